@@ -72,6 +72,18 @@ inline feaid_t DecodeFeaGrpID(feaid_t x, int nbits) {
   return x % (1 << nbits);
 }
 
+/**
+ * \brief mix the bits of a feature id
+ */
+inline uint64_t HashFeaID(feaid_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
 /** \brief get the role of this node */
 inline char* GetRole() { return getenv("DMLC_ROLE"); }
 /** \brief returns true if it is currently under distributed running */
@@ -41,9 +41,12 @@ class Learner {
   void Run() {
     if (!IsDistributed() || !strcmp(getenv("DMLC_ROLE"), "scheduler")) {
       RunScheduler();
+      // let the workers and servers exit
+      if (IsDistributed()) tracker_->Stop();
     } else {
       tracker_->Wait();
     }
+    SaveTrace();
   }
   /**
    * \brief Stop learner. It is often used to stop the training earlier
@@ -70,6 +73,11 @@ class Learner {
 
   /** \brief the job tracker */
   Tracker* tracker_;
+
+ private:
+  /** \brief write the trace events into trace_out_ if not empty */
+  void SaveTrace();
+  std::string trace_out_;
 };
 
 }  // namespace difacto
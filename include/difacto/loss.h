@@ -7,6 +7,8 @@
 #define DIFACTO_LOSS_H_
 #include <string>
 #include <vector>
+#include <memory>
+#include <mutex>
 #include "./base.h"
 #include "dmlc/data.h"
 #include "dmlc/omp.h"
@@ -14,9 +16,21 @@
 namespace difacto {
 /**
  * \brief the basic class of a loss function
+ *
+ * a loss object has no per-batch state, the scratch buffers of a batch, such
+ * as the intermediate results of \ref Predict needed by \ref CalcGrad, live
+ * in a \ref Workspace. so one loss object can serve many batches
+ * concurrently, each with its own workspace.
  */
 class Loss {
  public:
+  /**
+   * \brief the scratch buffers of a batch
+   */
+  class Workspace {
+   public:
+    virtual ~Workspace() { }
+  };
   /**
    * \brief the factory function
    * \param type the loss type such as "fm"
@@ -34,15 +48,38 @@ class Loss {
    * @return the unknown kwargs
    */
   virtual KWArgs Init(const KWArgs& kwargs) = 0;
+  /**
+   * \brief returns a workspace, reusing the ones released before. thread-safe
+   */
+  Workspace* GetWorkspace() {
+    std::lock_guard<std::mutex> lk(ws_mu_);
+    if (free_ws_.empty()) {
+      all_ws_.emplace_back(CreateWorkspace());
+      return all_ws_.back().get();
+    }
+    Workspace* ws = free_ws_.back();
+    free_ws_.pop_back();
+    return ws;
+  }
+  /**
+   * \brief returns a workspace back to the pool. thread-safe
+   */
+  void ReleaseWorkspace(Workspace* ws) {
+    std::lock_guard<std::mutex> lk(ws_mu_);
+    free_ws_.push_back(ws);
+  }
   /**
    * \brief predict given the data and model weights. often known as "forward"
    *
    * @param data the data
    * @param param model weights
+   * @param ws the workspace of this batch, which is then passed to
+   * \ref CalcGrad. can be nullptr for a loss without scratch state
    * @return pred the predict results
    */
   virtual void Predict(const dmlc::RowBlock<unsigned>& data,
                        const std::vector<SArray<char>>& param,
+                       Workspace* ws,
                        SArray<real_t>* pred) = 0;
   /**
    * \brief evaluate the loss
@@ -51,39 +88,44 @@ class Loss {
    *
    * @param label label
    * @param pred prediction
+   * @param weight optional example weights, 1 if nullptr
    *
    * @return the objective value
    */
   virtual real_t Evaluate(dmlc::real_t const* label,
-                          const SArray<real_t>& pred) const {
-    real_t objv = 0;
-#pragma omp parallel for reduction(+:objv) num_threads(nthreads_)
-    for (size_t i = 0; i < pred.size(); ++i) {
-      real_t y = label[i] > 0 ? 1 : -1;
-      objv += log(1 + exp(- y * pred[i]));
-    }
-    return objv;
-  }
+                          const SArray<real_t>& pred,
+                          dmlc::real_t const* weight = nullptr) const;
 
   /**
    * \brief calculate gradient given the data and model weights. often known as "backward"
    * @param data the data
    * @param param model weights
+   * @param ws the workspace passed to \ref Predict
    * @return grad the gradients
    */
   virtual void CalcGrad(const dmlc::RowBlock<unsigned>& data,
                         const std::vector<SArray<char>>& param,
+                        Workspace* ws,
                         SArray<real_t>* grad) = 0;
   /**
    * \brief set the number of threads
    */
   void set_nthreads(int nthreads) {
-    CHECK_GT(nthreads, 1); CHECK_LT(nthreads, 50);
+    CHECK_GE(nthreads, 1); CHECK_LT(nthreads, 1000);
     nthreads_ = nthreads;
   }
 
 
   int nthreads_;
+
+ protected:
+  /** \brief create a new workspace */
+  virtual Workspace* CreateWorkspace() { return new Workspace(); }
+
+ private:
+  std::mutex ws_mu_;
+  std::vector<std::unique_ptr<Workspace>> all_ws_;
+  std::vector<Workspace*> free_ws_;
 };
 }  // namespace difacto
 #endif  // DIFACTO_LOSS_H_
@@ -28,6 +28,16 @@ class NodeID {
   static int GetGroup(int id) {
     return (id % 8);
   }
+
+  /** \brief return the rank of a node id */
+  static int GetRank(int id) {
+    return id / 8 - 1;
+  }
+
+  /** \brief whether id is a (combined) group id rather than a node id */
+  static bool IsGroup(int id) {
+    return id < 8;
+  }
 };
 }  // namespace difacto
 
@@ -0,0 +1,97 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ * @file   scorer.h
+ * @brief  score single examples by a trained model, for online serving
+ */
+#ifndef DIFACTO_SCORER_H_
+#define DIFACTO_SCORER_H_
+#include <math.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "./base.h"
+namespace difacto {
+
+/**
+ * \brief scores examples one by one with an immutable snapshot of a model
+ *
+ * the features are indexed by an open addressing hash table, and the w and V
+ * of a feature are stored contiguously, so a feature costs about one cache
+ * miss. the features with w = 0 and no V are dropped, and a V quantized by
+ * the compact task stays in int8. scoring allocates nothing and takes no
+ * lock, so a scorer can be shared by any number of threads after \ref Load
+ *
+ * \code
+ * Scorer scorer;
+ * CHECK(scorer.Load("model"));
+ * feaid_t index[] = {3, 100, 1024};
+ * real_t prob = scorer.PredictProb(index, nullptr, 3);
+ * \endcode
+ *
+ * link with libdifacto_scorer.a and libdmlc.a
+ */
+class Scorer {
+ public:
+  Scorer() { }
+  ~Scorer() { }
+
+  /**
+   * \brief load a model saved by a training task, returns false if failed.
+   * it is not thread-safe
+   */
+  bool Load(const std::string& filename);
+
+  /** \brief the embedding dimension */
+  int V_dim() const { return V_dim_; }
+
+  /** \brief the number of features indexed */
+  size_t NumFeatures() const { return num_feas_; }
+
+  /** \brief the memory in bytes used by the snapshot */
+  size_t MemBytes() const {
+    return table_.size() * sizeof(Slot) + values_.size() * sizeof(real_t);
+  }
+
+  /**
+   * \brief returns the margin of an example, the same as the predict task
+   * with pred_prob=0
+   *
+   * @param index the feature ids as in the data files, in any order
+   * @param value the feature values, nullptr means all are 1
+   * @param nnz the number of features
+   */
+  real_t Predict(const feaid_t* index, const real_t* value, size_t nnz) const;
+
+  /** \brief returns the probability 1 / (1 + exp(-margin)) */
+  real_t PredictProb(const feaid_t* index, const real_t* value,
+                     size_t nnz) const {
+    return 1 / (1 + exp(-Predict(index, value, nnz)));
+  }
+
+ private:
+  /** \brief a slot of the hash table, len = 0 means empty */
+  struct Slot {
+    feaid_t key;
+    uint32_t pos;
+    uint32_t len;
+  };
+
+  /** \brief returns the slot of a model id, or nullptr if not exists */
+  const Slot* Find(feaid_t key) const;
+
+  int V_dim_ = 0;
+  /** \brief whether V is stored in int8 */
+  bool V_int8_ = false;
+  size_t num_feas_ = 0;
+  /** \brief the table size is a power of 2, at least twice of num_feas_ */
+  std::vector<Slot> table_;
+  uint64_t mask_ = 0;
+  /**
+   * \brief the w and then the V of the features. a int8 V is the scale
+   * followed by the packed V_dim bytes
+   */
+  std::vector<real_t> values_;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_SCORER_H_
@@ -31,6 +31,8 @@ class Store {
   static const int kFeaCount = 1;
   static const int kWeight = 2;
   static const int kGradient = 3;
+  /** \brief 1 if a feature is in the active set, 0 if screened out */
+  static const int kActive = 4;
   /**
    * \brief init
    *
@@ -79,6 +81,26 @@ class Store {
    */
   virtual void Wait(int time) = 0;
 
+  /**
+   * \brief advance the clock of this worker by one, which is called once the
+   * gradients of a batch are pushed. it is used by the stale synchronous
+   * parallel consistency of the distributed store, and a no-op in default
+   */
+  virtual void Clock() { }
+
+  /**
+   * \brief this worker has no more batches in the current job, so no worker
+   * waits for it, and its clock restarts by the next job
+   */
+  virtual void ResetClock() { }
+
+  /**
+   * \brief partition the feature ids over the servers by the given bounds,
+   * where server j owns [bounds[j], bounds[j+1]). it must be called on every
+   * worker and server before any request. a no-op in default
+   */
+  virtual void SetKeyRanges(const std::vector<feaid_t>& bounds) { }
+
   /**
    * \brief return number of workers
    */
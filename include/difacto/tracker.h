@@ -66,10 +66,25 @@ class Tracker {
    */
   virtual void Issue(const std::vector<std::pair<int, std::string>>& jobs) = 0;
 
+  /**
+   * \brief issue a job to every node in a group
+   *
+   * unlike \ref Issue, which sends a job to any one node in a group, every
+   * node gets a copy of this job and the monitor is called once per node.
+   *
+   * \param node_group the node group, e.g. kWorkerGroup + kServerGroup
+   * \param args the job arguments
+   */
+  virtual void Broadcast(int node_group, const std::string& args) = 0;
+
   /**
    * \brief return the number of unfinished job
    */
   virtual int NumRemains() = 0;
+  /**
+   * \brief block until the number of unfinished jobs is at most num_remains
+   */
+  virtual void WaitRemains(int num_remains = 0) = 0;
   /**
    * \brief clear all unfinished jobs
    *
@@ -67,6 +67,13 @@ class Updater {
                       int data_type,
                       const SArray<real_t>& data,
                       const SArray<int>& data_offset) = 0;
+
+  /**
+   * \brief whether the updates of a data type can be split by key ranges and
+   * applied concurrently, and the ones of the same id can be added up before
+   * being applied. false in default
+   */
+  virtual bool ConcurrentUpdate(int data_type) const { return false; }
 };
 
 }  // namespace difacto
@@ -4,10 +4,19 @@
 #include "./bcd_learner.h"
 #include <algorithm>
 #include <cmath>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 #include "difacto/node_id.h"
 #include "reader/reader.h"
 #include "loss/bin_class_metric.h"
 #include "./bcd_updater.h"
+#include "common/model_file.h"
+#include "common/reduce.h"
+#include "common/task_scheduler.h"
 namespace difacto {
 
 DMLC_REGISTER_PARAMETER(BCDUpdaterParam);
@@ -15,20 +24,33 @@ DMLC_REGISTER_PARAMETER(BCDUpdaterParam);
 KWArgs BCDLearner::Init(const KWArgs& kwargs) {
   auto remain = Learner::Init(kwargs);
   // init param
-  remain = param_.InitAllowUnknown(kwargs);
+  remain = param_.InitAllowUnknown(remain);
+  nthreads_ = param_.num_threads <= 0 ?
+              std::thread::hardware_concurrency() : param_.num_threads;
+  nthreads_ = std::max(nthreads_, 1);
   // init updater
-  std::shared_ptr<Updater> updater(new BCDUpdater());
+  auto updater = std::make_shared<BCDUpdater>();
   remain = updater->Init(remain);
+  V_dim_ = updater->param().V_dim;
+  if (V_dim_ > 0) {
+    CHECK_EQ(param_.tau, 0) << "tau > 0 is not supported with V_dim > 0";
+    CHECK_EQ(param_.active_set_interval, 0)
+        << "the active set is not supported with V_dim > 0";
+    remain.push_back(std::make_pair("V_dim", std::to_string(V_dim_)));
+  }
   // init model store
   model_store_ = Store::Create();
   model_store_->SetUpdater(updater);
   remain = model_store_->Init(remain);
   // init data stores
   tile_store_ = new TileStore();
+  remain.push_back(std::make_pair("data_cache", param_.data_cache));
   remain = tile_store_->Init(remain);
   // init loss
-  loss_ = Loss::Create("logit_delta", DEFAULT_NTHREADS);
+  loss_ = Loss::Create(V_dim_ > 0 ? "fm_delta" : "logit_delta", DEFAULT_NTHREADS);
   remain = loss_->Init(remain);
+  // a node reports at the end of every job, which is long enough
+  profiler_.Init(0);
   return remain;
 }
 
@@ -42,8 +64,24 @@ void BCDLearner::Process(const std::string& args, std::string* rets) {
   } else if (type == Job::kBuildFeatureMap) {
     BuildFeatureMap(job_args.feablk_ranges);
   } else if (type == Job::kIterateData) {
-    IterateData(job_args.feablks, &job_rets);
+    IterateData(job_args.feablks, job_args.epoch, &job_rets);
+  } else if (type == Job::kSaveModel || type == Job::kCheckpoint) {
+    auto filename = ModelName(param_.model_out, model_store_->Rank());
+    // the previous checkpoint is written first, it has the same filename
+    saver_.Wait();
+    if (type == Job::kCheckpoint) {
+      ModelFile model;
+      std::static_pointer_cast<BCDUpdater>(
+          model_store_->updater())->Snapshot(true, &model);
+      saver_.SaveAsync(std::move(model), filename);
+    } else {
+      auto updater = model_store_->updater();
+      ModelSaver::Write(filename, [updater](dmlc::Stream* fo) {
+          updater->Save(true, fo);
+        });
+    }
   }
+  profiler_.Flush();
   dmlc::Stream* ss = new dmlc::MemoryStringStream(rets);
   ss->Write(job_rets);
   delete ss;
@@ -55,78 +93,168 @@ void BCDLearner::RunScheduler() {
   Job load; load.type = Job::kPrepareData;
   std::vector<real_t> load_rets;
   IssueJobAndWait(NodeID::kWorkerGroup, load, &load_rets);
-  LOG(INFO) << "loaded " << load_rets.back() << " examples";
+  // see bcd::FeaGroupStats for the layout
+  int ngrp = 1 << param_.num_feature_group_bits;
+  real_t nrows = load_rets[ngrp];
+  LOG(INFO) << "loaded " << load_rets[ngrp+1] << " examples";
 
-  // partition feature group and build feature map
+  // partition feature group and build feature map. the number of blocks of a
+  // group is the nnz per example times block_ratio, and more if the tiles
+  // would be larger than block_tile_mb
   Job build; build.type = Job::kBuildFeatureMap;
   std::vector<std::pair<int, int>> feagrp;
-  int nfeablk = load_rets.size()-2;
-  for (int i = 0; i < nfeablk; ++i) {
-    int nblk = static_cast<int>(std::ceil(
-        load_rets[i] / load_rets[nfeablk] * param_.block_ratio));
+  real_t rowblk_size = load_rets[ngrp+1] / std::max(load_rets[ngrp+2], (real_t)1);
+  for (int i = 0; i < ngrp; ++i) {
+    real_t nnz_per_row = load_rets[i] / nrows;
+    int nblk = static_cast<int>(std::ceil(nnz_per_row * param_.block_ratio));
+    if (nblk > 0 && param_.block_tile_mb > 0) {
+      real_t tile_mb = nnz_per_row * rowblk_size *
+                       (sizeof(unsigned) + sizeof(real_t)) / 1e6;
+      nblk = std::max(nblk, static_cast<int>(
+          std::ceil(tile_mb / param_.block_tile_mb)));
+    }
     if (nblk > 0) feagrp.push_back(std::make_pair(i, nblk));
   }
   bcd::PartitionFeature(
-      param_.num_feature_group_bits, feagrp, &build.feablk_ranges);
+      param_.num_feature_group_bits, feagrp, load_rets.data() + ngrp + 3,
+      &build.feablk_ranges);
   LOG(INFO) << "partitioning feature into " << build.feablk_ranges.size() << " blocks";
   IssueJobAndWait(NodeID::kWorkerGroup, build);
 
   // iterate over data
   std::vector<int> feablks(build.feablk_ranges.size());
   for (size_t i = 0; i < feablks.size(); ++i) feablks[i] = i;
+  std::vector<real_t> decrease;
+  double last_ckpt = dmlc::GetTime();
   epoch_ = 0;
   for (; epoch_ < param_.max_num_epochs; ++epoch_) {
-    std::random_shuffle(feablks.begin(), feablks.end());
+    if (param_.random_block) std::random_shuffle(feablks.begin(), feablks.end());
+    if (param_.block_priority && decrease.size()) {
+      // the order of the blocks with the same decrease is kept random
+      std::stable_sort(feablks.begin(), feablks.end(),
+                       [&decrease](int a, int b) {
+                         return decrease[a] > decrease[b];
+                       });
+    }
     Job iter; iter.type = Job::kIterateData;
+    iter.epoch = epoch_;
     iter.feablks = feablks;
     std::vector<real_t> progress;
     IssueJobAndWait(NodeID::kWorkerGroup + NodeID::kServerGroup, iter, &progress);
+    if (progress.size() == 4 + feablks.size()) {
+      decrease.assign(progress.begin() + 4, progress.end());
+    }
     for (const auto& cb : epoch_end_callback_) {
       cb(epoch_, progress);
     }
+    if (param_.model_out.size() &&
+        CheckpointDue(epoch_, param_.checkpoint_epochs, param_.checkpoint_sec,
+                      &last_ckpt)) {
+      LOG(INFO) << "checkpointing model to " << param_.model_out;
+      Job ckpt; ckpt.type = Job::kCheckpoint;
+      IssueJobAndWait(NodeID::kServerGroup, ckpt);
+    }
     real_t cnt = progress[0];
     LL << "epoch: " << epoch_
        << ", objv: " << progress[1] / cnt
        << ", auc: " << progress[2] / cnt
        << ", acc: " << progress[3] / cnt;
+    if (DIFACTO_PROFILE) LL << " - profile: " << profiler_.Take().TextString();
+    if (!IsDistributed()) {
+      LL << " - memory: " << MemTracker::Get()->TextString();
+    }
+  }
+
+  // save the model
+  if (param_.model_out.size()) {
+    LOG(INFO) << "saving model to " << param_.model_out;
+    Job save; save.type = Job::kSaveModel;
+    IssueJobAndWait(NodeID::kServerGroup, save);
   }
 }
 
 
 void BCDLearner::PrepareData(std::vector<real_t>* fea_stats) {
-  // read train data
-  Reader train(param_.data_in, param_.data_format,
-               model_store_->Rank(), model_store_->NumWorkers(),
-               param_.data_chunk_size);
+  // the col format is read in the transposed layout directly, rather than
+  // being compacted and transposed by the tile builder
+  bool col = param_.data_format == "col";
   bcd::FeaGroupStats stats(param_.num_feature_group_bits);
-  tile_builder_ = new TileBuilder(tile_store_, DEFAULT_NTHREADS, true);
+  tile_builder_ = new TileBuilder(tile_store_, nthreads_, true);
   SArray<real_t> feacnts;
-  while (train.Next()) {
-    auto rowblk = train.Value();
-    stats.Add(rowblk);
-    tile_builder_->Add(rowblk, &feaids_, &feacnts);
-    pred_.push_back(SArray<real_t>(rowblk.size));
-    ++ntrain_blks_;
-  }
+  // the number of rows of each rowblk by its id, the sub-partitions add
+  // rowblks concurrently
+  std::vector<size_t> blk_rows;
+  std::mutex mu;
+  auto read = [&](const std::string& uri, bool train) {
+    auto read_part = [&](int part_index, int num_parts) {
+      std::unique_ptr<Reader> reader;
+      std::unique_ptr<ColumnarReader> col_reader;
+      if (col) {
+        col_reader.reset(new ColumnarReader(uri, part_index, num_parts));
+      } else {
+        reader.reset(new Reader(uri, param_.data_format, part_index,
+                                num_parts, param_.data_chunk_size));
+      }
+      bcd::FeaGroupStats part_stats(param_.num_feature_group_bits);
+      std::vector<std::pair<int, size_t>> blks;
+      ColumnarTile tile;
+      while (col ? col_reader->Next(&tile) : reader->Next()) {
+        size_t nrows;
+        int id;
+        if (col) {
+          nrows = tile.label.size();
+          if (train) part_stats.Add(tile);
+          id = train ? tile_builder_->Add(&tile, &feaids_, &feacnts) :
+               tile_builder_->Add(&tile);
+        } else {
+          auto rowblk = reader->Value();
+          nrows = rowblk.size;
+          if (train) part_stats.Add(rowblk);
+          id = train ? tile_builder_->Add(rowblk, &feaids_, &feacnts) :
+               tile_builder_->Add(rowblk);
+        }
+        blks.push_back(std::make_pair(id, nrows));
+      }
+      std::lock_guard<std::mutex> lk(mu);
+      stats.Merge(part_stats);
+      for (const auto& b : blks) {
+        if (blk_rows.size() <= static_cast<size_t>(b.first)) {
+          blk_rows.resize(b.first + 1);
+        }
+        blk_rows[b.first] = b.second;
+      }
+    };
+    ReadSubParts(model_store_->Rank(), model_store_->NumWorkers(),
+                 param_.num_data_parts, read_part);
+  };
+
+  // read train data
+  read(param_.data_in, true);
+  tile_builder_->Wait();
+  ntrain_blks_ = blk_rows.size();
   // push the feature ids and feature counts to the servers
   int t = model_store_->Push(
       feaids_, Store::kFeaCount, feacnts, SArray<int>());
   // report statistics to the scheduler
   stats.Get(fea_stats);
 
-  // read validation data if any
+  // read validation data if any, whose rowblks follow the train ones
   if (param_.data_val.size()) {
-    Reader val(param_.data_val, param_.data_format,
-               model_store_->Rank(), model_store_->NumWorkers(),
-               param_.data_chunk_size);
-    while (val.Next()) {
-      auto rowblk = val.Value();
-      tile_builder_->Add(rowblk);
-      pred_.push_back(SArray<real_t>(rowblk.size));
-      ++nval_blks_;
-    }
+    read(param_.data_val, false);
+    nval_blks_ = blk_rows.size() - ntrain_blks_;
+  }
+  for (size_t nrows : blk_rows) {
+    pred_.push_back(SArray<real_t>(nrows));
+    XV_.push_back(SArray<real_t>(nrows * V_dim_));
   }
 
+  pred_mu_.reset(new std::mutex[pred_.size()]);
+  size_t n = 0;
+  for (size_t i = 0; i < pred_.size(); ++i) {
+    n += pred_[i].size() + XV_[i].size();
+  }
+  scratch_mem_.Set(n * sizeof(real_t));
+
   // wait the previous push finished
   model_store_->Wait(t);
 }
@@ -166,20 +294,44 @@ void BCDLearner::BuildFeatureMap(const std::vector<Range>& feablk_ranges) {
     bcd::Delta::Init(feablk.feaids.size(), &feablk.delta);
     feablk.pos = pos[i];
   }
+
+  // V is initialized randomly by the servers, so pull it before computing
+  // any gradient. the servers return the changes from zero
+  if (V_dim_ == 0) return;
+  std::vector<SArray<real_t>> values(feablks_.size());
+  std::vector<SArray<int>> lens(feablks_.size());
+  std::vector<int> ts;
+  for (size_t i = 0; i < feablks_.size(); ++i) {
+    if (feablks_[i].feaids.empty()) continue;
+    ts.push_back(model_store_->Pull(
+        feablks_[i].feaids, Store::kWeight, &values[i], &lens[i]));
+  }
+  for (int t : ts) model_store_->Wait(t);
+  for (size_t i = 0; i < feablks_.size(); ++i) {
+    if (feablks_[i].feaids.empty()) continue;
+    auto& feablk = feablks_[i];
+    LensToOffsets(lens[i], &feablk.model_offset);
+    feablk.model.resize(values[i].size(), 0);
+    UpdtFeablk(i, feablk.model_offset, values[i], nullptr);
+  }
 }
 
-void BCDLearner::IterateData(const std::vector<int>& feablks,
+void BCDLearner::IterateData(const std::vector<int>& feablks, int epoch,
                              std::vector<real_t>* progress) {
   CHECK(feablks.size());
+  // the first epoch is always a full pass, which pulls the active set
+  int interval = param_.active_set_interval;
+  use_active_set_ = interval > 0 && epoch % interval != 0;
   // hint for data prefetch
   for (int f : feablks) {
+    if (ActiveFeaids(feablks_[f]).empty()) continue;
     for (int d = 0; d < ntrain_blks_ + nval_blks_; ++d) {
       tile_store_->Prefetch(d, f);
     }
   }
 
   size_t nfeablk = feablks.size();
-  int tau = 0;
+  int tau = param_.tau;
   bcd::BlockTracker feablk_tracker(nfeablk);
   for (size_t i = 0; i < nfeablk; ++i) {
     auto on_complete = [&feablk_tracker, i]() {
@@ -191,6 +343,42 @@ void BCDLearner::IterateData(const std::vector<int>& feablks,
     if (i >= tau) feablk_tracker.Wait(i - tau);
   }
   for (int i = nfeablk - tau; i < nfeablk ; ++i) feablk_tracker.Wait(i);
+
+  // report the decrease of each feature block after the metrics
+  if (progress->size() < 4) progress->resize(4);
+  for (const auto& feablk : feablks_) progress->push_back(feablk.decrease);
+
+  // the next epoch uses the active set found by this full pass
+  if (interval > 0 && !use_active_set_ && (epoch + 1) % interval != 0) {
+    PullActiveSet();
+  }
+}
+
+void BCDLearner::PullActiveSet() {
+  std::vector<SArray<real_t>> active(feablks_.size());
+  std::vector<int> ts;
+  for (size_t i = 0; i < feablks_.size(); ++i) {
+    if (feablks_[i].feaids.empty()) continue;
+    ts.push_back(model_store_->Pull(
+        feablks_[i].feaids, Store::kActive, &active[i], nullptr));
+  }
+  for (int t : ts) model_store_->Wait(t);
+
+  for (size_t i = 0; i < feablks_.size(); ++i) {
+    auto& feablk = feablks_[i];
+    size_t n = feablk.feaids.size();
+    CHECK_EQ(active[i].size(), n);
+    feablk.active_feaids.clear();
+    feablk.active_pos.resize(n);
+    for (size_t j = 0; j < n; ++j) {
+      if (active[i][j] != 0) {
+        feablk.active_pos[j] = feablk.active_feaids.size();
+        feablk.active_feaids.push_back(feablk.feaids[j]);
+      } else {
+        feablk.active_pos[j] = -1;
+      }
+    }
+  }
 }
 
 void BCDLearner::IterateFeablk(int blk_id,
@@ -198,50 +386,152 @@ void BCDLearner::IterateFeablk(int blk_id,
                                std::vector<real_t>* progress) {
   // 1. calculate gradient
   auto& feablk = feablks_[blk_id];
-  SArray<int> grad_offset = feablk.model_offset;
-  for (int& o : grad_offset) o += o;  // it's ok to overwrite model_offset_[blk_id]
-  SArray<real_t> grad(
-      grad_offset.empty() ? feablk.feaids.size() * 2 : grad_offset.back());
-  for (int i = 0; i < ntrain_blks_; ++i) {
-    CalcGrad(i, blk_id, grad_offset, &grad);
+  SArray<feaid_t> feaids = ActiveFeaids(feablk);
+  if (feaids.empty()) {
+    // all features are screened out, nothing changes
+    feablk.decrease = 0;
+    if (progress) UpdtFeablk(blk_id, SArray<int>(), SArray<real_t>(), progress);
+    on_complete();
+    return;
   }
+  // a (gradient, hessian) pair for each value of w and V
+  SArray<int> offset = use_active_set_ ? SArray<int>() : feablk.model_offset;
+  size_t n = (offset.empty() ? feaids.size() : offset.back()) * 2;
+  SArray<int> grad_len;
+  for (size_t k = 0; k + 1 < offset.size(); ++k) {
+    grad_len.push_back((offset[k+1] - offset[k]) * 2);
+  }
+  SArray<real_t> grad(n);
+  // the row blocks are processed by ntasks tasks in parallel, each adds into
+  // its own gradients, which are summed before pushing
+  int ntasks = std::max(1, std::min(ntrain_blks_, nthreads_));
+  loss_->set_nthreads(PartitionThreads(nthreads_, ntasks));
+  std::vector<SArray<real_t>> grads(ntasks);
+  grads[0] = grad;
+  ParallelForNodes(0, ntrain_blks_, ntasks,
+                   [this, blk_id, n, &offset, &grads](int tid, int i) {
+        if (grads[tid].empty()) grads[tid].resize(n);
+        CalcGrad(i, blk_id, offset, &grads[tid]);
+      });
+  std::vector<real_t*> bufs;
+  for (auto& g : grads) if (g.size()) bufs.push_back(g.data());
+  Reduce(bufs, n, nthreads_);
 
   // 3. once push is done, pull the changes for the weights
   // this callback will be called when the push is finished
-  auto push_callback = [this, blk_id, progress, on_complete]() {
+  auto push_callback = [this, blk_id, feaids, grad, progress, on_complete]() {
     // must use pointer here, since it may be reallocated by model_store_
     SArray<real_t>* delta_w = new SArray<real_t>();
-    SArray<int>* delta_w_offset = new SArray<int>();
+    SArray<int>* delta_w_len = new SArray<int>();
     // 4. once the pull is done, update the prediction
     // the callback will be called when the pull is finished
-    auto pull_callback = [this, blk_id, delta_w, delta_w_offset, progress, on_complete]() {
-      feablks_[blk_id].model_offset = *delta_w_offset;
-      for (int i = 0; i < ntrain_blks_ + nval_blks_; ++i) {
-        UpdtPred(i, blk_id, *delta_w_offset, *delta_w, progress);
+    auto pull_callback = [this, blk_id, feaids, grad, delta_w,
+                          delta_w_len, progress, on_complete]() {
+      // the decrease by the quadratic approximation g*d + .5*h*d^2, which is
+      // linear on the gradients. the l1 penalty is ignored
+      CHECK_EQ(grad.size(), delta_w->size() * 2);
+      real_t dec = 0;
+      for (size_t k = 0; k < delta_w->size(); ++k) {
+        real_t d = (*delta_w)[k];
+        dec -= grad[k*2] * d + .5 * grad[k*2+1] * d * d;
       }
+      feablks_[blk_id].decrease = dec;
+      SArray<int> offset;
+      LensToOffsets(*delta_w_len, &offset);
+      if (!use_active_set_) feablks_[blk_id].model_offset = offset;
+      UpdtFeablk(blk_id, offset, *delta_w, progress);
       delete delta_w;
-      delete delta_w_offset;
+      delete delta_w_len;
       on_complete();
     };
     // pull the changes of w from the servers
     model_store_->Pull(
-        feablks_[blk_id].feaids, Store::kWeight, delta_w, delta_w_offset, pull_callback);
+        feaids, Store::kWeight, delta_w, delta_w_len, pull_callback);
   };
   // 2. push gradient to the servers
   model_store_->Push(
-      feablk.feaids, Store::kGradient, grad, grad_offset, push_callback);
+      feaids, Store::kGradient, grad, grad_len, push_callback);
+}
+
+void BCDLearner::UpdtFeablk(int blk_id,
+                            const SArray<int>& delta_w_offset,
+                            const SArray<real_t>& delta_w,
+                            std::vector<real_t>* progress) {
+  UpdtDelta(blk_id, delta_w_offset, delta_w);
+  // each row block updates its own pred_, so they run in parallel
+  int nblks = ntrain_blks_ + nval_blks_;
+  int ntasks = std::max(1, std::min(nblks, nthreads_));
+  std::vector<std::vector<real_t>> progs(ntasks);
+  ParallelForNodes(0, nblks, ntasks,
+                   [this, blk_id, &delta_w, &delta_w_offset, progress, &progs](
+                       int tid, int i) {
+        UpdtPred(i, blk_id, delta_w_offset, delta_w,
+                 progress ? &progs[tid] : nullptr);
+      });
+  if (progress) {
+    for (const auto& p : progs) {
+      if (progress->size() < p.size()) progress->resize(p.size());
+      for (size_t k = 0; k < p.size(); ++k) (*progress)[k] += p[k];
+    }
+  }
+  // the weights are used by the V of the next round
+  if (V_dim_ > 0 && delta_w.size()) {
+    auto& model = feablks_[blk_id].model;
+    CHECK_EQ(model.size(), delta_w.size());
+    for (size_t k = 0; k < model.size(); ++k) model[k] += delta_w[k];
+  }
+}
+
+void BCDLearner::LensToOffsets(const SArray<int>& lens, SArray<int>* offsets) {
+  offsets->clear();
+  if (lens.empty()) return;
+  offsets->resize(lens.size() + 1);
+  (*offsets)[0] = 0;
+  for (size_t k = 0; k < lens.size(); ++k) {
+    (*offsets)[k+1] = (*offsets)[k] + lens[k];
+  }
+}
+
+void BCDLearner::WVPos(const Tile& tile, const FeaBlk& feablk,
+                       const SArray<int>& offset,
+                       SArray<int>* w_pos, SArray<int>* V_pos) {
+  size_t n = tile.colmap.size();
+  w_pos->resize(n);
+  V_pos->resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    int map = tile.colmap[i];
+    if (map < 0) {
+      (*w_pos)[i] = -1;
+      (*V_pos)[i] = -1;
+    } else {
+      map -= feablk.pos.begin; CHECK_GE(map, 0);
+      (*w_pos)[i] = offset[map];
+      (*V_pos)[i] = offset[map+1] - offset[map] > 1 ? offset[map] + 1 : -1;
+    }
+  }
 }
 
 
 void BCDLearner::CalcGrad(int rowblk_id, int colblk_id,
-                          const SArray<int>& grad_offset,
+                          const SArray<int>& model_offset,
                           SArray<real_t>* grad) {
   // load data
   Tile tile; tile_store_->Fetch(rowblk_id, colblk_id, &tile);
+  if (V_dim_ > 0) {
+    CHECK_EQ(tile.packed.size(), 0) << "packed tiles are not supported with V_dim > 0";
+    SArray<int> w_pos, V_pos;
+    WVPos(tile, feablks_[colblk_id], model_offset, &w_pos, &V_pos);
+    std::vector<SArray<char>> param = {
+      SArray<char>(pred_[rowblk_id]), SArray<char>(XV_[rowblk_id]),
+      SArray<char>(feablks_[colblk_id].model),
+      SArray<char>(w_pos), SArray<char>(V_pos)};
+    loss_->CalcGrad(tile.data.GetBlock(), param, nullptr, grad);
+    return;
+  }
 
   // build index
   size_t n = tile.colmap.size();
-  bool no_os = grad_offset.empty();
+  bool no_os = model_offset.empty();
   SArray<int> grad_pos(n);
   SArray<real_t> delta(n);
   auto& feablk = feablks_[colblk_id];
@@ -252,14 +542,42 @@ void BCDLearner::CalcGrad(int rowblk_id, int colblk_id,
       grad_pos[i] = -1;
     } else {
       map -= pos_begin; CHECK_GE(map, 0);
-      grad_pos[i] = no_os ? map * 2 : grad_offset[map] * 2;
+      int p = ActivePos(feablk, map);
+      grad_pos[i] = p < 0 ? -1 : (no_os ? p : model_offset[p]) * 2;
       delta[i] = feablk.delta[map];
     }
   }
 
-  // calc grad
-  loss_->CalcGrad(tile.data.GetBlock(), {SArray<char>(pred_[rowblk_id]),
-          SArray<char>(grad_pos), SArray<char>(delta)}, grad);
+  // the prediction may be updated by the other feature blocks if tau > 0
+  SArray<real_t> pred = pred_[rowblk_id];
+  if (param_.tau > 0) {
+    std::lock_guard<std::mutex> lk(pred_mu_[rowblk_id]);
+    pred.CopyFrom(pred_[rowblk_id]);
+  }
+
+  // calc grad, logit_delta needs no workspace
+  std::vector<SArray<char>> param = {SArray<char>(pred),
+                                     SArray<char>(grad_pos), SArray<char>(delta)};
+  if (tile.packed.size()) {
+    static_cast<LogitLossDelta*>(loss_)->CalcGrad(tile.packed, param, grad);
+  } else {
+    loss_->CalcGrad(tile.data.GetBlock(), param, nullptr, grad);
+  }
+}
+
+void BCDLearner::UpdtDelta(int colblk_id,
+                           const SArray<int>& delta_w_offset,
+                           const SArray<real_t>& delta_w) {
+  // the update only depends on delta_w, so it is done once here rather than
+  // by every row block containing the feature
+  auto& feablk = feablks_[colblk_id];
+  bool no_os = delta_w_offset.empty();
+  for (size_t map = 0; map < feablk.delta.size(); ++map) {
+    int p = ActivePos(feablk, map);
+    if (p < 0) continue;
+    if (!no_os) p = delta_w_offset[p];
+    bcd::Delta::Update(delta_w[p], &feablk.delta[map]);
+  }
 }
 
 void BCDLearner::UpdtPred(int rowblk_id, int colblk_id,
@@ -271,10 +589,22 @@ void BCDLearner::UpdtPred(int rowblk_id, int colblk_id,
   tile_store_->Fetch(rowblk_id, colblk_id, &tile);
   size_t n = tile.colmap.size();
 
-  // build index and update delta_
+  auto& feablk = feablks_[colblk_id];
+  if (V_dim_ > 0) {
+    CHECK_EQ(tile.packed.size(), 0) << "packed tiles are not supported with V_dim > 0";
+    SArray<int> w_pos, V_pos;
+    WVPos(tile, feablk, delta_w_offset, &w_pos, &V_pos);
+    std::vector<SArray<char>> param = {
+      SArray<char>(delta_w), SArray<char>(w_pos), SArray<char>(V_pos),
+      SArray<char>(feablk.model), SArray<char>(XV_[rowblk_id])};
+    loss_->Predict(tile.data.GetBlock(), param, nullptr, &pred_[rowblk_id]);
+    Evaluate(tile, pred_[rowblk_id], progress);
+    return;
+  }
+
+  // build index
   bool no_os = delta_w_offset.empty();
   SArray<int> w_pos(n);
-  auto& feablk = feablks_[colblk_id];
   int pos_begin = feablk.pos.begin;
   for (size_t i = 0; i < n; ++i) {
     int map = tile.colmap[i];
@@ -282,22 +612,39 @@ void BCDLearner::UpdtPred(int rowblk_id, int colblk_id,
       w_pos[i] = -1;
     } else {
       map -= pos_begin; CHECK_GE(map, 0);
-      w_pos[i] = no_os ? map : delta_w_offset[map];
-      bcd::Delta::Update(delta_w[w_pos[i]], &feablk.delta[map]);
+      int p = ActivePos(feablk, map);
+      w_pos[i] = p < 0 ? -1 : (no_os ? p : delta_w_offset[p]);
     }
   }
 
-  // predict
-  loss_->Predict(tile.data.GetBlock(),
-                 {SArray<char>(delta_w), SArray<char>(w_pos)},
-                 &pred_[rowblk_id]);
+  // predict. if tau > 0, the changes are computed aside and then added
+  // under the lock, since other feature blocks may use pred_ meanwhile. no
+  // lock is held by the parallel kernels, whose threads may run other tasks
+  SArray<real_t> pred = pred_[rowblk_id];
+  if (param_.tau > 0) pred = SArray<real_t>(pred_[rowblk_id].size());
+  std::vector<SArray<char>> param = {SArray<char>(delta_w), SArray<char>(w_pos)};
+  if (tile.packed.size()) {
+    static_cast<LogitLossDelta*>(loss_)->Predict(tile.packed, param, &pred);
+  } else {
+    loss_->Predict(tile.data.GetBlock(), param, nullptr, &pred);
+  }
+  if (param_.tau > 0) {
+    std::lock_guard<std::mutex> lk(pred_mu_[rowblk_id]);
+    real_t* p = pred_[rowblk_id].data();
+    for (size_t j = 0; j < pred.size(); ++j) p[j] += pred[j];
+    if (progress) pred.CopyFrom(pred_[rowblk_id]);
+  }
+
+  Evaluate(tile, pred, progress);
+}
 
-  // evaluate
+void BCDLearner::Evaluate(const Tile& tile, const SArray<real_t>& pred,
+                          std::vector<real_t>* progress) {
   if (!progress) return;
-  CHECK_EQ(tile.data.label.size(), pred_[rowblk_id].size());
-  BinClassMetric metric(tile.data.label.data(),
-                        pred_[rowblk_id].data(),
-                        pred_[rowblk_id].size());
+  CHECK_EQ(tile.data.label.size(), pred.size());
+  BinClassStats stats;
+  stats.Add(tile.data.label.data(), pred.data(), pred.size(),
+            BinClassStats::kMaxAUCBins, .5);
 
   // value[0] : count
   // value[1] : objv
@@ -307,9 +654,9 @@ void BCDLearner::UpdtPred(int rowblk_id, int colblk_id,
   auto& val = *progress;
   if (val.empty()) val.resize(4);
   val[0] += tile.data.label.size();
-  val[1] += metric.LogitObjv();
-  val[2] += metric.AUC();
-  val[3] += metric.Accuracy(.5);
+  val[1] += stats.objv;
+  val[2] += stats.AUC() * stats.count;
+  val[3] += stats.correct;
 }
 
 }  // namespace difacto
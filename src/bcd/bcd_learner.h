@@ -5,12 +5,17 @@
 #define DIFACTO_BCD_BCD_LEARNER_H_
 #include <vector>
 #include <string>
+#include <memory>
+#include <mutex>
 #include "difacto/learner.h"
 #include "difacto/store.h"
 #include "data/data_store.h"
 #include "data/tile_store.h"
 #include "data/tile_builder.h"
 #include "common/learner_utils.h"
+#include "common/mem_tracker.h"
+#include "common/model_saver.h"
+#include "reporter/profile_reporter.h"
 #include "./bcd_param.h"
 #include "./bcd_utils.h"
 #include "loss/logit_loss_delta.h"
@@ -47,7 +52,11 @@ class BCDLearner : public Learner {
 
   void BuildFeatureMap(const std::vector<Range>& feablk_ranges);
 
-  void IterateData(const std::vector<int>& feablks, std::vector<real_t>* progress);
+  void IterateData(const std::vector<int>& feablks, int epoch,
+                   std::vector<real_t>* progress);
+
+  /** \brief pull the active set of each feature block from the servers */
+  void PullActiveSet();
 
   /**
    * \brief iterate a feature block
@@ -75,8 +84,14 @@ class BCDLearner : public Learner {
                      const std::function<void()>& on_complete,
                      std::vector<real_t>* progress);
 
+  /** \brief update the deltas and the predictions after pulling delta_w */
+  void UpdtFeablk(int blk_id,
+                  const SArray<int>& delta_w_offset,
+                  const SArray<real_t>& delta_w,
+                  std::vector<real_t>* progress);
+
   void CalcGrad(int rowblk_id, int colblk_id,
-                const SArray<int>& grad_offset,
+                const SArray<int>& model_offset,
                 SArray<real_t>* grad);
 
   void UpdtPred(int rowblk_id, int colblk_id,
@@ -84,10 +99,26 @@ class BCDLearner : public Learner {
                 const SArray<real_t> delta_w,
                 std::vector<real_t>* progress);
 
+  /** \brief the prediction metrics of a tile */
+  void Evaluate(const Tile& tile, const SArray<real_t>& pred,
+                std::vector<real_t>* progress);
+
+  /** \brief convert the lengths returned by the store into prefix offsets */
+  static void LensToOffsets(const SArray<int>& lens, SArray<int>* offsets);
+
+  /** \brief update the deltas of a feature block given the changes of w */
+  void UpdtDelta(int colblk_id,
+                 const SArray<int>& delta_w_offset,
+                 const SArray<real_t>& delta_w);
+
   /** \brief the current epoch */
   int epoch_ = 0;
+  /** \brief the number of threads, shared by the row blocks */
+  int nthreads_ = 1;
   int ntrain_blks_ = 0;
   int nval_blks_ = 0;
+  /** \brief the embedding dimension, 0 for the linear model */
+  int V_dim_ = 0;
 
   /** \brief the model store*/
   Store* model_store_ = nullptr;
@@ -105,13 +136,64 @@ class BCDLearner : public Learner {
     SArray<feaid_t> feaids;
     Range pos;
     SArray<real_t> delta;
+    /**
+     * \brief the values of feature k are [model_offset[k], model_offset[k+1]),
+     * empty if each feature has only w
+     */
     SArray<int> model_offset;
+    /** \brief w and V of the features, only kept if V_dim > 0 */
+    SArray<real_t> model;
+    /** \brief the features in the active set, empty if none */
+    SArray<feaid_t> active_feaids;
+    /**
+     * \brief the position in active_feaids of each feature, -1 if screened
+     * out, empty if the active set is not pulled yet
+     */
+    SArray<int> active_pos;
+    /**
+     * \brief the decrease of the objective by the last update, estimated by
+     * the local gradients, so summing over workers gives the total
+     */
+    real_t decrease = 0;
   };
+
+  /**
+   * \brief the position of the map-th feature of a block among the pushed
+   * features, -1 if it is skipped by the active set
+   */
+  int ActivePos(const FeaBlk& feablk, int map) const {
+    return use_active_set_ ? feablk.active_pos[map] : map;
+  }
+  /** \brief the features pushed and pulled for a block */
+  const SArray<feaid_t>& ActiveFeaids(const FeaBlk& feablk) const {
+    return use_active_set_ ? feablk.active_feaids : feablk.feaids;
+  }
+  /** \brief the positions of w and V of each column of a tile, V_dim > 0 */
+  void WVPos(const Tile& tile, const FeaBlk& feablk,
+             const SArray<int>& offset,
+             SArray<int>* w_pos, SArray<int>* V_pos);
+
+  /** \brief whether or not the current epoch only processes the active set */
+  bool use_active_set_ = false;
   std::vector<FeaBlk> feablks_;
 
   SArray<feaid_t> feaids_;
 
   std::vector<SArray<real_t>> pred_;
+  /** \brief X * V of each row block, row major, only used if V_dim > 0 */
+  std::vector<SArray<real_t>> XV_;
+  /** \brief accounts pred_ and XV_ */
+  MemGauge scratch_mem_{MemTracker::kScratch};
+  /**
+   * \brief the locks of pred_, used if tau > 0, when several feature blocks
+   * may read and update the same pred_[i] at the same time
+   */
+  std::unique_ptr<std::mutex[]> pred_mu_;
+
+  /** \brief writes the checkpoints in background */
+  ModelSaver saver_;
+  /** \brief the hot path profile, if compiled with PROFILE=1 */
+  ProfileReporter profiler_;
 
   std::vector<std::function<void(
       int epoch, const std::vector<real_t> & prog)>> epoch_end_callback_;
@@ -14,10 +14,20 @@ struct BCDLearnerParam : public dmlc::Parameter<BCDLearnerParam> {
   std::string data_val;
   /** \brief the data format. default is libsvm */
   std::string data_format;
-  /** \brief the directory for the data chache */
+  /** \brief the prefix of the data cache files, see TileStoreParam */
   std::string data_cache;
   /** \brief the model output for a training task */
   std::string model_out;
+  /**
+   * \brief save a checkpoint into model_out every checkpoint_epochs epochs,
+   * 0 means never. the model is written in background by the servers
+   */
+  int checkpoint_epochs;
+  /**
+   * \brief also save a checkpoint if these seconds passed since the last
+   * one, 0 means never
+   */
+  int checkpoint_sec;
   /** \brief the model input for warm start */
   std::string model_in;
   /** \brief type of loss, defaut is fm*/
@@ -28,11 +38,48 @@ struct BCDLearnerParam : public dmlc::Parameter<BCDLearnerParam> {
   float block_ratio;
   /** \brief if or not process feature blocks in a random order, default is true */
   int random_block;
+  /**
+   * \brief if or not process the feature blocks decreasing the objective the
+   * most in the previous epoch first, default is false
+   */
+  int block_priority;
+  /**
+   * \brief the target size in MB of a tile, namely a feature block of a row
+   * block. the feature blocks are divided further if their tiles are
+   * estimated larger. default is 0, no limit
+   */
+  float block_tile_mb;
   /** \brief the number of heading bits used to encode the feature group, default is 12 */
   int num_feature_group_bits;
   float neg_sampling;
   /** \brief the size of data in MB read each time for processing, in default 256 MB */
   int data_chunk_size;
+  /**
+   * \brief the sub-partitions of the data of a worker, which are read and
+   * parsed concurrently. default is 1
+   */
+  int num_data_parts;
+  /**
+   * \brief the maximal delay of the feature blocks, default is 0.
+   *
+   * the gradient of feature block i is computed once block i - tau - 1 is
+   * finished, so it overlaps the communication and the prediction updates
+   * of the tau blocks before it
+   */
+  int tau;
+  /** \brief the number of threads, 0 means the number of cores */
+  int num_threads;
+  /**
+   * \brief the epochs between two full passes, default is 0, which disables
+   * the active set.
+   *
+   * a full pass processes all features, and the servers screen out the zero
+   * weights whose gradients are small, see
+   * BCDUpdaterParam::active_set_ratio. the other epochs only process the
+   * features kept by the last full pass, and skip the feature blocks without
+   * any of them
+   */
+  int active_set_interval;
 
   DMLC_DECLARE_PARAMETER(BCDLearnerParam) {
     DMLC_DECLARE_FIELD(data_format).set_default("libsvm");
@@ -40,13 +87,21 @@ struct BCDLearnerParam : public dmlc::Parameter<BCDLearnerParam> {
     DMLC_DECLARE_FIELD(data_val).set_default("");
     DMLC_DECLARE_FIELD(data_cache).set_default("/tmp/difacto_bcd_");
     DMLC_DECLARE_FIELD(data_chunk_size).set_default(1<<28);
+    DMLC_DECLARE_FIELD(num_data_parts).set_range(1, 64).set_default(1);
     DMLC_DECLARE_FIELD(model_out).set_default("");
+    DMLC_DECLARE_FIELD(checkpoint_epochs).set_lower_bound(0).set_default(0);
+    DMLC_DECLARE_FIELD(checkpoint_sec).set_lower_bound(0).set_default(0);
     DMLC_DECLARE_FIELD(model_in).set_default("");
     DMLC_DECLARE_FIELD(loss).set_default("fm");
     DMLC_DECLARE_FIELD(max_num_epochs).set_default(20);
     DMLC_DECLARE_FIELD(random_block).set_default(1);
+    DMLC_DECLARE_FIELD(block_priority).set_default(0);
+    DMLC_DECLARE_FIELD(block_tile_mb).set_default(0).set_lower_bound(0);
     DMLC_DECLARE_FIELD(num_feature_group_bits).set_default(0);
     DMLC_DECLARE_FIELD(block_ratio).set_default(4);
+    DMLC_DECLARE_FIELD(tau).set_default(0).set_lower_bound(0);
+    DMLC_DECLARE_FIELD(num_threads).set_default(0);
+    DMLC_DECLARE_FIELD(active_set_interval).set_default(0).set_lower_bound(0);
   }
 };
 }  // namespace difacto
@@ -3,53 +3,188 @@
  */
 #ifndef DIFACTO_BCD_BCD_UPDATER_H_
 #define DIFACTO_BCD_BCD_UPDATER_H_
+#include <stdlib.h>
+#include <string.h>
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <cmath>
 #include <limits>
 #include "difacto/updater.h"
 #include "dmlc/parameter.h"
 #include "dmlc/io.h"
 #include "difacto/store.h"
+#include "common/count_min_sketch.h"
 #include "common/find_position.h"
 #include "common/kv_match.h"
 #include "common/kv_union.h"
+#include "common/mem_tracker.h"
+#include "common/model_file.h"
 #include "./bcd_utils.h"
 namespace difacto {
 
 struct BCDUpdaterParam : public dmlc::Parameter<BCDUpdaterParam> {
-  int V_dim = 0;
+  /** \brief the embedding dimension, 0 means a linear model */
+  int V_dim;
   int tail_feature_filter;
 
   /** \brief the l1 regularizer for :math:`w`: :math:`\lambda_1 |w|_1` */
   float l1;
   /** \brief the l2 regularizer for :math:`w`: :math:`\lambda_2 \|w\|_2^2` */
   float l2;
+  /** \brief the l2 regularizer for :math:`V`: :math:`\lambda_2 \|V_i\|_2^2` */
+  float V_l2;
   /** \brief the learning rate :math:`\eta` (or :math:`\alpha`) for :math:`w` */
   float lr;
+  /** \brief the learning rate :math:`\eta` for :math:`V` */
+  float V_lr;
+  /**
+   * \brief the scale to initialize V.
+   * namely V is initialized by uniform random number in
+   *   [-V_init_scale/2, +V_init_scale/2]
+   */
+  float V_init_scale;
+  /** \brief the minimal feature count for allocating V */
+  int V_threshold;
+  /** \brief random seed */
+  unsigned int seed;
+  /**
+   * \brief a zero weight is screened out from the active set if its gradient
+   * satisfies :math:`|g| < ratio * \lambda_1`, see BCDLearnerParam::active_set_interval
+   */
+  float active_set_ratio;
+  /**
+   * \brief if positive, the feature counts for tail_feature_filter and
+   * V_threshold are estimated by a count-min sketch of this memory in MB,
+   * instead of being kept per feature. in default 0
+   */
+  float feacnt_sketch_mb;
 
   DMLC_DECLARE_PARAMETER(BCDUpdaterParam) {
+    DMLC_DECLARE_FIELD(V_dim).set_default(0).set_range(0, 10000);
     DMLC_DECLARE_FIELD(tail_feature_filter).set_default(4);
     DMLC_DECLARE_FIELD(l1).set_default(1);
     DMLC_DECLARE_FIELD(l2).set_default(.01);
+    DMLC_DECLARE_FIELD(V_l2).set_default(.01);
     DMLC_DECLARE_FIELD(lr).set_default(.9);
+    DMLC_DECLARE_FIELD(V_lr).set_default(.9);
+    DMLC_DECLARE_FIELD(V_init_scale).set_range(0, 10).set_default(.01);
+    DMLC_DECLARE_FIELD(V_threshold).set_default(0);
+    DMLC_DECLARE_FIELD(seed).set_default(0);
+    DMLC_DECLARE_FIELD(active_set_ratio).set_default(.5).set_range(0, 1);
+    DMLC_DECLARE_FIELD(feacnt_sketch_mb).set_lower_bound(0).set_default(0);
   }
 };
 
+/**
+ * \brief the updater of BCD
+ *
+ * if V_dim > 0, a feature has w and optionally V, which are stored together,
+ * the values of the i-th feature are weights_[offsets_[i], offsets_[i+1]).
+ * \ref Get returns the changes of the values with their lengths, and \ref
+ * Update expects a (gradient, diagonal hessian) pair for each value
+ */
 class BCDUpdater : public Updater {
  public:
-  BCDUpdater() { }
+  BCDUpdater()
+      : model_mem_(MemTracker::kModel), aux_mem_(MemTracker::kAux) { }
   virtual ~BCDUpdater() { }
 
   KWArgs Init(const KWArgs& kwargs) override {
-    return param_.InitAllowUnknown(kwargs);
+    auto remain = param_.InitAllowUnknown(kwargs);
+    if (param_.feacnt_sketch_mb > 0) {
+      feacnt_sketch_.Init(std::max<size_t>(
+          param_.feacnt_sketch_mb * 1024 * 1024 / sizeof(uint16_t) / 4, 1));
+    }
+    return remain;
   }
 
   const BCDUpdaterParam& param() const { return param_; }
 
-  void Load(dmlc::Stream* fi, bool* has_aux) override {}
+  void Load(dmlc::Stream* fi, bool* has_aux) override {
+    ModelFile model;
+    model.Load(fi);
+    CHECK_EQ(model.V_dim, param_.V_dim);
+    feaids_ = model.feaids;
+    feacnt_.clear();
+    size_t n = feaids_.size();
+    bool aux = model.aux_w.size() == 1;
+    if (param_.V_dim == 0) {
+      weights_ = model.w;
+      w_delta_.resize(n, 0);
+      if (aux) {
+        delta_ = model.aux_w[0];
+      } else {
+        bcd::Delta::Init(n, &delta_);
+      }
+    } else {
+      int V_dim = param_.V_dim;
+      offsets_.resize(n+1); offsets_[0] = 0;
+      for (size_t i = 0; i < n; ++i) {
+        offsets_[i+1] = offsets_[i] + 1 + (model.GetV(i) ? V_dim : 0);
+      }
+      weights_.resize(offsets_[n]);
+      bcd::Delta::Init(offsets_[n], &delta_);
+      for (size_t i = 0; i < n; ++i) {
+        int p = offsets_[i];
+        weights_[p] = model.w[i];
+        if (aux) delta_[p] = model.aux_w[0][i];
+        real_t const* V = model.GetV(i);
+        if (!V) continue;
+        memcpy(weights_.data() + p + 1, V, V_dim * sizeof(real_t));
+        if (aux && model.aux_V.size()) {
+          memcpy(delta_.data() + p + 1, model.aux_V.data() + (V - model.V.data()),
+                 V_dim * sizeof(real_t));
+        }
+      }
+      // the changes from zero, so the workers get the loaded model
+      w_delta_.CopyFrom(weights_);
+    }
+    active_.resize(n, 1);
+    UpdateMemGauge();
+    if (has_aux) *has_aux = aux;
+  }
 
   void Save(bool save_aux, dmlc::Stream *fo) const override {
+    ModelFile model;
+    Snapshot(save_aux, &model);
+    model.Save(fo);
+  }
+
+  /** \brief copy the model into a snapshot, which shares no memory with it */
+  void Snapshot(bool save_aux, ModelFile* model) const {
+    model->feaids.CopyFrom(feaids_);
+    size_t n = feaids_.size();
+    if (param_.V_dim == 0) {
+      model->w.CopyFrom(weights_);
+      if (weights_.empty()) model->w.resize(n, 0);
+      if (save_aux && delta_.size()) {
+        model->aux_w.push_back(SArray<real_t>());
+        model->aux_w.back().CopyFrom(delta_);
+      }
+    } else {
+      int V_dim = param_.V_dim;
+      model->V_dim = V_dim;
+      model->w.resize(n, 0);
+      model->V_idx.resize(n, -1);
+      SArray<real_t> aux_w(n);
+      for (size_t i = 0; i < n && weights_.size(); ++i) {
+        int p = offsets_[i];
+        model->w[i] = weights_[p];
+        aux_w[i] = delta_[p];
+        if (offsets_[i+1] - p == 1) continue;
+        model->V_idx[i] = model->V.size() / V_dim;
+        for (int k = 1; k <= V_dim; ++k) {
+          model->V.push_back(weights_[p+k]);
+          model->aux_V.push_back(delta_[p+k]);
+        }
+      }
+      if (save_aux && weights_.size()) {
+        model->aux_w.push_back(aux_w);
+      } else {
+        model->aux_V.clear();
+      }
+    }
   }
 
   void Get(const SArray<feaid_t>& feaids,
@@ -57,27 +192,37 @@ class BCDUpdater : public Updater {
            SArray<real_t>* values,
            SArray<int>* offsets) override {
     if (value_type == Store::kFeaCount) {
+      if (feacnt_sketch_.size()) {
+        feacnt_sketch_.Count(feaids, values);
+      } else {
+        values->resize(feaids.size());
+        KVMatch(feaids_, feacnt_, feaids, values);
+      }
+    } else if (value_type == Store::kActive) {
       values->resize(feaids.size());
-      KVMatch(feaids_, feacnt_, feaids, values);
+      KVMatch(feaids_, active_, feaids, values);
     } else if (value_type == Store::kWeight) {
       if (weights_.empty()) InitWeights();
-      values->resize(feaids.size() * (param_.V_dim+1));
       if (param_.V_dim == 0) {
+        values->resize(feaids.size());
         KVMatch(feaids_, w_delta_, feaids, values);
       } else {
-        offsets->resize(feaids.size());
+        // the lengths and then the values of each feature
         SArray<int> pos; FindPosition(feaids_, feaids, &pos);
-        int *os = offsets->data(); os[0] = 0;
-        real_t* val = values->data();
+        offsets->resize(feaids.size());
+        size_t len = 0;
         for (size_t i = 0; i < pos.size(); ++i) {
           CHECK_NE(pos[i], -1);
-          int start = offsets_[pos[i]+1];
-          int len = offsets_[pos[i]+1] - start;
-          os[1] = os[0] + len;
-          memcpy(val, w_delta_.data() + start, len * sizeof(real_t));
-          val += len; ++os;
+          (*offsets)[i] = offsets_[pos[i]+1] - offsets_[pos[i]];
+          len += (*offsets)[i];
+        }
+        values->resize(len);
+        real_t* val = values->data();
+        for (size_t i = 0; i < pos.size(); ++i) {
+          int l = (*offsets)[i];
+          memcpy(val, w_delta_.data() + offsets_[pos[i]], l * sizeof(real_t));
+          val += l;
         }
-        values->resize(os[1]);
       }
     } else {
       LOG(FATAL) << "...";
@@ -91,7 +236,14 @@ class BCDUpdater : public Updater {
               const SArray<int>& offsets) override {
     if (value_type == Store::kFeaCount) {
       feaids_ = feaids;
-      feacnt_ = values;
+      if (feacnt_sketch_.size()) {
+        CHECK_EQ(feaids.size(), values.size());
+        feacnt_sketch_.Clear();
+        feacnt_sketch_.Add(feaids, values);
+      } else {
+        feacnt_.CopyFrom(values);
+      }
+      UpdateMemGauge();
     } else if (value_type == Store::kGradient) {
       if (weights_.empty()) InitWeights();
       SArray<int> pos; FindPosition(feaids_, feaids, &pos);
@@ -103,12 +255,15 @@ class BCDUpdater : public Updater {
           UpdateWeight(pos[i], values.data()+i*k, k);
         }
       } else {
+        // the lengths of the gradients of each feature
         CHECK_EQ(offsets.size(), feaids.size());
-        CHECK_EQ(offsets.back(), static_cast<int>(values.size()));
+        size_t p = 0;
         for (size_t i = 0; i < pos.size(); ++i) {
           CHECK_NE(pos[i], -1);
-          UpdateWeight(pos[i], values.data()+offsets[i], offsets[i+1]-offsets[i]);
+          UpdateWeight(pos[i], values.data()+p, offsets[i]);
+          p += offsets[i];
         }
+        CHECK_EQ(p, values.size());
       }
     } else {
       LOG(FATAL) << "...";
@@ -118,21 +273,70 @@ class BCDUpdater : public Updater {
  private:
   void InitWeights() {
     // remove tail features
-    CHECK_EQ(feaids_.size(), feacnt_.size());
+    bool sketch = feacnt_sketch_.size() > 0;
+    if (!sketch) CHECK_EQ(feaids_.size(), feacnt_.size());
     SArray<feaid_t> filtered;
+    SArray<real_t> filtered_cnt;
     for (size_t i = 0; i < feaids_.size(); ++i) {
-      if (feacnt_[i] > param_.tail_feature_filter) {
+      real_t cnt = sketch ? feacnt_sketch_.Count(feaids_[i]) : feacnt_[i];
+      if (cnt > param_.tail_feature_filter) {
         filtered.push_back(feaids_[i]);
+        if (!sketch) filtered_cnt.push_back(cnt);
       }
     }
     feaids_ = filtered;
     feacnt_.clear();
+    size_t n = feaids_.size();
+    active_.resize(n, 1);
 
     // init weight
-    CHECK_EQ(param_.V_dim, 0);
-    weights_.resize(feaids_.size());
-    w_delta_.resize(feaids_.size());
-    bcd::Delta::Init(feaids_.size(), &delta_);
+    if (param_.V_dim == 0) {
+      weights_.resize(n);
+      w_delta_.resize(n);
+      bcd::Delta::Init(n, &delta_);
+      UpdateMemGauge();
+      return;
+    }
+    // w = 0 and V is random, the changes are counted from zero, so the
+    // workers get the initial V by the first pull. a value costs weights_,
+    // w_delta_ and delta_, V is not allocated for the rest features once the
+    // memory budget is exceeded
+    int V_dim = param_.V_dim;
+    auto tracker = MemTracker::Get();
+    size_t num_no_V = 0;
+    offsets_.resize(n+1); offsets_[0] = 0;
+    for (size_t i = 0; i < n; ++i) {
+      real_t cnt = sketch ? feacnt_sketch_.Count(feaids_[i]) : filtered_cnt[i];
+      bool has_V = cnt > param_.V_threshold;
+      if (has_V && tracker->Exceeds(
+              (offsets_[i] + 1 + V_dim) * 3 * sizeof(real_t))) {
+        has_V = false;
+        ++num_no_V;
+      }
+      offsets_[i+1] = offsets_[i] + 1 + (has_V ? V_dim : 0);
+    }
+    if (num_no_V) {
+      LOG(WARNING) << "memory budget exceeded, " << num_no_V
+                   << " features have no V: " << tracker->TextString();
+    }
+    weights_.resize(offsets_[n], 0);
+    for (size_t i = 0; i < n; ++i) {
+      for (int p = offsets_[i] + 1; p < offsets_[i+1]; ++p) {
+        weights_[p] = (rand_r(&param_.seed) / (real_t)RAND_MAX - 0.5) *
+                      param_.V_init_scale;
+      }
+    }
+    w_delta_.CopyFrom(weights_);
+    bcd::Delta::Init(offsets_[n], &delta_);
+    UpdateMemGauge();
+  }
+
+  void UpdateMemGauge() {
+    model_mem_.Set(feaids_.size() * sizeof(feaid_t) +
+                   weights_.size() * sizeof(real_t) +
+                   offsets_.size() * sizeof(int));
+    aux_mem_.Set((feacnt_.size() + w_delta_.size() + delta_.size() +
+                  active_.size()) * sizeof(real_t) + feacnt_sketch_.MemBytes());
   }
 
   void UpdateWeight(int idx, real_t const* grad, int grad_len) {
@@ -151,19 +355,47 @@ class BCDUpdater : public Updater {
     } else if (g_neg >= u * w) {
       d = - g_neg / u;
     }
-    d = std::min(delta_[idx], std::max(- delta_[idx], d));
-    bcd::Delta::Update(d, &delta_[idx]);
+    d = std::min(delta_[i], std::max(- delta_[i], d));
+    bcd::Delta::Update(d, &delta_[i]);
     weights_[i] += d;
     w_delta_[i] = d;
+
+    // KKT screening: a zero weight stays zero while |g| <= l1, it is screened
+    // out if the gradient is well inside this range
+    active_[idx] = weights_[i] != 0 ||
+                   std::fabs(g) >= param_.active_set_ratio * param_.l1;
+
+    // update V by a newton step with the l2 regularizer
+    if (offsets_.empty()) return;
+    int len = offsets_[idx+1] - i;
+    CHECK_EQ(grad_len, len * 2);
+    for (int k = 1; k < len; ++k) {
+      real_t V = weights_[i+k];
+      real_t d = - (grad[k*2] + param_.V_l2 * V) /
+                 (grad[k*2+1] / param_.V_lr + param_.V_l2 + 1e-10);
+      d = std::min(delta_[i+k], std::max(- delta_[i+k], d));
+      bcd::Delta::Update(d, &delta_[i+k]);
+      weights_[i+k] += d;
+      w_delta_[i+k] = d;
+    }
   }
 
   BCDUpdaterParam param_;
   SArray<feaid_t> feaids_;
   SArray<real_t> feacnt_;
+  /** \brief the estimated feature counts if feacnt_sketch_mb > 0 */
+  CountMinSketch<uint16_t> feacnt_sketch_;
+  /** \brief the values, w and then V of each feature if V_dim > 0 */
   SArray<real_t> weights_;
+  /** \brief the changes of weights_ by the last update */
   SArray<real_t> w_delta_;
+  /** \brief the start of each feature in weights_, empty if V_dim = 0 */
   SArray<int> offsets_;
+  /** \brief the bounds of the changes of each value in weights_ */
   SArray<real_t> delta_;
+  /** \brief 1 if a feature is active, 0 if screened out */
+  SArray<real_t> active_;
+  MemGauge model_mem_, aux_mem_;
 };
 
 
@@ -11,8 +11,11 @@
 #include <vector>
 #include <algorithm>
 #include "dmlc/data.h"
+#include "difacto/base.h"
 #include "difacto/sarray.h"
 #include "dmlc/memory_io.h"
+#include "common/range.h"
+#include "data/columnar_block.h"
 namespace difacto {
 namespace bcd {
 
@@ -22,8 +25,11 @@ struct Job {
   static const int kIterateData = 3;
   static const int kPrepareData = 6;
   static const int kBuildFeatureMap = 7;
+  static const int kCheckpoint = 8;
   /** \brief job type */
   int type;
+  /** \brief the epoch of kIterateData */
+  int epoch = 0;
   /** \brief the order to process feature blocks */
   std::vector<int> feablks;
   /** \brief the ID range of each feature block */
@@ -32,6 +38,7 @@ struct Job {
   void SerializeToString(std::string* str) const {
     dmlc::Stream* ss = new dmlc::MemoryStringStream(str);
     ss->Write(type);
+    ss->Write(epoch);
     ss->Write(feablks);
     ss->Write(feablk_ranges.size());
     for (auto r : feablk_ranges) {
@@ -44,6 +51,7 @@ struct Job {
     auto pstr = str;
     dmlc::Stream* ss = new dmlc::MemoryStringStream(&pstr);
     ss->Read(&type);
+    ss->Read(&epoch);
     ss->Read(&feablks);
     size_t size; ss->Read(&size);
     feablk_ranges.resize(size);
@@ -55,70 +63,224 @@ struct Job {
   }
 };
 
-/**
- * \brief partition the whole feature space into blocks
- *
- * @param feagrp_nbits number of bit for encoding the feature group
- * @param feagrps a list of (feature_group, num_partitions_this_group)
- * @param feablks a list of feature blocks with the start and end ID
- */
-inline void PartitionFeature(int feagrp_nbits,
-                             const std::vector<std::pair<int, int>>& feagrps,
-                             std::vector<Range>* feablks) {
-  CHECK_EQ(feagrp_nbits % 4, 0) << "should be 0, 4, 8, ...";
-  feablks->clear();
-  for (auto f : feagrps) {
-    int gid = f.first;
-    Range rg(ReverseBytes(EncodeFeaGrpID(0, gid, feagrp_nbits)),
-             ReverseBytes(EncodeFeaGrpID(
-                 std::numeric_limits<feaid_t>::max(), gid, feagrp_nbits)));
-    for (int i = 0; i < f.second; ++i) {
-      feablks->push_back(rg.Segment(i, f.second));
-      CHECK(feablks->back().Valid());
-    }
-  }
-  std::sort(feablks->begin(), feablks->end(),
-            [](const Range& a, const Range& b) { return a.begin < b.begin;});
-  for (size_t i = 1; i < feablks->size(); ++i) {
-    auto& before = feablks->at(i-1), after = feablks->at(i);
-    if (before.end < after.begin) ++before.end;
-    CHECK_LE(before.end, after.begin);
-  }
+/** \brief the range of the feature IDs of a feature group */
+inline Range FeaGrpRange(int gid, int feagrp_nbits) {
+  return Range(ReverseBytes(EncodeFeaGrpID(0, gid, feagrp_nbits)),
+               ReverseBytes(EncodeFeaGrpID(
+                   std::numeric_limits<feaid_t>::max(), gid, feagrp_nbits)));
 }
 
 /**
  * \brief count statistics for feature groups
+ *
+ * besides the nnz of each group, the nnz of a group is counted in buckets of
+ * the feature IDs for \ref PartitionFeature. the buckets are log-linear on
+ * the offset of an ID in the range of its group, so both the hashed IDs over
+ * the whole range and the small IDs are resolved.
+ *
+ * the values are, with G groups and B buckets per group,
+ *
+ * - [0, G) : the nnz of each group
+ * - G : the number of rows counted
+ * - G + 1 : the number of rows
+ * - G + 2 : the number of row blocks
+ * - [G + 3, G + 3 + G * B) : the nnz of each bucket
  */
 class FeaGroupStats {
  public:
   explicit FeaGroupStats(int nbits) {
     CHECK_LE(nbits, 16);
     nbits_ = nbits;
-    value_.resize((1 << nbits_)+2);
+    int ngrp = 1 << nbits_;
+    nbuckets_ = NumBuckets(nbits_);
+    value_.resize(ngrp + 3 + ngrp * nbuckets_);
+    grp_begin_.resize(ngrp);
+    for (int i = 0; i < ngrp; ++i) grp_begin_[i] = FeaGrpRange(i, nbits_).begin;
   }
 
   void Add(const dmlc::RowBlock<feaid_t>& rowblk) {
+    int ngrp = 1 << nbits_;
+    real_t* hist = value_.data() + ngrp + 3;
     real_t nrows = 0;
     for (size_t i = 0; i < rowblk.size; i+=skip_) {
       for (size_t j = rowblk.offset[i]; j < rowblk.offset[i+1]; ++j) {
-        ++value_[DecodeFeaGrpID(rowblk.index[j], nbits_)];
+        feaid_t id = rowblk.index[j];
+        int gid = DecodeFeaGrpID(id, nbits_);
+        ++value_[gid];
+        if (nbuckets_ > 1) {
+          ++hist[gid * nbuckets_ + Bucket(ReverseBytes(id) - grp_begin_[gid])];
+        }
       }
       ++nrows;
     }
-    value_[1 << nbits_] += nrows;
-    value_[(1 << nbits_)+1] += rowblk.size;
+    value_[ngrp] += nrows;
+    value_[ngrp+1] += rowblk.size;
+    value_[ngrp+2] += 1;
+  }
+
+  /**
+   * \brief add a rowblk in the transposed layout, whose features are counted
+   * directly, so all rows are counted
+   */
+  void Add(const ColumnarTile& tile) {
+    int ngrp = 1 << nbits_;
+    real_t* hist = value_.data() + ngrp + 3;
+    for (size_t c = 0; c < tile.ids.size(); ++c) {
+      feaid_t id = ReverseBytes(tile.ids[c]);
+      int gid = DecodeFeaGrpID(id, nbits_);
+      value_[gid] += tile.cnts[c];
+      if (nbuckets_ > 1) {
+        hist[gid * nbuckets_ + Bucket(tile.ids[c] - grp_begin_[gid])] +=
+            tile.cnts[c];
+      }
+    }
+    value_[ngrp] += tile.label.size();
+    value_[ngrp+1] += tile.label.size();
+    value_[ngrp+2] += 1;
+  }
+
+  /** \brief add the statistics of other, with the same nbits */
+  void Merge(const FeaGroupStats& other) {
+    CHECK_EQ(value_.size(), other.value_.size());
+    for (size_t i = 0; i < value_.size(); ++i) value_[i] += other.value_[i];
   }
 
   void Get(std::vector<real_t>* value) {
     *value = value_;
   }
 
+  /**
+   * \brief the number of buckets per group, the total is bounded to keep the
+   * statistics small, and there is a single bucket if too many groups
+   */
+  static int NumBuckets(int nbits) {
+    return nbits > kMantBits ? 1 : 65 << (kMantBits - nbits);
+  }
+
+  /** \brief the bucket of an offset in the range of a group */
+  int Bucket(feaid_t offset) const {
+    if (offset == 0) return 0;
+    int m = kMantBits - nbits_;
+    int e = 64 - __builtin_clzll(offset);
+    feaid_t mant = offset - (static_cast<feaid_t>(1) << (e - 1));
+    mant = e - 1 >= m ? mant >> (e - 1 - m) : mant << (m - e + 1);
+    return (e << m) + static_cast<int>(mant);
+  }
+
+  /**
+   * \brief the first offset of bucket b. some buckets of the small offsets
+   * are never used, the next offset is returned for them
+   */
+  static feaid_t BucketBegin(int b, int nbits) {
+    int m = kMantBits - nbits;
+    int e = b >> m;
+    if (e == 0) return b > 0;
+    feaid_t mant = b & ((1 << m) - 1);
+    if (e - 1 >= m) {
+      mant <<= e - 1 - m;
+    } else {
+      int s = m - e + 1;
+      mant = (mant + (1 << s) - 1) >> s;
+    }
+    return (static_cast<feaid_t>(1) << (e - 1)) + mant;
+  }
+
  private:
+  /** \brief the bits of the linear part of the buckets, with nbits = 0 */
+  static const int kMantBits = 10;
   int nbits_;
+  int nbuckets_;
   int skip_ = 10;  // only count 10% data
   std::vector<real_t> value_;
+  std::vector<feaid_t> grp_begin_;
 };
 
+/** \brief make the blocks sorted and connected */
+inline void ConnectFeablks(std::vector<Range>* feablks) {
+  std::sort(feablks->begin(), feablks->end(),
+            [](const Range& a, const Range& b) { return a.begin < b.begin;});
+  for (size_t i = 1; i < feablks->size(); ++i) {
+    auto& before = feablks->at(i-1), after = feablks->at(i);
+    if (before.end < after.begin) ++before.end;
+    CHECK_LE(before.end, after.begin);
+  }
+}
+
+/**
+ * \brief partition the whole feature space into blocks
+ *
+ * @param feagrp_nbits number of bit for encoding the feature group
+ * @param feagrps a list of (feature_group, num_partitions_this_group)
+ * @param feablks a list of feature blocks with the start and end ID
+ */
+inline void PartitionFeature(int feagrp_nbits,
+                             const std::vector<std::pair<int, int>>& feagrps,
+                             std::vector<Range>* feablks) {
+  CHECK_EQ(feagrp_nbits % 4, 0) << "should be 0, 4, 8, ...";
+  feablks->clear();
+  for (auto f : feagrps) {
+    Range rg = FeaGrpRange(f.first, feagrp_nbits);
+    for (int i = 0; i < f.second; ++i) {
+      feablks->push_back(rg.Segment(i, f.second));
+      CHECK(feablks->back().Valid());
+    }
+  }
+  ConnectFeablks(feablks);
+}
+
+/**
+ * \brief partition the whole feature space into blocks with about the same
+ * nnz in each group
+ *
+ * the blocks of a group are divided at the bucket boundaries of the
+ * histogram counted by \ref FeaGroupStats, rather than evenly on the IDs, so
+ * a few frequent features do not make a block much larger than others. a
+ * bucket is not divided, so there may be less blocks than asked
+ *
+ * @param feagrp_nbits number of bit for encoding the feature group
+ * @param feagrps a list of (feature_group, num_partitions_this_group)
+ * @param hist the nnz of each bucket, FeaGroupStats::NumBuckets per group
+ * @param feablks a list of feature blocks with the start and end ID
+ */
+inline void PartitionFeature(int feagrp_nbits,
+                             const std::vector<std::pair<int, int>>& feagrps,
+                             real_t const* hist,
+                             std::vector<Range>* feablks) {
+  int nb = FeaGroupStats::NumBuckets(feagrp_nbits);
+  if (nb == 1) {
+    PartitionFeature(feagrp_nbits, feagrps, feablks);
+    return;
+  }
+  CHECK_EQ(feagrp_nbits % 4, 0) << "should be 0, 4, 8, ...";
+  feablks->clear();
+  for (auto f : feagrps) {
+    Range rg = FeaGrpRange(f.first, feagrp_nbits);
+    real_t const* h = hist + f.first * nb;
+    real_t total = 0;
+    for (int b = 0; b < nb; ++b) total += h[b];
+    int nblk = f.second;
+    if (total == 0) {
+      for (int i = 0; i < nblk; ++i) feablks->push_back(rg.Segment(i, nblk));
+      continue;
+    }
+    // the k-th block starts after the bucket where the nnz reaches total*k/nblk
+    feaid_t begin = rg.begin;
+    real_t sum = 0;
+    int k = 1;
+    for (int b = 0; b + 1 < nb && k < nblk; ++b) {
+      sum += h[b];
+      if (sum < total * k / nblk) continue;
+      while (k < nblk && sum >= total * k / nblk) ++k;
+      feaid_t end = rg.begin + FeaGroupStats::BucketBegin(b + 1, feagrp_nbits);
+      if (end <= begin || end >= rg.end) continue;
+      feablks->push_back(Range(begin, end));
+      begin = end;
+    }
+    feablks->push_back(Range(begin, rg.end));
+  }
+  ConnectFeablks(feablks);
+}
+
 /**
  * \brief monitor if or not a block is finished, thread safe
  */
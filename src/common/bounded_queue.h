@@ -0,0 +1,77 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_COMMON_BOUNDED_QUEUE_H_
+#define DIFACTO_COMMON_BOUNDED_QUEUE_H_
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include "dmlc/logging.h"
+#include "dmlc/timer.h"
+namespace difacto {
+
+/**
+ * \brief a thread-safe FIFO queue with a maximal size, which connects the
+ * stages of a pipeline
+ *
+ * a producer blocks if the queue is full, and a consumer blocks if it is
+ * empty. the seconds blocked are added into the stall argument, so a stage
+ * knows how long it waited for its neighbours
+ */
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity) : capacity_(capacity) {
+    CHECK_GT(capacity, 0);
+  }
+
+  /** \brief add an item, blocks while the queue is full */
+  void Push(const T& item, double* stall = nullptr) {
+    std::unique_lock<std::mutex> lk(mu_);
+    if (items_.size() >= capacity_) {
+      double start = dmlc::GetTime();
+      push_cond_.wait(lk, [this] { return items_.size() < capacity_; });
+      if (stall) *stall += dmlc::GetTime() - start;
+    }
+    CHECK(!closed_) << "push into a closed queue";
+    items_.push_back(item);
+    pop_cond_.notify_one();
+  }
+
+  /**
+   * \brief get the front item, blocks while the queue is empty. returns false
+   * if the queue is empty and closed
+   */
+  bool Pop(T* item, double* stall = nullptr) {
+    std::unique_lock<std::mutex> lk(mu_);
+    if (items_.empty() && !closed_) {
+      double start = dmlc::GetTime();
+      pop_cond_.wait(lk, [this] { return closed_ || !items_.empty(); });
+      if (stall) *stall += dmlc::GetTime() - start;
+    }
+    if (items_.empty()) return false;
+    *item = std::move(items_.front());
+    items_.pop_front();
+    push_cond_.notify_one();
+    return true;
+  }
+
+  /** \brief no more items will be pushed, wakes up all blocked consumers */
+  void Close() {
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      closed_ = true;
+    }
+    pop_cond_.notify_all();
+  }
+
+ private:
+  size_t capacity_;
+  bool closed_ = false;
+  std::deque<T> items_;
+  std::mutex mu_;
+  std::condition_variable push_cond_, pop_cond_;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_BOUNDED_QUEUE_H_
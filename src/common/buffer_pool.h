@@ -0,0 +1,125 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_COMMON_BUFFER_POOL_H_
+#define DIFACTO_COMMON_BUFFER_POOL_H_
+#include <stdlib.h>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+#include "difacto/sarray.h"
+#include "dmlc/logging.h"
+#include "./mem_tracker.h"
+namespace difacto {
+
+/**
+ * \brief recycles the buffers of the arrays allocated for every batch
+ *
+ * a buffer is rounded up to a power of 2 bytes, its size class. an array
+ * from \ref New returns its buffer to the free list of its class once the last
+ * copy is released, and the next array of the class reuses it, so the steady
+ * state of a batch loop neither calls malloc nor touches new pages. the free
+ * buffers are kept up to max_cached_bytes, and are reported as the scratch
+ * memory. thread-safe
+ */
+class BufferPool {
+ public:
+  /** \brief the pool shared by the hot paths */
+  static BufferPool* Get() {
+    // never destroyed, so an array released at exit still finds it
+    static BufferPool* pool = new BufferPool();
+    return pool;
+  }
+
+  explicit BufferPool(size_t max_cached_bytes = 256 << 20)
+      : max_cached_(max_cached_bytes) { }
+  ~BufferPool() { Clear(); }
+
+  /** \brief an array of n elements, not initialized */
+  template <typename V>
+  SArray<V> New(size_t n) {
+    SArray<V> arr;
+    if (n == 0) return arr;
+    int cls = SizeClass(n * sizeof(V));
+    void* buf = Alloc(cls);
+    arr.reset(static_cast<V*>(buf), n, [this, cls](V* p) { Free(cls, p); });
+    return arr;
+  }
+
+  /** \brief an array of n elements, all are val */
+  template <typename V>
+  SArray<V> New(size_t n, V val) {
+    SArray<V> arr = New<V>(n);
+    std::fill(arr.data(), arr.data() + n, val);
+    return arr;
+  }
+
+  /** \brief the bytes of the free buffers */
+  size_t cached_bytes() {
+    std::lock_guard<std::mutex> lk(mu_);
+    return cached_;
+  }
+
+  /** \brief free all cached buffers */
+  void Clear() {
+    std::lock_guard<std::mutex> lk(mu_);
+    for (size_t c = 0; c < free_.size(); ++c) {
+      for (void* p : free_[c]) free(p);
+      free_[c].clear();
+    }
+    MemTracker::Get()->Add(MemTracker::kScratch,
+                           -static_cast<int64_t>(cached_));
+    cached_ = 0;
+  }
+
+ private:
+  /** \brief the smallest class is 64 bytes, a cache line */
+  static int SizeClass(size_t bytes) {
+    int c = 6;
+    while ((static_cast<size_t>(1) << c) < bytes) ++c;
+    return c;
+  }
+
+  void* Alloc(int cls) {
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      if (static_cast<size_t>(cls) < free_.size() && free_[cls].size()) {
+        void* p = free_[cls].back();
+        free_[cls].pop_back();
+        cached_ -= static_cast<size_t>(1) << cls;
+        MemTracker::Get()->Add(MemTracker::kScratch,
+                               -(static_cast<int64_t>(1) << cls));
+        return p;
+      }
+    }
+    void* p = nullptr;
+    CHECK_EQ(posix_memalign(&p, 64, static_cast<size_t>(1) << cls), 0)
+        << "failed to allocate " << (static_cast<size_t>(1) << cls)
+        << " bytes";
+    return p;
+  }
+
+  void Free(int cls, void* p) {
+    size_t bytes = static_cast<size_t>(1) << cls;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      if (cached_ + bytes <= max_cached_) {
+        if (free_.size() <= static_cast<size_t>(cls)) free_.resize(cls + 1);
+        free_[cls].push_back(p);
+        cached_ += bytes;
+        MemTracker::Get()->Add(MemTracker::kScratch, bytes);
+        return;
+      }
+    }
+    free(p);
+  }
+
+  std::mutex mu_;
+  /** \brief the free buffers of each size class */
+  std::vector<std::vector<void*>> free_;
+  size_t cached_ = 0;
+  size_t max_cached_;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_BUFFER_POOL_H_
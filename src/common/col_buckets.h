@@ -0,0 +1,113 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_COMMON_COL_BUCKETS_H_
+#define DIFACTO_COMMON_COL_BUCKETS_H_
+#include <vector>
+#include "dmlc/data.h"
+#include "difacto/base.h"
+#include "./range.h"
+#include "./task_scheduler.h"
+namespace difacto {
+
+/**
+ * \brief a column bucketed view of a row major sparse matrix
+ *
+ * the columns are divided into nbuckets consecutive ranges, and bucket b
+ * holds the nonzero entries whose columns are in the b-th range, ordered by
+ * row. it is built by a counting pass and a filling pass over the matrix,
+ * both parallelized over rows, so D' * x can be parallelized over columns
+ * without every thread scanning the whole matrix. the entries of a column
+ * are visited in the same order as a row scan, so the results are identical.
+ */
+class ColBuckets {
+ public:
+  /** \brief row major sparse matrix */
+  using SpMat = dmlc::RowBlock<unsigned>;
+  /** \brief a nonzero entry */
+  struct Entry {
+    unsigned col;
+    unsigned row;
+    real_t val;
+  };
+
+  /**
+   * \brief returns true if the bucketed view is cheaper than letting each of
+   * the nthreads threads scan the matrix
+   */
+  static bool Worth(const SpMat& D, size_t ncols, int nthreads) {
+    size_t nnz = D.offset[D.size] - D.offset[0];
+    return nthreads > 2 && nnz >= kMinNNZ &&
+        ncols >= static_cast<size_t>(nthreads);
+  }
+
+  /**
+   * \brief build the view
+   * @param D the sparse matrix
+   * @param ncols the number of columns, entries on larger columns are ignored
+   * @param nbuckets the number of buckets
+   * @param nthreads the number of threads
+   */
+  ColBuckets(const SpMat& D, size_t ncols, int nbuckets, int nthreads)
+      : nbuckets_(nbuckets), width_((ncols + nbuckets - 1) / nbuckets) {
+    CHECK_GT(nbuckets, 0);
+    int nseg = nthreads;
+    if (width_ == 0) width_ = 1;
+    // count the entries of each (row segment, bucket)
+    std::vector<size_t> cnt(nseg * nbuckets, 0);
+    ParallelRun(nseg, [&](int t, int nt) {
+        Range rg = Range(0, D.size).Segment(t, nseg);
+        size_t* c = cnt.data() + t * nbuckets;
+        for (size_t j = D.offset[rg.begin]; j < D.offset[rg.end]; ++j) {
+          size_t k = D.index[j];
+          if (k < ncols) ++c[k / width_];
+        }
+      });
+    // the start position of each (row segment, bucket), bucket major
+    std::vector<size_t> start(nseg * nbuckets);
+    begin_.resize(nbuckets + 1);
+    size_t n = 0;
+    for (int b = 0; b < nbuckets; ++b) {
+      begin_[b] = n;
+      for (int t = 0; t < nseg; ++t) {
+        start[t * nbuckets + b] = n;
+        n += cnt[t * nbuckets + b];
+      }
+    }
+    begin_[nbuckets] = n;
+    // fill the entries
+    entries_.resize(n);
+    ParallelRun(nseg, [&](int t, int nt) {
+        Range rg = Range(0, D.size).Segment(t, nseg);
+        size_t* pos = start.data() + t * nbuckets;
+        for (size_t i = rg.begin; i < rg.end; ++i) {
+          for (size_t j = D.offset[i]; j < D.offset[i+1]; ++j) {
+            unsigned k = D.index[j];
+            if (k >= ncols) continue;
+            Entry& e = entries_[pos[k / width_]++];
+            e.col = k;
+            e.row = static_cast<unsigned>(i);
+            e.val = D.value ? D.value[j] : 1;
+          }
+        }
+      });
+  }
+
+  /** \brief the number of buckets */
+  int size() const { return nbuckets_; }
+  /** \brief the first entry of bucket b */
+  Entry const* begin(int b) const { return entries_.data() + begin_[b]; }
+  /** \brief the end of bucket b */
+  Entry const* end(int b) const { return entries_.data() + begin_[b+1]; }
+
+ private:
+  /** \brief a small matrix is cheap to scan by every thread */
+  static const size_t kMinNNZ = 1 << 10;
+  int nbuckets_;
+  size_t width_;
+  std::vector<size_t> begin_;
+  std::vector<Entry> entries_;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_COL_BUCKETS_H_
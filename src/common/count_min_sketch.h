@@ -0,0 +1,109 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_COMMON_COUNT_MIN_SKETCH_H_
+#define DIFACTO_COMMON_COUNT_MIN_SKETCH_H_
+#include <string.h>
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include "difacto/base.h"
+#include "difacto/sarray.h"
+#include "dmlc/logging.h"
+namespace difacto {
+
+/**
+ * \brief a count-min sketch of the counts of feature ids
+ *
+ * a count is added into one counter of each of the depth rows, and the
+ * estimate is the minimum of them, which is never less than the true count.
+ * the counters saturate at the maximum of C. not thread-safe
+ */
+template <typename C>
+class CountMinSketch {
+ public:
+  CountMinSketch() { }
+  ~CountMinSketch() { }
+
+  /** \brief depth rows with width counters each, all zeros */
+  void Init(size_t width, int depth = 4) {
+    CHECK_GT(width, 0); CHECK_GT(depth, 0);
+    width_ = width;
+    depth_ = depth;
+    counts_.reset(new C[width * depth]);
+    memset(counts_.get(), 0, width * depth * sizeof(C));
+  }
+
+  /** \brief add n into the count of a key, returns the estimate after */
+  C Add(feaid_t key, uint64_t n) {
+    uint64_t h = HashFeaID(key);
+    C est = static_cast<C>(Max());
+    for (int r = 0; r < depth_; ++r) {
+      C& c = counts_[Index(h, r)];
+      c = static_cast<C>(std::min<uint64_t>(c + n, Max()));
+      est = std::min(est, c);
+    }
+    return est;
+  }
+
+  /** \brief the estimated count of a key */
+  C Count(feaid_t key) const {
+    uint64_t h = HashFeaID(key);
+    C est = static_cast<C>(Max());
+    for (int r = 0; r < depth_; ++r) est = std::min(est, counts_[Index(h, r)]);
+    return est;
+  }
+
+  /** \brief add the counts of a list of keys, rounded down */
+  void Add(const SArray<feaid_t>& keys, const SArray<real_t>& counts) {
+    CHECK_EQ(keys.size(), counts.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+      if (counts[i] >= 1) Add(keys[i], static_cast<uint64_t>(counts[i]));
+    }
+  }
+
+  /** \brief the estimated counts of a list of keys */
+  void Count(const SArray<feaid_t>& keys, SArray<real_t>* counts) const {
+    counts->resize(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) (*counts)[i] = Count(keys[i]);
+  }
+
+  /** \brief reset all counters to zero */
+  void Clear() { memset(counts_.get(), 0, MemBytes()); }
+
+  /** \brief halve all counters, so the old counts fade out */
+  void Halve() {
+    for (size_t i = 0; i < width_ * depth_; ++i) counts_[i] /= 2;
+  }
+
+  /** \brief add the counters of another sketch with the same shape */
+  void Merge(const CountMinSketch& other) {
+    CHECK_EQ(width_, other.width_); CHECK_EQ(depth_, other.depth_);
+    for (size_t i = 0; i < width_ * depth_; ++i) {
+      counts_[i] = static_cast<C>(std::min<uint64_t>(
+          static_cast<uint64_t>(counts_[i]) + other.counts_[i], Max()));
+    }
+  }
+
+  /** \brief the counters, depth rows of width each */
+  C* data() { return counts_.get(); }
+  size_t size() const { return width_ * depth_; }
+
+  size_t MemBytes() const { return size() * sizeof(C); }
+
+ private:
+  static uint64_t Max() { return std::numeric_limits<C>::max(); }
+
+  /** \brief the counter of a hashed key in row r, by double hashing */
+  size_t Index(uint64_t h, int r) const {
+    uint64_t h1 = h & 0xFFFFFFFFULL, h2 = (h >> 32) | 1;
+    return r * width_ + (h1 + r * h2) % width_;
+  }
+
+  size_t width_ = 0;
+  int depth_ = 0;
+  std::unique_ptr<C[]> counts_;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_COUNT_MIN_SKETCH_H_
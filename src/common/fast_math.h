@@ -0,0 +1,111 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_COMMON_FAST_MATH_H_
+#define DIFACTO_COMMON_FAST_MATH_H_
+#include <string.h>
+#include <stdint.h>
+#include <cmath>
+#include "difacto/base.h"
+/**
+ * \brief use libm rather than the polynomial approximations, to verify the
+ * results
+ */
+#ifndef DIFACTO_EXACT_MATH
+#define DIFACTO_EXACT_MATH 0
+#endif
+namespace difacto {
+namespace math {
+
+/**
+ * \brief exp(x), with relative error below 3e-7
+ *
+ * the argument is reduced into [-ln2/2, ln2/2] and then a polynomial is
+ * used. there are no branches, so the loops calling it can be vectorized.
+ * a too large (small) x is clamped to give about 1.7e38 (1.2e-38)
+ */
+inline real_t Exp(real_t x) {
+#if DIFACTO_EXACT_MATH
+  return std::exp(x);
+#else
+  x = x > 88.3f ? 88.3f : (x < -87.3f ? -87.3f : x);
+  real_t t = x * 1.44269504088896341f;
+  int n = static_cast<int>(t + (t >= 0 ? .5f : -.5f));
+  real_t fn = static_cast<real_t>(n);
+  real_t r = x - fn * 0.693359375f + fn * 2.12194440e-4f;
+  real_t y = 1.9875691500e-4f;
+  y = y * r + 1.3981999507e-3f;
+  y = y * r + 8.3334519073e-3f;
+  y = y * r + 4.1665795894e-2f;
+  y = y * r + 1.6666665459e-1f;
+  y = y * r + 5.0000001201e-1f;
+  y = y * r * r + r + 1;
+  uint32_t bits = static_cast<uint32_t>(n + 127) << 23;
+  real_t scale; memcpy(&scale, &bits, 4);
+  return y * scale;
+#endif  // DIFACTO_EXACT_MATH
+}
+
+/**
+ * \brief log(x) for a positive normal x, with relative error below 3e-7
+ */
+inline real_t Log(real_t x) {
+#if DIFACTO_EXACT_MATH
+  return std::log(x);
+#else
+  uint32_t bits; memcpy(&bits, &x, 4);
+  int e = static_cast<int>(bits >> 23) - 127;
+  bits = (bits & 0x7fffff) | 0x3f800000;
+  real_t m; memcpy(&m, &bits, 4);
+  // m in [sqrt(.5), sqrt(2))
+  bool big = m > 1.41421356f;
+  m = big ? m * .5f : m;
+  real_t fe = static_cast<real_t>(big ? e + 1 : e);
+  real_t f = m - 1;
+  real_t z = f * f;
+  real_t y = 7.0376836292e-2f;
+  y = y * f - 1.1514610310e-1f;
+  y = y * f + 1.1676998740e-1f;
+  y = y * f - 1.2420140846e-1f;
+  y = y * f + 1.4249322787e-1f;
+  y = y * f - 1.6668057665e-1f;
+  y = y * f + 2.0000714765e-1f;
+  y = y * f - 2.4999993993e-1f;
+  y = y * f + 3.3333331174e-1f;
+  y = y * f * z - 2.12194440e-4f * fe - .5f * z;
+  return f + y + 0.693359375f * fe;
+#endif  // DIFACTO_EXACT_MATH
+}
+
+/**
+ * \brief log(1+x) for x >= 0, accurate for a tiny x as well
+ */
+inline real_t Log1p(real_t x) {
+#if DIFACTO_EXACT_MATH
+  return std::log1p(x);
+#else
+  real_t w = 1 + x;
+  real_t d = w - 1;
+  return d == 0 ? x : Log(w) * (x / d);
+#endif  // DIFACTO_EXACT_MATH
+}
+
+/**
+ * \brief the logit loss log(1 + exp(- y * p)), y is either 1 or -1
+ */
+inline real_t LogitObjv(real_t y, real_t p) {
+  real_t t = - y * p;
+  real_t a = t > 0 ? t : -t;
+  return (t > 0 ? t : 0) + Log1p(Exp(-a));
+}
+
+/**
+ * \brief the derivative of the logit loss on p, - y / (1 + exp (y * p))
+ */
+inline real_t LogitGrad(real_t y, real_t p) {
+  return - y / (1 + Exp(y * p));
+}
+
+}  // namespace math
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_FAST_MATH_H_
@@ -0,0 +1,76 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_COMMON_FLOAT16_H_
+#define DIFACTO_COMMON_FLOAT16_H_
+#include <string.h>
+#include <stdint.h>
+#include "difacto/base.h"
+namespace difacto {
+
+/** \brief convert a float into fp16, rounding to the nearest even */
+inline uint16_t FloatToHalf(real_t f) {
+  uint32_t x; memcpy(&x, &f, 4);
+  uint32_t sign = (x >> 16) & 0x8000;
+  int exp = ((x >> 23) & 0xff) - 127 + 15;
+  uint32_t mant = x & 0x7fffff;
+  if (((x >> 23) & 0xff) == 0xff) {  // inf or nan
+    return sign | 0x7c00 | (mant ? 0x200 : 0);
+  }
+  if (exp >= 31) return sign | 0x7c00;  // overflow
+  if (exp <= 0) {  // subnormal or zero
+    if (exp < -10) return sign;
+    mant |= 0x800000;
+    int shift = 14 - exp;
+    uint32_t h = mant >> shift;
+    uint32_t rem = mant & ((1u << shift) - 1), half = 1u << (shift - 1);
+    if (rem > half || (rem == half && (h & 1))) ++h;
+    return sign | h;
+  }
+  uint32_t h = (exp << 10) | (mant >> 13);
+  uint32_t rem = mant & 0x1fff;
+  if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) ++h;
+  return sign | h;
+}
+
+/** \brief convert a fp16 into float */
+inline real_t HalfToFloat(uint16_t h) {
+  uint32_t sign = (h & 0x8000) << 16;
+  int exp = (h >> 10) & 0x1f;
+  uint32_t mant = h & 0x3ff;
+  uint32_t x;
+  if (exp == 0x1f) {
+    x = sign | 0x7f800000 | (mant << 13);
+  } else if (exp == 0) {
+    if (mant == 0) {
+      x = sign;
+    } else {  // subnormal
+      exp = 1;
+      while (!(mant & 0x400)) { mant <<= 1; --exp; }
+      mant &= 0x3ff;
+      x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+    }
+  } else {
+    x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+  }
+  real_t f; memcpy(&f, &x, 4);
+  return f;
+}
+
+/** \brief convert a float into bf16, rounding to the nearest even */
+inline uint16_t FloatToBF16(real_t f) {
+  uint32_t x; memcpy(&x, &f, 4);
+  if ((x & 0x7fffffff) > 0x7f800000) return (x >> 16) | 0x40;  // nan
+  x += 0x7fff + ((x >> 16) & 1);
+  return x >> 16;
+}
+
+/** \brief convert a bf16 into float */
+inline real_t BF16ToFloat(uint16_t h) {
+  uint32_t x = static_cast<uint32_t>(h) << 16;
+  real_t f; memcpy(&f, &x, 4);
+  return f;
+}
+
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_FLOAT16_H_
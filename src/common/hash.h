@@ -0,0 +1,87 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_COMMON_HASH_H_
+#define DIFACTO_COMMON_HASH_H_
+#include <string.h>
+#include <stdint.h>
+#if DIFACTO_USE_CITY
+#include <city.h>
+#endif  // DIFACTO_USE_CITY
+namespace difacto {
+namespace hash {
+
+/** \brief the xor of the high and low halves of a * b */
+inline uint64_t Mix(uint64_t a, uint64_t b) {
+  __uint128_t r = static_cast<__uint128_t>(a) * b;
+  return static_cast<uint64_t>(r) ^ static_cast<uint64_t>(r >> 64);
+}
+
+inline uint64_t Read8(const char* p) {
+  uint64_t v; memcpy(&v, p, 8); return v;
+}
+
+inline uint64_t Read4(const char* p) {
+  uint32_t v; memcpy(&v, p, 4); return v;
+}
+
+/**
+ * \brief a 64-bit hash of a byte string, in the style of wyhash
+ *
+ * a string of at most 16 bytes, which is the common case of a feature
+ * token, costs two 128-bit multiplications and no loop
+ */
+inline uint64_t Bytes(const char* p, size_t len, uint64_t seed = 0) {
+  const uint64_t s0 = 0xa0761d6478bd642full, s1 = 0xe7037ed1a0b428dbull;
+  seed ^= Mix(seed ^ s0, s1);
+  uint64_t a, b;
+  if (len <= 16) {
+    if (len >= 4) {
+      size_t d = (len >> 3) << 2;
+      a = (Read4(p) << 32) | Read4(p + d);
+      b = (Read4(p + len - 4) << 32) | Read4(p + len - 4 - d);
+    } else if (len > 0) {
+      const unsigned char* q = reinterpret_cast<const unsigned char*>(p);
+      a = (static_cast<uint64_t>(q[0]) << 16) |
+          (static_cast<uint64_t>(q[len >> 1]) << 8) | q[len - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = len;
+    for (; i > 16; i -= 16, p += 16) {
+      seed = Mix(Read8(p) ^ s1, Read8(p + 8) ^ seed);
+    }
+    // the last 16 bytes, may overlap with the ones above
+    a = Read8(p + i - 16);
+    b = Read8(p + i - 8);
+  }
+  __uint128_t r = static_cast<__uint128_t>(a ^ s1) * (b ^ seed);
+  return Mix(static_cast<uint64_t>(r) ^ s0 ^ len,
+             static_cast<uint64_t>(r >> 64) ^ s1);
+}
+
+/** \brief a 64-bit hash of an integer, the splitmix64 finalizer */
+inline uint64_t Int(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+/**
+ * \brief the hash used for the text features, CityHash64 if compiled with
+ * USE_CITY=1, otherwise \ref Bytes
+ */
+inline uint64_t String(const char* p, size_t len) {
+#if DIFACTO_USE_CITY
+  return CityHash64(p, len);
+#else
+  return Bytes(p, len);
+#endif  // DIFACTO_USE_CITY
+}
+
+}  // namespace hash
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_HASH_H_
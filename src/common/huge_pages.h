@@ -0,0 +1,212 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_COMMON_HUGE_PAGES_H_
+#define DIFACTO_COMMON_HUGE_PAGES_H_
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <memory>
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+#include "dmlc/logging.h"
+#include "dmlc/parameter.h"
+#include "difacto/sarray.h"
+namespace difacto {
+
+struct HugePageParam : public dmlc::Parameter<HugePageParam> {
+  /**
+   * \brief back the large arrays, namely the model, the optimizer states and
+   * the tiles, by huge pages.
+   * 0: normal pages,
+   * 1: transparent huge pages by madvise,
+   * 2: 2MB hugetlb pages,
+   * 3: 1GB hugetlb pages.
+   * it falls back to the next one if the pages are not available
+   */
+  int huge_pages;
+  /**
+   * \brief lock the large arrays in memory, so they are never swapped out
+   * and their physical addresses are fixed for DMA
+   */
+  int mem_lock;
+  DMLC_DECLARE_PARAMETER(HugePageParam) {
+    DMLC_DECLARE_FIELD(huge_pages).set_range(0, 3).set_default(0);
+    DMLC_DECLARE_FIELD(mem_lock).set_range(0, 1).set_default(0);
+  }
+};
+
+/**
+ * \brief allocates the large arrays from huge pages
+ *
+ * a random access into a large array misses the TLB on almost every access
+ * with 4KB pages, while a 2MB page covers 512 times more memory by an entry.
+ * an array of at least 2MB is mapped by mmap, as hugetlb pages, or as normal
+ * pages advised to be merged into transparent huge pages. the smaller ones,
+ * and all if not enabled, use the normal allocator. the memory is always
+ * zero-initialized. thread-safe
+ */
+class HugePages {
+ public:
+  /** \brief the smallest huge page, an array smaller than it is not mapped */
+  static const size_t kPageSize = 2 << 20;
+  static const size_t kGiantPageSize = 1 << 30;
+
+  static HugePages* Get() {
+    static HugePages pages;
+    return &pages;
+  }
+
+  void Init(const HugePageParam& param) {
+    mode_ = param.huge_pages;
+    lock_ = param.mem_lock;
+  }
+
+  /** \brief huge pages or locking is enabled */
+  bool Enabled() const { return mode_ > 0 || lock_; }
+
+  /**
+   * \brief returns bytes of zeros, which are released once the last copy of
+   * the pointer is gone
+   */
+  std::shared_ptr<char> Alloc(size_t bytes) {
+#if defined(__linux__)
+    if (Enabled() && bytes >= kPageSize) {
+      size_t len = 0;
+      bool huge = false;
+      char* p = Map(bytes, &len, &huge);
+      if (p) {
+        bool locked = lock_ && mlock(p, len) == 0;
+        if (lock_ && !locked) {
+          Warn(&warned_lock_, "failed to lock the memory, see ulimit -l");
+        }
+        if (huge) huge_bytes_ += len;
+        if (locked) locked_bytes_ += len;
+        return std::shared_ptr<char>(p, [this, len, huge, locked](char* p) {
+            if (huge) huge_bytes_ -= len;
+            if (locked) locked_bytes_ -= len;
+            munmap(p, len);
+          });
+      }
+    }
+#endif
+    return std::shared_ptr<char>(new char[bytes](),
+                                 std::default_delete<char[]>());
+  }
+
+  /** \brief returns n zero-initialized items */
+  template <typename V>
+  SArray<V> New(size_t n) {
+    if (!Enabled() || n * sizeof(V) < kPageSize) return SArray<V>(n, 0);
+    auto buf = Alloc(n * sizeof(V));
+    SArray<V> arr;
+    arr.reset(reinterpret_cast<V*>(buf.get()), n, [buf](V*) { });
+    return arr;
+  }
+
+  /** \brief returns a copy of src */
+  template <typename V>
+  SArray<V> Copy(const SArray<V>& src) {
+    if (!Enabled() || src.size() * sizeof(V) < kPageSize) {
+      SArray<V> dst; dst.CopyFrom(src);
+      return dst;
+    }
+    SArray<V> dst = New<V>(src.size());
+    memcpy(dst.data(), src.data(), src.size() * sizeof(V));
+    return dst;
+  }
+
+  /** \brief the bytes mapped by hugetlb pages, or advised to be huge pages */
+  size_t HugeBytes() const { return huge_bytes_; }
+  /** \brief the bytes locked in memory */
+  size_t LockedBytes() const { return locked_bytes_; }
+
+ private:
+  HugePages() { }
+
+#if defined(__linux__)
+  /**
+   * \brief map at least bytes of memory by the enabled pages, len is the bytes
+   * mapped, and huge is true if they are huge pages. returns nullptr if failed
+   */
+  char* Map(size_t bytes, size_t* len, bool* huge) {
+#ifdef MAP_HUGETLB
+    if (mode_ == 3 && bytes >= kGiantPageSize) {
+      char* p = MapHugeTLB(bytes, kGiantPageSize, 30, len);
+      if (p) { *huge = true; return p; }
+      Warn(&warned_giant_, "1GB hugetlb pages are not available, "
+           "see /proc/sys/vm/nr_hugepages or hugepagesz=1G");
+    }
+    if (mode_ >= 2) {
+      char* p = MapHugeTLB(bytes, kPageSize, 21, len);
+      if (p) { *huge = true; return p; }
+      Warn(&warned_huge_, "2MB hugetlb pages are not available, "
+           "fall back to transparent huge pages");
+    }
+#endif  // MAP_HUGETLB
+    return MapAnonymous(bytes, len, huge);
+  }
+
+#ifdef MAP_HUGETLB
+  /** \brief the bits of the page size in the mmap flags, as MAP_HUGE_SHIFT */
+  static const int kHugeShift = 26;
+  /** \brief map hugetlb pages of 2^shift bytes */
+  char* MapHugeTLB(size_t bytes, size_t page, int shift, size_t* len) {
+    size_t n = RoundUp(bytes, page);
+    void* p = mmap(nullptr, n, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << kHugeShift),
+                   -1, 0);
+    if (p == MAP_FAILED) return nullptr;
+    *len = n;
+    return static_cast<char*>(p);
+  }
+#endif  // MAP_HUGETLB
+
+  /**
+   * \brief map normal pages aligned to kPageSize, which are advised to be
+   * transparent huge pages if enabled
+   */
+  char* MapAnonymous(size_t bytes, size_t* len, bool* huge) {
+    size_t n = RoundUp(bytes, kPageSize);
+    // over map a page, and then trim it into an aligned one
+    void* p = mmap(nullptr, n + kPageSize, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return nullptr;
+    uintptr_t begin = reinterpret_cast<uintptr_t>(p);
+    uintptr_t aligned = RoundUp(begin, kPageSize);
+    if (aligned > begin) munmap(p, aligned - begin);
+    size_t tail = begin + n + kPageSize - (aligned + n);
+    if (tail) munmap(reinterpret_cast<char*>(aligned + n), tail);
+    char* q = reinterpret_cast<char*>(aligned);
+#ifdef MADV_HUGEPAGE
+    if (mode_ > 0) {
+      *huge = madvise(q, n, MADV_HUGEPAGE) == 0;
+      if (!*huge) {
+        Warn(&warned_thp_, "transparent huge pages are not available");
+      }
+    }
+#endif  // MADV_HUGEPAGE
+    *len = n;
+    return q;
+  }
+#endif  // defined(__linux__)
+
+  static size_t RoundUp(size_t x, size_t page) {
+    return (x + page - 1) / page * page;
+  }
+
+  /** \brief warn only once */
+  static void Warn(std::atomic<bool>* warned, const char* msg) {
+    if (!warned->exchange(true)) LOG(WARNING) << msg;
+  }
+
+  int mode_ = 0;
+  bool lock_ = false;
+  std::atomic<size_t> huge_bytes_{0}, locked_bytes_{0};
+  std::atomic<bool> warned_giant_{false}, warned_huge_{false};
+  std::atomic<bool> warned_thp_{false}, warned_lock_{false};
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_HUGE_PAGES_H_
@@ -0,0 +1,92 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_COMMON_KEY_RANGES_H_
+#define DIFACTO_COMMON_KEY_RANGES_H_
+#include <algorithm>
+#include <numeric>
+#include <vector>
+#include "difacto/base.h"
+#include "difacto/sarray.h"
+#include "dmlc/logging.h"
+namespace difacto {
+
+/**
+ * \brief the key ranges of the servers balanced by the loads of the keys
+ *
+ * the key space is divided into buckets by the top bits of a key, which are
+ * well spread since the feature ids are byte reversed. the loads of the
+ * buckets are counted on a sample of the data, and each server then owns
+ * consecutive buckets with about the same load. a frequent key still lives
+ * in a single bucket, so a server owns at least the load of its hottest key.
+ */
+class KeyRanges {
+ public:
+  /** \brief the number of buckets */
+  static size_t NumBuckets() { return 1 << 16; }
+
+  /** \brief the bucket of a key */
+  static size_t Bucket(feaid_t key) { return key >> 48; }
+
+  /** \brief add load into the buckets of a list of keys */
+  static void Add(const SArray<feaid_t>& keys, real_t load,
+                  std::vector<real_t>* hist) {
+    hist->resize(NumBuckets());
+    for (feaid_t k : keys) (*hist)[Bucket(k)] += load;
+  }
+
+  /**
+   * \brief split the key space [0, end) into num_servers ranges
+   *
+   * @param hist the loads of the buckets, the buckets are even if all are 0
+   * @param num_servers the number of ranges
+   * @param end the end of the key space
+   * @return the bounds, server j owns [bounds[j], bounds[j+1]), each has at
+   * least one bucket
+   */
+  static std::vector<feaid_t> Balance(const std::vector<real_t>& hist,
+                                      int num_servers, feaid_t end) {
+    size_t nb = NumBuckets();
+    CHECK_EQ(hist.size(), nb);
+    CHECK_GT(num_servers, 0);
+    CHECK_LE(static_cast<size_t>(num_servers), nb);
+    real_t total = std::accumulate(hist.begin(), hist.end(), (real_t)0);
+    // the load of a bucket
+    auto load = [&hist, total](size_t b) { return total > 0 ? hist[b] : 1; };
+    if (total <= 0) total = nb;
+    std::vector<feaid_t> bounds(num_servers + 1);
+    bounds[0] = 0;
+    bounds[num_servers] = end;
+    // range j-1 starts at bucket first, and sum is the load before c
+    size_t c = 0, first = 0;
+    real_t sum = 0;
+    for (int j = 1; j < num_servers; ++j) {
+      // the remaining load is split evenly among the remaining ranges
+      real_t target = sum + (total - sum) / (num_servers - j + 1);
+      size_t last = nb - (num_servers - j);
+      real_t pre = sum;
+      sum += load(c++);
+      while (c < last && sum < target) {
+        pre = sum;
+        sum += load(c++);
+      }
+      // leave the last bucket to the next range if the cut gets closer
+      if (c - 1 > first && target - pre < sum - target) {
+        sum = pre;
+        --c;
+      }
+      bounds[j] = static_cast<feaid_t>(c) << 48;
+      first = c;
+    }
+    return bounds;
+  }
+
+  /** \brief the server owning a key, where bounds is from \ref Balance */
+  static int Server(const std::vector<feaid_t>& bounds, feaid_t key) {
+    return static_cast<int>(std::upper_bound(
+        bounds.begin() + 1, bounds.end() - 1, key) - bounds.begin()) - 1;
+  }
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_KEY_RANGES_H_
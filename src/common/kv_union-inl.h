@@ -0,0 +1,102 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_COMMON_KV_UNION_INL_H_
+#define DIFACTO_COMMON_KV_UNION_INL_H_
+#include <algorithm>
+namespace difacto {
+
+/**
+ * \brief the first position in [key, key_end) whose key is not less than x,
+ * by galloping forward from key, internal use
+ *
+ * it costs O(log d), where d is the distance to the result, so skipping a
+ * short run of a long list is much cheaper than a binary search over the
+ * whole list
+ */
+template <typename K>
+const K* KVGallop(const K* key, const K* key_end, K x) {
+  size_t n = std::distance(key, key_end);
+  size_t lo = 0, step = 1;
+  while (lo + step < n && key[lo + step] < x) {
+    lo += step; step *= 2;
+  }
+  return std::lower_bound(key + lo, key + std::min(lo + step + 1, n), x);
+}
+
+/**
+ * \brief merge two sorted key-value lists in a single pass, internal use
+ *
+ * a value only in list a is copied, a value only in list b is (0 op b), and
+ * a matched value is (a op b), which agrees with assigning a and then
+ * matching b with op. if one list is much longer, the runs between two keys
+ * of the shorter one are found by galloping and copied in bulk.
+ *
+ * \tparam kWrite if false, only counts the number of joined keys
+ * \param key_a start of keys a
+ * \param key_a_end end of keys a
+ * \param val_a start of values a
+ * \param key_b start of keys b
+ * \param key_b_end end of keys b
+ * \param val_b start of values b
+ * \param k length of a single value
+ * \param op assignment operator
+ * \param key start of the joined keys
+ * \param val start of the joined values
+ * \return the number of joined keys
+ */
+template <bool kWrite, typename K, typename V>
+size_t KVUnionMerge(
+    const K* key_a, const K* key_a_end, const V* val_a,
+    const K* key_b, const K* key_b_end, const V* val_b,
+    int k, AssignOp op, K* key, V* val) {
+  static const size_t kGallopRatio = 8;
+  size_t size_a = std::distance(key_a, key_a_end);
+  size_t size_b = std::distance(key_b, key_b_end);
+  bool gallop_a = size_a > kGallopRatio * size_b;
+  bool gallop_b = size_b > kGallopRatio * size_a;
+  size_t n = 0;
+  auto copy_a = [&](const K* end) {
+    size_t m = end - key_a;
+    if (kWrite) {
+      std::copy(key_a, end, key + n);
+      std::copy(val_a, val_a + m * k, val + n * k);
+    }
+    key_a = end; val_a += m * k; n += m;
+  };
+  auto copy_b = [&](const K* end) {
+    size_t m = end - key_b;
+    if (kWrite) {
+      std::copy(key_b, end, key + n);
+      V* v = val + n * k;
+      std::fill(v, v + m * k, 0);
+      for (size_t i = 0; i < m * k; ++i) AssignFunc(val_b[i], op, v + i);
+    }
+    key_b = end; val_b += m * k; n += m;
+  };
+  while (key_a != key_a_end && key_b != key_b_end) {
+    if (*key_a < *key_b) {
+      copy_a(gallop_a ? KVGallop(key_a, key_a_end, *key_b) : key_a + 1);
+    } else if (*key_b < *key_a) {
+      copy_b(gallop_b ? KVGallop(key_b, key_b_end, *key_a) : key_b + 1);
+    } else {
+      if (kWrite) {
+        key[n] = *key_a;
+        V* v = val + n * k;
+        for (int i = 0; i < k; ++i) {
+          v[i] = val_a[i];
+          AssignFunc(val_b[i], op, v + i);
+        }
+      }
+      ++key_a; val_a += k;
+      ++key_b; val_b += k;
+      ++n;
+    }
+  }
+  copy_a(key_a_end);
+  copy_b(key_b_end);
+  return n;
+}
+
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_KV_UNION_INL_H_
@@ -5,12 +5,19 @@
 #define DIFACTO_COMMON_KV_UNION_H_
 #include <vector>
 #include "./kv_match.h"
-namespace difacto {
+#include "./range.h"
+#include "./task_scheduler.h"
+/** \brief implementation */
+#include "./kv_union-inl.h"
 
+namespace difacto {
 
 /**
  * \brief Join two key-value lists
  *
+ * keys and values are merged in a single pass, which is parallelized by
+ * partitioning the key range with binary search
+ *
  * \code
  * key_a = {1,2,3};
  * val_a = {2,3,4};
@@ -52,23 +59,55 @@ void KVUnion(
     return;
   }
 
-  // merge keys
-  CHECK_NOTNULL(joined_keys)->resize(keys_a.size() + keys_b.size());
-  auto end = std::set_union(keys_a.begin(), keys_a.end(), keys_b.begin(), keys_b.end(),
-                            joined_keys->begin());
-  joined_keys->resize(end - joined_keys->begin());
-
-  // merge value of list a
   size_t val_len = vals_a.size() / keys_a.size();
-  CHECK_NOTNULL(joined_vals)->clear();
-  size_t n1 = KVMatch<K, V>(
-      keys_a, vals_a, *joined_keys, joined_vals, ASSIGN, num_threads);
-  CHECK_EQ(n1, keys_a.size() * val_len);
+  CHECK_EQ(keys_a.size() * val_len, vals_a.size());
+  CHECK_EQ(keys_b.size() * val_len, vals_b.size());
+  CHECK_NOTNULL(joined_keys);
+  CHECK_NOTNULL(joined_vals);
+
+  // partition the key range by the keys of the longer list, so the parts can
+  // be merged independently
+  const SArray<K>& keys_l = keys_a.size() > keys_b.size() ? keys_a : keys_b;
+  const size_t kGrainSize = 1 << 16;
+  size_t size = keys_a.size() + keys_b.size();
+  int nparts = size < kGrainSize ? 1 :
+      std::min(num_threads, static_cast<int>(keys_l.size()));
+  std::vector<size_t> pos_a(nparts + 1), pos_b(nparts + 1);
+  pos_a[0] = pos_b[0] = 0;
+  pos_a[nparts] = keys_a.size();
+  pos_b[nparts] = keys_b.size();
+  for (int i = 1; i < nparts; ++i) {
+    K x = keys_l[Range(0, keys_l.size()).Segment(i, nparts).begin];
+    pos_a[i] = std::lower_bound(keys_a.begin(), keys_a.end(), x)
+               - keys_a.begin();
+    pos_b[i] = std::lower_bound(keys_b.begin(), keys_b.end(), x)
+               - keys_b.begin();
+  }
 
-  // merge value list b
-  auto n2 = KVMatch<K, V>(
-      keys_b, vals_b, *joined_keys, joined_vals, op, num_threads);
-  CHECK_EQ(n2, keys_b.size() * val_len);
+  // count the joined keys of each part, then merge into the right place
+  int k = static_cast<int>(val_len);
+  std::vector<size_t> start(nparts + 1, 0);
+  ParallelRun(nparts, [&](int i, int nt) {
+      start[i+1] = KVUnionMerge<false, K, V>(
+          keys_a.data() + pos_a[i], keys_a.data() + pos_a[i+1],
+          vals_a.data() + pos_a[i] * val_len,
+          keys_b.data() + pos_b[i], keys_b.data() + pos_b[i+1],
+          vals_b.data() + pos_b[i] * val_len,
+          k, op, nullptr, nullptr);
+    });
+  for (int i = 0; i < nparts; ++i) start[i+1] += start[i];
+  SArray<K> keys(start[nparts]);
+  SArray<V> vals(start[nparts] * val_len);
+  ParallelRun(nparts, [&](int i, int nt) {
+      KVUnionMerge<true, K, V>(
+          keys_a.data() + pos_a[i], keys_a.data() + pos_a[i+1],
+          vals_a.data() + pos_a[i] * val_len,
+          keys_b.data() + pos_b[i], keys_b.data() + pos_b[i+1],
+          vals_b.data() + pos_b[i] * val_len,
+          k, op, keys.data() + start[i], vals.data() + start[i] * val_len);
+    });
+  *joined_keys = keys;
+  *joined_vals = vals;
 }
 
 /**
@@ -3,15 +3,19 @@
  */
 #ifndef DIFACTO_COMMON_LEARNER_UTILS_H_
 #define DIFACTO_COMMON_LEARNER_UTILS_H_
+#include <functional>
 #include <utility>
 #include <string>
+#include <thread>
 #include <vector>
 #include "difacto/tracker.h"
 #include "dmlc/io.h"
 #include "dmlc/memory_io.h"
+#include "dmlc/timer.h"
 namespace difacto {
 /**
- * \brief send jobs to a node group and wait them finished.
+ * \brief send a job to every node in a group and wait them finished. the
+ * results of the nodes are summed.
  *
  * @param node_group
  * @param job_args
@@ -39,15 +43,45 @@ inline void SendJobAndWait(int node_group,
   tracker->SetMonitor(monitor);
 
   // sent job
-  std::pair<int, std::string> job;
-  job.first = node_group;
-  job.second = job_args;
-  tracker->Issue({job});
+  tracker->Broadcast(node_group, job_args);
 
   // wait until finished
-  while (tracker->NumRemains() != 0) {
-    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  tracker->WaitRemains(0);
+}
+
+/**
+ * \brief returns true if a checkpoint is due after an epoch
+ *
+ * @param epoch the epoch just finished
+ * @param every_epochs checkpoint every these epochs, 0 means never
+ * @param every_sec checkpoint if these seconds passed since the last one, 0
+ * means never
+ * @param last the time of the last checkpoint, reset if it is due
+ */
+inline bool CheckpointDue(int epoch, int every_epochs, int every_sec,
+                          double* last) {
+  double now = dmlc::GetTime();
+  bool due = (every_epochs > 0 && (epoch + 1) % every_epochs == 0) ||
+             (every_sec > 0 && now - *last >= every_sec);
+  if (due) *last = now;
+  return due;
+}
+
+/**
+ * \brief read the part rank of num_workers parts by nsubs sub-partitions
+ * concurrently, namely the parts rank * nsubs, ..., (rank + 1) * nsubs - 1 of
+ * num_workers * nsubs parts. read(part_index, num_parts) is called by a
+ * thread per sub-partition
+ */
+inline void ReadSubParts(int rank, int num_workers, int nsubs,
+                         const std::function<void(int, int)>& read) {
+  std::vector<std::thread> threads;
+  int nparts = num_workers * nsubs;
+  for (int k = 1; k < nsubs; ++k) {
+    threads.emplace_back(read, rank * nsubs + k, nparts);
   }
+  read(rank * nsubs, nparts);
+  for (auto& t : threads) t.join();
 }
 }  // namespace difacto
 #endif  // DIFACTO_COMMON_LEARNER_UTILS_H_
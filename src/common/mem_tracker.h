@@ -0,0 +1,134 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_COMMON_MEM_TRACKER_H_
+#define DIFACTO_COMMON_MEM_TRACKER_H_
+#include <stdint.h>
+#include <atomic>
+#include <sstream>
+#include <string>
+#include "dmlc/parameter.h"
+namespace difacto {
+
+struct MemTrackerParam : public dmlc::Parameter<MemTrackerParam> {
+  /**
+   * \brief the memory budget in MB of a node, 0 means no budget. once it is
+   * exceeded, the tile store spills to disk, V is not allocated for more
+   * features, and the data caches, the shuffle buffer and the quantization
+   * errors of the gradient compression stop growing
+   */
+  float mem_budget_mb;
+  DMLC_DECLARE_PARAMETER(MemTrackerParam) {
+    DMLC_DECLARE_FIELD(mem_budget_mb).set_lower_bound(0).set_default(0);
+  }
+};
+
+/**
+ * \brief the bytes used by each subsystem of this process
+ *
+ * the owners of large buffers report their sizes by \ref MemGauge, so the
+ * total is only what is accounted, not the resident memory. the counters are
+ * atomic, and a query costs a few relaxed loads
+ */
+class MemTracker {
+ public:
+  enum Type {
+    /** \brief the tiles, the cached batches */
+    kData,
+    /** \brief the weights */
+    kModel,
+    /** \brief the optimizer states */
+    kAux,
+    /** \brief the buffers used in computation, such as the predictions */
+    kScratch,
+    /** \brief the read buffers, such as the shuffle buffer */
+    kIO,
+    kNum
+  };
+  static const char* Name(int type) {
+    static const char* names[] = {"data", "model", "aux", "scratch", "io"};
+    return names[type];
+  }
+
+  static MemTracker* Get() {
+    static MemTracker tracker;
+    return &tracker;
+  }
+
+  /** \brief add bytes into a type, negative to release */
+  void Add(int type, int64_t bytes) {
+    bytes_[type].fetch_add(bytes, std::memory_order_relaxed);
+  }
+
+  int64_t Bytes(int type) const {
+    return bytes_[type].load(std::memory_order_relaxed);
+  }
+
+  int64_t Total() const {
+    int64_t total = 0;
+    for (int i = 0; i < kNum; ++i) total += Bytes(i);
+    return total;
+  }
+
+  /** \brief set the budget in bytes, 0 means no budget */
+  void SetBudget(size_t bytes) { budget_ = bytes; }
+
+  size_t budget() const { return budget_; }
+
+  /** \brief returns true if allocating bytes more exceeds the budget */
+  bool Exceeds(size_t bytes) const {
+    size_t budget = budget_;
+    return budget > 0 && Total() + static_cast<int64_t>(bytes) >
+        static_cast<int64_t>(budget);
+  }
+
+  /** \brief the MB of each type and the total */
+  std::string TextString() const {
+    std::stringstream ss;
+    ss.precision(4);
+    for (int i = 0; i < kNum; ++i) {
+      ss << Name(i) << " = " << Bytes(i) / 1e6 << ", ";
+    }
+    ss << "total = " << Total() / 1e6;
+    if (budget_ > 0) ss << " / " << budget_ / 1e6;
+    ss << " MB";
+    return ss.str();
+  }
+
+ private:
+  MemTracker() {
+    for (int i = 0; i < kNum; ++i) bytes_[i] = 0;
+  }
+  std::atomic<int64_t> bytes_[kNum];
+  std::atomic<size_t> budget_{0};
+};
+
+/**
+ * \brief the bytes of an owner accounted into a type, which are released
+ * when it is destroyed
+ */
+class MemGauge {
+ public:
+  explicit MemGauge(int type) : type_(type) { }
+  ~MemGauge() { Set(0); }
+  MemGauge(const MemGauge&) = delete;
+  MemGauge& operator=(const MemGauge&) = delete;
+
+  /** \brief the owner uses bytes now */
+  void Set(size_t bytes) {
+    size_t prev = bytes_.exchange(bytes, std::memory_order_relaxed);
+    if (prev != bytes) {
+      MemTracker::Get()->Add(type_, static_cast<int64_t>(bytes) -
+                             static_cast<int64_t>(prev));
+    }
+  }
+
+  size_t bytes() const { return bytes_.load(std::memory_order_relaxed); }
+
+ private:
+  int type_;
+  std::atomic<size_t> bytes_{0};
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_MEM_TRACKER_H_
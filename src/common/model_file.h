@@ -0,0 +1,307 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ * @file   model_file.h
+ * @brief  the binary model format shared by all updaters
+ */
+#ifndef DIFACTO_COMMON_MODEL_FILE_H_
+#define DIFACTO_COMMON_MODEL_FILE_H_
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <memory>
+#include "difacto/base.h"
+#include "difacto/sarray.h"
+#include "dmlc/io.h"
+namespace difacto {
+
+/**
+ * \brief a model stored in columns (SoA)
+ *
+ * the binary layout is
+ *
+ *    header | feaids | w | V_idx | V | aux_w[0] ... aux_w[k-1] | aux_V
+ *
+ * - feaids: num_feas sorted feature ids
+ * - w: the weights, num_feas floats
+ * - V_idx: the row of a feature in V, -1 means no V. exists if V_dim > 0
+ * - V: num_V x V_dim floats. exists if V_dim > 0. if the header has V_int8,
+ *   it is replaced by V_q, num_V x V_dim int8, and V_scale, num_V floats,
+ *   where a row of V is V_q * V_scale
+ * - aux_w: the aux data for w, k columns with num_feas floats each. optional
+ * - aux_V: the aux data for V, the same shape as V. optional
+ *
+ * every column starts at a multiple of 8 bytes, so a file can be memory mapped
+ * and then the columns are used in place, see \ref Map
+ */
+struct ModelFile {
+  static const uint64_t kMagic = 0x4c45444f4d464944ULL;  // "DIFMODEL"
+  /** \brief the file header */
+  struct Header {
+    uint64_t magic = kMagic;
+    uint32_t version = 2;
+    int32_t V_dim = 0;
+    uint64_t num_feas = 0;
+    uint64_t num_V = 0;
+    uint32_t num_aux_w = 0;
+    uint32_t has_aux_V = 0;
+    /** \brief added in version 2 */
+    uint32_t V_int8 = 0;
+    uint32_t hash_capacity = 0;
+  };
+  /** \brief the header size of version 1 */
+  static const size_t kHeaderV1 = 40;
+
+  int V_dim = 0;
+  /**
+   * \brief the number of hashed slots, 0 means not hashed. if hashed, the
+   * feaids are the slots, and a feature id is in slot \ref HashSlot
+   */
+  uint32_t hash_capacity = 0;
+  SArray<feaid_t> feaids;
+  SArray<real_t> w;
+  SArray<int> V_idx;
+  SArray<real_t> V;
+  /** \brief the int8 V and the scale of each row, empty if not quantized */
+  SArray<int8_t> V_q;
+  SArray<real_t> V_scale;
+  std::vector<SArray<real_t>> aux_w;
+  SArray<real_t> aux_V;
+
+  /** \brief returns true if aux data exist */
+  bool has_aux() const { return aux_w.size() || aux_V.size(); }
+
+  /** \brief returns the V of the i-th feature, nullptr if not exists */
+  real_t const* GetV(size_t i) const {
+    return V_idx.empty() || V_idx[i] < 0 ? nullptr : V.data() + V_idx[i] * V_dim;
+  }
+
+  /** \brief returns the slot of a feature id in a hashed model */
+  static feaid_t HashSlot(feaid_t id, uint32_t capacity) {
+    return HashFeaID(id) % capacity;
+  }
+
+  /** \brief returns true if V is stored in int8 */
+  bool quantized() const { return V_scale.size() > 0; }
+
+  /**
+   * \brief store V in int8 with a scale per row, which is max |V| / 127. V is
+   * kept, so the model still can be used
+   */
+  void Quantize() {
+    CHECK(aux_V.empty()) << "cannot quantize a model with aux data";
+    size_t num_V = V_dim > 0 ? V.size() / V_dim : 0;
+    V_q.resize(num_V * V_dim);
+    V_scale.resize(num_V);
+    for (size_t i = 0; i < num_V; ++i) {
+      real_t const* v = V.data() + i * V_dim;
+      real_t m = 0;
+      for (int j = 0; j < V_dim; ++j) m = std::max(m, std::fabs(v[j]));
+      real_t scale = m / 127;
+      V_scale[i] = scale;
+      for (int j = 0; j < V_dim; ++j) {
+        V_q[i * V_dim + j] = scale == 0 ? 0 : static_cast<int8_t>(
+            std::lround(v[j] / scale));
+      }
+    }
+  }
+
+  /** \brief the bytes of the file written by \ref Save */
+  size_t NumBytes() const {
+    size_t n = feaids.size(), bytes = sizeof(Header);
+    auto col = [](size_t b) { return b + Padding(b); };
+    bytes += col(n * sizeof(feaid_t)) + col(n * sizeof(real_t));
+    if (V_dim > 0) {
+      bytes += col(n * sizeof(int));
+      if (quantized()) {
+        bytes += col(V_q.size()) + col(V_scale.size() * sizeof(real_t));
+      } else {
+        bytes += col(V.size() * sizeof(real_t));
+      }
+    }
+    bytes += aux_w.size() * col(n * sizeof(real_t));
+    bytes += col(aux_V.size() * sizeof(real_t));
+    return bytes;
+  }
+
+  /** \brief write into a stream */
+  void Save(dmlc::Stream* fo) const {
+    size_t n = feaids.size();
+    CHECK_EQ(w.size(), n);
+    Header h;
+    h.V_dim = V_dim;
+    h.num_feas = n;
+    h.num_V = V_dim > 0 ? (quantized() ? V_scale.size() : V.size() / V_dim) : 0;
+    h.num_aux_w = aux_w.size();
+    h.has_aux_V = !aux_V.empty();
+    h.V_int8 = quantized();
+    h.hash_capacity = hash_capacity;
+    fo->Write(&h, sizeof(h));
+    WriteColumn(feaids, fo);
+    WriteColumn(w, fo);
+    if (V_dim > 0) {
+      CHECK_EQ(V_idx.size(), n);
+      WriteColumn(V_idx, fo);
+      if (h.V_int8) {
+        WriteColumn(V_q, fo);
+        WriteColumn(V_scale, fo);
+      } else {
+        WriteColumn(V, fo);
+      }
+    }
+    for (const auto& a : aux_w) {
+      CHECK_EQ(a.size(), n);
+      WriteColumn(a, fo);
+    }
+    if (h.has_aux_V) {
+      CHECK_EQ(aux_V.size(), V.size());
+      WriteColumn(aux_V, fo);
+    }
+  }
+
+  /**
+   * \brief read from a stream
+   * @param load_aux whether or not to load the aux data
+   * @param dequantize whether to fill V if it is stored in int8
+   */
+  void Load(dmlc::Stream* fi, bool load_aux = true, bool dequantize = true) {
+    Header h;
+    size_t v1 = kHeaderV1;
+    CHECK_EQ(fi->Read(&h, v1), v1) << "empty model file";
+    CHECK(h.magic == kMagic) << "not a difacto model file";
+    if (h.version >= 2) {
+      size_t rest = sizeof(h) - v1;
+      CHECK_EQ(fi->Read(reinterpret_cast<char*>(&h) + v1, rest), rest);
+    }
+    V_dim = h.V_dim;
+    hash_capacity = h.hash_capacity;
+    size_t n = h.num_feas, nV = h.num_V * h.V_dim;
+    ReadColumn(n, fi, &feaids);
+    ReadColumn(n, fi, &w);
+    V.clear(); V_q.clear(); V_scale.clear();
+    if (V_dim > 0) {
+      ReadColumn(n, fi, &V_idx);
+      if (h.V_int8) {
+        ReadColumn(nV, fi, &V_q);
+        ReadColumn(h.num_V, fi, &V_scale);
+        if (dequantize) Dequantize();
+      } else {
+        ReadColumn(nV, fi, &V);
+      }
+    }
+    aux_w.clear(); aux_V.clear();
+    if (!load_aux) return;
+    aux_w.resize(h.num_aux_w);
+    for (auto& a : aux_w) ReadColumn(n, fi, &a);
+    if (h.has_aux_V) ReadColumn(nV, fi, &aux_V);
+  }
+
+  /**
+   * \brief memory map a local file. the columns point to the mapped memory
+   * directly, which is released when all of them are freed
+   *
+   * @param dequantize whether to fill V if it is stored in int8
+   * @return false if failed to map
+   */
+  bool Map(const std::string& filename, bool dequantize = true) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(kHeaderV1)) {
+      close(fd); return false;
+    }
+    size_t size = st.st_size;
+    // private mapping, so writing into a column does not change the file
+    void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) return false;
+    std::shared_ptr<void> mem(addr, [size](void* p) { munmap(p, size); });
+
+    char* p = static_cast<char*>(addr);
+    Header h; memcpy(&h, p, kHeaderV1);
+    CHECK(h.magic == kMagic) << filename << " is not a difacto model file";
+    size_t pos = kHeaderV1;
+    if (h.version >= 2) {
+      CHECK_GE(size, sizeof(h)) << filename << " is truncated";
+      memcpy(&h, p, sizeof(h));
+      pos = sizeof(h);
+    }
+    V_dim = h.V_dim;
+    hash_capacity = h.hash_capacity;
+    size_t n = h.num_feas, nV = h.num_V * h.V_dim;
+    MapColumn(mem, n, &pos, &feaids);
+    MapColumn(mem, n, &pos, &w);
+    V.clear(); V_q.clear(); V_scale.clear();
+    if (V_dim > 0) {
+      MapColumn(mem, n, &pos, &V_idx);
+      if (h.V_int8) {
+        MapColumn(mem, nV, &pos, &V_q);
+        MapColumn(mem, h.num_V, &pos, &V_scale);
+      } else {
+        MapColumn(mem, nV, &pos, &V);
+      }
+    }
+    aux_w.resize(h.num_aux_w);
+    for (auto& a : aux_w) MapColumn(mem, n, &pos, &a);
+    if (h.has_aux_V) MapColumn(mem, nV, &pos, &aux_V);
+    CHECK_LE(pos, size) << filename << " is truncated";
+    if (h.V_int8 && dequantize) Dequantize();
+    return true;
+  }
+
+  /** \brief fill V by V_q * V_scale */
+  void Dequantize() {
+    size_t num_V = V_scale.size();
+    V.resize(num_V * V_dim);
+    for (size_t i = 0; i < num_V; ++i) {
+      for (int j = 0; j < V_dim; ++j) {
+        V[i * V_dim + j] = V_q[i * V_dim + j] * V_scale[i];
+      }
+    }
+  }
+
+ private:
+  static size_t Padding(size_t bytes) { return (8 - bytes % 8) % 8; }
+
+  template <typename V>
+  static void WriteColumn(const SArray<V>& col, dmlc::Stream* fo) {
+    size_t bytes = col.size() * sizeof(V);
+    if (bytes) fo->Write(col.data(), bytes);
+    char pad[8] = {0};
+    if (Padding(bytes)) fo->Write(pad, Padding(bytes));
+  }
+
+  template <typename V>
+  static void ReadColumn(size_t n, dmlc::Stream* fi, SArray<V>* col) {
+    col->resize(n);
+    size_t bytes = n * sizeof(V);
+    if (bytes) {
+      CHECK_EQ(fi->Read(col->data(), bytes), bytes) << "model file is truncated";
+    }
+    char pad[8];
+    if (Padding(bytes)) fi->Read(pad, Padding(bytes));
+  }
+
+  template <typename V>
+  static void MapColumn(const std::shared_ptr<void>& mem, size_t n,
+                        size_t* pos, SArray<V>* col) {
+    V* data = reinterpret_cast<V*>(static_cast<char*>(mem.get()) + *pos);
+    col->reset(data, n, [mem](V* p) { });
+    *pos += n * sizeof(V) + Padding(n * sizeof(V));
+  }
+};
+
+/**
+ * \brief returns the model filename of a server node. each server saves its
+ * own part in a distributed job
+ */
+inline std::string ModelName(const std::string& base, int rank) {
+  return IsDistributed() ? base + "_part-" + std::to_string(rank) : base;
+}
+
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_MODEL_FILE_H_
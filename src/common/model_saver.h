@@ -0,0 +1,85 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_COMMON_MODEL_SAVER_H_
+#define DIFACTO_COMMON_MODEL_SAVER_H_
+#include <stdio.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include "dmlc/io.h"
+#include "dmlc/logging.h"
+#include "./model_file.h"
+namespace difacto {
+
+/**
+ * \brief writes model snapshots by a background thread
+ *
+ * an updater copies its model into a \ref ModelFile, which is fast, and then
+ * the model is written here while the training continues. at most one
+ * snapshot is being written, a new one waits for the previous one
+ *
+ * the updater decides how consistent the copy is. such as the SGD updater,
+ * which pauses the updates while a shard is copied, so each feature is
+ * copied between two updates, see SGDUpdater::Snapshot
+ */
+class ModelSaver {
+ public:
+  ModelSaver() { }
+  ~ModelSaver() { Wait(); }
+
+  /**
+   * \brief write a snapshot into filename in background, see \ref Write
+   *
+   * the snapshot must not share memory with the model being trained. it is
+   * moved if passed by std::move, so the model is not copied again
+   */
+  void SaveAsync(ModelFile snapshot, const std::string& filename) {
+    Wait();
+    std::shared_ptr<ModelFile> model(new ModelFile(std::move(snapshot)));
+    thread_ = std::thread([model, filename]() {
+        Write(filename, [model](dmlc::Stream* fo) { model->Save(fo); });
+      });
+  }
+
+  /** \brief wait until the snapshot in writing is written */
+  void Wait() {
+    if (thread_.joinable()) thread_.join();
+  }
+
+  /**
+   * \brief write into filename by fn
+   *
+   * a local file is written into filename.tmp first, and then renamed to
+   * filename. so a crash during writing keeps the previous file, such as the
+   * last checkpoint. a remote file is written directly, which s3 only makes
+   * visible once it is closed
+   */
+  static void Write(const std::string& filename,
+                    const std::function<void(dmlc::Stream*)>& fn) {
+    bool local = filename.find("://") == std::string::npos ||
+                 filename.compare(0, 7, "file://") == 0;
+    std::string path = local ? filename + ".tmp" : filename;
+    {
+      std::unique_ptr<dmlc::Stream> fo(
+          dmlc::Stream::Create(path.c_str(), "w"));
+      fn(fo.get());
+    }
+    if (!local) return;
+    std::string from = path, to = filename;
+    if (to.compare(0, 7, "file://") == 0) {
+      from = from.substr(7);
+      to = to.substr(7);
+    }
+    CHECK_EQ(rename(from.c_str(), to.c_str()), 0)
+        << "failed to rename " << from << " to " << to;
+  }
+
+ private:
+  std::thread thread_;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_MODEL_SAVER_H_
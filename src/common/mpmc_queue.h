@@ -0,0 +1,229 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_COMMON_MPMC_QUEUE_H_
+#define DIFACTO_COMMON_MPMC_QUEUE_H_
+#include <stdint.h>
+#include <atomic>
+#include <climits>
+#include <memory>
+#include <thread>
+#include <utility>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <condition_variable>
+#include <mutex>
+#endif  // defined(__linux__)
+#include "dmlc/logging.h"
+namespace difacto {
+
+/**
+ * \brief threads park here until a condition holds, and are woken by
+ * \ref Notify after the condition is changed
+ *
+ * a waiter spins a while before sleeping on a futex word, and a notifier
+ * only does the syscall if there are sleeping waiters, so neither side takes
+ * a lock in the common case. it falls back to a condition variable if futex
+ * is not available
+ */
+class Parker {
+ public:
+  Parker() { }
+  ~Parker() { }
+
+  /** \brief block until pred() is true */
+  template <typename Pred>
+  void Wait(const Pred& pred) {
+    for (int i = 0; i < kSpins; ++i) {
+      if (pred()) return;
+      if (i >= kSpins / 2) std::this_thread::yield();
+    }
+    while (true) {
+      uint32_t epoch = epoch_.load(std::memory_order_acquire);
+      waiters_.fetch_add(1, std::memory_order_seq_cst);
+      // pairs with the fence of Notify, so either pred sees the change or
+      // the notifier sees this waiter
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (pred()) {
+        waiters_.fetch_sub(1, std::memory_order_relaxed);
+        return;
+      }
+      Sleep(epoch);
+      waiters_.fetch_sub(1, std::memory_order_relaxed);
+      if (pred()) return;
+    }
+  }
+
+  /**
+   * \brief wake up the waiters after the condition is changed
+   * \param all wake all waiters if true, otherwise one
+   */
+  void Notify(bool all = false) {
+    epoch_.fetch_add(1, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters_.load(std::memory_order_relaxed) == 0) return;
+    Wake(all);
+  }
+
+ private:
+  static const int kSpins = 64;
+#if defined(__linux__)
+  /** \brief sleep unless epoch_ has changed */
+  void Sleep(uint32_t epoch) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch_),
+            FUTEX_WAIT_PRIVATE, epoch, nullptr, nullptr, 0);
+  }
+  void Wake(bool all) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch_),
+            FUTEX_WAKE_PRIVATE, all ? INT_MAX : 1, nullptr, nullptr, 0);
+  }
+#else
+  void Sleep(uint32_t epoch) {
+    std::unique_lock<std::mutex> lk(mu_);
+    cond_.wait(lk, [this, epoch] {
+        return epoch_.load(std::memory_order_acquire) != epoch;
+      });
+  }
+  void Wake(bool all) {
+    { std::lock_guard<std::mutex> lk(mu_); }
+    if (all) {
+      cond_.notify_all();
+    } else {
+      cond_.notify_one();
+    }
+  }
+  std::mutex mu_;
+  std::condition_variable cond_;
+#endif  // defined(__linux__)
+  std::atomic<uint32_t> epoch_{0};
+  std::atomic<int> waiters_{0};
+};
+
+/**
+ * \brief a bounded lock-free multi-producer multi-consumer FIFO queue
+ *
+ * a ring of cells, each with a sequence number telling whether it is ready
+ * to be written or read in the current lap. a producer or a consumer claims
+ * a position by a CAS on the tail or the head, so the threads only contend
+ * on a cache line rather than a lock. \ref Push and \ref Pop park on a
+ * \ref Parker if the queue is full or empty
+ */
+template <typename T>
+class MPMCQueue {
+ public:
+  /** \param capacity the maximal number of items, rounded up to a power of 2 */
+  explicit MPMCQueue(size_t capacity) {
+    CHECK_GT(capacity, 0);
+    size_t n = 1;
+    while (n < capacity) n *= 2;
+    mask_ = n - 1;
+    cells_.reset(new Cell[n]);
+    for (size_t i = 0; i < n; ++i) {
+      cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+  ~MPMCQueue() { }
+
+  /** \brief add an item, returns false if the queue is full */
+  bool TryPush(T&& item) {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    while (true) {
+      Cell& c = cells_[pos & mask_];
+      size_t seq = c.seq.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          c.item = std::move(item);
+          c.seq.store(pos + 1, std::memory_order_release);
+          not_empty_.Notify();
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  /** \brief get the front item, returns false if the queue is empty */
+  bool TryPop(T* item) {
+    size_t pos = head_.load(std::memory_order_relaxed);
+    while (true) {
+      Cell& c = cells_[pos & mask_];
+      size_t seq = c.seq.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) -
+                      static_cast<intptr_t>(pos + 1);
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          *item = std::move(c.item);
+          c.item = T();
+          c.seq.store(pos + mask_ + 1, std::memory_order_release);
+          not_full_.Notify();
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  /** \brief add an item, blocks while the queue is full */
+  void Push(T item) {
+    CHECK(!closed_.load(std::memory_order_relaxed))
+        << "push into a closed queue";
+    if (TryPush(std::move(item))) return;
+    not_full_.Wait([this, &item] { return TryPush(std::move(item)); });
+  }
+
+  /**
+   * \brief get the front item, blocks while the queue is empty. returns false
+   * if the queue is empty and closed
+   */
+  bool Pop(T* item) {
+    if (TryPop(item)) return true;
+    bool got = false;
+    not_empty_.Wait([this, item, &got] {
+        got = TryPop(item);
+        return got || closed_.load(std::memory_order_acquire);
+      });
+    // an item may be pushed right before closing
+    return got || TryPop(item);
+  }
+
+  /** \brief no more items will be pushed, wakes up all blocked consumers */
+  void Close() {
+    closed_.store(true, std::memory_order_release);
+    not_empty_.Notify(true);
+  }
+
+  /** \brief the number of items, which may be stale once returned */
+  size_t Size() const {
+    size_t head = head_.load(std::memory_order_relaxed);
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+  }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> seq;
+    T item;
+  };
+  std::unique_ptr<Cell[]> cells_;
+  size_t mask_;
+  /** \brief the producers and the consumers use different cache lines */
+  alignas(64) std::atomic<size_t> tail_{0};
+  alignas(64) std::atomic<size_t> head_{0};
+  std::atomic<bool> closed_{false};
+  Parker not_empty_, not_full_;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_MPMC_QUEUE_H_
@@ -0,0 +1,92 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_COMMON_NUMA_H_
+#define DIFACTO_COMMON_NUMA_H_
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+namespace difacto {
+
+/**
+ * \brief the NUMA nodes of the machine, read from sysfs on linux
+ *
+ * memory is placed on the node of the thread touching it first, so a buffer
+ * is allocated and first written by a thread pinned to the node using it.
+ * there is only one node without the sysfs information
+ */
+class Numa {
+ public:
+  /** \brief the topology of this machine */
+  static const Numa& Get() {
+    static Numa numa;
+    return numa;
+  }
+
+  /** \brief the number of nodes with cpus */
+  int NumNodes() const { return static_cast<int>(cpus_.size()); }
+
+  /** \brief the cpus of a node, empty if unknown */
+  const std::vector<int>& Cpus(int node) const { return cpus_[node]; }
+
+  /**
+   * \brief pin the calling thread to the cpus of a node, returns false if
+   * not supported
+   */
+  bool Bind(int node) const {
+#if defined(__linux__)
+    if (node < 0 || node >= NumNodes()) return false;
+    const auto& cpus = cpus_[node];
+    if (cpus.empty()) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int c : cpus) CPU_SET(c, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+  }
+
+  /** \brief parse a cpu list such as "0-3,8,10-11" */
+  static std::vector<int> ParseCpuList(const std::string& str) {
+    std::vector<int> cpus;
+    std::stringstream ss(str);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+      if (item.empty() || item == "\n") continue;
+      size_t dash = item.find('-');
+      int begin = std::stoi(item.substr(0, dash));
+      int end = dash == std::string::npos ? begin : std::stoi(item.substr(dash+1));
+      for (int c = begin; c <= end; ++c) cpus.push_back(c);
+    }
+    return cpus;
+  }
+
+ private:
+  Numa() {
+    const std::string dir = "/sys/devices/system/node/";
+    for (int i : ParseCpuList(ReadLine(dir + "online"))) {
+      auto cpus = ParseCpuList(ReadLine(
+          dir + "node" + std::to_string(i) + "/cpulist"));
+      // skip the memory only nodes
+      if (cpus.size()) cpus_.push_back(cpus);
+    }
+    if (cpus_.empty()) cpus_.resize(1);
+  }
+
+  static std::string ReadLine(const std::string& filename) {
+    std::ifstream in(filename);
+    std::string str;
+    if (in) std::getline(in, str);
+    return str;
+  }
+  std::vector<std::vector<int>> cpus_;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_NUMA_H_
@@ -0,0 +1,220 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_COMMON_PACKED_BLOCK_H_
+#define DIFACTO_COMMON_PACKED_BLOCK_H_
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#include "dmlc/data.h"
+#include "difacto/base.h"
+#include "difacto/sarray.h"
+#include "common/float16.h"
+namespace difacto {
+
+/**
+ * \brief a row major sparse matrix whose indices are delta encoded and bit
+ * packed, it requires the indices of each row are strictly increasing, such
+ * as the transposed data of BCD
+ *
+ * the indices of a row are encoded as d_k = index_k - index_{k-1} - 1, with
+ * index_{-1} = -1, and then divided into groups of \ref kGroup. all d_k in a
+ * group are packed with the same number of bits. the words of a row starts
+ * with the bit widths of its groups, one byte per group, then the packed
+ * groups one by one.
+ *
+ * the kernels decode a group into a small buffer and then use it, there is
+ * no separate pass to decompress the whole matrix
+ */
+struct PackedBlock {
+  /** \brief the number of indices packed together */
+  static const int kGroup = 128;
+  /** \brief offset[i+1] - offset[i] is the number of entries in row i */
+  SArray<size_t> offset;
+  /** \brief the labels, optional */
+  SArray<real_t> label;
+  /** \brief the packed indices */
+  SArray<uint32_t> words;
+  /** \brief the words of row i are words[pos[i], pos[i+1]) */
+  SArray<size_t> pos;
+  /** \brief the values, empty if binary or stored in value16 */
+  SArray<real_t> value;
+  /** \brief the values in fp16 */
+  SArray<uint16_t> value16;
+
+  /** \brief the number of rows */
+  size_t size() const { return offset.empty() ? 0 : offset.size() - 1; }
+
+  /** \brief whether or not it has values */
+  bool valued() const { return value.size() || value16.size(); }
+
+  /** \brief the j-th value, requires \ref valued */
+  real_t Value(size_t j) const {
+    return value16.size() ? HalfToFloat(value16[j]) : value[j];
+  }
+
+  /**
+   * \brief pack a row block
+   *
+   * @param blk the data, blk.offset[0] should be 0
+   * @param fp16 store values in fp16, which is lossy
+   */
+  void Pack(const dmlc::RowBlock<unsigned>& blk, bool fp16) {
+    CHECK_EQ(blk.offset[0], 0);
+    size_t n = blk.size, nnz = blk.offset[n];
+    offset.CopyFrom(blk.offset, n+1);
+    if (blk.label) label.CopyFrom(blk.label, n);
+    value.clear(); value16.clear();
+    if (blk.value) {
+      if (fp16) {
+        value16.resize(nnz);
+        for (size_t j = 0; j < nnz; ++j) value16[j] = FloatToHalf(blk.value[j]);
+      } else {
+        value.CopyFrom(blk.value, nnz);
+      }
+    }
+
+    std::vector<uint32_t> out;
+    out.reserve(nnz / 2 + n);
+    pos.resize(n+1);
+    uint32_t delta[kGroup];
+    for (size_t i = 0; i < n; ++i) {
+      pos[i] = out.size();
+      size_t len = blk.offset[i+1] - blk.offset[i];
+      size_t ngroup = (len + kGroup - 1) / kGroup;
+      // reserve the words for bit widths
+      size_t wbegin = out.size();
+      out.resize(wbegin + (ngroup + 3) / 4, 0);
+      uint32_t prev = static_cast<uint32_t>(-1);
+      unsigned const* index = blk.index + blk.offset[i];
+      for (size_t g = 0; g < ngroup; ++g) {
+        int cnt = static_cast<int>(std::min<size_t>(kGroup, len - g * kGroup));
+        uint32_t all = 0;
+        for (int k = 0; k < cnt; ++k) {
+          uint32_t idx = index[g * kGroup + k];
+          CHECK(k + g > 0 ? idx > prev : true)
+              << "the indices of a row should be increasing";
+          delta[k] = idx - prev - 1;
+          prev = idx;
+          all |= delta[k];
+        }
+        int bits = all ? 32 - __builtin_clz(all) : 0;
+        reinterpret_cast<uint8_t*>(out.data() + wbegin)[g] = bits;
+        PackBits(delta, cnt, bits, &out);
+      }
+    }
+    pos[n] = out.size();
+    words.CopyFrom(out.data(), out.size());
+  }
+
+  /**
+   * \brief decode the indices of a row group by group
+   *
+   * \code
+   * unsigned idx[PackedBlock::kGroup];
+   * PackedBlock::RowReader rd(blk, i);
+   * for (int n; (n = rd.Next(idx)) > 0; ) { ... }
+   * \endcode
+   */
+  class RowReader {
+   public:
+    RowReader(const PackedBlock& blk, size_t i) {
+      remain_ = blk.offset[i+1] - blk.offset[i];
+      uint32_t const* w = blk.words.data() + blk.pos[i];
+      bits_ = reinterpret_cast<uint8_t const*>(w);
+      in_ = w + (remain_ + kGroup * 4 - 1) / (kGroup * 4);
+    }
+    /**
+     * \brief decode the next group into idx, returns the number of indices
+     */
+    int Next(unsigned* idx) {
+      int cnt = static_cast<int>(std::min<size_t>(kGroup, remain_));
+      if (cnt == 0) return 0;
+      int bits = *bits_++;
+      in_ = UnpackBits(in_, cnt, bits, idx);
+      uint32_t prev = prev_;
+      for (int k = 0; k < cnt; ++k) {
+        prev += idx[k] + 1;
+        idx[k] = prev;
+      }
+      prev_ = prev;
+      remain_ -= cnt;
+      return cnt;
+    }
+
+   private:
+    uint8_t const* bits_;
+    uint32_t const* in_;
+    size_t remain_;
+    uint32_t prev_ = static_cast<uint32_t>(-1);
+  };
+
+  /** \brief append n values with the given bits into out */
+  static void PackBits(uint32_t const* in, int n, int bits,
+                       std::vector<uint32_t>* out) {
+    if (bits == 0) return;
+    uint64_t buf = 0;
+    int used = 0;
+    for (int k = 0; k < n; ++k) {
+      buf |= static_cast<uint64_t>(in[k]) << used;
+      used += bits;
+      if (used >= 32) {
+        out->push_back(static_cast<uint32_t>(buf));
+        buf >>= 32;
+        used -= 32;
+      }
+    }
+    if (used) out->push_back(static_cast<uint32_t>(buf));
+  }
+
+  /**
+   * \brief decode n values with the given bits, returns the next word
+   */
+  static uint32_t const* UnpackBits(uint32_t const* in, int n, int bits,
+                                    uint32_t* out) {
+    switch (bits) {
+#define DIFACTO_UNPACK_CASE(B) case B: return UnpackBits<B>(in, n, out);
+#define DIFACTO_UNPACK_CASE4(B) DIFACTO_UNPACK_CASE(B) DIFACTO_UNPACK_CASE(B+1) \
+      DIFACTO_UNPACK_CASE(B+2) DIFACTO_UNPACK_CASE(B+3)
+      DIFACTO_UNPACK_CASE4(0) DIFACTO_UNPACK_CASE4(4)
+      DIFACTO_UNPACK_CASE4(8) DIFACTO_UNPACK_CASE4(12)
+      DIFACTO_UNPACK_CASE4(16) DIFACTO_UNPACK_CASE4(20)
+      DIFACTO_UNPACK_CASE4(24) DIFACTO_UNPACK_CASE4(28)
+      DIFACTO_UNPACK_CASE(32)
+#undef DIFACTO_UNPACK_CASE4
+#undef DIFACTO_UNPACK_CASE
+      default: LOG(FATAL) << "invalid bits " << bits;
+    }
+    return in;
+  }
+
+ private:
+  /**
+   * \brief the bits is a constant, so the shifts and masks are known by the
+   * compiler
+   */
+  template <int kBits>
+  static uint32_t const* UnpackBits(uint32_t const* in, int n, uint32_t* out) {
+    if (kBits == 0) {
+      memset(out, 0, n * sizeof(uint32_t));
+      return in;
+    }
+    const uint64_t mask = (static_cast<uint64_t>(1) << kBits) - 1;
+    uint64_t buf = 0;
+    int avail = 0;
+    for (int k = 0; k < n; ++k) {
+      if (avail < kBits) {
+        buf |= static_cast<uint64_t>(*in++) << avail;
+        avail += 32;
+      }
+      out[k] = static_cast<uint32_t>(buf & mask);
+      buf >>= kBits;
+      avail -= kBits;
+    }
+    return in;
+  }
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_PACKED_BLOCK_H_
@@ -3,30 +3,40 @@
  */
 #ifndef DIFACTO_COMMON_PARALLEL_SORT_H_
 #define DIFACTO_COMMON_PARALLEL_SORT_H_
-#include <thread>
+#include <stdint.h>
 #include <vector>
 #include <algorithm>
+#include "dmlc/omp.h"
 namespace difacto {
 namespace {
 /**
- * \brief the thread function
+ * \brief returns the number of items from a among the first k items of
+ * merging a and b, where the items of a go first if equal
  */
 template<typename T, class Fn>
-void ParallelSort_(T* data, size_t len, size_t grainsize, const Fn& cmp) {
-  if (len <= grainsize) {
-    std::sort(data, data + len, cmp);
-  } else {
-    std::thread thr(ParallelSort_<T, Fn>, data, len/2, grainsize, cmp);
-    ParallelSort_(data + len/2, len - len/2, grainsize, cmp);
-    thr.join();
-    std::inplace_merge(data, data + len/2, data + len, cmp);
+size_t MergeRank(T const* a, size_t m, T const* b, size_t n, size_t k,
+                 const Fn& cmp) {
+  size_t lo = k > n ? k - n : 0, hi = std::min(k, m);
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (cmp(b[k - mid - 1], a[mid])) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
   }
+  return lo;
 }
 }  // namespace
 
 /**
  * @brief Parallel Sort
  *
+ * the array is divided into segments, which are sorted and then merged pair
+ * by pair. each merge is divided into pieces of the output, so all threads
+ * are busy even in the last merge. it runs in the thread pool of OpenMP, so no
+ * thread is created per call
+ *
  * @param arr the array for sorting
  * @param num_threads
  * @param cmp the comparision function, such as [](const T& a, const T& b) {
@@ -34,8 +44,133 @@ void ParallelSort_(T* data, size_t len, size_t grainsize, const Fn& cmp) {
  */
 template<typename T, class Fn>
 void ParallelSort(std::vector<T>* arr, int num_threads, const Fn& cmp) {
-  size_t grainsize = std::max(arr->size() / num_threads + 5, (size_t)1024*16);
-  ParallelSort_(arr->data(), arr->size(), grainsize, cmp);
+  size_t n = arr->size();
+  size_t grainsize = 1024 * 16;
+  int nseg = static_cast<int>(std::min<size_t>(num_threads, n / grainsize));
+  if (nseg <= 1) {
+    std::sort(arr->begin(), arr->end(), cmp);
+    return;
+  }
+  std::vector<size_t> bounds(nseg + 1);
+  for (int i = 0; i <= nseg; ++i) bounds[i] = n * i / nseg;
+  T* src = arr->data();
+#pragma omp parallel for num_threads(nseg)
+  for (int i = 0; i < nseg; ++i) {
+    std::sort(src + bounds[i], src + bounds[i+1], cmp);
+  }
+
+  std::vector<T> buf(n);
+  T* dst = buf.data();
+  while (bounds.size() > 2) {
+    // merge run 2i and 2i+1, each merge is divided into npiece pieces
+    int nrun = bounds.size() - 1;
+    int nmerge = nrun / 2;
+    int npiece = std::max(1, num_threads / nmerge);
+#pragma omp parallel for num_threads(num_threads) schedule(dynamic, 1)
+    for (int t = 0; t < nmerge * npiece; ++t) {
+      int i = t / npiece, p = t % npiece;
+      T const* a = src + bounds[2*i];
+      T const* b = src + bounds[2*i+1];
+      size_t m = bounds[2*i+1] - bounds[2*i];
+      size_t l = bounds[2*i+2] - bounds[2*i+1];
+      size_t k0 = (m + l) * p / npiece, k1 = (m + l) * (p + 1) / npiece;
+      size_t i0 = MergeRank(a, m, b, l, k0, cmp);
+      size_t i1 = MergeRank(a, m, b, l, k1, cmp);
+      std::merge(a + i0, a + i1, b + k0 - i0, b + k1 - i1,
+                 dst + bounds[2*i] + k0, cmp);
+    }
+    // the last run has no pair
+    if (nrun % 2) {
+      std::copy(src + bounds[nrun-1], src + bounds[nrun], dst + bounds[nrun-1]);
+    }
+    std::vector<size_t> merged;
+    for (int i = 0; i < nrun; i += 2) merged.push_back(bounds[i]);
+    merged.push_back(n);
+    bounds.swap(merged);
+    std::swap(src, dst);
+  }
+  if (src != arr->data()) std::copy(src, src + n, arr->data());
+}
+
+/**
+ * @brief LSD radix sort by a 64-bit key, 8 bits per pass
+ *
+ * the passes where all keys have the same digit are skipped, which is common
+ * for the high bytes of feature indices. it is stable, and is mainly used for
+ * feature indices with unsigned payloads
+ *
+ * @param arr the array for sorting
+ * @param tmp a buffer, which can be reused among calls
+ * @param key returns the key of an item, such as [](const T& a) { return a.k; }
+ * @param num_threads each thread counts and scatters its own segment
+ */
+template<typename T, class KeyFn>
+void RadixSort(std::vector<T>* arr, std::vector<T>* tmp, const KeyFn& key,
+               int num_threads = 1) {
+  size_t n = arr->size();
+  if (n < 2) return;
+  int nt = static_cast<int>(std::max<size_t>(
+      1, std::min<size_t>(num_threads, n / (1024 * 16))));
+  std::vector<size_t> bounds(nt + 1);
+  for (int t = 0; t <= nt; ++t) bounds[t] = n * t / nt;
+  // cnt[t][d][b], the histogram of digit d in segment t
+  std::vector<size_t> cnt(nt * 8 * 256);
+
+  tmp->resize(n);
+  T* src = arr->data();
+  T* dst = tmp->data();
+  // the histograms of all passes in a single scan, to find the passes
+  // can be skipped
+#pragma omp parallel for num_threads(nt)
+  for (int t = 0; t < nt; ++t) {
+    size_t* c = cnt.data() + t * 8 * 256;
+    for (size_t i = bounds[t]; i < bounds[t+1]; ++i) {
+      uint64_t k = key(src[i]);
+      for (int d = 0; d < 8; ++d) ++c[d * 256 + ((k >> (d * 8)) & 0xFF)];
+    }
+  }
+  bool skip[8];
+  for (int d = 0; d < 8; ++d) {
+    int b = (key(src[0]) >> (d * 8)) & 0xFF;
+    size_t total = 0;
+    for (int t = 0; t < nt; ++t) total += cnt[(t * 8 + d) * 256 + b];
+    skip[d] = total == n;
+  }
+
+  bool first = true;
+  for (int d = 0; d < 8; ++d) {
+    if (skip[d]) continue;
+    int shift = d * 8;
+    if (!first) {
+      // the segments are changed by the previous pass, count again
+#pragma omp parallel for num_threads(nt)
+      for (int t = 0; t < nt; ++t) {
+        size_t* c = cnt.data() + (t * 8 + d) * 256;
+        std::fill(c, c + 256, 0);
+        for (size_t i = bounds[t]; i < bounds[t+1]; ++i) {
+          ++c[(key(src[i]) >> shift) & 0xFF];
+        }
+      }
+    }
+    first = false;
+    // the start position of bucket b of segment t
+    size_t sum = 0;
+    for (int b = 0; b < 256; ++b) {
+      for (int t = 0; t < nt; ++t) {
+        size_t& c = cnt[(t * 8 + d) * 256 + b];
+        size_t v = c; c = sum; sum += v;
+      }
+    }
+#pragma omp parallel for num_threads(nt)
+    for (int t = 0; t < nt; ++t) {
+      size_t* c = cnt.data() + (t * 8 + d) * 256;
+      for (size_t i = bounds[t]; i < bounds[t+1]; ++i) {
+        dst[c[(key(src[i]) >> shift) & 0xFF]++] = src[i];
+      }
+    }
+    std::swap(src, dst);
+  }
+  if (src != arr->data()) std::copy(src, src + n, arr->data());
 }
 
 }  // namespace difacto
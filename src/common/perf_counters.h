@@ -0,0 +1,136 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_COMMON_PERF_COUNTERS_H_
+#define DIFACTO_COMMON_PERF_COUNTERS_H_
+#include <stdint.h>
+#include <string.h>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+namespace difacto {
+
+/**
+ * \brief the hardware counters of a piece of code
+ */
+struct PerfCounts {
+  enum Event { kCycles, kInstructions, kLLCMisses, kDTLBMisses, kNum };
+  static const char* Name(int event) {
+    static const char* names[] = {
+      "cycles", "instructions", "llc_misses", "dtlb_misses"};
+    return names[event];
+  }
+  /** \brief a last level cache miss reads a cache line from the memory */
+  static const int kCacheLine = 64;
+
+  uint64_t count[kNum] = {0};
+
+  /** \brief instructions per cycle, 0 if not counted */
+  double IPC() const {
+    return count[kCycles] ?
+        static_cast<double>(count[kInstructions]) / count[kCycles] : 0;
+  }
+
+  /** \brief the bytes read from the memory, estimated by the LLC misses */
+  double Bytes() const {
+    return static_cast<double>(count[kLLCMisses]) * kCacheLine;
+  }
+
+  PerfCounts Since(const PerfCounts& prev) const {
+    PerfCounts diff;
+    for (int i = 0; i < kNum; ++i) diff.count[i] = count[i] - prev.count[i];
+    return diff;
+  }
+};
+
+/**
+ * \brief counts \ref PerfCounts of the calling thread by perf_event_open
+ *
+ * the events are opened as a group, so they are read by a single syscall and
+ * are scheduled onto the PMU together. only the calling thread is counted,
+ * not the ones of \ref TaskScheduler it waits for. an event is not counted,
+ * namely always 0, if it is not supported by the cpu, not on linux, or
+ * restricted by /proc/sys/kernel/perf_event_paranoid
+ */
+class PerfCounters {
+ public:
+  PerfCounters() {
+#if defined(__linux__)
+    const uint64_t kDTLBRead = PERF_COUNT_HW_CACHE_DTLB |
+                               (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                               (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    const uint32_t types[] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+                              PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE};
+    const uint64_t configs[] = {PERF_COUNT_HW_CPU_CYCLES,
+                                PERF_COUNT_HW_INSTRUCTIONS,
+                                PERF_COUNT_HW_CACHE_MISSES, kDTLBRead};
+    for (int i = 0; i < PerfCounts::kNum; ++i) {
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = types[i];
+      attr.config = configs[i];
+      attr.read_format = PERF_FORMAT_GROUP;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      int fd = static_cast<int>(
+          syscall(SYS_perf_event_open, &attr, 0, -1, leader_, 0));
+      if (fd < 0) continue;
+      if (leader_ < 0) leader_ = fd;
+      fds_[i] = fd;
+      pos_[i] = num_++;
+    }
+#endif
+  }
+  ~PerfCounters() {
+#if defined(__linux__)
+    for (int fd : fds_) if (fd >= 0) close(fd);
+#endif
+  }
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  /** \brief returns true if any event is counted */
+  bool Available() const { return leader_ >= 0; }
+
+  /** \brief returns true if the event is counted */
+  bool Available(int event) const { return fds_[event] >= 0; }
+
+  /**
+   * \brief the counts since the construction, or all 0 if not available.
+   * the difference of two reads is the counts in between
+   */
+  PerfCounts Read() const {
+    PerfCounts counts;
+#if defined(__linux__)
+    if (leader_ < 0) return counts;
+    // {nr, values[nr]}
+    uint64_t buf[PerfCounts::kNum + 1];
+    ssize_t n = read(leader_, buf, sizeof(buf));
+    if (n < static_cast<ssize_t>((num_ + 1) * sizeof(uint64_t))) return counts;
+    for (int i = 0; i < PerfCounts::kNum; ++i) {
+      if (pos_[i] >= 0) counts.count[i] = buf[pos_[i] + 1];
+    }
+#endif
+    return counts;
+  }
+
+  /** \brief the counters of the calling thread, opened at its first call */
+  static const PerfCounters& ThisThread() {
+    static thread_local PerfCounters counters;
+    return counters;
+  }
+
+ private:
+  int leader_ = -1;
+  int num_ = 0;
+  int fds_[PerfCounts::kNum] = {-1, -1, -1, -1};
+  /** \brief the position of an event in the group read, -1 if not opened */
+  int pos_[PerfCounts::kNum] = {-1, -1, -1, -1};
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_PERF_COUNTERS_H_
@@ -0,0 +1,282 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_COMMON_PROFILER_H_
+#define DIFACTO_COMMON_PROFILER_H_
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "dmlc/logging.h"
+#include "./perf_counters.h"
+
+/**
+ * \brief whether to profile the hot paths, set by `make PROFILE=1`. the
+ * macros at the bottom compile into nothing if it is 0. `make PROFILE=2` also
+ * counts the hardware events of the phases by \ref PerfCounters
+ */
+#ifndef DIFACTO_PROFILE
+#define DIFACTO_PROFILE 0
+#endif
+
+namespace difacto {
+
+/**
+ * \brief the seconds, the calls, the items processed and the hardware events
+ * of each phase
+ */
+struct ProfileStats {
+  enum Phase {
+    kParse, kLocalize, kPull, kPredict, kGrad, kPush, kUpdate, kTileFetch,
+    kWait, kNum
+  };
+  static const char* Name(int phase) {
+    static const char* names[] = {
+      "parse", "localize", "pull", "predict", "grad", "push", "update",
+      "tile_fetch", "wait"};
+    return names[phase];
+  }
+
+  double sec[kNum] = {0};
+  double calls[kNum] = {0};
+  double items[kNum] = {0};
+  /** \brief the \ref PerfCounts of each phase, 0 if not counted */
+  double events[PerfCounts::kNum][kNum] = {{0}};
+
+  bool Empty() const {
+    for (int i = 0; i < kNum; ++i) {
+      if (calls[i] > 0 || items[i] > 0) return false;
+    }
+    return true;
+  }
+
+  void Merge(const ProfileStats& other) {
+    for (int i = 0; i < kNum; ++i) {
+      sec[i] += other.sec[i];
+      calls[i] += other.calls[i];
+      items[i] += other.items[i];
+      for (int e = 0; e < PerfCounts::kNum; ++e) {
+        events[e][i] += other.events[e][i];
+      }
+    }
+  }
+
+  /** \brief the stats since prev */
+  ProfileStats Since(const ProfileStats& prev) const {
+    ProfileStats diff;
+    for (int i = 0; i < kNum; ++i) {
+      diff.sec[i] = sec[i] - prev.sec[i];
+      diff.calls[i] = calls[i] - prev.calls[i];
+      diff.items[i] = items[i] - prev.items[i];
+      for (int e = 0; e < PerfCounts::kNum; ++e) {
+        diff.events[e][i] = events[e][i] - prev.events[e][i];
+      }
+    }
+    return diff;
+  }
+
+  /** \brief instructions per cycle of a phase, 0 if not counted */
+  double IPC(int phase) const {
+    double cycles = events[PerfCounts::kCycles][phase];
+    return cycles > 0 ? events[PerfCounts::kInstructions][phase] / cycles : 0;
+  }
+
+  /**
+   * \brief GB per second read from the memory by a phase, estimated by the
+   * LLC misses, 0 if not counted
+   */
+  double GBps(int phase) const {
+    if (sec[phase] <= 0) return 0;
+    return events[PerfCounts::kLLCMisses][phase] * PerfCounts::kCacheLine /
+        sec[phase] * 1e-9;
+  }
+
+  void SerializeToString(std::string* str) const {
+    *str = std::string(reinterpret_cast<char const*>(this), sizeof(*this));
+  }
+
+  void ParseFromString(const std::string& str) {
+    CHECK_EQ(str.size(), sizeof(*this));
+    memcpy(reinterpret_cast<char*>(this), str.data(), sizeof(*this));
+  }
+
+  /** \brief the seconds / calls / items of the phases ever called */
+  std::string TextString() const {
+    std::stringstream ss;
+    for (int i = 0; i < kNum; ++i) {
+      if (calls[i] == 0 && items[i] == 0) continue;
+      if (ss.tellp() > 0) ss << ", ";
+      ss << Name(i) << " = " << sec[i] << " / " << calls[i] << " / "
+         << items[i];
+    }
+    ss << " (sec / calls / items)";
+    bool counted = false;
+    for (int i = 0; i < kNum; ++i) {
+      if (events[PerfCounts::kCycles][i] <= 0) continue;
+      ss << (counted ? ", " : "; ") << Name(i) << " = " << IPC(i) << " / "
+         << GBps(i) << " / "
+         << events[PerfCounts::kDTLBMisses][i] / std::max(items[i], 1.0);
+      counted = true;
+    }
+    if (counted) ss << " (ipc / GB/s / dtlb misses per item)";
+    return ss.str();
+  }
+};
+
+/**
+ * \brief the timers and counters of the hot paths in this process
+ *
+ * a thread adds into its own slot, which only it writes, by relaxed atomic
+ * loads and stores. so the hot path takes no lock and shares no cache line,
+ * and \ref Total can read the slots of the running threads. a slot is folded
+ * into the total once its thread exits
+ *
+ * use the DIFACTO_PROFILE_ macros rather than this class, they are removed if
+ * the profiling is disabled
+ */
+class Profiler {
+ public:
+  static Profiler* Get() {
+    static Profiler profiler;
+    return &profiler;
+  }
+
+  /** \brief add to a phase of the calling thread */
+  void Add(int phase, uint64_t ns, uint64_t calls, uint64_t items) {
+    Slot* s = LocalSlot();
+    Inc(&s->ns[phase], ns);
+    Inc(&s->calls[phase], calls);
+    Inc(&s->items[phase], items);
+  }
+
+  /** \brief add the hardware events to a phase of the calling thread */
+  void AddEvents(int phase, const PerfCounts& counts) {
+    Slot* s = LocalSlot();
+    for (int e = 0; e < PerfCounts::kNum; ++e) {
+      Inc(&s->events[e][phase], counts.count[e]);
+    }
+  }
+
+  /** \brief the stats summed over all threads ever run */
+  ProfileStats Total() {
+    std::lock_guard<std::mutex> lk(mu_);
+    ProfileStats total = retired_;
+    for (Slot* s : slots_) Fold(*s, &total);
+    return total;
+  }
+
+ private:
+  struct Slot {
+    std::atomic<uint64_t> ns[ProfileStats::kNum];
+    std::atomic<uint64_t> calls[ProfileStats::kNum];
+    std::atomic<uint64_t> items[ProfileStats::kNum];
+    std::atomic<uint64_t> events[PerfCounts::kNum][ProfileStats::kNum];
+    Slot() {
+      for (int i = 0; i < ProfileStats::kNum; ++i) {
+        ns[i] = 0; calls[i] = 0; items[i] = 0;
+        for (int e = 0; e < PerfCounts::kNum; ++e) events[e][i] = 0;
+      }
+    }
+  };
+
+  /** \brief registers a slot for a thread, and retires it on exit */
+  struct SlotHolder {
+    SlotHolder() : slot(new Slot()) {
+      auto p = Get();
+      std::lock_guard<std::mutex> lk(p->mu_);
+      p->slots_.push_back(slot);
+    }
+    ~SlotHolder() {
+      auto p = Get();
+      {
+        std::lock_guard<std::mutex> lk(p->mu_);
+        Fold(*slot, &p->retired_);
+        auto& v = p->slots_;
+        v.erase(std::remove(v.begin(), v.end(), slot), v.end());
+      }
+      delete slot;
+    }
+    Slot* slot;
+  };
+
+  Profiler() { }
+
+  Slot* LocalSlot() {
+    static thread_local SlotHolder holder;
+    return holder.slot;
+  }
+
+  /** \brief only the owner thread writes, so no need of fetch_add */
+  static void Inc(std::atomic<uint64_t>* v, uint64_t d) {
+    if (d) v->store(v->load(std::memory_order_relaxed) + d,
+                    std::memory_order_relaxed);
+  }
+
+  static void Fold(const Slot& s, ProfileStats* stats) {
+    for (int i = 0; i < ProfileStats::kNum; ++i) {
+      stats->sec[i] += s.ns[i].load(std::memory_order_relaxed) * 1e-9;
+      stats->calls[i] += s.calls[i].load(std::memory_order_relaxed);
+      stats->items[i] += s.items[i].load(std::memory_order_relaxed);
+      for (int e = 0; e < PerfCounts::kNum; ++e) {
+        stats->events[e][i] += s.events[e][i].load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  std::mutex mu_;
+  std::vector<Slot*> slots_;
+  ProfileStats retired_;
+};
+
+/**
+ * \brief add the lifetime of this object into a phase as a call, and also
+ * the hardware events of the calling thread if events is true
+ */
+class ProfileTimer {
+ public:
+  explicit ProfileTimer(int phase, bool events = false)
+      : phase_(phase), events_(events) {
+    if (events_) counts_ = PerfCounters::ThisThread().Read();
+    start_ = std::chrono::steady_clock::now();
+  }
+  ~ProfileTimer() {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start_).count();
+    Profiler::Get()->Add(phase_, ns, 1, 0);
+    if (events_) {
+      Profiler::Get()->AddEvents(
+          phase_, PerfCounters::ThisThread().Read().Since(counts_));
+    }
+  }
+
+ private:
+  int phase_;
+  bool events_;
+  PerfCounts counts_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+}  // namespace difacto
+
+#define DIFACTO_PROFILE_CAT_(a, b) a##b
+#define DIFACTO_PROFILE_CAT(a, b) DIFACTO_PROFILE_CAT_(a, b)
+
+#if DIFACTO_PROFILE
+/** \brief time the rest of the scope into a phase, e.g. kPull */
+#define DIFACTO_PROFILE_SCOPE(phase)                                    \
+  ::difacto::ProfileTimer DIFACTO_PROFILE_CAT(difacto_profile_, __LINE__)( \
+      ::difacto::ProfileStats::phase, DIFACTO_PROFILE >= 2)
+/** \brief count n items into a phase, n is not evaluated if disabled */
+#define DIFACTO_PROFILE_COUNT(phase, n)                                 \
+  ::difacto::Profiler::Get()->Add(::difacto::ProfileStats::phase, 0, 0, (n))
+#else
+#define DIFACTO_PROFILE_SCOPE(phase)
+#define DIFACTO_PROFILE_COUNT(phase, n)
+#endif  // DIFACTO_PROFILE
+
+#endif  // DIFACTO_COMMON_PROFILER_H_
@@ -0,0 +1,44 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_COMMON_REDUCE_H_
+#define DIFACTO_COMMON_REDUCE_H_
+#include <algorithm>
+#include <vector>
+#include "difacto/base.h"
+#include "./range.h"
+#include "./task_scheduler.h"
+namespace difacto {
+
+/**
+ * \brief arrs[0] += arrs[1] + ... + arrs[k-1], the n entries are divided into
+ * nparts parts, which are summed in parallel
+ *
+ * a part is summed block by block, so the block of arrs[0] stays in cache
+ * when the other arrays are added
+ *
+ * @param node if non-negative, the tasks prefer to run on this NUMA node
+ */
+inline void Reduce(const std::vector<real_t*>& arrs, size_t n, int nparts,
+                   int node = -1) {
+  if (arrs.size() < 2) return;
+  const size_t kBlock = 2048;
+  real_t* dst = arrs[0];
+  TaskGroup group;
+  for (int p = 0; p < nparts; ++p) {
+    group.Run([&arrs, dst, n, nparts, p, kBlock]() {
+        Range rg = Range(0, n).Segment(p, nparts);
+        for (size_t b = rg.begin; b < rg.end; b += kBlock) {
+          size_t e = std::min(b + kBlock, static_cast<size_t>(rg.end));
+          for (size_t k = 1; k < arrs.size(); ++k) {
+            real_t const* src = arrs[k];
+            for (size_t j = b; j < e; ++j) dst[j] += src[j];
+          }
+        }
+      }, node);
+  }
+  group.Wait();
+}
+
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_REDUCE_H_
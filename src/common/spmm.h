@@ -6,9 +6,10 @@
 #include <cstring>
 #include <vector>
 #include "dmlc/data.h"
-#include "dmlc/omp.h"
 #include "difacto/sarray.h"
 #include "./range.h"
+#include "./task_scheduler.h"
+#include "./col_buckets.h"
 namespace difacto {
 /**
  * \brief multi-thread sparse matrix dense matrix multiplication
@@ -89,6 +90,9 @@ class SpMM {
  private:
   /**
    * \brief y += D * x, C pointer version
+   *
+   * chooses a kernel specialized on the common k, whether D is binary and
+   * whether the position maps are used
    */
   template<typename V, typename I>
   static void Times(const SpMat& D,
@@ -98,31 +102,80 @@ class SpMM {
                     I const* y_pos,
                     int k,
                     int nthreads) {
-#pragma omp parallel num_threads(nthreads)
-    {
-      Range rg = Range(0, D.size).Segment(
-          omp_get_thread_num(), omp_get_num_threads());
+    switch (k) {
+      case 8: Times<8>(D, x, y, x_pos, y_pos, k, nthreads); break;
+      case 16: Times<16>(D, x, y, x_pos, y_pos, k, nthreads); break;
+      case 32: Times<32>(D, x, y, x_pos, y_pos, k, nthreads); break;
+      case 64: Times<64>(D, x, y, x_pos, y_pos, k, nthreads); break;
+      default: Times<0>(D, x, y, x_pos, y_pos, k, nthreads);
+    }
+  }
 
-      for (size_t i = rg.begin; i < rg.end; ++i) {
-        if (D.offset[i] == D.offset[i+1]) continue;
-        V* y_i = GetPtr(y, y_pos, i, k);
-        if (!y_i) continue;
-        for (size_t j = D.offset[i]; j < D.offset[i+1]; ++j) {
-          V const* x_j = GetPtr(x, x_pos, D.index[j], k);
-          if (!x_j) continue;
-          if (D.value) {
-            V v = D.value[j];
-            for (int l = 0; l < k; ++l) y_i[l] += x_j[l] * v;
-          } else {
-            for (int l = 0; l < k; ++l) y_i[l] += x_j[l];
-          }
-        }
+  template<int kDim, typename V, typename I>
+  static void Times(const SpMat& D,
+                    V const* x,
+                    V* y,
+                    I const* x_pos,
+                    I const* y_pos,
+                    int k,
+                    int nthreads) {
+    bool pos = x_pos || y_pos;
+    if (D.value) {
+      if (pos) {
+        Times<kDim, true, true>(D, x, y, x_pos, y_pos, k, nthreads);
+      } else {
+        Times<kDim, true, false>(D, x, y, x_pos, y_pos, k, nthreads);
+      }
+    } else {
+      if (pos) {
+        Times<kDim, false, true>(D, x, y, x_pos, y_pos, k, nthreads);
+      } else {
+        Times<kDim, false, false>(D, x, y, x_pos, y_pos, k, nthreads);
       }
     }
   }
 
+  /**
+   * \brief y += D * x
+   * @tparam kDim k if known at compile time, otherwise 0
+   * @tparam kValued false if D is binary, namely D.value is nullptr
+   * @tparam kPos false if both x_pos and y_pos are nullptr
+   */
+  template<int kDim, bool kValued, bool kPos, typename V, typename I>
+  static void Times(const SpMat& D,
+                    V const* x,
+                    V* y,
+                    I const* x_pos,
+                    I const* y_pos,
+                    int k,
+                    int nthreads) {
+    const int n = kDim ? kDim : k;
+    ParallelRun(nthreads, [&](int tid, int nt) {
+        Range rg = Range(0, D.size).Segment(tid, nt);
+
+        for (size_t i = rg.begin; i < rg.end; ++i) {
+          if (D.offset[i] == D.offset[i+1]) continue;
+          V* y_i = GetPtr<kPos>(y, y_pos, i, n);
+          if (kPos && !y_i) continue;
+          for (size_t j = D.offset[i]; j < D.offset[i+1]; ++j) {
+            V const* x_j = GetPtr<kPos>(x, x_pos, D.index[j], n);
+            if (kPos && !x_j) continue;
+            if (kValued) {
+              V v = D.value[j];
+              for (int l = 0; l < n; ++l) y_i[l] += x_j[l] * v;
+            } else {
+              for (int l = 0; l < n; ++l) y_i[l] += x_j[l];
+            }
+          }
+        }
+      });
+  }
+
   /**
    * \brief y += D' * x, C pointer version
+   *
+   * uses the column buckets if worth, and chooses a kernel specialized as
+   * Times does
    */
   template<typename V, typename I>
   static void TransTimes(const SpMat& D,
@@ -133,34 +186,126 @@ class SpMM {
                          int k,
                          size_t ncols,
                          int nthreads) {
-#pragma omp parallel num_threads(nthreads)
-    {
-      Range rg = Range(0, ncols).Segment(
-          omp_get_thread_num(), omp_get_num_threads());
+    switch (k) {
+      case 8: TransTimes<8>(D, x, y, x_pos, y_pos, k, ncols, nthreads); break;
+      case 16: TransTimes<16>(D, x, y, x_pos, y_pos, k, ncols, nthreads); break;
+      case 32: TransTimes<32>(D, x, y, x_pos, y_pos, k, ncols, nthreads); break;
+      case 64: TransTimes<64>(D, x, y, x_pos, y_pos, k, ncols, nthreads); break;
+      default: TransTimes<0>(D, x, y, x_pos, y_pos, k, ncols, nthreads);
+    }
+  }
 
-      for (size_t i = 0; i < D.size; ++i) {
-        if (D.offset[i] == D.offset[i+1]) continue;
-        V const* x_i = GetPtr(x, x_pos, i, k);
-        if (!x_i) continue;
-        for (size_t j = D.offset[i]; j < D.offset[i+1]; ++j) {
-          unsigned e = D.index[j];
-          if (!rg.Has(e)) continue;
-          V* y_j = GetPtr(y, y_pos, e, k);
-          if (!y_j) continue;
-          if (D.value) {
-            V v = D.value[j];
-            for (int l = 0; l < k; ++l) y_j[l] += x_i[l] * v;
-          } else {
-            for (int l = 0; l < k; ++l) y_j[l] += x_i[l];
-          }
+  template<int kDim, typename V, typename I>
+  static void TransTimes(const SpMat& D,
+                         V const* x,
+                         V* y,
+                         I const* x_pos,
+                         I const* y_pos,
+                         int k,
+                         size_t ncols,
+                         int nthreads) {
+    bool pos = x_pos || y_pos;
+    if (ColBuckets::Worth(D, ncols, nthreads)) {
+      ColBuckets bk(D, ncols, nthreads * 4, nthreads);
+      if (D.value) {
+        if (pos) {
+          TransTimes<kDim, true, true>(bk, x, y, x_pos, y_pos, k, nthreads);
+        } else {
+          TransTimes<kDim, true, false>(bk, x, y, x_pos, y_pos, k, nthreads);
+        }
+      } else {
+        if (pos) {
+          TransTimes<kDim, false, true>(bk, x, y, x_pos, y_pos, k, nthreads);
+        } else {
+          TransTimes<kDim, false, false>(bk, x, y, x_pos, y_pos, k, nthreads);
         }
       }
+      return;
     }
+    if (D.value) {
+      if (pos) {
+        TransTimes<kDim, true, true>(D, x, y, x_pos, y_pos, k, ncols, nthreads);
+      } else {
+        TransTimes<kDim, true, false>(D, x, y, x_pos, y_pos, k, ncols, nthreads);
+      }
+    } else {
+      if (pos) {
+        TransTimes<kDim, false, true>(D, x, y, x_pos, y_pos, k, ncols, nthreads);
+      } else {
+        TransTimes<kDim, false, false>(D, x, y, x_pos, y_pos, k, ncols, nthreads);
+      }
+    }
+  }
+
+  /**
+   * \brief y += D' * x, each thread scans the whole matrix but only updates
+   * its own columns
+   */
+  template<int kDim, bool kValued, bool kPos, typename V, typename I>
+  static void TransTimes(const SpMat& D,
+                         V const* x,
+                         V* y,
+                         I const* x_pos,
+                         I const* y_pos,
+                         int k,
+                         size_t ncols,
+                         int nthreads) {
+    const int n = kDim ? kDim : k;
+    ParallelRun(nthreads, [&](int tid, int nt) {
+        Range rg = Range(0, ncols).Segment(tid, nt);
+
+        for (size_t i = 0; i < D.size; ++i) {
+          if (D.offset[i] == D.offset[i+1]) continue;
+          V const* x_i = GetPtr<kPos>(x, x_pos, i, n);
+          if (kPos && !x_i) continue;
+          for (size_t j = D.offset[i]; j < D.offset[i+1]; ++j) {
+            unsigned e = D.index[j];
+            if (!rg.Has(e)) continue;
+            V* y_j = GetPtr<kPos>(y, y_pos, e, n);
+            if (kPos && !y_j) continue;
+            if (kValued) {
+              V v = D.value[j];
+              for (int l = 0; l < n; ++l) y_j[l] += x_i[l] * v;
+            } else {
+              for (int l = 0; l < n; ++l) y_j[l] += x_i[l];
+            }
+          }
+        }
+      });
+  }
+
+  /**
+   * \brief y += D' * x, each thread only visits the entries of its own
+   * column buckets
+   */
+  template<int kDim, bool kValued, bool kPos, typename V, typename I>
+  static void TransTimes(const ColBuckets& buckets,
+                         V const* x,
+                         V* y,
+                         I const* x_pos,
+                         I const* y_pos,
+                         int k,
+                         int nthreads) {
+    const int n = kDim ? kDim : k;
+    ParallelFor(buckets.size(), nthreads, [&](int tid, int b) {
+        for (auto e = buckets.begin(b); e != buckets.end(b); ++e) {
+          V const* x_i = GetPtr<kPos>(x, x_pos, e->row, n);
+          if (kPos && !x_i) continue;
+          V* y_j = GetPtr<kPos>(y, y_pos, e->col, n);
+          if (kPos && !y_j) continue;
+          if (kValued) {
+            V v = e->val;
+            for (int l = 0; l < n; ++l) y_j[l] += x_i[l] * v;
+          } else {
+            for (int l = 0; l < n; ++l) y_j[l] += x_i[l];
+          }
+        }
+      });
   }
 
-  template <typename V, typename I>
+  template <bool kPos, typename V, typename I>
   static inline V* GetPtr(V* val, I const* pos, size_t idx, int k) {
-    if (pos) {
+    if (kPos && pos) {
       I pos_i = pos[idx];
       return pos_i == static_cast<I>(-1) ? nullptr : val+pos_i;
     } else {
@@ -3,11 +3,12 @@
  */
 #ifndef DIFACTO_COMMON_SPMT_H_
 #define DIFACTO_COMMON_SPMT_H_
+#include <algorithm>
 #include <cstring>
 #include <vector>
 #include "dmlc/data.h"
-#include "dmlc/omp.h"
 #include "./range.h"
+#include "./task_scheduler.h"
 #include "data/row_block.h"
 #include "difacto/base.h"
 namespace difacto {
@@ -19,6 +20,13 @@ class SpMT {
  public:
   /**
    * \brief transpose matrix Y = X'
+   *
+   * the rows of X are divided into segments. each thread counts the entries
+   * per column of its own segment, then a prefix sum over (column, segment)
+   * gives the position every segment writes into, and each thread scatters
+   * its segment. so X is scanned twice in total, rather than twice per
+   * thread. the rows of a column are still in increasing order.
+   *
    * \param X sparse matrix in row major
    * \param Y sparse matrix in row major
    * \param X_ncols optional, number of columns in X
@@ -32,8 +40,8 @@ class SpMT {
     size_t nrows = X.size;
     size_t nnz = X.offset[nrows] - X.offset[0];
     if (X_ncols == 0) {
-      for (size_t i = 0; i < nnz; ++i) {
-        if (X_ncols < X.index[i]) X_ncols = X.index[i];
+      for (size_t j = X.offset[0]; j < X.offset[nrows]; ++j) {
+        if (X_ncols < X.index[j]) X_ncols = X.index[j];
       }
       ++X_ncols;
     }
@@ -44,49 +52,50 @@ class SpMT {
     Y->offset.resize(X_ncols+1, 0);
     Y->index.resize(nnz);
     if (X.value) Y->value.resize(nnz);
+    if (nnz == 0) return;
 
-    // fill Y->offset
-#pragma omp parallel num_threads(nt)
-    {
-      Range range = Range(0, X_ncols).Segment(
-          omp_get_thread_num(), omp_get_num_threads());
-      for (size_t i = 0; i < nnz; ++i) {
-        unsigned k = X.index[i];
-        if (!range.Has(k)) continue;
-        ++Y->offset[k+1];
-      }
-    }
-    for (size_t i = 0; i < X_ncols; ++i) {
-      Y->offset[i+1] += Y->offset[i];
-    }
+    // the counters take nseg * X_ncols, keep them within a few times of nnz
+    size_t ncols = X_ncols;
+    size_t max_nseg = std::max(std::min(nrows, 4 * nnz / ncols),
+                               static_cast<size_t>(1));
+    int nseg = static_cast<int>(
+        std::min(static_cast<size_t>(std::max(nt, 1)), max_nseg));
 
-    // fill Y->index and Y->value
-#pragma omp parallel num_threads(nt)
-    {
-      Range range = Range(0, X_ncols).Segment(
-          omp_get_thread_num(), omp_get_num_threads());
-
-      for (size_t i = 0; i < nrows; ++i) {
-        if (X.offset[i] == X.offset[i+1]) continue;
-        for (size_t j = X.offset[i]; j < X.offset[i+1]; ++j) {
-          unsigned k = X.index[j];
-          if (!range.Has(k)) continue;
-          if (X.value) {
-            Y->value[Y->offset[k]] = X.value[j];
-          }
-          Y->index[Y->offset[k]] = static_cast<unsigned>(i);
-          ++Y->offset[k];
+    // count the entries of each (row segment, column)
+    std::vector<size_t> pos(nseg * ncols, 0);
+    ParallelRun(nseg, [&](int t, int nt) {
+        Range rg = Range(0, nrows).Segment(t, nseg);
+        size_t* c = pos.data() + t * ncols;
+        for (size_t j = X.offset[rg.begin]; j < X.offset[rg.end]; ++j) {
+          ++c[X.index[j]];
         }
-      }
-    }
+      });
 
-    // restore Y->offset
-    if (X_ncols > 0) {
-      for (size_t i = X_ncols -1; i > 0; --i) {
-        Y->offset[i] = Y->offset[i-1];
+    // the start position of each (row segment, column), column major
+    size_t n = 0;
+    for (size_t k = 0; k < ncols; ++k) {
+      Y->offset[k] = n;
+      for (int t = 0; t < nseg; ++t) {
+        size_t c = pos[t * ncols + k];
+        pos[t * ncols + k] = n;
+        n += c;
       }
-      Y->offset[0] = 0;
     }
+    Y->offset[ncols] = n;
+    CHECK_EQ(n, nnz);
+
+    // scatter the entries
+    ParallelRun(nseg, [&](int t, int nt) {
+        Range rg = Range(0, nrows).Segment(t, nseg);
+        size_t* p = pos.data() + t * ncols;
+        for (size_t i = rg.begin; i < rg.end; ++i) {
+          for (size_t j = X.offset[i]; j < X.offset[i+1]; ++j) {
+            size_t q = p[X.index[j]]++;
+            Y->index[q] = static_cast<unsigned>(i);
+            if (X.value) Y->value[q] = X.value[j];
+          }
+        }
+      });
   }
 };
 }  // namespace difacto
@@ -6,8 +6,10 @@
 #include <cstring>
 #include <vector>
 #include "dmlc/data.h"
-#include "dmlc/omp.h"
 #include "./range.h"
+#include "./task_scheduler.h"
+#include "./col_buckets.h"
+#include "./packed_block.h"
 namespace difacto {
 
 /**
@@ -100,9 +102,67 @@ class SpMV {
                nthreads);
   }
 
+  /**
+   * \brief y += D * x, where D is packed
+   *
+   * @param square if true, then uses D .* D rather than D
+   * @see Times
+   */
+  template<typename Vec, typename Pos = std::vector<int>>
+  static void Times(const PackedBlock& D,
+                    const Vec& x,
+                    Vec* y,
+                    int nthreads = DEFAULT_NTHREADS,
+                    const Pos& x_pos = Pos(),
+                    const Pos& y_pos = Pos(),
+                    bool square = false) {
+    CHECK_NOTNULL(y);
+    if (y_pos.size()) {
+      CHECK_EQ(y_pos.size(), D.size());
+    } else {
+      CHECK_EQ(y->size(), D.size());
+    }
+    CheckPos(x_pos, x.size());
+    CheckPos(y_pos, y->size());
+    Times(D, x.data(), y->data(),
+          (x_pos.empty() ? nullptr : x_pos.data()),
+          (y_pos.empty() ? nullptr : y_pos.data()),
+          square, nthreads);
+  }
+
+  /**
+   * \brief y += D^T * x, where D is packed
+   *
+   * @see TransTimes
+   */
+  template<typename Vec, typename Pos = std::vector<int>>
+  static void TransTimes(const PackedBlock& D,
+                         const Vec& x,
+                         Vec* y,
+                         int nthreads = DEFAULT_NTHREADS,
+                         const Pos& x_pos = Pos(),
+                         const Pos& y_pos = Pos()) {
+    if (x_pos.size()) {
+      CHECK_EQ(x_pos.size(), D.size());
+    } else {
+      CHECK_EQ(x.size(), D.size());
+    }
+    CHECK_NOTNULL(y);
+    CheckPos(x_pos, x.size());
+    CheckPos(y_pos, y->size());
+    size_t ncol = y_pos.size() ? y_pos.size() : y->size();
+    TransTimes(D, x.data(), y->data(), ncol,
+               (x_pos.empty() ? nullptr : x_pos.data()),
+               (y_pos.empty() ? nullptr : y_pos.data()),
+               nthreads);
+  }
+
  private:
   /**
    * \brief y += D * x, C pointer version
+   *
+   * chooses a kernel specialized on whether D is binary and whether the
+   * position maps are used, so the innermost loop has no such branches
    */
   template<typename V, typename I>
   static void Times(const SpMat& D,
@@ -111,30 +171,59 @@ class SpMV {
                     I const* x_pos,
                     I const* y_pos,
                     int nthreads) {
-#pragma omp parallel num_threads(nthreads)
-    {
-      Range rg = Range(0, D.size).Segment(
-          omp_get_thread_num(), omp_get_num_threads());
-
-      for (size_t i = rg.begin; i < rg.end; ++i) {
-        if (D.offset[i] == D.offset[i+1]) continue;
-        V* y_i = GetPtr(y, y_pos, i);
-        if (!y_i) continue;
-        for (size_t j = D.offset[i]; j < D.offset[i+1]; ++j) {
-          V x_j = GetVal(x, x_pos, D.index[j]);
-          if (x_j == 0) continue;
-          if (D.value) {
-            *y_i += x_j * D.value[j];
-          } else {
-            *y_i += x_j;
-          }
-        }
+    bool pos = x_pos || y_pos;
+    if (D.value) {
+      if (pos) {
+        Times<true, true>(D, x, y, x_pos, y_pos, nthreads);
+      } else {
+        Times<true, false>(D, x, y, x_pos, y_pos, nthreads);
+      }
+    } else {
+      if (pos) {
+        Times<false, true>(D, x, y, x_pos, y_pos, nthreads);
+      } else {
+        Times<false, false>(D, x, y, x_pos, y_pos, nthreads);
       }
     }
   }
 
+  /**
+   * \brief y += D * x
+   * @tparam kValued false if D is binary, namely D.value is nullptr
+   * @tparam kPos false if both x_pos and y_pos are nullptr
+   */
+  template<bool kValued, bool kPos, typename V, typename I>
+  static void Times(const SpMat& D,
+                    V const* x,
+                    V* y,
+                    I const* x_pos,
+                    I const* y_pos,
+                    int nthreads) {
+    ParallelRun(nthreads, [&](int tid, int nt) {
+        Range rg = Range(0, D.size).Segment(tid, nt);
+
+        for (size_t i = rg.begin; i < rg.end; ++i) {
+          if (D.offset[i] == D.offset[i+1]) continue;
+          V* y_i = GetPtr<kPos>(y, y_pos, i);
+          if (kPos && !y_i) continue;
+          for (size_t j = D.offset[i]; j < D.offset[i+1]; ++j) {
+            V x_j = GetVal<kPos>(x, x_pos, D.index[j]);
+            if (x_j == 0) continue;
+            if (kValued) {
+              *y_i += x_j * D.value[j];
+            } else {
+              *y_i += x_j;
+            }
+          }
+        }
+      });
+  }
+
   /**
    * \brief y += D' * x, C pointer version
+   *
+   * uses the column buckets if worth, and chooses a kernel specialized as
+   * Times does
    */
   template<typename V, typename I>
   static void TransTimes(const SpMat& D,
@@ -144,35 +233,274 @@ class SpMV {
                          I const* x_pos,
                          I const* y_pos,
                          int nthreads) {
-#pragma omp parallel num_threads(nthreads)
-    {
-      Range rg = Range(0, ncol).Segment(
-          omp_get_thread_num(), omp_get_num_threads());
-
-      for (size_t i = 0; i < D.size; ++i) {
-        if (D.offset[i] == D.offset[i+1]) continue;
-        V x_i = GetVal(x, x_pos, i);
-        if (x_i == 0) continue;
-        for (size_t j = D.offset[i]; j < D.offset[i+1]; ++j) {
-          unsigned k = D.index[j];
-          if (rg.Has(k)) {
-            V* y_j = GetPtr(y, y_pos, k);
-            if (y_j) {
-              if (D.value) {
-                *y_j += x_i * D.value[j];
-              } else {
-                *y_j += x_i;
-              }
+    bool pos = x_pos || y_pos;
+    if (ColBuckets::Worth(D, ncol, nthreads)) {
+      ColBuckets buckets(D, ncol, nthreads * 4, nthreads);
+      if (D.value) {
+        if (pos) {
+          TransTimes<true, true>(buckets, x, y, x_pos, y_pos, nthreads);
+        } else {
+          TransTimes<true, false>(buckets, x, y, x_pos, y_pos, nthreads);
+        }
+      } else {
+        if (pos) {
+          TransTimes<false, true>(buckets, x, y, x_pos, y_pos, nthreads);
+        } else {
+          TransTimes<false, false>(buckets, x, y, x_pos, y_pos, nthreads);
+        }
+      }
+      return;
+    }
+    if (D.value) {
+      if (pos) {
+        TransTimes<true, true>(D, x, y, ncol, x_pos, y_pos, nthreads);
+      } else {
+        TransTimes<true, false>(D, x, y, ncol, x_pos, y_pos, nthreads);
+      }
+    } else {
+      if (pos) {
+        TransTimes<false, true>(D, x, y, ncol, x_pos, y_pos, nthreads);
+      } else {
+        TransTimes<false, false>(D, x, y, ncol, x_pos, y_pos, nthreads);
+      }
+    }
+  }
+
+  /**
+   * \brief y += D' * x, each thread scans the whole matrix but only updates
+   * its own columns
+   */
+  template<bool kValued, bool kPos, typename V, typename I>
+  static void TransTimes(const SpMat& D,
+                         V const* x,
+                         V* y,
+                         size_t ncol,
+                         I const* x_pos,
+                         I const* y_pos,
+                         int nthreads) {
+    ParallelRun(nthreads, [&](int tid, int nt) {
+        Range rg = Range(0, ncol).Segment(tid, nt);
+
+        for (size_t i = 0; i < D.size; ++i) {
+          if (D.offset[i] == D.offset[i+1]) continue;
+          V x_i = GetVal<kPos>(x, x_pos, i);
+          if (x_i == 0) continue;
+          for (size_t j = D.offset[i]; j < D.offset[i+1]; ++j) {
+            unsigned k = D.index[j];
+            if (!rg.Has(k)) continue;
+            V* y_j = GetPtr<kPos>(y, y_pos, k);
+            if (kPos && !y_j) continue;
+            if (kValued) {
+              *y_j += x_i * D.value[j];
+            } else {
+              *y_j += x_i;
             }
           }
         }
+      });
+  }
+
+  /**
+   * \brief y += D' * x, each thread only visits the entries of its own
+   * column buckets
+   */
+  template<bool kValued, bool kPos, typename V, typename I>
+  static void TransTimes(const ColBuckets& buckets,
+                         V const* x,
+                         V* y,
+                         I const* x_pos,
+                         I const* y_pos,
+                         int nthreads) {
+    ParallelFor(buckets.size(), nthreads, [&](int tid, int b) {
+        for (auto e = buckets.begin(b); e != buckets.end(b); ++e) {
+          V x_i = GetVal<kPos>(x, x_pos, e->row);
+          if (x_i == 0) continue;
+          V* y_j = GetPtr<kPos>(y, y_pos, e->col);
+          if (kPos && !y_j) continue;
+          if (kValued) {
+            *y_j += x_i * e->val;
+          } else {
+            *y_j += x_i;
+          }
+        }
+      });
+  }
+
+  /** \brief the values of a binary packed matrix */
+  struct NoValue {
+    real_t operator()(size_t j) const { return 1; }
+  };
+  struct RealValue {
+    real_t const* value;
+    real_t operator()(size_t j) const { return value[j]; }
+  };
+  struct HalfValue {
+    uint16_t const* value;
+    real_t operator()(size_t j) const { return HalfToFloat(value[j]); }
+  };
+  template <typename Val>
+  struct SquaredValue {
+    Val val;
+    real_t operator()(size_t j) const { real_t v = val(j); return v * v; }
+  };
+
+  /**
+   * \brief y += D * x, C pointer version for a packed D
+   *
+   * chooses a kernel specialized on how the values are stored and whether
+   * the position maps are used
+   */
+  template<typename V, typename I>
+  static void Times(const PackedBlock& D,
+                    V const* x,
+                    V* y,
+                    I const* x_pos,
+                    I const* y_pos,
+                    bool square,
+                    int nthreads) {
+    if (D.value16.size()) {
+      HalfValue val{D.value16.data()};
+      if (square) {
+        PackedTimes(D, SquaredValue<HalfValue>{val}, x, y, x_pos, y_pos, nthreads);
+      } else {
+        PackedTimes(D, val, x, y, x_pos, y_pos, nthreads);
+      }
+    } else if (D.value.size()) {
+      RealValue val{D.value.data()};
+      if (square) {
+        PackedTimes(D, SquaredValue<RealValue>{val}, x, y, x_pos, y_pos, nthreads);
+      } else {
+        PackedTimes(D, val, x, y, x_pos, y_pos, nthreads);
       }
+    } else {
+      PackedTimes(D, NoValue(), x, y, x_pos, y_pos, nthreads);
+    }
+  }
+
+  template<typename Val, typename V, typename I>
+  static void PackedTimes(const PackedBlock& D,
+                          const Val& val,
+                          V const* x,
+                          V* y,
+                          I const* x_pos,
+                          I const* y_pos,
+                          int nthreads) {
+    if (x_pos || y_pos) {
+      Times<true>(D, val, x, y, x_pos, y_pos, nthreads);
+    } else {
+      Times<false>(D, val, x, y, x_pos, y_pos, nthreads);
+    }
+  }
+
+  /**
+   * \brief y += D' * x, C pointer version for a packed D
+   */
+  template<typename V, typename I>
+  static void TransTimes(const PackedBlock& D,
+                         V const* x,
+                         V* y,
+                         size_t ncol,
+                         I const* x_pos,
+                         I const* y_pos,
+                         int nthreads) {
+    if (D.value16.size()) {
+      PackedTransTimes(D, HalfValue{D.value16.data()}, x, y, ncol,
+                       x_pos, y_pos, nthreads);
+    } else if (D.value.size()) {
+      PackedTransTimes(D, RealValue{D.value.data()}, x, y, ncol,
+                       x_pos, y_pos, nthreads);
+    } else {
+      PackedTransTimes(D, NoValue(), x, y, ncol, x_pos, y_pos, nthreads);
     }
   }
 
-  template <typename V, typename I>
+  template<typename Val, typename V, typename I>
+  static void PackedTransTimes(const PackedBlock& D,
+                               const Val& val,
+                               V const* x,
+                               V* y,
+                               size_t ncol,
+                               I const* x_pos,
+                               I const* y_pos,
+                               int nthreads) {
+    if (x_pos || y_pos) {
+      TransTimes<true>(D, val, x, y, ncol, x_pos, y_pos, nthreads);
+    } else {
+      TransTimes<false>(D, val, x, y, ncol, x_pos, y_pos, nthreads);
+    }
+  }
+
+  /**
+   * \brief y += D * x, decodes the indices of a row group by group
+   */
+  template<bool kPos, typename Val, typename V, typename I>
+  static void Times(const PackedBlock& D,
+                    const Val& val,
+                    V const* x,
+                    V* y,
+                    I const* x_pos,
+                    I const* y_pos,
+                    int nthreads) {
+    ParallelRun(nthreads, [&](int tid, int nt) {
+        Range rg = Range(0, D.size()).Segment(tid, nt);
+        unsigned idx[PackedBlock::kGroup];
+        for (size_t i = rg.begin; i < rg.end; ++i) {
+          if (D.offset[i] == D.offset[i+1]) continue;
+          V* y_i = GetPtr<kPos>(y, y_pos, i);
+          if (kPos && !y_i) continue;
+          V sum = *y_i;
+          PackedBlock::RowReader rd(D, i);
+          size_t j = D.offset[i];
+          for (int n; (n = rd.Next(idx)) > 0; j += n) {
+            for (int k = 0; k < n; ++k) {
+              sum += GetVal<kPos>(x, x_pos, idx[k]) * val(j + k);
+            }
+          }
+          *y_i = sum;
+        }
+      });
+  }
+
+  /**
+   * \brief y += D' * x, each thread decodes the whole matrix but only updates
+   * its own columns. the indices of a row are sorted, so the groups out of
+   * the columns are skipped
+   */
+  template<bool kPos, typename Val, typename V, typename I>
+  static void TransTimes(const PackedBlock& D,
+                         const Val& val,
+                         V const* x,
+                         V* y,
+                         size_t ncol,
+                         I const* x_pos,
+                         I const* y_pos,
+                         int nthreads) {
+    ParallelRun(nthreads, [&](int tid, int nt) {
+        Range rg = Range(0, ncol).Segment(tid, nt);
+        unsigned idx[PackedBlock::kGroup];
+        for (size_t i = 0; i < D.size(); ++i) {
+          if (D.offset[i] == D.offset[i+1]) continue;
+          V x_i = GetVal<kPos>(x, x_pos, i);
+          if (x_i == 0) continue;
+          PackedBlock::RowReader rd(D, i);
+          size_t j = D.offset[i];
+          for (int n; (n = rd.Next(idx)) > 0; j += n) {
+            if (idx[n-1] < rg.begin) continue;
+            if (idx[0] >= rg.end) break;
+            for (int k = 0; k < n; ++k) {
+              if (!rg.Has(idx[k])) continue;
+              V* y_j = GetPtr<kPos>(y, y_pos, idx[k]);
+              if (kPos && !y_j) continue;
+              *y_j += x_i * val(j + k);
+            }
+          }
+        }
+      });
+  }
+
+  template <bool kPos, typename V, typename I>
   static inline V GetVal(V const* val, I const* pos, size_t idx) {
-    if (pos) {
+    if (kPos && pos) {
       I pos_i = pos[idx];
       return pos_i == static_cast<I>(-1) ? 0 : val[pos_i];
     } else {
@@ -180,9 +508,9 @@ class SpMV {
     }
   }
 
-  template <typename V, typename I>
+  template <bool kPos, typename V, typename I>
   static inline V* GetPtr(V* val, I const* pos, size_t idx) {
-    if (pos) {
+    if (kPos && pos) {
       I pos_i = pos[idx];
       return pos_i == static_cast<I>(-1) ? nullptr : val+pos_i;
     } else {
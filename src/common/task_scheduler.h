@@ -0,0 +1,403 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_COMMON_TASK_SCHEDULER_H_
+#define DIFACTO_COMMON_TASK_SCHEDULER_H_
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "dmlc/logging.h"
+#include "./numa.h"
+namespace difacto {
+
+/**
+ * \brief a process-wide work-stealing scheduler
+ *
+ * each worker has its own deque. a worker pushes and pops tasks at the back
+ * of its deque, and steals from the front of the others when its deque is
+ * empty. a thread waiting for a \ref TaskGroup executes the queued tasks of
+ * that group meanwhile, so nested parallelism, such as a parallel kernel
+ * inside a task, reuses the same threads rather than creating a new team.
+ *
+ * on a NUMA machine, the workers are partitioned among the nodes and pinned
+ * to them. a task can be pushed to a node, and a worker steals from the
+ * workers of its own node before the others, so the data first touched on a
+ * node is mostly used there.
+ *
+ * use \ref TaskGroup, \ref ParallelRun and \ref ParallelFor rather than this
+ * class directly
+ */
+class TaskScheduler {
+ public:
+  using Task = std::function<void()>;
+
+  /**
+   * \brief the scheduler shared by the whole process, the caller of a wait
+   * also works, so there are hardware_concurrency - 1 workers
+   */
+  static TaskScheduler* Get() {
+    static TaskScheduler sched(
+        std::max(1, static_cast<int>(std::thread::hardware_concurrency())) - 1,
+        Numa::Get().NumNodes());
+    return &sched;
+  }
+
+  /**
+   * @param num_workers the number of worker threads
+   * @param num_nodes the number of NUMA nodes, the workers are pinned if
+   * larger than 1
+   */
+  explicit TaskScheduler(int num_workers, int num_nodes = 1)
+      : queues_(std::max(num_workers, 1)) {
+    CHECK_GE(num_workers, 0);
+    CHECK_GE(num_nodes, 1);
+    int nq = static_cast<int>(queues_.size());
+    num_nodes_ = std::min(num_nodes, nq);
+    node_queues_.resize(num_nodes_);
+    for (int i = 0; i < nq; ++i) {
+      queues_[i].reset(new Queue());
+      queues_[i]->node = static_cast<int>(
+          static_cast<int64_t>(i) * num_nodes_ / nq);
+      node_queues_[queues_[i]->node].push_back(i);
+    }
+    for (int i = 0; i < num_workers; ++i) {
+      workers_.push_back(std::thread([this, i]() { RunWorker(i); }));
+    }
+  }
+
+  ~TaskScheduler() {
+    {
+      std::lock_guard<std::mutex> lk(sleep_mu_);
+      done_ = true;
+    }
+    sleep_cond_.notify_all();
+    for (auto& w : workers_) w.join();
+  }
+
+  /** \brief the number of threads can run tasks at the same time */
+  int NumThreads() const { return static_cast<int>(workers_.size()) + 1; }
+
+  /** \brief the number of NUMA nodes used */
+  int NumNodes() const { return num_nodes_; }
+
+  /**
+   * \brief the home node of the i-th of a sequence of items, such as row
+   * blocks, which are placed round robin
+   */
+  int HomeNode(int i) const { return i % num_nodes_; }
+
+  /**
+   * \brief queue a task, it goes to the deque of the calling worker, or a
+   * deque picked round robin if not called by a worker
+   *
+   * @param node if non-negative, the task goes to a worker of this node
+   */
+  void Push(const Task& task, int node = -1) {
+    int id = WorkerId();
+    int nq = static_cast<int>(queues_.size());
+    if (node >= 0) {
+      node %= num_nodes_;
+      if (id < 0 || id >= nq || queues_[id]->node != node) {
+        const auto& ids = node_queues_[node];
+        id = ids[next_queue_++ % ids.size()];
+      }
+    } else if (id < 0 || id >= nq) {
+      id = next_queue_++ % nq;
+    }
+    {
+      Queue& q = *queues_[id];
+      std::lock_guard<std::mutex> lk(q.mu);
+      q.tasks.push_back(task);
+    }
+    ++num_queued_;
+    if (num_idle_ > 0) {
+      std::lock_guard<std::mutex> lk(sleep_mu_);
+      sleep_cond_.notify_one();
+    }
+  }
+
+ private:
+  struct Queue {
+    std::mutex mu;
+    std::deque<Task> tasks;
+    /** \brief the node of the worker */
+    int node = 0;
+  };
+
+  /** \brief the worker id of the current thread, -1 if not a worker */
+  static int& WorkerId() {
+    static thread_local int id = -1;
+    return id;
+  }
+
+  /**
+   * \brief pop from the back of its own deque, or steal from the others,
+   * the workers of the same node first
+   */
+  bool Pop(int id, Task* task) {
+    if (num_queued_ == 0) return false;
+    int n = static_cast<int>(queues_.size());
+    bool worker = id >= 0 && id < n;
+    if (worker) {
+      Queue& q = *queues_[id];
+      std::lock_guard<std::mutex> lk(q.mu);
+      if (!q.tasks.empty()) {
+        *task = std::move(q.tasks.back());
+        q.tasks.pop_back();
+        --num_queued_;
+        return true;
+      }
+    }
+    int start = worker ? id + 1 : next_steal_++;
+    int node = worker ? queues_[id]->node : -1;
+    for (int pass = node < 0 ? 1 : 0; pass < 2; ++pass) {
+      for (int k = 0; k < n; ++k) {
+        int v = (start + k) % n;
+        if (v == id || (pass == 0 && queues_[v]->node != node)) continue;
+        if (Steal(v, task)) return true;
+      }
+    }
+    return false;
+  }
+
+  bool Steal(int v, Task* task) {
+    Queue& q = *queues_[v];
+    std::lock_guard<std::mutex> lk(q.mu);
+    if (q.tasks.empty()) return false;
+    *task = std::move(q.tasks.front());
+    q.tasks.pop_front();
+    --num_queued_;
+    return true;
+  }
+
+  void RunWorker(int id) {
+    WorkerId() = id;
+    if (num_nodes_ > 1) Numa::Get().Bind(queues_[id]->node);
+    Task task;
+    while (true) {
+      if (Pop(id, &task)) {
+        task();
+        task = nullptr;
+        continue;
+      }
+      std::unique_lock<std::mutex> lk(sleep_mu_);
+      ++num_idle_;
+      sleep_cond_.wait(lk, [this]{ return done_ || num_queued_ > 0; });
+      --num_idle_;
+      if (done_) break;
+    }
+  }
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  /** \brief the queues of each node */
+  std::vector<std::vector<int>> node_queues_;
+  int num_nodes_;
+  std::vector<std::thread> workers_;
+  std::atomic<int> num_queued_{0};
+  std::atomic<int> num_idle_{0};
+  std::atomic<unsigned> next_queue_{0};
+  std::atomic<unsigned> next_steal_{0};
+  bool done_ = false;
+  std::mutex sleep_mu_;
+  std::condition_variable sleep_cond_;
+};
+
+/**
+ * \brief a group of tasks running on the \ref TaskScheduler
+ *
+ * a task is pushed to the scheduler, and also kept by the group until it is
+ * started, so a waiter can run the unstarted tasks of its group itself, and
+ * sleeps once all of them are started by others. whichever thread starts a
+ * task first runs it.
+ *
+ * \code
+ * TaskGroup group;
+ * for (int i = 0; i < n; ++i) group.Run([i]() { ... });
+ * group.Wait();
+ * \endcode
+ */
+class TaskGroup {
+ public:
+  /**
+   * @param max_pending if positive, \ref Run waits until less than
+   * max_pending tasks of this group are unfinished
+   */
+  explicit TaskGroup(int max_pending = 0,
+                     TaskScheduler* sched = TaskScheduler::Get())
+      : sched_(sched), max_pending_(max_pending), state_(new State()) { }
+
+  /** \brief will wait all tasks are done before deconstruction */
+  ~TaskGroup() { Wait(); }
+
+  /**
+   * \brief add a task
+   * @param node if non-negative, prefer to run it on this NUMA node
+   */
+  void Run(const std::function<void()>& task, int node = -1) {
+    if (max_pending_ > 0) WaitUntil(max_pending_ - 1);
+    std::shared_ptr<Entry> entry(new Entry(task));
+    std::shared_ptr<State> state = state_;
+    {
+      std::lock_guard<std::mutex> lk(state->mu);
+      ++state->pending;
+      // drop the ones started by the scheduler
+      while (!state->queued.empty() && state->queued.front()->started) {
+        state->queued.pop_front();
+      }
+      state->queued.push_back(entry);
+    }
+    // the scheduler may get it after this group is gone
+    sched_->Push([state, entry]() { Execute(state.get(), entry.get()); },
+                 node);
+  }
+
+  /**
+   * \brief wait until all tasks are finished, the unstarted tasks of this
+   * group are executed by the calling thread meanwhile
+   */
+  void Wait() { WaitUntil(0); }
+
+ private:
+  struct Entry {
+    explicit Entry(const std::function<void()>& task) : task(task) { }
+    std::function<void()> task;
+    std::atomic<bool> started{false};
+  };
+
+  struct State {
+    std::mutex mu;
+    std::condition_variable cond;
+    /** \brief the number of unfinished tasks */
+    int pending = 0;
+    /** \brief the tasks pushed to the scheduler, some may be started */
+    std::deque<std::shared_ptr<Entry>> queued;
+  };
+
+  /** \brief run the task unless another thread has started it */
+  static void Execute(State* state, Entry* entry) {
+    if (entry->started.exchange(true)) return;
+    entry->task();
+    {
+      std::lock_guard<std::mutex> lk(state->mu);
+      --state->pending;
+    }
+    state->cond.notify_all();
+  }
+
+  void WaitUntil(int n) {
+    State* s = state_.get();
+    std::unique_lock<std::mutex> lk(s->mu);
+    while (s->pending > n) {
+      if (s->queued.empty()) {
+        // the remaining tasks are running by others
+        s->cond.wait(lk, [s, n] {
+            return s->pending <= n || !s->queued.empty();
+          });
+        continue;
+      }
+      // the latest first, while the scheduler steals the earliest
+      std::shared_ptr<Entry> entry = std::move(s->queued.back());
+      s->queued.pop_back();
+      lk.unlock();
+      Execute(s, entry.get());
+      lk.lock();
+    }
+  }
+
+  TaskScheduler* sched_;
+  int max_pending_;
+  std::shared_ptr<State> state_;
+};
+
+/**
+ * \brief run fn(tid, ntasks) for tid in [0, ntasks) in parallel, the
+ * calling thread runs tid = 0
+ *
+ * it replaces "#pragma omp parallel num_threads(ntasks)", but the tasks share
+ * the threads of \ref TaskScheduler, so calling it inside a task partitions
+ * the cores instead of creating ntasks more threads
+ */
+inline void ParallelRun(int ntasks, const std::function<void(int, int)>& fn) {
+  if (ntasks <= 1 || TaskScheduler::Get()->NumThreads() == 1) {
+    for (int t = 0; t < std::max(ntasks, 1); ++t) fn(t, std::max(ntasks, 1));
+    return;
+  }
+  TaskGroup group;
+  for (int t = 1; t < ntasks; ++t) {
+    group.Run([&fn, t, ntasks]() { fn(t, ntasks); });
+  }
+  fn(0, ntasks);
+  group.Wait();
+}
+
+/**
+ * \brief run fn(tid, i) for i in [0, n) in parallel, the iterations are
+ * picked one by one by ntasks tasks, and tid in [0, ntasks) is the task
+ * running it
+ *
+ * it replaces "#pragma omp parallel for schedule(dynamic, 1)"
+ */
+inline void ParallelFor(int n, int ntasks,
+                        const std::function<void(int, int)>& fn) {
+  std::atomic<int> next{0};
+  ParallelRun(std::min(n, ntasks), [&fn, &next, n](int tid, int nt) {
+      for (int i; (i = next++) < n; ) fn(tid, i);
+    });
+}
+
+/**
+ * \brief run fn(tid, i) for i in [begin, end), where iteration i prefers to
+ * run on the node TaskScheduler::HomeNode(i)
+ *
+ * the tasks are spread over the nodes. a task runs the iterations of its
+ * node first, and then helps the other nodes
+ */
+inline void ParallelForNodes(int begin, int end, int ntasks,
+                             const std::function<void(int, int)>& fn,
+                             TaskScheduler* sched = TaskScheduler::Get()) {
+  int nnodes = sched->NumNodes();
+  if (nnodes == 1) {
+    ParallelFor(end - begin, ntasks, [&fn, begin](int tid, int i) {
+        fn(tid, begin + i);
+      });
+    return;
+  }
+  ntasks = std::max(1, std::min(end - begin, ntasks));
+  // the iterations of node v are first[v] + k * nnodes, next[v] is the next k
+  std::vector<int> first(nnodes);
+  std::unique_ptr<std::atomic<int>[]> next(new std::atomic<int>[nnodes]);
+  for (int v = 0; v < nnodes; ++v) {
+    first[v] = begin + (v - sched->HomeNode(begin) + nnodes) % nnodes;
+    next[v] = 0;
+  }
+  TaskGroup group(0, sched);
+  for (int t = 0; t < ntasks; ++t) {
+    int node = t % nnodes;
+    group.Run([&fn, &first, &next, end, nnodes, t, node]() {
+        for (int k = 0; k < nnodes; ++k) {
+          int v = (node + k) % nnodes;
+          for (int i; (i = first[v] + next[v]++ * nnodes) < end; ) fn(t, i);
+        }
+      }, node);
+  }
+  group.Wait();
+}
+
+/**
+ * \brief the number of threads each of nparts concurrent parts should use,
+ * so the parts together use about nthreads threads
+ */
+inline int PartitionThreads(int nthreads, int nparts) {
+  nparts = std::max(1, std::min(nparts, nthreads));
+  return std::max(1, nthreads / nparts);
+}
+
+}  // namespace difacto
+#endif  // DIFACTO_COMMON_TASK_SCHEDULER_H_
@@ -3,16 +3,19 @@
  */
 #ifndef DIFACTO_COMMON_THREAD_POOL_H_
 #define DIFACTO_COMMON_THREAD_POOL_H_
-#include <list>
 #include <functional>
 #include <vector>
 #include <thread>
-#include <mutex>
 #include <atomic>
-#include <condition_variable>
+#include <utility>
+#include "./mpmc_queue.h"
 namespace difacto {
 /**
  * \brief a pool with multiple threads
+ *
+ * the jobs are passed to the threads by a lock-free \ref MPMCQueue, and
+ * \ref Wait is only woken once all jobs are finished. a job may add more
+ * jobs, see \ref Add
  */
 class ThreadPool {
  public:
@@ -20,13 +23,13 @@ class ThreadPool {
    * \brief create a threadpool
    *
    * @param num_workers number of threads
-   * @param max_capacity the maximal jobs can be added to the pool
+   * @param max_capacity the maximal number of queued jobs
    */
-  explicit ThreadPool(int num_workers, int max_capacity = 1000000) {
+  explicit ThreadPool(int num_workers, int max_capacity = 4096)
+      : tasks_(max_capacity) {
     CHECK_GT(max_capacity, 0);
     CHECK_GT(num_workers, 0);
     CHECK_LT(num_workers, 100);
-    capacity_ = max_capacity;
     for (int i = 0; i < num_workers; ++i) {
       workers_.push_back(std::thread([this, i](){
             RunWorker(i);
@@ -39,8 +42,7 @@ class ThreadPool {
    */
   ~ThreadPool() {
     Wait();
-    done_ = true;
-    add_cond_.notify_all();
+    tasks_.Close();
     for (size_t i = 0; i < workers_.size(); ++i) {
       workers_[i].join();
     }
@@ -48,49 +50,54 @@ class ThreadPool {
 
   /**
    * \brief add a job to the pool
-   * return immmediatly if the current number of unfinished jobs is less than the
-   * max_capacity. otherwise wait until the pool is available
+   * return immmediatly if the current number of queued jobs is less than the
+   * max_capacity. otherwise wait until the pool is available, or run the job
+   * at once if called by a worker of this pool, which could be the one to
+   * drain the queue
    * @param job
    */
   void Add(const std::function<void(int tid)>& job) {
-    std::unique_lock<std::mutex> lk(mu_);
-    fin_cond_.wait(lk, [this]{ return tasks_.size() < capacity_; });
-    tasks_.push_back(job);
-    add_cond_.notify_one();
+    num_unfinished_.fetch_add(1);
+    auto task = job;
+    if (tasks_.TryPush(std::move(task))) return;
+    const auto& worker = Worker();
+    if (worker.first == this) {
+      Run(job, worker.second);
+    } else {
+      tasks_.Push(job);
+    }
   }
 
   /**
    * \brief wait untill all jobs are finished
    */
   void Wait() {
-    std::unique_lock<std::mutex> lk(mu_);
-    fin_cond_.wait(lk, [this]{ return num_running_ == 0 && tasks_.empty(); });
+    fin_.Wait([this]{ return num_unfinished_.load() == 0; });
   }
 
  private:
   void RunWorker(int tid) {
-    std::unique_lock<std::mutex> lk(mu_);
-    while (true) {
-      add_cond_.wait(lk, [this]{ return done_ || !tasks_.empty(); });
-      if (done_) break;
-      // run a job
-      auto task = std::move(tasks_.front());
-      tasks_.pop_front();
-      ++num_running_;
-      lk.unlock();
-      CHECK(task); task(tid);
-      --num_running_;
-      fin_cond_.notify_all();
-      lk.lock();
+    Worker() = std::make_pair(this, tid);
+    std::function<void(int tid)> task;
+    while (tasks_.Pop(&task)) {
+      Run(task, tid);
+      task = nullptr;
     }
   }
-  std::atomic<int> num_running_{0};
-  std::atomic<bool> done_{false};
-  size_t capacity_;
-  std::mutex mu_;
-  std::condition_variable fin_cond_, add_cond_;
+  void Run(const std::function<void(int tid)>& task, int tid) {
+    CHECK(task); task(tid);
+    if (num_unfinished_.fetch_sub(1) == 1) fin_.Notify(true);
+  }
+  /** \brief the pool and the id of the calling thread if it is a worker */
+  static std::pair<ThreadPool*, int>& Worker() {
+    static thread_local std::pair<ThreadPool*, int> worker(nullptr, 0);
+    return worker;
+  }
+  /** \brief the number of jobs queued or running */
+  std::atomic<int> num_unfinished_{0};
+  MPMCQueue<std::function<void(int tid)>> tasks_;
+  Parker fin_;
   std::vector<std::thread> workers_;
-  std::list<std::function<void(int tid)>> tasks_;
 };
 }  // namespace difacto
 #endif  // DIFACTO_COMMON_THREAD_POOL_H_
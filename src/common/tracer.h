@@ -0,0 +1,195 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_COMMON_TRACER_H_
+#define DIFACTO_COMMON_TRACER_H_
+#include <stdint.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "dmlc/io.h"
+#include "dmlc/logging.h"
+#include "dmlc/parameter.h"
+namespace difacto {
+
+struct TracerParam : public dmlc::Parameter<TracerParam> {
+  /**
+   * \brief write the trace events into it in the chrome trace format if not
+   * empty, which chrome://tracing and perfetto open. a distributed node
+   * appends its role and pid
+   */
+  std::string trace_out;
+  /** \brief the maximal number of events kept, the older ones are dropped */
+  int trace_max_events;
+  DMLC_DECLARE_PARAMETER(TracerParam) {
+    DMLC_DECLARE_FIELD(trace_out).set_default("");
+    DMLC_DECLARE_FIELD(trace_max_events).set_lower_bound(1)
+        .set_default(1 << 20);
+  }
+};
+
+/**
+ * \brief records the trace events of this process into a ring buffer
+ *
+ * it is off until \ref Start, then an event costs a clock read and a short
+ * lock, and only the newest max_events events are kept, so it can be on in a
+ * long run. the names and categories must be string literals, they are kept
+ * as pointers
+ */
+class Tracer {
+ public:
+  static Tracer* Get() {
+    static Tracer tracer;
+    return &tracer;
+  }
+
+  /** \brief start recording, the events recorded before are cleared */
+  void Start(size_t max_events) {
+    CHECK_GT(max_events, 0);
+    std::lock_guard<std::mutex> lk(mu_);
+    events_.clear();
+    events_.resize(max_events);
+    num_events_ = 0;
+    enabled_ = true;
+  }
+
+  /** \brief stop recording, the events are kept for \ref Write */
+  void Stop() { enabled_ = false; }
+
+  bool Enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  /** \brief the microseconds since the process started */
+  static double NowUs() {
+    static auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::micro>(
+        std::chrono::steady_clock::now() - start).count();
+  }
+
+  /** \brief a span on the calling thread */
+  void Complete(const char* name, const char* cat, double begin_us,
+                double end_us) {
+    Add(Event{name, cat, 'X', begin_us, end_us - begin_us, 0, ThreadID()});
+  }
+
+  /**
+   * \brief the begin of an async span, which may end on another thread.
+   * returns its id for \ref AsyncEnd, or 0 if disabled
+   */
+  uint64_t AsyncBegin(const char* name, const char* cat) {
+    if (!Enabled()) return 0;
+    uint64_t id = ++next_id_;
+    Add(Event{name, cat, 'b', NowUs(), 0, id, ThreadID()});
+    return id;
+  }
+
+  void AsyncEnd(const char* name, const char* cat, uint64_t id) {
+    if (id) Add(Event{name, cat, 'e', NowUs(), 0, id, ThreadID()});
+  }
+
+  /**
+   * \brief returns on_complete wrapped by an async span, which begins now and
+   * ends when it is called. returns on_complete itself if disabled
+   */
+  std::function<void()> Async(const char* name, const char* cat,
+                              const std::function<void()>& on_complete) {
+    uint64_t id = AsyncBegin(name, cat);
+    if (!id) return on_complete;
+    return [this, name, cat, id, on_complete]() {
+      AsyncEnd(name, cat, id);
+      if (on_complete) on_complete();
+    };
+  }
+
+  /** \brief the number of events recorded, including the dropped ones */
+  size_t NumEvents() {
+    std::lock_guard<std::mutex> lk(mu_);
+    return num_events_;
+  }
+
+  /** \brief write the kept events in the chrome trace json format */
+  void Write(dmlc::Stream* fo) {
+    std::lock_guard<std::mutex> lk(mu_);
+    size_t cap = events_.size();
+    size_t begin = num_events_ > cap ? num_events_ - cap : 0;
+    dmlc::ostream os(fo);
+    os.precision(15);
+    os << "{\"displayTimeUnit\": \"ms\", \"otherData\": {\"dropped\": "
+       << begin << "},\n\"traceEvents\": [";
+    int pid = getpid();
+    for (size_t i = begin; i < num_events_; ++i) {
+      const auto& e = events_[i % cap];
+      os << (i == begin ? "\n" : ",\n")
+         << "{\"name\": \"" << e.name << "\", \"cat\": \"" << e.cat
+         << "\", \"ph\": \"" << e.ph << "\", \"ts\": " << e.ts
+         << ", \"pid\": " << pid << ", \"tid\": " << e.tid;
+      if (e.ph == 'X') os << ", \"dur\": " << e.dur;
+      if (e.id) os << ", \"id\": \"0x" << std::hex << e.id << std::dec << "\"";
+      os << "}";
+    }
+    os << "\n]}\n";
+  }
+
+ private:
+  struct Event {
+    const char* name;
+    const char* cat;
+    char ph;
+    double ts, dur;
+    uint64_t id;
+    int tid;
+  };
+
+  Tracer() { }
+
+  void Add(const Event& e) {
+    std::lock_guard<std::mutex> lk(mu_);
+    if (!enabled_) return;
+    events_[num_events_ % events_.size()] = e;
+    ++num_events_;
+  }
+
+  /** \brief a small id of the calling thread */
+  int ThreadID() {
+    static thread_local int tid = ++next_tid_;
+    return tid;
+  }
+
+  std::atomic<bool> enabled_{false};
+  std::atomic<uint64_t> next_id_{0};
+  std::atomic<int> next_tid_{0};
+  std::mutex mu_;
+  std::vector<Event> events_;
+  size_t num_events_ = 0;
+};
+
+/** \brief records its lifetime as a span if the tracer is enabled */
+class TraceScope {
+ public:
+  TraceScope(const char* name, const char* cat)
+      : name_(name), cat_(cat),
+        begin_(Tracer::Get()->Enabled() ? Tracer::NowUs() : -1) { }
+  ~TraceScope() {
+    if (begin_ >= 0) {
+      Tracer::Get()->Complete(name_, cat_, begin_, Tracer::NowUs());
+    }
+  }
+
+ private:
+  const char* name_;
+  const char* cat_;
+  double begin_;
+};
+
+}  // namespace difacto
+
+#define DIFACTO_TRACE_CAT_(a, b) a##b
+#define DIFACTO_TRACE_CAT(a, b) DIFACTO_TRACE_CAT_(a, b)
+/** \brief trace the rest of the scope, name and cat are string literals */
+#define DIFACTO_TRACE_SCOPE(name, cat)                                  \
+  ::difacto::TraceScope DIFACTO_TRACE_CAT(difacto_trace_, __LINE__)(name, cat)
+
+#endif  // DIFACTO_COMMON_TRACER_H_
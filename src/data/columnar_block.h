@@ -0,0 +1,422 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ * \file   columnar_block.h
+ * \brief  a row group stored by fields, with a footer of its statistics
+ */
+#ifndef DIFACTO_DATA_COLUMNAR_BLOCK_H_
+#define DIFACTO_DATA_COLUMNAR_BLOCK_H_
+#if DIFACTO_USE_LZ4
+#include <lz4.h>
+#endif  // DIFACTO_USE_LZ4
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+#include <limits>
+#include <string>
+#include <vector>
+#include "data/row_block.h"
+#include "difacto/base.h"
+namespace difacto {
+
+/**
+ * \brief the statistics of a row group, kept in its footer, so a reader can
+ * skip the row group or some of its fields without decompressing them
+ */
+struct ColumnarFooter {
+  /** \brief a field, the features with the same group id */
+  struct Field {
+    /** \brief the group id, see \ref DecodeFeaGrpID */
+    int id;
+    /** \brief the nnz, and the number of unique features */
+    uint64_t nnz, ncols;
+    /** \brief the min and max feature ids */
+    feaid_t min_id, max_id;
+    /** \brief the position and the size of the field in the record */
+    uint64_t pos, size;
+  };
+  /** \brief the number of the first row in the converted data */
+  uint64_t first_row = 0;
+  uint64_t nrows = 0, nnz = 0;
+  real_t label_min = 0, label_max = 0, label_sum = 0;
+  /** \brief the bits of the group id in a feature id */
+  int field_bits = 0;
+  /** \brief the non-empty fields, ordered by id */
+  std::vector<Field> fields;
+};
+
+/**
+ * \brief the transposed layout of a row group, as \ref TileBuilder builds
+ * from a row block with a \ref Localizer and \ref SpMT::Transpose
+ */
+struct ColumnarTile {
+  std::vector<real_t> label;
+  /** \brief the sorted unique feature ids, as Localizer::Compact returns */
+  std::vector<feaid_t> ids;
+  /** \brief the occurrences of each feature */
+  std::vector<real_t> cnts;
+  /**
+   * \brief a row for each feature, whose indices are the row ids. the value
+   * is empty for binary data
+   */
+  dmlc::data::RowBlockContainer<unsigned> data;
+};
+
+/**
+ * \brief compress and decompress a row block by fields
+ *
+ * each field keeps the column layout of its features: the unique ids sorted
+ * as a \ref Localizer does, the column offsets, the row ids and the values,
+ * each compressed separately. a record is
+ *
+ *   magic, labels, field 0, field 1, ..., footer, footer size, magic
+ *
+ * the example weights are not kept.
+ */
+class ColumnarBlock {
+ public:
+  /**
+   * \brief compress blk
+   * @param blk the row block
+   * @param field_bits the bits of the group id in a feature id
+   * @param first_row the number of the first row of blk in all data
+   * @param str the record
+   */
+  void Compress(const dmlc::RowBlock<feaid_t>& blk, int field_bits,
+                uint64_t first_row, std::string* str) {
+    CHECK_GE(field_bits, 0); CHECK_LE(field_bits, 16);
+    str->clear();
+    str_ = str;
+    ColumnarFooter footer;
+    footer.first_row = first_row;
+    footer.nrows = blk.size;
+    footer.field_bits = field_bits;
+    size_t base = blk.offset[0];
+    size_t nnz = blk.offset[blk.size] - base;
+    footer.nnz = nnz;
+    if (blk.size) {
+      footer.label_min = footer.label_max = blk.label[0];
+      for (size_t i = 0; i < blk.size; ++i) {
+        footer.label_min = std::min(footer.label_min, blk.label[i]);
+        footer.label_max = std::max(footer.label_max, blk.label[i]);
+        footer.label_sum += blk.label[i];
+      }
+    }
+    Write(static_cast<int>(kMagicNumber));
+    Compress(blk.label, blk.size);
+
+    // order the entries by field, feature and then row
+    entries_.resize(nnz);
+    for (size_t i = 0; i < blk.size; ++i) {
+      for (size_t j = blk.offset[i]; j < blk.offset[i+1]; ++j) {
+        Entry& e = entries_[j - base];
+        e.field = DecodeFeaGrpID(blk.index[j], field_bits);
+        e.key = ReverseBytes(blk.index[j]);
+        e.row = i;
+        e.pos = j;
+      }
+    }
+    std::sort(entries_.begin(), entries_.end(),
+              [](const Entry& a, const Entry& b) {
+                if (a.field != b.field) return a.field < b.field;
+                if (a.key != b.key) return a.key < b.key;
+                return a.pos < b.pos;
+              });
+    for (size_t a = 0; a < nnz; ) {
+      size_t b = a;
+      while (b < nnz && entries_[b].field == entries_[a].field) ++b;
+      footer.fields.push_back(CompressField(blk, a, b));
+      a = b;
+    }
+    WriteFooter(footer);
+  }
+
+  /**
+   * \brief read the footer of a record
+   */
+  void ReadFooter(char const* data, size_t size, ColumnarFooter* footer) {
+    CHECK_GE(size, 3 * sizeof(int));
+    int magic, footer_size;
+    memcpy(&magic, data + size - sizeof(int), sizeof(int));
+    memcpy(&footer_size, data + size - 2 * sizeof(int), sizeof(int));
+    CHECK_EQ(magic, static_cast<int>(kMagicNumber)) << "wrong data format";
+    CHECK_LE(footer_size + 3 * sizeof(int), size);
+    cdata_ = data + size - 2 * sizeof(int) - footer_size;
+    cur_len_ = 0; max_len_ = footer_size;
+    Read(&footer->first_row);
+    Read(&footer->nrows);
+    Read(&footer->nnz);
+    Read(&footer->label_min);
+    Read(&footer->label_max);
+    Read(&footer->label_sum);
+    Read(&footer->field_bits);
+    uint64_t nfields; Read(&nfields);
+    footer->fields.resize(nfields);
+    for (auto& f : footer->fields) Read(&f);
+  }
+
+  /**
+   * \brief decompress into a row block
+   *
+   * the features of a row are ordered by field
+   *
+   * @param data the record
+   * @param size the record size
+   * @param footer the footer of the record
+   * @param fields the positions in footer.fields of the fields to read
+   * @param blk the row block
+   */
+  void Decompress(char const* data, size_t size, const ColumnarFooter& footer,
+                  const std::vector<int>& fields,
+                  dmlc::data::RowBlockContainer<feaid_t>* blk) {
+    DecompressFields(data, size, footer, fields);
+    blk->Clear();
+    DecompressLabel(data, size, footer, &blk->label);
+    size_t nrows = footer.nrows;
+    blk->offset.assign(nrows + 1, 0);
+    bool has_value = false;
+    for (const auto& f : fields_) {
+      for (unsigned r : f.rows) ++blk->offset[r+1];
+      has_value |= f.vals.size() > 0;
+    }
+    for (size_t i = 0; i < nrows; ++i) blk->offset[i+1] += blk->offset[i];
+    size_t nnz = blk->offset[nrows];
+    blk->index.resize(nnz);
+    if (has_value) blk->value.resize(nnz);
+    pos_.assign(blk->offset.begin(), blk->offset.end() - 1);
+    feaid_t max_index = 0;
+    for (const auto& f : fields_) {
+      for (size_t c = 0; c + 1 < f.offset.size(); ++c) {
+        feaid_t id = ReverseBytes(f.ids[c]);
+        max_index = std::max(max_index, id);
+        for (size_t k = f.offset[c]; k < f.offset[c+1]; ++k) {
+          size_t p = pos_[f.rows[k]]++;
+          blk->index[p] = id;
+          if (has_value) blk->value[p] = f.vals.empty() ? 1 : f.vals[k];
+        }
+      }
+    }
+    blk->max_index = max_index;
+  }
+
+  /**
+   * \brief decompress into the transposed layout directly
+   *
+   * the arguments are the same as above
+   */
+  void Decompress(char const* data, size_t size, const ColumnarFooter& footer,
+                  const std::vector<int>& fields, ColumnarTile* tile) {
+    DecompressFields(data, size, footer, fields);
+    DecompressLabel(data, size, footer, &tile->label);
+    // the fields are ordered by the group ids, while the ids are sorted on
+    // their reversed bits, so the columns of the fields may interleave
+    cols_.clear();
+    bool sorted = true;
+    for (size_t i = 0; i < fields_.size(); ++i) {
+      const auto& f = fields_[i];
+      for (size_t c = 0; c + 1 < f.offset.size(); ++c) {
+        if (cols_.size() && cols_.back().key >= f.ids[c]) sorted = false;
+        cols_.push_back(Col{f.ids[c], static_cast<unsigned>(i),
+                static_cast<unsigned>(c)});
+      }
+    }
+    if (!sorted) {
+      std::sort(cols_.begin(), cols_.end(),
+                [](const Col& a, const Col& b) { return a.key < b.key; });
+    }
+    bool has_value = false;
+    for (const auto& f : fields_) has_value |= f.vals.size() > 0;
+    size_t ncols = cols_.size();
+    auto& Y = tile->data;
+    Y.Clear();
+    tile->ids.resize(ncols);
+    tile->cnts.resize(ncols);
+    Y.offset.resize(ncols + 1);
+    Y.offset[0] = 0;
+    for (size_t c = 0; c < ncols; ++c) {
+      const auto& f = fields_[cols_[c].field];
+      size_t n = f.offset[cols_[c].col+1] - f.offset[cols_[c].col];
+      tile->ids[c] = cols_[c].key;
+      tile->cnts[c] = n;
+      Y.offset[c+1] = Y.offset[c] + n;
+    }
+    Y.index.resize(Y.offset[ncols]);
+    if (has_value) Y.value.resize(Y.offset[ncols]);
+    for (size_t c = 0; c < ncols; ++c) {
+      const auto& f = fields_[cols_[c].field];
+      size_t begin = f.offset[cols_[c].col];
+      size_t n = Y.offset[c+1] - Y.offset[c];
+      memcpy(Y.index.data() + Y.offset[c], f.rows.data() + begin,
+             n * sizeof(unsigned));
+      if (!has_value) continue;
+      real_t* v = Y.value.data() + Y.offset[c];
+      if (f.vals.empty()) {
+        std::fill(v, v + n, 1);
+      } else {
+        memcpy(v, f.vals.data() + begin, n * sizeof(real_t));
+      }
+    }
+  }
+
+ private:
+  struct Entry {
+    int field;
+    feaid_t key;
+    unsigned row;
+    size_t pos;
+  };
+  /** \brief a decompressed field */
+  struct FieldData {
+    std::vector<feaid_t> ids;
+    std::vector<size_t> offset;
+    std::vector<unsigned> rows;
+    std::vector<real_t> vals;
+  };
+  /** \brief a column in the transposed layout */
+  struct Col {
+    feaid_t key;
+    unsigned field, col;
+  };
+
+  /** \brief compress the field of entries_[a, b) */
+  ColumnarFooter::Field CompressField(const dmlc::RowBlock<feaid_t>& blk,
+                                      size_t a, size_t b) {
+    ColumnarFooter::Field f;
+    f.id = entries_[a].field;
+    f.nnz = b - a;
+    f.pos = str_->size();
+    ids_.clear(); offset_.clear(); rows_.clear(); vals_.clear();
+    bool binary = true;
+    for (size_t k = a; k < b; ++k) {
+      const Entry& e = entries_[k];
+      if (ids_.empty() || ids_.back() != e.key) {
+        ids_.push_back(e.key);
+        offset_.push_back(k - a);
+      }
+      rows_.push_back(e.row);
+      real_t v = blk.value ? blk.value[e.pos] : 1;
+      vals_.push_back(v);
+      binary = binary && v == 1;
+    }
+    offset_.push_back(b - a);
+    f.ncols = ids_.size();
+    f.min_id = std::numeric_limits<feaid_t>::max();
+    f.max_id = 0;
+    for (feaid_t key : ids_) {
+      f.min_id = std::min(f.min_id, ReverseBytes(key));
+      f.max_id = std::max(f.max_id, ReverseBytes(key));
+    }
+    Compress(ids_.data(), ids_.size());
+    Compress(offset_.data(), offset_.size());
+    Compress(rows_.data(), rows_.size());
+    Compress(binary ? nullptr : vals_.data(), vals_.size());
+    f.size = str_->size() - f.pos;
+    return f;
+  }
+
+  void WriteFooter(const ColumnarFooter& footer) {
+    size_t pos = str_->size();
+    Write(footer.first_row);
+    Write(footer.nrows);
+    Write(footer.nnz);
+    Write(footer.label_min);
+    Write(footer.label_max);
+    Write(footer.label_sum);
+    Write(footer.field_bits);
+    Write(static_cast<uint64_t>(footer.fields.size()));
+    for (const auto& f : footer.fields) Write(f);
+    Write(static_cast<int>(str_->size() - pos));
+    Write(static_cast<int>(kMagicNumber));
+  }
+
+  void DecompressLabel(char const* data, size_t size,
+                       const ColumnarFooter& footer,
+                       std::vector<real_t>* label) {
+    cdata_ = data; cur_len_ = sizeof(int); max_len_ = size;
+    label->clear();
+    Decompress(label, footer.nrows);
+  }
+
+  /** \brief decompress the fields at the positions into fields_ */
+  void DecompressFields(char const* data, size_t size,
+                        const ColumnarFooter& footer,
+                        const std::vector<int>& fields) {
+    fields_.resize(fields.size());
+    for (size_t i = 0; i < fields.size(); ++i) {
+      const auto& f = footer.fields[fields[i]];
+      CHECK_LE(f.pos + f.size, size);
+      cdata_ = data; cur_len_ = f.pos; max_len_ = f.pos + f.size;
+      auto& d = fields_[i];
+      d.vals.clear();
+      Decompress(&d.ids, f.ncols);
+      Decompress(&d.offset, f.ncols + 1);
+      Decompress(&d.rows, f.nnz);
+      Decompress(&d.vals, f.nnz);
+      CHECK_EQ(d.offset.size(), f.ncols + 1) << "broken record";
+    }
+  }
+
+  template <typename T>
+  void Compress(const T* data, size_t len) {
+#if DIFACTO_USE_LZ4
+    if (data == NULL || len == 0) { Write(0); return; }
+    size_t size = len * sizeof(T);
+    size_t pos = str_->size();
+    int dst_size = LZ4_compressBound(size);
+    str_->resize(pos + sizeof(int) + dst_size);
+    int actual_size = LZ4_compress_default(
+        reinterpret_cast<const char*>(data), &(*str_)[pos + sizeof(int)],
+        size, dst_size);
+    CHECK_NE(actual_size, 0);
+    memcpy(&(*str_)[pos], &actual_size, sizeof(int));
+    str_->resize(pos + sizeof(int) + actual_size);
+#else
+    LOG(FATAL) << "compile with USE_LZ4=1";
+#endif
+  }
+
+  template <typename T>
+  void Decompress(std::vector<T>* dst, size_t len) {
+#if DIFACTO_USE_LZ4
+    int cp_size; Read(&cp_size);
+    if (cp_size <= 0) return;
+    CHECK_LE(cur_len_ + cp_size, max_len_);
+    dst->resize(len);
+    int dst_size = len * sizeof(T);
+    CHECK_EQ(dst_size, LZ4_decompress_safe(
+        cdata_ + cur_len_, reinterpret_cast<char*>(dst->data()),
+        cp_size, dst_size));
+    cur_len_ += cp_size;
+#else
+    LOG(FATAL) << "compile with USE_LZ4=1";
+#endif
+  }
+
+  template <typename T>
+  void Write(const T& x) {
+    str_->append(reinterpret_cast<const char*>(&x), sizeof(T));
+  }
+
+  template <typename T>
+  void Read(T* x) {
+    CHECK_LE(cur_len_ + sizeof(T), max_len_);
+    memcpy(x, cdata_ + cur_len_, sizeof(T));
+    cur_len_ += sizeof(T);
+  }
+
+  std::string* str_;
+  char const* cdata_;
+  size_t max_len_, cur_len_;
+  /** \brief the buffers, reused for the blocks */
+  std::vector<Entry> entries_;
+  std::vector<feaid_t> ids_;
+  std::vector<size_t> offset_;
+  std::vector<unsigned> rows_;
+  std::vector<real_t> vals_;
+  std::vector<FieldData> fields_;
+  std::vector<size_t> pos_;
+  std::vector<Col> cols_;
+  static const int kMagicNumber = 1196140744;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_DATA_COLUMNAR_BLOCK_H_
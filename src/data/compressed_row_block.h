@@ -78,9 +78,9 @@ class CompressedRowBlock {
 #if DIFACTO_USE_LZ4
     int nrows = blk.size;
     int nnz = blk.offset[nrows] - blk.offset[0];
-    size_t size = 6 * sizeof(int)  // size
+    size_t size = 8 * sizeof(int)  // size
                   + LZ4_compressBound((nrows+1)*sizeof(size_t));  // offset
-    if (blk.label) size += LZ4_compressBound(nrows*sizeof(size_t));
+    if (blk.label) size += LZ4_compressBound(nrows*sizeof(real_t));
     if (blk.index) size += LZ4_compressBound(nnz*sizeof(IndexType));
     if (blk.value) size += LZ4_compressBound(nnz*sizeof(real_t));
     if (blk.weight) size += LZ4_compressBound(nrows*sizeof(real_t));
@@ -94,13 +94,15 @@ class CompressedRowBlock {
   void Compress(const char* data, size_t size) {
 #if DIFACTO_USE_LZ4
     if (data == NULL) { Write(0); return; }
+    // compress into str_ directly, after the room for the compressed size
+    size_t pos = str_->size();
     int dst_size = LZ4_compressBound(size);
-    char *dst = new char[dst_size];
-    int actual_size = LZ4_compress_default(data, dst, size, dst_size);
+    str_->resize(pos + sizeof(int) + dst_size);
+    int actual_size = LZ4_compress_default(
+        data, &(*str_)[pos + sizeof(int)], size, dst_size);
     CHECK_NE(actual_size, 0);
-
-    Write(actual_size);
-    str_->append(dst, actual_size);
+    memcpy(&(*str_)[pos], &actual_size, sizeof(int));
+    str_->resize(pos + sizeof(int) + actual_size);
 #else
     LOG(FATAL) << "compile with USE_LZ4=1";
 #endif
@@ -24,13 +24,28 @@ namespace difacto {
 class DataStore {
  public:
   /**
-   * \brief create a data store
-   *
-   * @param store_prefix , such as /tmp/store_. If not specified, then keep all
-   * things in memory
-   * @param max_mem_capacity  in default no limits
+   * \brief create a data store which keeps all things in memory
    */
   DataStore() { store_ = new DataStoreMemory(); }
+  /**
+   * \brief create a data store which writes data into disk once exceeding the
+   * memory capacity
+   *
+   * @param store_prefix , such as /tmp/store_
+   * @param max_mem_capacity the memory capacity in bytes
+   * @param num_io_threads the number of threads for prefetching
+   */
+  DataStore(const std::string& store_prefix, size_t max_mem_capacity,
+            int num_io_threads = 2) {
+    store_ = new DataStoreDisk(store_prefix, max_mem_capacity, num_io_threads);
+  }
+  /**
+   * \brief create a data store which maps all data from files under
+   * store_prefix
+   */
+  explicit DataStore(const std::string& store_prefix) {
+    store_ = new DataStoreMmap(store_prefix);
+  }
   /** \brief deconstructor */
   virtual ~DataStore() { delete store_; }
   /**
@@ -3,13 +3,24 @@
  */
 #ifndef DIFACTO_DATA_DATA_STORE_IMPL_H_
 #define DIFACTO_DATA_DATA_STORE_IMPL_H_
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <list>
 #include <queue>
 #include <thread>
 #include <mutex>
 #include <string>
 #include <functional>
 #include <unordered_map>
+#include "common/huge_pages.h"
+#include "common/mem_tracker.h"
 #include "common/range.h"
+#include "common/thread_pool.h"
 #include "difacto/sarray.h"
 namespace difacto {
 
@@ -54,10 +65,13 @@ class DataStoreImpl {
  */
 class DataStoreMemory : public DataStoreImpl {
  public:
-  DataStoreMemory() { }
+  DataStoreMemory() : gauge_(MemTracker::kData) { }
   virtual ~DataStoreMemory() { }
   void Store(const std::string& key, const SArray<char>& data) override {
-    store_[key] = data;
+    auto& v = store_[key];
+    mem_ += data.size() - v.size();
+    v = data;
+    gauge_.Set(mem_);
   }
   void Fetch(const std::string& key, Range range, SArray<char>* data) override {
     auto it = store_.find(key);
@@ -65,21 +79,267 @@ class DataStoreMemory : public DataStoreImpl {
     *CHECK_NOTNULL(data) = it->second.segment(range.begin, range.end);
   }
   void Prefetch(const std::string& key, Range range) override { }
-  void Remove(const std::string& key) override { store_.erase(key); }
+  void Remove(const std::string& key) override {
+    auto it = store_.find(key);
+    if (it == store_.end()) return;
+    mem_ -= it->second.size();
+    store_.erase(it);
+    gauge_.Set(mem_);
+  }
 
  private:
   std::unordered_map<std::string, SArray<char>> store_;
+  size_t mem_ = 0;
+  MemGauge gauge_;
 };
 
 /**
  * \brief write data back to disk if exeeds the maximal memory capacity
+ *
+ * the data are kept in memory in the least-recently-used order. once the
+ * memory exceeds the capacity, the least recently used ones are written into
+ * files (only once, data are not changed after being stored) and released
+ * from memory. a fetch of a released data loads the whole data back, while a
+ * prefetch does the same in a background thread pool. the memory is also
+ * released once the memory budget of this node is exceeded, see
+ * \ref MemTracker
  */
 class DataStoreDisk : public DataStoreImpl {
  public:
+  /**
+   * @param cache_prefix the prefix of the cache files, such as /tmp/difacto_
+   * @param max_mem_capacity the maximal memory in bytes
+   * @param num_io_threads the number of threads for prefetching
+   */
   DataStoreDisk(const std::string& cache_prefix,
-                size_t max_mem_capacity) {
+                size_t max_mem_capacity,
+                int num_io_threads = 2)
+      : capacity_(max_mem_capacity), gauge_(MemTracker::kData),
+        pool_(num_io_threads) {
+    // avoid conflicts with other stores using the same prefix
+    static std::atomic<int> num_stores{0};
+    prefix_ = cache_prefix + std::to_string(getpid()) + "_"
+              + std::to_string(num_stores++) + "_";
+  }
+  virtual ~DataStoreDisk() {
+    pool_.Wait();
+    for (const auto& it : store_) {
+      if (it.second.on_disk) remove(Filename(it.first).c_str());
+    }
+  }
+
+  void Store(const std::string& key, const SArray<char>& data) override {
+    std::unique_lock<std::mutex> lk(mu_);
+    Entry& e = store_[key];
+    cond_.wait(lk, [&e]{ return !e.loading; });
+    if (e.in_mem) Release(&e);
+    if (e.on_disk) remove(Filename(key).c_str());
+    e.on_disk = false;
+    e.size = data.size();
+    Insert(key, data, &e);
+  }
+
+  void Fetch(const std::string& key, Range range, SArray<char>* data) override {
+    std::unique_lock<std::mutex> lk(mu_);
+    auto it = store_.find(key);
+    CHECK(it != store_.end()) << "key " << key << " doesn't exist";
+    Entry& e = it->second;
+    cond_.wait(lk, [&e]{ return !e.loading; });
+    if (e.in_mem) {
+      lru_.splice(lru_.begin(), lru_, e.lru);
+    } else {
+      Load(key, &e, &lk);
+    }
+    *CHECK_NOTNULL(data) = e.data.segment(range.begin, range.end);
+  }
+
+  void Prefetch(const std::string& key, Range range) override {
+    pool_.Add([this, key](int tid) {
+        std::unique_lock<std::mutex> lk(mu_);
+        auto it = store_.find(key);
+        if (it == store_.end()) return;
+        Entry& e = it->second;
+        if (e.in_mem || e.loading) return;
+        Load(key, &e, &lk);
+      });
+  }
+
+  void Remove(const std::string& key) override {
+    std::unique_lock<std::mutex> lk(mu_);
+    auto it = store_.find(key);
+    if (it == store_.end()) return;
+    Entry& e = it->second;
+    cond_.wait(lk, [&e]{ return !e.loading; });
+    if (e.in_mem) Release(&e);
+    if (e.on_disk) remove(Filename(key).c_str());
+    store_.erase(it);
+  }
+
+  /** \brief the bytes kept in memory */
+  size_t MemBytes() {
+    std::lock_guard<std::mutex> lk(mu_);
+    return mem_;
+  }
+
+ private:
+  struct Entry {
+    SArray<char> data;
+    size_t size = 0;
+    bool in_mem = false;
+    bool on_disk = false;
+    /** \brief it is being read from disk */
+    bool loading = false;
+    std::list<std::string>::iterator lru;
+  };
+
+  std::string Filename(const std::string& key) const { return prefix_ + key; }
+
+  /** \brief put data in memory as the most recently used one */
+  void Insert(const std::string& key, const SArray<char>& data, Entry* e) {
+    e->data = data;
+    e->in_mem = true;
+    mem_ += e->size;
+    gauge_.Set(mem_);
+    lru_.push_front(key);
+    e->lru = lru_.begin();
+    // evict the least recently used ones, but never the one just inserted
+    auto tracker = MemTracker::Get();
+    while ((mem_ > capacity_ || tracker->Exceeds(0)) && lru_.size() > 1) {
+      Entry& v = store_[lru_.back()];
+      if (!v.on_disk) {
+        Write(Filename(lru_.back()), v.data);
+        v.on_disk = true;
+      }
+      Release(&v);
+    }
+  }
+
+  /** \brief release the memory, must be on disk or going to be overwritten */
+  void Release(Entry* e) {
+    mem_ -= e->size;
+    gauge_.Set(mem_);
+    lru_.erase(e->lru);
+    e->data = SArray<char>();
+    e->in_mem = false;
+  }
+
+  /** \brief read data from disk without holding the lock */
+  void Load(const std::string& key, Entry* e, std::unique_lock<std::mutex>* lk) {
+    CHECK(e->on_disk);
+    e->loading = true;
+    lk->unlock();
+    SArray<char> data = HugePages::Get()->New<char>(e->size);
+    Read(Filename(key), &data);
+    lk->lock();
+    e->loading = false;
+    Insert(key, data, e);
+    cond_.notify_all();
+  }
+
+  static void Write(const std::string& filename, const SArray<char>& data) {
+    FILE* f = fopen(filename.c_str(), "wb");
+    CHECK(f) << "failed to open " << filename;
+    CHECK_EQ(fwrite(data.data(), 1, data.size(), f), data.size())
+        << "failed to write " << filename;
+    fclose(f);
   }
-  virtual ~DataStoreDisk() { }
+
+  static void Read(const std::string& filename, SArray<char>* data) {
+    FILE* f = fopen(filename.c_str(), "rb");
+    CHECK(f) << "failed to open " << filename;
+    CHECK_EQ(fread(data->data(), 1, data->size(), f), data->size())
+        << "failed to read " << filename;
+    fclose(f);
+  }
+
+  std::string prefix_;
+  size_t capacity_;
+  size_t mem_ = 0;
+  MemGauge gauge_;
+  std::unordered_map<std::string, Entry> store_;
+  /** \brief the keys in memory, the most recently used first */
+  std::list<std::string> lru_;
+  std::mutex mu_;
+  std::condition_variable cond_;
+  ThreadPool pool_;
+};
+
+/**
+ * \brief write every data into a file and map it into memory
+ *
+ * a fetch returns a view of the mapping without copying, the pages are read
+ * on demand and then kept by the page cache of the OS, which also bounds the
+ * memory used.
+ */
+class DataStoreMmap : public DataStoreImpl {
+ public:
+  /**
+   * @param cache_prefix the prefix of the cache files, such as /tmp/difacto_
+   */
+  explicit DataStoreMmap(const std::string& cache_prefix) {
+    static std::atomic<int> num_stores{0};
+    prefix_ = cache_prefix + std::to_string(getpid()) + "_m"
+              + std::to_string(num_stores++) + "_";
+  }
+  virtual ~DataStoreMmap() {
+    for (const auto& it : store_) remove(Filename(it.first).c_str());
+  }
+
+  void Store(const std::string& key, const SArray<char>& data) override {
+    auto filename = Filename(key);
+    // the previous mapped file may still be used, so create a new one rather
+    // than overwrite it
+    remove(filename.c_str());
+    FILE* f = fopen(filename.c_str(), "wb");
+    CHECK(f) << "failed to open " << filename;
+    CHECK_EQ(fwrite(data.data(), 1, data.size(), f), data.size())
+        << "failed to write " << filename;
+    fclose(f);
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    CHECK_GE(fd, 0) << "failed to open " << filename;
+    size_t size = data.size();
+    // a private mapping, so writing a fetched data will not change the file
+    void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    CHECK(ptr != MAP_FAILED) << "failed to map " << filename;
+    SArray<char> mapped;
+    mapped.reset(static_cast<char*>(ptr), size,
+                 [size](char* p) { munmap(p, size); });
+
+    std::lock_guard<std::mutex> lk(mu_);
+    store_[key] = mapped;
+  }
+
+  void Fetch(const std::string& key, Range range, SArray<char>* data) override {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = store_.find(key);
+    CHECK(it != store_.end()) << "key " << key << " doesn't exist";
+    *CHECK_NOTNULL(data) = it->second.segment(range.begin, range.end);
+  }
+
+  void Prefetch(const std::string& key, Range range) override {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = store_.find(key);
+    if (it == store_.end()) return;
+    // madvise needs a page aligned address
+    size_t page = sysconf(_SC_PAGESIZE);
+    char* base = it->second.data();
+    size_t begin = range.begin / page * page;
+    size_t end = std::min(range.end, it->second.size());
+    if (end > begin) madvise(base + begin, end - begin, MADV_WILLNEED);
+  }
+
+  void Remove(const std::string& key) override {
+    std::lock_guard<std::mutex> lk(mu_);
+    if (store_.erase(key)) remove(Filename(key).c_str());
+  }
+
+ private:
+  std::string Filename(const std::string& key) const { return prefix_ + key; }
+  std::string prefix_;
+  std::unordered_map<std::string, SArray<char>> store_;
+  std::mutex mu_;
 };
 
 }  // namespace difacto
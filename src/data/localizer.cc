@@ -2,9 +2,11 @@
  * Copyright (c) 2015 by Contributors
  */
 #include "./localizer.h"
+#include <algorithm>
 #include "dmlc/omp.h"
 #include "dmlc/logging.h"
 #include "common/parallel_sort.h"
+#include "common/hash.h"
 #include "difacto/sarray.h"
 namespace difacto {
 
@@ -12,6 +14,10 @@ void Localizer::CountUniqIndex(
     const dmlc::RowBlock<feaid_t>& blk,
     std::vector<feaid_t>* uniq_idx,
     std::vector<real_t>* idx_frq) {
+  if (method_ != kSort) {
+    CountUniqIndexHash(blk, uniq_idx, idx_frq);
+    return;
+  }
   // sort
   if (blk.size == 0) return;
   size_t idx_size = blk.offset[blk.size];
@@ -57,25 +63,30 @@ void Localizer::RemapIndex(
   if (blk.size == 0 || idx_dict.empty()) return;
   CHECK_LT(idx_dict.size(),
            static_cast<size_t>(std::numeric_limits<unsigned>::max()));
-  CHECK_EQ(blk.offset[blk.size], pair_.size());
 
   // build the index mapping
-  unsigned matched = 0;
-  std::vector<unsigned> remapped_idx(pair_.size(), 0);
-  auto cur_dict = idx_dict.cbegin();
-  auto cur_pair = pair_.cbegin();
-  while (cur_dict != idx_dict.cend() && cur_pair != pair_.cend()) {
-    if (*cur_dict < cur_pair->k) {
-      ++cur_dict;
-    } else {
-      if (*cur_dict == cur_pair->k) {
-        remapped_idx[cur_pair->i]
-            = static_cast<unsigned>((cur_dict-idx_dict.cbegin()) + 1);
-        ++matched;
+  auto& remapped_idx = remapped_idx_;
+  if (method_ != kSort) {
+    RemapIndexHash(blk, idx_dict, &remapped_idx);
+  } else {
+    CHECK_EQ(blk.offset[blk.size], pair_.size());
+    remapped_idx.assign(pair_.size(), 0);
+    auto cur_dict = idx_dict.cbegin();
+    auto cur_pair = pair_.cbegin();
+    while (cur_dict != idx_dict.cend() && cur_pair != pair_.cend()) {
+      if (*cur_dict < cur_pair->k) {
+        ++cur_dict;
+      } else {
+        if (*cur_dict == cur_pair->k) {
+          remapped_idx[cur_pair->i]
+              = static_cast<unsigned>((cur_dict-idx_dict.cbegin()) + 1);
+        }
+        ++cur_pair;
       }
-      ++cur_pair;
     }
   }
+  size_t matched = remapped_idx.size() -
+      std::count(remapped_idx.begin(), remapped_idx.end(), 0);
 
   // construct the new rowblock
   auto o = compacted;
@@ -99,7 +110,99 @@ void Localizer::RemapIndex(
     o->label.resize(blk.size);
     memcpy(o->label.data(), blk.label, blk.size*sizeof(*blk.label));
   }
+  o->weight.clear();
+  if (blk.weight) {
+    o->weight.resize(blk.size);
+    memcpy(o->weight.data(), blk.weight, blk.size*sizeof(*blk.weight));
+  }
   o->max_index = idx_dict.size() - 1;
 }
 
+void Localizer::CountUniqIndexHash(
+    const dmlc::RowBlock<feaid_t>& blk,
+    std::vector<feaid_t>* uniq_idx,
+    std::vector<real_t>* idx_frq) {
+  if (blk.size == 0) return;
+  size_t idx_size = blk.offset[blk.size];
+  CHECK_LT(idx_size, static_cast<size_t>(std::numeric_limits<unsigned>::max()))
+      << "you need to change Pair.i from unsigned to uint64";
+
+  // the table is at most half full. the entries with an old stamp are empty,
+  // so no need to clear the table
+  size_t capacity = 16;
+  while (capacity < idx_size * 2) capacity *= 2;
+  if (table_.size() < capacity) {
+    table_.resize(capacity);
+    stamp_.assign(capacity, 0);
+    cur_stamp_ = 0;
+  }
+  if (++cur_stamp_ == 0) {
+    std::fill(stamp_.begin(), stamp_.end(), 0);
+    cur_stamp_ = 1;
+  }
+  size_t mask = capacity - 1;
+
+  uniq_.clear();
+  cnt_.clear();
+  local_.resize(idx_size);
+  for (size_t j = 0; j < idx_size; ++j) {
+    feaid_t k = ReverseBytes(blk.index[j] % max_index_);
+    size_t h = hash::Int(k) & mask;
+    while (stamp_[h] == cur_stamp_ && table_[h].k != k) h = (h + 1) & mask;
+    if (stamp_[h] != cur_stamp_) {
+      stamp_[h] = cur_stamp_;
+      table_[h].k = k;
+      table_[h].i = uniq_.size();
+      uniq_.push_back(table_[h]);
+      cnt_.push_back(0);
+    }
+    unsigned id = table_[h].i;
+    ++cnt_[id];
+    local_[j] = id;
+  }
+
+  // sort the unique keys only
+  if (method_ == kHashRadix) {
+    RadixSort(&uniq_, &uniq_tmp_, [](const Pair& a) { return a.k; });
+  } else {
+    std::sort(uniq_.begin(), uniq_.end(),
+              [](const Pair& a, const Pair& b) { return a.k < b.k; });
+  }
+
+  // save data
+  CHECK_NOTNULL(uniq_idx);
+  uniq_idx->resize(uniq_.size());
+  if (idx_frq) idx_frq->resize(uniq_.size());
+  for (size_t i = 0; i < uniq_.size(); ++i) {
+    (*uniq_idx)[i] = uniq_[i].k;
+    if (idx_frq) (*idx_frq)[i] = cnt_[uniq_[i].i];
+  }
+}
+
+void Localizer::RemapIndexHash(
+    const dmlc::RowBlock<feaid_t>& blk,
+    const std::vector<feaid_t>& idx_dict,
+    std::vector<unsigned>* remapped_idx) {
+  CHECK_EQ(blk.offset[blk.size], local_.size());
+  // match the sorted unique keys with the dictionary
+  id_map_.assign(uniq_.size(), 0);
+  auto cur_dict = idx_dict.cbegin();
+  auto cur_uniq = uniq_.cbegin();
+  while (cur_dict != idx_dict.cend() && cur_uniq != uniq_.cend()) {
+    if (*cur_dict < cur_uniq->k) {
+      ++cur_dict;
+    } else {
+      if (*cur_dict == cur_uniq->k) {
+        id_map_[cur_uniq->i] =
+            static_cast<unsigned>((cur_dict-idx_dict.cbegin()) + 1);
+      }
+      ++cur_uniq;
+    }
+  }
+  remapped_idx->resize(local_.size());
+  for (size_t j = 0; j < local_.size(); ++j) {
+    (*remapped_idx)[j] = id_map_[local_[j]];
+  }
+}
+
 }  // namespace difacto
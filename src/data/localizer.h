@@ -8,6 +8,7 @@
 #include "difacto/base.h"
 #include "dmlc/io.h"
 #include "data/row_block.h"
+#include "common/profiler.h"
 namespace difacto {
 
 /**
@@ -15,16 +16,33 @@ namespace difacto {
  */
 class Localizer {
  public:
+  /** \brief how to find the unique feature indices */
+  enum Method {
+    /** \brief sort all indices in parallel */
+    kSort,
+    /**
+     * \brief count the indices by a hash table, and then sort the unique
+     * ones, which are often far fewer. it uses a single thread, and suits
+     * small blocks such as minibatches
+     */
+    kHash,
+    /** \brief same as kHash, but radix sort the unique indices */
+    kHashRadix
+  };
   /**
    * \brief constructor
    *
    * \param max_index feature index will be projected into [0, max_index) by mod
    * \param nthreads number of threads
+   * \param method the method to find the unique indices
+   *
+   * the buffers are reused if a localizer is used for multiple blocks
    */
 
   Localizer(feaid_t max_index = std::numeric_limits<feaid_t>::max(),
-            int nthreads = DEFAULT_NTHREADS)
-      : max_index_(max_index), nt_(nthreads) { }
+            int nthreads = DEFAULT_NTHREADS,
+            Method method = kSort)
+      : max_index_(max_index), nt_(nthreads), method_(method) { }
   ~Localizer() { }
 
   /**
@@ -42,6 +60,8 @@ class Localizer {
                dmlc::data::RowBlockContainer<unsigned> *compacted,
                std::vector<feaid_t>* uniq_idx = NULL,
                std::vector<real_t>* idx_frq = NULL) {
+    DIFACTO_PROFILE_SCOPE(kLocalize);
+    DIFACTO_PROFILE_COUNT(kLocalize, blk.size);
     std::vector<feaid_t>* uidx =
         uniq_idx == NULL ? new std::vector<feaid_t>() : uniq_idx;
     CountUniqIndex(blk, uidx, idx_frq);
@@ -78,12 +98,20 @@ class Localizer {
   /**
    * @brief Clears the temporal results
    */
-  void Clear() { pair_.clear(); }
+  void Clear() { pair_.clear(); local_.clear(); }
 
  private:
+  void CountUniqIndexHash(const dmlc::RowBlock<feaid_t>& blk,
+                          std::vector<feaid_t>* uniq_idx,
+                          std::vector<real_t>* idx_frq);
+  void RemapIndexHash(const dmlc::RowBlock<feaid_t>& blk,
+                      const std::vector<feaid_t>& idx_dict,
+                      std::vector<unsigned>* remapped_idx);
+
   feaid_t max_index_;
   /** \brief number of threads */
   int nt_;
+  Method method_;
 
 #pragma pack(push)
 #pragma pack(4)
@@ -92,6 +120,23 @@ class Localizer {
   };
 #pragma pack(pop)
   std::vector<Pair> pair_;
+  /** \brief index j -> position in remapped_idx_ */
+  std::vector<unsigned> remapped_idx_;
+
+  // for the hash methods
+  /** \brief an open addressing table, key -> id in uniq_ */
+  std::vector<Pair> table_;
+  /** \brief table_[i] is used only if stamp_[i] == cur_stamp_ */
+  std::vector<unsigned> stamp_;
+  unsigned cur_stamp_ = 0;
+  /** \brief the unique keys in the order of appearance, and their ids */
+  std::vector<Pair> uniq_, uniq_tmp_;
+  /** \brief the id of the unique key of each index */
+  std::vector<unsigned> local_;
+  /** \brief the occurrence of each unique key */
+  std::vector<real_t> cnt_;
+  /** \brief id -> the position in the dictionary + 1, 0 if not matched */
+  std::vector<unsigned> id_map_;
 };
 }  // namespace difacto
 
@@ -0,0 +1,123 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_DATA_ROW_DEDUP_H_
+#define DIFACTO_DATA_ROW_DEDUP_H_
+#include <string.h>
+#include <algorithm>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "difacto/base.h"
+#include "dmlc/data.h"
+#include "data/row_block.h"
+#include "common/hash.h"
+namespace difacto {
+
+/**
+ * \brief merge the duplicate rows of a localized block into weighted rows
+ *
+ * two rows are duplicates if they have the same label sign and the same set
+ * of (index, value) pairs. a merged row keeps the first of them with the sum
+ * of their weights, which are 1 if the block has no weight. so the positive
+ * and the negative examples of the same features are two rows, weighted by
+ * their counts. the indices of a row are sorted in the output
+ *
+ * the buffers are reused if a deduplicator is used for multiple blocks
+ */
+class RowDedup {
+ public:
+  RowDedup() { }
+  ~RowDedup() { }
+
+  /**
+   * \brief out = the deduplicated rows of blk, with weights
+   * \param blk the localized block, with labels
+   * \param out the output block
+   */
+  void Dedup(const dmlc::RowBlock<unsigned>& blk,
+             dmlc::data::RowBlockContainer<unsigned>* out) {
+    CHECK_NOTNULL(blk.label);
+    out->Clear();
+    bool has_value = blk.value != nullptr;
+    rows_.clear();
+    rows_.reserve(blk.size);
+    next_.clear();
+    for (size_t i = 0; i < blk.size; ++i) {
+      // sort the pairs of the row into the end of out
+      size_t begin = blk.offset[i], len = blk.offset[i+1] - begin;
+      pairs_.resize(len);
+      for (size_t j = 0; j < len; ++j) {
+        pairs_[j].first = blk.index[begin + j];
+        pairs_[j].second = has_value ? blk.value[begin + j] : 1;
+      }
+      std::sort(pairs_.begin(), pairs_.end());
+      size_t pos = out->index.size();
+      for (const auto& p : pairs_) {
+        out->index.push_back(p.first);
+        if (has_value) out->value.push_back(p.second);
+        out->max_index = std::max(out->max_index, p.first);
+      }
+
+      bool pos_label = blk.label[i] > 0;
+      real_t w = blk.weight ? blk.weight[i] : 1;
+      uint64_t key = Hash(out->index.data() + pos, len,
+                          has_value ? out->value.data() + pos : nullptr,
+                          pos_label);
+      auto it = rows_.find(key);
+      int head = it == rows_.end() ? -1 : it->second, dup = -1;
+      for (int r = head; r >= 0; r = next_[r]) {
+        if (Same(*out, r, pos, len, pos_label)) { dup = r; break; }
+      }
+      if (dup >= 0) {
+        out->weight[dup] += w;
+        out->index.resize(pos);
+        if (has_value) out->value.resize(pos);
+        continue;
+      }
+      int r = static_cast<int>(out->label.size());
+      next_.push_back(head);
+      rows_[key] = r;
+      out->label.push_back(blk.label[i]);
+      out->weight.push_back(w);
+      out->offset.push_back(out->index.size());
+    }
+  }
+
+ private:
+  /** \brief the hash of a sorted row */
+  static uint64_t Hash(unsigned const* index, size_t len,
+                       dmlc::real_t const* value, bool pos_label) {
+    uint64_t h = hash::Bytes(reinterpret_cast<const char*>(index),
+                             len * sizeof(unsigned), pos_label);
+    if (value) {
+      h = hash::Bytes(reinterpret_cast<const char*>(value),
+                      len * sizeof(dmlc::real_t), h);
+    }
+    return h;
+  }
+
+  /** \brief the row r of out equals to the len pairs at pos of out */
+  static bool Same(const dmlc::data::RowBlockContainer<unsigned>& out, int r,
+                   size_t pos, size_t len, bool pos_label) {
+    if ((out.label[r] > 0) != pos_label) return false;
+    size_t begin = out.offset[r];
+    if (out.offset[r+1] - begin != len) return false;
+    if (memcmp(out.index.data() + begin, out.index.data() + pos,
+               len * sizeof(unsigned))) {
+      return false;
+    }
+    return out.value.empty() ||
+        memcmp(out.value.data() + begin, out.value.data() + pos,
+               len * sizeof(dmlc::real_t)) == 0;
+  }
+
+  /** \brief the hash of a row to its last output row with this hash */
+  std::unordered_map<uint64_t, int> rows_;
+  /** \brief the previous output row with the same hash, or -1 */
+  std::vector<int> next_;
+  std::vector<std::pair<unsigned, dmlc::real_t>> pairs_;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_DATA_ROW_DEDUP_H_
@@ -3,60 +3,118 @@
  */
 #ifndef DIFACTO_DATA_TILE_BUILDER_H_
 #define DIFACTO_DATA_TILE_BUILDER_H_
+#include <algorithm>
+#include <string>
 #include <vector>
 #include <mutex>
+#include <atomic>
 #include "common/kv_union.h"
 #include "common/spmt.h"
 #include "data/localizer.h"
+#include "data/columnar_block.h"
 #include "./tile_store.h"
-#include "common/thread_pool.h"
+#include "common/task_scheduler.h"
 namespace difacto {
 /**
  * \brief helper class to build TileStore
  */
 class TileBuilder {
  public:
+  /**
+   * @param store the tile store
+   * @param nthreads the number of threads. at most nthreads rowblks are
+   * processed at the same time, and they share the threads
+   * @param allow_multi_columns whether to slice a rowblk into column blocks
+   */
   TileBuilder(TileStore* store, int nthreads, bool allow_multi_columns = false) {
     store_ = store;
     multicol_ = allow_multi_columns;
-    int blk_nthreads = nthreads > 20 ? 4 : 2;
-    if (nthreads > blk_nthreads) {
-      nthreads_ = blk_nthreads;
-      int pool_size = nthreads / blk_nthreads;
-      pool_ = new ThreadPool(pool_size, pool_size);
-    } else {
-      nthreads_ = nthreads;
-    }
+    nthreads_ = std::max(nthreads, 1);
+    if (nthreads_ > 1) group_ = new TaskGroup(nthreads_);
   }
-  ~TileBuilder() { delete pool_; }
+  ~TileBuilder() { delete group_; }
 
   /**
    * \brief add a raw rowblk to the store
    * feaids = feaids \cup new_feaids
    * feacnts = feacnts \cup new_feacnts
+   *
+   * feaids and feacnts are updated in \ref Wait, they should be the same for
+   * all calls. threadsafe, rowblks may be added by several readers
+   *
+   * @return the id of the rowblk in the store
    */
-  void Add(const dmlc::RowBlock<feaid_t>& rowblk,
+  int Add(const dmlc::RowBlock<feaid_t>& rowblk,
            SArray<feaid_t>* feaids = nullptr,
            SArray<real_t>* feacnts = nullptr) {
     mu_.lock();
     int id = blk_feaids_.size();
     blk_feaids_.resize(id+1);
+    blk_offset_.resize(id+1);
     mu_.unlock();
-    if (pool_ == nullptr) {
-      Add(id, rowblk, feaids, feacnts);
+    if (group_ == nullptr) {
+      Add(id, rowblk, feaids, feacnts, nthreads_);
     } else {
       auto container = new SharedRowBlockContainer<feaid_t>(rowblk);
-      pool_->Add([this, id, container, feaids, feacnts](int tid) {
-          Add(id, container->GetBlock(), feaids, feacnts);
+      // the rowblks being processed share the threads. a rowblk is built on
+      // its home node, so its tiles are first touched there
+      int nt = PartitionThreads(nthreads_, ++num_running_);
+      group_->Run([this, id, container, feaids, feacnts, nt]() {
+          Add(id, container->GetBlock(), feaids, feacnts, nt);
           delete container;
-        });
+          --num_running_;
+        }, TaskScheduler::Get()->HomeNode(id));
     }
+    return id;
+  }
+
+  /**
+   * \brief add a rowblk already in the transposed layout, such as read by
+   * \ref ColumnarReader, so neither compacting nor transposing is needed.
+   * only if allow_multi_columns. the data of tile are moved. returns the id
+   * of the rowblk
+   */
+  int Add(ColumnarTile* tile,
+           SArray<feaid_t>* feaids = nullptr,
+           SArray<real_t>* feacnts = nullptr) {
+    CHECK(multicol_);
+    mu_.lock();
+    int id = blk_feaids_.size();
+    blk_feaids_.resize(id+1);
+    blk_offset_.resize(id+1);
+    mu_.unlock();
+    auto transposed = new dmlc::data::RowBlockContainer<unsigned>();
+    transposed->offset.swap(tile->data.offset);
+    transposed->index.swap(tile->data.index);
+    transposed->value.swap(tile->data.value);
+    std::shared_ptr<std::vector<feaid_t>> ids(new std::vector<feaid_t>());
+    std::shared_ptr<std::vector<real_t>> cnts(new std::vector<real_t>());
+    ids->swap(tile->ids);
+    cnts->swap(tile->cnts);
+    StoreTransposed(id, transposed, tile->label.data(), tile->label.size());
+    AddFeatures(id, ids, cnts, feaids, feacnts, nthreads_);
+    return id;
   }
 
-  void Wait() { if (pool_) pool_->Wait(); }
+  /**
+   * \brief wait until all rowblks are added, and merge the feature ids and
+   * counts into the ones given to Add
+   */
+  void Wait() {
+    if (group_) group_->Wait();
+    std::unique_lock<std::mutex> lk(mu_);
+    if (feaids_ == nullptr) return;
+    while (runs_.size() > 1) MergeRuns(&lk, nthreads_);
+    if (runs_.size()) {
+      KVUnion(runs_[0].feaids, runs_[0].feacnts, feaids_, feacnts_);
+      runs_.clear();
+    }
+  }
 
   /**
    * \brief build colmap
+   *
+   * the rowblks are built in parallel, each writes its own slot of the meta
    * \param feaids
    */
   void BuildColmap(const SArray<feaid_t>& feaids,
@@ -66,47 +124,123 @@ class TileBuilder {
     for (size_t i = 0; i < map.size(); ++i) {
       map[i] = i+1;  // start from 1
     }
-    store_->meta_.resize(blk_feaids_.size());
-    for (size_t i = 0; i < blk_feaids_.size(); ++i) {
-      // store colmap
-      SArray<int> colmap;
-      KVMatch(feaids, map, blk_feaids_[i], &colmap, ASSIGN, nthreads_);
-      for (int& c : colmap) --c;  // unmatched will get -1
-      store_->Store(i, colmap);
-
-      // update meta
-      std::vector<Range> pos;
-      if (feablk_range.size()) {
-        CHECK(multicol_) << "you should set allow_multi_columns = true";
-        FindPosition(blk_feaids_[i], feablk_range, &pos);
-      }
+    if (feablk_range.size()) {
+      CHECK(multicol_) << "you should set allow_multi_columns = true";
+    }
+    int n = blk_feaids_.size();
+    store_->meta_.resize(n);
+    // the rowblks share the threads as Add
+    int nt = PartitionThreads(nthreads_, n);
+    ParallelFor(n, std::max(1, nthreads_ / nt), [&](int tid, int i) {
+        BuildColmap(i, feaids, map, feablk_range, nt);
+      });
+    if (feapos) FindPosition(feaids, feablk_range, feapos);
+  }
+
+ private:
+  /** \brief build the colmap and the meta of rowblk i, threadsafe */
+  void BuildColmap(int i, const SArray<feaid_t>& feaids,
+                   const SArray<int>& map,
+                   const std::vector<Range>& feablk_range,
+                   int nthreads) {
+    // store colmap
+    SArray<int> colmap;
+    KVMatch(feaids, map, blk_feaids_[i], &colmap, ASSIGN, nthreads);
+    for (int& c : colmap) --c;  // unmatched will get -1
+    store_->Store(i, colmap);
+
+    // update meta
+    std::vector<Range> pos;
+    if (feablk_range.size()) FindPosition(blk_feaids_[i], feablk_range, &pos);
 
-      auto key = std::to_string(i) + "_";
-      if (pos.empty()) {
+    auto key = std::to_string(i) + "_";
+    auto& meta = store_->meta_[i];
+    if (pos.empty()) {
+      TileStore::Meta c;
+      c.colmap = Range(0, colmap.size());
+      c.offset = Range(0, DataSize(key+"offset"));
+      c.index = Range(0, DataSize(key+"index"));
+      meta.push_back(c);
+      SArray<size_t> offset;
+      FetchData(key+"offset", &offset);
+      store_->StoreOffset(i, 0, offset);
+    } else {
+      // the column offsets kept by Add, so no need to fetch them back
+      const SArray<size_t>& offset = blk_offset_[i];
+      CHECK_EQ(offset.size(), colmap.size()+1);
+      for (size_t j = 0; j < pos.size(); ++j) {
+        auto p = pos[j];
         TileStore::Meta c;
-        c.colmap = Range(0, colmap.size());
-        c.offset = Range(0, store_->data_->size(key+"offset"));
-        c.index = Range(0, store_->data_->size(key+"index"));
-        store_->meta_[i].push_back(c);
-      } else {
-        SArray<size_t> offset;
-        store_->data_->Fetch(key+"offset", &offset);
-        CHECK_EQ(offset.size(), colmap.size()+1);
-        for (auto p : pos) {
-          TileStore::Meta c;
-          c.colmap = p;
-          c.offset = Range(p.begin, p.end+1);
-          c.index = Range(offset[p.begin], offset[p.end]);
-          store_->meta_[i].push_back(c);
+        c.colmap = p;
+        c.offset = Range(p.begin, p.end+1);
+        c.index = Range(offset[p.begin], offset[p.end]);
+        meta.push_back(c);
+        // rebase the offsets once here rather than in every fetch
+        SArray<size_t> blk_offset(p.Size()+1);
+        for (size_t k = 0; k < blk_offset.size(); ++k) {
+          blk_offset[k] = offset[p.begin+k] - offset[p.begin];
         }
+        store_->StoreOffset(i, j, blk_offset);
       }
-      // clear
-      blk_feaids_[i].clear();
     }
-    if (feapos) FindPosition(feaids, feablk_range, feapos);
+    RemoveData(key+"offset");
+    if (multicol_ && store_->param_.tile_compress) Pack(i);
+    // clear
+    blk_feaids_[i].clear();
+    blk_offset_[i].clear();
+  }
+
+  /**
+   * \brief the accesses of the data store not through a TileStore method,
+   * which hold the lock of the store
+   */
+  template <typename V>
+  void FetchData(const std::string& key, SArray<V>* data,
+                 Range range = Range::All()) {
+    std::lock_guard<std::mutex> lk(store_->mu_);
+    store_->data_->Fetch(key, data, range);
+  }
+  size_t DataSize(const std::string& key) {
+    std::lock_guard<std::mutex> lk(store_->mu_);
+    return store_->data_->size(key);
+  }
+  void RemoveData(const std::string& key) {
+    std::lock_guard<std::mutex> lk(store_->mu_);
+    store_->data_->Remove(key);
+  }
+
+  /**
+   * \brief pack the tiles of a rowblk, and then remove the unpacked index and
+   * value. threadsafe
+   */
+  void Pack(int rowblk_id) {
+    auto key = std::to_string(rowblk_id) + "_";
+    const auto& metas = store_->meta_[rowblk_id];
+    bool fp16 = store_->param_.tile_compress == 2;
+    for (size_t j = 0; j < metas.size(); ++j) {
+      SArray<size_t> offset;
+      SArray<unsigned> index;
+      SArray<real_t> value;
+      FetchData(key+"offset_"+std::to_string(j), &offset);
+      FetchData(key+"index", &index, metas[j].index);
+      FetchData(key+"value", &value, metas[j].index);
+      PackedBlock packed;
+      if (offset.size()) {
+        dmlc::RowBlock<unsigned> blk;
+        blk.size = offset.size() - 1;
+        blk.offset = offset.data();
+        blk.label = nullptr;
+        blk.weight = nullptr;
+        blk.index = index.data();
+        blk.value = value.empty() ? nullptr : value.data();
+        packed.Pack(blk, fp16);
+      }
+      store_->Store(rowblk_id, j, packed);
+    }
+    RemoveData(key+"index");
+    RemoveData(key+"value");
   }
 
- private:
   /**
    * \brief find the positionn of each feature block in the list of feature IDs
    *
@@ -138,47 +272,111 @@ class TileBuilder {
    */
   void Add(int id, const dmlc::RowBlock<feaid_t>& rowblk,
            SArray<feaid_t>* feaids,
-           SArray<real_t>* feacnts) {
+           SArray<real_t>* feacnts,
+           int nthreads) {
     // map feature id into continous intergers
     std::shared_ptr<std::vector<feaid_t>> ids(new std::vector<feaid_t>());
     std::shared_ptr<std::vector<real_t>> cnts(new std::vector<real_t>());
     auto compacted = new dmlc::data::RowBlockContainer<unsigned>();
-    Localizer lc(-1, nthreads_);
+    Localizer lc(-1, nthreads);
     lc.Compact(rowblk, compacted, ids.get(), feacnts ? cnts.get() : nullptr);
 
     // store data into tile store
     if (multicol_) {
       // transpose to easy slice a column block
       auto transposed = new dmlc::data::RowBlockContainer<unsigned>();
-      SpMT::Transpose(compacted->GetBlock(), transposed, ids->size(), nthreads_);
+      SpMT::Transpose(compacted->GetBlock(), transposed, ids->size(), nthreads);
       delete compacted;
-      SharedRowBlockContainer<unsigned> data(&transposed);
-      data.label.CopyFrom(rowblk.label, rowblk.size);
-      store_->Store(id, data);
-      delete transposed;
+      StoreTransposed(id, transposed, rowblk.label, rowblk.size);
     } else {
       SharedRowBlockContainer<unsigned> data(&compacted);
       store_->Store(id, data);
       delete compacted;
     }
+    AddFeatures(id, ids, cnts, feaids, feacnts, nthreads);
+  }
 
-    // store ids, which are used to build colmap
+  /** \brief store a transposed rowblk, which is deleted, threadsafe */
+  void StoreTransposed(int id, dmlc::data::RowBlockContainer<unsigned>* blk,
+                       const real_t* label, size_t nrows) {
+    SharedRowBlockContainer<unsigned> data(&blk);
+    data.label.CopyFrom(label, nrows);
+    store_->Store(id, data);
     std::lock_guard<std::mutex> lk(mu_);
+    blk_offset_[id] = data.offset;
+  }
+
+  /**
+   * \brief keep the unique feature ids of a rowblk, and merge the counts if
+   * feaids is given, threadsafe
+   */
+  void AddFeatures(int id,
+                   const std::shared_ptr<std::vector<feaid_t>>& ids,
+                   const std::shared_ptr<std::vector<real_t>>& cnts,
+                   SArray<feaid_t>* feaids,
+                   SArray<real_t>* feacnts,
+                   int nthreads) {
+    // store ids, which are used to build colmap
+    std::unique_lock<std::mutex> lk(mu_);
     SArray<feaid_t> sids(ids);
     blk_feaids_[id] = sids;
 
     if (!feaids) return;
     CHECK_NOTNULL(feacnts);
+    CHECK(feaids_ == nullptr || feaids_ == feaids);
+    feaids_ = feaids;
+    feacnts_ = feacnts;
     SArray<real_t> scnts(cnts);
-    CHECK_EQ(feaids->size(), feacnts->size());
     CHECK_EQ(sids.size(), scnts.size());
-    KVUnion(sids, scnts, feaids, feacnts);
+    runs_.push_back(Run{sids, scnts, 0});
+    // merge two runs with the same level, so every count is merged
+    // O(log(#blocks)) times rather than once per block
+    while (runs_.size() > 1 &&
+           runs_.back().level == runs_[runs_.size()-2].level) {
+      MergeRuns(&lk, nthreads);
+    }
   }
+
+  /**
+   * \brief merge the last two runs, lk should hold mu_
+   *
+   * mu_ is released during merging, because a thread waiting for the merge
+   * may run other tasks of this builder meanwhile
+   */
+  void MergeRuns(std::unique_lock<std::mutex>* lk, int nthreads) {
+    Run b = runs_.back(); runs_.pop_back();
+    Run a = runs_.back(); runs_.pop_back();
+    lk->unlock();
+    Run c;
+    KVUnion(a.feaids, a.feacnts, b.feaids, b.feacnts, &c.feaids, &c.feacnts,
+            PLUS, nthreads);
+    c.level = std::max(a.level, b.level) + 1;
+    lk->lock();
+    // keep the levels decreasing, runs may be added when merging
+    auto it = runs_.begin();
+    while (it != runs_.end() && it->level >= c.level) ++it;
+    runs_.insert(it, c);
+  }
+
+  /** \brief the feature ids and counts of one or more rowblks */
+  struct Run {
+    SArray<feaid_t> feaids;
+    SArray<real_t> feacnts;
+    int level;
+  };
+  /** \brief the runs not merged yet, the levels are decreasing */
+  std::vector<Run> runs_;
+  SArray<feaid_t>* feaids_ = nullptr;
+  SArray<real_t>* feacnts_ = nullptr;
   std::vector<SArray<feaid_t>> blk_feaids_;
+  /** \brief the column offsets of the transposed blocks */
+  std::vector<SArray<size_t>> blk_offset_;
   TileStore* store_;
   int nthreads_;
   bool multicol_;
-  ThreadPool* pool_ = nullptr;
+  TaskGroup* group_ = nullptr;
+  /** \brief the number of rowblks being processed */
+  std::atomic<int> num_running_{0};
   std::mutex mu_;
 };
 
@@ -3,11 +3,17 @@
  */
 #ifndef DIFACTO_DATA_TILE_STORE_H_
 #define DIFACTO_DATA_TILE_STORE_H_
+#include <limits>
 #include <string>
 #include <vector>
 #include <mutex>
 #include "dmlc/data.h"
+#include "dmlc/parameter.h"
 #include "difacto/sarray.h"
+#include "common/mem_tracker.h"
+#include "common/packed_block.h"
+#include "common/profiler.h"
+#include "common/tracer.h"
 #include "./shared_row_block_container.h"
 #include "./data_store.h"
 namespace difacto {
@@ -32,12 +38,48 @@ namespace difacto {
 struct Tile {
   /** \brief the map to the column id on the original matrix */
   SArray<int> colmap;
-  /** \brief the transposed data to make slice efficient */
+  /**
+   * \brief the transposed data to make slice efficient. if the tile is
+   * packed, then only the label and the offset are available
+   */
   SharedRowBlockContainer<unsigned> data;
+  /** \brief the packed data, empty if the tile is not packed */
+  PackedBlock packed;
 };
 
 class TileBuilder;
 
+struct TileStoreParam : public dmlc::Parameter<TileStoreParam> {
+  /** \brief the prefix of the cache files */
+  std::string data_cache;
+  /**
+   * \brief the memory capacity in MB, the tiles exceeding it are written into
+   * data_cache. in default 0, which keeps all tiles in memory, or in memory
+   * until the memory budget of this node is exceeded if mem_budget_mb is set
+   */
+  float data_cache_mem_mb;
+  /**
+   * \brief if nonzero, write all tiles into data_cache and map them into
+   * memory, so the page cache decides which tiles are kept in memory
+   */
+  int data_cache_mmap;
+  /**
+   * \brief compress the transposed tiles, which have increasing indices in
+   * each row. 0: no compression, 1: delta encode and bit pack the indices,
+   * 2: also store the values in fp16. in default 0
+   */
+  int tile_compress;
+  /** \brief the number of threads for prefetching tiles from disk */
+  int num_io_threads;
+  DMLC_DECLARE_PARAMETER(TileStoreParam) {
+    DMLC_DECLARE_FIELD(data_cache).set_default("");
+    DMLC_DECLARE_FIELD(data_cache_mem_mb).set_default(0);
+    DMLC_DECLARE_FIELD(data_cache_mmap).set_default(0);
+    DMLC_DECLARE_FIELD(tile_compress).set_default(0).set_range(0, 2);
+    DMLC_DECLARE_FIELD(num_io_threads).set_default(2).set_range(1, 64);
+  }
+};
+
 /**
  * \brief thread safe
  */
@@ -48,8 +90,20 @@ class TileStore {
   friend class TileBuilder;
 
   KWArgs Init(const KWArgs& kwargs) {
-    data_ = new DataStore();
-    return kwargs;
+    auto remain = param_.InitAllowUnknown(kwargs);
+    if (param_.data_cache_mmap && param_.data_cache.size()) {
+      data_ = new DataStore(param_.data_cache);
+    } else if ((param_.data_cache_mem_mb > 0 || MemTracker::Get()->budget())
+               && param_.data_cache.size()) {
+      size_t capacity = param_.data_cache_mem_mb > 0 ?
+          static_cast<size_t>(param_.data_cache_mem_mb * 1024 * 1024) :
+          std::numeric_limits<size_t>::max();
+      data_ = new DataStore(param_.data_cache, capacity,
+                            param_.num_io_threads);
+    } else {
+      data_ = new DataStore();
+    }
+    return remain;
   }
   /**
    * \brief store a shared rowblock container into the store (no memory copy)
@@ -70,9 +124,34 @@ class TileStore {
    * \brief store a the column map of a row block into the store (no memory copy)
    */
   void Store(int rowblk_id, const SArray<int>& colmap) {
+    std::lock_guard<std::mutex> lk(mu_);
     data_->Store(std::to_string(rowblk_id) + "_colmap", colmap);
   }
 
+  /**
+   * \brief store the offsets of a column block, which start from 0
+   */
+  void StoreOffset(int rowblk_id, int colblk_id, const SArray<size_t>& offset) {
+    std::lock_guard<std::mutex> lk(mu_);
+    data_->Store(std::to_string(rowblk_id) + "_offset_" +
+                 std::to_string(colblk_id), offset);
+  }
+
+  /**
+   * \brief store a packed tile, which replaces the index and value of the
+   * tile
+   */
+  void Store(int rowblk_id, int colblk_id, const PackedBlock& packed) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto key = std::to_string(rowblk_id) + "_";
+    auto suffix = "_" + std::to_string(colblk_id);
+    data_->Store(key+"words"+suffix, packed.words);
+    data_->Store(key+"pos"+suffix, packed.pos);
+    data_->Store(key+"value"+suffix, packed.value);
+    data_->Store(key+"value16"+suffix, packed.value16);
+    packed_ = true;
+  }
+
   /**
    * \brief prefetch a tile
    *
@@ -85,9 +164,17 @@ class TileStore {
     auto rg = meta_[rowblk_id][colblk_id];
     data_->Prefetch(key+"label");
     data_->Prefetch(key+"colmap", rg.colmap);
-    data_->Prefetch(key+"offset", rg.offset);
-    data_->Prefetch(key+"index", rg.index);
-    data_->Prefetch(key+"value", rg.index);
+    auto suffix = "_" + std::to_string(colblk_id);
+    data_->Prefetch(key+"offset"+suffix);
+    if (packed_) {
+      data_->Prefetch(key+"words"+suffix);
+      data_->Prefetch(key+"pos"+suffix);
+      data_->Prefetch(key+"value"+suffix);
+      data_->Prefetch(key+"value16"+suffix);
+    } else {
+      data_->Prefetch(key+"index", rg.index);
+      data_->Prefetch(key+"value", rg.index);
+    }
   }
 
   /**
@@ -98,23 +185,30 @@ class TileStore {
    * @param tile
    */
   void Fetch(int rowblk_id, int colblk_id, Tile* tile) {
+    DIFACTO_PROFILE_SCOPE(kTileFetch);
+    DIFACTO_TRACE_SCOPE("tile_fetch", "data");
     std::lock_guard<std::mutex> lk(mu_);
     auto& data = CHECK_NOTNULL(tile)->data;
     auto key = std::to_string(rowblk_id) + "_";
     auto rg = meta_[rowblk_id][colblk_id];
     data_->Fetch(key+"label", &data.label);
     data_->Fetch(key+"colmap", &tile->colmap, rg.colmap);
-    data_->Fetch(key+"offset", &data.offset, rg.offset);
-    if (rg.offset.begin != 0) {
-      // force to start from 0
-      SArray<size_t> offset; offset.CopyFrom(data.offset);
-      for (size_t i = 0; i < offset.size(); ++i) {
-        offset[i] -= data.offset[0];
-      }
-      data.offset = offset;
+    // the offsets of each column block are stored separately and start from
+    // 0, so all arrays are views of the store without copying
+    auto suffix = "_" + std::to_string(colblk_id);
+    data_->Fetch(key+"offset"+suffix, &data.offset);
+    if (packed_) {
+      auto& packed = tile->packed;
+      packed.label = data.label;
+      packed.offset = data.offset;
+      data_->Fetch(key+"words"+suffix, &packed.words);
+      data_->Fetch(key+"pos"+suffix, &packed.pos);
+      data_->Fetch(key+"value"+suffix, &packed.value);
+      data_->Fetch(key+"value16"+suffix, &packed.value16);
+    } else {
+      data_->Fetch(key+"index", &data.index, rg.index);
+      data_->Fetch(key+"value", &data.value, rg.index);
     }
-    data_->Fetch(key+"index", &data.index, rg.index);
-    data_->Fetch(key+"value", &data.value, rg.index);
   }
 
   /**
@@ -156,6 +250,9 @@ class TileStore {
   }
 
  private:
+  TileStoreParam param_;
+  /** \brief whether or not the tiles are packed */
+  bool packed_ = false;
   std::mutex mu_;
   DataStore* data_ = nullptr;
   /** \brief meta data for a rowblk */
@@ -0,0 +1,210 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_LBFGS_LBFGS_HISTORY_H_
+#define DIFACTO_LBFGS_LBFGS_HISTORY_H_
+#include <stdint.h>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include "common/huge_pages.h"
+#include "data/data_store.h"
+#include "./lbfgs_utils.h"
+namespace difacto {
+namespace lbfgs {
+
+/**
+ * \brief the last m pairs of s and y of L-BFGS
+ *
+ * the pairs are kept in a ring buffer, whose arrays are reused once the
+ * oldest pair is dropped, so there is no allocation after the first m
+ * pairs. s and y can be stored in fp16 or bf16, which are decoded a chunk each
+ * time by \ref MultiInner and \ref MultiAdd.
+ *
+ * optionally only the newest pairs are kept in memory, the older ones are
+ * spilled into a \ref DataStore on disk and fetched every time they are used
+ */
+class History {
+ public:
+  /**
+   * @param m the maximal number of pairs
+   * @param precision 0: fp32, 1: fp16, 2: bf16
+   * @param mem_pairs if positive, the number of newest pairs kept in memory
+   * @param cache the prefix of the files of the spilled pairs
+   * @param nthreads the number of threads to write a new pair
+   */
+  void Init(int m, int precision, int mem_pairs, const std::string& cache,
+            int nthreads = DEFAULT_NTHREADS) {
+    CHECK_GT(m, 0);
+    CHECK(precision >= 0 && precision <= 2) << "invalid precision " << precision;
+    m_ = m;
+    precision_ = precision;
+    nthreads_ = nthreads;
+    mem_cap_ = mem_pairs > 0 ? std::min(mem_pairs, m) : m;
+    slots_.clear();
+    slots_.resize(mem_cap_);
+    head_ = num_mem_ = 0;
+    spilled_.clear();
+    store_.reset(mem_cap_ < m ? new DataStore(cache, 0, 1) : nullptr);
+  }
+
+  /** \brief the number of pairs */
+  int size() const { return num_mem_ + static_cast<int>(spilled_.size()); }
+
+  /** \brief the bytes of the pairs in memory */
+  size_t MemBytes() const {
+    size_t bytes = 0;
+    for (const auto& slot : slots_) {
+      bytes += (slot.s.size() + slot.y.size()) * sizeof(real_t) +
+               (slot.s16.size() + slot.y16.size()) * sizeof(uint16_t);
+    }
+    return bytes;
+  }
+
+  /**
+   * \brief add s = alpha * dir and y = new_grad - grad as the newest pair, the
+   * oldest one is dropped if there are m pairs
+   */
+  void Push(real_t alpha, const SArray<real_t>& dir,
+            const SArray<real_t>& new_grad, const SArray<real_t>& grad) {
+    size_t n = grad.size();
+    CHECK_EQ(dir.size(), n);
+    CHECK_EQ(new_grad.size(), n);
+    if (num_mem_ == mem_cap_) {
+      // reuse the slot of the oldest pair in memory
+      if (store_) Spill(slots_[head_]);
+      head_ = (head_ + 1) % mem_cap_;
+      --num_mem_;
+    }
+    Slot& slot = slots_[(head_ + num_mem_) % mem_cap_];
+    ++num_mem_;
+
+    real_t const* d = dir.data();
+    real_t const* g1 = new_grad.data();
+    real_t const* g0 = grad.data();
+    if (precision_ == 0) {
+      Resize(n, &slot.s); Resize(n, &slot.y);
+      real_t* s = slot.s.data();
+      real_t* y = slot.y.data();
+      ParallelRun(nthreads_, [&](int tid, int nt) {
+          Range rg = Range(0, n).Segment(tid, nt);
+          for (size_t i = rg.begin; i < rg.end; ++i) {
+            s[i] = alpha * d[i];
+            y[i] = g1[i] - g0[i];
+          }
+        });
+    } else {
+      Resize(n, &slot.s16); Resize(n, &slot.y16);
+      uint16_t* s = slot.s16.data();
+      uint16_t* y = slot.y16.data();
+      bool bf16 = precision_ == 2;
+      ParallelRun(nthreads_, [&](int tid, int nt) {
+          Range rg = Range(0, n).Segment(tid, nt);
+          for (size_t i = rg.begin; i < rg.end; ++i) {
+            real_t a = alpha * d[i], b = g1[i] - g0[i];
+            s[i] = bf16 ? FloatToBF16(a) : FloatToHalf(a);
+            y[i] = bf16 ? FloatToBF16(b) : FloatToHalf(b);
+          }
+        });
+    }
+  }
+
+  /**
+   * \brief the references of all pairs, the oldest first. the spilled pairs
+   * are fetched, and valid until the next call
+   */
+  void Get(std::vector<VecRef>* s, std::vector<VecRef>* y) {
+    s->clear(); y->clear();
+    fetched_.clear();
+    fetched16_.clear();
+    for (int id : spilled_) {
+      store_->Prefetch(Key('s', id));
+      store_->Prefetch(Key('y', id));
+    }
+    for (int id : spilled_) {
+      Slot slot;
+      if (precision_ == 0) {
+        store_->Fetch(Key('s', id), &slot.s);
+        store_->Fetch(Key('y', id), &slot.y);
+        fetched_.push_back(slot.s);
+        fetched_.push_back(slot.y);
+      } else {
+        store_->Fetch(Key('s', id), &slot.s16);
+        store_->Fetch(Key('y', id), &slot.y16);
+        fetched16_.push_back(slot.s16);
+        fetched16_.push_back(slot.y16);
+      }
+      Refs(slot, s, y);
+    }
+    for (int i = 0; i < num_mem_; ++i) {
+      Refs(slots_[(head_ + i) % mem_cap_], s, y);
+    }
+  }
+
+ private:
+  struct Slot {
+    /** \brief s and y in fp32 */
+    SArray<real_t> s, y;
+    /** \brief s and y in fp16 or bf16 */
+    SArray<uint16_t> s16, y16;
+  };
+
+  /** \brief allocate an array of a slot, from huge pages if enabled */
+  template <typename V>
+  static void Resize(size_t n, SArray<V>* arr) {
+    if (arr->size() != n) *arr = HugePages::Get()->New<V>(n);
+  }
+
+  void Refs(const Slot& slot, std::vector<VecRef>* s, std::vector<VecRef>* y) {
+    if (precision_ == 0) {
+      s->push_back(slot.s.data());
+      y->push_back(slot.y.data());
+    } else {
+      s->push_back(VecRef(slot.s16.data(), precision_ == 2));
+      y->push_back(VecRef(slot.y16.data(), precision_ == 2));
+    }
+  }
+
+  /** \brief copy a pair into the store, and drop the oldest spilled pair */
+  void Spill(const Slot& slot) {
+    if (static_cast<int>(spilled_.size()) == m_ - mem_cap_) {
+      store_->Remove(Key('s', spilled_.front()));
+      store_->Remove(Key('y', spilled_.front()));
+      spilled_.pop_front();
+    }
+    int id = next_id_++;
+    if (precision_ == 0) {
+      store_->Store(Key('s', id), slot.s.data(), slot.s.size());
+      store_->Store(Key('y', id), slot.y.data(), slot.y.size());
+    } else {
+      store_->Store(Key('s', id), slot.s16.data(), slot.s16.size());
+      store_->Store(Key('y', id), slot.y16.data(), slot.y16.size());
+    }
+    spilled_.push_back(id);
+  }
+
+  static std::string Key(char type, int id) {
+    return std::string(1, type) + std::to_string(id);
+  }
+
+  int m_ = 0;
+  int precision_ = 0;
+  int nthreads_ = DEFAULT_NTHREADS;
+  /** \brief the ring buffer, the pairs in memory start from head_ */
+  std::vector<Slot> slots_;
+  int mem_cap_ = 0;
+  int head_ = 0;
+  int num_mem_ = 0;
+  /** \brief the ids of the spilled pairs, the oldest first */
+  std::deque<int> spilled_;
+  int next_id_ = 0;
+  std::unique_ptr<DataStore> store_;
+  /** \brief keep the fetched pairs alive */
+  std::vector<SArray<real_t>> fetched_;
+  std::vector<SArray<uint16_t>> fetched16_;
+};
+
+}  // namespace lbfgs
+}  // namespace difacto
+#endif  // DIFACTO_LBFGS_LBFGS_HISTORY_H_
@@ -2,10 +2,20 @@
  *  Copyright (c) 2015 by Contributors
  */
 #include "./lbfgs_learner.h"
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
 #include "./lbfgs_utils.h"
 #include "difacto/node_id.h"
 #include "loss/bin_class_metric.h"
 #include "reader/reader.h"
+#include "common/fast_math.h"
+#include "common/mem_tracker.h"
+#include "common/model_file.h"
+#include "common/spmv.h"
+#include "common/task_scheduler.h"
+#include "common/reduce.h"
 namespace difacto {
 
 DMLC_REGISTER_PARAMETER(LBFGSLearnerParam);
@@ -25,6 +35,8 @@ void LBFGSLearner::RunScheduler() {
     LOG(INFO) << " - found " << nval << " validation examples, splitted into "
               << data[4] << " chunks";
   }
+  LOG(INFO) << " - spent " << data[6] << " sec on parsing, and waited "
+            << data[7] << " sec for the parsed data";
   std::vector<real_t> server;
   IssueJobAndWait(NodeID::kServerGroup, Job::kInitServer, {}, &server);
   LOG(INFO) << "Inited model with " << server[1] << " parameters";
@@ -34,18 +46,16 @@ void LBFGSLearner::RunScheduler() {
 
   // iterate over data
   real_t alpha = 0, val_auc = 0, new_objv = 0;
+  double last_ckpt = dmlc::GetTime();
   int k = param_.load_epoch >= 0 ? param_.load_epoch : 0;
+  // <p, ∂f(w)> of the direction of the next epoch
+  real_t p_g = k < param_.max_num_epochs ? CalcDirection(alpha) : 0;
+  bool l1 = GetUpdater()->param().l1 > 0;
   for (; k < param_.max_num_epochs; ++k) {
     LOG(INFO) << "Epoch " << k << ":";
-    // calc direction
-    IssueJobAndWait(NodeID::kWorkerGroup, Job::kPushGradient);
-    std::vector<real_t> B;
-    IssueJobAndWait(NodeID::kServerGroup, Job::kPrepareCalcDirection, {alpha}, &B);
-    std::vector<real_t> p_gf;  // = <p, ∂f(w)>
-    IssueJobAndWait(NodeID::kServerGroup, Job::kCalcDirection, B, &p_gf);
     // start linesearch
     LOG(INFO) << " - start linesearch with objv = " << objv <<
-        ", <p,g> = " << p_gf[0];
+        ", <p,g> = " << p_g;
     alpha = k != 0 ? param_.alpha : (
         param_.init_alpha > 0 ? param_.init_alpha : ntrain / data[2]);
     std::vector<real_t> status;  // = {f(w+αp), <p, ∂f(w+αp)>}
@@ -57,8 +67,10 @@ void LBFGSLearner::RunScheduler() {
       new_objv = status[0];
       LOG(INFO) << " - alpha = " << alpha
                 << ", objv = " << status[0] << ", <p,g> = " << status[1];
-      if ((new_objv <= objv + param_.c1 * alpha * p_gf[0]) &&
-          (status[1] >= param_.c2 * p_gf[0])) {
+      // OWL-QN only checks the sufficient decrease, as the objective is not
+      // smooth
+      if ((new_objv <= objv + param_.c1 * alpha * p_g) &&
+          (l1 || status[1] >= param_.c2 * p_g)) {
         LOG(INFO) << " - wolfe condition is satisifed";
         break;  // satisified
       }
@@ -67,6 +79,10 @@ void LBFGSLearner::RunScheduler() {
       }
       alpha *= param_.rho;
     }
+    // the workers evaluate w on the validation data in background when
+    // pushing the gradient, so it runs while the servers compute the next
+    // direction. the direction is wasted if it stops after this epoch
+    if (k+1 < param_.max_num_epochs) p_g = CalcDirection(alpha);
     // evaluate AUC, ...
     std::vector<real_t> eval;
     IssueJobAndWait(NodeID::kWorkerGroup + NodeID::kServerGroup,
@@ -79,7 +95,16 @@ void LBFGSLearner::RunScheduler() {
       prog.val_auc /= nval;
       LOG(INFO) << " - validation AUC = " << prog.val_auc;
     }
+    if (!IsDistributed()) {
+      LOG(INFO) << " - memory: " << MemTracker::Get()->TextString();
+    }
     for (const auto& cb : epoch_end_callback_) cb(k, prog);
+    if (param_.model_out.size() &&
+        CheckpointDue(k, param_.checkpoint_epochs, param_.checkpoint_sec,
+                      &last_ckpt)) {
+      LOG(INFO) << " - checkpointing model to " << param_.model_out;
+      IssueJobAndWait(NodeID::kServerGroup, Job::kCheckpoint);
+    }
 
     // check stop critea
     if (k > param_.min_num_epochs) {
@@ -105,6 +130,20 @@ void LBFGSLearner::RunScheduler() {
     val_auc = prog.val_auc;
   }
   LOG(INFO) << "Training is done";
+  if (param_.model_out.size()) {
+    LOG(INFO) << "Saving model to " << param_.model_out;
+    IssueJobAndWait(NodeID::kServerGroup, Job::kSaveModel);
+  }
+}
+
+real_t LBFGSLearner::CalcDirection(real_t alpha) {
+  using lbfgs::Job;
+  IssueJobAndWait(NodeID::kWorkerGroup, Job::kPushGradient);
+  std::vector<real_t> B;
+  IssueJobAndWait(NodeID::kServerGroup, Job::kPrepareCalcDirection, {alpha}, &B);
+  std::vector<real_t> p_gf;  // = <p, ∂f(w)>
+  IssueJobAndWait(NodeID::kServerGroup, Job::kCalcDirection, B, &p_gf);
+  return p_gf[0];
 }
 
 void LBFGSLearner::Process(const std::string& args, std::string* rets) {
@@ -115,14 +154,35 @@ void LBFGSLearner::Process(const std::string& args, std::string* rets) {
   if (type == Job::kPrepareData) {
     PrepareData(&job_rets);
   } else if (type == Job::kInitServer) {
+    if (param_.model_in.size()) {
+      auto filename = ModelName(param_.model_in, model_store_->Rank());
+      std::unique_ptr<dmlc::Stream> fi(
+          dmlc::Stream::Create(filename.c_str(), "r"));
+      GetUpdater()->Load(fi.get(), nullptr);
+    }
     GetUpdater()->InitWeight(&job_rets);
   } else if (type == Job::kInitWorker) {
     job_rets.push_back(InitWorker());
   } else if (type == Job::kPushGradient) {
+    // the servers sum the pushed gradients
+    std::vector<int> ts;
+    if (grads_stale_) {
+      // the line search ended on the cached margins. the ones of a linear
+      // model are exact, while FM needs X*V for the gradient. the blocks are
+      // pushed while the rest are computed
+      CalcGrad(weights_, model_lens_, &grads_, V_dim_ != 0, &ts);
+      grads_stale_ = false;
+    } else {
+      ts.push_back(CHECK_NOTNULL(model_store_)->Push(
+          feaids_, Store::kGradient, grads_, model_lens_));
+    }
     directions_.clear();
-    int t = CHECK_NOTNULL(model_store_)->Push(
-        feaids_, Store::kGradient, grads_, model_lens_);
-    model_store_->Wait(t);
+    // w is final till the next line search, which is issued after kEvaluate
+    if (nval_blks_ > 0 && !eval_pending_) {
+      eval_pending_ = true;
+      eval_group_.Run([this]() { Evaluate(&eval_prog_); });
+    }
+    for (int t : ts) model_store_->Wait(t);
   } else if (type == Job::kPrepareCalcDirection) {
     GetUpdater()->PrepareCalcDirection(&job_rets);
   } else if (type == Job::kCalcDirection) {
@@ -132,38 +192,100 @@ void LBFGSLearner::Process(const std::string& args, std::string* rets) {
     if (IsServer()) GetUpdater()->LineSearch(job_args.value[0], &job_rets);
   } else if (type == Job::kEvaluate) {
     lbfgs::Progress prog;
-    if (IsWorker()) Evaluate(&prog);
+    if (IsWorker()) {
+      if (eval_pending_) {
+        eval_group_.Wait();
+        eval_pending_ = false;
+        prog = eval_prog_;
+      } else {
+        Evaluate(&prog);
+      }
+    }
     if (IsServer()) GetUpdater()->Evaluate(&prog);
     prog.SerializeToVector(&job_rets);
+  } else if (type == Job::kSaveModel || type == Job::kCheckpoint) {
+    auto filename = ModelName(param_.model_out, model_store_->Rank());
+    // the previous checkpoint is written first, it has the same filename
+    saver_.Wait();
+    if (type == Job::kCheckpoint) {
+      ModelFile model;
+      GetUpdater()->Snapshot(&model);
+      saver_.SaveAsync(std::move(model), filename);
+    } else {
+      auto updater = GetUpdater();
+      ModelSaver::Write(filename, [updater](dmlc::Stream* fo) {
+          updater->Save(false, fo);
+        });
+    }
   } else {
     LOG(FATAL) << "unknown job type " << type;
   }
+  if (IsWorker()) UpdateMemGauge();
   dmlc::Stream* ss = new dmlc::MemoryStringStream(rets);
   ss->Write(job_rets);
   delete ss;
 }
 
+void LBFGSLearner::UpdateMemGauge() {
+  size_t n = weights_.size() + grads_.size() + directions_.size() +
+      w0_.size();
+  const std::vector<SArray<real_t>>* bufs[] = {
+    &pred_, &grad_bufs_, &margin0_, &margin1_, &margin2_, &labels_, &val_labels_};
+  for (auto b : bufs) {
+    for (const auto& buf : *b) n += buf.size();
+  }
+  scratch_mem_.Set(n * sizeof(real_t));
+}
+
 void LBFGSLearner::PrepareData(std::vector<real_t>* rets) {
-  // read train data
   size_t chunk_size = static_cast<size_t>(param_.data_chunk_size * 1024 * 1024);
-  Reader train(param_.data_in, param_.data_format,
-               model_store_->Rank(), model_store_->NumWorkers(),
-               chunk_size);
-  size_t nrows = 0, nnz = 0;
   tile_builder_ = new TileBuilder(tile_store_, nthreads_);
   SArray<real_t> feacnts;
-  while (train.Next()) {
-    auto rowblk = train.Value();
-    nrows += rowblk.size;
-    nnz += rowblk.offset[rowblk.size];
-    tile_builder_->Add(rowblk, &feaids_, &feacnts);
-    pred_.push_back(SArray<real_t>(rowblk.size));
-    ++ntrain_blks_;
-  }
-  rets->resize(6);
-  (*rets)[0] = nrows;
+  int nblks = 0;
+  std::mutex mu;
+  // returns {nrows, nnz, parse_sec, wait_sec}, the sub-partitions add rowblks
+  // concurrently
+  auto read = [&](const std::string& uri, bool train) {
+    std::vector<double> cnts(4);
+    ReadSubParts(model_store_->Rank(), model_store_->NumWorkers(),
+                 param_.num_data_parts, [&](int part_index, int num_parts) {
+        Reader reader(uri, param_.data_format, part_index, num_parts,
+                      chunk_size, param_.num_parse_threads);
+        size_t nrows = 0, nnz = 0;
+        int n = 0;
+        while (reader.Next()) {
+          auto rowblk = reader.Value();
+          nrows += rowblk.size;
+          nnz += rowblk.offset[rowblk.size];
+          if (train) {
+            tile_builder_->Add(rowblk, &feaids_, &feacnts);
+          } else {
+            tile_builder_->Add(rowblk);
+          }
+          ++n;
+        }
+        std::lock_guard<std::mutex> lk(mu);
+        cnts[0] += nrows;
+        cnts[1] += nnz;
+        cnts[2] += reader.parse_sec();
+        cnts[3] += reader.wait_sec();
+        nblks += n;
+      });
+    return cnts;
+  };
+
+  // read train data
+  auto train = read(param_.data_in, true);
+  ntrain_blks_ = nblks;
+  // allocated by the first pass over the block, on its home node
+  pred_.resize(ntrain_blks_);
+  labels_.resize(ntrain_blks_);
+  rets->resize(8);
+  (*rets)[0] = train[0];
   (*rets)[1] = ntrain_blks_;
-  (*rets)[2] = nnz;
+  (*rets)[2] = train[1];
+  (*rets)[6] = train[2];
+  (*rets)[7] = train[3];
 
   tile_builder_->Wait();
   // push the feature ids and feature counts to the servers
@@ -172,21 +294,15 @@ void LBFGSLearner::PrepareData(std::vector<real_t>* rets) {
 
   // read validation data if any
   if (param_.data_val.size()) {
-    nrows = 0; nnz = 0;
-    Reader val(param_.data_val, param_.data_format,
-               model_store_->Rank(), model_store_->NumWorkers(),
-               chunk_size);
-    while (val.Next()) {
-      auto rowblk = val.Value();
-      nrows += rowblk.size;
-      nnz += rowblk.offset[rowblk.size];
-      tile_builder_->Add(rowblk);
-      pred_.push_back(SArray<real_t>(rowblk.size));
-      ++nval_blks_;
-    }
-    (*rets)[3] = nrows;
+    auto val = read(param_.data_val, false);
+    nval_blks_ = nblks - ntrain_blks_;
+    pred_.resize(nblks);
+    val_labels_.resize(nval_blks_);
+    (*rets)[3] = val[0];
     (*rets)[4] = nval_blks_;
-    (*rets)[5] = nnz;
+    (*rets)[5] = val[1];
+    (*rets)[6] += val[2];
+    (*rets)[7] += val[3];
   }
   tile_builder_->Wait();
   // wait the previous push finished
@@ -219,104 +335,345 @@ real_t LBFGSLearner::InitWorker() {
 }
 
 void LBFGSLearner::LineSearch(real_t alpha, std::vector<real_t>* status) {
-  // w += αp
+  // the gradients modified by gamma are not the ones of the margins, and the
+  // margins of OWL-QN are not linear in α due to the orthant projection
+  bool l1 = GetUpdater()->param().l1 > 0;
+  bool cache = param_.linesearch_cache && param_.gamma == 1 && !l1;
+  // w += αp, or w = π(w0 + αp) of OWL-QN
   if (directions_.empty()) {
     SArray<int> dir_lens;
     int t = CHECK_NOTNULL(model_store_)->Pull(
         feaids_, Store::kWeight, &directions_, &model_lens_);
     model_store_->Wait(t);
+    if (cache && V_dim_ == 0) CacheLinearMargins(alpha_);
+    if (l1) w0_.CopyFrom(weights_);
     alpha_ = 0;
+    ls_step_ = 0;
+  }
+  if (l1) {
+    lbfgs::OrthantStep(alpha, w0_, directions_, model_lens_, &weights_,
+                       nthreads_);
+  } else {
+    lbfgs::Add(alpha - alpha_, directions_, &weights_);
   }
-  lbfgs::Add(alpha - alpha_, directions_, &weights_);
   alpha_ = alpha;
   status->resize(2);
-  (*status)[0] += CalcGrad(weights_, model_lens_, &grads_);
-  (*status)[1] += lbfgs::Inner(grads_, directions_, nthreads_);
+  if (cache && (V_dim_ == 0 || (ls_step_ >= 2 && fm_fitted_))) {
+    (*status)[0] += MarginLineSearch(alpha, &(*status)[1]);
+    grads_stale_ = true;
+  } else {
+    bool fit = cache && ls_step_ < 2;
+    if (fit && ls_step_ == 0) {
+      // the predictions of w before the line search
+      margin0_.resize(ntrain_blks_);
+      for (int i = 0; i < ntrain_blks_; ++i) margin0_[i].CopyFrom(pred_[i]);
+    }
+    (*status)[0] += CalcGrad(weights_, model_lens_, &grads_);
+    (*status)[1] += lbfgs::Inner(grads_, directions_, nthreads_);
+    grads_stale_ = false;
+    if (fit) FitFMMargins(ls_step_, alpha);
+  }
+  ++ls_step_;
+}
+
+void LBFGSLearner::CacheLinearMargins(real_t prev_alpha) {
+  // the validation blocks too, so Evaluate needs no pass over them
+  int nblks = ntrain_blks_ + nval_blks_;
+  int ntasks = std::max(1, std::min(nblks, nthreads_));
+  blk_nthreads_ = PartitionThreads(nthreads_, ntasks);
+  margin0_.resize(nblks);
+  margin1_.resize(nblks);
+  margin2_.clear();
+  ParallelForNodes(0, nblks, ntasks, [this, prev_alpha](int tid, int i) {
+      Tile tile; tile_store_->Fetch(i, 0, &tile);
+      auto data = tile.data.GetBlock();
+      SArray<int> w_pos, V_pos;
+      GetPos(model_lens_, tile.colmap, &w_pos, &V_pos);
+      SArray<real_t>& m0 = margin0_[i];
+      SArray<real_t>& m1 = margin1_[i];
+      if (m0.size() == data.size && m1.size() == data.size) {
+        // X*w moved by the previous step
+        for (size_t j = 0; j < data.size; ++j) m0[j] += prev_alpha * m1[j];
+      } else {
+        m0 = SArray<real_t>(data.size);
+        SpMV::Times(data, weights_, &m0, blk_nthreads_, w_pos, SArray<int>());
+      }
+      m1.resize(data.size);
+      memset(m1.data(), 0, data.size * sizeof(real_t));
+      SpMV::Times(data, directions_, &m1, blk_nthreads_, w_pos, SArray<int>());
+    });
+}
+
+void LBFGSLearner::FitFMMargins(int step, real_t alpha) {
+  margin1_.resize(ntrain_blks_);
+  if (step == 0) {
+    for (int i = 0; i < ntrain_blks_; ++i) margin1_[i].CopyFrom(pred_[i]);
+    fm_alpha0_ = alpha;
+    return;
+  }
+  // the margins of FM are quadratic on α. given the predictions m_a and m_b
+  // at α = a and b, c1 + c2 * a = (m_a - m0) / a, c1 + c2 * b = (m_b - m0) / b.
+  // but it is not true for the predictions clipped by FMLoss::Predict
+  real_t a = fm_alpha0_, b = alpha;
+  CHECK_NE(a, b);
+  margin2_.resize(ntrain_blks_);
+  std::vector<char> clipped(ntrain_blks_, 0);
+  ParallelFor(ntrain_blks_, nthreads_, [this, a, b, &clipped](int tid, int i) {
+      const SArray<real_t>& m0 = margin0_[i];
+      SArray<real_t>& m1 = margin1_[i];
+      SArray<real_t>& m2 = margin2_[i];
+      m2.resize(m0.size());
+      for (size_t j = 0; j < m0.size(); ++j) {
+        real_t mb = pred_[i][j];
+        if (fabs(m0[j]) >= 20 || fabs(m1[j]) >= 20 || fabs(mb) >= 20) {
+          clipped[i] = 1;
+        }
+        real_t da = (m1[j] - m0[j]) / a, db = (mb - m0[j]) / b;
+        m2[j] = (db - da) / (b - a);
+        m1[j] = da - m2[j] * a;
+      }
+    });
+  fm_fitted_ = std::find(clipped.begin(), clipped.end(), 1) == clipped.end();
+}
+
+real_t LBFGSLearner::MarginLineSearch(real_t alpha, real_t* p_g) {
+  int ntasks = std::max(1, std::min(ntrain_blks_, nthreads_));
+  blk_nthreads_ = PartitionThreads(nthreads_, ntasks);
+  std::vector<real_t> objv(ntasks), auc(ntasks), pg(ntasks);
+  bool quad = margin2_.size() > 0;
+  ParallelForNodes(0, ntrain_blks_, ntasks,
+                   [this, alpha, quad, &objv, &auc, &pg](int tid, int i) {
+        const SArray<real_t>& label = labels_[i];
+        size_t n = label.size();
+        real_t const* m0 = margin0_[i].data();
+        real_t const* m1 = margin1_[i].data();
+        real_t const* m2 = quad ? margin2_[i].data() : nullptr;
+        real_t* pred = pred_[i].data();
+        real_t g = 0;
+        for (size_t j = 0; j < n; ++j) {
+          real_t m = m0[j] + alpha * m1[j], dm = m1[j];
+          if (m2) {
+            m += alpha * alpha * m2[j];
+            dm += 2 * alpha * m2[j];
+          }
+          // the same projection as FMLoss::Predict
+          m = m > 20 ? 20 : (m < -20 ? -20 : m);
+          pred[j] = m;
+          g += math::LogitGrad(label[j] > 0 ? 1 : -1, m) * dm;
+        }
+        pg[tid] += g;
+        objv[tid] += loss_->Evaluate(label.data(), pred_[i]);
+        BinClassStats stats;
+        stats.Add(label.data(), pred, n, BinClassStats::kMaxAUCBins, 0,
+                  blk_nthreads_);
+        auc[tid] += stats.AUC() * n;
+      });
+  for (int i = 1; i < ntasks; ++i) {
+    objv[0] += objv[i];
+    auc[0] += auc[i];
+    pg[0] += pg[i];
+  }
+  prog_.auc = auc[0];
+  *p_g += pg[0];
+  return objv[0];
 }
 
 real_t LBFGSLearner::CalcGrad(const SArray<real_t>& w_val,
                               const SArray<int>& w_len,
-                              SArray<real_t>* grad) {
-  // create thread pool
+                              SArray<real_t>* grad,
+                              bool predict,
+                              std::vector<int>* pushes) {
   for (int i = 0; i < ntrain_blks_; ++i) {
     tile_store_->Prefetch(i, 0);
   }
-  int pool_size = nthreads_ / blk_nthreads_;
-  ThreadPool pool(pool_size, pool_size);
-  std::vector<SArray<real_t>> grads(pool_size);
+  // the blocks are processed by ntasks tasks, which share the threads. a
+  // block is processed on its home node if possible
+  int ntasks = std::max(1, std::min(ntrain_blks_, nthreads_));
+  blk_nthreads_ = PartitionThreads(nthreads_, ntasks);
+  loss_->set_nthreads(blk_nthreads_);
   size_t n = w_val.size();
   grad->resize(n); memset(grad->data(), 0, sizeof(real_t)*n);
+  // the buffers are kept among calls, the one of task 0 is grad itself
+  std::vector<SArray<real_t>>& grads = grad_bufs_;
+  grads.resize(ntasks);
   grads[0] = *grad;
-  for (int p = 1; p < pool_size; ++p) grads[p].resize(n);
-  std::vector<real_t> objv(pool_size), auc(pool_size);
+  // whether or not a buffer is used in this call, only written by its task
+  std::vector<char> used(ntasks, 0);
+  used[0] = 1;
+  std::vector<real_t> objv(ntasks), auc(ntasks);
+  // gamma is applied on the sum, so the blocks cannot be pushed separately
+  bool push_blks = pushes && param_.gamma == 1;
+  std::mutex push_mu;
 
   // two-level parallel
-  for (int i = 0; i < ntrain_blks_; ++i) {
-    pool.Add([this, i, &w_len, &w_val, &grads, &objv, &auc](int tid) {
+  ParallelForNodes(0, ntrain_blks_, ntasks,
+                   [this, n, predict, push_blks, pushes, &push_mu, &w_len,
+                    &w_val, &grads, &used, &objv, &auc](int tid, int i) {
+        if (push_blks) {
+          // the buffers are not used
+        } else if (!used[tid]) {
+          // cleared by the task, so first touched on its node
+          used[tid] = 1;
+          if (grads[tid].size() == n) {
+            memset(grads[tid].data(), 0, n * sizeof(real_t));
+          } else {
+            grads[tid] = SArray<real_t>(n);
+          }
+        }
         // prepare data
         Tile tile; tile_store_->Fetch(i, 0, &tile);
         auto data = tile.data.GetBlock();
         SArray<int> w_pos, V_pos;
         GetPos(w_len, tile.colmap, &w_pos, &V_pos);
-        memset(pred_[i].data(), 0, pred_[i].size()*sizeof(real_t));
+        if (labels_[i].empty()) labels_[i].CopyFrom(data.label, data.size);
+        if (pred_[i].empty()) pred_[i].resize(data.size);
         std::vector<SArray<char>> param = {
           SArray<char>(w_val), SArray<char>(w_pos), SArray<char>(V_pos)};
 
         // calc
-        auto loss = loss_[tid];
-        loss->Predict(data, param, &pred_[i]);
+        Loss::Workspace* ws = loss_->GetWorkspace();
+        if (predict) {
+          memset(pred_[i].data(), 0, pred_[i].size()*sizeof(real_t));
+          loss_->Predict(data, param, ws, &pred_[i]);
+        }
         param.push_back(SArray<char>(pred_[i]));
-        loss->CalcGrad(data, param, &(grads[tid]));
-        objv[tid] += loss->Evaluate(data.label, pred_[i]);
-        BinClassMetric metric(data.label, pred_[i].data(), pred_[i].size(), blk_nthreads_);
-        auc[tid] += metric.AUC();
+        if (push_blks) {
+          // the gradient of the features of this block only, in a compact
+          // buffer, with the weights copied into the same layout
+          SArray<feaid_t> ids;
+          SArray<int> lens;
+          SArray<real_t> w;
+          SArray<int> pos(tile.colmap.size(), -1), Vpos(pos.size(), -1);
+          for (size_t j = 0; j < tile.colmap.size(); ++j) {
+            int k = tile.colmap[j];
+            if (k == -1) continue;
+            int len = w_len.empty() ? 1 : w_len[k];
+            ids.push_back(feaids_[k]);
+            if (!w_len.empty()) lens.push_back(len);
+            pos[j] = w.size();
+            if (len > 1) Vpos[j] = w.size() + 1;
+            for (int l = 0; l < len; ++l) w.push_back(w_val[w_pos[j] + l]);
+          }
+          std::vector<SArray<char>> blk_param = {
+            SArray<char>(w), SArray<char>(pos), SArray<char>(Vpos), param[3]};
+          SArray<real_t> blk_grad(w.size(), 0);
+          loss_->CalcGrad(data, blk_param, ws, &blk_grad);
+          int t = model_store_->Push(ids, Store::kGradient, blk_grad, lens);
+          std::lock_guard<std::mutex> lk(push_mu);
+          pushes->push_back(t);
+        } else {
+          loss_->CalcGrad(data, param, ws, &(grads[tid]));
+        }
+        loss_->ReleaseWorkspace(ws);
+        objv[tid] += loss_->Evaluate(data.label, pred_[i]);
+        BinClassStats stats;
+        stats.Add(data.label, pred_[i].data(), pred_[i].size(),
+                  BinClassStats::kMaxAUCBins, 0, blk_nthreads_);
+        auc[tid] += stats.AUC() * stats.count;
       });
-  }
-  pool.Wait();
 
   // merge results
-  for (int i = 1; i < pool_size; ++i) {
+  for (int i = 1; i < ntasks; ++i) {
     objv[0] += objv[i];
     auc[0] += auc[i];
-    for (size_t j = 0; j < n; ++j) {
-      grads[0][j] += grads[i][j];
-    }
   }
   prog_.auc = auc[0];
+  if (push_blks) {
+    grad->clear();
+    return objv[0];
+  }
+  ReduceGrads(used, n);
   *grad = grads[0];
   if (param_.gamma != 1) {
     for (real_t& g : *grad) g = (g > 0 ? 1 : -1) * pow(fabs(g), param_.gamma);
   }
+  if (pushes) {
+    pushes->push_back(model_store_->Push(
+        feaids_, Store::kGradient, *grad, w_len));
+  }
   return objv[0];
 }
 
+void LBFGSLearner::ReduceGrads(const std::vector<char>& used, size_t n) {
+  // task t runs on node t % nnodes. the buffers are first summed on each
+  // node into its first buffer, and then only these cross the nodes
+  int ntasks = static_cast<int>(used.size());
+  int nnodes = std::min(ntasks, TaskScheduler::Get()->NumNodes());
+  std::vector<std::vector<real_t*>> node_bufs(nnodes);
+  for (int t = 0; t < ntasks; ++t) {
+    if (used[t]) node_bufs[t % nnodes].push_back(grad_bufs_[t].data());
+  }
+  int nparts = PartitionThreads(nthreads_, nnodes);
+  std::vector<real_t*> bufs;
+  {
+    TaskGroup group;
+    for (int v = 0; v < nnodes; ++v) {
+      if (node_bufs[v].empty()) continue;
+      bufs.push_back(node_bufs[v][0]);
+      group.Run([&node_bufs, n, nparts, v]() {
+          Reduce(node_bufs[v], n, nparts, v);
+        });
+    }
+  }
+  // grads[0] is used, so bufs[0] is grad
+  Reduce(bufs, n, nthreads_);
+}
+
 void LBFGSLearner::Evaluate(lbfgs::Progress* prog) {
-  int pool_size = nthreads_ / blk_nthreads_;
-  ThreadPool pool(pool_size, pool_size);
-  std::vector<real_t> val_auc(pool_size);
+  int ntasks = std::max(1, std::min(nval_blks_, nthreads_));
+  blk_nthreads_ = PartitionThreads(nthreads_, ntasks);
+  loss_->set_nthreads(blk_nthreads_);
+  std::vector<real_t> val_auc(ntasks);
+  // the margins of a linear model are X*w0 + αX*p along the direction of the
+  // last line search, where w = w0 + αp
+  int nblks = ntrain_blks_ + nval_blks_;
+  bool cached = V_dim_ == 0 && margin1_.size() == static_cast<size_t>(nblks);
   // validation data
-  for (int i = ntrain_blks_; i < ntrain_blks_ + nval_blks_; ++i) {
-    pool.Add([this, i, &val_auc](int tid) {
+  ParallelForNodes(ntrain_blks_, nblks, ntasks,
+                   [this, cached, &val_auc](int tid, int i) {
+        if (cached) {
+          const SArray<real_t>& m0 = margin0_[i];
+          const SArray<real_t>& m1 = margin1_[i];
+          SArray<real_t>& pred = pred_[i];
+          pred.resize(m0.size());
+          for (size_t j = 0; j < m0.size(); ++j) {
+            real_t m = m0[j] + alpha_ * m1[j];
+            // the same projection as FMLoss::Predict
+            pred[j] = m > 20 ? 20 : (m < -20 ? -20 : m);
+          }
+          if (val_labels_[i - ntrain_blks_].empty()) {
+            Tile tile; tile_store_->Fetch(i, 0, &tile);
+            val_labels_[i - ntrain_blks_].CopyFrom(tile.data.label);
+          }
+          BinClassStats stats;
+          stats.Add(val_labels_[i - ntrain_blks_].data(), pred.data(),
+                    pred.size(), BinClassStats::kMaxAUCBins, 0, blk_nthreads_);
+          val_auc[tid] += stats.AUC() * stats.count;
+          return;
+        }
         // prepare data
         Tile tile; tile_store_->Fetch(i, 0, &tile);
         auto data = tile.data.GetBlock();
         SArray<int> w_pos, V_pos;
         GetPos(model_lens_, tile.colmap, &w_pos, &V_pos);
+        if (pred_[i].empty()) pred_[i].resize(data.size);
         memset(pred_[i].data(), 0, pred_[i].size()*sizeof(real_t));
         std::vector<SArray<char>> param = {
           SArray<char>(weights_), SArray<char>(w_pos), SArray<char>(V_pos)};
 
         // calc
-        loss_[tid]->Predict(data, param, &pred_[i]);
-        BinClassMetric metric(data.label, pred_[i].data(), pred_[i].size(), blk_nthreads_);
-        val_auc[tid] += metric.AUC();
+        Loss::Workspace* ws = loss_->GetWorkspace();
+        loss_->Predict(data, param, ws, &pred_[i]);
+        loss_->ReleaseWorkspace(ws);
+        BinClassStats stats;
+        stats.Add(data.label, pred_[i].data(), pred_[i].size(),
+                  BinClassStats::kMaxAUCBins, 0, blk_nthreads_);
+        val_auc[tid] += stats.AUC() * stats.count;
       });
-  }
-  pool.Wait();
 
   // merge results
   *prog = prog_;
-  for (int i = 1; i < pool_size; ++i) {
+  for (int i = 1; i < ntasks; ++i) {
     val_auc[0] += val_auc[i];
   }
   prog->val_auc = val_auc[0];
@@ -344,28 +701,27 @@ void LBFGSLearner::GetPos(const SArray<int>& len, const SArray<int>& colmap,
 KWArgs LBFGSLearner::Init(const KWArgs& kwargs) {
   auto remain = Learner::Init(kwargs);
   // init param
-  remain = param_.InitAllowUnknown(kwargs);
+  remain = param_.InitAllowUnknown(remain);
   nthreads_ = param_.num_threads <= 0 ?
               std::thread::hardware_concurrency() : param_.num_threads;
-  blk_nthreads_ = std::min(nthreads_ > 20 ? 4 : 2, nthreads_);
+  // repartitioned once the number of blocks is known
+  blk_nthreads_ = nthreads_;
   // init updater
   auto updater = new LBFGSUpdater();
   remain = updater->Init(remain);
-  remain.push_back(std::make_pair("V_dim", std::to_string(updater->param().V_dim)));
+  V_dim_ = updater->param().V_dim;
+  remain.push_back(std::make_pair("V_dim", std::to_string(V_dim_)));
   // init model store
   model_store_ = Store::Create();
   model_store_->SetUpdater(std::shared_ptr<Updater>(updater));
   remain = model_store_->Init(remain);
   // init data stores
   tile_store_ = new TileStore();
+  remain.push_back(std::make_pair("data_cache", param_.data_cache));
   remain = tile_store_->Init(remain);
-  // init loss
-  KWArgs last;
-  for (int i = 0; i < nthreads_ / blk_nthreads_; ++i) {
-    loss_.push_back(Loss::Create(param_.loss, blk_nthreads_));
-    last = loss_.back()->Init(remain);
-  }
-  return last;
+  // init loss, shared by all pool threads
+  loss_ = Loss::Create(param_.loss, blk_nthreads_);
+  return loss_->Init(remain);
 }
 
 }  // namespace difacto
@@ -13,6 +13,9 @@
 #include "data/tile_store.h"
 #include "data/tile_builder.h"
 #include "common/learner_utils.h"
+#include "common/mem_tracker.h"
+#include "common/model_saver.h"
+#include "common/task_scheduler.h"
 #include "./lbfgs_param.h"
 #include "./lbfgs_utils.h"
 #include "./lbfgs_updater.h"
@@ -21,9 +24,10 @@ namespace difacto {
 class LBFGSLearner : public Learner {
  public:
   virtual ~LBFGSLearner() {
+    eval_group_.Wait();
     delete model_store_;
     delete tile_store_;
-    for (auto l : loss_) delete l;
+    delete loss_;
   }
   KWArgs Init(const KWArgs& kwargs) override;
 
@@ -54,6 +58,14 @@ class LBFGSLearner : public Learner {
     SendJobAndWait(node_group, args, tracker_, job_rets);
   }
 
+  /**
+   * \brief push the gradient and compute the next direction, returns
+   * <p, ∂f(w)>
+   *
+   * @param alpha the step of the previous direction
+   */
+  real_t CalcDirection(real_t alpha);
+
   /**
    * \brief preprocessing the data
    *
@@ -73,22 +85,63 @@ class LBFGSLearner : public Learner {
    */
   real_t InitWorker();
 
+  /**
+   * \brief compute f(w) and ∇f(w)
+   *
+   * @param predict if false, reuse pred_ as the predictions of w
+   * @param pushes if given, ∇f(w) is pushed to the servers rather than stored
+   * in grad, and the timestamps of the pushes are appended. the gradient of a
+   * row block is pushed once it is computed, unless gamma != 1
+   */
   real_t CalcGrad(const SArray<real_t>& w_val,
                   const SArray<int>& w_len,
-                  SArray<real_t>* grad);
+                  SArray<real_t>* grad,
+                  bool predict = true,
+                  std::vector<int>* pushes = nullptr);
+  /**
+   * \brief sum the used per-task gradients of CalcGrad into grad_bufs_[0]
+   */
+  void ReduceGrads(const std::vector<char>& used, size_t n);
 
   void LineSearch(real_t alpha, std::vector<real_t>* status);
 
+  /**
+   * \brief the margins of the current direction are margin0_ + α margin1_ +
+   * α^2 margin2_, set by X*w and X*p for a linear model, of both the training
+   * and the validation blocks. requires w is the one before the line search,
+   * and alpha_ is the step of the previous direction
+   */
+  void CacheLinearMargins(real_t prev_alpha);
+
+  /**
+   * \brief record the predictions of an FM line search step, the margins are
+   * fitted once two steps are known, unless some of them are clipped
+   */
+  void FitFMMargins(int step, real_t alpha);
+
+  /**
+   * \brief evaluate f(w+αp) on the cached margins, and add <p, ∇f(w+αp)>
+   * into p_g, where the gradient is of the loss only
+   */
+  real_t MarginLineSearch(real_t alpha, real_t* p_g);
+
   void Evaluate(lbfgs::Progress* prog);
 
+  /** \brief account the buffers of a worker as scratch */
+  void UpdateMemGauge();
+
   void GetPos(const SArray<int>& len, const SArray<int>& colmap,
               SArray<int>* w_pos, SArray<int>* V_pos) const;
 
 
   LBFGSLearnerParam param_;
   int nthreads_, blk_nthreads_;
+  /** \brief the embedding dimension */
+  int V_dim_ = 0;
   SArray<feaid_t> feaids_;
   SArray<real_t> weights_, grads_, directions_;
+  /** \brief the weights before the line search, only used if l1 > 0 */
+  SArray<real_t> w0_;
   SArray<int> model_lens_;
 
   // data
@@ -102,12 +155,46 @@ class LBFGSLearner : public Learner {
   Store* model_store_ = nullptr;
 
   /** \brief the loss function */
-  std::vector<Loss*> loss_;
+  Loss* loss_ = nullptr;
   std::vector<SArray<real_t>> pred_;
+  /** \brief the per-task gradients of CalcGrad, kept among calls */
+  std::vector<SArray<real_t>> grad_bufs_;
+
+  /**
+   * \brief the coefficients of the margins of the training blocks along the
+   * current direction, see \ref CacheLinearMargins. the ones of a linear
+   * model are not clipped, kept among directions, and also of the validation
+   * blocks
+   */
+  std::vector<SArray<real_t>> margin0_, margin1_, margin2_;
+  /** \brief the labels of the training blocks, used with the margins */
+  std::vector<SArray<real_t>> labels_;
+  /** \brief the labels of the validation blocks, with the cached margins */
+  std::vector<SArray<real_t>> val_labels_;
+  /** \brief the line search steps done on the current direction */
+  int ls_step_ = 0;
+  /** \brief the step of the first FM line search step */
+  real_t fm_alpha0_ = 0;
+  /** \brief the FM margins are fitted, none of the predictions is clipped */
+  bool fm_fitted_ = false;
+  /** \brief grads_ is not computed for the current w yet */
+  bool grads_stale_ = false;
 
   real_t alpha_;
   lbfgs::Progress prog_;
 
+  /**
+   * \brief the validation started by kPushGradient, so it overlaps with the
+   * direction computation on the servers. kEvaluate waits it
+   */
+  TaskGroup eval_group_;
+  bool eval_pending_ = false;
+  lbfgs::Progress eval_prog_;
+
+  /** \brief writes the checkpoints in background */
+  ModelSaver saver_;
+  MemGauge scratch_mem_{MemTracker::kScratch};
+
   std::vector<std::function<void(
       int epoch, const lbfgs::Progress& prog)>> epoch_end_callback_;
 };
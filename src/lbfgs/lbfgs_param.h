@@ -14,10 +14,20 @@ struct LBFGSLearnerParam : public dmlc::Parameter<LBFGSLearnerParam> {
   std::string data_val;
   /** \brief the data format. default is libsvm */
   std::string data_format;
-  /** \brief the directory for the data chache */
+  /** \brief the prefix of the data cache files, see TileStoreParam */
   std::string data_cache;
   /** \brief the model output */
   std::string model_out;
+  /**
+   * \brief save a checkpoint into model_out every checkpoint_epochs epochs,
+   * 0 means never. the model is written in background by the servers
+   */
+  int checkpoint_epochs;
+  /**
+   * \brief also save a checkpoint if these seconds passed since the last
+   * one, 0 means never
+   */
+  int checkpoint_sec;
   /** \brief the model input for warm start */
   std::string model_in;
   /** \brief type of loss, defaut is fm*/
@@ -28,6 +38,11 @@ struct LBFGSLearnerParam : public dmlc::Parameter<LBFGSLearnerParam> {
   int min_num_epochs;
   /** \brief the size of data in MB read each time for processing, in default 256 MB */
   real_t data_chunk_size;
+  /**
+   * \brief the sub-partitions of the data of a worker, which are read and
+   * parsed concurrently. in default 1
+   */
+  int num_data_parts;
 
   /** \brief stop if (objv_new - objv_old) / obj_old < threshold */
   real_t stop_rel_objv;
@@ -45,8 +60,17 @@ struct LBFGSLearnerParam : public dmlc::Parameter<LBFGSLearnerParam> {
 
   real_t gamma;
   int max_num_linesearchs;
+  /**
+   * \brief if nonzero, the line search steps reuse the margins of the data
+   * rather than recompute them. the margins of a linear model are Xw + αXp,
+   * so a step costs O(nrows) once Xp is known. the margins of FM are fitted
+   * by a quadratic function of α from the first two steps. in default 1
+   */
+  int linesearch_cache;
 
   int num_threads;
+  /** \brief the number of threads to parse a text data chunk */
+  int num_parse_threads;
 
   DMLC_DECLARE_PARAMETER(LBFGSLearnerParam) {
     DMLC_DECLARE_FIELD(data_in);
@@ -54,7 +78,10 @@ struct LBFGSLearnerParam : public dmlc::Parameter<LBFGSLearnerParam> {
     DMLC_DECLARE_FIELD(data_format).set_default("libsvm");
     DMLC_DECLARE_FIELD(data_cache).set_default("/tmp/difacto_lbfgs_");
     DMLC_DECLARE_FIELD(data_chunk_size).set_default(256);
+    DMLC_DECLARE_FIELD(num_data_parts).set_range(1, 64).set_default(1);
     DMLC_DECLARE_FIELD(model_out).set_default("");
+    DMLC_DECLARE_FIELD(checkpoint_epochs).set_lower_bound(0).set_default(0);
+    DMLC_DECLARE_FIELD(checkpoint_sec).set_lower_bound(0).set_default(0);
     DMLC_DECLARE_FIELD(model_in).set_default("");
     DMLC_DECLARE_FIELD(loss).set_default("fm");
     DMLC_DECLARE_FIELD(max_num_epochs).set_default(100);
@@ -62,6 +89,7 @@ struct LBFGSLearnerParam : public dmlc::Parameter<LBFGSLearnerParam> {
     DMLC_DECLARE_FIELD(alpha).set_default(1);
     DMLC_DECLARE_FIELD(init_alpha).set_default(0);
     DMLC_DECLARE_FIELD(max_num_linesearchs).set_default(5);
+    DMLC_DECLARE_FIELD(linesearch_cache).set_default(1);
     DMLC_DECLARE_FIELD(c1).set_default(1e-4);
     DMLC_DECLARE_FIELD(gamma).set_default(1);
     DMLC_DECLARE_FIELD(c2).set_default(.9);
@@ -70,6 +98,7 @@ struct LBFGSLearnerParam : public dmlc::Parameter<LBFGSLearnerParam> {
     DMLC_DECLARE_FIELD(stop_rel_objv).set_default(1e-5);
     DMLC_DECLARE_FIELD(stop_val_auc).set_default(1e-5);
     DMLC_DECLARE_FIELD(num_threads).set_default(0);
+    DMLC_DECLARE_FIELD(num_parse_threads).set_range(1, 64).set_default(2);
   }
 };
 
@@ -81,22 +110,46 @@ struct LBFGSUpdaterParam : public dmlc::Parameter<LBFGSUpdaterParam> {
   /** \brief initialize V into [-x, +x] */
   float V_init_scale;
   int tail_feature_filter;
-  // /** \brief the l1 regularizer for :math:`w`: :math:`\lambda_1 |w|_1` */
-  // float l1;
+  /**
+   * \brief the l1 regularizer for :math:`w`: :math:`\lambda_1 |w|_1`, solved
+   * by OWL-QN. in default 0, V is not l1 regularized
+   */
+  float l1;
   /** \brief the l2 regularizer for :math:`w`: :math:`\lambda_2 \|w\|_2^2` */
   float l2;
   /** \brief the l2 regularizer for :math:`V`: :math:`\lambda_2 \|V_i\|_2^2` */
   float V_l2;
+  /** \brief the number of (s, y) pairs kept */
   int m;
+  /** \brief the storage of s and y. 0: fp32, 1: fp16, 2: bf16. in default 0 */
+  int history_precision;
+  /**
+   * \brief if positive, only keep the newest history_mem_pairs pairs in
+   * memory, the older ones are spilled into history_cache. in default 0, which
+   * keeps all pairs in memory
+   */
+  int history_mem_pairs;
+  /** \brief the prefix of the files of the spilled pairs */
+  std::string history_cache;
+  /**
+   * \brief if positive, the feature counts for tail_feature_filter and
+   * V_threshold are estimated by a count-min sketch of this memory in MB,
+   * instead of being kept per feature. in default 0
+   */
+  float feacnt_sketch_mb;
   DMLC_DECLARE_PARAMETER(LBFGSUpdaterParam) {
     DMLC_DECLARE_FIELD(tail_feature_filter).set_default(4);
-    // DMLC_DECLARE_FIELD(l1).set_default(1);
+    DMLC_DECLARE_FIELD(l1).set_default(0).set_lower_bound(0);
     DMLC_DECLARE_FIELD(l2).set_default(.1);
     DMLC_DECLARE_FIELD(V_l2).set_default(.01);
     DMLC_DECLARE_FIELD(V_dim);
     DMLC_DECLARE_FIELD(V_threshold).set_default(0);
     DMLC_DECLARE_FIELD(m).set_default(10);
+    DMLC_DECLARE_FIELD(history_precision).set_default(0).set_range(0, 2);
+    DMLC_DECLARE_FIELD(history_mem_pairs).set_default(0);
+    DMLC_DECLARE_FIELD(history_cache).set_default("/tmp/difacto_lbfgs_history_");
     DMLC_DECLARE_FIELD(V_init_scale).set_default(.01);
+    DMLC_DECLARE_FIELD(feacnt_sketch_mb).set_lower_bound(0).set_default(0);
   }
 };
 
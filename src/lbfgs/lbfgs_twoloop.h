@@ -20,18 +20,43 @@ class Twoloop {
                   const std::vector<SArray<real_t>>& y,
                   const SArray<real_t>& grad,
                   std::vector<real_t>* incr_B) {
+    std::vector<VecRef> sr, yr;
+    Refs(s, y, grad, &sr, &yr);
+    CalcIncreB(sr, yr, grad, incr_B);
+  }
+
+  /**
+   * \brief the same as above, but s and y may be stored in 16 bits, such as
+   * the ones in \ref History. their lengths should be equal to grad
+   */
+  void CalcIncreB(const std::vector<VecRef>& s,
+                  const std::vector<VecRef>& y,
+                  const SArray<real_t>& grad,
+                  std::vector<real_t>* incr_B) {
     CHECK_EQ(s.size(), y.size());
     int m = static_cast<int>(s.size());
     incr_B->resize(6*m+1);
+    if (m == 0) {
+      (*incr_B)[0] = Inner(grad, grad, nthreads_);
+      return;
+    }
+    // the products of [s(k-1), y(k-1), grad] with [s, y, grad] in one sweep
+    std::vector<VecRef> a = {s.back(), y.back(), grad.data()};
+    std::vector<VecRef> b = s;
+    b.insert(b.end(), y.begin(), y.end());
+    b.push_back(grad.data());
+    std::vector<double> res;
+    MultiInner(a, b, grad.size(), &res, nthreads_);
+    int nb = 2*m+1;
     for (int i = 0; i < m; ++i) {
-      (*incr_B)[i    ] = Inner(s.back(), s[i]);
-      (*incr_B)[i+  m] = Inner(s.back(), y[i]);
-      (*incr_B)[i+2*m] = Inner(y.back(), s[i]);
-      (*incr_B)[i+3*m] = Inner(y.back(), y[i]);
-      (*incr_B)[i+4*m] = Inner(grad,     s[i]);
-      (*incr_B)[i+5*m] = Inner(grad,     y[i]);
+      (*incr_B)[i    ] = res[i];
+      (*incr_B)[i+  m] = res[i+m];
+      (*incr_B)[i+2*m] = res[i+nb];
+      (*incr_B)[i+3*m] = res[i+m+nb];
+      (*incr_B)[i+4*m] = res[i+2*nb];
+      (*incr_B)[i+5*m] = res[i+m+2*nb];
     }
-    (*incr_B)[6*m] = Inner(grad, grad);
+    (*incr_B)[6*m] = res[2*m+2*nb];
   }
 
   void ApplyIncreB(const std::vector<real_t>& incr_B) {
@@ -80,18 +105,42 @@ class Twoloop {
                      const std::vector<SArray<real_t>>& y,
                      const SArray<real_t>& grad,
                      SArray<real_t>* p) {
+    std::vector<VecRef> sr, yr;
+    Refs(s, y, grad, &sr, &yr);
+    CalcDirection(sr, yr, grad, p);
+  }
+
+  /** \brief the same as above, but s and y may be stored in 16 bits */
+  void CalcDirection(const std::vector<VecRef>& s,
+                     const std::vector<VecRef>& y,
+                     const SArray<real_t>& grad,
+                     SArray<real_t>* p) {
     CHECK_EQ(s.size(), static_cast<size_t>(m_));
     CHECK_EQ(y.size(), static_cast<size_t>(m_));
     size_t n = grad.size();
-    p->resize(n); memset(p->data(), 0, n*sizeof(real_t));
+    p->resize(n);
 
     std::vector<double> delta; CalcDelta(&delta);
-    for (int i = 0; i < m_; ++i) Add(delta[i], s[i], p);
-    for (int i = 0; i < m_; ++i) Add(delta[i+m_], y[i], p);
-    Add(delta[2*m_], grad, p);
+    std::vector<VecRef> vecs = s;
+    vecs.insert(vecs.end(), y.begin(), y.end());
+    vecs.push_back(grad.data());
+    MultiAdd(delta, vecs, n, p->data(), nthreads_);
   }
 
  private:
+  /** \brief the references of s and y, whose lengths should be equal to grad */
+  static void Refs(const std::vector<SArray<real_t>>& s,
+                   const std::vector<SArray<real_t>>& y,
+                   const SArray<real_t>& grad,
+                   std::vector<VecRef>* sr, std::vector<VecRef>* yr) {
+    for (const auto& v : s) {
+      CHECK_EQ(v.size(), grad.size()); sr->push_back(v.data());
+    }
+    for (const auto& v : y) {
+      CHECK_EQ(v.size(), grad.size()); yr->push_back(v.data());
+    }
+  }
+
   void CalcDelta(std::vector<double>* delta) {
     delta->resize(2*m_+1);
     double* d = delta->data(); d[2*m_] = -1;
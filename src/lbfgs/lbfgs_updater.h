@@ -3,25 +3,77 @@
  */
 #ifndef DIFACTO_LBFGS_LBFGS_UPDATER_H_
 #define DIFACTO_LBFGS_LBFGS_UPDATER_H_
+#include <algorithm>
+#include <cmath>
+#include <mutex>
 #include <vector>
+#include "./lbfgs_history.h"
 #include "./lbfgs_twoloop.h"
 #include "difacto/updater.h"
+#include "common/huge_pages.h"
+#include "common/mem_tracker.h"
+#include "common/model_file.h"
+#include "common/find_position.h"
 namespace difacto {
 
 class LBFGSUpdater : public Updater {
  public:
-  LBFGSUpdater() { }
+  LBFGSUpdater()
+      : model_mem_(MemTracker::kModel), aux_mem_(MemTracker::kAux) { }
   virtual ~LBFGSUpdater() { }
 
   KWArgs Init(const KWArgs& kwargs) override {
-    return param_.InitAllowUnknown(kwargs);
+    auto remain = param_.InitAllowUnknown(kwargs);
+    history_.Init(param_.m, param_.history_precision, param_.history_mem_pairs,
+                  param_.history_cache, nthreads_);
+    if (param_.feacnt_sketch_mb > 0) {
+      feacnt_sketch_.Init(std::max<size_t>(
+          param_.feacnt_sketch_mb * 1024 * 1024 / sizeof(uint16_t) / 4, 1));
+    }
+    return remain;
   }
 
   const LBFGSUpdaterParam& param() const { return param_; }
 
-  void Load(dmlc::Stream* fi, bool* has_aux) override { }
+  /**
+   * \brief load a model, which is used to init the weights in \ref InitWeight.
+   * there is no aux data.
+   */
+  void Load(dmlc::Stream* fi, bool* has_aux) override {
+    init_model_.Load(fi, false);
+    CHECK_EQ(init_model_.V_dim, param_.V_dim) << "the model has a different V_dim";
+    if (has_aux) *has_aux = false;
+  }
+
+  /**
+   * \brief save the weights, the history of s and y is not saved
+   */
+  void Save(bool save_aux, dmlc::Stream *fo) const override {
+    ModelFile model;
+    Snapshot(&model);
+    model.Save(fo);
+  }
 
-  void Save(bool save_aux, dmlc::Stream *fo) const override { }
+  /** \brief copy the weights into a snapshot, which shares no memory */
+  void Snapshot(ModelFile* model) const {
+    model->V_dim = param_.V_dim;
+    model->feaids.CopyFrom(feaids_);
+    if (weight_lens_.empty()) {
+      model->w.CopyFrom(weights_);
+      if (model->V_dim > 0) model->V_idx.resize(feaids_.size(), -1);
+    } else {
+      size_t n = feaids_.size(), p = 0;
+      model->w.resize(n);
+      model->V_idx.resize(n);
+      for (size_t i = 0; i < n; ++i) {
+        int len = weight_lens_[i];
+        model->w[i] = weights_[p];
+        model->V_idx[i] = len > 1 ? model->V.size() / model->V_dim : -1;
+        for (int j = 1; j < len; ++j) model->V.push_back(weights_[p+j]);
+        p += len;
+      }
+    }
+  }
 
   typedef std::function<void(
       const SArray<int>& weight_lens, SArray<real_t>* weights)> WeightInitializer;
@@ -31,7 +83,13 @@ class LBFGSUpdater : public Updater {
   }
 
   void InitWeight(std::vector<real_t>* rets) {
-    if (param_.tail_feature_filter > 0) {
+    bool sketch = feacnt_sketch_.size() > 0;
+    if (param_.tail_feature_filter > 0 && sketch) {
+      SArray<feaid_t> filtered_ids;
+      lbfgs::RemoveTailFeatures(
+          feaids_, feacnt_sketch_, param_.tail_feature_filter, &filtered_ids);
+      feaids_ = filtered_ids;
+    } else if (param_.tail_feature_filter > 0) {
       SArray<feaid_t> filtered_ids;
       SArray<real_t> filtered_cnts;
       lbfgs::RemoveTailFeatures(
@@ -43,15 +101,33 @@ class LBFGSUpdater : public Updater {
 
     size_t n = 0;
     if (param_.V_dim) {
+      // a value costs the weight, the gradients, the direction and the pairs
+      // in memory. V is not allocated for the rest features once the memory
+      // budget is exceeded
+      int pairs = param_.history_mem_pairs > 0 ?
+                  std::min(param_.history_mem_pairs, param_.m) : param_.m;
+      size_t val_bytes = (4 + 2 * pairs) * sizeof(real_t);
+      auto tracker = MemTracker::Get();
+      size_t num_no_V = 0;
       weight_lens_.resize(feaids_.size());
       for (size_t i = 0; i < feaids_.size(); ++i) {
-        weight_lens_[i] = 1 + (feacnts_[i] > param_.V_threshold ? param_.V_dim : 0);
+        real_t cnt = sketch ? feacnt_sketch_.Count(feaids_[i]) : feacnts_[i];
+        bool has_V = cnt > param_.V_threshold;
+        if (has_V && tracker->Exceeds((n + 1 + param_.V_dim) * val_bytes)) {
+          has_V = false;
+          ++num_no_V;
+        }
+        weight_lens_[i] = 1 + (has_V ? param_.V_dim : 0);
         n +=  weight_lens_[i];
       }
+      if (num_no_V) {
+        LOG(WARNING) << "memory budget exceeded, " << num_no_V
+                     << " features have no V: " << tracker->TextString();
+      }
     } else {
       n = feaids_.size();
     }
-    weights_.resize(n);
+    weights_ = HugePages::Get()->New<real_t>(n);
 
     if (weight_initializer_) {
       weight_initializer_(weight_lens_, &weights_);
@@ -69,6 +145,24 @@ class LBFGSUpdater : public Updater {
       }
     }
 
+    if (init_model_.feaids.size() && feaids_.size()) {
+      // warm start, copy the weights existing in the loaded model
+      SArray<int> pos;
+      FindPosition(init_model_.feaids, feaids_, &pos);
+      n = 0;
+      for (size_t i = 0; i < feaids_.size(); ++i) {
+        int len = weight_lens_.empty() ? 1 : weight_lens_[i];
+        if (pos[i] != -1) {
+          weights_[n] = init_model_.w[pos[i]];
+          real_t const* V = init_model_.GetV(pos[i]);
+          if (V && len > 1) memcpy(weights_.data()+n+1, V, (len-1)*sizeof(real_t));
+        }
+        n += len;
+      }
+      init_model_ = ModelFile();
+    }
+
+    UpdateMemGauge();
     rets->resize(2);
     (*rets)[0] = Evaluate();
     (*rets)[1] = weights_.size();
@@ -82,51 +176,72 @@ class LBFGSUpdater : public Updater {
   void PrepareCalcDirection(std::vector<real_t>* aux) {
     // add regularizer
     AddRegularizerGrad(&new_grads_);
+    bool l1 = param_.l1 > 0;
     // it's epoch 0, no need to update s, y
-    if (grads_.empty()) { grads_ = new_grads_; return; }
-    // add new_grad - old_grad to y
-    if (static_cast<int>(y_.size()) == param_.m) y_.erase(y_.begin());
-    y_.resize(y_.size()+1);
-    y_.back().CopyFrom(new_grads_);
-    lbfgs::Add(-1, grads_, &y_.back(), nthreads_);
+    if (grads_.empty()) {
+      grads_ = new_grads_;
+      new_grads_ = SArray<real_t>();
+      if (l1) CalcPseudoGradient();
+      return;
+    }
+    // add s = alpha * p and y = new_grad - old_grad. the step of OWL-QN is
+    // the projected one
+    if (l1) {
+      SArray<real_t> step; step.CopyFrom(weights_);
+      lbfgs::Add(-1, w0_, &step, nthreads_);
+      history_.Push(1, step, new_grads_, grads_);
+    } else {
+      history_.Push(alpha_, dir_, new_grads_, grads_);
+    }
     grads_ = new_grads_;
-    // update s
-    lbfgs::Times(alpha_, &s_.back(), nthreads_);
+    new_grads_ = SArray<real_t>();
+    UpdateMemGauge();
     alpha_ = 0;
-    twoloop_.CalcIncreB(s_, y_, grads_, aux);
+    if (l1) CalcPseudoGradient();
+    std::vector<lbfgs::VecRef> s, y;
+    history_.Get(&s, &y);
+    twoloop_.CalcIncreB(s, y, l1 ? pseudo_grads_ : grads_, aux);
   }
 
   /**
-   * \brief return <∇f(w), p>
-   * @return
+   * \brief return <∇f(w), p>, where ∇f(w) is the pseudo-gradient if l1 > 0
    */
   real_t CalcDirection(const std::vector<real_t>& aux) {
-    // calc direction
-    SArray<real_t> dir;
-    if (y_.size()) {
+    bool l1 = param_.l1 > 0;
+    const SArray<real_t>& g = l1 ? pseudo_grads_ : grads_;
+    // calc direction, the buffer of the previous one is reused
+    if (history_.size()) {
       twoloop_.ApplyIncreB(aux);
-      twoloop_.CalcDirection(s_, y_, grads_, &dir);
+      std::vector<lbfgs::VecRef> s, y;
+      history_.Get(&s, &y);
+      twoloop_.CalcDirection(s, y, g, &dir_);
     } else {
-      dir.CopyFrom(grads_);
-      lbfgs::Times(-1, &dir, nthreads_);
+      dir_ = HugePages::Get()->Copy(g);
+      lbfgs::Times(-1, &dir_, nthreads_);
+    }
+    if (l1) {
+      lbfgs::AlignDirection(g, weight_lens_, &dir_);
+      w0_ = HugePages::Get()->Copy(weights_);
     }
-    for (auto& p : dir) p = p > 5 ? 5 : (p < -5 ? -5 : p);
-    // push into s_
-    if (static_cast<int>(s_.size()) == param_.m) s_.erase(s_.begin());
-    s_.push_back(dir);
+    for (auto& p : dir_) p = p > 5 ? 5 : (p < -5 ? -5 : p);
+    UpdateMemGauge();
     // return <p, g>
-    return lbfgs::Inner(grads_, dir, nthreads_);
+    return lbfgs::Inner(g, dir_, nthreads_);
   }
 
 
   void LineSearch(real_t alpha, std::vector<real_t>* status) {
-    lbfgs::Add(alpha - alpha_, s_.back(), &weights_, nthreads_);
+    if (param_.l1 > 0) {
+      lbfgs::OrthantStep(alpha, w0_, dir_, weight_lens_, &weights_, nthreads_);
+    } else {
+      lbfgs::Add(alpha - alpha_, dir_, &weights_, nthreads_);
+    }
     alpha_ = alpha;
     SArray<real_t> grads(weights_.size(), 0);
     AddRegularizerGrad(&grads);
     status->resize(2);
     (*status)[0] += Evaluate();
-    (*status)[1] += lbfgs::Inner(grads, s_.back(), nthreads_);
+    (*status)[1] += lbfgs::Inner(grads, dir_, nthreads_) + L1Derivative();
   }
 
   void Get(const SArray<feaid_t>& feaids,
@@ -134,11 +249,15 @@ class LBFGSUpdater : public Updater {
            SArray<real_t>* values,
            SArray<int>* lengths) override {
     if (value_type == Store::kFeaCount) {
-      KVMatch(feaids_, feacnts_, feaids, values, ASSIGN, nthreads_);
+      if (feacnt_sketch_.size()) {
+        feacnt_sketch_.Count(feaids, values);
+      } else {
+        KVMatch(feaids_, feacnts_, feaids, values, ASSIGN, nthreads_);
+      }
     } else if (value_type == Store::kWeight) {
       feacnts_.clear();
-      if (s_.size()) {
-        KVMatch(feaids_, s_.back(), weight_lens_, feaids, values, lengths,
+      if (dir_.size()) {
+        KVMatch(feaids_, dir_, weight_lens_, feaids, values, lengths,
                 ASSIGN, nthreads_);
       } else {
         KVMatch(feaids_, weights_, weight_lens_, feaids, values, lengths,
@@ -154,16 +273,95 @@ class LBFGSUpdater : public Updater {
               const SArray<real_t>& values,
               const SArray<int>& lengths) override {
     if (value_type == Store::kFeaCount) {
-      feaids_ = feaids; feacnts_ = values;
+      feaids_ = feaids;
+      if (feacnt_sketch_.size()) {
+        CHECK_EQ(feaids.size(), values.size());
+        feacnt_sketch_.Clear();
+        feacnt_sketch_.Add(feaids, values);
+      } else {
+        // copy the values, which may still be owned by the sender
+        feacnts_.CopyFrom(values);
+      }
     } else if (value_type == Store::kGradient) {
-      CHECK_EQ(feaids_.size(), feaids.size());
-      new_grads_ = values;
+      AddGrads(feaids, values, lengths);
     } else {
       LOG(FATAL) << "...";
     }
+    UpdateMemGauge();
   }
 
  private:
+  /**
+   * \brief new_grads_ += the pushed gradients of some features, such as of a
+   * row block of a worker. it is consumed by \ref PrepareCalcDirection
+   */
+  void AddGrads(const SArray<feaid_t>& feaids, const SArray<real_t>& values,
+                const SArray<int>& lengths) {
+    // a local store updates from the threads of the worker
+    std::lock_guard<std::mutex> lk(grad_mu_);
+    if (new_grads_.empty()) {
+      new_grads_ = HugePages::Get()->New<real_t>(weights_.size());
+    }
+    if (feaids.size() == feaids_.size()) {
+      // all features
+      lbfgs::Add(1, values, &new_grads_, nthreads_);
+      return;
+    }
+    if (!weight_lens_.empty() && grad_pos_.size() != weight_lens_.size()) {
+      grad_pos_.resize(weight_lens_.size());
+      size_t p = 0;
+      for (size_t i = 0; i < weight_lens_.size(); ++i) {
+        grad_pos_[i] = p;
+        p += weight_lens_[i];
+      }
+    }
+    size_t p = 0;
+    auto it = feaids_.begin();
+    for (size_t i = 0; i < feaids.size(); ++i) {
+      it = std::lower_bound(it, feaids_.end(), feaids[i]);
+      CHECK(it != feaids_.end() && *it == feaids[i])
+          << "unknown feature " << feaids[i];
+      size_t j = it - feaids_.begin();
+      int len = lengths.empty() ? 1 : lengths[i];
+      CHECK_EQ(len, weight_lens_.empty() ? 1 : weight_lens_[j]);
+      size_t pos = weight_lens_.empty() ? j : grad_pos_[j];
+      real_t* g = new_grads_.data() + pos;
+      for (int k = 0; k < len; ++k) g[k] += values[p+k];
+      p += len;
+    }
+    CHECK_EQ(p, values.size());
+  }
+
+  void UpdateMemGauge() {
+    model_mem_.Set(feaids_.size() * sizeof(feaid_t) +
+                   (feacnts_.size() + weights_.size()) * sizeof(real_t) +
+                   weight_lens_.size() * sizeof(int));
+    aux_mem_.Set(history_.MemBytes() + feacnt_sketch_.MemBytes() +
+                 (dir_.size() + grads_.size() + new_grads_.size() +
+                  pseudo_grads_.size() + w0_.size()) * sizeof(real_t) +
+                 grad_pos_.size() * sizeof(size_t));
+  }
+
+  /** \brief pseudo_grads_ = the pseudo-gradient of grads_ */
+  void CalcPseudoGradient() {
+    pseudo_grads_ = HugePages::Get()->Copy(grads_);
+    lbfgs::PseudoGradient(param_.l1, weights_, weight_lens_, &pseudo_grads_);
+  }
+
+  /**
+   * \brief the directional derivative of l1 * |w|_1 along dir_, where a zero
+   * w moves by the sign of the direction
+   */
+  real_t L1Derivative() {
+    if (param_.l1 <= 0) return 0;
+    double res = 0;
+    lbfgs::ForEachW(weight_lens_, weights_.size(), [&](size_t i) {
+        real_t w = weights_[i], p = dir_[i];
+        res += w > 0 ? p : (w < 0 ? -p : fabs(p));
+      });
+    return param_.l1 * res;
+  }
+
   void AddRegularizerGrad(SArray<real_t>* grads) {
     CHECK_EQ(grads->size(), weights_.size());
     if (weight_lens_.empty()) {
@@ -197,24 +395,49 @@ class LBFGSUpdater : public Updater {
       }
       CHECK_EQ(static_cast<size_t>(n), weights_.size());
     }
+    if (param_.l1 > 0) {
+      lbfgs::ForEachW(weight_lens_, weights_.size(), [&](size_t i) {
+          objv += param_.l1 * fabs(weights_[i]);
+        });
+    }
     return objv;
   }
 
   LBFGSUpdaterParam param_;
   SArray<feaid_t> feaids_;
   SArray<real_t> feacnts_;
+  /** \brief the estimated feature counts if feacnt_sketch_mb > 0 */
+  CountMinSketch<uint16_t> feacnt_sketch_;
 
-  std::vector<SArray<real_t>> s_, y_;
+  /** \brief the pairs of s and y */
+  lbfgs::History history_;
+  /** \brief the current direction p, s = alpha * p after the line search */
+  SArray<real_t> dir_;
 
   SArray<real_t> weights_;
   SArray<int> weight_lens_;
+  /**
+   * \brief the gradient of the current direction, and the sum of the pushed
+   * ones of the next
+   */
   SArray<real_t> grads_, new_grads_;
+  std::mutex grad_mu_;
+  /** \brief the position of each feature in the gradients if V is used */
+  std::vector<size_t> grad_pos_;
+  /**
+   * \brief the pseudo-gradient of grads_ and the weights before the line
+   * search, only used if l1 > 0
+   */
+  SArray<real_t> pseudo_grads_, w0_;
 
   WeightInitializer weight_initializer_ = nullptr;
+  /** \brief the model for warm start */
+  ModelFile init_model_;
   lbfgs::Twoloop twoloop_;
   int nthreads_ = DEFAULT_NTHREADS;
 
   real_t alpha_ = 0;
+  MemGauge model_mem_, aux_mem_;
 };
 }  // namespace difacto
 #endif  // DIFACTO_LBFGS_LBFGS_UPDATER_H_
@@ -3,12 +3,19 @@
  */
 #ifndef DIFACTO_LBFGS_LBFGS_UTILS_H_
 #define DIFACTO_LBFGS_LBFGS_UTILS_H_
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
 #include <string>
 #include <vector>
 #include "dmlc/memory_io.h"
 #include "dmlc/omp.h"
 #include "difacto/base.h"
 #include "difacto/sarray.h"
+#include "common/count_min_sketch.h"
+#include "common/float16.h"
+#include "common/range.h"
+#include "common/task_scheduler.h"
 namespace difacto {
 namespace lbfgs {
 
@@ -21,7 +28,8 @@ struct Job {
   static const int kCalcDirection = 6;
   static const int kLineSearch = 7;
   static const int kSaveModel = 8;
-  static const int kEvaluate = 8;
+  static const int kEvaluate = 9;
+  static const int kCheckpoint = 10;
 
   int type;
   std::vector<real_t> value;
@@ -92,6 +100,112 @@ inline void Add(real_t x, const SArray<real_t>& a,
   }
 }
 
+/** \brief the number of entries of a chunk in \ref MultiInner and \ref MultiAdd */
+static const size_t kMultiChunk = 2048;
+
+/**
+ * \brief a read only vector stored in fp32, fp16 or bf16
+ */
+struct VecRef {
+  real_t const* f32 = nullptr;
+  uint16_t const* f16 = nullptr;
+  /** \brief f16 is bf16 rather than fp16 */
+  bool bf16 = false;
+
+  VecRef(real_t const* p) : f32(p) { }  // NOLINT(runtime/explicit)
+  VecRef(uint16_t const* p, bool is_bf16) : f16(p), bf16(is_bf16) { }
+
+  /** \brief entries [begin, begin + len), decoded into buf unless in fp32 */
+  real_t const* Chunk(size_t begin, size_t len, real_t* buf) const {
+    if (f32) return f32 + begin;
+    uint16_t const* h = f16 + begin;
+    if (bf16) {
+      for (size_t k = 0; k < len; ++k) buf[k] = BF16ToFloat(h[k]);
+    } else {
+      for (size_t k = 0; k < len; ++k) buf[k] = HalfToFloat(h[k]);
+    }
+    return buf;
+  }
+};
+
+/**
+ * \brief res[i * b.size() + j] = <a[i], b[j]>, all vectors have length n
+ *
+ * all products are computed in a single sweep. the vectors are processed
+ * chunk by chunk, so the chunks of all vectors stay in the cache while
+ * computing their products, and each thread works on a range of chunks. the
+ * 16-bit vectors are decoded a chunk each time, and accumulated in fp64
+ */
+inline void MultiInner(const std::vector<VecRef>& a,
+                       const std::vector<VecRef>& b,
+                       size_t n, std::vector<double>* res,
+                       int nthreads = DEFAULT_NTHREADS) {
+  size_t na = a.size(), nb = b.size();
+  res->assign(na * nb, 0);
+  size_t nchunk = (n + kMultiChunk - 1) / kMultiChunk;
+  int nt = static_cast<int>(std::max<size_t>(1, std::min<size_t>(nthreads, nchunk)));
+  std::vector<std::vector<double>> parts(nt);
+  ParallelRun(nt, [&](int tid, int nt) {
+      auto& part = parts[tid];
+      part.resize(na * nb);
+      std::vector<real_t> buf((na + nb) * kMultiChunk);
+      std::vector<real_t const*> bps(nb);
+      Range rg = Range(0, nchunk).Segment(tid, nt);
+      for (size_t c = rg.begin; c < rg.end; ++c) {
+        size_t begin = c * kMultiChunk;
+        size_t len = std::min(kMultiChunk, n - begin);
+        for (size_t j = 0; j < nb; ++j) {
+          bps[j] = b[j].Chunk(begin, len, buf.data() + (na + j) * kMultiChunk);
+        }
+        for (size_t i = 0; i < na; ++i) {
+          real_t const* ap = a[i].Chunk(begin, len, buf.data() + i * kMultiChunk);
+          for (size_t j = 0; j < nb; ++j) {
+            real_t const* bp = bps[j];
+            double r = 0;
+#pragma omp simd reduction(+:r)
+            for (size_t k = 0; k < len; ++k) r += ap[k] * bp[k];
+            part[i * nb + j] += r;
+          }
+        }
+      }
+    });
+  for (const auto& part : parts) {
+    for (size_t k = 0; k < part.size(); ++k) (*res)[k] += part[k];
+  }
+}
+
+/**
+ * \brief b = sum_i x[i] * a[i], all vectors have length n
+ *
+ * b is written in a single sweep, a chunk of b stays in the cache while
+ * adding all a[i]
+ */
+inline void MultiAdd(const std::vector<double>& x,
+                     const std::vector<VecRef>& a,
+                     size_t n, real_t* b,
+                     int nthreads = DEFAULT_NTHREADS) {
+  CHECK_EQ(x.size(), a.size());
+  size_t nchunk = (n + kMultiChunk - 1) / kMultiChunk;
+  int nt = static_cast<int>(std::max<size_t>(1, std::min<size_t>(nthreads, nchunk)));
+  ParallelRun(nt, [&](int tid, int nt) {
+      std::vector<real_t> buf(kMultiChunk);
+      Range rg = Range(0, nchunk).Segment(tid, nt);
+      for (size_t c = rg.begin; c < rg.end; ++c) {
+        size_t begin = c * kMultiChunk;
+        size_t len = std::min(kMultiChunk, n - begin);
+        real_t* bp = b + begin;
+        memset(bp, 0, len * sizeof(real_t));
+        for (size_t i = 0; i < a.size(); ++i) {
+          if (x[i] == 0) continue;
+          real_t xi = static_cast<real_t>(x[i]);
+          real_t const* ap = a[i].Chunk(begin, len, buf.data());
+#pragma omp simd
+          for (size_t k = 0; k < len; ++k) bp[k] += xi * ap[k];
+        }
+      }
+    });
+}
+
 /**
  * \brief a *= x
  */
@@ -102,6 +216,75 @@ inline void Times(real_t x, SArray<real_t>* a, int nthreads = DEFAULT_NTHREADS)
   for (size_t i = 0; i < a->size(); ++i) ap[i] *= x;
 }
 
+/**
+ * \brief call fn(i) for the position i of each w in a vector of length n,
+ * which is the first one of each length in lens, or all if lens is empty
+ */
+template <typename Fn>
+inline void ForEachW(const SArray<int>& lens, size_t n, const Fn& fn) {
+  if (lens.empty()) {
+    for (size_t i = 0; i < n; ++i) fn(i);
+  } else {
+    size_t i = 0;
+    for (int l : lens) { fn(i); i += l; }
+    CHECK_EQ(i, n);
+  }
+}
+
+/**
+ * \brief turn the gradient g of the smooth part into the pseudo-gradient of
+ * g + l1 * |w|_1 of OWL-QN, which is the one-sided derivative pointing to
+ * the steepest descent. only w has the l1 regularizer, V is not changed
+ */
+inline void PseudoGradient(real_t l1, const SArray<real_t>& w,
+                           const SArray<int>& lens, SArray<real_t>* g) {
+  CHECK_EQ(w.size(), g->size());
+  ForEachW(lens, w.size(), [&](size_t i) {
+      real_t& gi = (*g)[i];
+      if (w[i] > 0) {
+        gi += l1;
+      } else if (w[i] < 0) {
+        gi -= l1;
+      } else if (gi + l1 < 0) {
+        gi += l1;
+      } else if (gi - l1 > 0) {
+        gi -= l1;
+      } else {
+        gi = 0;
+      }
+    });
+}
+
+/**
+ * \brief zero the entries of w in the direction p whose signs disagree with
+ * the ones of the negative pseudo-gradient pg
+ */
+inline void AlignDirection(const SArray<real_t>& pg, const SArray<int>& lens,
+                           SArray<real_t>* p) {
+  CHECK_EQ(pg.size(), p->size());
+  ForEachW(lens, p->size(), [&](size_t i) {
+      if ((*p)[i] * pg[i] >= 0) (*p)[i] = 0;
+    });
+}
+
+/**
+ * \brief w = π(w0 + alpha * p), the entries of w leaving the orthant of w0
+ * are set to 0. the orthant of a zero w0 is the sign of p, as p is aligned
+ * by \ref AlignDirection
+ */
+inline void OrthantStep(real_t alpha, const SArray<real_t>& w0,
+                        const SArray<real_t>& p, const SArray<int>& lens,
+                        SArray<real_t>* w, int nthreads = DEFAULT_NTHREADS) {
+  CHECK_EQ(w0.size(), p.size());
+  w->resize(w0.size());
+  real_t const *w0p = w0.data(), *pp = p.data();
+  real_t *wp = w->data();
+#pragma omp parallel for num_threads(nthreads)
+  for (size_t i = 0; i < w0.size(); ++i) wp[i] = w0p[i] + alpha * pp[i];
+  ForEachW(lens, w0.size(), [&](size_t i) {
+      if (wp[i] * w0p[i] < 0) wp[i] = 0;
+    });
+}
 
 inline void RemoveTailFeatures(const SArray<feaid_t>& feaids,
                                const SArray<real_t>& feacnts,
@@ -119,6 +302,18 @@ inline void RemoveTailFeatures(const SArray<feaid_t>& feaids,
   }
 }
 
+/** \brief the same, but with the counts estimated by a count-min sketch */
+template <typename C>
+inline void RemoveTailFeatures(const SArray<feaid_t>& feaids,
+                               const CountMinSketch<C>& sketch,
+                               real_t threshold,
+                               SArray<feaid_t>* filtered) {
+  filtered->clear();
+  for (size_t i = 0; i < feaids.size(); ++i) {
+    if (sketch.Count(feaids[i]) > threshold) filtered->push_back(feaids[i]);
+  }
+}
+
 }  // namespace lbfgs
 }  // namespace difacto
 #endif  // DIFACTO_LBFGS_LBFGS_UTILS_H_
@@ -2,15 +2,30 @@
  * Copyright (c) 2015 by Contributors
  */
 #include "difacto/learner.h"
+#include <memory>
 #include "./sgd/sgd_param.h"
 #include "./sgd/sgd_learner.h"
 #include "./bcd/bcd_param.h"
 #include "./bcd/bcd_learner.h"
 #include "./lbfgs/lbfgs_learner.h"
+#include "./data/tile_store.h"
+#include "./common/tracer.h"
+#include "./common/mem_tracker.h"
+#include "./common/huge_pages.h"
+#include "./reader/columnar_parser.h"
+#include "./reader/read_ahead_split.h"
+#include "./reader/feature_cross.h"
 namespace difacto {
 
 DMLC_REGISTER_PARAMETER(SGDLearnerParam);
 DMLC_REGISTER_PARAMETER(BCDLearnerParam);
+DMLC_REGISTER_PARAMETER(TileStoreParam);
+DMLC_REGISTER_PARAMETER(TracerParam);
+DMLC_REGISTER_PARAMETER(MemTrackerParam);
+DMLC_REGISTER_PARAMETER(HugePageParam);
+DMLC_REGISTER_PARAMETER(ColumnarParam);
+DMLC_REGISTER_PARAMETER(ReadAheadParam);
+DMLC_REGISTER_PARAMETER(FeatureCrossParam);
 
 Learner* Learner::Create(const std::string& type) {
   if (type == "sgd") {
@@ -31,7 +46,43 @@ KWArgs Learner::Init(const KWArgs& kwargs) {
   auto remain = tracker_->Init(kwargs);
   using namespace std::placeholders;
   tracker_->SetExecutor(std::bind(&Learner::Process, this, _1, _2));
+  // start tracing
+  TracerParam trace;
+  remain = trace.InitAllowUnknown(remain);
+  trace_out_ = trace.trace_out;
+  if (trace_out_.size()) Tracer::Get()->Start(trace.trace_max_events);
+  // the memory budget of this node
+  MemTrackerParam mem;
+  remain = mem.InitAllowUnknown(remain);
+  MemTracker::Get()->SetBudget(
+      static_cast<size_t>(mem.mem_budget_mb * 1024 * 1024));
+  // the pages of the large arrays
+  HugePageParam pages;
+  remain = pages.InitAllowUnknown(remain);
+  HugePages::Get()->Init(pages);
+  // the parts of the data in the col format read
+  ColumnarParam col;
+  remain = col.InitAllowUnknown(remain);
+  ColumnarFilter::Get()->Init(col);
+  // the read-ahead of the data
+  remain = ReadAheadSplit::DefaultParam()->InitAllowUnknown(remain);
+  // the crosses generated by the parsers
+  remain = FeatureCross::DefaultParam()->InitAllowUnknown(remain);
   return remain;
 }
 
+void Learner::SaveTrace() {
+  if (trace_out_.empty()) return;
+  auto tracer = Tracer::Get();
+  tracer->Stop();
+  std::string filename = trace_out_;
+  if (IsDistributed()) {
+    filename += std::string("-") + GetRole() + "-" + std::to_string(getpid());
+  }
+  LOG(INFO) << "writing the trace into " << filename << ", "
+            << tracer->NumEvents() << " events recorded";
+  std::unique_ptr<dmlc::Stream> fo(dmlc::Stream::Create(filename.c_str(), "w"));
+  tracer->Write(fo.get());
+}
+
 }  // namespace difacto
@@ -3,12 +3,16 @@
  */
 #ifndef DIFACTO_LOSS_BIN_CLASS_METRIC_H_
 #define DIFACTO_LOSS_BIN_CLASS_METRIC_H_
+#include <math.h>
 #include <algorithm>
 #include <vector>
 #include "difacto/base.h"
+#include "dmlc/data.h"
+#include "dmlc/io.h"
 #include "dmlc/logging.h"
 #include "dmlc/omp.h"
 #include "difacto/sarray.h"
+#include "common/fast_math.h"
 namespace difacto {
 
 /**
@@ -82,10 +86,10 @@ class BinClassMetric {
 
   real_t LogitObjv() {
     real_t objv = 0;
-#pragma omp parallel for reduction(+:objv) num_threads(nt_)
+#pragma omp parallel for simd reduction(+:objv) num_threads(nt_)
     for (size_t i = 0; i < size_; ++i) {
       real_t y = label_[i] > 0 ? 1 : -1;
-      objv += log(1 + exp(- y * predict_[i]));
+      objv += math::LogitObjv(y, predict_[i]);
     }
     return objv;
   }
@@ -97,5 +101,199 @@ class BinClassMetric {
   int nt_;
 };
 
+/**
+ * \brief an approximate AUC computed from a histogram of the predictions
+ *
+ * a prediction, namely the margin, falls into one of num_bins equal-width
+ * bins over [-kMaxMargin, kMaxMargin], and the bins count the positive and
+ * negative examples. so adding a batch costs O(n) without sorting, and the
+ * histograms of different batches, threads or nodes are merged by adding
+ * them up. the examples inside a bin are treated as ties. the bins are
+ * log-spaced in the odds, so the predictions of a low CTR, which are all
+ * close to 0 after the sigmoid, still spread over many bins.
+ *
+ * the histogram is a plain double array of length 2 * num_bins, with the
+ * positive and negative counts of bin b at 2*b and 2*b+1
+ */
+class AUCHistogram {
+ public:
+  /** \brief the margins beyond it fall into the first or the last bin */
+  static constexpr real_t kMaxMargin = 20;
+
+  /**
+   * \brief add a batch into the histogram
+   * @param label label vector
+   * @param predict predict vector
+   * @param n length
+   * @param num_bins the number of bins
+   * @param hist the histogram
+   * @param weight optional example weights, 1 if nullptr
+   */
+  static void Add(const dmlc::real_t* const label,
+                  const real_t* const predict,
+                  size_t n, int num_bins, double* hist,
+                  const dmlc::real_t* const weight = nullptr) {
+    real_t scale = num_bins / (2 * kMaxMargin);
+    for (size_t i = 0; i < n; ++i) {
+      int b = static_cast<int>((predict[i] + kMaxMargin) * scale);
+      b = b < 0 ? 0 : (b >= num_bins ? num_bins - 1 : b);
+      hist[2 * b + (label[i] > 0 ? 0 : 1)] += weight ? weight[i] : 1;
+    }
+  }
+
+  /** \brief returns the AUC of a histogram */
+  static real_t AUC(double const* hist, int num_bins) {
+    double area = 0, cum_neg = 0, cum_pos = 0;
+    for (int b = 0; b < num_bins; ++b) {
+      double pos = hist[2 * b], neg = hist[2 * b + 1];
+      area += pos * (cum_neg + .5 * neg);
+      cum_neg += neg;
+      cum_pos += pos;
+    }
+    if (cum_pos == 0 || cum_neg == 0) return 1;
+    return area / (cum_pos * cum_neg);
+  }
+};
+
+/**
+ * \brief the sums of the binary classification metrics of a set of examples
+ *
+ * \ref Add computes the logit objective, the accuracy, the calibration, the
+ * squared error and the AUC histogram in one pass. all members are double,
+ * which count exactly beyond the 2^24 examples a float does, and the sums of
+ * different batches, threads or nodes are merged by adding them up, see
+ * \ref Merge
+ */
+struct BinClassStats {
+  /** \brief the maximal number of bins of the AUC histogram */
+  static const int kMaxAUCBins = 1024;
+  double count = 0;  // number of examples
+  double num_pos = 0;  // number of positive examples
+  double objv = 0;  // the logit objective, namely the logloss
+  double correct = 0;  // number of examples with predict > threshold iff y > 0
+  double sum_prob = 0;  // the sum of the sigmoids of the predictions
+  double sq_err = 0;  // the sum of (sigmoid(predict) - y)^2, y in {0, 1}
+  /** \brief the AUC histogram, see \ref AUCHistogram, the unused bins are 0 */
+  double auc_hist[2 * kMaxAUCBins] = {0};
+
+  /**
+   * \brief add a batch
+   * @param label label vector
+   * @param predict predict vector
+   * @param n length
+   * @param num_bins the number of bins of the AUC histogram, at most
+   * kMaxAUCBins
+   * @param threshold the threshold of predict for the accuracy
+   * @param nthreads num threads, each adds a segment into its own stats
+   * @param weight optional example weights, 1 if nullptr. an example of
+   * weight w counts as w examples in all metrics
+   */
+  void Add(const dmlc::real_t* const label,
+           const real_t* const predict,
+           size_t n, int num_bins = kMaxAUCBins, real_t threshold = 0,
+           int nthreads = 1, const dmlc::real_t* const weight = nullptr) {
+    CHECK(num_bins <= kMaxAUCBins);
+    // too few examples to pay the copies of the stats
+    int nt = std::max(1, std::min<int>(nthreads, n / 10000));
+    if (nt == 1) {
+      AddSegment(label, predict, weight, n, num_bins, threshold);
+      return;
+    }
+    std::vector<BinClassStats> stats(nt);
+#pragma omp parallel for num_threads(nt)
+    for (int t = 0; t < nt; ++t) {
+      size_t begin = n * t / nt, end = n * (t + 1) / nt;
+      stats[t].AddSegment(label + begin, predict + begin,
+                          weight ? weight + begin : nullptr, end - begin,
+                          num_bins, threshold);
+    }
+    for (const auto& s : stats) Merge(s);
+  }
+
+  void Merge(const BinClassStats& other) {
+    count += other.count;
+    num_pos += other.num_pos;
+    objv += other.objv;
+    correct += other.correct;
+    sum_prob += other.sum_prob;
+    sq_err += other.sq_err;
+    for (int i = 0; i < 2 * kMaxAUCBins; ++i) auc_hist[i] += other.auc_hist[i];
+  }
+
+  /**
+   * \brief write the sums, and only the nonzero bins of the histogram, which
+   * are a few of them for a small batch or few bins
+   */
+  void Save(dmlc::Stream* fo) const {
+    double sums[] = {count, num_pos, objv, correct, sum_prob, sq_err};
+    fo->Write(sums, sizeof(sums));
+    std::vector<uint32_t> idx;
+    std::vector<double> val;
+    for (int i = 0; i < 2 * kMaxAUCBins; ++i) {
+      if (auc_hist[i] == 0) continue;
+      idx.push_back(i);
+      val.push_back(auc_hist[i]);
+    }
+    fo->Write(idx);
+    fo->Write(val);
+  }
+
+  void Load(dmlc::Stream* fi) {
+    double sums[6];
+    CHECK_EQ(fi->Read(sums, sizeof(sums)), sizeof(sums));
+    count = sums[0];
+    num_pos = sums[1];
+    objv = sums[2];
+    correct = sums[3];
+    sum_prob = sums[4];
+    sq_err = sums[5];
+    std::vector<uint32_t> idx;
+    std::vector<double> val;
+    CHECK(fi->Read(&idx));
+    CHECK(fi->Read(&val));
+    CHECK_EQ(idx.size(), val.size());
+    std::fill(auc_hist, auc_hist + 2 * kMaxAUCBins, 0);
+    for (size_t i = 0; i < idx.size(); ++i) {
+      CHECK_LT(idx[i], 2U * kMaxAUCBins);
+      auc_hist[idx[i]] = val[i];
+    }
+  }
+
+  real_t AUC() const { return AUCHistogram::AUC(auc_hist, kMaxAUCBins); }
+  real_t LogLoss() const { return count ? objv / count : 0; }
+  real_t Accuracy() const { return count ? correct / count : 0; }
+  /** \brief the clicks over the predicted clicks, 1 is well calibrated */
+  real_t COPC() const { return sum_prob ? num_pos / sum_prob : 0; }
+  real_t RMSE() const { return count ? sqrt(sq_err / count) : 0; }
+
+ private:
+  void AddSegment(const dmlc::real_t* const label,
+                  const real_t* const predict,
+                  const dmlc::real_t* const weight,
+                  size_t n, int num_bins, real_t threshold) {
+    double cnt = 0, pos = 0, ob = 0, cor = 0, prob = 0, sq = 0;
+#pragma omp simd reduction(+:cnt, pos, ob, cor, prob, sq)
+    for (size_t i = 0; i < n; ++i) {
+      real_t y = label[i] > 0 ? 1 : 0;
+      real_t p = 1 / (1 + math::Exp(- predict[i]));
+      real_t w = weight ? weight[i] : 1;
+      cnt += w;
+      pos += w * y;
+      ob += w * math::LogitObjv(2 * y - 1, predict[i]);
+      cor += (predict[i] > threshold) == (y > 0) ? w : 0;
+      prob += w * p;
+      sq += w * (p - y) * (p - y);
+    }
+    count += cnt;
+    num_pos += pos;
+    objv += ob;
+    correct += cor;
+    sum_prob += prob;
+    sq_err += sq;
+    // the scatter into the bins is not vectorized, so it is a separate loop
+    AUCHistogram::Add(label, predict, n, num_bins, auc_hist, weight);
+  }
+};
+
 }  // namespace difacto
 #endif  // DIFACTO_LOSS_BIN_CLASS_METRIC_H_
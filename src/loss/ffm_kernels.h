@@ -0,0 +1,92 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ * @file   ffm_kernels.h
+ * @brief  the vector kernels of the ffm loss
+ */
+#ifndef DIFACTO_LOSS_FFM_KERNELS_H_
+#define DIFACTO_LOSS_FFM_KERNELS_H_
+#include "difacto/base.h"
+#if defined(__GNUC__) && defined(__x86_64__)
+#define DIFACTO_FFM_SIMD 1
+#include <immintrin.h>
+#else
+#define DIFACTO_FFM_SIMD 0
+#endif
+namespace difacto {
+namespace ffm {
+
+/** \brief returns <a, b>, the scalar version */
+inline real_t DotScalar(int n, real_t const* a, real_t const* b) {
+  real_t s = 0;
+  for (int i = 0; i < n; ++i) s += a[i] * b[i];
+  return s;
+}
+
+/** \brief y += alpha * x, the scalar version */
+inline void AxpyScalar(int n, real_t alpha, real_t const* x, real_t* y) {
+  for (int i = 0; i < n; ++i) y[i] += alpha * x[i];
+}
+
+#if DIFACTO_FFM_SIMD
+/**
+ * \brief the avx version, it sums 8 lanes separately, so the result may
+ * differ from \ref DotScalar by rounding
+ */
+__attribute__((target("avx")))
+inline real_t DotAVX(int n, real_t const* a, real_t const* b) {
+  __m256 acc = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(a + i),
+                                           _mm256_loadu_ps(b + i)));
+  }
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc),
+                        _mm256_extractf128_ps(acc, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s) + DotScalar(n - i, a + i, b + i);
+}
+
+/** \brief the avx version, identical to \ref AxpyScalar */
+__attribute__((target("avx")))
+inline void AxpyAVX(int n, real_t alpha, real_t const* x, real_t* y) {
+  __m256 va = _mm256_set1_ps(alpha);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(y + i, _mm256_add_ps(
+        _mm256_loadu_ps(y + i), _mm256_mul_ps(va, _mm256_loadu_ps(x + i))));
+  }
+  AxpyScalar(n - i, alpha, x + i, y + i);
+}
+
+/** \brief whether the cpu supports avx, checked once */
+inline bool HasAVX() {
+  static const bool has_avx = __builtin_cpu_supports("avx");
+  return has_avx;
+}
+#endif  // DIFACTO_FFM_SIMD
+
+/**
+ * \brief returns <a, b>, uses avx if the cpu supports it at runtime and n is
+ * at least 8
+ */
+inline real_t Dot(int n, real_t const* a, real_t const* b) {
+#if DIFACTO_FFM_SIMD
+  if (n >= 8 && HasAVX()) return DotAVX(n, a, b);
+#endif  // DIFACTO_FFM_SIMD
+  return DotScalar(n, a, b);
+}
+
+/** \brief y += alpha * x, uses avx if possible */
+inline void Axpy(int n, real_t alpha, real_t const* x, real_t* y) {
+#if DIFACTO_FFM_SIMD
+  if (n >= 8 && HasAVX()) {
+    AxpyAVX(n, alpha, x, y); return;
+  }
+#endif  // DIFACTO_FFM_SIMD
+  AxpyScalar(n, alpha, x, y);
+}
+
+}  // namespace ffm
+}  // namespace difacto
+#endif  // DIFACTO_LOSS_FFM_KERNELS_H_
@@ -0,0 +1,351 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_LOSS_FFM_LOSS_H_
+#define DIFACTO_LOSS_FFM_LOSS_H_
+#include <vector>
+#include <algorithm>
+#include "difacto/base.h"
+#include "dmlc/data.h"
+#include "difacto/loss.h"
+#include "common/spmv.h"
+#include "common/fast_math.h"
+#include "common/col_buckets.h"
+#include "common/range.h"
+#include "common/task_scheduler.h"
+#include "common/tracer.h"
+#include "./ffm_kernels.h"
+namespace difacto {
+/**
+ * \brief parameters for FFM loss
+ */
+struct FFMLossParam : public dmlc::Parameter<FFMLossParam> {
+  /**
+   * \brief the embedding length of a feature, which is ffm_num_fields times
+   * the embedding dimension of a field
+   */
+  int V_dim;
+  /** \brief the number of fields, the larger field ids are folded by modulo */
+  int ffm_num_fields;
+  /** \brief the bits of the field id in a feature id, see EncodeFeaGrpID */
+  int ffm_field_bits;
+  DMLC_DECLARE_PARAMETER(FFMLossParam) {
+    DMLC_DECLARE_FIELD(V_dim).set_range(0, 100000);
+    DMLC_DECLARE_FIELD(ffm_num_fields).set_range(1, 1 << 12);
+    DMLC_DECLARE_FIELD(ffm_field_bits).set_range(1, 16).set_default(12);
+  }
+};
+
+/**
+ * \brief the field-aware factorization machine loss
+ * :math:`f(x) = \langle w, x \rangle + \sum_{i<j} \langle V_{i,f_j},
+ * V_{j,f_i} \rangle x_i x_j`
+ *
+ * the V of a feature is the embeddings of all fields, field f at [f*k,
+ * (f+1)*k), so it uses the same variable length values of the updater as
+ * \ref FMLoss. the field of a feature is decoded from its id, see
+ * \ref GetFields.
+ *
+ * rather than the O(nnz^2 k) pairs, a row is computed by the field sums
+ * S[a][b] = sum_{i in field a} x_i V_{i,b} over the fields present in the
+ * row, then f(x) = <w,x> + sum_{a<b} <S[a][b], S[b][a]> + .5 * sum_a
+ * (|S[a][a]|^2 - sum_{i in field a} x_i^2 |V_{i,a}|^2), which costs O(nnz F'
+ * k + F'^2 k) for F' fields in the row, and the same for the gradients
+ */
+class FFMLoss : public Loss {
+ public:
+  FFMLoss() {}
+  virtual ~FFMLoss() {}
+
+  KWArgs Init(const KWArgs& kwargs) override {
+    auto remain = param_.InitAllowUnknown(kwargs);
+    CHECK_EQ(param_.V_dim % param_.ffm_num_fields, 0)
+        << "V_dim must be a multiple of ffm_num_fields";
+    return remain;
+  }
+
+  /**
+   * \brief the field of each feature
+   *
+   * @param feaids the localized feature ids, see \ref Localizer
+   * @param fields the field ids in [0, ffm_num_fields)
+   */
+  void GetFields(const SArray<feaid_t>& feaids, SArray<int>* fields) const {
+    fields->resize(feaids.size());
+    for (size_t i = 0; i < feaids.size(); ++i) {
+      (*fields)[i] = static_cast<int>(
+          DecodeFeaGrpID(ReverseBytes(feaids[i]), param_.ffm_field_bits) %
+          param_.ffm_num_fields);
+    }
+  }
+
+  /**
+   * \brief perform prediction
+   *
+   * @param data the data
+   * @param param input parameters
+   * - param[0], real_t vector, the weights
+   * - param[1], int vector, the w positions
+   * - param[2], int vector, the V positions
+   * - param[3], int vector, the fields, see \ref GetFields
+   * @param ws the workspace, keeps the field sums for CalcGrad
+   * @param pred predict output, should be pre-allocated
+   */
+  void Predict(const dmlc::RowBlock<unsigned>& data,
+               const std::vector<SArray<char>>& param,
+               Workspace* ws,
+               SArray<real_t>* pred) override {
+    CHECK_EQ(param.size(), 4);
+    Predict(data,
+            SArray<real_t>(param[0]),
+            SArray<int>(param[1]),
+            SArray<int>(param[2]),
+            SArray<int>(param[3]),
+            ws,
+            pred);
+  }
+
+  /** \brief the typed \ref Predict */
+  void Predict(const dmlc::RowBlock<unsigned>& data,
+               const SArray<real_t>& weights,
+               const SArray<int>& w_pos,
+               const SArray<int>& V_pos,
+               const SArray<int>& fields,
+               Workspace* ws,
+               SArray<real_t>* pred) {
+    DIFACTO_TRACE_SCOPE("predict", "loss");
+    if (param_.V_dim == 0) {
+      // pred = X * w
+      SArray<real_t> w = weights;
+      SpMV::Times(data, w, pred, nthreads_, w_pos, {});
+    } else {
+      CHECK_EQ(pred->size(), data.size);
+      CHECK(fields.size()) << "no fields";
+      Forward(data, weights, w_pos, V_pos, fields, ToFFMWorkspace(ws), pred);
+    }
+
+    // projection
+    for (auto& p : *pred) p = p > 20 ? 20 : (p < -20 ? -20 : p);
+  }
+
+  /*!
+   * \brief compute the gradients
+   *
+   * @param data the data
+   * @param param input parameters
+   * - param[0], real_t vector, the weights
+   * - param[1], int vector, the w positions
+   * - param[2], int vector, the V positions
+   * - param[3], int vector, the fields
+   * - param[4], real_t vector, the predict output
+   * @param ws the workspace passed to Predict
+   * @param grad the results
+   */
+  void CalcGrad(const dmlc::RowBlock<unsigned>& data,
+                const std::vector<SArray<char>>& param,
+                Workspace* ws,
+                SArray<real_t>* grad) override {
+    CHECK_EQ(param.size(), 5);
+    CalcGrad(data,
+             SArray<real_t>(param[0]),
+             SArray<int>(param[1]),
+             SArray<int>(param[2]),
+             SArray<int>(param[3]),
+             SArray<real_t>(param[4]),
+             ws,
+             grad);
+  }
+
+  /** \brief the typed \ref CalcGrad */
+  void CalcGrad(const dmlc::RowBlock<unsigned>& data,
+                const SArray<real_t>& weights,
+                const SArray<int>& w_pos,
+                const SArray<int>& V_pos,
+                const SArray<int>& fields,
+                const SArray<real_t>& pred,
+                Workspace* ws,
+                SArray<real_t>* grad) {
+    DIFACTO_TRACE_SCOPE("calc_grad", "loss");
+    FFMWorkspace* ffm_ws = ToFFMWorkspace(ws);
+    SArray<real_t>& p = ffm_ws->p;
+    CHECK_EQ(pred.size(), data.size);
+    p.resize(pred.size());
+    ParallelRun(nthreads_, [&](int tid, int nt) {
+        Range rg = Range(0, p.size()).Segment(tid, nt);
+        for (size_t i = rg.begin; i < rg.end; ++i) {
+          real_t y = data.label[i] > 0 ? 1 : -1;
+          p[i] = math::LogitGrad(y, pred[i]);
+          if (data.weight) p[i] *= data.weight[i];
+        }
+      });
+
+    if (param_.V_dim == 0) {
+      SpMV::TransTimes(data, p, grad, nthreads_, {}, w_pos);
+    } else {
+      CHECK_EQ(ffm_ws->S_offset.size(), data.size + 1);
+      Backward(data, weights, w_pos, V_pos, fields, *ffm_ws, grad);
+    }
+  }
+
+ private:
+  /** \brief the scratch buffers of a batch */
+  struct FFMWorkspace : public Workspace {
+    /**
+     * \brief the fields present in each row, the ones of row i start at
+     * offset[i] - offset[0] of the row block
+     */
+    std::vector<int> row_fields;
+    /** \brief the number of fields present in each row */
+    std::vector<int> num_fields;
+    /**
+     * \brief the field sums, the ones of row i start at S_offset[i], ordered
+     * by (a, b, the embedding dimension)
+     */
+    std::vector<real_t> S;
+    std::vector<size_t> S_offset;
+    /** \brief the loss derivative on predictions */
+    SArray<real_t> p;
+  };
+
+  Workspace* CreateWorkspace() override { return new FFMWorkspace(); }
+
+  static FFMWorkspace* ToFFMWorkspace(Workspace* ws) {
+    return static_cast<FFMWorkspace*>(CHECK_NOTNULL(ws));
+  }
+
+  /** \brief pred += f(x), and computes the field sums for Backward */
+  void Forward(const dmlc::RowBlock<unsigned>& data,
+               const SArray<real_t>& weights,
+               const SArray<int>& w_pos,
+               const SArray<int>& V_pos,
+               const SArray<int>& fields,
+               FFMWorkspace* ws,
+               SArray<real_t>* pred) {
+    int V_dim = param_.V_dim;
+    int k = V_dim / param_.ffm_num_fields;
+    size_t n = data.size;
+    size_t start = data.offset[0];
+    real_t const* w = weights.data();
+    int const* wp = w_pos.empty() ? nullptr : w_pos.data();
+    int const* Vp = V_pos.empty() ? nullptr : V_pos.data();
+    int const* fld = fields.data();
+
+    // find the fields present in each row
+    ws->row_fields.resize(data.offset[n] - start);
+    ws->num_fields.resize(n);
+    ParallelRun(nthreads_, [&](int tid, int nt) {
+        std::vector<char> seen(param_.ffm_num_fields, 0);
+        Range rg = Range(0, n).Segment(tid, nt);
+        for (size_t i = rg.begin; i < rg.end; ++i) {
+          int* rf = ws->row_fields.data() + data.offset[i] - start;
+          int nf = 0;
+          for (size_t j = data.offset[i]; j < data.offset[i+1]; ++j) {
+            int f = fld[data.index[j]];
+            if (!seen[f]) { seen[f] = 1; rf[nf++] = f; }
+          }
+          for (int a = 0; a < nf; ++a) seen[rf[a]] = 0;
+          ws->num_fields[i] = nf;
+        }
+      });
+    ws->S_offset.resize(n + 1);
+    ws->S_offset[0] = 0;
+    for (size_t i = 0; i < n; ++i) {
+      size_t nf = ws->num_fields[i];
+      ws->S_offset[i+1] = ws->S_offset[i] + nf * nf * k;
+    }
+    ws->S.assign(ws->S_offset[n], 0);
+
+    ParallelRun(nthreads_, [&](int tid, int nt) {
+        // the position of a field in the fields of the current row
+        std::vector<int> slot(param_.ffm_num_fields);
+        Range rg = Range(0, n).Segment(tid, nt);
+        for (size_t i = rg.begin; i < rg.end; ++i) {
+          int const* rf = ws->row_fields.data() + data.offset[i] - start;
+          int nf = ws->num_fields[i];
+          for (int a = 0; a < nf; ++a) slot[rf[a]] = a;
+          real_t* S = ws->S.data() + ws->S_offset[i];
+          real_t lin = 0, xxvv = 0;
+          for (size_t j = data.offset[i]; j < data.offset[i+1]; ++j) {
+            unsigned c = data.index[j];
+            real_t x = data.value ? data.value[j] : 1;
+            int q = wp ? wp[c] : c;
+            if (q >= 0) lin += x * w[q];
+            q = Vp ? Vp[c] : c * V_dim;
+            if (q < 0) continue;
+            real_t const* V = w + q;
+            int a = slot[fld[c]];
+            real_t* Sa = S + a * nf * k;
+            for (int b = 0; b < nf; ++b) {
+              ffm::Axpy(k, x, V + rf[b] * k, Sa + b * k);
+            }
+            real_t const* Va = V + rf[a] * k;
+            xxvv += x * x * ffm::Dot(k, Va, Va);
+          }
+          real_t s = 0;
+          for (int a = 0; a < nf; ++a) {
+            real_t const* Saa = S + (a * nf + a) * k;
+            s += .5 * ffm::Dot(k, Saa, Saa);
+            for (int b = a + 1; b < nf; ++b) {
+              s += ffm::Dot(k, S + (a * nf + b) * k, S + (b * nf + a) * k);
+            }
+          }
+          (*pred)[i] += lin + s - .5 * xxvv;
+        }
+      });
+  }
+
+  /**
+   * \brief grad_w += X' * p, and for a feature i of field a and a field b
+   * present in the row, grad_{V_{i,b}} += p x_i S[b][a], minus p x_i^2
+   * V_{i,a} if b = a
+   *
+   * the nonzero entries are column bucketed as \ref FMLoss
+   */
+  void Backward(const dmlc::RowBlock<unsigned>& data,
+                const SArray<real_t>& weights,
+                const SArray<int>& w_pos,
+                const SArray<int>& V_pos,
+                const SArray<int>& fields,
+                const FFMWorkspace& ws,
+                SArray<real_t>* grad) {
+    int V_dim = param_.V_dim;
+    int k = V_dim / param_.ffm_num_fields;
+    size_t start = data.offset[0];
+    real_t const* w = weights.data();
+    real_t* g = grad->data();
+    int const* wp = w_pos.empty() ? nullptr : w_pos.data();
+    int const* Vp = V_pos.empty() ? nullptr : V_pos.data();
+    int const* fld = fields.data();
+    const SArray<real_t>& p = ws.p;
+    auto update = [&](size_t i, unsigned c, real_t x) {
+      real_t xp = x * p[i];
+      int q = wp ? wp[c] : c;
+      if (q >= 0) g[q] += xp;
+      q = Vp ? Vp[c] : c * V_dim;
+      if (q < 0) return;
+      int const* rf = ws.row_fields.data() + data.offset[i] - start;
+      int nf = ws.num_fields[i];
+      int a = std::find(rf, rf + nf, fld[c]) - rf;
+      real_t const* S = ws.S.data() + ws.S_offset[i];
+      real_t* gV = g + q;
+      for (int b = 0; b < nf; ++b) {
+        ffm::Axpy(k, xp, S + (b * nf + a) * k, gV + rf[b] * k);
+      }
+      ffm::Axpy(k, - xp * x, w + q + rf[a] * k, gV + rf[a] * k);
+    };
+
+    size_t ncols = std::max(w_pos.size(), V_pos.size());
+    if (ncols == 0) ncols = grad->size();
+    ColBuckets buckets(data, ncols, nthreads_ * 4, nthreads_);
+    ParallelFor(buckets.size(), nthreads_, [&](int tid, int b) {
+        for (auto e = buckets.begin(b); e != buckets.end(b); ++e) {
+          update(e->row, e->col, e->val);
+        }
+      });
+  }
+
+  FFMLossParam param_;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_LOSS_FFM_LOSS_H_
@@ -5,13 +5,18 @@
 #define DIFACTO_LOSS_FM_LOSS_H_
 #include <vector>
 #include <cmath>
+#include <algorithm>
 #include "difacto/base.h"
 #include "dmlc/data.h"
 #include "dmlc/io.h"
 #include "difacto/loss.h"
 #include "common/spmv.h"
-#include "common/spmm.h"
+#include "common/fast_math.h"
+#include "common/col_buckets.h"
+#include "common/range.h"
+#include "common/task_scheduler.h"
 #include "./logit_loss.h"
+#include "common/tracer.h"
 namespace difacto {
 /**
  * \brief parameters for FM loss
@@ -35,7 +40,17 @@ class FMLoss : public Loss {
   virtual ~FMLoss() {}
 
   KWArgs Init(const KWArgs& kwargs) override {
-    return param_.InitAllowUnknown(kwargs);
+    auto remain = param_.InitAllowUnknown(kwargs);
+    // the kernels unrolled for the common V_dim, picked once here
+    switch (param_.V_dim) {
+      case 4: SetKernels<4>(); break;
+      case 8: SetKernels<8>(); break;
+      case 16: SetKernels<16>(); break;
+      case 32: SetKernels<32>(); break;
+      case 64: SetKernels<64>(); break;
+      default: SetKernels<0>();
+    }
+    return remain;
   }
   /**
    * \brief perform prediction
@@ -51,67 +66,51 @@ class FMLoss : public Loss {
    * - param[0], real_t vector, the weights
    * - param[1], int vector, the w positions
    * - param[2], int vector, the V positions
+   * - param[3], optional int vector, the V lengths, which are at most V_dim.
+   *   all Vs have length V_dim if not given
+   * @param ws the workspace, keeps X*V for CalcGrad
    * @param pred predict output, should be pre-allocated
    */
   void Predict(const dmlc::RowBlock<unsigned>& data,
                const std::vector<SArray<char>>& param,
+               Workspace* ws,
                SArray<real_t>* pred) override {
-    CHECK_EQ(param.size(), 3);
+    CHECK(param.size() == 3 || param.size() == 4);
     Predict(data,
             SArray<real_t>(param[0]),
             SArray<int>(param[1]),
             SArray<int>(param[2]),
+            param.size() == 4 ? SArray<int>(param[3]) : SArray<int>(),
+            ws,
             pred);
   }
 
+  /**
+   * \brief the typed \ref Predict, which callers knowing the loss is FMLoss
+   * use to skip packing the inputs
+   */
   void Predict(const dmlc::RowBlock<unsigned>& data,
                const SArray<real_t>& weights,
                const SArray<int>& w_pos,
                const SArray<int>& V_pos,
+               const SArray<int>& V_len,
+               Workspace* ws,
                SArray<real_t>* pred) {
-    // pred = X * w
-    SArray<real_t> w = weights;
-    SpMV::Times(data, w, pred, nthreads_, w_pos, {});
-
+    DIFACTO_TRACE_SCOPE("predict", "loss");
     int V_dim = param_.V_dim;
-    if (V_dim == 0) return;
-    SArray<real_t> V = weights;
-
-    // XV_ = X*V
-    XV_.clear();
-    XV_.resize(data.size * V_dim, 0);
-    SpMM::Times(data, V, V_dim, &XV_, nthreads_, V_pos);
-
-    // XX = X.*X
-    auto XX = data;
-    if (XX.value) {
-      XX_.clear();
-      XX_.CopyFrom(XX.value+XX.offset[0], XX.offset[XX.size] - XX.offset[0]);
-      for (auto& v : XX_) v *= v;
-      XX.value = XX_.data();
-    }
-
-    // VV = V*V
-    SArray<real_t> VV(V.size());
-#pragma omp parallel for num_threads(nthreads_)
-    for (size_t i = 0; i < V_pos.size(); ++i) {
-      int p = V_pos[i];
-      if (p < 0) continue;
-      for (int j = 0; j < V_dim; ++j) VV[p+j] = V[p+j] * V[p+j];
-    }
-
-    // XXVV = XX*VV
-    SArray<real_t> XXVV(XV_.size());
-    SpMM::Times(XX, VV, V_dim, &XXVV, nthreads_, V_pos);
-
-    // py += .5 * sum((V.XV).^2 - xxvv)
-#pragma omp parallel for num_threads(nthreads_)
-    for (size_t i = 0; i < pred->size(); ++i) {
-      real_t* t = XV_.data() + i * V_dim;
-      real_t* tt = XXVV.data() + i * V_dim;
-      real_t s = 0;
-      for (int j = 0; j < V_dim; ++j) s += t[j] * t[j] - tt[j];
-      (*pred)[i] += .5 * s;
+    if (V_dim == 0) {
+      // pred = X * w
+      SArray<real_t> w = weights;
+      SpMV::Times(data, w, pred, nthreads_, w_pos, {});
+    } else {
+      // XV = X*V, CalcGrad uses it later
+      CHECK_EQ(pred->size(), data.size);
+      SArray<real_t>* XV = &ToFMWorkspace(ws)->XV;
+      XV->resize(0);
+      XV->resize(data.size * V_dim, 0);
+      // V_len varies the lengths, so only the generic kernel takes it
+      auto forward = V_len.empty() ? forward_ : &FMLoss::Forward<0>;
+      (this->*forward)(data, weights, w_pos, V_pos, V_len, XV, pred);
     }
 
     // projection
@@ -121,7 +120,7 @@ class FMLoss : public Loss {
   /*!
    * \brief compute the gradients
    *
-   *   p = - y ./ (1 + exp (y .* pred));
+   *   p = - y ./ (1 + exp (y .* pred)) .* weight;
    *   grad_w = X' * p;
    *   grad_u = X' * diag(p) * X * V  - diag((X.*X)'*p) * V
    *
@@ -130,78 +129,189 @@ class FMLoss : public Loss {
    * - param[0], real_t vector, the weights
    * - param[1], int vector, the w positions
    * - param[2], int vector, the V positions
-   * - param[3], real_t vector, the predict output
+   * - param[3], optional int vector, the V lengths
+   * - the last, real_t vector, the predict output
+   * @param ws the workspace passed to Predict
    * @param grad the results
    */
   void CalcGrad(const dmlc::RowBlock<unsigned>& data,
                 const std::vector<SArray<char>>& param,
+                Workspace* ws,
                 SArray<real_t>* grad) override {
-    CHECK_EQ(param.size(), 4);
+    CHECK(param.size() == 4 || param.size() == 5);
     CalcGrad(data,
              SArray<real_t>(param[0]),
              SArray<int>(param[1]),
              SArray<int>(param[2]),
-             SArray<real_t>(param[3]),
+             param.size() == 5 ? SArray<int>(param[3]) : SArray<int>(),
+             SArray<real_t>(param.back()),
+             ws,
              grad);
   }
 
+  /** \brief the typed \ref CalcGrad */
   void CalcGrad(const dmlc::RowBlock<unsigned>& data,
                 const SArray<real_t>& weights,
                 const SArray<int>& w_pos,
                 const SArray<int>& V_pos,
+                const SArray<int>& V_len,
                 const SArray<real_t>& pred,
+                Workspace* ws,
                 SArray<real_t>* grad) {
+    DIFACTO_TRACE_SCOPE("calc_grad", "loss");
     // p = ...
-    SArray<real_t> p; p.CopyFrom(pred);
-    CHECK_EQ(p.size(), data.size);
-#pragma omp parallel for num_threads(nthreads_)
-    for (size_t i = 0; i < p.size(); ++i) {
-      real_t y = data.label[i] > 0 ? 1 : -1;
-      p[i] = - y / (1 + std::exp(y * p[i]));
-    }
-
-    // grad_w = ...
-    SpMV::TransTimes(data, p, grad, nthreads_, {}, w_pos);
+    FMWorkspace* fm_ws = ToFMWorkspace(ws);
+    SArray<real_t>& p = fm_ws->p;
+    CHECK_EQ(pred.size(), data.size);
+    p.resize(pred.size());
+    ParallelRun(nthreads_, [&](int tid, int nt) {
+        Range rg = Range(0, p.size()).Segment(tid, nt);
+        for (size_t i = rg.begin; i < rg.end; ++i) {
+          real_t y = data.label[i] > 0 ? 1 : -1;
+          p[i] = math::LogitGrad(y, pred[i]);
+          if (data.weight) p[i] *= data.weight[i];
+        }
+      });
 
-    // grad_u = ...
     int V_dim = param_.V_dim;
-    if (V_dim == 0) return;
-    SArray<real_t> V = weights;
-
-    // XXp = (X.*X)'*p
-    auto XX = data;
-    if (XX.value) {
-      CHECK_EQ(XX_.size(), XX.offset[XX.size] - XX.offset[0]);
-      XX.value = XX_.data();
-    }
-    SArray<real_t> XXp(V_pos.size());
-    SpMV::TransTimes(XX, p, &XXp, nthreads_);
-
-    // grad_u -= diag(XXp) * V,
-#pragma omp parallel for num_threads(nthreads_)
-    for (size_t i = 0; i < V_pos.size(); ++i) {
-      int p = V_pos[i];
-      if (p < 0) continue;
-      for (int j = 0; j < V_dim; ++j) {
-        (*grad)[p+j] -= V[p+j] * XXp[i];
-      }
+    if (V_dim == 0) {
+      // grad_w = ...
+      SpMV::TransTimes(data, p, grad, nthreads_, {}, w_pos);
+    } else {
+      // grad_w and grad_u = ...
+      CHECK_EQ(fm_ws->XV.size(), data.size * V_dim);
+      auto backward = V_len.empty() ? backward_ : &FMLoss::Backward<0>;
+      (this->*backward)(data, weights, w_pos, V_pos, V_len, p, fm_ws->XV,
+                        grad);
     }
+  }
 
-    // XV_ = diag(p) * X * V
-    CHECK_EQ(XV_.size(), data.size * V_dim);
-#pragma omp parallel for num_threads(nthreads_)
-    for (size_t i = 0; i < p.size(); ++i) {
-      for (int j = 0; j < V_dim; ++j) XV_[i*V_dim+j] *= p[i];
-    }
+ protected:
+  /** \brief the embedding dimension */
+  int V_dim() const { return param_.V_dim; }
 
-    // grad_u += X' * diag(p) * X * V
-    SpMM::TransTimes(data, XV_, V_dim, grad, nthreads_, {}, V_pos);
-  }
+  /** \brief the scratch buffers of a batch */
+  struct FMWorkspace : public Workspace {
+    /** \brief X*V, computed by Predict and used by CalcGrad */
+    SArray<real_t> XV;
+    /** \brief the loss derivative on predictions */
+    SArray<real_t> p;
+  };
+
+  Workspace* CreateWorkspace() override { return new FMWorkspace(); }
 
  private:
-  SArray<real_t> XV_;
-  SArray<dmlc::real_t> XX_;
+  static FMWorkspace* ToFMWorkspace(Workspace* ws) {
+    return static_cast<FMWorkspace*>(CHECK_NOTNULL(ws));
+  }
+
+  /**
+   * \brief pred += X * w + .5 * sum((X*V).^2 - (X.*X)*(V.*V), 2), and
+   * stores X*V in XV
+   *
+   * a fused per-row kernel, the w and V of a nonzero entry are loaded once
+   * and X.*X, V.*V and (X.*X)*(V.*V) are never materialized. a V shorter
+   * than V_dim only touches its own length, as if padded by zeros. kVDim > 0
+   * fixes V_dim at compile time, which needs V_len empty
+   */
+  template <int kVDim>
+  void Forward(const dmlc::RowBlock<unsigned>& data,
+               const SArray<real_t>& weights,
+               const SArray<int>& w_pos,
+               const SArray<int>& V_pos,
+               const SArray<int>& V_len,
+               SArray<real_t>* XV,
+               SArray<real_t>* pred) {
+    const int V_dim = kVDim ? kVDim : param_.V_dim;
+    real_t const* w = weights.data();
+    int const* wp = w_pos.empty() ? nullptr : w_pos.data();
+    int const* Vp = V_pos.empty() ? nullptr : V_pos.data();
+    int const* Vl = V_len.empty() ? nullptr : V_len.data();
+    ParallelRun(nthreads_, [&](int tid, int nt) {
+        Range rg = Range(0, data.size).Segment(tid, nt);
+        for (size_t i = rg.begin; i < rg.end; ++i) {
+          real_t* xv = XV->data() + i * V_dim;
+          real_t lin = 0, xxvv = 0;
+          for (size_t j = data.offset[i]; j < data.offset[i+1]; ++j) {
+            unsigned k = data.index[j];
+            real_t x = data.value ? data.value[j] : 1;
+            int p = wp ? wp[k] : k;
+            if (p >= 0) lin += x * w[p];
+            p = Vp ? Vp[k] : k * V_dim;
+            if (p < 0) continue;
+            real_t const* V = w + p;
+            int d = kVDim ? kVDim : (Vl ? Vl[k] : V_dim);
+            real_t vv = 0;
+            for (int l = 0; l < d; ++l) {
+              xv[l] += x * V[l];
+              vv += V[l] * V[l];
+            }
+            xxvv += x * x * vv;
+          }
+          real_t s = 0;
+          for (int l = 0; l < V_dim; ++l) s += xv[l] * xv[l];
+          (*pred)[i] += lin + .5 * (s - xxvv);
+        }
+      });
+  }
+
+  /**
+   * \brief grad_w += X' * p, and
+   * grad_u += X' * diag(p) * X * V  - diag((X.*X)'*p) * V
+   *
+   * a fused kernel reusing XV from \ref Forward. the nonzero entries are
+   * column bucketed so that each thread owns its gradient columns, and the
+   * w and V gradients of an entry are updated together. kVDim is the same as
+   * \ref Forward
+   */
+  template <int kVDim>
+  void Backward(const dmlc::RowBlock<unsigned>& data,
+                const SArray<real_t>& weights,
+                const SArray<int>& w_pos,
+                const SArray<int>& V_pos,
+                const SArray<int>& V_len,
+                const SArray<real_t>& p,
+                const SArray<real_t>& XV,
+                SArray<real_t>* grad) {
+    const int V_dim = kVDim ? kVDim : param_.V_dim;
+    real_t const* w = weights.data();
+    real_t* g = grad->data();
+    int const* wp = w_pos.empty() ? nullptr : w_pos.data();
+    int const* Vp = V_pos.empty() ? nullptr : V_pos.data();
+    int const* Vl = V_len.empty() ? nullptr : V_len.data();
+    auto update = [&](size_t i, unsigned k, real_t x) {
+      real_t xp = x * p[i];
+      int q = wp ? wp[k] : k;
+      if (q >= 0) g[q] += xp;
+      q = Vp ? Vp[k] : k * V_dim;
+      if (q < 0) return;
+      real_t const* xv = XV.data() + i * V_dim;
+      real_t const* V = w + q;
+      real_t* gV = g + q;
+      real_t xxp = x * xp;
+      int d = kVDim ? kVDim : (Vl ? Vl[k] : V_dim);
+      for (int l = 0; l < d; ++l) gV[l] += xp * xv[l] - xxp * V[l];
+    };
+
+    size_t ncols = std::max(w_pos.size(), V_pos.size());
+    if (ncols == 0) ncols = grad->size();
+    ColBuckets buckets(data, ncols, nthreads_ * 4, nthreads_);
+    ParallelFor(buckets.size(), nthreads_, [&](int tid, int b) {
+        for (auto e = buckets.begin(b); e != buckets.end(b); ++e) {
+          update(e->row, e->col, e->val);
+        }
+      });
+  }
+
+  template <int kVDim>
+  void SetKernels() {
+    forward_ = &FMLoss::Forward<kVDim>;
+    backward_ = &FMLoss::Backward<kVDim>;
+  }
+
   FMLossParam param_;
+  decltype(&FMLoss::Forward<0>) forward_ = &FMLoss::Forward<0>;
+  decltype(&FMLoss::Backward<0>) backward_ = &FMLoss::Backward<0>;
 };
 
 }  // namespace difacto
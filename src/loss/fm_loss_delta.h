@@ -5,12 +5,20 @@
 #define DIFACTO_LOSS_FM_LOSS_DELTA_H_
 #include <vector>
 #include "difacto/sarray.h"
+#include "common/fast_math.h"
+#include "common/range.h"
+#include "common/task_scheduler.h"
 #include "./fm_loss.h"
+#include "common/tracer.h"
 namespace difacto {
 
 /**
  * \brief the FM loss, different to \ref FMLoss, \ref FMLossDelta is feeded with
  * delta weight, and tranpose of X, each time
+ *
+ * it is used by BCD on a feature block. besides the prediction, X * V of the
+ * rows is kept by the caller and updated by \ref Predict. the weights of a
+ * feature are w and then V, both positions are given
  */
 class FMLossDelta : public FMLoss {
  public:
@@ -20,38 +28,149 @@ class FMLossDelta : public FMLoss {
   virtual ~FMLossDelta() { }
 
   KWArgs Init(const KWArgs& kwargs) override {
-    return kwargs;
+    return FMLoss::Init(kwargs);
   }
 
   /**
+   * \brief the gradients and the diagonal hessians of a feature block
+   *
+   * with p and q the first and second derivatives of the loss on the
+   * predictions, for the j-th feature
+   *
+   *   grad_w = X_j' * p, hess_w = (X_j.*X_j)' * q
+   *   a_k = X_j .* (XV_k - X_j * V_jk), grad_V_jk = a_k' * p, hess_V_jk = (a_k.*a_k)' * q
+   *
    * @param data X', the transpose of X
    * @param param parameters
-   * - param[0], real_t, previous predict
-   * - param[1], int, param[1][i] is the length of the gradient on the i-th feature
-   *   and sum(param[2]) = length(grad)
-   * - param[2], real_t, the prediction (results of \ref Predict)
-   * @param grad output gradient
+   * - param[0], real_t, the prediction
+   * - param[1], real_t, X * V, row major
+   * - param[2], real_t, the weights of the feature block
+   * - param[3], int, the position of w_j in the weights, -1 means skipped
+   * - param[4], int, the position of V_j in the weights, -1 means no V
+   * @param ws not used
+   * @param grad the (gradient, hessian) pairs, the pair of a weight is at
+   * twice its position
    */
   void CalcGrad(const dmlc::RowBlock<unsigned>& data,
                 const std::vector<SArray<char>>& param,
+                Workspace* ws,
                 SArray<real_t>* grad) override {
-    // TODO(mli)
+    DIFACTO_TRACE_SCOPE("calc_grad", "loss");
+    CHECK_EQ(param.size(), 5);
+    SArray<real_t> pred(param[0]), XV(param[1]), weights(param[2]);
+    SArray<int> w_pos(param[3]), V_pos(param[4]);
+    CHECK_EQ(w_pos.size(), data.size);
+    CHECK_EQ(V_pos.size(), data.size);
+    int V_dim = this->V_dim();
+    size_t n = pred.size();
+    CHECK_EQ(XV.size(), n * V_dim);
+
+    // p = ..., q = ...
+    CHECK_NOTNULL(data.label);
+    std::vector<real_t> p(n), q(n);
+    for (size_t i = 0; i < n; ++i) {
+      real_t y = data.label[i] > 0 ? 1 : -1;
+      p[i] = math::LogitGrad(y, pred[i]);
+      q[i] = - p[i] * (y + p[i]);
+    }
+
+    // each feature writes its own pairs
+    real_t* g = grad->data();
+    ParallelRun(nthreads_, [&](int tid, int nt) {
+        Range rg = Range(0, data.size).Segment(tid, nt);
+        std::vector<real_t> gv(V_dim * 2);
+        for (size_t j = rg.begin; j < rg.end; ++j) {
+          int wp = w_pos[j];
+          if (wp < 0) continue;
+          int vp = V_pos[j];
+          real_t const* V = vp < 0 ? nullptr : weights.data() + vp;
+          real_t gw = 0, hw = 0;
+          std::fill(gv.begin(), gv.end(), 0);
+          for (size_t e = data.offset[j]; e < data.offset[j+1]; ++e) {
+            unsigned i = data.index[e];
+            real_t x = data.value ? data.value[e] : 1;
+            gw += x * p[i];
+            hw += x * x * q[i];
+            if (!V) continue;
+            real_t const* xv = XV.data() + i * V_dim;
+            for (int k = 0; k < V_dim; ++k) {
+              real_t a = x * (xv[k] - x * V[k]);
+              gv[k*2] += a * p[i];
+              gv[k*2+1] += a * a * q[i];
+            }
+          }
+          g[wp*2] += gw;
+          g[wp*2+1] += hw;
+          if (!V) continue;
+          for (int k = 0; k < V_dim * 2; ++k) g[vp*2+k] += gv[k];
+        }
+      });
   }
 
   /**
+   * \brief update the prediction and X * V given the changes of the weights
+   *
+   *   pred += X * dw + .5 * sum((XV + X*dV).^2 - XV.^2 - (X.*X)*((V+dV).^2 - V.^2), 2)
+   *   XV += X * dV
+   *
    * @param data X', the transpose of X
    * @param param parameters
-   * - param[0], real_t, previous predict
-   * - param[1], real_t, delta weight, namely new_w - old_w
-   * - param[2], int, param[2][i] is the length of delta_w[i].
-   *   and sum(param[2]) = length(delta_w)
-   * @param pred output prediction, it may overwrite param[0]
+   * - param[0], real_t, the changes of the weights
+   * - param[1], int, the position of w_j, -1 means skipped
+   * - param[2], int, the position of V_j, -1 means no V
+   * - param[3], real_t, the weights before the changes
+   * - param[4], real_t, X * V, row major, updated in place
+   * @param ws not used
+   * @param pred the prediction, updated in place
    */
   void Predict(const dmlc::RowBlock<unsigned>& data,
                const std::vector<SArray<char>>& param,
+               Workspace* ws,
                SArray<real_t>* pred) override {
-    *CHECK_NOTNULL(pred) = param[0];
-    FMLoss::Predict(data, {param[1], param[2]}, pred);
+    DIFACTO_TRACE_SCOPE("predict", "loss");
+    CHECK_EQ(param.size(), 5);
+    SArray<real_t> delta_w(param[0]), weights(param[3]), XV(param[4]);
+    SArray<int> w_pos(param[1]), V_pos(param[2]);
+    CHECK_EQ(w_pos.size(), data.size);
+    CHECK_EQ(V_pos.size(), data.size);
+    int V_dim = this->V_dim();
+    size_t n = CHECK_NOTNULL(pred)->size();
+    CHECK_EQ(XV.size(), n * V_dim);
+
+    // u = X * dV, s = (X.*X)*((V+dV).^2 - V.^2)
+    std::vector<real_t> u(n * V_dim), s(n);
+    real_t* y = pred->data();
+    for (size_t j = 0; j < data.size; ++j) {
+      int wp = w_pos[j];
+      if (wp < 0) continue;
+      real_t dw = delta_w[wp];
+      int vp = V_pos[j];
+      real_t const* dV = vp < 0 ? nullptr : delta_w.data() + vp;
+      real_t dvv = 0;
+      if (dV) {
+        real_t const* V = weights.data() + vp;
+        for (int k = 0; k < V_dim; ++k) dvv += dV[k] * (2 * V[k] + dV[k]);
+      }
+      for (size_t e = data.offset[j]; e < data.offset[j+1]; ++e) {
+        unsigned i = data.index[e];
+        real_t x = data.value ? data.value[e] : 1;
+        y[i] += x * dw;
+        if (!dV) continue;
+        real_t* ui = u.data() + i * V_dim;
+        for (int k = 0; k < V_dim; ++k) ui[k] += x * dV[k];
+        s[i] += x * x * dvv;
+      }
+    }
+    for (size_t i = 0; i < n; ++i) {
+      real_t* xv = XV.data() + i * V_dim;
+      real_t const* ui = u.data() + i * V_dim;
+      real_t sum = 0;
+      for (int k = 0; k < V_dim; ++k) {
+        sum += xv[k] * ui[k] + .5 * ui[k] * ui[k];
+        xv[k] += ui[k];
+      }
+      y[i] += sum - .5 * s[i];
+    }
   }
 };
 }  // namespace difacto
@@ -3,13 +3,18 @@
  */
 #ifndef DIFACTO_LOSS_LOGIT_LOSS_H_
 #define DIFACTO_LOSS_LOGIT_LOSS_H_
+#include <algorithm>
 #include <vector>
 #include <cmath>
 #include "difacto/base.h"
 #include "difacto/loss.h"
 #include "dmlc/data.h"
-#include "dmlc/omp.h"
+#include "common/buffer_pool.h"
+#include "common/range.h"
+#include "common/task_scheduler.h"
 #include "common/spmv.h"
+#include "common/fast_math.h"
+#include "common/tracer.h"
 namespace difacto {
 
 /**
@@ -40,7 +45,9 @@ class LogitLoss : public Loss {
    */
   void Predict(const dmlc::RowBlock<unsigned>& data,
                const std::vector<SArray<char>>& param,
+               Workspace* ws,
                SArray<real_t>* pred) override {
+    DIFACTO_TRACE_SCOPE("predict", "loss");
     int psize = param.size();
     CHECK_GE(psize, 1); CHECK_LE(psize, 2);
     SArray<real_t> w(param[0]);
@@ -51,7 +58,7 @@ class LogitLoss : public Loss {
   /*!
    * \brief compute the gradients
    *
-   *   p = - y ./ (1 + exp (y .* pred));
+   *   p = - y ./ (1 + exp (y .* pred)) .* weight;
    *   grad += X' * p;
    *
    * @param data the data X
@@ -62,19 +69,26 @@ class LogitLoss : public Loss {
    */
   void CalcGrad(const dmlc::RowBlock<unsigned>& data,
                 const std::vector<SArray<char>>& param,
+                Workspace* ws,
                 SArray<real_t>* grad) override {
+    DIFACTO_TRACE_SCOPE("calc_grad", "loss");
     int psize = param.size();
     CHECK_GE(psize, 1);
     CHECK_LE(psize, 2);
-    SArray<real_t> p; p.CopyFrom(SArray<real_t>(param[0]));
+    SArray<real_t> pred(param[0]);
+    SArray<real_t> p = BufferPool::Get()->New<real_t>(pred.size());
+    std::copy(pred.begin(), pred.end(), p.begin());
     SArray<int> grad_pos = psize == 2 ? SArray<int>(param[1]) : SArray<int>();
     // p = ...
     CHECK_NOTNULL(data.label);
-#pragma omp parallel for num_threads(nthreads_)
-    for (size_t i = 0; i < p.size(); ++i) {
-      real_t y = data.label[i] > 0 ? 1 : -1;
-      p[i] = - y / (1 + std::exp(y * p[i]));
-    }
+    ParallelRun(nthreads_, [&](int tid, int nt) {
+        Range rg = Range(0, p.size()).Segment(tid, nt);
+        for (size_t i = rg.begin; i < rg.end; ++i) {
+          real_t y = data.label[i] > 0 ? 1 : -1;
+          p[i] = math::LogitGrad(y, p[i]);
+          if (data.weight) p[i] *= data.weight[i];
+        }
+      });
 
     // grad += ...
     SpMV::TransTimes(data, p, grad, nthreads_, {}, grad_pos);
@@ -9,6 +9,9 @@
 #include "difacto/sarray.h"
 #include "common/range.h"
 #include "common/spmv.h"
+#include "common/packed_block.h"
+#include "common/fast_math.h"
+#include "common/tracer.h"
 #include "dmlc/omp.h"
 #include "dmlc/logging.h"
 namespace difacto {
@@ -62,7 +65,9 @@ class LogitLossDelta : public Loss {
    */
   void Predict(const dmlc::RowBlock<unsigned>& data,
                const std::vector<SArray<char>>& param,
+               Workspace* ws,
                SArray<real_t>* pred) override {
+    DIFACTO_TRACE_SCOPE("predict", "loss");
     int psize = param.size();
     CHECK_GE(psize, 1); CHECK_LE(psize, 2);
     SArray<real_t> delta_w(param[0]);
@@ -89,7 +94,44 @@ class LogitLossDelta : public Loss {
    */
   void CalcGrad(const dmlc::RowBlock<unsigned>& data,
                 const std::vector<SArray<char>>& param,
+                Workspace* ws,
                 SArray<real_t>* grad) override {
+    DIFACTO_TRACE_SCOPE("calc_grad", "loss");
+    CalcGrad(data, data.label, param, grad);
+  }
+
+  /**
+   * \brief pred += X * delta_w, where X' is packed
+   * \sa Predict
+   */
+  void Predict(const PackedBlock& data,
+               const std::vector<SArray<char>>& param,
+               SArray<real_t>* pred) {
+    DIFACTO_TRACE_SCOPE("predict", "loss");
+    int psize = param.size();
+    CHECK_GE(psize, 1); CHECK_LE(psize, 2);
+    SArray<real_t> delta_w(param[0]);
+    SArray<int> w_pos = psize == 2 ? SArray<int>(param[1]) : SArray<int>();
+    SpMV::TransTimes(data, delta_w, pred, nthreads_, w_pos, {});
+  }
+
+  /**
+   * \brief compute the gradients, where X' is packed
+   * \sa CalcGrad
+   */
+  void CalcGrad(const PackedBlock& data,
+                const std::vector<SArray<char>>& param,
+                SArray<real_t>* grad) {
+    DIFACTO_TRACE_SCOPE("calc_grad", "loss");
+    CalcGrad(data, data.label.data(), param, grad);
+  }
+
+ private:
+  template <typename Mat>
+  void CalcGrad(const Mat& data,
+                real_t const* label,
+                const std::vector<SArray<char>>& param,
+                SArray<real_t>* grad) {
     int psize = param.size();
     CHECK_GE(psize, 1);
     CHECK_LE(psize, 3);
@@ -97,11 +139,11 @@ class LogitLossDelta : public Loss {
 
     // p = ...
     SArray<real_t> p; p.CopyFrom(SArray<real_t>(param[0]));
-    CHECK_NOTNULL(data.label);
-#pragma omp parallel for num_threads(nthreads_)
+    CHECK_NOTNULL(label);
+#pragma omp parallel for simd num_threads(nthreads_)
     for (size_t i = 0; i < p.size(); ++i) {
-      real_t y = data.label[i] > 0 ? 1 : -1;
-      p[i] = - y / (1 + std::exp(y * p[i]));
+      real_t y = label[i] > 0 ? 1 : -1;
+      p[i] = math::LogitGrad(y, p[i]);
     }
 
     // grad = ...
@@ -116,26 +158,15 @@ class LogitLossDelta : public Loss {
       if (h_pos[i] >= 0) ++h_pos[i];
     }
 
-    // compute X .* X
-    dmlc::RowBlock<unsigned> XX = data;
-    SArray<dmlc::real_t> xx_value;
-    if (data.value) {
-      xx_value.resize(data.offset[data.size]);
-      for (size_t i = data.offset[0]; i < data.offset[data.size]; ++i) {
-        xx_value[i] = data.value[i] * data.value[i];
-      }
-      XX.value = xx_value.data();
-    }
-
     // p = tau * (1 - tau)
 #pragma omp parallel for num_threads(nthreads_)
     for (size_t i = 0; i < p.size(); ++i) {
-      real_t y = data.label[i] > 0 ? 1 : -1;
+      real_t y = label[i] > 0 ? 1 : -1;
       p[i] = - p[i] * (y + p[i]);
     }
 
     if (param_.compute_hession == 1) {
-      SpMV::Times(XX, p, grad, nthreads_, {}, h_pos);
+      SquareTimes(data, p, h_pos, grad);
     } else if (param_.compute_hession == 2) {
       LOG(FATAL) << "...";
       CHECK_EQ(psize, 3);
@@ -146,7 +177,36 @@ class LogitLossDelta : public Loss {
     }
   }
 
- private:
+  /**
+   * \brief grad += (X .* X)' * p
+   */
+  void SquareTimes(const dmlc::RowBlock<unsigned>& data,
+                   const SArray<real_t>& p,
+                   const SArray<int>& h_pos,
+                   SArray<real_t>* grad) {
+    // compute X .* X
+    dmlc::RowBlock<unsigned> XX = data;
+    SArray<dmlc::real_t> xx_value;
+    if (data.value) {
+      xx_value.resize(data.offset[data.size]);
+      for (size_t i = data.offset[0]; i < data.offset[data.size]; ++i) {
+        xx_value[i] = data.value[i] * data.value[i];
+      }
+      XX.value = xx_value.data();
+    }
+    SpMV::Times(XX, p, grad, nthreads_, {}, h_pos);
+  }
+
+  /**
+   * \brief grad += (X .* X)' * p, the squares are computed in the kernel
+   */
+  void SquareTimes(const PackedBlock& data,
+                   const SArray<real_t>& p,
+                   const SArray<int>& h_pos,
+                   SArray<real_t>* grad) {
+    SpMV::Times(data, p, grad, nthreads_, {}, h_pos, true);
+  }
+
   LogitLossDeltaParam param_;
 };
 
@@ -1,23 +1,34 @@
 /**
  * Copyright (c) 2015 by Contributors
  */
+#include <vector>
 #include "difacto/loss.h"
 #include "./fm_loss.h"
+#include "./fm_loss_delta.h"
+#include "./ffm_loss.h"
 #include "./logit_loss_delta.h"
 #include "./logit_loss.h"
+#include "common/fast_math.h"
+#include "common/range.h"
+#include "common/task_scheduler.h"
 namespace difacto {
 
 DMLC_REGISTER_PARAMETER(FMLossParam);
+DMLC_REGISTER_PARAMETER(FFMLossParam);
 DMLC_REGISTER_PARAMETER(LogitLossDeltaParam);
 
 Loss* Loss::Create(const std::string& type, int nthreads) {
   Loss* loss = nullptr;
   if (type == "fm") {
     loss = new FMLoss();
+  } else if (type == "ffm") {
+    loss = new FFMLoss();
   } else if (type == "logit") {
     loss = new LogitLoss();
   } else if (type == "logit_delta") {
     loss = new LogitLossDelta();
+  } else if (type == "fm_delta") {
+    loss = new FMLossDelta();
   } else {
     LOG(FATAL) << "unknown loss type";
   }
@@ -25,4 +36,20 @@ Loss* Loss::Create(const std::string& type, int nthreads) {
   return loss;
 }
 
+real_t Loss::Evaluate(dmlc::real_t const* label,
+                      const SArray<real_t>& pred,
+                      dmlc::real_t const* weight) const {
+  std::vector<real_t> objv(nthreads_);
+  ParallelRun(nthreads_, [&](int tid, int nt) {
+      Range rg = Range(0, pred.size()).Segment(tid, nt);
+      for (size_t i = rg.begin; i < rg.end; ++i) {
+        real_t y = label[i] > 0 ? 1 : -1;
+        objv[tid] += math::LogitObjv(y, pred[i]) * (weight ? weight[i] : 1);
+      }
+    });
+  real_t sum = 0;
+  for (real_t v : objv) sum += v;
+  return sum;
+}
+
 }  // namespace difacto
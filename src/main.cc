@@ -5,6 +5,9 @@
 #include "common/arg_parser.h"
 #include "dmlc/parameter.h"
 #include "reader/converter.h"
+#include "predict/predictor.h"
+#include "predict/compactor.h"
+#include "ps/ps.h"
 namespace difacto {
 struct DifactoParam : public dmlc::Parameter<DifactoParam> {
   /**
@@ -12,6 +15,7 @@ struct DifactoParam : public dmlc::Parameter<DifactoParam> {
    * - train: train a model, which is the default
    * - predict: predict by using a trained model
    * - convert: convert data from one format into another
+   * - compact: prune and quantize a trained model for serving
    */
   std::string task;
   /** \brief the learner's type, required for a training task */
@@ -48,6 +52,9 @@ int main(int argc, char *argv[]) {
   DifactoParam param;
   auto kwargs_remain = param.InitAllowUnknown(parser.GetKWArgs());
 
+  // start the communication if launched by the tracker
+  if (IsDistributed()) ps::Start();
+
   // run
   if (param.task == "train") {
     Learner* learner = Learner::Create(param.learner);
@@ -59,9 +66,17 @@ int main(int argc, char *argv[]) {
     WarnUnknownKWArgs(param, converter.Init(kwargs_remain));
     converter.Run();
   } else if (param.task == "predict") {
-    LOG(FATAL) << "TODO";
+    Predictor predictor;
+    WarnUnknownKWArgs(param, predictor.Init(kwargs_remain));
+    predictor.Run();
+  } else if (param.task == "compact") {
+    Compactor compactor;
+    WarnUnknownKWArgs(param, compactor.Init(kwargs_remain));
+    compactor.Run();
   } else {
     LOG(FATAL) << "unknown task: " << param.task;
   }
+
+  if (IsDistributed()) ps::Finalize();
   return 0;
 }
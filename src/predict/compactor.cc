@@ -0,0 +1,100 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ */
+#include "./compactor.h"
+#include <cmath>
+#include <memory>
+#include <vector>
+#include "dmlc/io.h"
+#include "difacto/scorer.h"
+#include "reader/reader.h"
+#include "loss/bin_class_metric.h"
+namespace difacto {
+
+DMLC_REGISTER_PARAMETER(CompactorParam);
+
+ModelFile Compactor::Prune(const ModelFile& model, real_t prune_w,
+                           real_t prune_V) {
+  ModelFile out;
+  int V_dim = out.V_dim = model.V_dim;
+  for (size_t i = 0; i < model.feaids.size(); ++i) {
+    real_t const* V = model.GetV(i);
+    if (V) {
+      real_t norm = 0;
+      for (int j = 0; j < V_dim; ++j) norm += V[j] * V[j];
+      if (std::sqrt(norm) < prune_V) V = nullptr;
+    }
+    real_t w = model.w[i];
+    if (!V && std::fabs(w) <= prune_w) continue;
+    out.feaids.push_back(model.feaids[i]);
+    out.w.push_back(w);
+    if (V_dim == 0) continue;
+    if (V) {
+      out.V_idx.push_back(out.V.size() / V_dim);
+      for (int j = 0; j < V_dim; ++j) out.V.push_back(V[j]);
+    } else {
+      out.V_idx.push_back(-1);
+    }
+  }
+  return out;
+}
+
+void Compactor::Run() {
+  ModelFile model;
+  {
+    std::unique_ptr<dmlc::Stream> fi(
+        dmlc::Stream::Create(param_.model_in.c_str(), "r"));
+    model.Load(fi.get(), true);
+  }
+  size_t bytes_in = model.NumBytes();
+  size_t num_V_in = model.V_dim > 0 ? model.V.size() / model.V_dim : 0;
+
+  ModelFile out = Prune(model, param_.prune_w, param_.prune_V);
+  size_t num_V_out = out.V_dim > 0 ? out.V.size() / out.V_dim : 0;
+  if (param_.V_int8) {
+    out.Quantize();
+    out.V.clear();
+  }
+  {
+    std::unique_ptr<dmlc::Stream> fo(
+        dmlc::Stream::Create(param_.model_out.c_str(), "w"));
+    out.Save(fo.get());
+  }
+  LOG(INFO) << "compacted " << param_.model_in << " into "
+            << param_.model_out;
+  LOG(INFO) << " - features: " << model.feaids.size() << " -> "
+            << out.feaids.size() << ", V: " << num_V_in << " -> " << num_V_out;
+  LOG(INFO) << " - file: " << bytes_in << " -> " << out.NumBytes()
+            << " bytes";
+  if (param_.data_val.size()) {
+    Scorer before, after;
+    CHECK(before.Load(param_.model_in));
+    CHECK(after.Load(param_.model_out));
+    LOG(INFO) << " - serving memory: " << before.MemBytes() << " -> "
+              << after.MemBytes() << " bytes";
+    LOG(INFO) << " - validation AUC: " << ValAUC(param_.model_in) << " -> "
+              << ValAUC(param_.model_out);
+  }
+}
+
+real_t Compactor::ValAUC(const std::string& model) {
+  Scorer scorer;
+  CHECK(scorer.Load(model)) << "failed to load " << model;
+  Reader reader(param_.data_val, param_.data_format, 0, 1, 64 << 20);
+  std::vector<dmlc::real_t> label;
+  std::vector<real_t> pred;
+  while (reader.Next()) {
+    const auto& blk = reader.Value();
+    for (size_t i = 0; i < blk.size; ++i) {
+      size_t begin = blk.offset[i], nnz = blk.offset[i+1] - begin;
+      label.push_back(blk.label[i]);
+      pred.push_back(scorer.Predict(
+          blk.index + begin, blk.value ? blk.value + begin : nullptr, nnz));
+    }
+  }
+  // AUC() is weighted by the number of examples
+  BinClassMetric metric(label.data(), pred.data(), label.size());
+  return label.empty() ? 0 : metric.AUC() / label.size();
+}
+
+}  // namespace difacto
@@ -0,0 +1,70 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_PREDICT_COMPACTOR_H_
+#define DIFACTO_PREDICT_COMPACTOR_H_
+#include <string>
+#include "dmlc/parameter.h"
+#include "difacto/base.h"
+#include "common/model_file.h"
+namespace difacto {
+
+struct CompactorParam : public dmlc::Parameter<CompactorParam> {
+  /** \brief the model saved by a training task */
+  std::string model_in;
+  /** \brief the compact model for serving */
+  std::string model_out;
+  /** \brief drop a feature without V if |w| <= prune_w */
+  real_t prune_w;
+  /** \brief drop the V of a feature if its L2 norm < prune_V */
+  real_t prune_V;
+  /** \brief store V in int8 with a scale per feature if 1 */
+  int V_int8;
+  /**
+   * \brief the optional validation data, the AUCs before and after the
+   * compaction are reported
+   */
+  std::string data_val;
+  /** \brief the data format. default is libsvm */
+  std::string data_format;
+  DMLC_DECLARE_PARAMETER(CompactorParam) {
+    DMLC_DECLARE_FIELD(model_in);
+    DMLC_DECLARE_FIELD(model_out);
+    DMLC_DECLARE_FIELD(prune_w).set_lower_bound(0).set_default(0);
+    DMLC_DECLARE_FIELD(prune_V).set_lower_bound(0).set_default(0);
+    DMLC_DECLARE_FIELD(V_int8).set_default(0);
+    DMLC_DECLARE_FIELD(data_val).set_default("");
+    DMLC_DECLARE_FIELD(data_format).set_default("libsvm");
+  };
+};
+
+/**
+ * \brief compact a trained model for serving
+ *
+ * the aux data are dropped, then the negligible entries are pruned, namely
+ * the V with a small norm and the features left with a small w and no V.
+ * V can be quantized into int8 as well. the sizes, and the validation AUCs by
+ * \ref Scorer if data_val is given, are reported to pick the tradeoff
+ */
+class Compactor {
+ public:
+  KWArgs Init(const KWArgs& kwargs) {
+    return param_.InitAllowUnknown(kwargs);
+  }
+
+  /** \brief compact model_in into model_out */
+  void Run();
+
+  /** \brief returns the pruned model of a model */
+  static ModelFile Prune(const ModelFile& model, real_t prune_w,
+                         real_t prune_V);
+
+ private:
+  /** \brief returns the AUC of a model on data_val */
+  real_t ValAUC(const std::string& model);
+
+  CompactorParam param_;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_PREDICT_COMPACTOR_H_
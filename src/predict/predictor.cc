@@ -0,0 +1,190 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ */
+#include "./predictor.h"
+#include <stdio.h>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include "dmlc/timer.h"
+#include "data/localizer.h"
+#include "common/fast_math.h"
+#include "common/thread_pool.h"
+namespace difacto {
+
+DMLC_REGISTER_PARAMETER(PredictorParam);
+
+void Predictor::Run() {
+  double start = dmlc::GetTime();
+  Reader reader(param_.data_in, param_.data_format, param_.part_idx,
+                param_.num_parts, param_.chunk_size * 1024 * 1024,
+                param_.num_parse_threads);
+  auto outfile = param_.pred_out;
+  if (param_.num_parts > 1) {
+    outfile += "_part-" + std::to_string(param_.part_idx);
+  }
+  std::unique_ptr<dmlc::Stream> out(
+      CHECK_NOTNULL(dmlc::Stream::Create(outfile.c_str(), "wb")));
+  LOG(INFO) << "predicting " << param_.data_in << " into " << outfile;
+
+  // the chunk with sequence number k uses slots[k % nslots], whose buffers
+  // are reused
+  int nslots = param_.num_threads * 2;
+  std::vector<Slot> slots(nslots);
+  size_t nread = 0, nwritten = 0;
+  {
+    ThreadPool pool(param_.num_threads);
+    while (reader.Next()) {
+      Slot* slot = &slots[nread % nslots];
+      if (nread - nwritten == static_cast<size_t>(nslots)) {
+        Write(&slots[nwritten++ % nslots], out.get());
+      }
+      slot->blk.Clear();
+      slot->blk.Push(reader.Value());
+      slot->done = false;
+      ++nread;
+      pool.Add([this, slot](int tid) {
+          Predict(slot);
+          std::lock_guard<std::mutex> lk(mu_);
+          slot->done = true;
+          cond_.notify_all();
+        });
+      while (nwritten < nread && IsDone(slots[nwritten % nslots])) {
+        Write(&slots[nwritten++ % nslots], out.get());
+      }
+    }
+  }
+  while (nwritten < nread) Write(&slots[nwritten++ % nslots], out.get());
+  double sec = dmlc::GetTime() - start;
+  LOG(INFO) << "done. predicted " << nrows_ << " examples in " << sec
+            << " sec, " << nrows_ / std::max(sec, 1e-6) << " examples/sec";
+}
+
+void Predictor::LoadModel() {
+  if (model_.Map(param_.model_in)) return;
+  std::unique_ptr<dmlc::Stream> fi(
+      dmlc::Stream::Create(param_.model_in.c_str(), "r", true));
+  if (fi) {
+    model_.Load(fi.get(), false);
+    return;
+  }
+  ModelFile all;
+  for (int i = 0; ; ++i) {
+    auto name = param_.model_in + "_part-" + std::to_string(i);
+    fi.reset(dmlc::Stream::Create(name.c_str(), "r", true));
+    if (!fi) {
+      CHECK_GT(i, 0) << "failed to open " << param_.model_in;
+      break;
+    }
+    ModelFile part;
+    part.Load(fi.get(), false);
+    CHECK_EQ(part.hash_capacity, 0) << name
+        << " is hashed, which cannot be merged with the other parts";
+    if (i == 0) all.V_dim = part.V_dim;
+    CHECK_EQ(all.V_dim, part.V_dim) << name;
+    if (part.feaids.empty()) continue;
+    CHECK(all.feaids.empty() || all.feaids.back() < part.feaids.front())
+        << name << " overlaps with the previous parts";
+    int num_V = all.V_dim > 0 ? all.V.size() / all.V_dim : 0;
+    for (size_t j = 0; j < part.feaids.size(); ++j) {
+      all.feaids.push_back(part.feaids[j]);
+      all.w.push_back(part.w[j]);
+      if (all.V_dim > 0) {
+        int k = part.V_idx[j];
+        all.V_idx.push_back(k < 0 ? -1 : k + num_V);
+      }
+    }
+    for (real_t v : part.V) all.V.push_back(v);
+  }
+  model_ = all;
+}
+
+void Predictor::Predict(Slot* slot) {
+  auto blk = slot->blk.GetBlock();
+  dmlc::data::RowBlockContainer<unsigned> data;
+  std::vector<feaid_t> feaids;
+  Localizer(-1, 1, Localizer::kHash).Compact(blk, &data, &feaids);
+
+  // the weights of the features, a feature not in the model has w = 0. the
+  // feaids are sorted, but their slots are not if the model is hashed
+  int V_dim = model_.V_dim;
+  uint32_t capacity = model_.hash_capacity;
+  size_t n = feaids.size();
+  SArray<real_t> weights;
+  SArray<int> w_pos(V_dim > 0 ? n : 0), V_pos(V_dim > 0 ? n : 0);
+  const feaid_t* begin = model_.feaids.data();
+  const feaid_t* end = begin + model_.feaids.size();
+  const feaid_t* it = begin;
+  for (size_t i = 0; i < n; ++i) {
+    feaid_t id = feaids[i];
+    if (capacity) {
+      id = ModelFile::HashSlot(id, capacity);
+      it = begin;
+    }
+    it = std::lower_bound(it, end, id);
+    bool found = it != end && *it == id;
+    size_t k = it - begin;
+    if (V_dim > 0) w_pos[i] = weights.size();
+    weights.push_back(found ? model_.w[k] : 0);
+    if (V_dim == 0) continue;
+    real_t const* V = found ? model_.GetV(k) : nullptr;
+    if (V) {
+      V_pos[i] = weights.size();
+      for (int j = 0; j < V_dim; ++j) weights.push_back(V[j]);
+    } else {
+      V_pos[i] = -1;
+    }
+  }
+
+  auto local = data.GetBlock();
+  SArray<real_t> pred(local.size);
+  std::vector<SArray<char>> inputs = {
+    SArray<char>(weights), SArray<char>(w_pos), SArray<char>(V_pos)};
+  if (ffm_) {
+    SArray<feaid_t> ids; ids.CopyFrom(feaids.data(), n);
+    SArray<int> fields;
+    ffm_->GetFields(ids, &fields);
+    inputs.push_back(SArray<char>(fields));
+  }
+  Loss::Workspace* ws = loss_->GetWorkspace();
+  loss_->Predict(local, inputs, ws, &pred);
+  loss_->ReleaseWorkspace(ws);
+  if (param_.neg_sampling < 1) {
+    // the odds of the sampled data are the ones of all over neg_sampling
+    real_t shift = log(param_.neg_sampling);
+    for (auto& p : pred) p += shift;
+  }
+  if (param_.pred_prob) {
+    for (auto& p : pred) p = 1 / (1 + math::Exp(-p));
+  }
+
+  // format
+  std::string& str = slot->out;
+  str.clear();
+  if (param_.pred_format == "binary") {
+    str.append(reinterpret_cast<const char*>(pred.data()),
+               pred.size() * sizeof(real_t));
+    return;
+  }
+  bool label = param_.pred_format == "label";
+  char buf[64];
+  for (size_t i = 0; i < pred.size(); ++i) {
+    if (label) {
+      snprintf(buf, sizeof(buf), "%g\t%g\n", blk.label[i], pred[i]);
+    } else {
+      snprintf(buf, sizeof(buf), "%g\n", pred[i]);
+    }
+    str += buf;
+  }
+}
+
+void Predictor::Write(Slot* slot, dmlc::Stream* out) {
+  {
+    std::unique_lock<std::mutex> lk(mu_);
+    cond_.wait(lk, [slot]{ return slot->done; });
+  }
+  out->Write(slot->out.data(), slot->out.size());
+  nrows_ += slot->blk.Size();
+}
+
+}  // namespace difacto
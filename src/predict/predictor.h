@@ -0,0 +1,143 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_PREDICT_PREDICTOR_H_
+#define DIFACTO_PREDICT_PREDICTOR_H_
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "dmlc/parameter.h"
+#include "dmlc/io.h"
+#include "difacto/loss.h"
+#include "loss/ffm_loss.h"
+#include "reader/reader.h"
+#include "common/model_file.h"
+namespace difacto {
+
+struct PredictorParam : public dmlc::Parameter<PredictorParam> {
+  /** \brief The input data, either a filename or a directory. */
+  std::string data_in;
+  /** \brief the data format. default is libsvm */
+  std::string data_format;
+  /**
+   * \brief the model saved by a training task. the parts of a distributed
+   * model, model_in_part-0, model_in_part-1, ..., are loaded together
+   */
+  std::string model_in;
+  /** \brief the output of the scores */
+  std::string pred_out;
+  /**
+   * \brief the output format
+   * - text: a score per line, which is the default
+   * - label: the label and the score separated by a tab per line
+   * - binary: the scores as 32-bit floats
+   */
+  std::string pred_format;
+  /** \brief output the probability if 1, otherwise the raw margin */
+  int pred_prob;
+  /**
+   * \brief the neg_sampling of a model trained with neg_sampling_weight = 0,
+   * whose margins are shifted by log(neg_sampling) to calibrate the
+   * probabilities. in default 1, no change
+   */
+  float neg_sampling;
+  /** \brief type of loss, defaut is fm */
+  std::string loss;
+  /**
+   * \brief only predict the part_idx-th of the num_parts parts of data_in,
+   * the part index is appended to pred_out if num_parts > 1
+   */
+  int num_parts;
+  int part_idx;
+  /** \brief input chunk size in MB */
+  real_t chunk_size;
+  /** \brief the number of threads to predict the chunks */
+  int num_threads;
+  /** \brief the number of threads to parse a text data chunk */
+  int num_parse_threads;
+  DMLC_DECLARE_PARAMETER(PredictorParam) {
+    DMLC_DECLARE_FIELD(data_in);
+    DMLC_DECLARE_FIELD(data_format).set_default("libsvm");
+    DMLC_DECLARE_FIELD(model_in);
+    DMLC_DECLARE_FIELD(pred_out);
+    DMLC_DECLARE_FIELD(pred_format).set_default("text");
+    DMLC_DECLARE_FIELD(pred_prob).set_default(1);
+    DMLC_DECLARE_FIELD(neg_sampling).set_range(1e-6, 1).set_default(1);
+    DMLC_DECLARE_FIELD(loss).set_default("fm");
+    DMLC_DECLARE_FIELD(num_parts).set_default(1).set_lower_bound(1);
+    DMLC_DECLARE_FIELD(part_idx).set_default(0).set_lower_bound(0);
+    DMLC_DECLARE_FIELD(chunk_size).set_default(64);
+    DMLC_DECLARE_FIELD(num_threads).set_default(2).set_range(1, 64);
+    DMLC_DECLARE_FIELD(num_parse_threads).set_default(2).set_range(1, 64);
+  };
+};
+
+/**
+ * \brief predict the data by a trained model
+ *
+ * the chunks read are localized and predicted by a thread pool with the
+ * kernels of the loss used by training, and then the scores are written in
+ * order by this thread
+ */
+class Predictor {
+ public:
+  Predictor() { }
+  ~Predictor() { delete loss_; }
+
+  KWArgs Init(const KWArgs& kwargs) {
+    auto remain = param_.InitAllowUnknown(kwargs);
+    CHECK_LT(param_.part_idx, param_.num_parts);
+    const auto& fmt = param_.pred_format;
+    CHECK(fmt == "text" || fmt == "label" || fmt == "binary")
+        << "unknown pred_format: " << fmt;
+    LoadModel();
+    // each chunk is predicted by a single thread
+    loss_ = Loss::Create(param_.loss, 1);
+    remain.push_back(std::make_pair("V_dim", std::to_string(model_.V_dim)));
+    remain = loss_->Init(remain);
+    ffm_ = dynamic_cast<FFMLoss*>(loss_);
+    return remain;
+  }
+
+  /** \brief predict data_in and write the scores into pred_out */
+  void Run();
+
+ private:
+  /** \brief a chunk being predicted */
+  struct Slot {
+    dmlc::data::RowBlockContainer<feaid_t> blk;
+    /** \brief the formatted scores */
+    std::string out;
+    bool done = true;
+  };
+
+  bool IsDone(const Slot& slot) {
+    std::lock_guard<std::mutex> lk(mu_);
+    return slot.done;
+  }
+
+  /**
+   * \brief load model_in, or concatenate its parts if it does not exist. the
+   * servers hold increasing key ranges, so the parts are still sorted
+   */
+  void LoadModel();
+
+  /** \brief predict slot->blk into slot->out, thread safe */
+  void Predict(Slot* slot);
+
+  /** \brief wait until the slot is predicted, then write it */
+  void Write(Slot* slot, dmlc::Stream* out);
+
+  PredictorParam param_;
+  ModelFile model_;
+  Loss* loss_ = nullptr;
+  /** \brief loss_ if it is ffm */
+  FFMLoss* ffm_ = nullptr;
+  std::mutex mu_;
+  std::condition_variable cond_;
+  size_t nrows_ = 0;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_PREDICT_PREDICTOR_H_
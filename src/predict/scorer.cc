@@ -0,0 +1,118 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ */
+#include "difacto/scorer.h"
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include "dmlc/io.h"
+#include "common/hash.h"
+#include "common/model_file.h"
+namespace difacto {
+
+bool Scorer::Load(const std::string& filename) {
+  ModelFile model;
+  if (!model.Map(filename, false)) {
+    std::unique_ptr<dmlc::Stream> fi(
+        dmlc::Stream::Create(filename.c_str(), "r", true));
+    if (!fi) return false;
+    model.Load(fi.get(), false, false);
+  }
+  V_dim_ = model.V_dim;
+  V_int8_ = model.quantized();
+  // the words of a V, a int8 V is packed after its scale
+  size_t V_words = V_int8_ ? 1 + (V_dim_ + 3) / 4 : V_dim_;
+  size_t n = model.feaids.size();
+  auto has_V = [&model](size_t i) {
+    return model.V_dim > 0 && model.V_idx[i] >= 0;
+  };
+  num_feas_ = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (model.w[i] != 0 || has_V(i)) ++num_feas_;
+  }
+  size_t size = 2;
+  while (size < num_feas_ * 2) size *= 2;
+  mask_ = size - 1;
+  table_.assign(size, Slot{0, 0, 0});
+  values_.clear();
+  for (size_t i = 0; i < n; ++i) {
+    bool V = has_V(i);
+    if (model.w[i] == 0 && !V) continue;
+    uint64_t h = hash::Int(model.feaids[i]) & mask_;
+    while (table_[h].len) h = (h + 1) & mask_;
+    Slot& s = table_[h];
+    s.key = model.feaids[i];
+    s.pos = static_cast<uint32_t>(values_.size());
+    s.len = static_cast<uint32_t>(V ? 1 + V_words : 1);
+    values_.push_back(model.w[i]);
+    if (!V) continue;
+    size_t row = model.V_idx[i];
+    if (V_int8_) {
+      values_.push_back(model.V_scale[row]);
+      size_t p = values_.size();
+      values_.resize(p + V_words - 1, 0);
+      memcpy(values_.data() + p, model.V_q.data() + row * V_dim_, V_dim_);
+    } else {
+      real_t const* v = model.V.data() + row * V_dim_;
+      values_.insert(values_.end(), v, v + V_dim_);
+    }
+  }
+  CHECK_LE(values_.size(), static_cast<size_t>(UINT32_MAX))
+      << "too large model";
+  return true;
+}
+
+const Scorer::Slot* Scorer::Find(feaid_t key) const {
+  if (table_.empty()) return nullptr;
+  uint64_t h = hash::Int(key) & mask_;
+  while (true) {
+    const Slot& s = table_[h];
+    if (s.len == 0) return nullptr;
+    if (s.key == key) return &s;
+    h = (h + 1) & mask_;
+  }
+}
+
+real_t Scorer::Predict(const feaid_t* index, const real_t* value,
+                       size_t nnz) const {
+  // the sums over the features of x*V are kept on the stack, kBlock
+  // dimensions a time
+  const int kBlock = 64;
+  real_t xv[kBlock];
+  real_t lin = 0, xxvv = 0, s = 0;
+  for (int d = 0; d < std::max(V_dim_, 1); d += kBlock) {
+    int nd = std::min(kBlock, V_dim_ - d);
+    if (nd > 0) std::fill(xv, xv + nd, 0);
+    for (size_t j = 0; j < nnz; ++j) {
+      const Slot* slot = Find(ReverseBytes(index[j]));
+      if (!slot) continue;
+      real_t x = value ? value[j] : 1;
+      real_t const* w = values_.data() + slot->pos;
+      if (d == 0) lin += x * w[0];
+      if (slot->len == 1) continue;
+      real_t vv = 0;
+      if (V_int8_) {
+        real_t scale = w[1];
+        auto q = reinterpret_cast<const int8_t*>(w + 2) + d;
+        for (int l = 0; l < nd; ++l) {
+          real_t v = q[l] * scale;
+          xv[l] += x * v;
+          vv += v * v;
+        }
+      } else {
+        real_t const* V = w + 1 + d;
+        for (int l = 0; l < nd; ++l) {
+          xv[l] += x * V[l];
+          vv += V[l] * V[l];
+        }
+      }
+      xxvv += x * x * vv;
+    }
+    for (int l = 0; l < nd; ++l) s += xv[l] * xv[l];
+  }
+  real_t p = lin + .5 * (s - xxvv);
+  // the same projection as the loss
+  return p > 20 ? 20 : (p < -20 ? -20 : p);
+}
+
+}  // namespace difacto
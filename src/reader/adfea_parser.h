@@ -5,12 +5,15 @@
  */
 #ifndef DIFACTO_READER_ADFEA_PARSER_H_
 #define DIFACTO_READER_ADFEA_PARSER_H_
+#include <algorithm>
 #include <limits>
 #include <vector>
+#include "dmlc/omp.h"
 #include "difacto/base.h"
 #include "data/row_block.h"
 #include "data/parser.h"
 #include "data/strtonum.h"
+#include "./text_tokenizer.h"
 namespace difacto {
 
 /**
@@ -19,8 +22,12 @@ namespace difacto {
  */
 class AdfeaParser : public dmlc::data::ParserImpl<feaid_t> {
  public:
-  explicit AdfeaParser(dmlc::InputSplit *source)
-      : bytes_read_(0), source_(source) { }
+  /**
+   * \param source the input
+   * \param nthreads the number of threads to parse a chunk
+   */
+  explicit AdfeaParser(dmlc::InputSplit *source, int nthreads = 1)
+      : bytes_read_(0), source_(source), nthreads_(std::max(nthreads, 1)) { }
   virtual ~AdfeaParser() {
     delete source_;
   }
@@ -33,61 +40,80 @@ class AdfeaParser : public dmlc::data::ParserImpl<feaid_t> {
   }
   bool ParseNext(
       std::vector<dmlc::data::RowBlockContainer<feaid_t> > *data) override {
-    using dmlc::data::isspace;
-    using dmlc::data::isdigit;
-    using dmlc::data::strtoull;
-
     dmlc::InputSplit::Blob chunk;
 
     if (!source_->NextChunk(&chunk)) return false;
 
     CHECK_NE(chunk.size, 0);
     bytes_read_ += chunk.size;
-    data->resize(1);
-    dmlc::data::RowBlockContainer<feaid_t>& blk = (*data)[0];
-    blk.Clear();
-    int i = 0;
     char *p = reinterpret_cast<char*>(chunk.dptr);
     char *end = p + chunk.size;
+    // each thread parses its own lines into its own block
+    std::vector<char*> bounds;
+    SplitLines(p, end, nthreads_, &bounds);
+    data->resize(nthreads_);
+#pragma omp parallel for num_threads(nthreads_)
+    for (int i = 0; i < nthreads_; ++i) {
+      ParseBlock(bounds[i], bounds[i+1], &(*data)[i]);
+    }
+    return true;
+  }
 
-    while (isspace(*p) && p != end) ++p;
+ private:
+  /**
+   * \brief parse the lines in [p, end) into blk
+   */
+  void ParseBlock(char *p, char *end,
+                  dmlc::data::RowBlockContainer<feaid_t>* blk) {
+    using dmlc::data::isspace;
+    using dmlc::data::isdigit;
+
+    blk->Clear();
+    int i = 0;
+    // each feature has a ':'
+    size_t nlines = CountChar(p, end, '\n') + 1;
+    blk->label.reserve(nlines);
+    blk->offset.reserve(nlines + 1);
+    blk->index.reserve(CountChar(p, end, ':'));
+
+    while (p != end && isspace(*p)) ++p;
     while (p != end) {
+      // the digits are converted while scanned, only once
       char *head = p;
-      while (isdigit(*p) && p != end) ++p;
+      feaid_t idx = 0;
+      for (; p != end && isdigit(*p); ++p) idx = idx * 10 + (*p - '0');
       CHECK_NE(head, p);
 
-      if (*p == ':') {
+      if (p != end && *p == ':') {
         ++p;
-        feaid_t idx = strtoull(head, NULL, 10);
-        feaid_t gid = strtoull(p, NULL, 10);
-        blk.index.push_back(EncodeFeaGrpID(idx, gid, 12));
-        while (isdigit(*p) && p != end) ++p;
+        feaid_t gid = 0;
+        for (; p != end && isdigit(*p); ++p) gid = gid * 10 + (*p - '0');
+        blk->index.push_back(EncodeFeaGrpID(idx, gid, 12));
       } else {
         // skip the lineid and the first count
         if (i == 2) {
           i = 0;
-          if (blk.label.size() != 0) {
-            blk.offset.push_back(blk.index.size());
+          if (blk->label.size() != 0) {
+            blk->offset.push_back(blk->index.size());
           }
-          blk.label.push_back(*head == '1');
+          blk->label.push_back(*head == '1');
         } else {
           ++i;
         }
       }
 
-      while (isspace(*p) && p != end) ++p;
+      while (p != end && isspace(*p)) ++p;
     }
-    if (blk.label.size() != 0) {
-      blk.offset.push_back(blk.index.size());
+    if (blk->label.size() != 0) {
+      blk->offset.push_back(blk->index.size());
     }
-    return true;
   }
 
- private:
   // number of bytes readed
   size_t bytes_read_;
   // source split that provides the data
   dmlc::InputSplit *source_;
+  int nthreads_;
 };
 
 }  // namespace difacto
@@ -3,73 +3,71 @@
  */
 #include "./batch_reader.h"
 namespace difacto {
+namespace {
+/**
+ * \brief push rows into blk. a binary input block may have no values, then
+ * 1s are filled so the values stay aligned with the indices
+ */
+template <typename Rows>
+void PushAligned(const Rows& rows,
+                 dmlc::data::RowBlockContainer<feaid_t>* blk) {
+  if (rows.value) blk->value.resize(blk->index.size(), 1);
+  blk->Push(rows);
+  if (!rows.value && blk->value.size()) {
+    blk->value.resize(blk->index.size(), 1);
+  }
+}
+}  // namespace
 
 BatchReader::BatchReader(
     const std::string& uri, const std::string& format,
     unsigned part_index, unsigned num_parts,
-    unsigned batch_size, unsigned shuffle_buf_size,
-    float neg_sampling) {
+    unsigned batch_size, float shuffle_buf_mb,
+    float neg_sampling, unsigned seed, int nthreads, bool neg_weight)
+    : rng_(seed), gauge_(MemTracker::kIO) {
   batch_size_   = batch_size;
-  shuf_buf_    = shuffle_buf_size;
+  shuf_bytes_   = static_cast<size_t>(shuffle_buf_mb * 1024 * 1024);
   neg_sampling_ = neg_sampling;
+  neg_weight_   = neg_weight && neg_sampling < 1.0;
   start_        = 0;
   end_          = 0;
-  seed_         = 0;
-  if (shuf_buf_) {
-    CHECK_GE(shuf_buf_, batch_size_);
-    buf_reader_ = new BatchReader(
-        uri, format, part_index, num_parts, shuf_buf_);
-    reader_ = NULL;
-  } else {
-    buf_reader_ = NULL;
-    reader_ = new Reader(uri, format, part_index, num_parts, 1<<26);
-  }
+  in_binary_    = true;
+  buf_bytes_    = 0;
+  eof_          = false;
+  reader_ = new Reader(uri, format, part_index, num_parts, 1<<26, nthreads);
 }
 
 bool BatchReader::Next() {
+  if (shuf_bytes_) return NextShuffled();
   batch_.Clear();
+  bool binary = true;
   while (batch_.offset.size() < batch_size_ + 1) {
     if (start_ == end_) {
-      if (shuf_buf_ == 0) {
-        // no random shuffle
-        if (!reader_->Next()) break;
-        in_blk_ = reader_->Value();
-      } else {
-        // do random shuffle
-        if (!buf_reader_->Next()) break;
-        in_blk_ = buf_reader_->Value();
-        if (rdp_.size() != in_blk_.size) {
-          rdp_.resize(in_blk_.size);
-          for (size_t i = 0; i < in_blk_.size; ++i) rdp_[i] = i;
-        }
-        std::random_shuffle(rdp_.begin(), rdp_.end());
-      }
+      if (!reader_->Next()) break;
+      in_blk_ = reader_->Value();
       start_ = 0;
       end_ = in_blk_.size;
+      in_binary_ = IsBinary(in_blk_);
     }
 
     size_t len = std::min(end_ - start_, batch_size_ + 1 - batch_.offset.size());
-    if (shuf_buf_ == 0 && neg_sampling_ == 1.0) {
+    if (neg_sampling_ == 1.0) {
+      if (batch_.offset.size() == 1 && len == batch_size_) {
+        // the whole batch is inside in_blk_, no need to copy
+        Slice(start_, len);
+        start_ += len;
+        return true;
+      }
       Push(start_, len);
     } else {
       for (size_t i = start_; i < start_ + len; ++i) {
-        int j = rdp_[i];
-        // downsampling
-        float p = static_cast<float>(rand_r(&seed_)) /
-                  static_cast<float>(RAND_MAX);
-        if (neg_sampling_ < 1.0 &&
-            in_blk_.label[j] <= 0 &&
-            p > 1 - neg_sampling_) {
-          continue;
-        }
-        batch_.Push(in_blk_[j]);
+        if (Sample(in_blk_.label[i])) PushSampled(in_blk_[i]);
       }
     }
+    binary = binary && in_binary_;
     start_ += len;
   }
 
-  bool binary =  true;
-  for (auto f : batch_.value) if (f != 1) { binary = false; break; }
   if (binary) batch_.value.clear();
 
   out_blk_ = batch_.GetBlock();
@@ -77,11 +75,116 @@ bool BatchReader::Next() {
   return out_blk_.size > 0;
 }
 
+bool BatchReader::NextShuffled() {
+  batch_.Clear();
+  bool binary = true;
+  while (batch_.offset.size() < batch_size_ + 1) {
+    // the buffer stops growing if the memory budget is exceeded, but keeps
+    // at least one block
+    auto tracker = MemTracker::Get();
+    while (!eof_ && buf_bytes_ < shuf_bytes_ &&
+           (buf_rows_.empty() || !tracker->Exceeds(0))) {
+      eof_ = !FillBuffer();
+    }
+    if (buf_rows_.empty()) break;
+
+    // pick a random example, and copy it into the batch directly
+    size_t k = std::uniform_int_distribution<size_t>(
+        0, buf_rows_.size() - 1)(rng_);
+    BufRow r = buf_rows_[k];
+    buf_rows_[k] = buf_rows_.back();
+    buf_rows_.pop_back();
+    BufBlock& blk = buf_blks_[r.blk];
+    auto row = blk.data[r.row];
+    if (Sample(*row.label)) {
+      PushSampled(row);
+      binary = binary && blk.binary;
+    }
+
+    // release the block once all its examples are picked
+    if (--blk.remain == 0) {
+      buf_bytes_ -= blk.bytes;
+      gauge_.Set(buf_bytes_);
+      reader_->Release(blk.handle);
+      blk.handle = nullptr;
+      free_blks_.push_back(r.blk);
+    }
+  }
+
+  if (binary) batch_.value.clear();
+
+  out_blk_ = batch_.GetBlock();
+
+  return out_blk_.size > 0;
+}
+
+bool BatchReader::FillBuffer() {
+  if (!reader_->Next()) return false;
+  const auto& in = reader_->Value();
+  if (in.size == 0) return true;
+  unsigned id;
+  if (free_blks_.empty()) {
+    id = buf_blks_.size();
+    buf_blks_.resize(id + 1);
+  } else {
+    id = free_blks_.back();
+    free_blks_.pop_back();
+  }
+  // hold the parsed block rather than copying it, so an example is copied
+  // only once, into its batch
+  BufBlock& blk = buf_blks_[id];
+  blk.handle = reader_->Hold();
+  blk.data = in;
+  blk.remain = in.size;
+  blk.binary = IsBinary(in);
+  blk.bytes = in.MemCostBytes();
+  buf_bytes_ += blk.bytes;
+  gauge_.Set(buf_bytes_);
+  for (size_t i = 0; i < in.size; ++i) {
+    buf_rows_.push_back(BufRow{id, static_cast<unsigned>(i)});
+  }
+  return true;
+}
+
+void BatchReader::PushSampled(const dmlc::Row<feaid_t>& row) {
+  PushAligned(row, &batch_);
+  if (!neg_weight_) return;
+  real_t w = *row.label > 0 ? 1 : 1 / neg_sampling_;
+  if (row.weight) {
+    batch_.weight.back() *= w;
+  } else {
+    batch_.weight.push_back(w);
+  }
+}
+
+bool BatchReader::IsBinary(const dmlc::RowBlock<feaid_t>& blk) {
+  if (!blk.value) return true;
+  size_t nnz = blk.offset[blk.size] - blk.offset[0];
+  real_t const* value = blk.value + blk.offset[0];
+  for (size_t i = 0; i < nnz; ++i) if (value[i] != 1) return false;
+  return true;
+}
+
+void BatchReader::Slice(size_t pos, size_t len) {
+  CHECK_LE(pos + len, in_blk_.size);
+  size_t base = in_blk_.offset[pos];
+  slice_offset_.resize(len + 1);
+  for (size_t i = 0; i <= len; ++i) {
+    slice_offset_[i] = in_blk_.offset[pos + i] - base;
+  }
+  out_blk_.size = len;
+  out_blk_.offset = slice_offset_.data();
+  out_blk_.label = in_blk_.label + pos;
+  out_blk_.weight = in_blk_.weight ? in_blk_.weight + pos : NULL;
+  out_blk_.index = in_blk_.index + base;
+  out_blk_.value = in_binary_ ? NULL : in_blk_.value + base;
+}
+
 void BatchReader::Push(size_t pos, size_t len) {
   if (!len) return;
   CHECK_LE(pos + len, in_blk_.size);
   dmlc::RowBlock<feaid_t> slice;
-  slice.weight = NULL;
+  slice.weight = in_blk_.weight ? in_blk_.weight + pos : NULL;
   slice.size = len;
   slice.offset  = in_blk_.offset + pos;
   slice.label   = in_blk_.label  + pos;
@@ -91,7 +194,7 @@ void BatchReader::Push(size_t pos, size_t len) {
   } else {
     slice.value = NULL;
   }
-  batch_.Push(slice);
+  PushAligned(slice, &batch_);
 }
 
 }  // namespace difacto
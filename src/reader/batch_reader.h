@@ -3,10 +3,12 @@
  */
 #ifndef DIFACTO_READER_BATCH_READER_H_
 #define DIFACTO_READER_BATCH_READER_H_
+#include <random>
 #include <string>
 #include <vector>
 #include "difacto/base.h"
 #include "dmlc/data.h"
+#include "common/mem_tracker.h"
 #include "./reader.h"
 namespace difacto {
 
@@ -24,21 +26,32 @@ class BatchReader : public Reader {
    * @param part_index the i-th part to read
    * @param num_parts partition the file into serveral parts
    * @param batch_size the batch size.
-   * @param shuffle_size if nonzero, then the batch is randomly picked from a buffer with
-   * shuffle_buf_size examples
+   * @param shuffle_buf_mb if nonzero, then the examples of a batch are randomly
+   * picked from a buffer of the blocks read, which uses about shuffle_buf_mb
+   * MB, or less if the memory budget is exceeded
    * @param neg_sampling the probability to pickup a negative sample (label <= 0)
+   * @param seed the random seed for shuffling and sampling
+   * @param nthreads the number of threads to parse the data
+   * @param neg_weight if true and neg_sampling < 1, a picked negative sample
+   * has the weight 1 / neg_sampling and a positive one 1, so the weighted
+   * losses and metrics are unbiased
    */
   BatchReader(const std::string& uri,
             const std::string& format,
             unsigned part_index,
             unsigned num_parts,
             unsigned batch_size,
-            unsigned shuffle_buf_size = 0,
-            float neg_sampling = 1.0);
+            float shuffle_buf_mb = 0,
+            float neg_sampling = 1.0,
+            unsigned seed = 0,
+            int nthreads = 1,
+            bool neg_weight = true);
 
   virtual ~BatchReader() {
+    for (const auto& blk : buf_blks_) {
+      if (blk.handle) reader_->Release(blk.handle);
+    }
     delete reader_;
-    delete buf_reader_;
   }
 
   /**
@@ -49,30 +62,100 @@ class BatchReader : public Reader {
   /**
    * \brief get the current batch
    *
+   * if neither shuffle nor negative sampling is used, a batch within a block
+   * returned by the parser is a view of that block rather than a copy, so
+   * the batch is only valid until the next call of \ref Next
    */
   const dmlc::RowBlock<feaid_t>& Value() const override {
     return out_blk_;
   }
 
+  double parse_sec() const override { return reader_->parse_sec(); }
+  double wait_sec() const override { return reader_->wait_sec(); }
+  size_t read_bytes() const override { return reader_->read_bytes(); }
+  double read_sec() const override { return reader_->read_sec(); }
+
  private:
+  /**
+   * \brief the next batch by randomly picking examples from the buffer
+   */
+  bool NextShuffled();
+  /**
+   * \brief read a block into the shuffle buffer, returns false if at the end
+   */
+  bool FillBuffer();
   /**
    * \brief batch_.push(in_blk_(pos:pos+len))
    */
   void Push(size_t pos, size_t len);
+  /**
+   * \brief out_blk_ = in_blk_(pos:pos+len), without copying the index and
+   * values
+   */
+  void Slice(size_t pos, size_t len);
+  /**
+   * \brief returns false if an example with this label is dropped by the
+   * negative sampling
+   */
+  bool Sample(real_t label) {
+    return neg_sampling_ >= 1.0 || label > 0 ||
+        std::uniform_real_distribution<float>(0, 1)(rng_) <= neg_sampling_;
+  }
+  /**
+   * \brief push a sampled row into batch_, with its importance weight if
+   * neg_weight_
+   */
+  void PushSampled(const dmlc::Row<feaid_t>& row);
+  /**
+   * \brief returns true if all values of blk are 1
+   */
+  static bool IsBinary(const dmlc::RowBlock<feaid_t>& blk);
 
-  unsigned batch_size_, shuf_buf_;
+  unsigned batch_size_;
+  /** \brief the memory bound of the shuffle buffer, 0 means no shuffle */
+  size_t shuf_bytes_;
 
   Reader *reader_;
-  BatchReader* buf_reader_;
 
   float neg_sampling_;
+  /** \brief whether the sampled examples are weighted */
+  bool neg_weight_;
   size_t start_, end_;
   dmlc::RowBlock<feaid_t> in_blk_, out_blk_;
   dmlc::data::RowBlockContainer<feaid_t> batch_;
+  /** \brief whether in_blk_ is binary, checked once per block */
+  bool in_binary_;
+  /** \brief the offsets of out_blk_ when it is a slice of in_blk_ */
+  std::vector<size_t> slice_offset_;
+
+  /**
+   * \brief a buffered block of the shuffle buffer, which is a parsed block
+   * held by \ref Reader::Hold
+   */
+  struct BufBlock {
+    void* handle = nullptr;
+    dmlc::RowBlock<feaid_t> data;
+    /** \brief the number of examples not picked yet */
+    size_t remain;
+    bool binary;
+    size_t bytes;
+  };
+  /** \brief an example in the shuffle buffer */
+  struct BufRow {
+    unsigned blk;
+    unsigned row;
+  };
+  std::vector<BufBlock> buf_blks_;
+  /** \brief the slots in buf_blks_ can be reused */
+  std::vector<unsigned> free_blks_;
+  /** \brief the examples not picked yet */
+  std::vector<BufRow> buf_rows_;
+  size_t buf_bytes_;
+  bool eof_;
 
-  // random pertubation
-  std::vector<unsigned> rdp_;
-  unsigned int seed_;
+  std::mt19937 rng_;
+  /** \brief accounts buf_bytes_ */
+  MemGauge gauge_;
 };
 
 }  // namespace difacto
@@ -0,0 +1,204 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ * @file   columnar_parser.h
+ * @brief  parser for the columnar data format
+ */
+#ifndef DIFACTO_READER_COLUMNAR_PARSER_H_
+#define DIFACTO_READER_COLUMNAR_PARSER_H_
+#include <algorithm>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "dmlc/parameter.h"
+#include "dmlc/recordio.h"
+#include "data/parser.h"
+#include "data/columnar_block.h"
+#include "./read_ahead_split.h"
+namespace difacto {
+
+/**
+ * \brief which parts of the data in the col format are read
+ */
+struct ColumnarParam : public dmlc::Parameter<ColumnarParam> {
+  /**
+   * \brief the field (feature group) ids read, such as "1,3,5". empty means
+   * all
+   */
+  std::string col_fields;
+  /** \brief the field ids not read, such as for a feature ablation */
+  std::string col_skip_fields;
+  /**
+   * \brief only the row groups overlapping the rows [col_row_begin,
+   * col_row_end) of the converted data are read, such as a time range if the
+   * data is ordered by time. a negative col_row_end means no end
+   */
+  int64_t col_row_begin;
+  int64_t col_row_end;
+  DMLC_DECLARE_PARAMETER(ColumnarParam) {
+    DMLC_DECLARE_FIELD(col_fields).set_default("");
+    DMLC_DECLARE_FIELD(col_skip_fields).set_default("");
+    DMLC_DECLARE_FIELD(col_row_begin).set_default(0);
+    DMLC_DECLARE_FIELD(col_row_end).set_default(-1);
+  }
+};
+
+/**
+ * \brief selects the row groups and the fields by the footers, shared by all
+ * readers of this process
+ */
+class ColumnarFilter {
+ public:
+  static ColumnarFilter* Get() {
+    static ColumnarFilter filter;
+    return &filter;
+  }
+
+  void Init(const ColumnarParam& param) {
+    fields_ = ParseList(param.col_fields);
+    skip_fields_ = ParseList(param.col_skip_fields);
+    row_begin_ = param.col_row_begin;
+    row_end_ = param.col_row_end < 0 ? std::numeric_limits<uint64_t>::max() :
+               param.col_row_end;
+  }
+
+  /**
+   * \brief select the fields of a row group
+   * @param footer the footer of the row group
+   * @param fields the positions in footer.fields of the fields to read
+   * @return false if the row group is skipped
+   */
+  bool Select(const ColumnarFooter& footer, std::vector<int>* fields) const {
+    fields->clear();
+    if (footer.first_row >= row_end_ ||
+        footer.first_row + footer.nrows <= row_begin_) {
+      return false;
+    }
+    for (size_t i = 0; i < footer.fields.size(); ++i) {
+      int id = footer.fields[i].id;
+      if (fields_.size() &&
+          !std::binary_search(fields_.begin(), fields_.end(), id)) continue;
+      if (std::binary_search(skip_fields_.begin(), skip_fields_.end(), id)) {
+        continue;
+      }
+      fields->push_back(i);
+    }
+    return true;
+  }
+
+ private:
+  /** \brief parse a comma separated list of integers, sorted */
+  static std::vector<int> ParseList(const std::string& str) {
+    std::vector<int> list;
+    std::stringstream ss(str);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+      if (item.size()) list.push_back(std::stoi(item));
+    }
+    std::sort(list.begin(), list.end());
+    return list;
+  }
+
+  std::vector<int> fields_, skip_fields_;
+  uint64_t row_begin_ = 0;
+  uint64_t row_end_ = std::numeric_limits<uint64_t>::max();
+};
+
+/**
+ * \brief columnar block parser, the row groups and fields not selected by
+ * \ref ColumnarFilter are skipped without decompressing
+ */
+class ColumnarParser : public dmlc::data::ParserImpl<feaid_t> {
+ public:
+  /**
+   * \param source the input split
+   * \param nthreads the number of records decompressed in parallel
+   */
+  explicit ColumnarParser(dmlc::InputSplit *source, int nthreads = 1)
+      : bytes_read_(0), source_(source), nthreads_(std::max(nthreads, 1)),
+        recs_(nthreads_) { }
+  virtual ~ColumnarParser() {
+    delete source_;
+  }
+  void BeforeFirst(void) override {
+    source_->BeforeFirst();
+  }
+  size_t BytesRead(void) const override {
+    return bytes_read_;
+  }
+  bool ParseNext(
+      std::vector<dmlc::data::RowBlockContainer<feaid_t> > *data) override {
+    // a record is only valid until the next one is read, so the selected
+    // ones are copied into the reused buffers
+    dmlc::InputSplit::Blob rec;
+    auto filter = ColumnarFilter::Get();
+    int n = 0;
+    while (n < nthreads_ && source_->NextRecord(&rec)) {
+      CHECK_NE(rec.size, 0);
+      bytes_read_ += rec.size;
+      Rec& r = recs_[n];
+      char const* dptr = static_cast<char const*>(rec.dptr);
+      ColumnarBlock().ReadFooter(dptr, rec.size, &r.footer);
+      if (!filter->Select(r.footer, &r.fields)) continue;
+      r.data.assign(dptr, rec.size);
+      ++n;
+    }
+    if (n == 0) return false;
+    data->resize(n);
+#pragma omp parallel for num_threads(n)
+    for (int i = 0; i < n; ++i) {
+      const Rec& r = recs_[i];
+      ColumnarBlock().Decompress(r.data.data(), r.data.size(), r.footer,
+                                 r.fields, &(*data)[i]);
+    }
+    return true;
+  }
+
+ private:
+  /** \brief a record selected */
+  struct Rec {
+    std::string data;
+    ColumnarFooter footer;
+    std::vector<int> fields;
+  };
+  // number of bytes readed
+  size_t bytes_read_;
+  // source split that provides the data
+  dmlc::InputSplit *source_;
+  int nthreads_;
+  std::vector<Rec> recs_;
+};
+
+/**
+ * \brief reads the data in the col format into the transposed layout, for
+ * \ref TileBuilder
+ */
+class ColumnarReader {
+ public:
+  ColumnarReader(const std::string& uri, int part_index, int num_parts) {
+    source_ = ReadAheadSplit::Create(uri, part_index, num_parts, "recordio");
+  }
+  ~ColumnarReader() { delete source_; }
+
+  /** \brief read the next selected row group, false if at the end */
+  bool Next(ColumnarTile* tile) {
+    dmlc::InputSplit::Blob rec;
+    while (source_->NextRecord(&rec)) {
+      char const* dptr = static_cast<char const*>(rec.dptr);
+      block_.ReadFooter(dptr, rec.size, &footer_);
+      if (!ColumnarFilter::Get()->Select(footer_, &fields_)) continue;
+      block_.Decompress(dptr, rec.size, footer_, fields_, tile);
+      return true;
+    }
+    return false;
+  }
+
+ private:
+  dmlc::InputSplit* source_;
+  ColumnarBlock block_;
+  ColumnarFooter footer_;
+  std::vector<int> fields_;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_READER_COLUMNAR_PARSER_H_
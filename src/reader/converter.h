@@ -3,10 +3,21 @@
  */
 #ifndef DIFACTO_READER_CONVERTER_H_
 #define DIFACTO_READER_CONVERTER_H_
+#include <stdio.h>
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
 #include <string>
+#include <vector>
 #include "dmlc/parameter.h"
+#include "dmlc/recordio.h"
 #include "reader/reader.h"
 #include "dmlc/io.h"
+#include "data/compressed_row_block.h"
+#include "data/columnar_block.h"
+#include "common/thread_pool.h"
+#include "reader/read_ahead_split.h"
+#include "reader/feature_cross.h"
 namespace difacto {
 
 struct ConverterParam : public dmlc::Parameter<ConverterParam> {
@@ -16,7 +27,7 @@ struct ConverterParam : public dmlc::Parameter<ConverterParam> {
   std::string data_format;
   /** \brief The prefix of output */
   std::string data_out;
-  /** \brief the output data format: libsvm or rec */
+  /** \brief the output data format: libsvm, rec or col */
   std::string data_out_format;
   /** \brief input chunk size in MB */
   real_t chunk_size;
@@ -26,6 +37,15 @@ struct ConverterParam : public dmlc::Parameter<ConverterParam> {
    * the default value -1 means no splitting
    */
   int part_size;
+  /**
+   * \brief the number of partitions of the input read in parallel. the blocks
+   * are written in a round robin order of the partitions
+   */
+  int num_readers;
+  /** \brief the number of threads to compress or format the blocks */
+  int num_threads;
+  /** \brief the bits of the field (feature group) id in a feature id, in col */
+  int field_bits;
   DMLC_DECLARE_PARAMETER(ConverterParam) {
     DMLC_DECLARE_FIELD(data_in);
     DMLC_DECLARE_FIELD(data_format);
@@ -33,6 +53,9 @@ struct ConverterParam : public dmlc::Parameter<ConverterParam> {
     DMLC_DECLARE_FIELD(data_out_format);
     DMLC_DECLARE_FIELD(part_size).set_default(-1);
     DMLC_DECLARE_FIELD(chunk_size).set_default(512);
+    DMLC_DECLARE_FIELD(num_readers).set_default(1).set_range(1, 64);
+    DMLC_DECLARE_FIELD(num_threads).set_default(2).set_range(1, 64);
+    DMLC_DECLARE_FIELD(field_bits).set_default(12).set_range(0, 16);
   };
 };
 /**
@@ -42,85 +65,185 @@ class Converter {
  public:
   KWArgs Init(const KWArgs& kwargs) {
     auto remain = param_.InitAllowUnknown(kwargs);
+    remain = ReadAheadSplit::DefaultParam()->InitAllowUnknown(remain);
+    remain = FeatureCross::DefaultParam()->InitAllowUnknown(remain);
     return remain;
   }
 
+  /**
+   * \brief convert the data
+   *
+   * the blocks read by the readers are converted by a thread pool, and then
+   * written in order by this thread
+   */
   void Run() {
-    using namespace dmlc;
-    using namespace dmlc::data;
     int chunk_size = param_.chunk_size * 1024 * 1024;
-    Reader in(param_.data_in, param_.data_format, 0, 1, chunk_size);
-
+    int nreaders = param_.num_readers;
+    std::vector<Reader*> readers(nreaders);
+    for (int i = 0; i < nreaders; ++i) {
+      readers[i] = new Reader(param_.data_in, param_.data_format,
+                              i, nreaders, chunk_size);
+    }
     LOG(INFO) << "reading data from " << param_.data_in
               << " in " << param_.data_format << " format";
+    const auto& out_format = param_.data_out_format;
+    CHECK(out_format == "libsvm" || out_format == "rec" || out_format == "col")
+        << "unknow output format: " << out_format;
 
-    int ipart = 0;
-    size_t limit = static_cast<size_t>(-1);
-    size_t part_size = static_cast<size_t>(param_.part_size);
-    size_t nwrite = limit;
-    Stream *out = nullptr;
-    RecordIOWriter* rec_writer = nullptr;
-    ostream* libsvm_writer = nullptr;
-
-    size_t nrows = 0;
-    while (in.Next()) {
-      auto out_format = param_.data_out_format;
-      if (nwrite == limit || nwrite / 1000000 >= part_size) {
-        if (nwrite != limit) {
-          LOG(INFO) << "done. written " << nwrite << " bytes";
+    // the block with sequence number k uses slots[k % nslots], whose buffers
+    // are reused
+    int nslots = param_.num_threads * 2;
+    std::vector<Slot> slots(nslots);
+    size_t nread = 0, nwritten = 0, nrows_read = 0;
+    {
+      ThreadPool pool(param_.num_threads);
+      std::vector<bool> eof(nreaders, false);
+      for (int r = 0, neof = 0; neof < nreaders; r = (r + 1) % nreaders) {
+        if (eof[r]) continue;
+        if (!readers[r]->Next()) {
+          eof[r] = true; ++neof; continue;
+        }
+        // wait the previous block in this slot is written
+        Slot* slot = &slots[nread % nslots];
+        if (nread - nwritten == static_cast<size_t>(nslots)) {
+          Write(&slots[nwritten++ % nslots]);
         }
-        auto outfile = param_.data_out;
-        if (part_size != limit) {
-          outfile += "-part_" + std::to_string(ipart++);
+        slot->blk.Clear();
+        slot->blk.Push(readers[r]->Value());
+        slot->first_row = nrows_read;
+        nrows_read += slot->blk.Size();
+        slot->done = false;
+        ++nread;
+        pool.Add([this, slot](int tid) {
+            Convert(slot);
+            std::lock_guard<std::mutex> lk(mu_);
+            slot->done = true;
+            cond_.notify_all();
+          });
+        // write the converted ones
+        while (nwritten < nread && IsDone(slots[nwritten % nslots])) {
+          Write(&slots[nwritten++ % nslots]);
         }
-        delete libsvm_writer; libsvm_writer = nullptr;
-        delete rec_writer; rec_writer = nullptr;
-        delete out; out = CHECK_NOTNULL(Stream::Create(outfile.c_str(), "wb"));
-        nwrite = 0;
+      }
+    }
+    while (nwritten < nread) Write(&slots[nwritten++ % nslots]);
+
+    size_t read_bytes = 0;
+    double read_sec = 0;
+    for (auto r : readers) {
+      read_bytes += r->read_bytes();
+      read_sec = std::max(read_sec, r->read_sec());
+    }
+    if (read_sec > 0) {
+      LOG(INFO) << "read " << read_bytes << " bytes at "
+                << read_bytes / read_sec / 1e6 << " MB/s";
+    }
+    for (auto r : readers) delete r;
+    delete libsvm_writer_; libsvm_writer_ = nullptr;
+    delete rec_writer_; rec_writer_ = nullptr;
+    delete out_; out_ = nullptr;
+    LOG(INFO) << "done. written " << nwrite_ << " bytes";
+  }
+
+ private:
+  /** \brief a block being converted */
+  struct Slot {
+    dmlc::data::RowBlockContainer<feaid_t> blk;
+    /** \brief the converted data */
+    std::string out;
+    /** \brief the number of the first row in all blocks */
+    size_t first_row = 0;
+    bool done = true;
+  };
 
-        LOG(INFO) << "wrting data to " << outfile
-                  << " in " << out_format << " format";
-        if (out_format == "libsvm") {
-          libsvm_writer = new ostream(out);
-        } else if (out_format == "rec") {
-          rec_writer = new RecordIOWriter(out);
-        } else {
-          LOG(FATAL) << "unknow output format: " << out_format;
+  bool IsDone(const Slot& slot) {
+    std::lock_guard<std::mutex> lk(mu_);
+    return slot.done;
+  }
+
+  /** \brief convert slot->blk into slot->out, thread safe */
+  void Convert(Slot* slot) {
+    auto blk = slot->blk.GetBlock();
+    if (param_.data_out_format == "rec") {
+      CompressedRowBlock().Compress(blk, &slot->out);
+      return;
+    }
+    if (param_.data_out_format == "col") {
+      ColumnarBlock().Compress(blk, param_.field_bits, slot->first_row,
+                               &slot->out);
+      return;
+    }
+    // libsvm, formatted as std::ostream does
+    std::string& str = slot->out;
+    str.clear();
+    char buf[32];
+    for (size_t i = 0; i < blk.size; ++i) {
+      snprintf(buf, sizeof(buf), "%g ", blk.label[i]);
+      str += buf;
+      for (size_t j = blk.offset[i]; j < blk.offset[i+1]; ++j) {
+        str += std::to_string(blk.index[j]);
+        if (blk.value) {
+          snprintf(buf, sizeof(buf), ":%g", blk.value[j]);
+          str += buf;
         }
+        str += ' ';
+      }
+      str += '\n';
+    }
+  }
+
+  /** \brief wait until the slot is converted, then write it */
+  void Write(Slot* slot) {
+    {
+      std::unique_lock<std::mutex> lk(mu_);
+      cond_.wait(lk, [slot]{ return slot->done; });
+    }
+    size_t limit = static_cast<size_t>(-1);
+    size_t part_size = static_cast<size_t>(param_.part_size);
+    const auto& out_format = param_.data_out_format;
+    if (nwrite_ == limit || nwrite_ / 1000000 >= part_size) {
+      if (nwrite_ != limit) {
+        LOG(INFO) << "done. written " << nwrite_ << " bytes";
+      }
+      auto outfile = param_.data_out;
+      if (part_size != limit) {
+        outfile += "-part_" + std::to_string(ipart_++);
       }
+      delete libsvm_writer_; libsvm_writer_ = nullptr;
+      delete rec_writer_; rec_writer_ = nullptr;
+      delete out_;
+      out_ = CHECK_NOTNULL(dmlc::Stream::Create(outfile.c_str(), "wb"));
+      nwrite_ = 0;
+
+      LOG(INFO) << "wrting data to " << outfile
+                << " in " << out_format << " format";
       if (out_format == "libsvm") {
-        auto blk = in.Value();
-        for (size_t i = 0; i < blk.size; ++i) {
-          *libsvm_writer << blk.label[i] << " ";
-          for (size_t j = blk.offset[i]; j < blk.offset[i+1]; ++j) {
-            *libsvm_writer << blk.index[j];
-            if (blk.value) *libsvm_writer << ":" << blk.value[j];
-            *libsvm_writer << " ";
-          }
-          *libsvm_writer << "\n";
-        }
-        nwrite = libsvm_writer->bytes_written();
-      } else if (out_format == "rec") {
-        std::string str;
-        CompressedRowBlock cblk;
-        cblk.Compress(in.Value(), &str);
-        rec_writer->WriteRecord(str);
-        nwrite += str.size();
+        libsvm_writer_ = new dmlc::ostream(out_);
       } else {
-        LOG(FATAL) << "unknow output format: " << out_format;
+        rec_writer_ = new dmlc::RecordIOWriter(out_);
       }
-
-      nrows += in.Value().size;
-      LOG(INFO) << "written " << nrows << " examples in " << nwrite << " bytes";
     }
-    delete libsvm_writer;
-    delete rec_writer;
-    delete out;
-    LOG(INFO) << "done. written " << nwrite << " bytes";
+    if (out_format == "libsvm") {
+      libsvm_writer_->write(slot->out.data(), slot->out.size());
+      nwrite_ = libsvm_writer_->bytes_written();
+    } else {
+      rec_writer_->WriteRecord(slot->out);
+      nwrite_ += slot->out.size();
+    }
+
+    nrows_ += slot->blk.Size();
+    LOG(INFO) << "written " << nrows_ << " examples in " << nwrite_ << " bytes";
   }
 
- private:
   ConverterParam param_;
+  std::mutex mu_;
+  std::condition_variable cond_;
+  int ipart_ = 0;
+  size_t nwrite_ = static_cast<size_t>(-1);
+  size_t nrows_ = 0;
+  dmlc::Stream *out_ = nullptr;
+  dmlc::RecordIOWriter* rec_writer_ = nullptr;
+  dmlc::ostream* libsvm_writer_ = nullptr;
 };
 
 }  // namespace difacto
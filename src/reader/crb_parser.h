@@ -5,6 +5,7 @@
  */
 #ifndef DIFACTO_READER_CRB_PARSER_H_
 #define DIFACTO_READER_CRB_PARSER_H_
+#include <string>
 #include <vector>
 #include "data/parser.h"
 #include "dmlc/recordio.h"
@@ -15,8 +16,12 @@ namespace difacto {
  */
 class CRBParser : public dmlc::data::ParserImpl<feaid_t> {
  public:
-  explicit CRBParser(dmlc::InputSplit *source)
-      : bytes_read_(0), source_(source) {
+  /**
+   * \param source the input split
+   * \param nthreads the number of records decompressed in parallel
+   */
+  explicit CRBParser(dmlc::InputSplit *source, int nthreads = 1)
+      : bytes_read_(0), source_(source), nthreads_(nthreads), recs_(nthreads) {
   }
   virtual ~CRBParser() {
     delete source_;
@@ -30,12 +35,31 @@ class CRBParser : public dmlc::data::ParserImpl<feaid_t> {
   bool ParseNext(
       std::vector<dmlc::data::RowBlockContainer<feaid_t> > *data) override {
     dmlc::InputSplit::Blob rec;
-    if (!source_->NextRecord(&rec)) return false;
-    CHECK_NE(rec.size, 0);
-    bytes_read_ += rec.size;
-    data->resize(1); (*data)[0].Clear();
-    CompressedRowBlock crb;
-    crb.Decompress((char const*)rec.dptr, rec.size, &(*data)[0]);
+    if (nthreads_ == 1) {
+      if (!source_->NextRecord(&rec)) return false;
+      CHECK_NE(rec.size, 0);
+      bytes_read_ += rec.size;
+      data->resize(1); (*data)[0].Clear();
+      CompressedRowBlock().Decompress(
+          static_cast<char const*>(rec.dptr), rec.size, &(*data)[0]);
+      return true;
+    }
+    // a record is only valid until the next one is read, so copy it into the
+    // reused buffers
+    int n = 0;
+    while (n < nthreads_ && source_->NextRecord(&rec)) {
+      CHECK_NE(rec.size, 0);
+      bytes_read_ += rec.size;
+      recs_[n++].assign(static_cast<char const*>(rec.dptr), rec.size);
+    }
+    if (n == 0) return false;
+    // decompress into the containers given, which are reused by the caller
+    data->resize(n);
+#pragma omp parallel for num_threads(n)
+    for (int i = 0; i < n; ++i) {
+      (*data)[i].Clear();
+      CompressedRowBlock().Decompress(recs_[i], &(*data)[i]);
+    }
     return true;
   }
 
@@ -44,6 +68,9 @@ class CRBParser : public dmlc::data::ParserImpl<feaid_t> {
   size_t bytes_read_;
   // source split that provides the data
   dmlc::InputSplit *source_;
+  int nthreads_;
+  /** \brief the records being decompressed */
+  std::vector<std::string> recs_;
 };
 }  // namespace difacto
 #endif  // DIFACTO_READER_CRB_PARSER_H_
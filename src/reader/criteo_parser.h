@@ -5,15 +5,21 @@
  */
 #ifndef DIFACTO_READER_CRITEO_PARSER_H_
 #define DIFACTO_READER_CRITEO_PARSER_H_
+#include <stdlib.h>
+#include <string.h>
+#include <cmath>
+#include <algorithm>
 #include <limits>
-#if DIFACTO_USE_CITY
-#include <city.h>
-#endif  // DIFACTO_USE_CITY
+#include <string>
 #include <vector>
+#include "dmlc/omp.h"
 #include "difacto/base.h"
 #include "data/row_block.h"
 #include "data/parser.h"
 #include "data/strtonum.h"
+#include "common/hash.h"
+#include "./feature_cross.h"
+#include "./text_tokenizer.h"
 namespace difacto {
 
 /**
@@ -21,11 +27,24 @@ namespace difacto {
  * The columns are tab separeted with the following schema:
  *  <label> <integer feature 1> ... <integer feature 13>
  *  <categorical feature 1> ... <categorical feature 26>
+ *
+ * an integer feature is mapped into its log bin, while a categorical feature
+ * is hashed. the i-th column has group id i, and the crosses of the columns,
+ * if any, have group ids from 39 on, see \ref FeatureCross
  */
 class CriteoParser : public dmlc::data::ParserImpl<feaid_t> {
  public:
-  explicit CriteoParser(dmlc::InputSplit *source, bool is_train)
-      : bytes_read_(0), source_(source), is_train_(is_train) {
+  /**
+   * \param source the input
+   * \param is_train whether the first column is the label
+   * \param nthreads the number of threads to parse a chunk
+   * \param crosses the crosses of the columns, see \ref FeatureCrossParam
+   */
+  CriteoParser(dmlc::InputSplit *source, bool is_train, int nthreads = 1,
+               const std::string& crosses = "")
+      : bytes_read_(0), source_(source), is_train_(is_train),
+        nthreads_(std::max(nthreads, 1)),
+        cross_(crosses, kNumFields, kGrpBits) {
   }
   virtual ~CriteoParser() {
     delete source_;
@@ -46,65 +65,85 @@ class CriteoParser : public dmlc::data::ParserImpl<feaid_t> {
     bytes_read_ += chunk.size;
     char *p = reinterpret_cast<char*>(chunk.dptr);
     char *end = p + chunk.size;
-    data->resize(1);
-    dmlc::data::RowBlockContainer<feaid_t>& blk = (*data)[0];
-    blk.Clear();
-    char *pp = p;
+    // each thread parses its own lines into its own block, so the order of
+    // the examples is kept
+    std::vector<char*> bounds;
+    SplitLines(p, end, nthreads_, &bounds);
+    data->resize(nthreads_);
+#pragma omp parallel for num_threads(nthreads_)
+    for (int i = 0; i < nthreads_; ++i) {
+      ParseBlock(bounds[i], bounds[i+1], &(*data)[i]);
+    }
+    return true;
+  }
+
+ private:
+  /**
+   * \brief parse the lines in [p, end) into blk
+   */
+  void ParseBlock(char *p, char *end,
+                  dmlc::data::RowBlockContainer<feaid_t>* blk) {
+    blk->Clear();
+    size_t nlines = CountChar(p, end, '\n') + 1;
+    blk->label.reserve(nlines);
+    blk->offset.reserve(nlines + 1);
+    blk->index.reserve(nlines * (kNumFields + cross_.Size()));
+    // the hash of each column of a line, kept for the crosses
+    feaid_t hashes[kNumFields];
+    bool present[kNumFields];
     while (p != end) {
-      while (*p == '\r' || *p == '\n') ++p;
-      if (p == end) break;
+      char *eol = FindChar(p, end, '\n', '\r');
+      if (eol == p) { ++p; continue; }
 
       // parse label
       if (is_train_) {
-        pp = Find(p, end, '\t');
+        char *pp = FindChar(p, eol, '\t');
         CHECK_NE(p, pp) << "no label.., try criteo_test";
-        blk.label.push_back(atof(p));
+        blk->label.push_back(atof(p));
         p = pp + 1;
       } else {
-        blk.label.push_back(0);
+        blk->label.push_back(0);
       }
 
-      // parse inter feature
-      for (feaid_t i = 0; i < 13; ++i) {
-        pp = Find(p, end, '\t');
-        CHECK_NOTNULL(pp);
+      // parse the 13 integer features and then the 26 categorty features,
+      // both can have any width
+      memset(present, 0, sizeof(present));
+      for (feaid_t i = 0; i < kNumFields && p < eol; ++i) {
+        char *pp = FindChar(p, eol, '\t');
         if (pp > p) {
-          blk.index.push_back(EncodeFeaGrpID(Hash(p, pp-p), i, 12));
+          feaid_t x = i < kNumIntFields ? IntFea(p, pp) : hash::String(p, pp-p);
+          blk->index.push_back(EncodeFeaGrpID(x, i, kGrpBits));
+          hashes[i] = x;
+          present[i] = true;
         }
         p = pp + 1;
       }
-
-      // parse categorty feature
-      for (int i = 0; i < 26; ++i) {
-        if (p == end) break;
-        if (isspace(*p)) { ++p; continue; }
-        pp = p + 8; CHECK(isspace(*pp)) << i << " " << end - p << " " << *p;
-        size_t len = pp - p;
-        if (len) {
-          blk.index.push_back(EncodeFeaGrpID(Hash(p, len), i+13, 12));
-        }
-        p = pp + 1;
-        if (*pp == '\n' || *pp == '\r') break;
-      }
-      blk.offset.push_back(blk.index.size());
+      if (!cross_.Empty()) cross_.Append(hashes, present, &blk->index);
+      blk->offset.push_back(blk->index.size());
+      p = eol;
     }
-    return true;
   }
 
- private:
-  inline feaid_t Hash(const char* p, size_t len) {
-#if DIFACTO_USE_CITY
-    return CityHash64(p, len);
-#else
-    LOG(FATAL) << "compile with USE_CITY=1";
-    return 0;
-#endif  // DIFACTO_USE_CITY
-  }
+  /** \brief the number of integer feature columns */
+  static const feaid_t kNumIntFields = 13;
+  /** \brief the number of feature columns */
+  static const feaid_t kNumFields = kNumIntFields + 26;
+  /** \brief the number of bits of the group id */
+  static const int kGrpBits = 12;
 
-  // implement strchr
-  inline char* Find(char* p, char* end, int c) {
-    while (p != end && *p != c) ++p;
-    return p;
+  /**
+   * \brief encode integer v in [p, end) by its log bin, namely v if v <= 2,
+   * otherwise 2 + floor(log(v)^2). a non-integer is hashed as a string
+   */
+  static inline feaid_t IntFea(const char* p, const char* end) {
+    char* q;
+    int64_t v = strtoll(p, &q, 10);
+    if (q != end) return hash::String(p, end - p);
+    if (v > 2) {
+      real_t l = log(static_cast<real_t>(v));
+      v = 2 + static_cast<int64_t>(l * l);
+    }
+    return hash::Int(static_cast<uint64_t>(v));
   }
 
   // number of bytes readed
@@ -112,6 +151,8 @@ class CriteoParser : public dmlc::data::ParserImpl<feaid_t> {
   // source split that provides the data
   dmlc::InputSplit *source_;
   bool is_train_;
+  int nthreads_;
+  FeatureCross cross_;
 };
 
 }  // namespace difacto
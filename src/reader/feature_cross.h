@@ -0,0 +1,120 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ * @file   feature_cross.h
+ * @brief  crosses of the feature groups generated while parsing
+ */
+#ifndef DIFACTO_READER_FEATURE_CROSS_H_
+#define DIFACTO_READER_FEATURE_CROSS_H_
+#include <stdlib.h>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "dmlc/logging.h"
+#include "dmlc/parameter.h"
+#include "difacto/base.h"
+#include "common/hash.h"
+namespace difacto {
+
+struct FeatureCrossParam : public dmlc::Parameter<FeatureCrossParam> {
+  /**
+   * \brief the crosses of the feature groups, separated by ';', each is two
+   * or more group ids separated by ','. for example, "13,14;13,14,15" crosses
+   * the first two categorical fields of criteo, and then the first three.
+   * empty means no crosses
+   */
+  std::string feature_crosses;
+  DMLC_DECLARE_PARAMETER(FeatureCrossParam) {
+    DMLC_DECLARE_FIELD(feature_crosses).set_default("");
+  }
+};
+
+/**
+ * \brief generates the cross features of a row from the hashes of its groups
+ *
+ * a cross is present in a row if all its groups are, and its id is the
+ * chained hash of the hashes of the groups, in the order given. the i-th
+ * cross has the group id num_groups + i.
+ *
+ * the crosses are generated in memory while parsing text, so the text input
+ * stays the same size and the extra cost is the crosses generated. the
+ * converter reads feature_crosses too, so a rec or col file converted from
+ * text stores the crosses, and reading it needs no crossing again
+ */
+class FeatureCross {
+ public:
+  /**
+   * \brief the parameters used by \ref Reader, set by the learners and the
+   * converter
+   */
+  static FeatureCrossParam* DefaultParam() {
+    static FeatureCrossParam param;
+    return &param;
+  }
+
+  /**
+   * \param crosses the crosses, see \ref FeatureCrossParam
+   * \param num_groups the group ids of a row are in [0, num_groups)
+   * \param nbits the number of bits used to encode the group id
+   */
+  FeatureCross(const std::string& crosses, int num_groups, int nbits)
+      : num_groups_(num_groups), nbits_(nbits) {
+    std::stringstream ss(crosses);
+    std::string item;
+    while (std::getline(ss, item, ';')) {
+      if (item.find_first_not_of(" \t") == std::string::npos) continue;
+      std::vector<int> grps;
+      std::stringstream is(item);
+      std::string g;
+      while (std::getline(is, g, ',')) {
+        char* end;
+        long gid = strtol(g.c_str(), &end, 10);  // NOLINT(runtime/int)
+        CHECK(end != g.c_str() && *end == '\0')
+            << "invalid group id '" << g << "' in feature_crosses";
+        CHECK(gid >= 0 && gid < num_groups)
+            << "group " << gid << " is not in [0, " << num_groups << ")";
+        grps.push_back(static_cast<int>(gid));
+      }
+      CHECK_GE(grps.size(), 2U)
+          << "a cross needs two or more groups: " << item;
+      crosses_.push_back(grps);
+    }
+    CHECK_LT(num_groups_ + crosses_.size(), static_cast<size_t>(1) << nbits_)
+        << "too many crosses for " << nbits_ << " bits of group ids";
+  }
+
+  /** \brief returns true if no cross is generated */
+  bool Empty() const { return crosses_.empty(); }
+
+  /** \brief the number of crosses */
+  size_t Size() const { return crosses_.size(); }
+
+  /**
+   * \brief append the crosses of a row into index
+   *
+   * \param hashes the hash of each group, before encoding the group id
+   * \param present whether a group is present in the row
+   */
+  void Append(const feaid_t* hashes, const bool* present,
+              std::vector<feaid_t>* index) const {
+    for (size_t i = 0; i < crosses_.size(); ++i) {
+      const auto& grps = crosses_[i];
+      feaid_t h = 0;
+      bool all = true;
+      for (int g : grps) {
+        if (!present[g]) { all = false; break; }
+        h = hash::Int(h * 0x9E3779B97F4A7C15ULL + hashes[g]);
+      }
+      if (all) {
+        index->push_back(EncodeFeaGrpID(h, num_groups_ + i, nbits_));
+      }
+    }
+  }
+
+ private:
+  int num_groups_;
+  int nbits_;
+  std::vector<std::vector<int>> crosses_;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_READER_FEATURE_CROSS_H_
@@ -0,0 +1,146 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ * @file   libsvm_parser.h
+ * @brief  parse libsvm data format
+ */
+#ifndef DIFACTO_READER_LIBSVM_PARSER_H_
+#define DIFACTO_READER_LIBSVM_PARSER_H_
+#include <algorithm>
+#include <vector>
+#include "dmlc/omp.h"
+#include "difacto/base.h"
+#include "data/row_block.h"
+#include "data/parser.h"
+#include "data/strtonum.h"
+#include "./text_tokenizer.h"
+namespace difacto {
+
+/**
+ * \brief libsvm dataset, each line is
+ *  <label> <index>:<value> <index>:<value> ...
+ *
+ * the indices are converted while scanning their digits. most datasets are
+ * binary, so a value of 1 is not parsed, and the values are stored only once
+ * a block has a value other than 1. a token not starting with a digit, such
+ * as qid:1, is skipped
+ */
+class LibSVMParser : public dmlc::data::ParserImpl<feaid_t> {
+ public:
+  /**
+   * \param source the input
+   * \param nthreads the number of threads to parse a chunk
+   */
+  explicit LibSVMParser(dmlc::InputSplit *source, int nthreads = 1)
+      : bytes_read_(0), source_(source), nthreads_(std::max(nthreads, 1)) { }
+  virtual ~LibSVMParser() {
+    delete source_;
+  }
+
+  void BeforeFirst(void) override {
+    source_->BeforeFirst();
+  }
+  size_t BytesRead(void) const override {
+    return bytes_read_;
+  }
+  bool ParseNext(
+      std::vector<dmlc::data::RowBlockContainer<feaid_t> > *data) override {
+    dmlc::InputSplit::Blob chunk;
+    if (!source_->NextChunk(&chunk)) return false;
+
+    CHECK_NE(chunk.size, 0);
+    bytes_read_ += chunk.size;
+    char *p = reinterpret_cast<char*>(chunk.dptr);
+    char *end = p + chunk.size;
+    // each thread parses its own lines into its own block
+    std::vector<char*> bounds;
+    SplitLines(p, end, nthreads_, &bounds);
+    data->resize(nthreads_);
+#pragma omp parallel for num_threads(nthreads_)
+    for (int i = 0; i < nthreads_; ++i) {
+      ParseBlock(bounds[i], bounds[i+1], &(*data)[i]);
+    }
+    // the blocks of a chunk either all have values or none
+    bool has_value = false;
+    for (const auto& blk : *data) has_value |= blk.value.size() > 0;
+    if (has_value) {
+      for (auto& blk : *data) blk.value.resize(blk.index.size(), 1);
+    }
+    return true;
+  }
+
+ private:
+  /**
+   * \brief parse the lines in [p, end) into blk
+   */
+  void ParseBlock(char *p, char *end,
+                  dmlc::data::RowBlockContainer<feaid_t>* blk) {
+    using dmlc::data::isdigit;
+    using dmlc::data::isspace;
+    blk->Clear();
+    // each feature has a ':'
+    size_t nlines = CountChar(p, end, '\n') + 1;
+    blk->label.reserve(nlines);
+    blk->offset.reserve(nlines + 1);
+    blk->index.reserve(CountChar(p, end, ':'));
+    feaid_t max_index = 0;
+    while (p != end) {
+      while (p != end && isspace(*p)) ++p;
+      if (p == end) break;
+      p = ParseLabel(p, end, blk);
+      while (p != end && *p != '\n') {
+        if (isspace(*p)) { ++p; continue; }
+        if (!isdigit(*p)) {
+          while (p != end && !isspace(*p)) ++p;
+          continue;
+        }
+        feaid_t idx = 0;
+        for (; p != end && isdigit(*p); ++p) idx = idx * 10 + (*p - '0');
+        blk->index.push_back(idx);
+        max_index = std::max(max_index, idx);
+        real_t v = 1;
+        if (p != end && *p == ':') {
+          ++p;
+          if (p != end && *p == '1' && (p + 1 == end || isspace(p[1]))) {
+            // the fast path of a binary value
+            ++p;
+          } else {
+            char* q;
+            v = dmlc::data::strtof(p, &q);
+            p = q;
+          }
+        }
+        if (v != 1 || blk->value.size()) {
+          blk->value.resize(blk->index.size() - 1, 1);
+          blk->value.push_back(v);
+        }
+      }
+      blk->offset.push_back(blk->index.size());
+    }
+    blk->max_index = max_index;
+  }
+
+  /** \brief parse the label at p, the common 0, 1, -1 and +1 are fast */
+  static char* ParseLabel(char* p, char* end,
+                          dmlc::data::RowBlockContainer<feaid_t>* blk) {
+    char* q = p;
+    real_t sign = 1;
+    if (*q == '-' || *q == '+') sign = *q++ == '-' ? -1 : 1;
+    if (q != end && (*q == '0' || *q == '1') &&
+        (q + 1 == end || dmlc::data::isspace(q[1]))) {
+      blk->label.push_back(sign * (*q - '0'));
+      return q + 1;
+    }
+    blk->label.push_back(dmlc::data::strtof(p, &q));
+    CHECK_NE(p, q) << "no label";
+    return q;
+  }
+
+  // number of bytes readed
+  size_t bytes_read_;
+  // source split that provides the data
+  dmlc::InputSplit *source_;
+  int nthreads_;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_READER_LIBSVM_PARSER_H_
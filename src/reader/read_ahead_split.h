@@ -0,0 +1,422 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ * @file   read_ahead_split.h
+ * @brief  an input split reading ahead by concurrent range reads
+ */
+#ifndef DIFACTO_READER_READ_AHEAD_SPLIT_H_
+#define DIFACTO_READER_READ_AHEAD_SPLIT_H_
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "dmlc/io.h"
+#include "dmlc/parameter.h"
+#include "dmlc/timer.h"
+#include "io/filesys.h"
+namespace difacto {
+
+/**
+ * \brief the read-ahead of data_in, for the remote storages such as s3 and
+ * hdfs, whose single stream is bounded by the latency rather than the
+ * bandwidth
+ */
+struct ReadAheadParam : public dmlc::Parameter<ReadAheadParam> {
+  /**
+   * \brief the number of range reads in flight for a partition, such as 8
+   * for s3. 0 means the sequential dmlc::InputSplit is used
+   */
+  int read_ahead_depth;
+  /** \brief the MB of a range read */
+  int read_ahead_chunk_mb;
+  DMLC_DECLARE_PARAMETER(ReadAheadParam) {
+    DMLC_DECLARE_FIELD(read_ahead_depth).set_range(0, 64).set_default(0);
+    DMLC_DECLARE_FIELD(read_ahead_chunk_mb).set_range(1, 1024).set_default(8);
+  }
+};
+
+/**
+ * \brief an input split of text lines or recordio records, which reads its
+ * partition by range reads of chunk bytes, with up to depth of them in
+ * flight, each by its own thread and stream. the chunks read are kept in a
+ * bounded buffer of depth chunks, and returned in order
+ *
+ * the files and the partition are the same as dmlc::InputSplit: a partition
+ * is an even range of the bytes of all files, moved to the next line or
+ * record
+ */
+class ReadAheadSplit : public dmlc::InputSplit {
+ public:
+  /** \brief the parameters used by \ref Reader, set by the learners */
+  static ReadAheadParam* DefaultParam() {
+    static ReadAheadParam param;
+    return &param;
+  }
+
+  /**
+   * \brief create a read-ahead split if read_ahead_depth is positive in the
+   * default parameters, otherwise a dmlc::InputSplit
+   * \param type "text" or "recordio"
+   */
+  static dmlc::InputSplit* Create(const std::string& uri, unsigned part_index,
+                                  unsigned num_parts, const char* type) {
+    const auto& param = *DefaultParam();
+    if (param.read_ahead_depth == 0) {
+      return dmlc::InputSplit::Create(uri.c_str(), part_index, num_parts, type);
+    }
+    return new ReadAheadSplit(uri, part_index, num_parts,
+                              !strcmp(type, "recordio"),
+                              param.read_ahead_depth,
+                              static_cast<size_t>(param.read_ahead_chunk_mb)
+                              << 20);
+  }
+
+  /**
+   * \param uri files or directories separated by ';'
+   * \param part_index the partition
+   * \param num_parts the number of partitions
+   * \param recordio records of dmlc::RecordIOWriter, otherwise text lines
+   * \param depth the number of range reads in flight
+   * \param chunk_bytes the bytes of a range read
+   */
+  ReadAheadSplit(const std::string& uri, unsigned part_index,
+                 unsigned num_parts, bool recordio, int depth,
+                 size_t chunk_bytes)
+      : recordio_(recordio), depth_(std::max(depth, 1)),
+        chunk_bytes_(std::max(chunk_bytes, static_cast<size_t>(64))) {
+    ListFiles(uri);
+    size_t total = files_.empty() ? 0 : files_.back().end;
+    size_t align = recordio_ ? 4 : 1;
+    size_t step = (total + num_parts - 1) / num_parts;
+    step = (step + align - 1) / align * align;
+    begin_ = SeekRecordBegin(std::min(step * part_index, total));
+    end_ = SeekRecordBegin(std::min(step * (part_index + 1), total));
+    // the range reads in the partition, which do not cross the files
+    for (size_t f = 0; f < files_.size(); ++f) {
+      size_t a = std::max(begin_, files_[f].begin);
+      size_t b = std::min(end_, files_[f].end);
+      for (; a < b; a += chunk_bytes_) {
+        size_t e = std::min(a + chunk_bytes_, b);
+        ranges_.push_back(RangeRead{f, a - files_[f].begin, e - a, e == b});
+      }
+    }
+    bufs_.resize(depth_);
+    Start();
+  }
+  virtual ~ReadAheadSplit() { Stop(); }
+
+  /** \brief the chunk size is read_ahead_chunk_mb */
+  void HintChunkSize(size_t chunk_size) override { }
+  size_t GetTotalSize() override { return end_ - begin_; }
+
+  void BeforeFirst() override {
+    Stop();
+    Start();
+  }
+
+  bool NextChunk(Blob* out_chunk) override {
+    while (true) {
+      if (next_ == ranges_.size()) return false;
+      const RangeRead& r = ranges_[next_];
+      out_.swap(carry_);
+      carry_.clear();
+      {
+        std::unique_lock<std::mutex> lk(mu_);
+        Buf& buf = bufs_[next_ % depth_];
+        cond_.wait(lk, [&buf]{ return buf.ready; });
+        out_.append(buf.data);
+        buf.ready = false;
+        ++next_;
+      }
+      cond_.notify_all();
+      // a chunk ends at a line or a record, the rest goes to the next one
+      size_t cut = r.last ? out_.size() : LastRecordEnd(out_);
+      carry_.assign(out_, cut, std::string::npos);
+      out_.resize(cut);
+      if (!recordio_ && r.last && out_.size() && out_.back() != '\n') {
+        out_.push_back('\n');
+      }
+      if (out_.empty()) continue;
+      out_chunk->dptr = &out_[0];
+      out_chunk->size = out_.size();
+      return true;
+    }
+  }
+
+  bool NextRecord(Blob* out_rec) override {
+    while (true) {
+      if (rec_pos_ == rec_chunk_.size) {
+        if (!NextChunk(&rec_chunk_)) return false;
+        rec_pos_ = 0;
+      }
+      char* p = static_cast<char*>(rec_chunk_.dptr);
+      if (!recordio_) {
+        // a line, without the empty ones
+        char* head = p + rec_pos_;
+        char* end = p + rec_chunk_.size;
+        char* q = head;
+        while (q != end && *q != '\n' && *q != '\r') ++q;
+        rec_pos_ = q - p + (q != end);
+        if (q == head) continue;
+        out_rec->dptr = head;
+        out_rec->size = q - head;
+        return true;
+      }
+      // the parts of a record split at the magics are joined by the magics
+      uint32_t cflag, len;
+      Header(p + rec_pos_, &cflag, &len);
+      rec_pos_ += 8;
+      if (cflag == 0) {
+        out_rec->dptr = p + rec_pos_;
+        out_rec->size = len;
+        rec_pos_ += Pad(len);
+        return true;
+      }
+      rec_.assign(p + rec_pos_, len);
+      rec_pos_ += Pad(len);
+      while (cflag != 3) {
+        Header(p + rec_pos_, &cflag, &len);
+        rec_pos_ += 8;
+        uint32_t magic = kMagic;
+        rec_.append(reinterpret_cast<char*>(&magic), 4);
+        rec_.append(p + rec_pos_, len);
+        rec_pos_ += Pad(len);
+      }
+      out_rec->dptr = &rec_[0];
+      out_rec->size = rec_.size();
+      return true;
+    }
+  }
+
+  /** \brief the bytes read so far */
+  size_t bytes_read() const { return bytes_read_; }
+  /** \brief the seconds with at least one range read in flight */
+  double read_sec() {
+    std::lock_guard<std::mutex> lk(mu_);
+    return read_sec_ + (active_ ? dmlc::GetTime() - active_start_ : 0);
+  }
+
+ private:
+  /** \brief the magic of dmlc::RecordIOWriter */
+  static const uint32_t kMagic = 0xced7230a;
+
+  struct File {
+    std::string path;
+    /** \brief the range in all files */
+    size_t begin, end;
+  };
+  struct RangeRead {
+    size_t file;
+    size_t pos, size;
+    /** \brief the last one of the file in this partition */
+    bool last;
+  };
+  struct Buf {
+    std::string data;
+    bool ready = false;
+  };
+
+  void ListFiles(const std::string& uri) {
+    size_t begin = 0;
+    std::vector<std::string> paths;
+    for (size_t i = 0; i <= uri.size(); ++i) {
+      if (i < uri.size() && uri[i] != ';') continue;
+      if (i > begin) paths.push_back(uri.substr(begin, i - begin));
+      begin = i + 1;
+    }
+    size_t pos = 0;
+    for (const auto& path : paths) {
+      dmlc::io::URI path_uri(path.c_str());
+      auto fs = dmlc::io::FileSystem::GetInstance(path_uri.protocol);
+      auto info = fs->GetPathInfo(path_uri);
+      std::vector<dmlc::io::FileInfo> files;
+      if (info.type == dmlc::io::kDirectory) {
+        fs->ListDirectory(path_uri, &files);
+        std::sort(files.begin(), files.end(),
+                  [](const dmlc::io::FileInfo& a, const dmlc::io::FileInfo& b) {
+                    return a.path.str() < b.path.str();
+                  });
+      } else {
+        files.push_back(info);
+      }
+      for (const auto& f : files) {
+        if (f.type != dmlc::io::kFile || f.size == 0) continue;
+        files_.push_back(File{f.path.str(), pos, pos + f.size});
+        pos += f.size;
+      }
+    }
+    CHECK(files_.size()) << "no data in " << uri;
+  }
+
+  /**
+   * \brief the first line or record at or after pos, of all files. a line
+   * starts after a newline, and a record starts at a magic followed by the
+   * flag of a first part
+   */
+  size_t SeekRecordBegin(size_t pos) {
+    size_t f = 0;
+    while (f < files_.size() && files_[f].end <= pos) ++f;
+    if (f == files_.size() || files_[f].begin == pos) return pos;
+    std::unique_ptr<dmlc::SeekStream> fi(
+        dmlc::SeekStream::CreateForRead(files_[f].path.c_str()));
+    size_t offset = pos - files_[f].begin;
+    fi->Seek(offset);
+    std::string buf(4096, 0);
+    char prev = 0;
+    uint32_t word = 0;
+    bool magic = false;
+    while (true) {
+      size_t n = fi->Read(&buf[0], buf.size());
+      if (n == 0) return files_[f].end;
+      for (size_t i = 0; i < n; ++i, ++offset) {
+        char c = buf[i];
+        if (!recordio_) {
+          bool nl = c == '\n' || c == '\r';
+          if ((prev == '\n' || prev == '\r') && !nl) {
+            return files_[f].begin + offset;
+          }
+          prev = c;
+          continue;
+        }
+        // offset is aligned to 4 bytes, so are the words
+        word = (word >> 8) | (static_cast<uint32_t>(
+            static_cast<unsigned char>(c)) << 24);
+        if ((offset & 3) != 3) continue;
+        if (magic && ((word >> 29) == 0 || (word >> 29) == 1)) {
+          return files_[f].begin + offset - 7;
+        }
+        magic = word == kMagic;
+      }
+    }
+  }
+
+  /** \brief the end of the last complete line or record in data */
+  size_t LastRecordEnd(const std::string& data) const {
+    if (!recordio_) {
+      // not at a '\r', which may be followed by a '\n'
+      size_t p = data.rfind('\n');
+      return p == std::string::npos ? 0 : p + 1;
+    }
+    size_t pos = 0, last = 0;
+    while (pos + 8 <= data.size()) {
+      uint32_t cflag, len;
+      Header(&data[pos], &cflag, &len);
+      size_t next = pos + 8 + Pad(len);
+      if (next > data.size()) break;
+      pos = next;
+      if (cflag == 0 || cflag == 3) last = pos;
+    }
+    return last;
+  }
+
+  static void Header(char const* p, uint32_t* cflag, uint32_t* len) {
+    uint32_t magic, lrec;
+    memcpy(&magic, p, 4);
+    memcpy(&lrec, p + 4, 4);
+    CHECK_EQ(magic, static_cast<uint32_t>(kMagic))
+        << "invalid recordio format";
+    *cflag = lrec >> 29;
+    *len = lrec & ((1U << 29) - 1);
+  }
+  static size_t Pad(size_t len) { return (len + 3) / 4 * 4; }
+
+  /** \brief start the range reads from the beginning */
+  void Start() {
+    next_ = 0;
+    rec_pos_ = rec_chunk_.size = 0;
+    carry_.clear();
+    stop_ = false;
+    fetch_next_ = 0;
+    for (auto& buf : bufs_) buf.ready = false;
+    int nthreads = std::min(static_cast<size_t>(depth_), ranges_.size());
+    for (int i = 0; i < nthreads; ++i) {
+      threads_.push_back(std::thread([this]() { Fetch(); }));
+    }
+  }
+
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      stop_ = true;
+    }
+    cond_.notify_all();
+    for (auto& t : threads_) t.join();
+    threads_.clear();
+  }
+
+  /** \brief the loop of a read thread */
+  void Fetch() {
+    std::unique_ptr<dmlc::SeekStream> fi;
+    size_t cur_file = files_.size();
+    std::string data;
+    while (true) {
+      size_t k = fetch_next_++;
+      if (k >= ranges_.size()) return;
+      {
+        // wait until the buffer is returned
+        std::unique_lock<std::mutex> lk(mu_);
+        cond_.wait(lk, [this, k]{ return stop_ || k < next_ + depth_; });
+        if (stop_) return;
+        if (active_++ == 0) active_start_ = dmlc::GetTime();
+      }
+      const RangeRead& r = ranges_[k];
+      if (r.file != cur_file) {
+        cur_file = r.file;
+        fi.reset(dmlc::SeekStream::CreateForRead(
+            files_[cur_file].path.c_str()));
+      }
+      fi->Seek(r.pos);
+      data.resize(r.size);
+      for (size_t n = 0; n < r.size; ) {
+        size_t m = fi->Read(&data[n], r.size - n);
+        CHECK_NE(m, 0) << "failed to read " << files_[cur_file].path;
+        n += m;
+      }
+      bytes_read_ += r.size;
+      {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (--active_ == 0) read_sec_ += dmlc::GetTime() - active_start_;
+        Buf& buf = bufs_[k % depth_];
+        buf.data.swap(data);
+        buf.ready = true;
+      }
+      cond_.notify_all();
+    }
+  }
+
+  bool recordio_;
+  size_t depth_;
+  size_t chunk_bytes_;
+  std::vector<File> files_;
+  /** \brief the partition in all files */
+  size_t begin_, end_;
+  std::vector<RangeRead> ranges_;
+
+  std::mutex mu_;
+  std::condition_variable cond_;
+  std::vector<std::thread> threads_;
+  bool stop_ = false;
+  /** \brief the next range read to issue and to return */
+  std::atomic<size_t> fetch_next_{0};
+  size_t next_ = 0;
+  /** \brief the buffer of range k is bufs_[k % depth_] */
+  std::vector<Buf> bufs_;
+  /** \brief the chunk returned, and the partial line or record after it */
+  std::string out_, carry_;
+  /** \brief the chunk of the records being returned, and the position */
+  Blob rec_chunk_;
+  size_t rec_pos_ = 0;
+  std::string rec_;
+
+  std::atomic<size_t> bytes_read_{0};
+  int active_ = 0;
+  double active_start_ = 0, read_sec_ = 0;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_READER_READ_AHEAD_SPLIT_H_
@@ -3,55 +3,202 @@
  */
 #ifndef DIFACTO_READER_READER_H_
 #define DIFACTO_READER_READER_H_
+#include <atomic>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include "difacto/base.h"
 #include "dmlc/data.h"
+#include "dmlc/threadediter.h"
+#include "dmlc/timer.h"
 #include "data/parser.h"
-#include "data/libsvm_parser.h"
 #include "./adfea_parser.h"
+#include "./columnar_parser.h"
 #include "./crb_parser.h"
 #include "./criteo_parser.h"
+#include "./read_ahead_split.h"
+#include "./libsvm_parser.h"
+#include "common/profiler.h"
 namespace difacto {
+/**
+ * \brief a parser records the time spent on parsing, internal use
+ */
+class TimedParser : public dmlc::data::ParserImpl<feaid_t> {
+ public:
+  explicit TimedParser(dmlc::data::ParserImpl<feaid_t>* base) : base_(base) { }
+  virtual ~TimedParser() { delete base_; }
+
+  void BeforeFirst(void) override { base_->BeforeFirst(); }
+  size_t BytesRead(void) const override { return base_->BytesRead(); }
+  bool ParseNext(
+      std::vector<dmlc::data::RowBlockContainer<feaid_t> > *data) override {
+    double start = dmlc::GetTime();
+    bool ret;
+    {
+      DIFACTO_PROFILE_SCOPE(kParse);
+      ret = base_->ParseNext(data);
+    }
+    // only the parsing thread writes it
+    parse_sec_.store(parse_sec_.load() + dmlc::GetTime() - start);
+#if DIFACTO_PROFILE
+    size_t nrows = 0;
+    if (ret) for (const auto& blk : *data) nrows += blk.Size();
+    DIFACTO_PROFILE_COUNT(kParse, nrows);
+#endif  // DIFACTO_PROFILE
+    return ret;
+  }
+  /** \brief the seconds spent on parsing */
+  double parse_sec() const { return parse_sec_; }
+
+ private:
+  dmlc::data::ParserImpl<feaid_t>* base_;
+  std::atomic<double> parse_sec_{0};
+};
+
 /**
  * \brief a reader reads a chunk of data with roughly same size a time
+ *
+ * a chunk is parsed in a background thread, with nthreads threads for text
+ * formats, while the previous chunk is being processed. a parsed chunk is
+ * reused for the next chunks once its blocks are passed, unless it is held by
+ * \ref Hold
  */
 class Reader {
  public:
-  Reader() { parser_ = nullptr; }
+  Reader() { }
   Reader(const std::string& uri,
          const std::string& format,
          int part_index,
          int num_parts,
-         int chunk_size_hint) {
-    char const* c_uri = uri.c_str();
-    dmlc::InputSplit* input = dmlc::InputSplit::Create(
-        c_uri, part_index, num_parts, format == "rec" ? "recordio" : "text");
+         int chunk_size_hint,
+         int nthreads = 1) {
+    dmlc::InputSplit* input = ReadAheadSplit::Create(
+        uri, part_index, num_parts,
+        format == "rec" || format == "col" ? "recordio" : "text");
     input->HintChunkSize(chunk_size_hint);
+    read_ahead_ = dynamic_cast<ReadAheadSplit*>(input);
 
+    dmlc::data::ParserImpl<feaid_t>* parser = nullptr;
     if (format == "libsvm") {
-      parser_ = new dmlc::data::LibSVMParser<feaid_t>(input, 1);
+      parser = new LibSVMParser(input, nthreads);
     } else if (format == "criteo") {
-      parser_ = new CriteoParser(input, true);
+      parser = new CriteoParser(input, true, nthreads,
+                                FeatureCross::DefaultParam()->feature_crosses);
     } else if (format == "criteo_test") {
-      parser_ = new CriteoParser(input, false);
+      parser = new CriteoParser(input, false, nthreads,
+                                FeatureCross::DefaultParam()->feature_crosses);
     } else if (format ==  "adfea") {
-      parser_ = new AdfeaParser(input);
+      parser = new AdfeaParser(input, nthreads);
     } else if (format == "rec") {
-      parser_ = new CRBParser(input);
+      parser = new CRBParser(input, nthreads);
+    } else if (format == "col") {
+      parser = new ColumnarParser(input, nthreads);
     } else {
       LOG(FATAL) << "unknown format " << format;
     }
-    parser_ = new dmlc::data::ThreadedParser<feaid_t>(parser_);
+    timer_ = new TimedParser(parser);
+    // as dmlc::data::ThreadedParser, but the chunks can be held
+    TimedParser* timer = timer_;
+    iter_.set_max_capacity(8);
+    iter_.Init([timer](Chunk** chunk) {
+        if (*chunk == nullptr) *chunk = new Chunk();
+        return timer->ParseNext(*chunk);
+      }, [timer]() { timer->BeforeFirst(); });
   }
 
-  virtual ~Reader() { delete parser_; }
+  virtual ~Reader() {
+    if (!timer_) return;
+    iter_.Destroy();
+    // the chunks held or being read are not owned by iter_
+    std::unordered_set<Chunk*> chunks;
+    for (const auto& it : holds_) chunks.insert(it.first);
+    if (chunk_) chunks.insert(chunk_);
+    for (Chunk* c : chunks) delete c;
+    delete timer_;
+  }
 
-  virtual bool Next() { return parser_->Next(); }
+  virtual bool Next() {
+    double start = dmlc::GetTime();
+    bool ret = NextBlock();
+    wait_sec_ += dmlc::GetTime() - start;
+    return ret;
+  }
 
-  virtual const dmlc::RowBlock<feaid_t>& Value() const { return parser_->Value(); }
+  virtual const dmlc::RowBlock<feaid_t>& Value() const { return blk_; }
+
+  /**
+   * \brief keep the block of \ref Value valid after \ref Next, until \ref
+   * Release is called with the returned handle. so the blocks can be pooled
+   * without copying them
+   */
+  virtual void* Hold() {
+    CHECK_NOTNULL(chunk_);
+    ++holds_[chunk_];
+    return chunk_;
+  }
+
+  /** \brief release a block held by \ref Hold */
+  virtual void Release(void* handle) {
+    Chunk* chunk = static_cast<Chunk*>(handle);
+    auto it = holds_.find(chunk);
+    CHECK(it != holds_.end());
+    if (--it->second > 0) return;
+    holds_.erase(it);
+    // the current chunk is recycled once its blocks are passed
+    if (chunk != chunk_) iter_.Recycle(&chunk);
+  }
+
+  /** \brief the seconds spent on parsing, in the background */
+  virtual double parse_sec() const { return timer_ ? timer_->parse_sec() : 0; }
+  /** \brief the seconds waited in Next for the parsed data */
+  virtual double wait_sec() const { return wait_sec_; }
+  /** \brief the bytes read by the read-ahead, 0 if not used */
+  virtual size_t read_bytes() const {
+    return read_ahead_ ? read_ahead_->bytes_read() : 0;
+  }
+  /** \brief the seconds the read-ahead has range reads in flight */
+  virtual double read_sec() const {
+    return read_ahead_ ? read_ahead_->read_sec() : 0;
+  }
 
  private:
-  dmlc::data::ParserImpl<feaid_t>* parser_;
+  /** \brief the blocks parsed from a chunk, one per parsing thread */
+  using Chunk = std::vector<dmlc::data::RowBlockContainer<feaid_t>>;
+
+  /** \brief move to the next nonempty block */
+  bool NextBlock() {
+    while (true) {
+      while (chunk_ && pos_ < chunk_->size()) {
+        const auto& blk = (*chunk_)[pos_++];
+        if (blk.Size() == 0) continue;
+        blk_ = blk.GetBlock();
+        return true;
+      }
+      if (chunk_) {
+        if (holds_.count(chunk_)) {
+          chunk_ = nullptr;
+        } else {
+          iter_.Recycle(&chunk_);
+        }
+      }
+      if (!iter_.Next(&chunk_)) return false;
+      pos_ = 0;
+    }
+  }
+
+  /** \brief owns the parser */
+  TimedParser* timer_ = nullptr;
+  /** \brief owned by the parser, if the read-ahead is used */
+  ReadAheadSplit* read_ahead_ = nullptr;
+  dmlc::ThreadedIter<Chunk> iter_;
+  /** \brief the chunk being read, and the position of the next block */
+  Chunk* chunk_ = nullptr;
+  size_t pos_ = 0;
+  dmlc::RowBlock<feaid_t> blk_;
+  /** \brief the number of held blocks of a chunk */
+  std::unordered_map<Chunk*, int> holds_;
+  double wait_sec_ = 0;
 };
 
 }  // namespace difacto
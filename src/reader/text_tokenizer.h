@@ -0,0 +1,82 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ * @file   text_tokenizer.h
+ * @brief  helpers to split text chunks into lines and fields
+ */
+#ifndef DIFACTO_READER_TEXT_TOKENIZER_H_
+#define DIFACTO_READER_TEXT_TOKENIZER_H_
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif  // __SSE2__
+#include <string.h>
+#include <algorithm>
+#include <vector>
+namespace difacto {
+
+/**
+ * \brief returns the first c in [p, end), or end if not found
+ */
+inline char* FindChar(char* p, char* end, char c) {
+  void* q = memchr(p, c, end - p);
+  return q ? reinterpret_cast<char*>(q) : end;
+}
+
+/**
+ * \brief returns the first c1 or c2 in [p, end), or end if not found
+ *
+ * 16 bytes are compared at a time if SSE2 is available
+ */
+inline char* FindChar(char* p, char* end, char c1, char c2) {
+#if defined(__SSE2__)
+  __m128i v1 = _mm_set1_epi8(c1);
+  __m128i v2 = _mm_set1_epi8(c2);
+  for (; end - p >= 16; p += 16) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+    int m = _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(x, v1), _mm_cmpeq_epi8(x, v2)));
+    if (m) return p + __builtin_ctz(m);
+  }
+#endif  // __SSE2__
+  while (p != end && *p != c1 && *p != c2) ++p;
+  return p;
+}
+
+/**
+ * \brief returns the number of c in [p, end)
+ *
+ * it is used to pre-size the outputs before parsing a chunk
+ */
+inline size_t CountChar(const char* p, const char* end, char c) {
+  size_t n = 0;
+#if defined(__SSE2__)
+  __m128i v = _mm_set1_epi8(c);
+  for (; end - p >= 16; p += 16) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+    n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(x, v)));
+  }
+#endif  // __SSE2__
+  for (; p != end; ++p) n += *p == c;
+  return n;
+}
+
+/**
+ * \brief divides [p, end) into nparts segments with about the same size, each
+ * of them starts at the beginning of a line
+ *
+ * \param bounds the i-th segment is [bounds[i], bounds[i+1])
+ */
+inline void SplitLines(char* p, char* end, int nparts,
+                       std::vector<char*>* bounds) {
+  bounds->resize(nparts + 1);
+  (*bounds)[0] = p;
+  size_t step = (end - p) / nparts;
+  for (int i = 1; i < nparts; ++i) {
+    char* q = std::max(p + i * step, (*bounds)[i-1]);
+    q = FindChar(q, end, '\n');
+    (*bounds)[i] = q == end ? end : q + 1;
+  }
+  (*bounds)[nparts] = end;
+}
+
+}  // namespace difacto
+#endif  // DIFACTO_READER_TEXT_TOKENIZER_H_
@@ -0,0 +1,70 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_REPORTER_DIST_REPORTER_H_
+#define DIFACTO_REPORTER_DIST_REPORTER_H_
+#include <mutex>
+#include <string>
+#include "difacto/reporter.h"
+#include "difacto/node_id.h"
+#include "ps/ps.h"
+namespace difacto {
+/**
+ * \brief a reporter which runs over mutliple machines
+ *
+ * a report is a request to the scheduler, which calls the monitor and then
+ * responses. so a report is finished once the monitor has processed it. the
+ * reports arrive before the monitor is set are dropped
+ */
+class DistReporter : public Reporter {
+ public:
+  DistReporter() { }
+  virtual ~DistReporter() { delete app_; }
+
+  KWArgs Init(const KWArgs& kwargs) override {
+    using namespace std::placeholders;
+    app_ = new ps::SimpleApp(kAppID);
+    if (IsScheduler()) {
+      app_->set_request_handle(
+          std::bind(&DistReporter::OnReport, this, _1, _2));
+    }
+    return kwargs;
+  }
+
+  void SetMonitor(const Monitor& monitor) override {
+    std::lock_guard<std::mutex> lk(mu_);
+    monitor_ = monitor;
+  }
+
+  int Report(const std::string& report) override {
+    return app_->Request(kReport, report, ps::kScheduler);
+  }
+
+  void Wait(int timestamp) override { app_->Wait(timestamp); }
+
+ private:
+  /** \brief the ps-lite customer id, different to the tracker's and store's */
+  static const int kAppID = 3;
+  static const int kReport = 0;
+
+  /** \brief the scheduler receives a report */
+  void OnReport(const ps::SimpleData& req, ps::SimpleApp* app) {
+    Monitor monitor;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      monitor = monitor_;
+    }
+    if (monitor) {
+      int id = req.sender;
+      int group = id % 2 ? NodeID::kWorkerGroup : NodeID::kServerGroup;
+      monitor(NodeID::Encode(group, ps::Postoffice::IDtoRank(id)), req.body);
+    }
+    app->Response(req);
+  }
+
+  ps::SimpleApp* app_ = nullptr;
+  std::mutex mu_;
+  Monitor monitor_;
+};
+}  // namespace difacto
+#endif  // DIFACTO_REPORTER_DIST_REPORTER_H_
@@ -0,0 +1,116 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_REPORTER_PROFILE_REPORTER_H_
+#define DIFACTO_REPORTER_PROFILE_REPORTER_H_
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "difacto/reporter.h"
+#include "common/profiler.h"
+namespace difacto {
+
+/**
+ * \brief sends the profile of this process to the scheduler through
+ * \ref Reporter
+ *
+ * a node reports the stats since its previous report, on \ref Flush and every
+ * report_sec by a background thread, and the scheduler sums them until
+ * \ref Take. a worker flushes at the end of a job, so the stats of a job are
+ * taken once the job is finished, while the ones of a server may be taken by
+ * the next epoch. it does nothing unless enabled, which is DIFACTO_PROFILE
+ * by default
+ */
+class ProfileReporter {
+ public:
+  ProfileReporter() { }
+  ~ProfileReporter() {
+    if (thread_.joinable()) {
+      {
+        std::lock_guard<std::mutex> lk(mu_);
+        done_ = true;
+      }
+      cond_.notify_all();
+      thread_.join();
+    }
+    delete reporter_;
+  }
+
+  /**
+   * \brief start reporting, report_sec <= 0 means only on Flush
+   *
+   * enabled is evaluated by the caller, so this function is the same in all
+   * compile units
+   */
+  void Init(double report_sec, bool enabled = DIFACTO_PROFILE) {
+    if (!enabled) return;
+    reporter_ = Reporter::Create();
+    reporter_->Init(KWArgs());
+    if (IsScheduler()) {
+      reporter_->SetMonitor([this](int node_id, const std::string& report) {
+          ProfileStats stats;
+          stats.ParseFromString(report);
+          std::lock_guard<std::mutex> lk(mu_);
+          total_.Merge(stats);
+        });
+    }
+    if ((!IsDistributed() || !IsScheduler()) && report_sec > 0) {
+      thread_ = std::thread([this, report_sec]() {
+          auto period = std::chrono::duration<double>(report_sec);
+          std::unique_lock<std::mutex> lk(mu_);
+          while (!cond_.wait_for(lk, period, [this]() { return done_; })) {
+            lk.unlock();
+            Send(false);
+            lk.lock();
+          }
+        });
+    }
+  }
+
+  /** \brief report the stats since the previous report and wait */
+  void Flush() {
+    if (reporter_) Send(true);
+  }
+
+  /** \brief returns the stats received since the previous call, and clear */
+  ProfileStats Take() {
+    std::lock_guard<std::mutex> lk(mu_);
+    ProfileStats stats = total_;
+    total_ = ProfileStats();
+    return stats;
+  }
+
+ private:
+  /**
+   * \brief the background thread does not wait, the scheduler may be gone
+   * once the training is finished
+   */
+  void Send(bool wait) {
+    std::lock_guard<std::mutex> lk(send_mu_);
+    ProfileStats now = Profiler::Get()->Total();
+    ProfileStats diff = now.Since(sent_);
+    if (diff.Empty()) return;
+    sent_ = now;
+    std::string report;
+    diff.SerializeToString(&report);
+    int ts = reporter_->Report(report);
+    if (wait) reporter_->Wait(ts);
+  }
+
+  Reporter* reporter_ = nullptr;
+  std::thread thread_;
+  /** \brief protects total_ and done_ */
+  std::mutex mu_;
+  std::condition_variable cond_;
+  bool done_ = false;
+  /** \brief on the scheduler, the stats received */
+  ProfileStats total_;
+  /** \brief protects sent_, the stats reported */
+  std::mutex send_mu_;
+  ProfileStats sent_;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_REPORTER_PROFILE_REPORTER_H_
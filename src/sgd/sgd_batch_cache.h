@@ -0,0 +1,221 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_SGD_SGD_BATCH_CACHE_H_
+#define DIFACTO_SGD_SGD_BATCH_CACHE_H_
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include "difacto/base.h"
+#include "difacto/sarray.h"
+#include "common/mem_tracker.h"
+#include "data/data_store.h"
+#include "data/shared_row_block_container.h"
+#include "data/compressed_row_block.h"
+namespace difacto {
+namespace sgd {
+
+/**
+ * \brief a batch after preprocessing, namely the feature ids are mapped into
+ * continuous indices
+ */
+struct LocalBatch {
+  /** \brief the original feature ids, sorted */
+  SArray<feaid_t> feaids;
+  /** \brief the data with mapped feature indices */
+  SharedRowBlockContainer<unsigned> data;
+};
+
+/**
+ * \brief caches the preprocessed batches of data parts, so the later epochs
+ * need neither to parse the data nor to map the feature ids
+ *
+ * the batches are kept in a \ref DataStore. with a spill prefix, it is a disk
+ * store which writes the least recently used batches exceeding the capacity
+ * into files and reads them back when fetched. otherwise everything is in
+ * memory, and the part being added is dropped if the capacity or the memory
+ * budget of this node is exceeded, while the parts cached before are kept.
+ *
+ * a part is only available after all its batches are added and \ref Finish
+ * is called
+ */
+class BatchCache {
+ public:
+  BatchCache() { }
+
+  /**
+   * \param capacity the memory capacity in bytes, 0 means no cache
+   * \param compress whether to compress the data by LZ4, which reduces the
+   * memory by a few times at the cost of decompressing in every epoch
+   * \param spill_prefix if not empty, the prefix of the files the batches
+   * exceeding the capacity are written into, such as /tmp/difacto_
+   */
+  void Init(size_t capacity, bool compress,
+            const std::string& spill_prefix = "") {
+    capacity_ = capacity;
+    compress_ = compress;
+    spill_ = !spill_prefix.empty();
+    if (capacity_ == 0) return;
+    store_.reset(spill_ ? new DataStore(spill_prefix, capacity_) :
+                 new DataStore());
+  }
+
+  /** \brief returns true if nothing can be cached */
+  bool Disabled() const { return capacity_ == 0; }
+
+  /**
+   * \brief returns the number of batches of a cached part, -1 if not cached
+   */
+  int Size(const std::string& part) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = parts_.find(part);
+    if (it == parts_.end() || !it->second.done) return -1;
+    return it->second.num_batches;
+  }
+
+  /**
+   * \brief append a batch to a part, returns false if the part is dropped
+   * since the capacity or the memory budget is exceeded without spilling
+   */
+  bool Add(const std::string& part, const LocalBatch& batch) {
+    std::string compressed;
+    size_t bytes = batch.feaids.size() * sizeof(feaid_t);
+    if (compress_) {
+      CompressedRowBlock().Compress(batch.data.GetBlock(), &compressed);
+      bytes += compressed.size();
+    } else {
+      const auto& d = batch.data;
+      bytes += d.offset.size() * sizeof(size_t) +
+          (d.label.size() + d.weight.size() + d.value.size()) * sizeof(real_t) +
+          d.index.size() * sizeof(unsigned);
+    }
+
+    std::lock_guard<std::mutex> lk(mu_);
+    Part& p = parts_[part];
+    if (p.done || p.failed) return false;
+    if (!spill_ && (mem_bytes_ + bytes > capacity_ ||
+                    MemTracker::Get()->Exceeds(bytes))) {
+      // drop this part
+      p.failed = true;
+      for (int i = 0; i < p.num_batches; ++i) Remove(part, i);
+      mem_bytes_ -= p.bytes;
+      p.bytes = 0;
+      p.num_batches = 0;
+      return false;
+    }
+    // the arrays are shared with the store rather than copied
+    std::string key = Key(part, p.num_batches++);
+    store_->Store(key + "feaids", batch.feaids);
+    if (compress_) {
+      store_->Store(key + "data", compressed.data(), compressed.size());
+    } else {
+      const auto& d = batch.data;
+      store_->Store(key + "offset", d.offset);
+      store_->Store(key + "label", d.label);
+      store_->Store(key + "weight", d.weight);
+      store_->Store(key + "index", d.index);
+      store_->Store(key + "value", d.value);
+    }
+    p.bytes += bytes;
+    mem_bytes_ += bytes;
+    return true;
+  }
+
+  /** \brief mark a part is completed */
+  void Finish(const std::string& part) {
+    std::lock_guard<std::mutex> lk(mu_);
+    Part& p = parts_[part];
+    if (!p.failed) p.done = true;
+  }
+
+  /** \brief get the i-th batch of a cached part */
+  void Get(const std::string& part, int i, LocalBatch* batch) {
+    SArray<char> compressed;
+    SharedRowBlockContainer<unsigned> data;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      auto it = parts_.find(part);
+      CHECK(it != parts_.end() && it->second.done) << part << " is not cached";
+      CHECK_LT(i, it->second.num_batches);
+      std::string key = Key(part, i);
+      store_->Fetch(key + "feaids", &batch->feaids);
+      if (compress_) {
+        store_->Fetch(key + "data", &compressed);
+      } else {
+        store_->Fetch(key + "offset", &data.offset);
+        store_->Fetch(key + "label", &data.label);
+        store_->Fetch(key + "weight", &data.weight);
+        store_->Fetch(key + "index", &data.index);
+        store_->Fetch(key + "value", &data.value);
+      }
+    }
+    if (compress_) {
+      auto blk = new dmlc::data::RowBlockContainer<unsigned>();
+      CompressedRowBlock().Decompress(compressed.data(), compressed.size(),
+                                      blk);
+      batch->data = SharedRowBlockContainer<unsigned>(&blk);
+    } else {
+      batch->data = data;
+    }
+  }
+
+  /**
+   * \brief hint that the i-th batch of a cached part is got soon, so a
+   * spilled one is read back in the background
+   */
+  void Prefetch(const std::string& part, int i) {
+    if (!spill_) return;
+    std::lock_guard<std::mutex> lk(mu_);
+    std::string key = Key(part, i);
+    store_->Prefetch(key + "feaids");
+    if (compress_) {
+      store_->Prefetch(key + "data");
+    } else {
+      for (const char* a : {"offset", "label", "weight", "index", "value"}) {
+        store_->Prefetch(key + a);
+      }
+    }
+  }
+
+  /** \brief the bytes of the cached batches, in memory or spilled */
+  size_t Bytes() {
+    std::lock_guard<std::mutex> lk(mu_);
+    return mem_bytes_;
+  }
+
+ private:
+  struct Part {
+    int num_batches = 0;
+    size_t bytes = 0;
+    bool done = false;
+    bool failed = false;
+  };
+
+  static std::string Key(const std::string& part, int i) {
+    return part + "_" + std::to_string(i) + "_";
+  }
+
+  /** \brief remove the i-th batch of a part, needs to hold mu_ */
+  void Remove(const std::string& part, int i) {
+    std::string key = Key(part, i);
+    for (const char* a : {"feaids", "data", "offset", "label", "weight",
+                          "index", "value"}) {
+      store_->Remove(key + a);
+    }
+  }
+
+  std::unordered_map<std::string, Part> parts_;
+  /** \brief the batches, the store is not thread-safe so needs to hold mu_ */
+  std::unique_ptr<DataStore> store_;
+  size_t capacity_ = 0;
+  size_t mem_bytes_ = 0;
+  bool compress_ = false;
+  bool spill_ = false;
+  std::mutex mu_;
+};
+
+}  // namespace sgd
+}  // namespace difacto
+#endif  // DIFACTO_SGD_SGD_BATCH_CACHE_H_
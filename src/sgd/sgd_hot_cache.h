@@ -0,0 +1,180 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_SGD_SGD_HOT_CACHE_H_
+#define DIFACTO_SGD_SGD_HOT_CACHE_H_
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "difacto/base.h"
+#include "difacto/sarray.h"
+#include "difacto/store.h"
+namespace difacto {
+namespace sgd {
+
+/**
+ * \brief caches the weights of the most frequent features on the worker, so
+ * a pull only requests the other features from the store
+ *
+ * the features are counted over the pulls, and the counts are halved on
+ * every refresh, so a feature is hot if it is frequent recently. every
+ * refresh_pulls pulls, the hot features are picked again and their weights
+ * are pulled from the store, so a cached weight is at most refresh_pulls
+ * pulls old
+ */
+class HotCache {
+ public:
+  /**
+   * \param capacity the maximal number of hot features, 0 means no cache
+   * \param refresh_pulls refresh the cache every refresh_pulls pulls
+   * \param V_dim the embedding dimension, the lengths are empty if 0
+   */
+  void Init(size_t capacity, int refresh_pulls, int V_dim) {
+    capacity_ = capacity;
+    refresh_pulls_ = std::max(refresh_pulls, 1);
+    V_dim_ = V_dim;
+  }
+
+  /** \brief returns true if nothing is cached */
+  bool Disabled() const { return capacity_ == 0; }
+
+  /**
+   * \brief the same as store->Pull(feaids, Store::kWeight, values, lengths)
+   * and waits it, but the hot features are read from the cache
+   */
+  void Pull(Store* store, const SArray<feaid_t>& feaids,
+            SArray<real_t>* values, SArray<int>* lengths) {
+    std::shared_ptr<const Snapshot> hot;
+    bool refresh;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      for (feaid_t f : feaids) ++counts_[f];
+      refresh = ++num_pulls_ % refresh_pulls_ == 0;
+      if (refresh) PickHot();
+      hot = hot_;
+    }
+    if (refresh) {
+      hot = Refresh(store);
+    }
+    if (!hot || hot->ids.empty()) {
+      store->Wait(store->Pull(feaids, Store::kWeight, values, lengths));
+      return;
+    }
+
+    // split by whether a feature is hot, pos[i] is its position in hot, or -1
+    size_t n = feaids.size();
+    std::vector<int> pos(n, -1);
+    SArray<feaid_t> cold;
+    const feaid_t* begin = hot->ids.data();
+    const feaid_t* end = begin + hot->ids.size();
+    const feaid_t* it = begin;
+    for (size_t i = 0; i < n; ++i) {
+      it = std::lower_bound(it, end, feaids[i]);
+      if (it != end && *it == feaids[i]) {
+        pos[i] = static_cast<int>(it - begin);
+      } else {
+        cold.push_back(feaids[i]);
+      }
+    }
+    SArray<real_t> cold_vals;
+    SArray<int> cold_lens;
+    if (cold.size()) {
+      store->Wait(store->Pull(cold, Store::kWeight, &cold_vals, &cold_lens));
+    }
+
+    // merge them in the order of feaids
+    values->resize(0);
+    lengths->resize(0);
+    size_t c = 0, cp = 0;
+    for (size_t i = 0; i < n; ++i) {
+      const real_t* v;
+      int len;
+      if (pos[i] >= 0) {
+        size_t o = hot->offsets[pos[i]];
+        v = hot->values.data() + o;
+        len = static_cast<int>(hot->offsets[pos[i]+1] - o);
+      } else {
+        v = cold_vals.data() + cp;
+        len = cold_lens.empty() ? 1 : cold_lens[c];
+        ++c; cp += len;
+      }
+      for (int k = 0; k < len; ++k) values->push_back(v[k]);
+      if (V_dim_ != 0) lengths->push_back(len);
+    }
+  }
+
+ private:
+  /** \brief the hot features and their weights */
+  struct Snapshot {
+    SArray<feaid_t> ids;
+    SArray<real_t> values;
+    std::vector<size_t> offsets;
+  };
+
+  /** \brief pick the most frequent ones, and then halve the counts */
+  void PickHot() {
+    std::vector<std::pair<int, feaid_t>> top;
+    top.reserve(counts_.size());
+    for (const auto& c : counts_) {
+      top.push_back(std::make_pair(c.second, c.first));
+    }
+    size_t k = std::min(capacity_, top.size());
+    std::nth_element(top.begin(), top.begin() + k, top.end(),
+                     [](const std::pair<int, feaid_t>& a,
+                        const std::pair<int, feaid_t>& b) {
+                       return a.first > b.first;
+                     });
+    hot_ids_.resize(0);
+    for (size_t i = 0; i < k; ++i) hot_ids_.push_back(top[i].second);
+    std::sort(hot_ids_.begin(), hot_ids_.end());
+
+    for (auto it = counts_.begin(); it != counts_.end(); ) {
+      it->second /= 2;
+      if (it->second == 0) {
+        it = counts_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  /** \brief pull the weights of the hot features picked */
+  std::shared_ptr<const Snapshot> Refresh(Store* store) {
+    auto snap = std::make_shared<Snapshot>();
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      snap->ids = SArray<feaid_t>(hot_ids_);
+    }
+    SArray<int> lens;
+    if (snap->ids.size()) {
+      store->Wait(store->Pull(snap->ids, Store::kWeight, &snap->values, &lens));
+    }
+    size_t n = snap->ids.size();
+    snap->offsets.resize(n + 1);
+    snap->offsets[0] = 0;
+    for (size_t i = 0; i < n; ++i) {
+      snap->offsets[i+1] = snap->offsets[i] + (lens.empty() ? 1 : lens[i]);
+    }
+    std::lock_guard<std::mutex> lk(mu_);
+    hot_ = snap;
+    return snap;
+  }
+
+  size_t capacity_ = 0;
+  int refresh_pulls_ = 1;
+  int V_dim_ = 0;
+  std::mutex mu_;
+  /** \brief the number of pulls, and the decayed counts of the features */
+  size_t num_pulls_ = 0;
+  std::unordered_map<feaid_t, int> counts_;
+  /** \brief the hot features of the last refresh */
+  std::vector<feaid_t> hot_ids_;
+  std::shared_ptr<const Snapshot> hot_;
+};
+
+}  // namespace sgd
+}  // namespace difacto
+#endif  // DIFACTO_SGD_SGD_HOT_CACHE_H_
@@ -0,0 +1,82 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ * @file   sgd_kernels.h
+ * @brief  the update kernels of the sgd updater
+ */
+#ifndef DIFACTO_SGD_SGD_KERNELS_H_
+#define DIFACTO_SGD_SGD_KERNELS_H_
+#include <math.h>
+#include "difacto/base.h"
+#if defined(__GNUC__) && defined(__x86_64__)
+#define DIFACTO_SGD_SIMD 1
+#include <immintrin.h>
+#else
+#define DIFACTO_SGD_SIMD 0
+#endif
+namespace difacto {
+namespace sgd {
+
+/**
+ * \brief adagrad on V, the scalar version
+ *
+ * for each i: g_i += l2 * V_i, cg_i = sqrt(cg_i^2 + g_i^2),
+ * V_i -= lr / (cg_i + lr_beta) * g_i
+ *
+ * @param n the length
+ * @param gV the gradient
+ * @param V the weight
+ * @param cg the accumulated gradient norm
+ */
+inline void AdaGradScalar(int n, real_t lr, real_t lr_beta, real_t l2,
+                          real_t const* gV, real_t* V, real_t* cg) {
+  for (int i = 0; i < n; ++i) {
+    real_t g = gV[i] + l2 * V[i];
+    real_t c = sqrtf(cg[i] * cg[i] + g * g);
+    cg[i] = c;
+    V[i] -= lr / (c + lr_beta) * g;
+  }
+}
+
+#if DIFACTO_SGD_SIMD
+/**
+ * \brief the avx version. avx has no fma, so the results are identical to
+ * \ref AdaGradScalar. (avx-512 is not used, the compiler will contract the
+ * multiply-adds there)
+ */
+__attribute__((target("avx")))
+inline void AdaGradAVX(int n, real_t lr, real_t lr_beta, real_t l2,
+                       real_t const* gV, real_t* V, real_t* cg) {
+  __m256 vlr = _mm256_set1_ps(lr);
+  __m256 vbeta = _mm256_set1_ps(lr_beta);
+  __m256 vl2 = _mm256_set1_ps(l2);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 v = _mm256_loadu_ps(V + i);
+    __m256 c = _mm256_loadu_ps(cg + i);
+    __m256 g = _mm256_add_ps(_mm256_loadu_ps(gV + i), _mm256_mul_ps(vl2, v));
+    c = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(c, c), _mm256_mul_ps(g, g)));
+    _mm256_storeu_ps(cg + i, c);
+    __m256 eta = _mm256_div_ps(vlr, _mm256_add_ps(c, vbeta));
+    _mm256_storeu_ps(V + i, _mm256_sub_ps(v, _mm256_mul_ps(eta, g)));
+  }
+  AdaGradScalar(n - i, lr, lr_beta, l2, gV + i, V + i, cg + i);
+}
+#endif  // DIFACTO_SGD_SIMD
+
+/**
+ * \brief adagrad on V, uses avx if the cpu supports it at runtime
+ */
+inline void AdaGrad(int n, real_t lr, real_t lr_beta, real_t l2,
+                    real_t const* gV, real_t* V, real_t* cg) {
+#if DIFACTO_SGD_SIMD
+  static const bool has_avx = __builtin_cpu_supports("avx");
+  if (has_avx) {
+    AdaGradAVX(n, lr, lr_beta, l2, gV, V, cg); return;
+  }
+#endif  // DIFACTO_SGD_SIMD
+  AdaGradScalar(n, lr, lr_beta, l2, gV, V, cg);
+}
+
+}  // namespace sgd
+}  // namespace difacto
+#endif  // DIFACTO_SGD_SGD_KERNELS_H_
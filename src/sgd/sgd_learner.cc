@@ -3,76 +3,630 @@
  */
 #include "./sgd_learner.h"
 #include <stdlib.h>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
 #include <thread>
+#include <typeinfo>
 #include <vector>
 #include <utility>
 #include "dmlc/data.h"
 #include "reader/batch_reader.h"
 #include "reader/reader.h"
-#include "tracker/async_local_tracker.h"
+#include "reader/match_file.h"
 #include "data/shared_row_block_container.h"
 #include "data/row_block.h"
 #include "data/localizer.h"
+#include "data/row_dedup.h"
 #include "dmlc/timer.h"
 #include "difacto/node_id.h"
 #include "loss/bin_class_metric.h"
+#include "common/bounded_queue.h"
+#include "common/buffer_pool.h"
+#include "common/key_ranges.h"
+#include "common/kv_match.h"
+#include "common/kv_union.h"
+#include "common/mem_tracker.h"
+#include "common/model_file.h"
+#include "common/learner_utils.h"
+#include "common/profiler.h"
 #include "./sgd_updater.h"
 namespace difacto {
 
-/** \brief struct to hold info for a batch job */
+/**
+ * \brief consecutive batches sharing the pulled weights and the pushed
+ * gradients
+ *
+ * the keys are sorted as the feaids of a batch, and the values are padded
+ * to 1 + V_dim per feature, so they can be merged by KVMatch and KVUnion
+ */
+struct BatchWindow {
+  std::mutex mu;
+  /** \brief the number of batches assigned, and the ones merged */
+  int num_batches = 0, num_merged = 0;
+  /** \brief the weights pulled, and the length of each feature */
+  SArray<feaid_t> ids;
+  SArray<real_t> weights;
+  SArray<int> lens;
+  /** \brief the gradients summed over the merged batches */
+  SArray<feaid_t> grad_ids;
+  SArray<real_t> grads;
+};
+
+namespace {
+/** \brief pad values with lens into width per key, empty lens means 1 */
+void PadValues(const SArray<real_t>& vals, const SArray<int>& lens, size_t n,
+               int width, SArray<real_t>* padded) {
+  *padded = BufferPool::Get()->New<real_t>(n * width, 0);
+  size_t p = 0;
+  for (size_t i = 0; i < n; ++i) {
+    int l = lens.empty() ? 1 : lens[i];
+    std::copy(vals.data() + p, vals.data() + p + l, padded->data() + i * width);
+    p += l;
+  }
+  CHECK_EQ(p, vals.size());
+}
+
+/** \brief the reverse of \ref PadValues */
+void UnpadValues(const SArray<real_t>& padded, const SArray<int>& lens,
+                 int width, SArray<real_t>* vals) {
+  vals->resize(0);
+  for (size_t i = 0; i < lens.size(); ++i) {
+    const real_t* v = padded.data() + i * width;
+    for (int j = 0; j < lens[i]; ++j) vals->push_back(v[j]);
+  }
+}
+}  // namespace
+
+/** \brief a batch passed among the stages of \ref SGDLearner::IteratePart */
 struct BatchJob {
-  int type;
+  /** \brief the buffers for pulled weights and gradients */
+  struct Buffer {
+    SArray<real_t> values, grads;
+    SArray<int> lengths;
+  };
+  /** \brief the data before localized, empty if it is read from the cache */
+  SharedRowBlockContainer<feaid_t> raw;
   SArray<feaid_t> feaids;
   SharedRowBlockContainer<unsigned> data;
+  /** \brief set by the pull stage */
+  Buffer* buf = nullptr;
+  /** \brief the window of this batch, empty if grad_push_batches is 1 */
+  std::shared_ptr<BatchWindow> window;
 };
 
+/**
+ * \brief the pull, compute and push stages of a model in
+ * \ref SGDLearner::IteratePart
+ */
+struct ModelPass {
+  ModelPass(sgd::Model* m, sgd::Progress* prog, size_t qsize)
+      : model(m), progress(prog), to_pull(qsize), to_compute(qsize),
+        to_push(qsize), width(1 + m->updater()->param().V_dim) { }
+  sgd::Model* model;
+  sgd::Progress* progress;
+  BoundedQueue<BatchJob> to_pull, to_compute, to_push;
+  /** \brief the values of a feature are padded to width in a window */
+  int width;
+  /** \brief protects the buffers, the batch counters and progress */
+  std::mutex mu;
+  /** \brief the buffers for pulled weights and gradients, reused */
+  std::vector<std::unique_ptr<BatchJob::Buffer>> buffers;
+  std::vector<BatchJob::Buffer*> free_buffers;
+  /** \brief the number of batches pulled, and the ones finished */
+  int num_pulled = 0, num_finished = 0;
+  std::condition_variable finish_cond;
+  /** \brief the window the pulled batches are assigned to */
+  std::shared_ptr<BatchWindow> window;
+  /** \brief the feature counts summed over batches, and the pushes */
+  std::mutex cnt_mu;
+  SArray<feaid_t> cnt_ids;
+  SArray<real_t> cnt_vals;
+  int cnt_batches = 0;
+  std::vector<int> cnt_pushes;
+};
+
+namespace {
+/** \brief parse "k1=v1,k2=v2;k1=v3" into the kwargs of every model */
+std::vector<KWArgs> ParseSweep(const std::string& sweep) {
+  std::vector<KWArgs> models;
+  std::stringstream ss(sweep);
+  std::string model;
+  while (std::getline(ss, model, ';')) {
+    KWArgs args;
+    std::stringstream ms(model);
+    std::string kv;
+    while (std::getline(ms, kv, ',')) {
+      if (kv.empty()) continue;
+      size_t pos = kv.find('=');
+      CHECK_NE(pos, std::string::npos) << "bad sweep argument " << kv;
+      args.push_back(std::make_pair(kv.substr(0, pos), kv.substr(pos + 1)));
+    }
+    if (args.size()) models.push_back(args);
+  }
+  return models;
+}
+}  // namespace
+
 void SGDLearner::RunScheduler() {
-  real_t pre_loss = 0, pre_val_auc = 0;
+  if (param_.stream) {
+    RunStream();
+    return;
+  }
+  InitKeyRanges();
+  if (param_.model_in.size()) {
+    LOG(INFO) << "Loading model from " << param_.model_in;
+    IssueJobAndWait(NodeID::kServerGroup, sgd::Job::kLoadModel);
+  }
+  size_t nmodels = models_.size();
+  std::vector<real_t> pre_loss(nmodels), pre_val_auc(nmodels);
+  double last_ckpt = dmlc::GetTime();
+  stop_training_ = false;
+  if (param_.val_interval_sec > 0 && param_.data_val.size()) {
+    LoadValSample();
+    sample_auc_.assign(nmodels, 0);
+  }
+  // the validation running on the snapshots of an epoch if val_async
+  std::vector<std::unique_ptr<sgd::Model>> snapshots;
+  std::vector<sgd::Progress> async_progs;
+  std::thread async_val;
+  auto log_val = [this, nmodels](std::vector<sgd::Progress>& progs) {
+    for (size_t m = 0; m < nmodels; ++m) {
+      LOG(INFO) << " - Validation" << ModelTag(m) << ": "
+                << progs[m].TextString();
+    }
+  };
   int k = 0;
   for (; k < param_.max_num_epochs; ++k) {
-    sgd::Progress train_prog;
+    std::vector<sgd::Progress> train_progs, val_progs(nmodels);
     LOG(INFO) << "Start epoch " << k;
-    RunEpoch(k, sgd::Job::kTraining, &train_prog);
-    LOG(INFO) << " - Training: " << train_prog.TextString();
-
-    sgd::Progress val_prog;
-    if (param_.data_val.size()) {
-      RunEpoch(k, sgd::Job::kValidation, &val_prog);
-      LOG(INFO) << " - Validation: " << val_prog.TextString();
+    std::atomic<bool> done{false};
+    std::thread sampler;
+    if (val_sample_.size()) {
+      sampler = std::thread([this, k, &done]() { SampleValidation(k, done); });
+    }
+    RunEpoch(k, sgd::Job::kTraining, &train_progs);
+    done = true;
+    if (sampler.joinable()) sampler.join();
+    for (size_t m = 0; m < nmodels; ++m) {
+      LOG(INFO) << " - Training" << ModelTag(m) << ": "
+                << train_progs[m].TextString();
+      LOG(INFO) << " - Stages" << ModelTag(m) << ": "
+                << train_progs[m].StageString();
+    }
+    if (DIFACTO_PROFILE) {
+      LOG(INFO) << " - Profile: " << profiler_.Take().TextString();
+    }
+    if (!IsDistributed()) {
+      for (size_t m = 0; m < nmodels; ++m) {
+        auto updater = models_[m]->updater();
+        size_t num_feas, num_bytes;
+        updater->MemUsage(&num_feas, &num_bytes);
+        LOG(INFO) << " - Model" << ModelTag(m) << ": " << num_feas
+                  << " features, "
+                  << num_bytes / std::max(num_feas, (size_t)1)
+                  << " bytes per feature";
+        const auto& up = updater->param();
+        if (up.admit_count > 0 || up.evict_interval > 0) {
+          size_t num_admitted, num_evicted;
+          updater->AdmitStats(&num_admitted, &num_evicted);
+          LOG(INFO) << " - Admission" << ModelTag(m) << ": " << num_admitted
+                    << " admitted, " << num_evicted << " evicted";
+        }
+      }
+      LOG(INFO) << " - Memory: " << MemTracker::Get()->TextString();
+    }
+    if (param_.data_val.size() && param_.val_async) {
+      // report the previous epoch, and validate this one while the next one
+      // trains
+      if (async_val.joinable()) {
+        async_val.join();
+        LOG(INFO) << " - Validation of epoch " << k - 1 << ":";
+        log_val(async_progs);
+        val_progs = async_progs;
+      }
+      snapshots.clear();
+      for (const auto& m : models_) snapshots.push_back(Snapshot(*m));
+      async_val = std::thread([this, k, &snapshots, &async_progs]() {
+          std::vector<sgd::Model*> models;
+          for (const auto& m : snapshots) models.push_back(m.get());
+          async_progs.assign(models.size(), sgd::Progress());
+          sgd::Job job;
+          job.type = sgd::Job::kValidation;
+          job.num_parts = 1;
+          job.part_idx = 0;
+          job.epoch = k;
+          double start = dmlc::GetTime();
+          IteratePart(job, models, &async_progs);
+          for (auto& p : async_progs) p.sec = dmlc::GetTime() - start;
+        });
+    } else if (param_.data_val.size()) {
+      RunEpoch(k, sgd::Job::kValidation, &val_progs);
+      log_val(val_progs);
+      if (DIFACTO_PROFILE) {
+        LOG(INFO) << " - Validation profile: "
+                  << profiler_.Take().TextString();
+      }
+    }
+    EndEpoch(k, train_progs, val_progs);
+    if (param_.model_out.size() &&
+        CheckpointDue(k, param_.checkpoint_epochs, param_.checkpoint_sec,
+                      &last_ckpt)) {
+      LOG(INFO) << " - Checkpointing model to " << param_.model_out;
+      IssueJobAndWait(NodeID::kServerGroup, sgd::Job::kCheckpoint);
+      SaveKeyRanges();
     }
-    for (const auto& cb : epoch_end_callback_) cb(k, train_prog, val_prog);
 
-    // stop criteria
-    real_t eps = fabs(train_prog.loss - pre_loss) / pre_loss;
-    if (eps < param_.stop_rel_objv) {
-      LOG(INFO) << "Change of loss [" << eps << "] < stop_rel_objv ["
-                << param_.stop_rel_objv << "]";
-      break;
+    if (k+1 < param_.max_num_epochs) {
+      AdaptPushBatches(train_progs[0], pre_loss[0]);
     }
-    if (val_prog.auc > 0) {
-      eps = (val_prog.auc - pre_val_auc) / val_prog.nrows;
-      if (eps < param_.stop_val_auc) {
-        LOG(INFO) << "Change of validation AUC [" << eps << "] < stop_val_auc ["
+
+    // stop criteria, every model needs to meet one
+    size_t num_stopped = 0;
+    for (size_t m = 0; m < nmodels; ++m) {
+      const auto& train_prog = train_progs[m];
+      const auto& val_prog = val_progs[m];
+      real_t eps = fabs(train_prog.loss - pre_loss[m]) / pre_loss[m];
+      if (eps < param_.stop_rel_objv) {
+        LOG(INFO) << "Change of loss" << ModelTag(m) << " [" << eps
+                  << "] < stop_rel_objv [" << param_.stop_rel_objv << "]";
+        ++num_stopped;
+      } else if (val_prog.nrows > 0 &&
+                 val_prog.AUC() - pre_val_auc[m] < param_.stop_val_auc) {
+        LOG(INFO) << "Change of validation AUC" << ModelTag(m) << " ["
+                  << val_prog.AUC() - pre_val_auc[m] << "] < stop_val_auc ["
                   << param_.stop_val_auc << "]";
-        break;
+        ++num_stopped;
       }
+      pre_loss[m] = train_prog.loss;
+      pre_val_auc[m] = val_prog.AUC();
+    }
+    if (stop_training_) {
+      LOG(INFO) << "Stopped in epoch " << k << " by the sampled validation";
+      break;
     }
+    if (num_stopped == nmodels) break;
     if (k+1 >= param_.max_num_epochs) {
       LOG(INFO) << "Reach maximal number of epochs";
     }
-    pre_loss = train_prog.loss;
-    pre_val_auc = val_prog.auc;
+  }
+  if (async_val.joinable()) {
+    async_val.join();
+    // k is the last epoch if it stops early
+    LOG(INFO) << " - Validation of epoch "
+              << std::min(k, param_.max_num_epochs - 1) << ":";
+    log_val(async_progs);
+  }
+  if (param_.model_out.size()) {
+    LOG(INFO) << "Saving model to " << param_.model_out;
+    IssueJobAndWait(NodeID::kServerGroup, sgd::Job::kSaveModel);
+    SaveKeyRanges();
   }
 }
 
-void SGDLearner::RunEpoch(int epoch, int job_type, sgd::Progress* prog) {
-  // progress merger
+void SGDLearner::RunStream() {
+  CHECK(param_.model_out.size()) << "stream needs model_out to checkpoint";
+  // the names of the trained files
+  std::vector<std::string> trained;
+  std::string list = param_.model_out + ".files";
+  std::unique_ptr<dmlc::Stream> fi(
+      dmlc::Stream::Create(list.c_str(), "r", true));
+  if (fi) {
+    dmlc::istream is(fi.get());
+    std::string name;
+    while (is >> name) trained.push_back(name);
+    LOG(INFO) << "Resuming from checkpoint " << param_.model_out << ", "
+              << trained.size() << " files trained";
+    IssueJobAndWait(NodeID::kServerGroup, sgd::Job::kLoadModel,
+                    param_.model_out);
+  } else if (param_.model_in.size()) {
+    LOG(INFO) << "Loading model from " << param_.model_in;
+    IssueJobAndWait(NodeID::kServerGroup, sgd::Job::kLoadModel);
+  }
+  fi.reset();
+  std::set<std::string> done(trained.begin(), trained.end());
+
+  // a file is an epoch, and checkpoint every file by default
+  int every = param_.checkpoint_epochs;
+  if (every == 0 && param_.checkpoint_sec == 0) every = 1;
+  int k = 0;
+  double last_new = dmlc::GetTime(), last_ckpt = last_new;
+  while (true) {
+    // the files being written are hidden by a leading . or _
+    std::vector<std::string> files;
+    MatchFile(param_.data_in + "/.*", &files);
+    std::vector<std::pair<std::string, std::string>> news;
+    for (const auto& f : files) {
+      size_t pos = f.find_last_of("/\\");
+      std::string name = pos == std::string::npos ? f : f.substr(pos+1);
+      if (name.empty() || name[0] == '.' || name[0] == '_') continue;
+      if (done.count(name)) continue;
+      news.push_back(std::make_pair(name, f));
+    }
+    std::sort(news.begin(), news.end());
+    for (const auto& f : news) {
+      std::vector<sgd::Progress> train_progs, val_progs(models_.size());
+      LOG(INFO) << "Start file " << f.first;
+      RunEpoch(k, sgd::Job::kTraining, &train_progs, f.second);
+      for (size_t m = 0; m < models_.size(); ++m) {
+        LOG(INFO) << " - Training" << ModelTag(m) << ": "
+                  << train_progs[m].TextString();
+      }
+      if (DIFACTO_PROFILE) {
+        LOG(INFO) << " - Profile: " << profiler_.Take().TextString();
+      }
+      EndEpoch(k, train_progs, val_progs);
+      done.insert(f.first);
+      trained.push_back(f.first);
+      if (CheckpointDue(k, every, param_.checkpoint_sec, &last_ckpt)) {
+        SaveStream(trained, false);
+      }
+      ++k;
+    }
+    double now = dmlc::GetTime();
+    if (news.size()) {
+      last_new = now;
+    } else if (param_.stream_idle_sec > 0 &&
+               now - last_new >= param_.stream_idle_sec) {
+      LOG(INFO) << "No new file in " << param_.stream_idle_sec << " sec";
+      break;
+    }
+    if (news.empty()) {
+      std::this_thread::sleep_for(
+          std::chrono::seconds(param_.stream_poll_sec));
+    }
+  }
+  if (k > 0) SaveStream(trained, true);
+}
+
+void SGDLearner::SaveStream(const std::vector<std::string>& trained,
+                            bool final) {
+  LOG(INFO) << (final ? "Saving" : "Checkpointing") << " model to "
+            << param_.model_out;
+  IssueJobAndWait(NodeID::kServerGroup, final ? sgd::Job::kSaveModel :
+                  sgd::Job::kCheckpoint);
+  // the model of ckpt_files_ is written now
+  const auto& files = final ? trained : ckpt_files_;
+  if (files.size()) {
+    std::string list = param_.model_out + ".files";
+    std::unique_ptr<dmlc::Stream> fo(dmlc::Stream::Create(list.c_str(), "w"));
+    dmlc::ostream os(fo.get());
+    for (const auto& name : files) os << name << "\n";
+  }
+  ckpt_files_ = final ? std::vector<std::string>() : trained;
+}
+
+void SGDLearner::IssueJobAndWait(int node_group, int job_type,
+                                 const std::string& filename) {
+  tracker_->SetMonitor(nullptr);
+  sgd::Job job;
+  job.type = job_type;
+  job.filename = filename;
+  std::string args;
+  job.SerializeToString(&args);
+  tracker_->Broadcast(node_group, args);
+  tracker_->WaitRemains(0);
+}
+
+void SGDLearner::InitKeyRanges() {
+  if (!IsDistributed()) return;
+  if (param_.model_in.size()) {
+    // the model is partitioned by the ranges it is trained with
+    std::string name = param_.model_in + ".ranges";
+    std::unique_ptr<dmlc::Stream> fi(
+        dmlc::Stream::Create(name.c_str(), "r", true));
+    if (fi) {
+      std::vector<feaid_t> bounds;
+      CHECK(fi->Read(&bounds)) << "failed to read " << name;
+      if (param_.key_balance_rows > 0) {
+        LOG(INFO) << "Using the key ranges of " << param_.model_in;
+      }
+      SetKeyRanges(bounds);
+    }
+    return;
+  }
+  if (param_.key_balance_rows <= 0) return;
+
+  // sum the loads of the buckets over the workers
+  std::vector<real_t> hist(KeyRanges::NumBuckets());
   tracker_->SetMonitor(
-      [this, prog](int node_id, const std::string& rets) {
-        prog->Merge(rets);
+      [&hist](int node_id, const std::string& rets) {
+        CHECK_EQ(rets.size(), hist.size() * sizeof(real_t));
+        auto load = reinterpret_cast<real_t const*>(rets.data());
+        for (size_t i = 0; i < hist.size(); ++i) hist[i] += load[i];
       });
+  int n = store_->NumWorkers();
+  std::vector<std::pair<int, std::string>> jobs(n);
+  for (int i = 0; i < n; ++i) {
+    jobs[i].first = NodeID::kWorkerGroup;
+    sgd::Job job;
+    job.type = sgd::Job::kCountKeys;
+    job.num_parts = n;
+    job.part_idx = i;
+    job.SerializeToString(&jobs[i].second);
+  }
+  tracker_->Issue(jobs);
+  tracker_->WaitRemains(0);
+
+  // log the load of the busiest server over the average one
+  int num_servers = store_->NumServers();
+  feaid_t end = std::numeric_limits<feaid_t>::max();
+  auto imbalance = [&hist, num_servers](
+      const std::vector<feaid_t>& bounds) -> real_t {
+    std::vector<real_t> load(num_servers);
+    real_t total = 0;
+    for (size_t b = 0; b < hist.size(); ++b) {
+      load[KeyRanges::Server(bounds, b << 48)] += hist[b];
+      total += hist[b];
+    }
+    return total > 0 ? *std::max_element(load.begin(), load.end()) *
+        num_servers / total : 1;
+  };
+  auto bounds = KeyRanges::Balance(hist, num_servers, end);
+  LOG(INFO) << "Balanced the key ranges, the busiest server has "
+            << imbalance(KeyRanges::Balance(std::vector<real_t>(hist.size()),
+                                            num_servers, end))
+            << "x the average load before, and " << imbalance(bounds)
+            << "x after";
+  SetKeyRanges(bounds);
+}
+
+void SGDLearner::SetKeyRanges(const std::vector<feaid_t>& bounds) {
+  CHECK_EQ(bounds.size(), static_cast<size_t>(store_->NumServers() + 1));
+  tracker_->SetMonitor(nullptr);
+  sgd::Job job;
+  job.type = sgd::Job::kSetKeyRanges;
+  job.key_bounds = bounds;
+  std::string args;
+  job.SerializeToString(&args);
+  tracker_->Broadcast(NodeID::kWorkerGroup + NodeID::kServerGroup, args);
+  tracker_->WaitRemains(0);
+  key_bounds_ = bounds;
+}
+
+void SGDLearner::SaveKeyRanges() {
+  if (key_bounds_.empty()) return;
+  std::string name = param_.model_out + ".ranges";
+  std::unique_ptr<dmlc::Stream> fo(dmlc::Stream::Create(name.c_str(), "w"));
+  fo->Write(key_bounds_);
+}
+
+void SGDLearner::LoadValSample() {
+  BatchReader reader(param_.data_val, param_.data_format, 0, 1,
+                     param_.batch_size, 0, 1, 0, param_.num_parse_threads);
+  Localizer lc(-1, blk_nthreads_, Localizer::kHash);
+  val_sample_.clear();
+  int64_t nrows = 0;
+  while (nrows < param_.val_sample_rows && reader.Next()) {
+    const auto& blk = reader.Value();
+    auto data = new dmlc::data::RowBlockContainer<unsigned>();
+    auto feaids = std::make_shared<std::vector<feaid_t>>();
+    lc.Compact(blk, data, feaids.get());
+    sgd::LocalBatch local;
+    local.feaids = SArray<feaid_t>(feaids);
+    local.data = SharedRowBlockContainer<unsigned>(&data);
+    delete data;
+    val_sample_.push_back(local);
+    nrows += blk.size;
+  }
+  LOG(INFO) << "Validating " << nrows << " examples of " << param_.data_val
+            << " every " << param_.val_interval_sec << " sec of training";
+}
+
+void SGDLearner::SampleValidation(int epoch, const std::atomic<bool>& done) {
+  double last = dmlc::GetTime();
+  while (!done) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    if (dmlc::GetTime() - last < param_.val_interval_sec) continue;
+    // the weights are pulled from the models being trained
+    std::vector<sgd::Progress> progs(models_.size());
+    sgd::Job job;
+    job.type = sgd::Job::kValidation;
+    job.num_parts = 1;
+    job.part_idx = 0;
+    job.epoch = epoch;
+    double start = dmlc::GetTime();
+    IteratePart(job, Models(), &progs, &val_sample_);
+    last = dmlc::GetTime();
+    size_t num_stopped = 0;
+    for (size_t m = 0; m < progs.size(); ++m) {
+      progs[m].sec = last - start;
+      LOG(INFO) << " - Sampled validation" << ModelTag(m) << ": "
+                << progs[m].TextString();
+      real_t auc = progs[m].AUC();
+      if (auc - sample_auc_[m] < param_.stop_val_auc) ++num_stopped;
+      sample_auc_[m] = auc;
+    }
+    if (num_stopped == progs.size()) {
+      LOG(INFO) << "Change of sampled validation AUC < stop_val_auc ["
+                << param_.stop_val_auc << "], stop training";
+      stop_training_ = true;
+      return;
+    }
+  }
+}
+
+void SGDLearner::CountKeys(const sgd::Job& job, std::string* rets) {
+  BatchReader reader(param_.data_in, param_.data_format, job.part_idx,
+                     job.num_parts, param_.batch_size, 0, 1, 0,
+                     param_.num_parse_threads);
+  Localizer lc(-1, blk_nthreads_, Localizer::kHash);
+  std::vector<real_t> hist(KeyRanges::NumBuckets());
+  int64_t nrows = 0;
+  while (nrows < param_.key_balance_rows && reader.Next()) {
+    // a batch requests each of its features once
+    const auto& blk = reader.Value();
+    dmlc::data::RowBlockContainer<unsigned> data;
+    auto feaids = std::make_shared<std::vector<feaid_t>>();
+    lc.Compact(blk, &data, feaids.get());
+    KeyRanges::Add(SArray<feaid_t>(feaids), 1, &hist);
+    nrows += blk.size;
+  }
+  rets->assign(reinterpret_cast<char const*>(hist.data()),
+               hist.size() * sizeof(real_t));
+}
+
+void SGDLearner::LoadModel(const std::string& model) {
+  // every model of a sweep starts from model_in, or resumes from its own
+  // checkpoint
+  for (auto& m : models_) {
+    auto filename = ModelName(model.size() ? model + m->suffix :
+                              param_.model_in, store_->Rank());
+    std::unique_ptr<dmlc::Stream> fi(
+        dmlc::Stream::Create(filename.c_str(), "r"));
+    bool has_aux;
+    m->updater()->Load(fi.get(), &has_aux);
+    CHECK(has_aux) << filename
+                   << " has no aux data, cannot continue training";
+  }
+}
+
+void SGDLearner::SaveModel(bool async) {
+  for (auto& m : models_) {
+    auto filename = ModelName(param_.model_out + m->suffix, store_->Rank());
+    // the previous checkpoint is written first, it has the same filename
+    m->saver.Wait();
+    if (async) {
+      ModelFile model;
+      m->updater()->Snapshot(true, &model);
+      m->saver.SaveAsync(std::move(model), filename);
+      continue;
+    }
+    auto updater = m->updater();
+    ModelSaver::Write(filename, [updater](dmlc::Stream* fo) {
+        updater->Save(true, fo);
+      });
+  }
+}
+
+void SGDLearner::RunEpoch(int epoch, int job_type,
+                          std::vector<sgd::Progress>* progs,
+                          const std::string& filename) {
+  double start = dmlc::GetTime();
+  // progress merger, a job returns the progress of every model
+  progs->assign(models_.size(), sgd::Progress());
+  auto merge = [](std::vector<sgd::Progress>* progs) {
+    return [progs](int node_id, const std::string& rets) {
+      if (rets.empty()) return;
+      std::string copy = rets;
+      dmlc::MemoryStringStream fi(&copy);
+      for (auto& p : *progs) {
+        sgd::Progress other;
+        other.Load(&fi);
+        p.Merge(other);
+      }
+    };
+  };
+  tracker_->SetMonitor(merge(progs));
 
   // issue jobs
   int n = store_->NumWorkers() * param_.num_jobs_per_epoch;
@@ -84,37 +638,90 @@ void SGDLearner::RunEpoch(int epoch, int job_type, sgd::Progress* prog) {
     job.epoch = epoch;
     job.num_parts = n;
     job.part_idx = i;
+    job.filename = filename;
+    job.push_batches = push_batches_;
     job.SerializeToString(&jobs[i].second);
   }
   tracker_->Issue(jobs);
 
   // wait
-  while (tracker_->NumRemains()) {
-    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  tracker_->WaitRemains(0);
+  double sec = dmlc::GetTime() - start;
+  for (auto& p : *progs) p.sec = sec;
+
+  // the penalty and the nnz of the models, which the servers keep up to date
+  if (job_type == sgd::Job::kTraining) {
+    std::vector<sgd::Progress> evals(models_.size());
+    tracker_->SetMonitor(merge(&evals));
+    sgd::Job job;
+    job.type = sgd::Job::kEvaluation;
+    std::string args;
+    job.SerializeToString(&args);
+    tracker_->Broadcast(NodeID::kServerGroup, args);
+    tracker_->WaitRemains(0);
+    for (size_t m = 0; m < evals.size(); ++m) {
+      (*progs)[m].penalty = evals[m].penalty;
+      (*progs)[m].nnz_w = evals[m].nnz_w;
+    }
+  }
+}
+
+void SGDLearner::AdaptPushBatches(const sgd::Progress& train,
+                                  real_t pre_loss) {
+  using sgd::Stage;
+  if (push_batches_ >= param_.adapt_push_batches) return;
+  std::stringstream reason;
+  real_t rel = pre_loss > 0 ? (pre_loss - train.loss) / pre_loss : 1;
+  real_t store = train.busy_sec[Stage::kPull] + train.busy_sec[Stage::kPush];
+  real_t compute = train.busy_sec[Stage::kCompute];
+  if (rel < param_.adapt_rel_objv) {
+    reason << "the loss decreased by " << rel << " < adapt_rel_objv ["
+           << param_.adapt_rel_objv << "]";
+  } else if (store > param_.adapt_store_ratio * compute) {
+    reason << "the pull and push stages are busy " << store << " sec > "
+           << "adapt_store_ratio [" << param_.adapt_store_ratio
+           << "] x compute " << compute << " sec";
+  } else {
+    return;
   }
+  push_batches_ = std::min(push_batches_ * 2, param_.adapt_push_batches);
+  real_t scale = sqrt(static_cast<real_t>(push_batches_) /
+                      param_.grad_push_batches);
+  LOG(INFO) << " - Push every " << push_batches_ << " batches ("
+            << push_batches_ * param_.batch_size << " examples) and scale "
+            << "V_lr by " << scale << ", since " << reason.str();
+
+  // the summed gradients of more batches make fewer updates, so V moves
+  // faster per update
+  tracker_->SetMonitor(nullptr);
+  sgd::Job job;
+  job.type = sgd::Job::kScaleLearningRate;
+  job.lr_scale = scale;
+  std::string args;
+  job.SerializeToString(&args);
+  tracker_->Broadcast(NodeID::kServerGroup, args);
+  tracker_->WaitRemains(0);
+}
 
-  // get penalty from servers
-  // if (job_type == sgd::Job::kTraining) {
-  //   int n = store_->NumServers();
-  //   std::vector<std::pair<int, std::string>> jobs(n);
-  //   for (int i = 0; i < n; ++i) {
-  //     jobs[i].first = NodeID::Encode(NodeID::kServerGroup, i);
-  //     sgd::Job job;
-  //     job.type = sgd::Job::kEvaluation;
-  //     job.SerializeToString(&jobs[i].second);
-  //   }
-  //   tracker_->Issue(jobs);
-  //   while (tracker_->NumRemains()) {
-  //     std::this_thread::sleep_for(std::chrono::milliseconds(10));
-  //   }
-  // }
+void SGDLearner::EndEpoch(int epoch, const std::vector<sgd::Progress>& train,
+                          const std::vector<sgd::Progress>& val) {
+  for (const auto& cb : epoch_end_callback_) cb(epoch, train[0], val[0]);
+  for (const auto& cb : sweep_callback_) {
+    for (size_t m = 0; m < models_.size(); ++m) {
+      cb(epoch, static_cast<int>(m), train[m], val[m]);
+    }
+  }
 }
 
-void SGDLearner::GetPos(const SArray<int>& len,
-                        SArray<int>* w_pos, SArray<int>* V_pos) {
+void SGDLearner::GetPos(const sgd::Model& model, const SArray<int>& len,
+                        SArray<int>* w_pos, SArray<int>* V_pos,
+                        SArray<int>* V_len) {
+  bool mixed = model.mixed_V_dims;
   size_t n = len.size();
-  w_pos->resize(n);
-  V_pos->resize(n);
+  auto pool = BufferPool::Get();
+  *w_pos = pool->New<int>(n);
+  *V_pos = pool->New<int>(n);
+  *V_len = mixed ? pool->New<int>(n) : SArray<int>();
   int* w = w_pos->data();
   int* V = V_pos->data();
   int p = 0;
@@ -122,144 +729,593 @@ void SGDLearner::GetPos(const SArray<int>& len,
     int l = len[i];
     w[i] = l == 0 ? -1 : p;
     V[i] = l > 1 ? p+1 : -1;
+    if (mixed) (*V_len)[i] = l > 1 ? l - 1 : 0;
     p += l;
   }
 }
 
-void SGDLearner::IterateData(const sgd::Job& job, sgd::Progress* progress) {
-  AsyncLocalTracker<BatchJob> batch_tracker;
-  batch_tracker.SetExecutor(
-      [this, progress](const BatchJob& batch,
-                       const std::function<void()>& on_complete,
-                       std::string* rets) {
-        // use potiners here in order to copy into the callback
-        auto values = new SArray<real_t>();
-        auto lengths = new SArray<int>();
-        auto pull_callback = [this, batch, values, lengths, progress, on_complete]() {
+void SGDLearner::IterateData(const sgd::Job& job,
+                             std::vector<sgd::Progress>* progress) {
+  auto models = Models();
+  int n = param_.num_hogwild_threads;
+  if (n <= 1) {
+    IteratePart(job, models, progress);
+    return;
+  }
+  // part i is split into sub parts i*n, ..., i*n+n-1, so the parts are the
+  // same over epochs, which the cache requires
+  std::vector<std::vector<sgd::Progress>> progs(
+      n, std::vector<sgd::Progress>(progress->size()));
+  std::vector<std::thread> threads;
+  for (int t = 0; t < n; ++t) {
+    sgd::Job sub = job;
+    sub.num_parts = job.num_parts * n;
+    sub.part_idx = job.part_idx * n + t;
+    threads.push_back(std::thread([this, sub, &models, &progs, t]() {
+        IteratePart(sub, models, &progs[t]);
+      }));
+  }
+  for (int t = 0; t < n; ++t) {
+    threads[t].join();
+    for (size_t m = 0; m < progress->size(); ++m) {
+      (*progress)[m].Merge(progs[t][m]);
+    }
+  }
+}
+
+void SGDLearner::IteratePart(const sgd::Job& job,
+                             const std::vector<sgd::Model*>& models,
+                             std::vector<sgd::Progress>* progs,
+                             const std::vector<sgd::LocalBatch>* batches) {
+  using sgd::Stage;
+  bool train = job.type == sgd::Job::kTraining;
+  // the window the pulled batches are assigned to
+  int win_size = !train ? 1 : job.push_batches > 0 ? job.push_batches :
+                 param_.grad_push_batches;
+  size_t qsize = param_.pipeline_queue_size;
+  std::vector<std::unique_ptr<ModelPass>> passes;
+  for (size_t m = 0; m < models.size(); ++m) {
+    passes.emplace_back(new ModelPass(models[m], &(*progs)[m], qsize));
+  }
+  BoundedQueue<BatchJob> to_localize(qsize);
+
+  auto finish = [](ModelPass* p, BatchJob::Buffer* buf) {
+    {
+      std::lock_guard<std::mutex> lk(p->mu);
+      p->free_buffers.push_back(buf);
+      ++p->num_finished;
+    }
+    p->finish_cond.notify_all();
+  };
+
+  // pull the weights and wait, the hot ones are from the cache in training
+  auto pull = [train](ModelPass* p, const SArray<feaid_t>& feaids,
+                      SArray<real_t>* values, SArray<int>* lengths) {
+    DIFACTO_PROFILE_SCOPE(kPull);
+    DIFACTO_PROFILE_COUNT(kPull, feaids.size());
+    auto store = p->model->store;
+    auto& hot_cache = p->model->hot_cache;
+    if (train && !hot_cache.Disabled()) {
+      hot_cache.Pull(store, feaids, values, lengths);
+    } else {
+      store->Wait(store->Pull(feaids, Store::kWeight, values, lengths));
+    }
+  };
+
+  // pull the weights of batch the window does not have yet
+  auto pull_window = [&pull](ModelPass* p, BatchJob* batch) {
+    int width = p->width;
+    auto& win = *batch->window;
+    auto buf = batch->buf;
+    std::lock_guard<std::mutex> lk(win.mu);
+    size_t n = batch->feaids.size();
+    auto pool = BufferPool::Get();
+    SArray<int> lens = pool->New<int>(n, 0);
+    KVMatch(win.ids, win.lens, batch->feaids, &lens, ASSIGN, 1);
+    SArray<feaid_t> missing;
+    for (size_t i = 0; i < n; ++i) {
+      if (lens[i] == 0) missing.push_back(batch->feaids[i]);
+    }
+    if (missing.size()) {
+      pull(p, missing, &buf->values, &buf->lengths);
+      SArray<real_t> padded;
+      PadValues(buf->values, buf->lengths, missing.size(), width, &padded);
+      SArray<int> miss_lens = buf->lengths;
+      if (miss_lens.empty()) miss_lens.resize(missing.size(), 1);
+      // the missing ids are not in the window, so the op does not matter
+      SArray<feaid_t> ids, unused;
+      SArray<real_t> weights;
+      SArray<int> all_lens;
+      KVUnion(win.ids, win.weights, missing, padded, &ids, &weights, PLUS, 1);
+      KVUnion(win.ids, win.lens, missing, miss_lens, &unused, &all_lens,
+              PLUS, 1);
+      win.ids = ids;
+      win.weights = weights;
+      win.lens = all_lens;
+    }
+    SArray<real_t> padded = pool->New<real_t>(n * width, 0);
+    KVMatch(win.ids, win.weights, batch->feaids, &padded, ASSIGN, 1);
+    std::fill(lens.begin(), lens.end(), 0);
+    KVMatch(win.ids, win.lens, batch->feaids, &lens, ASSIGN, 1);
+    UnpadValues(padded, lens, width, &buf->values);
+    buf->lengths = width == 1 ? SArray<int>() : lens;
+  };
+  // push the summed gradients of a window
+  auto push_window = [](ModelPass* p, BatchWindow* win) {
+    DIFACTO_PROFILE_SCOPE(kPush);
+    DIFACTO_PROFILE_COUNT(kPush, win->grad_ids.size());
+    int width = p->width;
+    SArray<int> lens = BufferPool::Get()->New<int>(win->grad_ids.size(), 0);
+    KVMatch(win->ids, win->lens, win->grad_ids, &lens, ASSIGN, 1);
+    SArray<real_t> grads;
+    UnpadValues(win->grads, lens, width, &grads);
+    if (width == 1) lens = SArray<int>();
+    auto store = p->model->store;
+    store->Wait(store->Push(win->grad_ids, Store::kGradient, grads, lens));
+    store->Clock();
+  };
+
+  // start n threads running fn(&stall) of a stage, whose time is reported by
+  // the models of ps. the last finished one closes the output queues
+  std::vector<std::thread> threads;
+  auto start = [&threads](
+      int stage, int n, const std::vector<ModelPass*>& ps,
+      const std::vector<BoundedQueue<BatchJob>*>& outs,
+      const std::function<void(double* stall)>& fn) {
+    auto remain = std::make_shared<std::atomic<int>>(n);
+    for (int t = 0; t < n; ++t) {
+      threads.push_back(std::thread([ps, stage, outs, fn, remain]() {
+          double begin = dmlc::GetTime(), stall = 0;
+          fn(&stall);
+          for (auto p : ps) {
+            std::lock_guard<std::mutex> lk(p->mu);
+            p->progress->busy_sec[stage] += dmlc::GetTime() - begin - stall;
+            p->progress->stall_sec[stage] += stall;
+          }
+          if (--*remain == 0) {
+            for (auto out : outs) out->Close();
+          }
+        }));
+    }
+  };
+  std::vector<ModelPass*> all;
+  std::vector<BoundedQueue<BatchJob>*> to_pull;
+  for (auto& p : passes) {
+    all.push_back(p.get());
+    to_pull.push_back(&p->to_pull);
+  }
+
+  // read, from the cache if this part is cached in a previous epoch. a file
+  // of a stream is read only once, so it is not cached. a training job
+  // stops reading once stop_training_ is set
+  bool stream = job.filename.size();
+  std::string part = std::to_string(job.type) + "_" +
+      std::to_string(job.part_idx) + "_" + std::to_string(job.num_parts);
+  // the validation data has its own cache, so later validations only pull
+  // and predict
+  sgd::BatchCache* cache = train ? &cache_ : &val_cache_;
+  int ncached = stream || batches ? -1 : cache->Size(part);
+  std::atomic<bool> caching{ncached < 0 && !stream && !batches &&
+                            !cache->Disabled()};
+  start(Stage::kRead, 1, all, {&to_localize},
+        [this, &job, &part, cache, ncached, train, stream, batches, &all,
+         &to_localize](double* stall) {
+      if (batches) {
+        for (const auto& local : *batches) {
+          BatchJob batch;
+          batch.feaids = local.feaids;
+          batch.data = local.data;
+          to_localize.Push(batch, stall);
+        }
+        return;
+      }
+      if (ncached >= 0) {
+        std::vector<int> order(ncached);
+        for (int i = 0; i < ncached; ++i) order[i] = i;
+        if (train && param_.shuffle > 0) {
+          std::shuffle(order.begin(), order.end(),
+                       std::mt19937(job.epoch * job.num_parts + job.part_idx));
+        }
+        for (size_t k = 0; k < order.size(); ++k) {
+          if (train && stop_training_) break;
+          // read the next spilled batch while this one is processed
+          if (k + 1 < order.size()) cache->Prefetch(part, order[k+1]);
+          sgd::LocalBatch local;
+          cache->Get(part, order[k], &local);
+          BatchJob batch;
+          batch.feaids = local.feaids;
+          batch.data = local.data;
+          to_localize.Push(batch, stall);
+        }
+        return;
+      }
+      std::unique_ptr<Reader> reader;
+      if (train) {
+        reader.reset(new BatchReader(stream ? job.filename : param_.data_in,
+                                     param_.data_format,
+                                     job.part_idx,
+                                     job.num_parts,
+                                     param_.batch_size,
+                                     param_.shuffle,
+                                     param_.neg_sampling,
+                                     job.epoch * job.num_parts + job.part_idx,
+                                     param_.num_parse_threads,
+                                     param_.neg_sampling_weight));
+      } else {
+        reader.reset(new Reader(param_.data_val,
+                                param_.data_format,
+                                job.part_idx,
+                                job.num_parts,
+                                256*1024*1024,
+                                param_.num_parse_threads));
+      }
+      while ((!train || !stop_training_) && reader->Next()) {
+        // the reader reuses its buffer, so copy it for the next stage
+        BatchJob batch;
+        batch.raw = SharedRowBlockContainer<feaid_t>(reader->Value());
+        to_localize.Push(batch, stall);
+      }
+      for (auto p : all) {
+        std::lock_guard<std::mutex> lk(p->mu);
+        p->progress->parse_sec += reader->parse_sec();
+        p->progress->wait_sec += reader->wait_sec();
+        p->progress->read_mb += reader->read_bytes() / 1e6;
+        p->progress->read_sec += reader->read_sec();
+      }
+    });
+
+  // the feature counts summed over batches, and the pushes not finished
+  auto add_cnt = [this](ModelPass* p, const SArray<feaid_t>& ids,
+                        const SArray<real_t>& vals, bool flush) {
+    std::lock_guard<std::mutex> lk(p->cnt_mu);
+    if (ids.size()) {
+      SArray<feaid_t> joined_ids;
+      SArray<real_t> joined_vals;
+      KVUnion(p->cnt_ids, p->cnt_vals, ids, vals, &joined_ids, &joined_vals,
+              PLUS, 1);
+      p->cnt_ids = joined_ids;
+      p->cnt_vals = joined_vals;
+      ++p->cnt_batches;
+    }
+    if (p->cnt_batches >= param_.feacnt_push_batches ||
+        (flush && p->cnt_batches > 0)) {
+      // the arrays are not reused, so no need to wait
+      p->cnt_pushes.push_back(p->model->store->Push(
+          p->cnt_ids, Store::kFeaCount, p->cnt_vals, {}));
+      p->cnt_ids = SArray<feaid_t>();
+      p->cnt_vals = SArray<real_t>();
+      p->cnt_batches = 0;
+    }
+  };
+
+  // map feature id into continous index, the batches from the cache are
+  // localized already. a batch is passed to every model
+  // the counts are pushed in the first epoch, or for every file of a stream
+  bool push_cnt = train && (job.epoch == 0 || stream);
+  start(Stage::kLocalize, param_.num_localize_threads, all, to_pull,
+        [this, &part, cache, push_cnt, &add_cnt, &caching, &to_localize,
+         &all](double* stall) {
+      // the batches are small, so a hash table is faster than sorting all
+      // indices. the localizer reuses its buffers among batches
+      Localizer lc(-1, blk_nthreads_, Localizer::kHash);
+      RowDedup dedup;
+      BatchJob batch;
+      while (to_localize.Pop(&batch, stall)) {
+        if (batch.raw.offset.size()) {
+          auto data = new dmlc::data::RowBlockContainer<unsigned>();
+          auto feaids = std::make_shared<std::vector<feaid_t>>();
+          auto feacnt = std::make_shared<std::vector<real_t>>();
+          lc.Compact(batch.raw.GetBlock(), data, feaids.get(),
+                     push_cnt ? feacnt.get() : nullptr);
+          batch.raw = SharedRowBlockContainer<feaid_t>();
+          if (param_.dedup_rows) {
+            // the counts of the features are of the rows before merging
+            auto merged = new dmlc::data::RowBlockContainer<unsigned>();
+            dedup.Dedup(data->GetBlock(), merged);
+            std::swap(data, merged);
+            delete merged;
+          }
+          batch.feaids = SArray<feaid_t>(feaids);
+          batch.data = SharedRowBlockContainer<unsigned>(&data);
+          delete data;
+
+          // the feature ids are sorted, so the counts can be summed by
+          // KVUnion
+          if (push_cnt) {
+            SArray<real_t> cnts(feacnt);
+            for (auto p : all) add_cnt(p, batch.feaids, cnts, false);
+          }
+          if (caching && !cache->Add(part, {batch.feaids, batch.data})) {
+            caching = false;
+          }
+        }
+        for (auto p : all) p->to_pull.Push(batch, stall);
+      }
+    });
+
+  for (auto& pass : passes) {
+    ModelPass* p = pass.get();
+    // pull the newest model for the batch
+    start(Stage::kPull, param_.num_pull_threads, {p}, {&p->to_compute},
+          [this, p, win_size, &pull, &pull_window](double* stall) {
+        BatchJob batch;
+        while (p->to_pull.Pop(&batch, stall)) {
+          {
+            // wait until at most max_delay pulled batches are unfinished
+            std::unique_lock<std::mutex> lk(p->mu);
+            int seq = p->num_pulled++;
+            if (p->num_finished < seq - param_.max_delay) {
+              DIFACTO_PROFILE_SCOPE(kWait);
+              double begin = dmlc::GetTime();
+              p->finish_cond.wait(lk, [this, seq, p]() {
+                  return p->num_finished >= seq - param_.max_delay;
+                });
+              *stall += dmlc::GetTime() - begin;
+            }
+            if (p->free_buffers.empty()) {
+              p->buffers.emplace_back(new BatchJob::Buffer());
+              p->free_buffers.push_back(p->buffers.back().get());
+            }
+            batch.buf = p->free_buffers.back();
+            p->free_buffers.pop_back();
+            if (win_size > 1) {
+              if (!p->window || p->window->num_batches == win_size) {
+                p->window = std::make_shared<BatchWindow>();
+              }
+              ++p->window->num_batches;
+              batch.window = p->window;
+            }
+          }
+          // keep the capacity but clear the sizes, so a pull fills them
+          auto buf = batch.buf;
+          buf->values.resize(0);
+          buf->lengths.resize(0);
+          if (batch.window) {
+            pull_window(p, &batch);
+          } else {
+            pull(p, batch.feaids, &buf->values, &buf->lengths);
+          }
+          p->to_compute.Push(batch, stall);
+        }
+      });
+
+    // compute the loss, auc and the gradients
+    start(Stage::kCompute, param_.num_compute_threads, {p}, {&p->to_push},
+          [this, p, train, &finish](double* stall) {
+        const sgd::Model& model = *p->model;
+        sgd::Progress prog;
+        BatchJob batch;
+        while (p->to_compute.Pop(&batch, stall)) {
+          auto buf = batch.buf;
           // eval loss
           auto data = batch.data.GetBlock();
-          progress->nrows += data.size;
-          SArray<real_t> pred(data.size);
-          SArray<int> w_pos, V_pos;
-          GetPos(*lengths, &w_pos, &V_pos);
-          std::vector<SArray<char>> inputs = {
-            SArray<char>(*values), SArray<char>(w_pos), SArray<char>(V_pos)};
-          CHECK_NOTNULL(loss_)->Predict(data, inputs, &pred);
-          progress->loss += loss_->Evaluate(batch.data.label.data(), pred);
+          prog.nrows += data.size;
+          // the scratch arrays of a batch are recycled by the pool
+          SArray<real_t> pred = BufferPool::Get()->New<real_t>(data.size, 0);
+          SArray<int> w_pos, V_pos, V_len;
+          GetPos(model, buf->lengths, &w_pos, &V_pos, &V_len);
+          SArray<int> fields;
+          if (model.ffm) {
+            fields = BufferPool::Get()->New<int>(batch.feaids.size());
+            model.ffm->GetFields(batch.feaids, &fields);
+          }
+          // only the other losses get the inputs packed
+          std::vector<SArray<char>> inputs;
+          if (!model.fm && !model.ffm) {
+            inputs = {SArray<char>(buf->values), SArray<char>(w_pos),
+                      SArray<char>(V_pos)};
+            if (V_len.size()) inputs.push_back(SArray<char>(V_len));
+          }
+          Loss* loss = CHECK_NOTNULL(model.loss);
+          Loss::Workspace* ws = loss->GetWorkspace();
+          {
+            DIFACTO_PROFILE_SCOPE(kPredict);
+            DIFACTO_PROFILE_COUNT(kPredict, data.size);
+            if (model.fm) {
+              model.fm->Predict(data, buf->values, w_pos, V_pos, V_len, ws,
+                                &pred);
+            } else if (model.ffm) {
+              model.ffm->Predict(data, buf->values, w_pos, V_pos, fields, ws,
+                                 &pred);
+            } else {
+              loss->Predict(data, inputs, ws, &pred);
+            }
+          }
+          prog.loss += loss->Evaluate(data.label, pred, data.weight);
           // eval penalty
-          progress->penalty += EvaluatePenalty(*values, w_pos, V_pos);
+          prog.penalty += EvaluatePenalty(model, buf->values, w_pos, V_pos,
+                                          V_len);
 
           // auc, ...
-          BinClassMetric metric(batch.data.label.data(), pred.data(),
-                                pred.size(), blk_nthreads_);
-          progress->auc += metric.AUC();
+          prog.metric.Add(data.label, pred.data(), pred.size(),
+                          param_.auc_bins, 0, 1, data.weight);
 
+          if (!train) {
+            loss->ReleaseWorkspace(ws);
+            finish(p, buf);
+            continue;
+          }
           // calculate the gradients
-          if (batch.type == sgd::Job::kTraining) {
-            SArray<real_t> grads(values->size());
-            inputs.push_back(SArray<char>(pred));
-            loss_->CalcGrad(data, inputs, &grads);
-
-            // push the gradient, this task is done only if the push is complete
-            store_->Push(batch.feaids,
-                         Store::kGradient,
-                         grads,
-                         *lengths,
-                         [on_complete]() { on_complete(); });
-          } else {
-            // a validation job
-            on_complete();
+          buf->grads.resize(0);
+          buf->grads.resize(buf->values.size());
+          {
+            DIFACTO_PROFILE_SCOPE(kGrad);
+            DIFACTO_PROFILE_COUNT(kGrad, data.size);
+            if (model.fm) {
+              model.fm->CalcGrad(data, buf->values, w_pos, V_pos, V_len, pred,
+                                 ws, &buf->grads);
+            } else if (model.ffm) {
+              model.ffm->CalcGrad(data, buf->values, w_pos, V_pos, fields,
+                                  pred, ws, &buf->grads);
+            } else {
+              inputs.push_back(SArray<char>(pred));
+              loss->CalcGrad(data, inputs, ws, &buf->grads);
+            }
           }
-          delete values;
-          delete lengths;
-        };
-        // pull the weight back
-        store_->Pull(batch.feaids, Store::kWeight, values, lengths, pull_callback);
+          loss->ReleaseWorkspace(ws);
+          p->to_push.Push(batch, stall);
+        }
+        std::lock_guard<std::mutex> lk(p->mu);
+        p->progress->Merge(prog);
       });
 
-  Reader* reader = nullptr;
-  if (job.type == sgd::Job::kTraining) {
-    reader = new BatchReader(param_.data_in,
-                             param_.data_format,
-                             job.part_idx,
-                             job.num_parts,
-                             param_.batch_size,
-                             param_.batch_size * param_.shuffle,
-                             param_.neg_sampling);
-  } else {
-    reader = new Reader(param_.data_val,
-                        param_.data_format,
-                        job.part_idx,
-                        job.num_parts,
-                        256*1024*1024);
-  }
-  while (reader->Next()) {
-    // map feature id into continous index
-    auto data = new dmlc::data::RowBlockContainer<unsigned>();
-    auto feaids = std::make_shared<std::vector<feaid_t>>();
-    auto feacnt = std::make_shared<std::vector<real_t>>();
-    bool push_cnt =
-        job.type == sgd::Job::kTraining && job.epoch == 0;
-    Localizer lc(-1, blk_nthreads_);
-    lc.Compact(reader->Value(), data, feaids.get(), push_cnt ? feacnt.get() : nullptr);
-
-    // save results into batch
-    BatchJob batch;
-    batch.type = job.type;
-    batch.feaids = SArray<feaid_t>(feaids);
-    batch.data = SharedRowBlockContainer<unsigned>(&data);
-    delete data;
-
-    // push feature count into the servers
-    if (push_cnt) {
-      store_->Wait(store_->Push(
-          batch.feaids, Store::kFeaCount, SArray<real_t>(feacnt), {}));
-    }
+    // push the gradients, a batch is finished once its push is complete
+    start(Stage::kPush, param_.num_push_threads, {p}, {},
+          [p, win_size, &finish, &push_window](double* stall) {
+        auto store = p->model->store;
+        BatchJob batch;
+        while (p->to_push.Pop(&batch, stall)) {
+          auto buf = batch.buf;
+          if (!batch.window) {
+            DIFACTO_PROFILE_SCOPE(kPush);
+            DIFACTO_PROFILE_COUNT(kPush, batch.feaids.size());
+            store->Push(batch.feaids, Store::kGradient, buf->grads,
+                        buf->lengths, [p, buf, &finish]() { finish(p, buf); });
+            store->Clock();
+            continue;
+          }
+          // the window is full once all its batches are merged
+          auto& win = *batch.window;
+          bool full;
+          {
+            SArray<real_t> padded;
+            PadValues(buf->grads, buf->lengths, batch.feaids.size(), p->width,
+                      &padded);
+            std::lock_guard<std::mutex> lk(win.mu);
+            KVUnion(batch.feaids, padded, &win.grad_ids, &win.grads, PLUS, 1);
+            full = ++win.num_merged == win_size;
+          }
+          finish(p, buf);
+          if (full) push_window(p, &win);
+        }
+      });
+  }
 
-    // avoid too many batches are processing in parallel
-    while (batch_tracker.NumRemains() > 1) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  for (auto& t : threads) t.join();
+  for (auto& pass : passes) {
+    ModelPass* p = pass.get();
+    // the last window may be not full
+    if (p->window && p->window->num_batches < win_size) {
+      push_window(p, p->window.get());
     }
-    batch_tracker.Issue({batch});
+    add_cnt(p, SArray<feaid_t>(), SArray<real_t>(), true);
+    // wait the pushes are complete
+    DIFACTO_PROFILE_SCOPE(kWait);
+    for (int t : p->cnt_pushes) p->model->store->Wait(t);
+    std::unique_lock<std::mutex> lk(p->mu);
+    p->finish_cond.wait(lk, [p]() {
+        return p->num_finished == p->num_pulled;
+      });
   }
-  batch_tracker.Wait();
-  delete reader;
+  if (caching) cache->Finish(part);
 }
 
 KWArgs SGDLearner::Init(const KWArgs& kwargs) {
   auto remain = Learner::Init(kwargs);
   // init param
   remain = param_.InitAllowUnknown(remain);
+  // the base model, and the ones of the sweep, which override its arguments
+  auto sweep = ParseSweep(param_.sweep);
+  CHECK(sweep.empty() || !IsDistributed())
+      << "sweep is only supported by a local job";
+  KWArgs base = remain;
+  models_.push_back(CreateModel(base, &remain));
+  for (size_t k = 0; k < sweep.size(); ++k) {
+    KWArgs args = base;
+    for (const auto& kv : sweep[k]) {
+      bool found = false;
+      for (auto& arg : args) {
+        if (arg.first != kv.first) continue;
+        arg.second = kv.second;
+        found = true;
+      }
+      if (!found) args.push_back(kv);
+    }
+    KWArgs unknown;
+    models_.push_back(CreateModel(args, &unknown));
+    models_.back()->suffix = "_sweep" + std::to_string(k + 1);
+    for (const auto& kv : sweep[k]) {
+      for (const auto& arg : unknown) {
+        CHECK_NE(arg.first, kv.first) << "unknown argument in sweep";
+      }
+    }
+  }
+  for (auto& m : models_) {
+    m->hot_cache.Init(param_.hot_cache_size, param_.hot_cache_refresh,
+                      m->updater()->param().V_dim);
+  }
+  store_ = models_[0]->store;
+  push_batches_ = param_.grad_push_batches;
+  CHECK(!(param_.val_async || param_.val_interval_sec) || !IsDistributed())
+      << "val_async and val_interval_sec are only supported by a local job";
+  // init the cache of preprocessed data
+  cache_.Init(static_cast<size_t>(param_.data_cache_mb * 1024 * 1024),
+              param_.data_cache_compress, param_.data_cache_prefix);
+  val_cache_.Init(static_cast<size_t>(param_.val_cache_mb * 1024 * 1024),
+                  param_.data_cache_compress, param_.data_cache_prefix);
+  profiler_.Init(param_.report_interval);
+
+  return remain;
+}
+
+std::unique_ptr<sgd::Model> SGDLearner::CreateModel(const KWArgs& kwargs,
+                                                    KWArgs* remain) {
+  std::unique_ptr<sgd::Model> model(new sgd::Model());
+  model->args = kwargs;
   // init updater
   auto updater = new SGDUpdater();
-  remain = updater->Init(remain);
-  remain.push_back(std::make_pair("V_dim", std::to_string(updater->param().V_dim)));
+  *remain = updater->Init(kwargs);
+  remain->push_back(std::make_pair("V_dim",
+                                   std::to_string(updater->param().V_dim)));
   // init store
-  store_ = Store::Create();
-  store_->SetUpdater(std::shared_ptr<Updater>(updater));
-  remain = store_->Init(remain);
+  model->store = Store::Create();
+  model->store->SetUpdater(std::shared_ptr<Updater>(updater));
+  *remain = model->store->Init(*remain);
   // init loss
-  loss_ = Loss::Create(param_.loss, blk_nthreads_);
-  remain = loss_->Init(remain);
-
-  return remain;
+  model->loss = Loss::Create(param_.loss, blk_nthreads_);
+  *remain = model->loss->Init(*remain);
+  // not the subclasses, which may override the generic calls
+  if (typeid(*model->loss) == typeid(FMLoss)) {
+    model->fm = static_cast<FMLoss*>(model->loss);
+  }
+  model->ffm = dynamic_cast<FFMLoss*>(model->loss);
+  model->mixed_V_dims = !updater->param().V_dims.empty();
+  CHECK(!(model->ffm && model->mixed_V_dims)) << "ffm does not support V_dims";
+  return model;
 }
 
+std::unique_ptr<sgd::Model> SGDLearner::Snapshot(const sgd::Model& model) {
+  KWArgs remain;
+  auto snapshot = CreateModel(model.args, &remain);
+  // the aux data is not needed to predict
+  std::string str;
+  {
+    dmlc::MemoryStringStream fo(&str);
+    model.updater()->Save(false, &fo);
+  }
+  dmlc::MemoryStringStream fi(&str);
+  snapshot->updater()->Load(&fi, nullptr);
+  return snapshot;
+}
 
-real_t SGDLearner::EvaluatePenalty(const SArray<real_t>& weights,
+real_t SGDLearner::EvaluatePenalty(const sgd::Model& model,
+                                   const SArray<real_t>& weights,
                                    const SArray<int>& w_pos,
-                                   const SArray<int>& V_pos) {
+                                   const SArray<int>& V_pos,
+                                   const SArray<int>& V_len) {
   real_t objv = 0;
-  auto param = GetUpdater()->param();
+  const auto& param = model.updater()->param();
   if (w_pos.size()) {
     for (int p : w_pos) {
       if (p == -1) continue;
       real_t w = weights[p];
       objv += param.l1 * fabs(w) + .5 * param.l2 * w * w;
     }
-    for (int p : V_pos) {
+    for (size_t j = 0; j < V_pos.size(); ++j) {
+      int p = V_pos[j];
       if (p == -1) continue;
-      for (int i = 0; i < param.V_dim; ++i) {
+      int d = V_len.empty() ? param.V_dim : V_len[j];
+      for (int i = 0; i < d; ++i) {
         real_t V = weights[p+i];
         objv += .5 * param.V_l2 * V * V;
       }
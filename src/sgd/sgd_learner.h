@@ -3,27 +3,63 @@
  */
 #ifndef DIFACTO_SGD_SGD_LEARNER_H_
 #define DIFACTO_SGD_SGD_LEARNER_H_
+#include <atomic>
+#include <memory>
 #include <string>
 #include <vector>
 #include "difacto/learner.h"
 #include "./sgd_utils.h"
 #include "./sgd_updater.h"
 #include "./sgd_param.h"
+#include "./sgd_batch_cache.h"
+#include "./sgd_hot_cache.h"
+#include "common/model_saver.h"
+#include "reporter/profile_reporter.h"
 #include "difacto/loss.h"
+#include "loss/ffm_loss.h"
+#include "loss/fm_loss.h"
 #include "difacto/store.h"
 namespace difacto {
+namespace sgd {
+/**
+ * \brief a model trained by \ref SGDLearner, with its own updater, store and
+ * loss. the base model and the ones of SGDLearnerParam::sweep share the read
+ * and localize stages of the data pipeline
+ */
+struct Model {
+  ~Model() {
+    delete loss;
+    delete store;
+  }
+  SGDUpdater* updater() const {
+    return CHECK_NOTNULL(std::static_pointer_cast<SGDUpdater>(
+        CHECK_NOTNULL(store)->updater()).get());
+  }
+  /** \brief appended to model_in and model_out, empty for the base model */
+  std::string suffix;
+  /** \brief the kwargs it is created by */
+  KWArgs args;
+  Store* store = nullptr;
+  Loss* loss = nullptr;
+  /**
+   * \brief loss if it is exactly fm or ffm, whose typed calls skip packing
+   * the inputs, and ffm needs the fields of the features
+   */
+  FMLoss* fm = nullptr;
+  FFMLoss* ffm = nullptr;
+  /** \brief whether the feature groups have different V dimensions */
+  bool mixed_V_dims = false;
+  /** \brief the weights of the frequent features */
+  HotCache hot_cache;
+  /** \brief writes the checkpoints in background */
+  ModelSaver saver;
+};
+}  // namespace sgd
 
 class SGDLearner : public Learner {
  public:
-  SGDLearner() {
-    store_ = nullptr;
-    loss_ = nullptr;
-  }
-
-  virtual ~SGDLearner() {
-    delete loss_;
-    delete store_;
-  }
+  SGDLearner() { }
+  virtual ~SGDLearner() { }
   KWArgs Init(const KWArgs& kwargs) override;
 
   void AddEpochEndCallback(const std::function<void(
@@ -31,11 +67,25 @@ class SGDLearner : public Learner {
     epoch_end_callback_.push_back(callback);
   }
 
+  /**
+   * \brief the callback of every model, model 0 is the base one and model k
+   * is the k-th configuration of SGDLearnerParam::sweep
+   */
+  void AddSweepEpochEndCallback(const std::function<void(
+      int epoch, int model, const sgd::Progress& train,
+      const sgd::Progress& val)>& callback) {
+    sweep_callback_.push_back(callback);
+  }
+
+  /** \brief the updater of the base model */
   SGDUpdater* GetUpdater() {
-    return CHECK_NOTNULL(std::static_pointer_cast<SGDUpdater>(
-        CHECK_NOTNULL(store_)->updater()).get());
+    return CHECK_NOTNULL(models_.size() ? models_[0].get() : nullptr)
+        ->updater();
   }
 
+  /** \brief the number of models trained, 1 plus the sweep ones */
+  size_t NumModels() const { return models_.size(); }
+
  protected:
   void RunScheduler() override;
 
@@ -43,54 +93,233 @@ class SGDLearner : public Learner {
     using sgd::Job;
     sgd::Progress prog;
     Job job; job.ParseFromString(args);
-    if (job.type == Job::kTraining ||
-        job.type == Job::kValidation) {
-      IterateData(job, &prog);
-    } else if (job.type == Job::kEvaluation) {
-      GetUpdater()->Evaluate(&prog);
+    if (job.type == Job::kCountKeys) {
+      CountKeys(job, rets);
+      return;
+    } else if (job.type == Job::kSetKeyRanges) {
+      store_->SetKeyRanges(job.key_bounds);
+    } else if (job.type == Job::kTraining ||
+        job.type == Job::kValidation || job.type == Job::kEvaluation) {
+      std::vector<sgd::Progress> progs(models_.size());
+      if (job.type == Job::kEvaluation) {
+        for (size_t m = 0; m < models_.size(); ++m) {
+          models_[m]->updater()->Evaluate(&progs[m]);
+        }
+      } else {
+        IterateData(job, &progs);
+        // the other workers no longer wait for this one
+        for (auto& m : models_) m->store->ResetClock();
+        // the stats of a job are reported before the job is finished
+        profiler_.Flush();
+      }
+      // the progress of every model, in order
+      rets->clear();
+      dmlc::MemoryStringStream fo(rets);
+      for (const auto& p : progs) p.Save(&fo);
+      return;
+    } else if (job.type == Job::kScaleLearningRate) {
+      for (auto& m : models_) m->updater()->ScaleVLearningRate(job.lr_scale);
+    } else if (job.type == Job::kLoadModel) {
+      LoadModel(job.filename);
+    } else if (job.type == Job::kSaveModel) {
+      SaveModel(false);
+    } else if (job.type == Job::kCheckpoint) {
+      SaveModel(true);
     }
     prog.SerializeToString(rets);
   }
 
  private:
-  void RunEpoch(int epoch, int job_type, sgd::Progress* prog);
+  /**
+   * \brief create a model with its own updater, store and loss from kwargs
+   * @param remain the unknown kwargs
+   */
+  std::unique_ptr<sgd::Model> CreateModel(const KWArgs& kwargs,
+                                          KWArgs* remain);
+
+  /** \brief a local copy of the weights of a model, for validation */
+  std::unique_ptr<sgd::Model> Snapshot(const sgd::Model& model);
+
+  /** \brief the models of models_ */
+  std::vector<sgd::Model*> Models() const {
+    std::vector<sgd::Model*> models;
+    for (const auto& m : models_) models.push_back(m.get());
+    return models;
+  }
+
+  /**
+   * \brief read and localize the first val_sample_rows examples of data_val
+   * into val_sample_
+   */
+  void LoadValSample();
+
+  /**
+   * \brief validate the current models on val_sample_ every val_interval_sec
+   * seconds until done, and set stop_training_ once the AUC of every model
+   * improves less than stop_val_auc
+   */
+  void SampleValidation(int epoch, const std::atomic<bool>& done);
+
+  /**
+   * \brief run an epoch on data_in, or on filename if it is not empty, progs
+   * are the progress of every model
+   */
+  void RunEpoch(int epoch, int job_type, std::vector<sgd::Progress>* progs,
+                const std::string& filename = "");
+
+  /**
+   * \brief double the batches pushed together up to adapt_push_batches if
+   * the loss of the base model plateaus or the store is its bottleneck, and
+   * scale the learning rate of V by the servers
+   */
+  void AdaptPushBatches(const sgd::Progress& train, real_t pre_loss);
+
+  /** \brief log the progress of every model, and call the callbacks */
+  void EndEpoch(int epoch, const std::vector<sgd::Progress>& train,
+                const std::vector<sgd::Progress>& val);
+
+  /** \brief the name of model k in the logs, empty if there is only one */
+  std::string ModelTag(size_t k) const {
+    return models_.size() == 1 ? "" : " [model " + std::to_string(k) + "]";
+  }
+
+  /**
+   * \brief train on the new files of data_in as they arrive, see
+   * SGDLearnerParam::stream
+   *
+   * the names of the trained files are saved into model_out.files once the
+   * model is written, the files not listed are trained after a restart
+   */
+  void RunStream();
+
+  /**
+   * \brief save a checkpoint of a stream, or the final model
+   *
+   * a checkpoint job returns before the model is written, and the next job
+   * waits for it. so the trained files of a checkpoint are listed by the next
+   * call, a listed file is always in model_out
+   */
+  void SaveStream(const std::vector<std::string>& trained, bool final);
+
+  /** \brief issue a job to every node in a group and wait until they finish */
+  void IssueJobAndWait(int node_group, int job_type,
+                       const std::string& filename = "");
+
+  /**
+   * \brief set the server key ranges before training, balanced if
+   * key_balance_rows > 0, or the ones saved with model_in
+   */
+  void InitKeyRanges();
+
+  /** \brief send the key bounds to all workers and servers */
+  void SetKeyRanges(const std::vector<feaid_t>& bounds);
+
+  /**
+   * \brief count the batches each feature appears in over the first
+   * key_balance_rows examples of a part, and return the loads of the key
+   * buckets, see \ref KeyRanges
+   */
+  void CountKeys(const sgd::Job& job, std::string* rets);
+
+  /** \brief save the key bounds with model_out if they are set */
+  void SaveKeyRanges();
+
+  /**
+   * \brief load the model from model_in, or from filename if it is not
+   * empty, with aux data if exists
+   */
+  void LoadModel(const std::string& filename);
+
+  /**
+   * \brief save the model with aux data into model_out, in background if
+   * async. the previous model in writing is waited first
+   */
+  void SaveModel(bool async);
+
+  /**
+   * \brief iterate on a part of a data by num_hogwild_threads threads, each
+   * runs \ref IteratePart on its own sub part. progs are of every model
+   */
+  void IterateData(const sgd::Job& job, std::vector<sgd::Progress>* progs);
 
   /**
    * \brief iterate on a part of a data
    *
-   * it repeats the following steps
+   * the batches go through a pipeline, the stages are connected by queues
+   * with at most pipeline_queue_size batches
    *
-   * 1. read batch_size examples
-   * 2. preprogress data (map from uint64 feature index into continous ones)
-   * 3. pull the newest model for this batch from the servers
-   * 4. compute the gradients on this batch
-   * 5. push the gradients to the servers to update the model
+   * 1. read: read batch_size examples, or a batch from the cache
+   * 2. localize: map from uint64 feature index into continous ones, with
+   *    num_localize_threads threads
+   * 3. pull: pull the newest model for this batch from the servers, with
+   *    num_pull_threads threads. it waits if more than max_delay pulled
+   *    batches are unfinished
+   * 4. compute: compute the gradients on this batch, with
+   *    num_compute_threads threads
+   * 5. push: push the gradients to the servers to update the model, with
+   *    num_push_threads threads
    *
-   * to maximize the parallelization of i/o and computation, we uses three
-   * threads here. they are asynchronized by callbacks
+   * if grad_push_batches > 1, every grad_push_batches consecutive training
+   * batches form a window. a window pulls a feature only once, and pushes the
+   * gradients summed over its batches once
    *
-   * a. main thread does 1 and 2
-   * b. batch_tracker's thread does 3 once a batch is preprocessed
-   * c. store_'s threads does 4 and 5 when the weight is pulled back
+   * each stage reports the seconds it works and it is blocked by other
+   * stages, the busy one with the least stall is the bottleneck
+   *
+   * with a sweep, a localized batch is passed to the pull stage of every
+   * model, each model has its own pull, compute and push stages. the read
+   * and localize stages are reported by every model
+   *
+   * the localized batches are read from batches instead if it is not null
    */
-  void IterateData(const sgd::Job& job, sgd::Progress* prog);
+  void IteratePart(const sgd::Job& job, const std::vector<sgd::Model*>& models,
+                   std::vector<sgd::Progress>* progs,
+                   const std::vector<sgd::LocalBatch>* batches = nullptr);
 
-  real_t EvaluatePenalty(const SArray<real_t>& weight,
+  /** \brief the penalty of the pulled weights, empty V_len means V_dim */
+  real_t EvaluatePenalty(const sgd::Model& model,
+                         const SArray<real_t>& weight,
                          const SArray<int>& w_pos,
-                         const SArray<int>& V_pos);
-  void GetPos(const SArray<int>& len,
-              SArray<int>* w_pos, SArray<int>* V_pos);
-  /** \brief the model store*/
-  Store* store_;
-  /** \brief the loss*/
-  Loss* loss_;
+                         const SArray<int>& V_pos,
+                         const SArray<int>& V_len);
+  /**
+   * \brief the positions of w and V from the lengths, and the lengths of V
+   * if the dimensions are mixed, otherwise V_len is empty
+   */
+  void GetPos(const sgd::Model& model, const SArray<int>& len,
+              SArray<int>* w_pos, SArray<int>* V_pos, SArray<int>* V_len);
+  /** \brief the base model, and then the ones of the sweep */
+  std::vector<std::unique_ptr<sgd::Model>> models_;
+  /** \brief the store of the base model, which runs the jobs */
+  Store* store_ = nullptr;
   /** \brief parameters */
   SGDLearnerParam param_;
+  /** \brief the batches pushed together, see adapt_push_batches */
+  int push_batches_ = 1;
+  /** \brief the examples of data_val validated during training */
+  std::vector<sgd::LocalBatch> val_sample_;
+  /** \brief the AUCs of every model on val_sample_ of the last time */
+  std::vector<real_t> sample_auc_;
+  /** \brief the training jobs stop reading once it is set */
+  std::atomic<bool> stop_training_{false};
+  /** \brief the preprocessed data, reused by the later epochs */
+  sgd::BatchCache cache_;
+  /** \brief the preprocessed data_val, see val_cache_mb */
+  sgd::BatchCache val_cache_;
+  /** \brief the trained files of the checkpoint being written by a stream */
+  std::vector<std::string> ckpt_files_;
+  /** \brief the key bounds of the servers, empty for the ps-lite ones */
+  std::vector<feaid_t> key_bounds_;
+  /** \brief the hot path profile, if compiled with PROFILE=1 */
+  ProfileReporter profiler_;
   // ProgressPrinter pprinter_;
   int blk_nthreads_ = DEFAULT_NTHREADS;
 
   std::vector<std::function<void(int epoch, const sgd::Progress& train,
                                  const sgd::Progress& val)>> epoch_end_callback_;
+  std::vector<std::function<void(int epoch, int model,
+                                 const sgd::Progress& train,
+                                 const sgd::Progress& val)>> sweep_callback_;
 };
 
 }  // namespace difacto
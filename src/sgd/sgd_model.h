@@ -0,0 +1,349 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ * @file   sgd_model.h
+ * @brief  the memory layout of the sgd model
+ */
+#ifndef DIFACTO_SGD_SGD_MODEL_H_
+#define DIFACTO_SGD_SGD_MODEL_H_
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include "difacto/base.h"
+#include "dmlc/logging.h"
+#include "common/float16.h"
+#include "common/huge_pages.h"
+namespace difacto {
+/**
+ * \brief the weight entry for one feature
+ */
+struct SGDEntry {
+  /** \brief the number of appearence of this feature in the data so far */
+  real_t fea_cnt = 0;
+  /** \brief w and its aux data */
+  real_t w = 0, sqrt_g = 0, z = 0;
+  /**
+   * \brief V and its aux data, allocated from a \ref SGDVArena and stored in
+   * the arena's types
+   */
+  char *V = nullptr;
+};
+
+/**
+ * \brief a flat open-addressing table maps feature ids into entries
+ *
+ * the slots only store (key, entry index) pairs, while the entries are
+ * allocated in fixed-size chunks. so a pointer to an entry is still valid
+ * after the table grows. an erased entry is reused only after the next
+ * \ref ReleaseErased, so a pointer obtained before is still safe to write
+ * until then.
+ *
+ * not thread-safe, the caller needs to lock \ref mu
+ */
+class SGDModelShard {
+ public:
+  SGDModelShard() { Rehash(kMinCapacity); }
+  ~SGDModelShard() { }
+
+  /**
+   * \brief returns the entry of a feature id, a new one is created if not
+   * exists
+   */
+  SGDEntry* Find(feaid_t key) {
+    size_t i = (HashFeaID(key) >> 20) & mask_;
+    while (true) {
+      Slot& s = slots_[i];
+      if (s.idx == kEmpty) break;
+      if (s.key == key) return GetEntry(s.idx);
+      i = (i + 1) & mask_;
+    }
+    if ((num_entries_ + 1) * 10 > slots_.size() * 7) {
+      Rehash(slots_.size() * 2);
+      return Find(key);
+    }
+    Slot& s = slots_[i];
+    s.key = key;
+    s.idx = NewEntry();
+    return GetEntry(s.idx);
+  }
+
+  /** \brief returns the entry of a feature id, nullptr if not exists */
+  SGDEntry* Lookup(feaid_t key) const {
+    size_t i = (HashFeaID(key) >> 20) & mask_;
+    while (true) {
+      const Slot& s = slots_[i];
+      if (s.idx == kEmpty) return nullptr;
+      if (s.key == key) return GetEntry(s.idx);
+      i = (i + 1) & mask_;
+    }
+  }
+
+  /** \brief remove a feature id, returns false if not exists */
+  bool Erase(feaid_t key) {
+    size_t i = (HashFeaID(key) >> 20) & mask_;
+    while (true) {
+      if (slots_[i].idx == kEmpty) return false;
+      if (slots_[i].key == key) break;
+      i = (i + 1) & mask_;
+    }
+    erased_.push_back(slots_[i].idx);
+    --num_entries_;
+    // shift the following slots back, so that no probe meets the hole
+    size_t j = i;
+    while (true) {
+      j = (j + 1) & mask_;
+      if (slots_[j].idx == kEmpty) break;
+      size_t h = (HashFeaID(slots_[j].key) >> 20) & mask_;
+      bool stay = i < j ? (h > i && h <= j) : (h > i || h <= j);
+      if (!stay) {
+        slots_[i] = slots_[j];
+        i = j;
+      }
+    }
+    slots_[i] = Slot();
+    return true;
+  }
+
+  /** \brief the entries erased so far can be reused by \ref Find */
+  void ReleaseErased() {
+    free_.insert(free_.end(), erased_.begin(), erased_.end());
+    erased_.clear();
+  }
+
+  /** \brief prefetch the slot a feature id will be probed first */
+  void Prefetch(feaid_t key) const {
+    __builtin_prefetch(&slots_[(HashFeaID(key) >> 20) & mask_]);
+  }
+
+  /** \brief visit all (key, entry) pairs */
+  template <typename Fn>
+  void ForEach(const Fn& fn) const {
+    for (const auto& s : slots_) {
+      if (s.idx != kEmpty) fn(s.key, *GetEntry(s.idx));
+    }
+  }
+
+  /** \brief the number of entries */
+  size_t size() const { return num_entries_; }
+
+  /** \brief the number of bytes allocated */
+  size_t MemBytes() const {
+    return slots_.size() * sizeof(Slot) +
+        chunks_.size() * kChunkSize * sizeof(SGDEntry);
+  }
+
+  /** \brief the lock protects this shard */
+  std::mutex mu;
+
+ private:
+  static const uint32_t kEmpty = 0xFFFFFFFF;
+  static const int kChunkBits = 10;
+  static const size_t kChunkSize = 1 << kChunkBits;
+  static const size_t kMinCapacity = 1 << 6;
+
+  struct Slot {
+    feaid_t key = 0;
+    uint32_t idx = kEmpty;
+  };
+
+  SGDEntry* GetEntry(uint32_t idx) const {
+    return chunks_[idx >> kChunkBits].get() + (idx & (kChunkSize - 1));
+  }
+
+  uint32_t NewEntry() {
+    ++num_entries_;
+    if (free_.size()) {
+      uint32_t idx = free_.back();
+      free_.pop_back();
+      *GetEntry(idx) = SGDEntry();
+      return idx;
+    }
+    CHECK(num_allocated_ < kEmpty) << "too many entries in a shard";
+    if (num_allocated_ == chunks_.size() * kChunkSize) {
+      chunks_.emplace_back(new SGDEntry[kChunkSize]);
+    }
+    return static_cast<uint32_t>(num_allocated_++);
+  }
+
+  void Rehash(size_t capacity) {
+    std::vector<Slot> old;
+    old.swap(slots_);
+    slots_.resize(capacity);
+    mask_ = capacity - 1;
+    for (const auto& s : old) {
+      if (s.idx == kEmpty) continue;
+      size_t i = (HashFeaID(s.key) >> 20) & mask_;
+      while (slots_[i].idx != kEmpty) i = (i + 1) & mask_;
+      slots_[i] = s;
+    }
+  }
+
+  std::vector<Slot> slots_;
+  size_t mask_ = 0;
+  std::vector<std::unique_ptr<SGDEntry[]>> chunks_;
+  /** \brief the entries in use, and the ones ever allocated */
+  size_t num_entries_ = 0, num_allocated_ = 0;
+  /** \brief the erased entries, and the ones can be reused */
+  std::vector<uint32_t> erased_, free_;
+};
+
+/**
+ * \brief allocates V and its aux data, with a fixed stride, from large slabs.
+ * thread-safe
+ *
+ * V and its aux data can be stored as 16-bit floats to save memory, they are
+ * then converted from and into real_t by \ref Get and \ref Set.
+ */
+class SGDVArena {
+ public:
+  /** \brief the storage type */
+  enum Type { kFP32 = 0, kFP16, kBF16 };
+
+  SGDVArena() { }
+  ~SGDVArena() { }
+
+  /** \brief parse the storage type name, fp32, fp16 or bf16 */
+  static Type GetType(const std::string& name) {
+    if (name == "fp32") return kFP32;
+    if (name == "fp16") return kFP16;
+    if (name == "bf16") return kBF16;
+    LOG(FATAL) << "unknown storage type: " << name;
+    return kFP32;
+  }
+
+  void Init(int V_dim, Type V_type = kFP32, Type aux_type = kFP32) {
+    V_dim_ = V_dim;
+    V_type_ = V_type;
+    aux_type_ = aux_type;
+    aux_offset_ = V_dim * TypeSize(V_type);
+    stride_ = aux_offset_ + V_dim * TypeSize(aux_type);
+    slab_size_ = stride_ * kRowsPerSlab;
+  }
+
+  /**
+   * \brief allocate rows zero-initialized Vs and their aux data at once,
+   * which are then accessed by \ref Row instead of \ref New
+   */
+  void Reserve(size_t rows) {
+    CHECK_GT(stride_, 0);
+    std::lock_guard<std::mutex> lk(mu_);
+    CHECK(slabs_.empty());
+    size_t n = (rows + kRowsPerSlab - 1) / kRowsPerSlab;
+    bufs_.push_back(HugePages::Get()->Alloc(n * slab_size_));
+    for (size_t i = 0; i < n; ++i) {
+      slabs_.push_back(bufs_.back().get() + i * slab_size_);
+    }
+    used_ = slab_size_;
+  }
+
+  /** \brief returns the i-th row allocated by \ref Reserve */
+  char* Row(size_t i) const {
+    return slabs_[i / kRowsPerSlab] + (i % kRowsPerSlab) * stride_;
+  }
+
+  /** \brief allocate a zero-initialized V and its aux data */
+  char* New() {
+    CHECK_GT(stride_, 0);
+    std::lock_guard<std::mutex> lk(mu_);
+    if (slabs_.empty() || used_ + stride_ > slab_size_) {
+      NewSlab();
+      used_ = 0;
+    }
+    char* p = slabs_.back() + used_;
+    used_ += stride_;
+    return p;
+  }
+
+  /**
+   * \brief returns true if both V and its aux data are stored as real_t, then
+   * they can be accessed directly from \ref New's memory: V_dim V followed by
+   * the V_dim aux data
+   */
+  bool IsFP32() const { return V_type_ == kFP32 && aux_type_ == kFP32; }
+
+  /**
+   * \brief read V and its aux data into real_t
+   * @param p the memory returned by \ref New
+   * @param V optional, the V_dim V
+   * @param aux optional, the V_dim aux data
+   */
+  void Get(char const* p, real_t* V, real_t* aux) const {
+    if (V) Decode(V_type_, p, V_dim_, V);
+    if (aux) Decode(aux_type_, p + aux_offset_, V_dim_, aux);
+  }
+
+  /** \brief write V and its aux data, either can be nullptr */
+  void Set(real_t const* V, real_t const* aux, char* p) const {
+    if (V) Encode(V_type_, V, V_dim_, p);
+    if (aux) Encode(aux_type_, aux, V_dim_, p + aux_offset_);
+  }
+
+  /** \brief the number of bytes allocated */
+  size_t MemBytes() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    return (slabs_.size() + spare_) * slab_size_;
+  }
+
+ private:
+  static size_t TypeSize(Type type) {
+    return type == kFP32 ? sizeof(real_t) : sizeof(uint16_t);
+  }
+
+  static void Decode(Type type, char const* p, int n, real_t* x) {
+    if (type == kFP32) {
+      memcpy(x, p, n * sizeof(real_t));
+      return;
+    }
+    uint16_t const* h = reinterpret_cast<uint16_t const*>(p);
+    for (int i = 0; i < n; ++i) {
+      x[i] = type == kFP16 ? HalfToFloat(h[i]) : BF16ToFloat(h[i]);
+    }
+  }
+
+  static void Encode(Type type, real_t const* x, int n, char* p) {
+    if (type == kFP32) {
+      memcpy(p, x, n * sizeof(real_t));
+      return;
+    }
+    uint16_t* h = reinterpret_cast<uint16_t*>(p);
+    for (int i = 0; i < n; ++i) {
+      h[i] = type == kFP16 ? FloatToHalf(x[i]) : FloatToBF16(x[i]);
+    }
+  }
+
+  /**
+   * \brief add a zero-initialized slab. if huge pages are enabled, the slabs
+   * are allocated a huge page each time, otherwise one by one
+   */
+  void NewSlab() {
+    if (spare_ == 0) {
+      spare_ = HugePages::Get()->Enabled() ?
+               std::max<size_t>(HugePages::kPageSize / slab_size_, 1) : 1;
+      bufs_.push_back(HugePages::Get()->Alloc(spare_ * slab_size_));
+      next_ = bufs_.back().get();
+    }
+    slabs_.push_back(next_);
+    next_ += slab_size_;
+    --spare_;
+  }
+
+  static const size_t kRowsPerSlab = 1 << 12;
+  int V_dim_ = 0;
+  Type V_type_ = kFP32;
+  Type aux_type_ = kFP32;
+  size_t aux_offset_ = 0;
+  size_t stride_ = 0;
+  size_t slab_size_ = 0;
+  size_t used_ = 0;
+  std::vector<char*> slabs_;
+  /** \brief the memory of the slabs, and the slabs not used yet in the last */
+  std::vector<std::shared_ptr<char>> bufs_;
+  char* next_ = nullptr;
+  size_t spare_ = 0;
+  mutable std::mutex mu_;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_SGD_SGD_MODEL_H_
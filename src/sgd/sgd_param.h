@@ -21,12 +21,25 @@ struct SGDLearnerParam : public dmlc::Parameter<SGDLearnerParam> {
   std::string data_format;
   /** \brief the model output for a training task */
   std::string model_out;
+  /**
+   * \brief save a checkpoint into model_out every checkpoint_epochs epochs,
+   * 0 means never. the model is written in background by the servers
+   */
+  int checkpoint_epochs;
+  /**
+   * \brief also save a checkpoint if these seconds passed since the last
+   * one, 0 means never
+   */
+  int checkpoint_sec;
   /**
    * \brief the model input
    * should be specified if it is a prediction task, or a training
    */
   std::string model_in;
-  /** \brief type of loss, defaut is fm*/
+  /**
+   * \brief type of loss, defaut is fm. ffm needs V_dim to be ffm_num_fields
+   * times the embedding dimension of a field, see \ref FFMLoss
+   */
   std::string loss;
   /** \brief the maximal number of data passes */
   int max_num_epochs;
@@ -34,32 +47,226 @@ struct SGDLearnerParam : public dmlc::Parameter<SGDLearnerParam> {
    * \brief the minibatch size
    */
   int batch_size;
-  int shuffle;
+  /**
+   * \brief the memory in MB of the buffer to shuffle the training examples,
+   * 0 means no shuffle
+   *
+   * it was the number of batches buffered before, such as the old default
+   * 10 for 10 * batch_size examples. an old value is now read as MB, which is
+   * usually a larger buffer. to keep the old one, set it to the old value *
+   * batch_size * the bytes of an example / 2^20
+   */
+  float shuffle;
+  /**
+   * \brief the probability to pickup a negative example. the examples of a
+   * part are sampled by a seed of the epoch and the part, so a run is
+   * reproducible
+   */
   float neg_sampling;
+  /**
+   * \brief weight a picked negative example by 1 / neg_sampling if 1, so the
+   * loss, the gradients and the metrics are unbiased and the predictions
+   * calibrated. if 0, the predictions are calibrated by the neg_sampling of
+   * the predictor instead. in default 1
+   */
+  int neg_sampling_weight;
 
   /** \brief issue num_jobs_per_epoch * num_workers per epoch */
   int num_jobs_per_epoch;
+  /**
+   * \brief the number of threads processing a job, each reads and computes
+   * its own part of the job's data. they update the model without locks
+   * (Hogwild), only the shards are locked to find the entries. in default 1
+   */
+  int num_hogwild_threads;
+  /**
+   * \brief the number of threads of the localize, pull, compute and push
+   * stages of a job. the read stage uses one thread, and num_parse_threads
+   * for text parsing. in default 1
+   */
+  int num_localize_threads;
+  int num_pull_threads;
+  int num_compute_threads;
+  int num_push_threads;
+  /**
+   * \brief the feature counts of the first epoch are summed over this many
+   * batches, and then pushed without waiting. the counts only decide when V
+   * is allocated, so the delay is harmless
+   */
+  int feacnt_push_batches;
+  /**
+   * \brief the gradients of this many consecutive batches are summed and
+   * pushed once, and these batches pull a feature only once, so they use
+   * the weights up to grad_push_batches batches old. in default 1, which
+   * pushes every batch
+   */
+  int grad_push_batches;
+  /**
+   * \brief the number of the most frequent features whose weights are cached
+   * by a worker, so a training batch only pulls the other ones. 0 means no
+   * cache
+   */
+  int hot_cache_size;
+  /**
+   * \brief the hot features and their weights are refreshed every this many
+   * pulls, so the cached weights are at most this many pulls old
+   */
+  int hot_cache_refresh;
+  /**
+   * \brief if positive, before training, each worker counts the batches each
+   * feature appears in over the first this many examples of its data, and
+   * the server key ranges are balanced by these counts, see \ref KeyRanges.
+   * the ranges are saved with the model, and loaded with model_in. 0 keeps
+   * the even ranges of ps-lite. only used by a distributed job not streamed
+   */
+  int key_balance_rows;
+  /**
+   * \brief if larger than grad_push_batches, the batches pushed together are
+   * adapted between epochs, which are doubled up to this many once the loss
+   * plateaus or the store is the bottleneck, so the effective batch size
+   * grows. the learning rate of V is scaled by the square root of the growth.
+   * 0 means grad_push_batches is fixed
+   */
+  int adapt_push_batches;
+  /**
+   * \brief the loss plateaus if its relative decrease in an epoch is less
+   * than this
+   */
+  real_t adapt_rel_objv;
+  /**
+   * \brief the store is the bottleneck if the pull and push stages are this
+   * times busier than the compute stage
+   */
+  real_t adapt_store_ratio;
+  /** \brief the maximal number of batches queued between two stages */
+  int pipeline_queue_size;
+  /**
+   * \brief a batch pulls the weights only if at most max_delay batches are
+   * pulled but not pushed yet. 0 means the weights always include all the
+   * previous updates, which is the sequential SGD
+   */
+  int max_delay;
 
-  /** \brief show the training progress for every n second */
+  /**
+   * \brief a node reports its profile every report_interval seconds if
+   * compiled with PROFILE=1, see \ref ProfileReporter
+   */
   int report_interval;
   /** \brief stop if (objv_new - objv_old) / obj_old < threshold */
   real_t stop_rel_objv;
   /** \brief stop if val_auc_new - val_auc_old < threshold */
   real_t stop_val_auc;
+  /**
+   * \brief if 1, the validation of an epoch runs on a snapshot of the models
+   * while the next epoch trains, so the validation progress and stop_val_auc
+   * are one epoch late. only used by a local job
+   */
+  int val_async;
+  /**
+   * \brief if positive, the first val_sample_rows examples of data_val are
+   * validated on the current models every val_interval_sec seconds of a
+   * training epoch, and the training stops in the epoch once their AUC
+   * improves less than stop_val_auc. only used by a local job
+   */
+  float val_interval_sec;
+  int val_sample_rows;
+  /** \brief the number of bins to approximate AUC, see AUCHistogram */
+  int auc_bins;
+  /** \brief the number of threads to parse a text data chunk */
+  int num_parse_threads;
+  /**
+   * \brief the memory in MB to cache the preprocessed data, so the later
+   * epochs read neither the files nor map the feature ids again. 0 means no
+   * cache. the batches exceeding it are written into data_cache_prefix if
+   * set, otherwise the part being read is not cached
+   */
+  float data_cache_mb;
+  /** \brief whether to compress the cached data by LZ4 */
+  int data_cache_compress;
+  /**
+   * \brief the prefix of the files the cached batches exceeding
+   * data_cache_mb are written into, such as /tmp/difacto_. empty means not
+   * to write
+   */
+  std::string data_cache_prefix;
+  /**
+   * \brief the memory in MB to cache the preprocessed data_val, apart from
+   * data_cache_mb, so a validation after the first one only pulls the
+   * weights and predicts. 0 means no cache
+   */
+  float val_cache_mb;
+  /**
+   * \brief merge the duplicate rows of a batch after localizing, if 1. the
+   * merged rows are weighted by their counts, and the positive and negative
+   * ones are kept apart. in default 0
+   */
+  int dedup_rows;
+  /**
+   * \brief train on a growing data_in directory if 1. the new files are
+   * trained once in the order of their names, a file is an epoch for
+   * checkpoint_epochs, which are 1 if both checkpoint_* are 0. a restart
+   * resumes from the last checkpoint
+   */
+  int stream;
+  /** \brief the seconds to wait before listing data_in again */
+  int stream_poll_sec;
+  /** \brief stop if no new file arrives in these seconds, 0 means never */
+  int stream_idle_sec;
+  /**
+   * \brief more models trained in the same data pass, separated by ';'. a
+   * model overrides the updater and loss arguments of the base one by its
+   * comma separated key=value pairs, such as "l1=.1,lr=.05;V_dim=4". model k
+   * is written into model_out_sweep<k>. the epochs stop once every model
+   * meets a stop criteria. only used by a local job
+   */
+  std::string sweep;
   DMLC_DECLARE_PARAMETER(SGDLearnerParam) {
     DMLC_DECLARE_FIELD(data_format).set_default("libsvm");
     DMLC_DECLARE_FIELD(data_in);
     DMLC_DECLARE_FIELD(data_val).set_default("");
     DMLC_DECLARE_FIELD(model_out).set_default("");
+    DMLC_DECLARE_FIELD(checkpoint_epochs).set_lower_bound(0).set_default(0);
+    DMLC_DECLARE_FIELD(checkpoint_sec).set_lower_bound(0).set_default(0);
     DMLC_DECLARE_FIELD(model_in).set_default("");
     DMLC_DECLARE_FIELD(loss).set_default("fm");
     DMLC_DECLARE_FIELD(max_num_epochs).set_default(20);
     DMLC_DECLARE_FIELD(num_jobs_per_epoch).set_default(10);
+    DMLC_DECLARE_FIELD(num_hogwild_threads).set_range(1, 256).set_default(1);
+    DMLC_DECLARE_FIELD(num_localize_threads).set_range(1, 64).set_default(1);
+    DMLC_DECLARE_FIELD(num_pull_threads).set_range(1, 64).set_default(1);
+    DMLC_DECLARE_FIELD(num_compute_threads).set_range(1, 64).set_default(1);
+    DMLC_DECLARE_FIELD(num_push_threads).set_range(1, 64).set_default(1);
+    DMLC_DECLARE_FIELD(feacnt_push_batches).set_range(1, 1024).set_default(16);
+    DMLC_DECLARE_FIELD(grad_push_batches).set_range(1, 1024).set_default(1);
+    DMLC_DECLARE_FIELD(adapt_push_batches).set_range(0, 1024).set_default(0);
+    DMLC_DECLARE_FIELD(adapt_rel_objv).set_lower_bound(0).set_default(1e-2);
+    DMLC_DECLARE_FIELD(adapt_store_ratio).set_lower_bound(0).set_default(2);
+    DMLC_DECLARE_FIELD(hot_cache_size).set_lower_bound(0).set_default(0);
+    DMLC_DECLARE_FIELD(hot_cache_refresh).set_range(1, 1 << 20).set_default(16);
+    DMLC_DECLARE_FIELD(key_balance_rows).set_lower_bound(0).set_default(0);
+    DMLC_DECLARE_FIELD(pipeline_queue_size).set_range(1, 1024).set_default(4);
+    DMLC_DECLARE_FIELD(max_delay).set_range(0, 1024).set_default(0);
+    DMLC_DECLARE_FIELD(report_interval).set_lower_bound(0).set_default(10);
     DMLC_DECLARE_FIELD(batch_size);
-    DMLC_DECLARE_FIELD(shuffle).set_default(10);
+    DMLC_DECLARE_FIELD(shuffle).set_default(64);
     DMLC_DECLARE_FIELD(neg_sampling).set_default(1);
+    DMLC_DECLARE_FIELD(neg_sampling_weight).set_default(1);
     DMLC_DECLARE_FIELD(stop_rel_objv).set_default(1e-5);
     DMLC_DECLARE_FIELD(stop_val_auc).set_default(1e-5);
+    DMLC_DECLARE_FIELD(val_async).set_default(0);
+    DMLC_DECLARE_FIELD(val_interval_sec).set_lower_bound(0).set_default(0);
+    DMLC_DECLARE_FIELD(val_sample_rows).set_lower_bound(1).set_default(10000);
+    DMLC_DECLARE_FIELD(auc_bins).set_range(1, 1024).set_default(256);
+    DMLC_DECLARE_FIELD(num_parse_threads).set_range(1, 64).set_default(2);
+    DMLC_DECLARE_FIELD(data_cache_mb).set_default(0);
+    DMLC_DECLARE_FIELD(data_cache_compress).set_default(0);
+    DMLC_DECLARE_FIELD(data_cache_prefix).set_default("");
+    DMLC_DECLARE_FIELD(val_cache_mb).set_lower_bound(0).set_default(1024);
+    DMLC_DECLARE_FIELD(dedup_rows).set_default(0);
+    DMLC_DECLARE_FIELD(stream).set_default(0);
+    DMLC_DECLARE_FIELD(stream_poll_sec).set_lower_bound(0).set_default(10);
+    DMLC_DECLARE_FIELD(stream_idle_sec).set_lower_bound(0).set_default(0);
+    DMLC_DECLARE_FIELD(sweep).set_default("");
   }
 };
 
@@ -87,10 +294,71 @@ struct SGDUpdaterParam : public dmlc::Parameter<SGDUpdaterParam> {
   float V_init_scale;
   /** \brief the embedding dimension */
   int V_dim;
+  /**
+   * \brief the embedding dimensions of some feature groups, such as
+   * "0:8,3:2,5:0", a dimension is at most V_dim, and the groups not listed
+   * use V_dim. empty means all features use V_dim
+   */
+  std::string V_dims;
+  /** \brief the number of bits of the group id in a feature id */
+  int V_group_bits;
   /** \brief the minimal feature count for allocating V */
   int V_threshold;
   /** \brief random seed */
   unsigned int seed;
+  /**
+   * \brief the number of shards of the model table, each shard is protected
+   * by its own lock
+   */
+  int num_shards;
+  /**
+   * \brief the storage type of V, fp32, fp16 or bf16. the 16-bit types halve
+   * the memory of V, while the computation is still in fp32
+   */
+  std::string V_storage;
+  /** \brief the storage type of the adagrad aux data of V */
+  std::string V_aux_storage;
+  /**
+   * \brief if positive, the feature ids are hashed into this many slots,
+   * which are preallocated. the features in a slot share w and V, so the
+   * model has a fixed size and no table is searched
+   */
+  int hash_capacity;
+  /**
+   * \brief the rows of the preallocated V table if hashed, slot i uses row
+   * i % V_hash_capacity. 0 means hash_capacity
+   */
+  int V_hash_capacity;
+  /**
+   * \brief if hashed, the V of a slot is the sum of this many rows of the V
+   * table, the first one by i % V_hash_capacity and the others by their own
+   * hash functions of slot i. so two slots rarely share all their rows
+   */
+  int V_num_hashes;
+  /**
+   * \brief if hashed, the V of slot i is the sum of row i % R and row R + i /
+   * R of the V table, where R = V_hash_capacity, namely the quotient-remainder
+   * trick. each slot then has its own pair of rows with R + hash_capacity / R
+   * rows, which are fewest if R is about sqrt(hash_capacity)
+   */
+  bool V_hash_qr;
+  /**
+   * \brief a feature gets an entry only after it is seen this many times,
+   * which are counted by a count-min sketch. a sighting is a count pushed
+   * or a gradient pushed. 0 means all features are admitted, at most 255
+   */
+  int admit_count;
+  /** \brief the memory in MB of the count-min sketch of admit_count */
+  float admit_sketch_mb;
+  /**
+   * \brief evict the idle entries every this many gradient pushes, 0 means
+   * never. an entry is idle if its w is 0, it has no V, and its count is
+   * less than evict_count. the sketch counts are halved at the same time,
+   * so the features not seen recently need to be admitted again
+   */
+  int evict_interval;
+  /** \brief see evict_interval */
+  float evict_count;
   DMLC_DECLARE_PARAMETER(SGDUpdaterParam) {
     DMLC_DECLARE_FIELD(l1).set_range(0, 1e10).set_default(1);
     DMLC_DECLARE_FIELD(l2).set_range(0, 1e10).set_default(0);
@@ -102,7 +370,20 @@ struct SGDUpdaterParam : public dmlc::Parameter<SGDUpdaterParam> {
     DMLC_DECLARE_FIELD(V_init_scale).set_range(0, 10).set_default(.01);
     DMLC_DECLARE_FIELD(V_threshold).set_default(10);
     DMLC_DECLARE_FIELD(V_dim);
+    DMLC_DECLARE_FIELD(V_dims).set_default("");
+    DMLC_DECLARE_FIELD(V_group_bits).set_range(1, 16).set_default(12);
     DMLC_DECLARE_FIELD(seed).set_default(0);
+    DMLC_DECLARE_FIELD(num_shards).set_range(1, 1024).set_default(32);
+    DMLC_DECLARE_FIELD(V_storage).set_default("fp32");
+    DMLC_DECLARE_FIELD(V_aux_storage).set_default("fp32");
+    DMLC_DECLARE_FIELD(hash_capacity).set_lower_bound(0).set_default(0);
+    DMLC_DECLARE_FIELD(V_hash_capacity).set_lower_bound(0).set_default(0);
+    DMLC_DECLARE_FIELD(V_num_hashes).set_range(1, 8).set_default(1);
+    DMLC_DECLARE_FIELD(V_hash_qr).set_default(false);
+    DMLC_DECLARE_FIELD(admit_count).set_range(0, 255).set_default(0);
+    DMLC_DECLARE_FIELD(admit_sketch_mb).set_lower_bound(0).set_default(4);
+    DMLC_DECLARE_FIELD(evict_interval).set_lower_bound(0).set_default(0);
+    DMLC_DECLARE_FIELD(evict_count).set_lower_bound(0).set_default(10);
   }
 };
 }  // namespace difacto
@@ -2,31 +2,486 @@
  * Copyright (c) 2015 by Contributors
  */
 #include <string.h>
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 #include "./sgd_updater.h"
+#include "./sgd_kernels.h"
 #include "difacto/store.h"
+#include "common/model_file.h"
+#include "common/profiler.h"
 namespace difacto {
 
 KWArgs SGDUpdater::Init(const KWArgs& kwargs) {
-  return param_.InitAllowUnknown(kwargs);
+  auto remain = param_.InitAllowUnknown(kwargs);
+  V_lr_ = param_.V_lr;
+  // a server receives new id arrays by each request, which never hit
+  cache_batches_ = !IsDistributed();
+  num_shards_ = param_.num_shards;
+  shards_.reset(new SGDModelShard[num_shards_]);
+  ParseVDims();
+  if (param_.admit_count > 0 && param_.hash_capacity == 0) {
+    size_t width = std::max<size_t>(
+        param_.admit_sketch_mb * 1024 * 1024 / kSketchDepth / num_shards_, 1);
+    sketches_.reset(new CountMinSketch<uint8_t>[num_shards_]);
+    for (int k = 0; k < num_shards_; ++k) {
+      sketches_[k].Init(width, kSketchDepth);
+    }
+  }
+  V_arenas_.resize(param_.V_dim + 1);
+  for (int d = 1; d <= param_.V_dim; ++d) {
+    if (d != param_.V_dim &&
+        std::find(grp_dims_.begin(), grp_dims_.end(), d) == grp_dims_.end()) {
+      continue;
+    }
+    V_arenas_[d].reset(new SGDVArena());
+    V_arenas_[d]->Init(d, SGDVArena::GetType(param_.V_storage),
+                       SGDVArena::GetType(param_.V_aux_storage));
+  }
+  if (param_.hash_capacity > 0) {
+    CHECK(grp_dims_.empty()) << "V_dims cannot be used with hash_capacity";
+    num_slots_ = param_.hash_capacity;
+    // the zeros are the default entries
+    auto buf = HugePages::Get()->Alloc(num_slots_ * sizeof(SGDEntry));
+    slots_ = std::shared_ptr<SGDEntry>(
+        buf, reinterpret_cast<SGDEntry*>(buf.get()));
+    num_V_mod_ = param_.V_hash_capacity > 0 ?
+                 param_.V_hash_capacity : num_slots_;
+    CHECK(!param_.V_hash_qr || param_.V_num_hashes == 1)
+        << "V_num_hashes cannot be used with V_hash_qr";
+    num_V_parts_ = param_.V_hash_qr ? 2 : param_.V_num_hashes;
+    // the quotient rows follow the remainder ones
+    num_V_rows_ = num_V_mod_ +
+        (param_.V_hash_qr ? (num_slots_ + num_V_mod_ - 1) / num_V_mod_ : 0);
+    if (param_.V_dim > 0) {
+      // the rows are initialized here, as they may be shared by slots. a V
+      // summed from several rows starts in the same range as a single one
+      int n = param_.V_dim;
+      auto& arena = *V_arenas_[n];
+      arena.Reserve(num_V_rows_);
+      std::vector<real_t> V(n);
+      Delta delta;
+      for (size_t i = 0; i < num_V_rows_; ++i) {
+        for (int j = 0; j < n; ++j) {
+          V[j] = (rand_r(&param_.seed) / (real_t)RAND_MAX - 0.5) *
+                 param_.V_init_scale / num_V_parts_;
+          delta.penalty += .5 * param_.V_l2 * V[j] * V[j];
+        }
+        arena.Set(V.data(), nullptr, arena.Row(i));
+      }
+      delta.nnz = static_cast<int64_t>(num_V_rows_) * n;
+      AddDelta(delta);
+    }
+    UpdateMemGauge();
+  }
+  return remain;
 }
 
-void SGDUpdater::Evaluate(sgd::Progress* prog) const {
-  real_t objv = 0;
-  size_t nnz = 0;
+void SGDUpdater::ParseVDims() {
+  grp_dims_.clear();
+  if (param_.V_dims.empty()) return;
+  grp_dims_.resize(1 << param_.V_group_bits, param_.V_dim);
+  std::stringstream ss(param_.V_dims);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    if (item.empty()) continue;
+    size_t colon = item.find(':');
+    CHECK_NE(colon, std::string::npos) << "bad V_dims: " << param_.V_dims;
+    int gid = atoi(item.substr(0, colon).c_str());
+    int dim = atoi(item.substr(colon + 1).c_str());
+    CHECK(gid >= 0 && gid < static_cast<int>(grp_dims_.size()))
+        << "bad group id " << gid << " in V_dims";
+    CHECK(dim >= 0 && dim <= param_.V_dim)
+        << "the dimension of group " << gid << " should be in [0, V_dim]";
+    grp_dims_[gid] = dim;
+  }
+}
+
+template <typename Fn>
+void SGDUpdater::VisitShards(const SArray<feaid_t>& fea_ids, const Fn& fn) {
+  size_t size = fea_ids.size();
+  if (num_shards_ == 1) {
+    auto& s = shards_[0];
+    std::lock_guard<std::mutex> lk(s.mu);
+    for (size_t i = 0; i < size; ++i) {
+      if (i + kPrefetchDist < size) s.Prefetch(fea_ids[i + kPrefetchDist]);
+      fn(0, i);
+    }
+    return;
+  }
+  // bucket the positions by shard
+  std::vector<int> shard(size);
+  std::vector<size_t> start(num_shards_+1, 0);
+  for (size_t i = 0; i < size; ++i) {
+    shard[i] = ShardID(fea_ids[i]);
+    ++start[shard[i]+1];
+  }
+  for (int k = 0; k < num_shards_; ++k) start[k+1] += start[k];
+  std::vector<size_t> pos(size);
+  std::vector<size_t> end(start.begin(), start.end()-1);
+  for (size_t i = 0; i < size; ++i) pos[end[shard[i]]++] = i;
+  // one lock per shard
+  for (int k = 0; k < num_shards_; ++k) {
+    if (start[k] == start[k+1]) continue;
+    auto& s = shards_[k];
+    std::lock_guard<std::mutex> lk(s.mu);
+    for (size_t j = start[k]; j < start[k+1]; ++j) {
+      if (j + kPrefetchDist < start[k+1]) {
+        s.Prefetch(fea_ids[pos[j + kPrefetchDist]]);
+      }
+      fn(k, pos[j]);
+    }
+  }
+}
+
+void SGDUpdater::GetEntries(const SArray<feaid_t>& fea_ids, bool create,
+                            std::vector<SGDEntry*>* entries) {
+  size_t size = fea_ids.size();
+  entries->resize(size);
+  if (slots_) {
+    SGDEntry* slots = slots_.get();
+    for (size_t i = 0; i < size; ++i) {
+      (*entries)[i] = slots + ModelFile::HashSlot(fea_ids[i], num_slots_);
+    }
+    return;
+  }
+  VisitShards(fea_ids, [&](int k, size_t i) {
+      auto& s = shards_[k];
+      (*entries)[i] = create ? s.Find(fea_ids[i]) : s.Lookup(fea_ids[i]);
+    });
+}
+
+void SGDUpdater::AdmitEntries(const SArray<feaid_t>& fea_ids,
+                              const SArray<real_t>& counts,
+                              std::vector<SGDEntry*>* entries) {
+  SArray<feaid_t> missing;
+  std::vector<size_t> pos;
+  for (size_t i = 0; i < fea_ids.size(); ++i) {
+    if ((*entries)[i] == nullptr) {
+      missing.push_back(fea_ids[i]);
+      pos.push_back(i);
+    }
+  }
+  if (missing.empty()) return;
+  int admit = param_.admit_count;
+  size_t admitted = 0;
+  VisitShards(missing, [&](int k, size_t j) {
+      size_t i = pos[j];
+      if (admit > 0) {
+        uint64_t n = counts.empty() ? 1 : static_cast<uint64_t>(counts[i]);
+        if (sketches_[k].Add(missing[j], n) < admit) return;
+      }
+      // it may be created by another thread meanwhile
+      auto& s = shards_[k];
+      size_t num = s.size();
+      (*entries)[i] = s.Find(missing[j]);
+      admitted += s.size() - num;
+    });
+  num_admitted_ += admitted;
+}
+
+SGDUpdater::UpdateScope::UpdateScope(SGDUpdater* updater)
+    : updater_(updater) {
+  std::unique_lock<std::mutex> lk(updater_->pause_mu_);
+  updater_->pause_cond_.wait(lk, [this] { return !updater_->paused_; });
+  ++updater_->num_updating_;
+}
+
+SGDUpdater::UpdateScope::~UpdateScope() {
+  {
+    std::lock_guard<std::mutex> lk(updater_->pause_mu_);
+    --updater_->num_updating_;
+  }
+  updater_->pause_cond_.notify_all();
+}
+
+void SGDUpdater::PauseUpdates() const {
+  // one at a time, and only once the running updates are finished
+  std::unique_lock<std::mutex> lk(pause_mu_);
+  pause_cond_.wait(lk, [this] { return !paused_; });
+  paused_ = true;
+  pause_cond_.wait(lk, [this] { return num_updating_ == 0; });
+}
+
+void SGDUpdater::ResumeUpdates() const {
+  {
+    std::lock_guard<std::mutex> lk(pause_mu_);
+    paused_ = false;
+  }
+  pause_cond_.notify_all();
+}
+
+void SGDUpdater::Evict() {
+  PauseUpdates();
+  // the entries of the cached batches may be updated soon
+  std::unordered_set<SGDEntry const*> busy;
+  {
+    std::lock_guard<std::mutex> lk(cache_mu_);
+    for (const auto& b : cache_) {
+      for (SGDEntry* e : *b.entries) if (e) busy.insert(e);
+    }
+  }
+  size_t evicted = 0;
+  std::vector<feaid_t> idle;
+  for (int k = 0; k < num_shards_; ++k) {
+    auto& s = shards_[k];
+    std::lock_guard<std::mutex> lk(s.mu);
+    // the ones erased by the last round are not referenced any more
+    s.ReleaseErased();
+    idle.clear();
+    s.ForEach([&](feaid_t key, const SGDEntry& e) {
+        if (e.w == 0 && e.V == nullptr && e.fea_cnt < param_.evict_count &&
+            !busy.count(&e)) {
+          idle.push_back(key);
+        }
+      });
+    for (feaid_t key : idle) s.Erase(key);
+    evicted += idle.size();
+    if (sketches_) sketches_[k].Halve();
+  }
+  num_evicted_ += evicted;
+  ResumeUpdates();
+}
+
+void SGDUpdater::AdmitStats(size_t* num_admitted, size_t* num_evicted) const {
+  *num_admitted = num_admitted_;
+  *num_evicted = num_evicted_;
+}
+
+SGDUpdater::EntryList SGDUpdater::GetBatchEntries(
+    const SArray<feaid_t>& fea_ids, bool release) {
+  {
+    std::lock_guard<std::mutex> lk(cache_mu_);
+    for (auto it = cache_.begin(); it != cache_.end(); ++it) {
+      if (it->fea_ids.data() == fea_ids.data() &&
+          it->fea_ids.size() == fea_ids.size()) {
+        auto entries = it->entries;
+        if (release) cache_.erase(it);
+        return entries;
+      }
+    }
+  }
+  EntryList entries(new std::vector<SGDEntry*>());
+  GetEntries(fea_ids, false, entries.get());
+  // hashing is as cheap as the cache
+  if (!release && cache_batches_ && !fea_ids.empty() && !slots_) {
+    std::lock_guard<std::mutex> lk(cache_mu_);
+    if (cache_.size() >= kMaxCachedBatches) cache_.pop_front();
+    cache_.push_back(CachedBatch{fea_ids, entries});
+  }
+  return entries;
+}
+
+void SGDUpdater::Save(bool save_aux, dmlc::Stream *fo) const {
+  ModelFile model;
+  Snapshot(save_aux, &model);
+  model.Save(fo);
+}
+
+void SGDUpdater::Snapshot(bool save_aux, ModelFile* model) const {
+  // copy the entries shard by shard, the updates are paused only while a
+  // shard is copied
   int dim = param_.V_dim;
-  mu_.lock();
-  for (const auto& it : model_) {
-    const auto& e = it.second;
-    if (e.w) ++nnz;
-    objv += param_.l1 * fabs(e.w) + .5 * param_.l2 * e.w * e.w;
-    if (e.V) {
-      nnz += dim;
-      for (int i = 0; i < dim; ++i) objv += .5 * param_.l2 * e.V[i] * e.V[i];
+  ModelFile copy;
+  if (save_aux) copy.aux_w.resize(3);
+  std::vector<real_t> V(2 * dim);
+  auto visit = [&](feaid_t key, const SGDEntry& e) {
+      // zero entries are useless without aux data
+      if (!save_aux && e.w == 0 && !e.V) return;
+      // a slot never used
+      if (slots_ && e.fea_cnt == 0 && e.z == 0 && !e.V) return;
+      copy.feaids.push_back(key);
+      copy.w.push_back(e.w);
+      if (save_aux) {
+        copy.aux_w[0].push_back(e.fea_cnt);
+        copy.aux_w[1].push_back(e.sqrt_g);
+        copy.aux_w[2].push_back(e.z);
+      }
+      if (dim == 0) return;
+      if (!e.V) {
+        copy.V_idx.push_back(-1);
+        return;
+      }
+      // a shorter V is padded by zeros, so the file has a fixed V_dim
+      int d = VDim(key);
+      copy.V_idx.push_back(copy.V.size() / dim);
+      if (num_V_parts_ > 1 && key < num_slots_) {
+        // the sum for the predictor, the rows are restored from the keys
+        // after the slots
+        GetV(d, e, V.data(), V.data() + d);
+        std::fill(V.begin() + d, V.end(), 0);
+      } else {
+        V_arenas_[d]->Get(e.V, V.data(), save_aux ? V.data() + d : nullptr);
+      }
+      for (int j = 0; j < dim; ++j) copy.V.push_back(j < d ? V[j] : 0);
+      if (save_aux) {
+        for (int j = 0; j < dim; ++j) {
+          copy.aux_V.push_back(j < d ? V[j+d] : 0);
+        }
+      }
+    };
+  if (slots_) {
+    PauseUpdates();
+    for (size_t i = 0; i < num_slots_; ++i) visit(i, slots_.get()[i]);
+    // the rows of the V table summed into the V of the slots
+    for (size_t i = 0; num_V_parts_ > 1 && dim > 0 && i < num_V_rows_; ++i) {
+      SGDEntry row;
+      row.V = V_arenas_[dim]->Row(i);
+      visit(num_slots_ + i, row);
+    }
+    ResumeUpdates();
+  }
+  for (int k = 0; !slots_ && k < num_shards_; ++k) {
+    PauseUpdates();
+    {
+      auto& s = shards_[k];
+      std::lock_guard<std::mutex> lk(s.mu);
+      s.ForEach(visit);
     }
+    ResumeUpdates();
   }
-  mu_.unlock();
-  prog->penalty = objv;
-  prog->nnz_w = nnz;
+  // sort the features by id, the rows of V stay in place
+  size_t n = copy.feaids.size();
+  std::vector<size_t> order(n);
+  for (size_t i = 0; i < n; ++i) order[i] = i;
+  std::sort(order.begin(), order.end(), [&copy](size_t a, size_t b) {
+      return copy.feaids[a] < copy.feaids[b];
+    });
+  model->V_dim = dim;
+  model->hash_capacity = num_slots_;
+  model->feaids.resize(n);
+  model->w.resize(n);
+  if (dim > 0) model->V_idx.resize(n);
+  // SArray copies by pointer, so each column is allocated on its own
+  model->aux_w.resize(copy.aux_w.size());
+  for (auto& col : model->aux_w) col.resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    size_t j = order[i];
+    model->feaids[i] = copy.feaids[j];
+    model->w[i] = copy.w[j];
+    if (dim > 0) model->V_idx[i] = copy.V_idx[j];
+    for (size_t l = 0; l < copy.aux_w.size(); ++l) {
+      model->aux_w[l][i] = copy.aux_w[l][j];
+    }
+  }
+  model->V = copy.V;
+  model->aux_V = copy.aux_V;
+}
+
+void SGDUpdater::Load(dmlc::Stream* fi, bool* has_aux) {
+  ModelFile model;
+  model.Load(fi);
+  CHECK_EQ(model.V_dim, param_.V_dim) << "the model has a different V_dim";
+  CHECK_EQ(model.hash_capacity, num_slots_)
+      << "the model has a different hash_capacity";
+  bool aux = model.aux_w.size() == 3;
+  std::vector<SGDEntry*> entries;
+  if (slots_) {
+    size_t num_keys = num_slots_ + (num_V_parts_ > 1 ? num_V_rows_ : 0);
+    for (feaid_t slot : model.feaids) {
+      CHECK_LT(slot, num_keys);
+      entries.push_back(slot < num_slots_ ? slots_.get() + slot : nullptr);
+    }
+  } else {
+    GetEntries(model.feaids, true, &entries);
+  }
+  for (size_t i = 0; i < entries.size(); ++i) {
+    SGDEntry* e = entries[i];
+    if (e == nullptr) {
+      // a row of the V table
+      real_t const* V = model.GetV(i);
+      if (V == nullptr) continue;
+      auto& arena = *V_arenas_[param_.V_dim];
+      arena.Set(V, model.aux_V.size() ?
+                model.aux_V.data() + (V - model.V.data()) : nullptr,
+                arena.Row(model.feaids[i] - num_slots_));
+      continue;
+    }
+    e->w = model.w[i];
+    if (aux) {
+      e->fea_cnt = model.aux_w[0][i];
+      e->sqrt_g = model.aux_w[1][i];
+      e->z = model.aux_w[2][i];
+    }
+    real_t const* V = model.GetV(i);
+    int d = VDim(model.feaids[i]);
+    if (V == nullptr || d == 0) continue;
+    // keeps the first d of a padded V
+    auto& arena = *V_arenas_[d];
+    if (e->V == nullptr) e->V = NewV(d, e);
+    // the sum of the rows, which are loaded by themselves
+    if (num_V_parts_ > 1) continue;
+    arena.Set(V, model.aux_V.size() ?
+              model.aux_V.data() + (V - model.V.data()) : nullptr, e->V);
+  }
+  has_aux_ = aux;
+  if (has_aux) *has_aux = aux;
+  Recount();
+  UpdateMemGauge();
+}
+
+void SGDUpdater::Evaluate(sgd::Progress* prog) const {
+  prog->penalty = penalty_;
+  prog->nnz_w = nnz_;
+}
+
+void SGDUpdater::AddDelta(const Delta& delta) {
+  if (delta.nnz) nnz_ += delta.nnz;
+  if (delta.penalty == 0) return;
+  double cur = penalty_;
+  while (!penalty_.compare_exchange_weak(cur, cur + delta.penalty)) { }
+}
+
+void SGDUpdater::Recount() {
+  Delta delta;
+  std::vector<real_t> V(param_.V_dim);
+  auto add_V = [&](int d, char const* row) {
+    delta.nnz += d;
+    V_arenas_[d]->Get(row, V.data(), nullptr);
+    for (int i = 0; i < d; ++i) {
+      delta.penalty += .5 * param_.V_l2 * V[i] * V[i];
+    }
+  };
+  ForEachEntry([&](feaid_t key, const SGDEntry& e) {
+      if (e.w) ++delta.nnz;
+      delta.penalty += param_.l1 * fabs(e.w) + .5 * param_.l2 * e.w * e.w;
+      if (e.V && !slots_) add_V(VDim(key), e.V);
+    });
+  // the rows of the V table are shared by slots, and are all initialized
+  for (size_t i = 0; slots_ && param_.V_dim > 0 && i < num_V_rows_; ++i) {
+    add_V(param_.V_dim, V_arenas_[param_.V_dim]->Row(i));
+  }
+  penalty_ = delta.penalty;
+  nnz_ = delta.nnz;
+}
+
+void SGDUpdater::MemUsage(size_t* num_feas, size_t* num_bytes) const {
+  *num_feas = 0;
+  *num_bytes = 0;
+  for (const auto& arena : V_arenas_) {
+    if (arena) *num_bytes += arena->MemBytes();
+  }
+  if (sketches_) *num_bytes += sketches_[0].MemBytes() * num_shards_;
+  if (slots_) {
+    *num_feas = num_slots_;
+    *num_bytes += num_slots_ * sizeof(SGDEntry);
+    return;
+  }
+  for (int k = 0; k < num_shards_; ++k) {
+    auto& s = shards_[k];
+    std::lock_guard<std::mutex> lk(s.mu);
+    *num_feas += s.size();
+    *num_bytes += s.MemBytes();
+  }
+}
+
+void SGDUpdater::UpdateMemGauge() {
+  size_t num_feas, num_bytes;
+  MemUsage(&num_feas, &num_bytes);
+  mem_gauge_.Set(num_bytes);
 }
 
 void SGDUpdater::Get(const SArray<feaid_t>& fea_ids,
@@ -38,16 +493,18 @@ void SGDUpdater::Get(const SArray<feaid_t>& fea_ids,
   size_t size = fea_ids.size();
   weights->resize(size * (1 + V_dim));
   lens->resize(V_dim == 0 ? 0 : size);
+  auto entries = GetBatchEntries(fea_ids, false);
+  std::vector<real_t> buf(V_dim);
   int p = 0;
   for (size_t i = 0; i < size; ++i) {
-    mu_.lock();
-    auto& e = model_[fea_ids[i]];
-    mu_.unlock();
-    (*weights)[p++] = e.w;
-    if (e.V) {
-      memcpy(weights->data()+p, e.V, V_dim*sizeof(real_t));
-      p += V_dim;
-      (*lens)[i] = V_dim + 1;
+    // a feature not admitted yet has w = 0 only
+    auto e = (*entries)[i];
+    (*weights)[p++] = e ? e->w : 0;
+    if (e && e->V) {
+      int d = VDim(fea_ids[i]);
+      GetV(d, *e, weights->data()+p, buf.data());
+      p += d;
+      (*lens)[i] = d + 1;
     } else if (V_dim != 0) {
       (*lens)[i] = 1;
     }
@@ -61,18 +518,28 @@ void SGDUpdater::Update(const SArray<feaid_t>& fea_ids,
                         const SArray<int>& lens) {
   if (value_type == Store::kFeaCount) {
     CHECK_EQ(fea_ids.size(), values.size());
+    // the counts of several batches are often pushed together, which are
+    // not a batch the cache should keep
+    UpdateScope scope(this);
+    std::vector<SGDEntry*> entries;
+    GetEntries(fea_ids, false, &entries);
+    AdmitEntries(fea_ids, values, &entries);
+    Delta delta;
     for (size_t i = 0; i < fea_ids.size(); ++i) {
-      mu_.lock();
-      auto& e = model_[fea_ids[i]];
-      mu_.unlock();
+      if (entries[i] == nullptr) continue;
+      auto& e = *entries[i];
       e.fea_cnt += values[i];
-      if (param_.V_dim > 0 && e.V == nullptr
-          && e.w != 0 && e.fea_cnt > param_.V_threshold) {
-        InitV(&e);
+      if (e.V == nullptr && e.w != 0 && e.fea_cnt > param_.V_threshold) {
+        int d = VDim(fea_ids[i]);
+        if (d > 0) InitV(d, &e, &delta);
       }
     }
+    AddDelta(delta);
+    UpdateMemGauge();
   } else if (value_type == Store::kGradient) {
     CHECK(has_aux_) << "no aux data";
+    DIFACTO_PROFILE_SCOPE(kUpdate);
+    DIFACTO_PROFILE_COUNT(kUpdate, fea_ids.size());
     size_t size = fea_ids.size();
     bool w_only = lens.empty();
     if (w_only) {
@@ -80,28 +547,45 @@ void SGDUpdater::Update(const SArray<feaid_t>& fea_ids,
     } else {
       CHECK_EQ(lens.size(), size);
     }
+    std::vector<real_t> buf(2 * param_.V_dim);
     int p = 0;
     real_t* v = values.data();
+    Delta delta;
+    // the entries are released from the cache, so they are protected from
+    // the eviction by the scope until written
+    UpdateScope scope(this);
+    auto entries = GetBatchEntries(fea_ids, true);
+    AdmitEntries(fea_ids, SArray<real_t>(), entries.get());
     for (size_t i = 0; i < size; ++i) {
-      mu_.lock();
-      auto& e = model_[fea_ids[i]];
-      mu_.unlock();
-      UpdateW(v[p++], &e);
+      // the gradient of a feature not admitted is dropped
+      if ((*entries)[i] == nullptr) {
+        p += w_only ? 1 : lens[i];
+        continue;
+      }
+      auto& e = *(*entries)[i];
+      int d = VDim(fea_ids[i]);
+      UpdateW(v[p++], d, &e, &delta);
       if (!w_only && lens[i] > 1) {
-        CHECK_EQ(lens[i], param_.V_dim+1);
+        CHECK_EQ(lens[i], d+1);
         CHECK(e.V != nullptr) << fea_ids[i];
-        UpdateV(v+p, &e);
-        p += param_.V_dim;
+        UpdateV(d, v+p, buf.data(), &e, &delta);
+        p += d;
       }
     }
     CHECK_EQ(static_cast<size_t>(p), values.size());
+    AddDelta(delta);
   } else {
-    LOG(FATAL) << ".....";
+    LOG(FATAL) << "unknown value_type " << value_type;
+  }
+  // evict once the scope of this update is released
+  if (value_type == Store::kGradient && param_.evict_interval > 0 &&
+      !slots_ && ++num_pushes_ % param_.evict_interval == 0) {
+    Evict();
   }
 }
 
 
-void SGDUpdater::UpdateW(real_t gw, SGDEntry* e) {
+void SGDUpdater::UpdateW(real_t gw, int dim, SGDEntry* e, Delta* delta) {
   real_t sg = e->sqrt_g;
   real_t w = e->w;
   // update sqrt_g
@@ -119,31 +603,92 @@ void SGDUpdater::UpdateW(real_t gw, SGDEntry* e) {
     e->w = (z > 0 ? z - l1 : z + l1) / eta;
   }
   // update statistics
-  if (w == 0 && e->w != 0) {
-    if (param_.V_dim > 0 && e->V == nullptr && e->fea_cnt > param_.V_threshold) {
-      InitV(e);
+  real_t nw = e->w;
+  delta->penalty += l1 * (fabs(nw) - fabs(w)) +
+                    .5 * param_.l2 * (nw * nw - w * w);
+  delta->nnz += (nw != 0) - (w != 0);
+  if (w == 0 && nw != 0) {
+    if (dim > 0 && e->V == nullptr && e->fea_cnt > param_.V_threshold) {
+      InitV(dim, e, delta);
     }
   }
 }
 
-void SGDUpdater::UpdateV(real_t const* gV, SGDEntry* e) {
-  int n = param_.V_dim;
-  for (int i = 0; i < n; ++i) {
-    real_t g = gV[i] + param_.V_l2 * e->V[i];
-    real_t cg = e->V[i+n];
-    e->V[i+n] = sqrt(cg * cg + g * g);
-    float eta = param_.V_lr / (e->V[i+n] + param_.V_lr_beta);
-    e->V[i] -= eta * g;
+namespace {
+/** \brief the squared l2 norm */
+inline real_t SquaredNorm(int n, real_t const* V) {
+  real_t s = 0;
+  for (int i = 0; i < n; ++i) s += V[i] * V[i];
+  return s;
+}
+}  // namespace
+
+void SGDUpdater::UpdateV(int n, real_t const* gV, real_t* buf, SGDEntry* e,
+                         Delta* delta) {
+  UpdateVRow(n, gV, buf, e->V, delta);
+  // the gradient of each row summed into V is the one of V
+  for (int j = 1; j < num_V_parts_; ++j) {
+    size_t slot = e - slots_.get();
+    UpdateVRow(n, gV, buf, V_arenas_[n]->Row(VRow(slot, j)), delta);
   }
 }
 
-void SGDUpdater::InitV(SGDEntry* e) {
-  int n = param_.V_dim;
-  e->V = new real_t[n*2];
+void SGDUpdater::UpdateVRow(int n, real_t const* gV, real_t* buf, char* row,
+                            Delta* delta) {
+  auto& arena = *V_arenas_[n];
+  real_t* V;
+  if (arena.IsFP32()) {
+    V = reinterpret_cast<real_t*>(row);
+  } else {
+    V = buf;
+    arena.Get(row, buf, buf+n);
+  }
+  real_t before = SquaredNorm(n, V);
+  sgd::AdaGrad(n, param_.V_lr, param_.V_lr_beta, param_.V_l2, gV, V, V+n);
+  delta->penalty += .5 * param_.V_l2 * (SquaredNorm(n, V) - before);
+  if (!arena.IsFP32()) arena.Set(buf, buf+n, row);
+}
+
+void SGDUpdater::GetV(int n, const SGDEntry& e, real_t* V,
+                      real_t* buf) const {
+  auto& arena = *V_arenas_[n];
+  arena.Get(e.V, V, nullptr);
+  for (int j = 1; j < num_V_parts_; ++j) {
+    arena.Get(arena.Row(VRow(&e - slots_.get(), j)), buf, nullptr);
+    for (int i = 0; i < n; ++i) V[i] += buf[i];
+  }
+}
+
+void SGDUpdater::InitV(int n, SGDEntry* e, Delta* delta) {
+  // the V table is preallocated and initialized
+  if (slots_) {
+    e->V = NewV(n, e);
+    return;
+  }
+  // the feature keeps w only, V is tried again when it is seen next time
+  if (MemTracker::Get()->Exceeds(0)) {
+    if (!V_skipped_.exchange(true)) {
+      LOG(WARNING) << "memory budget exceeded, stop allocating V: "
+                   << MemTracker::Get()->TextString();
+    }
+    return;
+  }
+  std::vector<real_t> V(n);
   for (int i = 0; i < n; ++i) {
-    e->V[i] = (rand_r(&param_.seed) / (real_t)RAND_MAX - 0.5) * param_.V_init_scale;
+    V[i] = (rand_r(&param_.seed) / (real_t)RAND_MAX - 0.5) * param_.V_init_scale;
   }
-  memset(e->V+n, 0, n*sizeof(real_t));
+  e->V = NewV(n, e);
+  V_arenas_[n]->Set(V.data(), nullptr, e->V);
+  // the stored V may be rounded
+  V_arenas_[n]->Get(e->V, V.data(), nullptr);
+  delta->penalty += .5 * param_.V_l2 * SquaredNorm(n, V.data());
+  delta->nnz += n;
+}
+
+char* SGDUpdater::NewV(int dim, SGDEntry* e) {
+  auto& arena = *V_arenas_[dim];
+  if (!slots_) return arena.New();
+  return arena.Row(VRow(e - slots_.get(), 0));
 }
 
 }  // namespace difacto
@@ -5,49 +5,65 @@
  */
 #ifndef DIFACTO_SGD_SGD_UPDATER_H_
 #define DIFACTO_SGD_SGD_UPDATER_H_
+#include <atomic>
+#include <condition_variable>
 #include <vector>
 #include <mutex>
+#include <memory>
 #include <limits>
+#include <deque>
+#include "difacto/store.h"
 #include "difacto/updater.h"
 #include "./sgd_param.h"
 #include "./sgd_utils.h"
+#include "./sgd_model.h"
+#include "common/count_min_sketch.h"
+#include "common/huge_pages.h"
+#include "common/mem_tracker.h"
+#include "common/model_file.h"
 #include "dmlc/io.h"
 namespace difacto {
-/**
- * \brief the weight entry for one feature
- */
-struct SGDEntry {
- public:
-  SGDEntry() { }
-  ~SGDEntry() { delete [] V; }
-  /** \brief the number of appearence of this feature in the data so far */
-  real_t fea_cnt = 0;
-  /** \brief w and its aux data */
-  real_t w = 0, sqrt_g = 0, z = 0;
-  /** \brief V and its aux data */
-  real_t *V = nullptr;
-};
 /**
  * \brief sgd updater
  *
  * - w is updated by FTRL, which is a smooth version of adagrad works well with
  *   the l1 regularizer
  * - V is updated by adagrad
+ * - V is not allocated for more features once the memory budget is exceeded
+ * - the V of a feature group can be shorter than V_dim, see
+ *   SGDUpdaterParam::V_dims. the Vs of a dimension are packed in their own
+ *   arena, and the lengths returned by \ref Get are 1 plus the dimensions
+ * - the feature ids can be hashed into a fixed number of preallocated slots,
+ *   see SGDUpdaterParam::hash_capacity. a slot is then found without a
+ *   table, and the keys of a saved model are the slots. the V of a slot can
+ *   be the sum of several rows of the V table, see
+ *   SGDUpdaterParam::V_num_hashes and SGDUpdaterParam::V_hash_qr, which are
+ *   then saved as keys after the slots
+ * - a feature can be admitted only after seen several times, and the idle
+ *   entries can be evicted periodically, see SGDUpdaterParam::admit_count
+ *   and SGDUpdaterParam::evict_interval. a pull never creates an entry
  */
 class SGDUpdater : public Updater {
  public:
-  SGDUpdater() {}
+  SGDUpdater() : mem_gauge_(MemTracker::kModel) {}
   virtual ~SGDUpdater() {}
 
   KWArgs Init(const KWArgs& kwargs) override;
 
-  void Load(dmlc::Stream* fi, bool* has_aux) override {
-       // TODO(mli)
-  }
+  void Load(dmlc::Stream* fi, bool* has_aux) override;
 
-  void Save(bool save_aux, dmlc::Stream *fo) const override {
-    // TODO(mli)
-  }
+  void Save(bool save_aux, dmlc::Stream *fo) const override;
+
+  /**
+   * \brief copy the model into a snapshot, which shares no memory with the
+   * model
+   *
+   * the updates are paused while a shard is copied, see \ref UpdateScope,
+   * so no feature is copied in the middle of an update, and the training
+   * continues between the shards. the features of different shards may be
+   * copied after different updates
+   */
+  void Snapshot(bool save_aux, ModelFile* model) const;
 
   void Get(const SArray<feaid_t>& fea_ids,
            int value_type,
@@ -60,24 +76,251 @@ class SGDUpdater : public Updater {
               const SArray<real_t>& values,
               const SArray<int>& val_lens) override;
 
+  /**
+   * \brief the gradients can be applied by the threads of ApplyEngine. an
+   * entry is looked up under the lock of its shard, but then updated without
+   * a lock, which is safe only because each thread owns a disjoint key range,
+   * so no two threads update the same entry. with hash_capacity, different
+   * ids share slots and V rows, so it is false
+   */
+  bool ConcurrentUpdate(int data_type) const override {
+    return data_type == Store::kGradient && !slots_;
+  }
+
+  /**
+   * \brief the penalty and the nnz of the model, which are maintained by the
+   * updates, so it costs O(1)
+   */
   void Evaluate(sgd::Progress* prog) const;
 
+  /**
+   * \brief returns the memory usage of the model
+   *
+   * @param num_feas the number of features
+   * @param num_bytes the number of bytes allocated
+   */
+  void MemUsage(size_t* num_feas, size_t* num_bytes) const;
+
+  /** \brief the numbers of the entries admitted and evicted so far */
+  void AdmitStats(size_t* num_admitted, size_t* num_evicted) const;
+
   const SGDUpdaterParam& param() const { return param_; }
 
+  /**
+   * \brief scale the adagrad learning rate of V from its initial value, such
+   * as when the gradients of more batches are summed by a push
+   */
+  void ScaleVLearningRate(real_t scale) { param_.V_lr = V_lr_ * scale; }
+
+  /** \brief returns the dimension of V of a feature */
+  int VDim(feaid_t key) const {
+    if (grp_dims_.empty()) return param_.V_dim;
+    return grp_dims_[DecodeFeaGrpID(ReverseBytes(key), param_.V_group_bits)];
+  }
+
  private:
-  /** \brief update w by FTRL */
-  void UpdateW(real_t gw, SGDEntry* e);
+  /** \brief the changes of the penalty and the nnz by an update */
+  struct Delta {
+    double penalty = 0;
+    int64_t nnz = 0;
+  };
+
+  /**
+   * \brief update w by FTRL, dim is the dimension of V of this feature. the
+   * changes of the model are added into delta
+   */
+  void UpdateW(real_t gw, int dim, SGDEntry* e, Delta* delta);
 
-  /** \brief update V by adagrad */
-  void UpdateV(real_t const* gV, SGDEntry* e);
+  /**
+   * \brief update V by adagrad, each of the rows summed into V if hashed
+   * @param buf 2 * dim buffer to convert V and its aux data, not used if
+   * they are stored as real_t
+   */
+  void UpdateV(int dim, real_t const* gV, real_t* buf, SGDEntry* e,
+               Delta* delta);
+
+  /** \brief update a row of V by adagrad, see \ref UpdateV */
+  void UpdateVRow(int dim, real_t const* gV, real_t* buf, char* row,
+                  Delta* delta);
+
+  /**
+   * \brief get the V of an entry, the sum of its rows if hashed into several
+   * @param buf dim buffer
+   */
+  void GetV(int dim, const SGDEntry& e, real_t* V, real_t* buf) const;
+
+  /** \brief returns the j-th row of the V table of a slot */
+  size_t VRow(size_t slot, int j) const {
+    if (j == 0) return slot % num_V_mod_;
+    if (param_.V_hash_qr) return num_V_mod_ + slot / num_V_mod_;
+    return HashFeaID(slot * num_V_parts_ + j) % num_V_mod_;
+  }
 
-  /** \brief init V */
-  void InitV(SGDEntry* e);
+  /** \brief init V, does nothing if the memory budget is exceeded */
+  void InitV(int dim, SGDEntry* e, Delta* delta);
+
+  /** \brief add a delta into penalty_ and nnz_ */
+  void AddDelta(const Delta& delta);
+
+  /** \brief compute penalty_ and nnz_ again by visiting all entries */
+  void Recount();
+
+  /** \brief returns the memory of a new V, a row of the V table if hashed */
+  char* NewV(int dim, SGDEntry* e);
+
+  /**
+   * \brief visit all (key, entry) pairs, a shard is locked while visiting
+   * it. the keys are the slots if hashed
+   */
+  template <typename Fn>
+  void ForEachEntry(const Fn& fn) const {
+    if (slots_) {
+      for (size_t i = 0; i < num_slots_; ++i) fn(i, slots_.get()[i]);
+      return;
+    }
+    for (int k = 0; k < num_shards_; ++k) {
+      auto& s = shards_[k];
+      std::lock_guard<std::mutex> lk(s.mu);
+      s.ForEach(fn);
+    }
+  }
+
+  /** \brief parse SGDUpdaterParam::V_dims into \ref grp_dims_ */
+  void ParseVDims();
+
+  /**
+   * \brief account the memory of the model, the aux data are stored along
+   * with the weights, so they are accounted as the model
+   */
+  void UpdateMemGauge();
+
+  /**
+   * \brief calls fn(k, i) for each position i of fea_ids with its shard k
+   * locked
+   *
+   * the ids are grouped by shards first, so each shard is locked only once
+   */
+  template <typename Fn>
+  void VisitShards(const SArray<feaid_t>& fea_ids, const Fn& fn);
+
+  /**
+   * \brief find the entries of a list of feature ids
+   * @param create create the ones not exist, otherwise they are nullptr
+   */
+  void GetEntries(const SArray<feaid_t>& fea_ids, bool create,
+                  std::vector<SGDEntry*>* entries);
+
+  /**
+   * \brief create the entries which are nullptr if they are admitted
+   * @param counts the sightings of the ids, empty means 1 each
+   */
+  void AdmitEntries(const SArray<feaid_t>& fea_ids,
+                    const SArray<real_t>& counts,
+                    std::vector<SGDEntry*>* entries);
+
+  /**
+   * \brief evict the idle entries, see SGDUpdaterParam::evict_interval. the
+   * updates are paused meanwhile
+   */
+  void Evict();
+
+  /**
+   * \brief wait for the running updates, and block the new ones until \ref
+   * ResumeUpdates. one pause at a time
+   */
+  void PauseUpdates() const;
+  void ResumeUpdates() const;
+
+  /**
+   * \brief an update holds it from resolving its entries till writing them,
+   * so \ref Evict never erases, and \ref Snapshot never copies, an entry
+   * being updated
+   */
+  class UpdateScope {
+   public:
+    explicit UpdateScope(SGDUpdater* updater);
+    ~UpdateScope();
+
+   private:
+    SGDUpdater* updater_;
+  };
+
+  typedef std::shared_ptr<std::vector<SGDEntry*>> EntryList;
+  /**
+   * \brief returns the entries of a batch, which are resolved once and then
+   * cached until the gradient of this batch is pushed
+   *
+   * the cache is keyed by the memory of fea_ids. the array is hold by the
+   * cache, so its memory cannot be reused by another batch. it is only used
+   * by a local job, since a server receives the ids of a pull and of the
+   * following push in different arrays, and the batches never released
+   * would keep their entries from the eviction
+   *
+   * @param fea_ids the feature ids of the batch
+   * @param release remove the batch from the cache
+   */
+  EntryList GetBatchEntries(const SArray<feaid_t>& fea_ids, bool release);
+
+  /** \brief a batch has been seen by Get or Update */
+  struct CachedBatch {
+    SArray<feaid_t> fea_ids;
+    EntryList entries;
+  };
+  /** \brief the maximal number of batches in the cache */
+  static const size_t kMaxCachedBatches = 16;
+  /** \brief how many keys ahead to prefetch */
+  static const size_t kPrefetchDist = 8;
+  /** \brief the number of rows of the count-min sketch */
+  static const int kSketchDepth = 4;
+
+  /** \brief returns the shard a feature id belongs to */
+  inline int ShardID(feaid_t id) const {
+    return static_cast<int>(HashFeaID(id) % num_shards_);
+  }
 
   SGDUpdaterParam param_;
-  std::unordered_map<feaid_t, SGDEntry> model_;
-  mutable std::mutex mu_;
+  /** \brief the V_lr before scaled */
+  real_t V_lr_ = 0;
+  int num_shards_ = 0;
+  std::unique_ptr<SGDModelShard[]> shards_;
+  /**
+   * \brief the arenas of V indexed by the dimension, only the dimensions used
+   * are created
+   */
+  std::vector<std::unique_ptr<SGDVArena>> V_arenas_;
+  /** \brief the dimension of each group, empty if all use V_dim */
+  std::vector<int> grp_dims_;
+  /** \brief the preallocated entries if hashed, nullptr otherwise */
+  std::shared_ptr<SGDEntry> slots_;
+  size_t num_slots_ = 0;
+  /** \brief the rows of the V table if hashed */
+  size_t num_V_rows_ = 0;
+  /** \brief the rows picked by the hashes of the slots, see \ref VRow */
+  size_t num_V_mod_ = 0;
+  /** \brief the rows summed into the V of a slot */
+  int num_V_parts_ = 1;
+  /** \brief the sightings of the features per shard, if admit_count > 0 */
+  std::unique_ptr<CountMinSketch<uint8_t>[]> sketches_;
+  std::atomic<size_t> num_admitted_{0}, num_evicted_{0}, num_pushes_{0};
+  /** \brief whether \ref GetBatchEntries caches the batches */
+  bool cache_batches_ = true;
+  std::deque<CachedBatch> cache_;
+  std::mutex cache_mu_;
+  /** \brief the updates in \ref UpdateScope, and whether they are paused */
+  mutable int num_updating_ = 0;
+  mutable bool paused_ = false;
+  mutable std::mutex pause_mu_;
+  mutable std::condition_variable pause_cond_;
   bool has_aux_ = true;
+  /**
+   * \brief the penalty and the nnz of w and V. the preallocated V table of
+   * hash_capacity is counted once
+   */
+  std::atomic<double> penalty_{0};
+  std::atomic<int64_t> nnz_{0};
+  MemGauge mem_gauge_;
+  /** \brief whether V was not allocated for a feature due to the budget */
+  std::atomic<bool> V_skipped_{false};
 };
 
 
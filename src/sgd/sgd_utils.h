@@ -7,6 +7,7 @@
 #include <vector>
 #include <sstream>
 #include "dmlc/memory_io.h"
+#include "loss/bin_class_metric.h"
 namespace difacto {
 namespace sgd {
 
@@ -19,6 +20,10 @@ struct Job {
   static const int kTraining = 3;
   static const int kValidation = 4;
   static const int kEvaluation = 5;
+  static const int kCheckpoint = 6;
+  static const int kCountKeys = 7;
+  static const int kSetKeyRanges = 8;
+  static const int kScaleLearningRate = 9;
   int type;
   /** \brief number of partitions of this file */
   int num_parts;
@@ -26,51 +31,166 @@ struct Job {
   int part_idx;
   /** \brief the current epoch */
   int epoch;
+  /**
+   * \brief the data file of a training job, or the model of a load job.
+   * empty means data_in or model_in
+   */
+  std::string filename;
+  /** \brief the key bounds of the servers of a kSetKeyRanges job */
+  std::vector<feaid_t> key_bounds;
+  /**
+   * \brief the batches whose gradients are pushed together by a training
+   * job, 0 means grad_push_batches
+   */
+  int push_batches = 0;
+  /** \brief the scale of the learning rate of a kScaleLearningRate job */
+  real_t lr_scale = 1;
   Job() { }
   void SerializeToString(std::string* str) const {
-    *str = std::string(reinterpret_cast<char const*>(this), sizeof(Job));
+    str->clear();
+    dmlc::MemoryStringStream fo(str);
+    fo.Write(&type, sizeof(type));
+    fo.Write(&num_parts, sizeof(num_parts));
+    fo.Write(&part_idx, sizeof(part_idx));
+    fo.Write(&epoch, sizeof(epoch));
+    fo.Write(filename);
+    fo.Write(key_bounds);
+    fo.Write(&push_batches, sizeof(push_batches));
+    fo.Write(&lr_scale, sizeof(lr_scale));
   }
 
   void ParseFromString(const std::string& str) {
-    CHECK_EQ(str.size(), sizeof(Job));
-    memcpy(this, str.data(), sizeof(Job));
+    std::string copy = str;
+    dmlc::MemoryStringStream fi(&copy);
+    CHECK_EQ(fi.Read(&type, sizeof(type)), sizeof(type));
+    CHECK_EQ(fi.Read(&num_parts, sizeof(num_parts)), sizeof(num_parts));
+    CHECK_EQ(fi.Read(&part_idx, sizeof(part_idx)), sizeof(part_idx));
+    CHECK_EQ(fi.Read(&epoch, sizeof(epoch)), sizeof(epoch));
+    CHECK(fi.Read(&filename));
+    CHECK(fi.Read(&key_bounds));
+    CHECK_EQ(fi.Read(&push_batches, sizeof(push_batches)),
+             sizeof(push_batches));
+    CHECK_EQ(fi.Read(&lr_scale, sizeof(lr_scale)), sizeof(lr_scale));
+  }
+};
+
+/**
+ * \brief the stages of the pipeline of a job, see SGDLearner::IteratePart
+ */
+struct Stage {
+  static const int kRead = 0;
+  static const int kLocalize = 1;
+  static const int kPull = 2;
+  static const int kCompute = 3;
+  static const int kPush = 4;
+  static const int kNum = 5;
+  static char const* Name(int stage) {
+    static char const* names[] = {"read", "localize", "pull", "compute", "push"};
+    return names[stage];
   }
 };
 
 struct Progress {
   real_t loss = 0;  //
   real_t penalty = 0;  //
-  real_t auc = 0;   // auc
   real_t nnz_w = 0;  // |w|_0
   real_t nrows = 0;   // number of examples
+  real_t parse_sec = 0;  // the seconds spent on parsing the data
+  real_t wait_sec = 0;  // the seconds waited for the parsed data
+  real_t read_mb = 0;  // the MB read by the read-ahead
+  real_t read_sec = 0;  // the seconds the read-ahead is reading
+  real_t sec = 0;  // the wall time of the epoch, set by the scheduler
+  /**
+   * \brief the seconds each stage works, and the ones it is blocked by its
+   * neighbours, summed over the threads of a stage
+   */
+  real_t busy_sec[Stage::kNum] = {0};
+  real_t stall_sec[Stage::kNum] = {0};
+  /** \brief the classification metrics over all examples seen */
+  BinClassStats metric;
+
+  /** \brief the AUC over all examples seen */
+  real_t AUC() const { return metric.AUC(); }
 
   std::string TextString() {
     std::stringstream ss;
-    ss << "loss = " << loss << ", AUC = " << auc / nrows;
+    ss << "loss = " << loss << ", AUC = " << AUC()
+       << ", parse = " << parse_sec << " sec, wait = " << wait_sec << " sec";
+    if (read_sec > 0) ss << ", read = " << read_mb / read_sec << " MB/s";
+    if (sec > 0) ss << ", " << nrows / sec << " examples/sec";
+    if (nnz_w > 0) ss << ", penalty = " << penalty << ", nnz = " << nnz_w;
     return ss.str();
   }
 
-  void SerializeToString(std::string* str) const {
-    *str = std::string(reinterpret_cast<char const*>(this), sizeof(Progress));
+  /** \brief the busy and stall seconds of the stages */
+  std::string StageString() {
+    std::stringstream ss;
+    for (int i = 0; i < Stage::kNum; ++i) {
+      ss << (i ? ", " : "") << Stage::Name(i) << " = " << busy_sec[i]
+         << " / " << stall_sec[i];
+    }
+    ss << " sec (busy / stall)";
+    return ss.str();
+  }
+
+  /** \brief write the members, the AUC histogram is written sparsely */
+  void Save(dmlc::Stream* fo) const {
+    fo->Write(&loss, sizeof(loss));
+    fo->Write(&penalty, sizeof(penalty));
+    fo->Write(&nnz_w, sizeof(nnz_w));
+    fo->Write(&nrows, sizeof(nrows));
+    fo->Write(&parse_sec, sizeof(parse_sec));
+    fo->Write(&wait_sec, sizeof(wait_sec));
+    fo->Write(&read_mb, sizeof(read_mb));
+    fo->Write(&read_sec, sizeof(read_sec));
+    fo->Write(&sec, sizeof(sec));
+    fo->Write(busy_sec, sizeof(busy_sec));
+    fo->Write(stall_sec, sizeof(stall_sec));
+    metric.Save(fo);
   }
 
-  void ParseFrom(char const* data, size_t size) {
-    if (size == 0) return;
-    CHECK_EQ(size, sizeof(Progress));
-    memcpy(this, data, sizeof(Progress));
+  void Load(dmlc::Stream* fi) {
+    CHECK_EQ(fi->Read(&loss, sizeof(loss)), sizeof(loss));
+    CHECK_EQ(fi->Read(&penalty, sizeof(penalty)), sizeof(penalty));
+    CHECK_EQ(fi->Read(&nnz_w, sizeof(nnz_w)), sizeof(nnz_w));
+    CHECK_EQ(fi->Read(&nrows, sizeof(nrows)), sizeof(nrows));
+    CHECK_EQ(fi->Read(&parse_sec, sizeof(parse_sec)), sizeof(parse_sec));
+    CHECK_EQ(fi->Read(&wait_sec, sizeof(wait_sec)), sizeof(wait_sec));
+    CHECK_EQ(fi->Read(&read_mb, sizeof(read_mb)), sizeof(read_mb));
+    CHECK_EQ(fi->Read(&read_sec, sizeof(read_sec)), sizeof(read_sec));
+    CHECK_EQ(fi->Read(&sec, sizeof(sec)), sizeof(sec));
+    CHECK_EQ(fi->Read(busy_sec, sizeof(busy_sec)), sizeof(busy_sec));
+    CHECK_EQ(fi->Read(stall_sec, sizeof(stall_sec)), sizeof(stall_sec));
+    metric.Load(fi);
   }
 
-  void Merge(const std::string& str) {
-    Progress other;
-    other.ParseFrom(str.data(), str.size());
-    Merge(other);
+  void SerializeToString(std::string* str) const {
+    str->clear();
+    dmlc::MemoryStringStream fo(str);
+    Save(&fo);
+  }
+
+  void ParseFromString(const std::string& str) {
+    std::string copy = str;
+    dmlc::MemoryStringStream fi(&copy);
+    Load(&fi);
   }
 
+  /** \brief add the sums of other, sec is set by the scheduler so is kept */
   void Merge(const Progress& other) {
-    size_t n = sizeof(Progress) / sizeof(real_t);
-    auto a = reinterpret_cast<real_t*>(this);
-    auto b = reinterpret_cast<real_t const*>(&other);
-    for (size_t i = 0; i < n; ++i) a[i] += b[i];
+    loss += other.loss;
+    penalty += other.penalty;
+    nnz_w += other.nnz_w;
+    nrows += other.nrows;
+    parse_sec += other.parse_sec;
+    wait_sec += other.wait_sec;
+    read_mb += other.read_mb;
+    read_sec += other.read_sec;
+    for (int i = 0; i < Stage::kNum; ++i) {
+      busy_sec[i] += other.busy_sec[i];
+      stall_sec[i] += other.stall_sec[i];
+    }
+    metric.Merge(other.metric);
   }
 };
 
@@ -3,12 +3,17 @@
  */
 #include "difacto/store.h"
 #include "./store_local.h"
+#include "./store_dist.h"
 namespace difacto {
 
+DMLC_REGISTER_PARAMETER(StoreCodecParam);
+DMLC_REGISTER_PARAMETER(StoreSSPParam);
+DMLC_REGISTER_PARAMETER(StoreApplyParam);
+DMLC_REGISTER_PARAMETER(StoreShmParam);
+
 Store* Store::Create() {
   if (IsDistributed()) {
-    LOG(FATAL) << "not implemented";
-    return nullptr;
+    return new StoreDist();
   } else {
     return new StoreLocal();
   }
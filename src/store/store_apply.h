@@ -0,0 +1,260 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_STORE_STORE_APPLY_H_
+#define DIFACTO_STORE_STORE_APPLY_H_
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "difacto/base.h"
+#include "difacto/sarray.h"
+#include "dmlc/logging.h"
+#include "dmlc/parameter.h"
+namespace difacto {
+
+/**
+ * \brief the multi-threaded apply of the pushes on a server
+ */
+struct StoreApplyParam : public dmlc::Parameter<StoreApplyParam> {
+  /**
+   * \brief if positive, the pushes the updater can apply concurrently (see
+   * Updater::ConcurrentUpdate) are queued, and applied by this number of
+   * threads, each owns a key range of the server. in default 0, a push is
+   * applied by the thread receiving it
+   */
+  int server_apply_threads;
+  DMLC_DECLARE_PARAMETER(StoreApplyParam) {
+    DMLC_DECLARE_FIELD(server_apply_threads).set_range(0, 256).set_default(0);
+  }
+};
+
+/**
+ * \brief applies the pushes by multiple threads, partitioned by key ranges
+ *
+ * a push is split by the ranges, since its ids are sorted, and the segments
+ * are queued to the threads owning the ranges. a thread takes all segments
+ * queued at once, merges them by adding up the values of the same id, and
+ * applies them by one call. a push is finished once all its segments are
+ * applied. reads are not ordered with the queued pushes, see \ref Wait.
+ */
+class ApplyEngine {
+ public:
+  /** \brief apply a list of (id, values), lens is empty if each has length 1 */
+  typedef std::function<void(const SArray<feaid_t>& ids,
+                             const SArray<real_t>& vals,
+                             const SArray<int>& lens)> Apply;
+
+  ApplyEngine() { }
+  ~ApplyEngine() { Stop(); }
+
+  /**
+   * \brief start the threads
+   * @param nthreads the number of threads
+   * @param begin the first key of the server
+   * @param end the end of the keys of the server
+   * @param apply the apply function, which needs to be thread-safe for
+   * disjoint key ranges
+   */
+  void Start(int nthreads, feaid_t begin, feaid_t end, const Apply& apply) {
+    CHECK_GT(nthreads, 0); CHECK_LT(begin, end);
+    apply_ = apply;
+    done_ = false;
+    bounds_.resize(nthreads + 1);
+    feaid_t step = (end - begin) / nthreads;
+    for (int t = 0; t < nthreads; ++t) bounds_[t] = begin + step * t;
+    bounds_[nthreads] = end;
+    queues_.resize(nthreads);
+    applying_.assign(nthreads, 0);
+    for (int t = 0; t < nthreads; ++t) {
+      threads_.emplace_back(&ApplyEngine::Run, this, t);
+    }
+  }
+
+  /** \brief apply the queued ones, and then stop the threads */
+  void Stop() {
+    if (threads_.empty()) return;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      done_ = true;
+    }
+    cond_.notify_all();
+    for (auto& t : threads_) t.join();
+    threads_.clear();
+  }
+
+  /**
+   * \brief queue a push, which must be sorted by ids
+   * @param on_applied called once all of them are applied
+   */
+  void Push(const SArray<feaid_t>& ids, const SArray<real_t>& vals,
+            const SArray<int>& lens,
+            const std::function<void()>& on_applied) {
+    CHECK(queues_.size()) << "not started";
+    size_t n = ids.size();
+    if (n == 0) {
+      if (on_applied) on_applied();
+      return;
+    }
+    int k = lens.empty() ? vals.size() / n : 0;
+    int nt = static_cast<int>(queues_.size());
+    auto push = std::make_shared<Request>();
+    push->on_applied = on_applied;
+    std::vector<Segment> segs;
+    size_t pos = 0, val_pos = 0;
+    for (int t = 0; t < nt && pos < n; ++t) {
+      size_t end = t + 1 == nt ? n :
+          std::lower_bound(ids.begin() + pos, ids.end(), bounds_[t+1]) -
+          ids.begin();
+      if (end == pos) continue;
+      size_t val_len = 0;
+      for (size_t i = pos; i < end; ++i) val_len += k ? k : lens[i];
+      Segment seg;
+      seg.thread = t;
+      seg.ids = ids.segment(pos, end);
+      seg.vals = vals.segment(val_pos, val_pos + val_len);
+      if (!k) seg.lens = lens.segment(pos, end);
+      seg.push = push;
+      segs.push_back(seg);
+      pos = end;
+      val_pos += val_len;
+    }
+    CHECK_EQ(val_pos, vals.size());
+    push->remain = segs.size();
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      uint64_t seq = ++seq_;
+      for (auto& seg : segs) {
+        seg.seq = seq;
+        queues_[seg.thread].push_back(seg);
+      }
+    }
+    cond_.notify_all();
+  }
+
+  /** \brief wait until the pushes queued before are applied */
+  void Wait() {
+    std::unique_lock<std::mutex> lk(mu_);
+    uint64_t seq = seq_;
+    applied_cond_.wait(lk, [this, seq]() { return MinPending() > seq; });
+  }
+
+ private:
+  /** \brief a queued push */
+  struct Request {
+    std::atomic<size_t> remain;
+    std::function<void()> on_applied;
+  };
+
+  /** \brief the part of a push in a key range */
+  struct Segment {
+    int thread;
+    uint64_t seq;
+    SArray<feaid_t> ids;
+    SArray<real_t> vals;
+    SArray<int> lens;
+    std::shared_ptr<Request> push;
+  };
+
+  /** \brief the first seq not applied yet. needs to hold mu_ */
+  uint64_t MinPending() const {
+    uint64_t m = std::numeric_limits<uint64_t>::max();
+    for (size_t t = 0; t < queues_.size(); ++t) {
+      if (queues_[t].size()) m = std::min(m, queues_[t][0].seq);
+    }
+    for (uint64_t s : applying_) if (s) m = std::min(m, s);
+    return m;
+  }
+
+  void Run(int tid) {
+    std::vector<Segment> segs;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lk(mu_);
+        cond_.wait(lk, [this, tid]() {
+            return done_ || queues_[tid].size();
+          });
+        if (queues_[tid].empty()) return;
+        segs.swap(queues_[tid]);
+        applying_[tid] = segs[0].seq;
+      }
+      // merge the segments, and then apply them at once
+      SArray<feaid_t> ids = segs[0].ids;
+      SArray<real_t> vals = segs[0].vals;
+      SArray<int> lens = segs[0].lens;
+      for (size_t i = 1; i < segs.size(); ++i) {
+        Merge(segs[i].ids, segs[i].vals, segs[i].lens, &ids, &vals, &lens);
+      }
+      apply_(ids, vals, lens);
+      for (auto& seg : segs) {
+        if (--seg.push->remain == 0 && seg.push->on_applied) {
+          seg.push->on_applied();
+        }
+      }
+      segs.clear();
+      {
+        std::lock_guard<std::mutex> lk(mu_);
+        applying_[tid] = 0;
+      }
+      applied_cond_.notify_all();
+    }
+  }
+
+  /**
+   * \brief merge (ids_b, vals_b, lens_b) into (ids, vals, lens). the values of
+   * the same id are added up, the shorter ones are padded by zeros
+   */
+  static void Merge(const SArray<feaid_t>& ids_b, const SArray<real_t>& vals_b,
+                    const SArray<int>& lens_b, SArray<feaid_t>* ids,
+                    SArray<real_t>* vals, SArray<int>* lens) {
+    size_t na = ids->size(), nb = ids_b.size();
+    int ka = lens->empty() ? vals->size() / na : 0;
+    int kb = lens_b.empty() ? vals_b.size() / nb : 0;
+    bool fixed = ka && ka == kb;
+    SArray<feaid_t> new_ids;
+    SArray<real_t> new_vals;
+    SArray<int> new_lens;
+    new_ids.reserve(na + nb);
+    new_vals.reserve(vals->size() + vals_b.size());
+    size_t a = 0, b = 0, pa = 0, pb = 0;
+    while (a < na || b < nb) {
+      bool use_a = a < na && (b >= nb || (*ids)[a] <= ids_b[b]);
+      bool use_b = b < nb && (a >= na || ids_b[b] <= (*ids)[a]);
+      int la = use_a ? (ka ? ka : (*lens)[a]) : 0;
+      int lb = use_b ? (kb ? kb : lens_b[b]) : 0;
+      int len = std::max(la, lb);
+      for (int j = 0; j < len; ++j) {
+        new_vals.push_back((j < la ? (*vals)[pa + j] : 0) +
+                           (j < lb ? vals_b[pb + j] : 0));
+      }
+      new_ids.push_back(use_a ? (*ids)[a] : ids_b[b]);
+      if (!fixed) new_lens.push_back(len);
+      if (use_a) { ++a; pa += la; }
+      if (use_b) { ++b; pb += lb; }
+    }
+    *ids = new_ids;
+    *vals = new_vals;
+    *lens = new_lens;
+  }
+
+  Apply apply_;
+  /** \brief thread t owns the keys in [bounds_[t], bounds_[t+1]) */
+  std::vector<feaid_t> bounds_;
+  std::vector<std::thread> threads_;
+  std::mutex mu_;
+  std::condition_variable cond_, applied_cond_;
+  std::vector<std::vector<Segment>> queues_;
+  /** \brief the first seq a thread is applying, 0 for none */
+  std::vector<uint64_t> applying_;
+  uint64_t seq_ = 0;
+  bool done_ = false;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_STORE_STORE_APPLY_H_
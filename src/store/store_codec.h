@@ -0,0 +1,445 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_STORE_STORE_CODEC_H_
+#define DIFACTO_STORE_STORE_CODEC_H_
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <algorithm>
+#include "difacto/base.h"
+#include "difacto/sarray.h"
+#include "dmlc/parameter.h"
+#include "common/float16.h"
+#include "common/mem_tracker.h"
+namespace difacto {
+
+/**
+ * \brief the compression and the id caching of the distributed store
+ */
+struct StoreCodecParam : public dmlc::Parameter<StoreCodecParam> {
+  /**
+   * \brief the compression of pushed gradients
+   * - none: no compression
+   * - fp16, bf16: 16-bit floats
+   * - int8, 1bit: quantization with error feedback
+   */
+  std::string grad_compression;
+  /** \brief the compression of pulled weights, none, fp16 or bf16 */
+  std::string weight_compression;
+  /**
+   * \brief do not push the V gradient of a feature if it is all zero, the
+   * feature is then sent with length 1. only valid for the sgd learner
+   */
+  bool skip_zero_V_grad;
+  /**
+   * \brief send a feature id list only once, later requests with the same
+   * list only send its slot. the list must not be changed in place
+   */
+  bool key_cache;
+  /**
+   * \brief the MB of the quantization errors kept by int8 and 1bit, 0 means
+   * no limit. once it is used up, the new features are quantized without the
+   * error feedback
+   */
+  float grad_residual_mb;
+  DMLC_DECLARE_PARAMETER(StoreCodecParam) {
+    DMLC_DECLARE_FIELD(grad_compression).set_default("none");
+    DMLC_DECLARE_FIELD(weight_compression).set_default("none");
+    DMLC_DECLARE_FIELD(skip_zero_V_grad).set_default(false);
+    DMLC_DECLARE_FIELD(key_cache).set_default(false);
+    DMLC_DECLARE_FIELD(grad_residual_mb).set_lower_bound(0).set_default(256);
+  }
+};
+
+/**
+ * \brief encodes a list of (feature id, values) into bytes
+ *
+ * the layout is
+ *
+ *    type | flags | n | id deltas | lens or k | values
+ *
+ * where n, the id deltas, the lens and the fixed length k are varints. the
+ * flags tell if the ids and the lens exist, the ids are omitted if the
+ * receiver already knows them. the ids must be sorted.
+ *
+ * int8 and 1bit store a scale per feature before its quantized values, and
+ * keep the quantization error of each feature, which is added to the next
+ * values pushed for the same feature. the errors are kept in the flat rows
+ * of kNumShards shards, which are bounded by grad_residual_mb and the memory
+ * budget, and accounted as MemTracker::kAux
+ */
+class StoreCodec {
+ public:
+  enum Type { kNone = 0, kFP16, kBF16, kInt8, k1Bit };
+
+  StoreCodec() { }
+  ~StoreCodec() { }
+
+  /** \brief the bytes the quantization errors can use, 0 means no limit */
+  void SetResidualLimit(size_t bytes) { residual_limit_ = bytes; }
+
+  /** \brief parse the compression name */
+  static Type GetType(const std::string& name) {
+    if (name == "none") return kNone;
+    if (name == "fp16") return kFP16;
+    if (name == "bf16") return kBF16;
+    if (name == "int8") return kInt8;
+    if (name == "1bit") return k1Bit;
+    LOG(FATAL) << "unknown compression: " << name;
+    return kNone;
+  }
+
+  /**
+   * \brief encode and append to out
+   *
+   * @param type the compression type
+   * @param skip_zero_V drop the all-zero V of a feature
+   * @param with_keys write the ids or not
+   * @param n the number of features
+   * @param keys n sorted feature ids
+   * @param vals the values
+   * @param lens the value length of each feature. if nullptr, all features
+   * have k values
+   * @param k the value length if lens is nullptr
+   */
+  void Encode(Type type, bool skip_zero_V, bool with_keys, size_t n,
+              feaid_t const* keys, real_t const* vals,
+              int const* lens, int k, std::string* out) {
+    out->push_back(static_cast<char>(type));
+    out->push_back((lens ? kHasLens : 0) | (with_keys ? kHasKeys : 0));
+    PutVarint(n, out);
+    if (with_keys) {
+      feaid_t pre = 0;
+      for (size_t i = 0; i < n; ++i) {
+        PutVarint(keys[i] - pre, out);
+        pre = keys[i];
+      }
+    }
+    // the lengths actually sent
+    std::vector<int> send_lens(n, k);
+    if (lens) {
+      for (size_t i = 0, p = 0; i < n; p += lens[i], ++i) {
+        send_lens[i] = lens[i];
+        if (skip_zero_V && lens[i] > 1) {
+          bool zero = true;
+          for (int j = 1; j < lens[i]; ++j) zero = zero && vals[p+j] == 0;
+          if (zero) send_lens[i] = 1;
+        }
+        PutVarint(send_lens[i], out);
+      }
+    } else {
+      PutVarint(k, out);
+    }
+    // the values
+    if (type == kInt8 || type == k1Bit) {
+      QuantizeAll(type, n, keys, vals, lens, k, send_lens, out);
+      return;
+    }
+    for (size_t i = 0, p = 0; i < n; ++i) {
+      int len = send_lens[i];
+      real_t const* x = vals + p;
+      p += lens ? lens[i] : k;
+      if (len == 0) continue;
+      if (type == kNone) {
+        out->append(reinterpret_cast<char const*>(x), len * sizeof(real_t));
+      } else {
+        for (int j = 0; j < len; ++j) {
+          PutUInt16(type == kFP16 ? FloatToHalf(x[j]) : FloatToBF16(x[j]), out);
+        }
+      }
+    }
+  }
+
+  /**
+   * \brief decode the bytes written by \ref Encode
+   *
+   * keys is cleared if the ids are not written
+   * @param append if true, the values and lengths are appended to vals and
+   * lens, which are then not reallocated if reserved by \ref Count
+   * @return the number of bytes read
+   */
+  static size_t Decode(char const* data, size_t size, SArray<feaid_t>* keys,
+                       SArray<real_t>* vals, SArray<int>* lens,
+                       bool append = false) {
+    char const* p = data;
+    char const* end = data + size;
+    CHECK_GE(size, 2);
+    Type type = static_cast<Type>(*p++);
+    int flags = *p++;
+    bool has_lens = flags & kHasLens;
+    size_t n = GetVarint(&p, end);
+    keys->resize(flags & kHasKeys ? n : 0);
+    feaid_t pre = 0;
+    for (size_t i = 0; i < keys->size(); ++i) {
+      pre += GetVarint(&p, end);
+      (*keys)[i] = pre;
+    }
+    // the lengths
+    size_t num_vals = 0;
+    int k = 0;
+    size_t l0 = append ? lens->size() : 0;
+    lens->resize(l0 + (has_lens ? n : 0));
+    if (has_lens) {
+      int* l = lens->data() + l0;
+      for (size_t i = 0; i < n; ++i) {
+        l[i] = GetVarint(&p, end);
+        num_vals += l[i];
+      }
+    } else {
+      k = GetVarint(&p, end);
+      num_vals = n * k;
+    }
+    size_t v0 = append ? vals->size() : 0;
+    vals->resize(v0 + num_vals);
+    real_t* x = vals->data() + v0;
+    int const* l = lens->data() + l0;
+    for (size_t i = 0; i < n; ++i) {
+      int len = has_lens ? l[i] : k;
+      if (type == kNone) {
+        CHECK_LE(p + len * sizeof(real_t), end);
+        memcpy(x, p, len * sizeof(real_t));
+        p += len * sizeof(real_t);
+      } else if (type == kFP16 || type == kBF16) {
+        CHECK_LE(p + len * 2, end);
+        for (int j = 0; j < len; ++j) {
+          uint16_t h = GetUInt16(&p);
+          x[j] = type == kFP16 ? HalfToFloat(h) : BF16ToFloat(h);
+        }
+      } else {
+        Dequantize(type, x, len, &p, end);
+      }
+      x += len;
+    }
+    return p - data;
+  }
+
+  /**
+   * \brief the numbers of lengths and values in the bytes written by \ref
+   * Encode, without decoding the values
+   */
+  static void Count(char const* data, size_t size, size_t* num_lens,
+                    size_t* num_vals) {
+    char const* p = data;
+    char const* end = data + size;
+    CHECK_GE(size, 2);
+    ++p;
+    int flags = *p++;
+    size_t n = GetVarint(&p, end);
+    if (flags & kHasKeys) {
+      for (size_t i = 0; i < n; ++i) GetVarint(&p, end);
+    }
+    *num_vals = 0;
+    if (flags & kHasLens) {
+      *num_lens = n;
+      for (size_t i = 0; i < n; ++i) *num_vals += GetVarint(&p, end);
+    } else {
+      *num_lens = 0;
+      *num_vals = n * GetVarint(&p, end);
+    }
+  }
+
+ private:
+  static const int kHasLens = 1;
+  static const int kHasKeys = 2;
+
+  /** \brief the number of shards of the quantization errors */
+  static const int kNumShards = 16;
+  /** \brief the estimated bytes of an entry of ResidualShard::rows */
+  static const size_t kRowBytes =
+      sizeof(feaid_t) + sizeof(std::pair<size_t, int>) + 2 * sizeof(void*);
+
+  /** \brief the quantization errors of the features hashed into a shard */
+  struct ResidualShard {
+    ResidualShard() : gauge(MemTracker::kAux) { }
+    /** \brief the position and the length of the row of a feature in vals */
+    std::unordered_map<feaid_t, std::pair<size_t, int>> rows;
+    /** \brief the rows, a row grown longer is appended again */
+    std::vector<real_t> vals;
+    /** \brief the row of a feature not kept, due to the limit */
+    std::vector<real_t> buf;
+    std::mutex mu;
+    MemGauge gauge;
+  };
+
+  /** \brief the bytes of the quantized values of a feature */
+  static size_t QuantizedSize(Type type, int len) {
+    return sizeof(real_t) + (type == kInt8 ? len : (len + 7) / 8);
+  }
+
+  /**
+   * \brief quantize the values of n features into out
+   *
+   * the output positions are computed first, and then the features are
+   * grouped by their shards, so each shard is locked only once, and the
+   * encodes of different threads only wait for each other on the same shard
+   */
+  void QuantizeAll(Type type, size_t n, feaid_t const* keys,
+                   real_t const* vals, int const* lens, int k,
+                   const std::vector<int>& send_lens, std::string* out) {
+    std::vector<size_t> val_pos(n), out_pos(n), begin(kNumShards + 1, 0);
+    std::vector<uint8_t> shard(n);
+    size_t p = 0, o = out->size();
+    for (size_t i = 0; i < n; ++i) {
+      val_pos[i] = p;
+      out_pos[i] = o;
+      p += lens ? lens[i] : k;
+      if (send_lens[i]) o += QuantizedSize(type, send_lens[i]);
+      shard[i] = HashFeaID(keys[i]) % kNumShards;
+      ++begin[shard[i] + 1];
+    }
+    out->resize(o);
+    // counting sort by the shards
+    for (int s = 0; s < kNumShards; ++s) begin[s+1] += begin[s];
+    std::vector<size_t> order(n), next(begin.begin(), begin.end() - 1);
+    for (size_t i = 0; i < n; ++i) order[next[shard[i]]++] = i;
+
+    for (int s = 0; s < kNumShards; ++s) {
+      if (begin[s] == begin[s+1]) continue;
+      auto& sh = shards_[s];
+      std::lock_guard<std::mutex> lk(sh.mu);
+      for (size_t t = begin[s]; t < begin[s+1]; ++t) {
+        size_t i = order[t];
+        int len = send_lens[i];
+        if (len == 0) continue;
+        real_t* r = Residual(&sh, keys[i], len);
+        if (r == nullptr) {
+          sh.buf.assign(len, 0);
+          r = sh.buf.data();
+        }
+        Quantize(type, vals + val_pos[i], len, r, &(*out)[out_pos[i]]);
+      }
+      sh.gauge.Set((sh.vals.capacity() + sh.buf.capacity()) * sizeof(real_t) +
+                   sh.rows.size() * kRowBytes);
+    }
+  }
+
+  /**
+   * \brief returns the row of the errors of a feature with at least len
+   * values, or nullptr if it cannot be kept. needs to hold sh->mu
+   */
+  real_t* Residual(ResidualShard* sh, feaid_t key, int len) {
+    auto it = sh->rows.find(key);
+    if (it != sh->rows.end() && it->second.second >= len) {
+      return sh->vals.data() + it->second.first;
+    }
+    size_t size = sh->vals.size() + len;
+    size_t row_bytes = (sh->rows.size() + 1) * kRowBytes;
+    size_t limit = residual_limit_ / kNumShards;
+    if (limit && std::max(size, sh->vals.capacity()) * sizeof(real_t) +
+        row_bytes > limit) {
+      return nullptr;
+    }
+    if (size > sh->vals.capacity()) {
+      size_t cap = std::max(size, 2 * sh->vals.capacity());
+      if (limit) cap = std::min(cap, (limit - row_bytes) / sizeof(real_t));
+      size_t more = (cap - sh->vals.capacity()) * sizeof(real_t);
+      if (MemTracker::Get()->Exceeds(more)) return nullptr;
+      sh->vals.reserve(cap);
+    }
+    size_t pos = sh->vals.size();
+    sh->vals.resize(size, 0);
+    if (it == sh->rows.end()) {
+      sh->rows[key] = std::make_pair(pos, len);
+    } else {
+      std::copy_n(sh->vals.data() + it->second.first, it->second.second,
+                  sh->vals.data() + pos);
+      it->second = std::make_pair(pos, len);
+    }
+    return sh->vals.data() + pos;
+  }
+
+  /**
+   * \brief quantize g with error feedback into out. the error r is added
+   * into g first, and then r is left with the new error
+   */
+  static void Quantize(Type type, real_t const* g, int len, real_t* r,
+                       char* out) {
+    real_t scale = 0;
+    for (int j = 0; j < len; ++j) {
+      r[j] += g[j];
+      scale = type == kInt8 ? std::max(scale, fabsf(r[j])) : scale + fabsf(r[j]);
+    }
+    scale = type == kInt8 ? scale / 127 : scale / len;
+    memcpy(out, &scale, sizeof(scale));
+    out += sizeof(scale);
+    if (type == kInt8) {
+      for (int j = 0; j < len; ++j) {
+        int q = scale == 0 ? 0 : static_cast<int>(roundf(r[j] / scale));
+        q = std::min(127, std::max(-127, q));
+        *out++ = static_cast<char>(q);
+        r[j] -= q * scale;
+      }
+    } else {
+      for (int j = 0; j < len; j += 8) {
+        uint8_t bits = 0;
+        for (int b = 0; b < 8 && j + b < len; ++b) {
+          bool pos = r[j+b] >= 0;
+          if (pos) bits |= 1 << b;
+          r[j+b] -= pos ? scale : -scale;
+        }
+        *out++ = static_cast<char>(bits);
+      }
+    }
+  }
+
+  static void Dequantize(Type type, real_t* x, int len,
+                         char const** p, char const* end) {
+    real_t scale;
+    CHECK_LE(*p + sizeof(scale), end);
+    memcpy(&scale, *p, sizeof(scale));
+    *p += sizeof(scale);
+    if (type == kInt8) {
+      CHECK_LE(*p + len, end);
+      for (int j = 0; j < len; ++j) {
+        x[j] = static_cast<int8_t>(*(*p)++) * scale;
+      }
+    } else {
+      CHECK_LE(*p + (len + 7) / 8, end);
+      for (int j = 0; j < len; j += 8) {
+        uint8_t bits = *(*p)++;
+        for (int b = 0; b < 8 && j + b < len; ++b) {
+          x[j+b] = (bits >> b) & 1 ? scale : -scale;
+        }
+      }
+    }
+  }
+
+  static void PutVarint(uint64_t x, std::string* out) {
+    while (x >= 0x80) {
+      out->push_back(static_cast<char>(x | 0x80));
+      x >>= 7;
+    }
+    out->push_back(static_cast<char>(x));
+  }
+
+  static uint64_t GetVarint(char const** p, char const* end) {
+    uint64_t x = 0;
+    for (int shift = 0; ; shift += 7) {
+      CHECK(*p < end) << "truncated data";
+      uint8_t b = *(*p)++;
+      x |= static_cast<uint64_t>(b & 0x7f) << shift;
+      if (!(b & 0x80)) break;
+    }
+    return x;
+  }
+
+  static void PutUInt16(uint16_t x, std::string* out) {
+    out->append(reinterpret_cast<char const*>(&x), 2);
+  }
+
+  static uint16_t GetUInt16(char const** p) {
+    uint16_t x; memcpy(&x, *p, 2); *p += 2;
+    return x;
+  }
+
+  ResidualShard shards_[kNumShards];
+  size_t residual_limit_ = 0;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_STORE_STORE_CODEC_H_
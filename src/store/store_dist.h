@@ -0,0 +1,923 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_STORE_STORE_DIST_H_
+#define DIFACTO_STORE_STORE_DIST_H_
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <condition_variable>
+#include <unordered_map>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include "difacto/store.h"
+#include "difacto/updater.h"
+#include "dmlc/parameter.h"
+#include "ps/ps.h"
+#include "./store_apply.h"
+#include "./store_codec.h"
+#include "./store_shm.h"
+#include "./store_ssp.h"
+#include "common/tracer.h"
+namespace difacto {
+
+/**
+ * \brief model sync over multiple machines through ps-lite
+ *
+ * the feature ids are range partitioned over the servers by ps-lite. so a
+ * request must be sorted by feature ids, which is the case for the localized
+ * data. the value type is passed as the command of a request.
+ *
+ * if compression or key caching is enabled (see \ref StoreCodecParam), the
+ * requests go through a second ps-lite customer with byte values instead:
+ *
+ * - a worker keeps the recent feature id lists in \ref kNumSlots slots. a list
+ *   is sent to each server, encoded by \ref StoreCodec, only when it is put
+ *   into a slot. a server remembers the lists per (worker, slot).
+ * - a request then sends one key per server, which is the first key of the
+ *   server's range plus the slot, and the encoded values without ids.
+ * - the slot of a request is found under a lock, and the values are encoded
+ *   without it, so the threads of a worker quantize their pushes in
+ *   parallel. the requests are then sent in the order of their slots, so a
+ *   server sees the id list of a slot before the requests using it.
+ *
+ * a timestamp returned by \ref Push or \ref Pull is 2 * t + c, where t is the
+ * timestamp of the ps-lite customer c.
+ *
+ * if ssp_staleness >= 0 (see \ref StoreSSPParam), the workers send their
+ * clocks to all servers through the customer of their gradients, so a server
+ * sees a clock after the pushes before it. a server delays a pull of the
+ * weights until the worker is no more than ssp_staleness clocks ahead of the
+ * slowest one, and replies a clock with the one of the slowest. a worker
+ * caches the pulled weights, and reads them again while they are fresh enough.
+ *
+ * if server_apply_threads > 0 (see \ref StoreApplyParam), a server queues
+ * the gradient pushes into an \ref ApplyEngine, which applies them by
+ * multiple threads, and responds a push once it is applied. a pull reads the
+ * updater meanwhile, so it may see part of the pushes being applied. a clock
+ * waits the queued pushes, so the SSP bound still holds.
+ *
+ * the ranges of ps-lite split the key space evenly, which can be replaced by
+ * load balanced ones through \ref SetKeyRanges before any request. the plain
+ * requests are then split by the new ranges, while the encoded requests still
+ * send the keys of the ps-lite ranges to find the servers, and only split the
+ * id lists of the slots by the new ones.
+ *
+ * if shm_mb > 0 (see \ref StoreShmParam), each worker and server creates a
+ * \ref ShmRing. an encoded message between a worker and a server on the same
+ * machine, namely one who can open the ring of the other, is written into
+ * the ring of the sender, and only its offset is sent. a worker marks such a
+ * server by adding kNumSlots to its request key, and the server then replies
+ * through its own ring too.
+ */
+class StoreDist : public Store {
+ public:
+  StoreDist() { }
+  virtual ~StoreDist() {
+    // the apply threads respond through server_
+    apply_.Stop();
+    delete worker_;
+    delete server_;
+    delete codec_worker_;
+    delete codec_server_;
+  }
+
+  KWArgs Init(const KWArgs& kwargs) override {
+    auto remain = param_.InitAllowUnknown(kwargs);
+    grad_type_ = StoreCodec::GetType(param_.grad_compression);
+    weight_type_ = StoreCodec::GetType(param_.weight_compression);
+    CHECK_LE(weight_type_, StoreCodec::kBF16)
+        << "weight_compression must be none, fp16 or bf16";
+    codec_.SetResidualLimit(
+        static_cast<size_t>(param_.grad_residual_mb * (1 << 20)));
+    use_codec_ = grad_type_ != StoreCodec::kNone ||
+                 weight_type_ != StoreCodec::kNone ||
+                 param_.skip_zero_V_grad || param_.key_cache;
+    remain = ssp_param_.InitAllowUnknown(remain);
+    remain = shm_param_.InitAllowUnknown(remain);
+    if (shm_param_.shm_mb > 0 && (IsWorker() || IsServer())) {
+      use_codec_ = true;
+      shm_.reset(new ShmRing());
+      shm_->Create(ShmName(IsWorker(), ps::MyRank()),
+                   static_cast<size_t>(shm_param_.shm_mb) << 20);
+    }
+    remain = apply_param_.InitAllowUnknown(remain);
+    ssp_ = ssp_param_.ssp_staleness >= 0;
+    if (ssp_) {
+      ssp_cache_.Init(ssp_param_.ssp_cache_size);
+      ssp_clocks_.Init(ps::NumWorkers());
+    }
+    for (const auto& r : ps::Postoffice::Get()->GetServerKeyRanges()) {
+      bounds_.push_back(r.begin());
+    }
+    bounds_.push_back(ps::Postoffice::Get()->GetServerKeyRanges().back().end());
+    using namespace std::placeholders;
+    if (IsWorker()) {
+      worker_ = new ps::KVWorker<real_t>(kAppID);
+      if (use_codec_) codec_worker_ = new ps::KVWorker<char>(kCodecAppID);
+    }
+    if (IsServer()) {
+      server_ = new ps::KVServer<real_t>(kAppID);
+      server_->set_request_handle(
+          std::bind(&StoreDist::Process, this, _1, _2, _3));
+      if (use_codec_) {
+        codec_server_ = new ps::KVServer<char>(kCodecAppID);
+        codec_server_->set_request_handle(
+            std::bind(&StoreDist::ProcessEncoded, this, _1, _2, _3));
+      }
+      StartApply();
+    }
+    return remain;
+  }
+
+  void SetKeyRanges(const std::vector<feaid_t>& bounds) override {
+    CHECK_EQ(bounds.size(), bounds_.size());
+    CHECK_EQ(bounds[0], bounds_[0]);
+    CHECK_EQ(bounds.back(), bounds_.back());
+    for (size_t j = 1; j < bounds.size(); ++j) {
+      CHECK_LT(bounds[j-1], bounds[j]) << "empty key range";
+    }
+    bounds_ = bounds;
+    if (worker_) {
+      using namespace std::placeholders;
+      worker_->set_slicer(std::bind(&StoreDist::Slice, this, _1, _2, _3));
+    }
+    if (server_) {
+      apply_.Stop();
+      StartApply();
+    }
+  }
+
+  int Push(const SArray<feaid_t>& fea_ids,
+           int val_type,
+           const SArray<real_t>& vals,
+           const SArray<int>& lens,
+           const std::function<void()>& on_complete) override {
+    // the span ends once the servers reply
+    auto done = Tracer::Get()->Async("push", "store", on_complete);
+    if (use_codec_ && fea_ids.size()) {
+      return PushEncoded(fea_ids, val_type, vals, lens, done);
+    }
+    return 2 * CHECK_NOTNULL(worker_)->ZPush(
+        fea_ids, vals, lens, val_type, done);
+  }
+
+  int Pull(const SArray<feaid_t>& fea_ids,
+           int val_type,
+           SArray<real_t>* vals,
+           SArray<int>* lens,
+           const std::function<void()>& on_complete) override {
+    auto done = Tracer::Get()->Async("pull", "store", on_complete);
+    if (ssp_ && val_type == Store::kWeight && !ssp_cache_.Disabled()) {
+      return PullCached(fea_ids, vals, lens, done);
+    }
+    return PullServers(fea_ids, val_type, vals, lens, done);
+  }
+
+  void Clock() override {
+    if (!ssp_) return;
+    int gen;
+    {
+      std::lock_guard<std::mutex> lk(ssp_mu_);
+      ++clock_;
+      gen = ssp_gen_;
+    }
+    if (use_codec_) {
+      SendClock(CHECK_NOTNULL(codec_worker_), false, gen);
+    } else {
+      SendClock(CHECK_NOTNULL(worker_), false, gen);
+    }
+  }
+
+  void ResetClock() override {
+    if (!ssp_) return;
+    {
+      std::lock_guard<std::mutex> lk(ssp_mu_);
+      clock_ = 0;
+      known_min_ = 0;
+      ++ssp_gen_;
+      ssp_cache_.Clear();
+    }
+    if (use_codec_) {
+      SendClock(CHECK_NOTNULL(codec_worker_), true, 0);
+    } else {
+      SendClock(CHECK_NOTNULL(worker_), true, 0);
+    }
+  }
+
+  void Wait(int time) override {
+    if (time == kCached) return;
+    if (time % 2) {
+      CHECK_NOTNULL(codec_worker_)->Wait(time / 2);
+    } else {
+      CHECK_NOTNULL(worker_)->Wait(time / 2);
+    }
+  }
+
+  int Rank() override { return ps::MyRank(); }
+  int NumWorkers() override { return ps::NumWorkers(); }
+  int NumServers() override { return ps::NumServers(); }
+
+ private:
+  /** \brief the ps-lite customer ids used by the model store */
+  static const int kAppID = 0;
+  static const int kCodecAppID = 2;
+  /** \brief the number of cached id lists on a worker */
+  static const int kNumSlots = 16;
+  /** \brief the value type of a request only sending ids */
+  static const int kKeysOnly = 0;
+  /** \brief the command of a clock, a push resets it and a pull advances it */
+  static const int kClock = 15;
+  /** \brief the timestamp of a pull read from the cache */
+  static const int kCached = -1;
+
+  /** \brief start the apply threads over the key range of this server */
+  void StartApply() {
+    if (apply_param_.server_apply_threads <= 0) return;
+    auto apply = [this](const SArray<feaid_t>& ids,
+                        const SArray<real_t>& vals,
+                        const SArray<int>& lens) {
+      CHECK_NOTNULL(updater_)->Update(ids, Store::kGradient, vals, lens);
+    };
+    int rank = ps::MyRank();
+    apply_.Start(apply_param_.server_apply_threads, bounds_[rank],
+                 bounds_[rank+1], apply);
+  }
+
+  /** \brief split a plain request by bounds_, its keys are sorted */
+  void Slice(const ps::KVPairs<real_t>& send,
+             const std::vector<ps::Range>& ranges,
+             ps::KVWorker<real_t>::SlicedKVs* sliced) {
+    size_t num = bounds_.size() - 1, n = send.keys.size();
+    CHECK_EQ(ranges.size(), num);
+    sliced->resize(num);
+    bool has_vals = send.vals.size() > 0, has_lens = send.lens.size() > 0;
+    int k = has_vals && !has_lens ? send.vals.size() / n : 0;
+    size_t pos = 0, val_pos = 0;
+    for (size_t j = 0; j < num; ++j) {
+      size_t end = j + 1 == num ? n :
+          std::lower_bound(send.keys.begin() + pos, send.keys.end(),
+                           bounds_[j+1]) - send.keys.begin();
+      auto& kv = (*sliced)[j];
+      kv.first = end > pos;
+      kv.second = ps::KVPairs<real_t>();
+      if (!kv.first) continue;
+      kv.second.keys = send.keys.segment(pos, end);
+      if (has_lens) kv.second.lens = send.lens.segment(pos, end);
+      if (has_vals) {
+        size_t val_len = k * (end - pos);
+        if (has_lens) {
+          for (size_t i = pos; i < end; ++i) val_len += send.lens[i];
+        }
+        kv.second.vals = send.vals.segment(val_pos, val_pos + val_len);
+        val_pos += val_len;
+      }
+      pos = end;
+    }
+  }
+
+  int PullServers(const SArray<feaid_t>& fea_ids,
+                  int val_type,
+                  SArray<real_t>* vals,
+                  SArray<int>* lens,
+                  const std::function<void()>& on_complete) {
+    if (use_codec_ && fea_ids.size()) {
+      return PullEncoded(fea_ids, val_type, vals, lens, on_complete);
+    }
+    return 2 * CHECK_NOTNULL(worker_)->ZPull(
+        fea_ids, vals, lens, val_type, on_complete);
+  }
+
+  /**
+   * \brief pull the weights, the ones fresh enough are read from the cache,
+   * and the others are pulled from the servers and then cached
+   */
+  int PullCached(const SArray<feaid_t>& fea_ids,
+                 SArray<real_t>* vals,
+                 SArray<int>* lens,
+                 const std::function<void()>& on_complete) {
+    auto hit = std::make_shared<std::vector<bool>>();
+    SArray<real_t> hit_vals;
+    SArray<int> hit_lens;
+    SArray<feaid_t> missing;
+    int stamp, min_stamp, gen;
+    {
+      std::lock_guard<std::mutex> lk(ssp_mu_);
+      // the weights pulled now have seen the gradients of the first
+      // min_stamp clocks of all workers, or more if the slowest is known
+      min_stamp = clock_ - ssp_param_.ssp_staleness;
+      stamp = std::max(min_stamp, known_min_);
+      gen = ssp_gen_;
+      if (clock_ > 0) {
+        ssp_cache_.Get(fea_ids, min_stamp, hit.get(), &hit_vals, &hit_lens,
+                       &missing);
+      } else {
+        // nothing is cached before the first clock of a job
+        hit->assign(fea_ids.size(), false);
+        missing = fea_ids;
+      }
+    }
+    auto miss_vals = new SArray<real_t>();
+    auto miss_lens = new SArray<int>();
+    auto merge = [this, fea_ids, hit, hit_vals, hit_lens, missing, miss_vals,
+                  miss_lens, stamp, min_stamp, gen, vals, lens,
+                  on_complete]() {
+      bool has_lens;
+      {
+        std::lock_guard<std::mutex> lk(ssp_mu_);
+        if (miss_lens->size()) has_lens_ = true;
+        has_lens = has_lens_;
+        if (missing.size() && gen == ssp_gen_) {
+          ssp_cache_.Put(missing, *miss_vals, *miss_lens, stamp, min_stamp);
+        }
+      }
+      // merge them in the order of fea_ids
+      vals->resize(0);
+      lens->resize(0);
+      size_t h = 0, hp = 0, m = 0, mp = 0;
+      for (size_t i = 0; i < fea_ids.size(); ++i) {
+        const real_t* v;
+        int len;
+        if ((*hit)[i]) {
+          len = hit_lens[h++];
+          v = hit_vals.data() + hp;
+          hp += len;
+        } else {
+          len = miss_lens->empty() ? 1 : (*miss_lens)[m];
+          ++m;
+          v = miss_vals->data() + mp;
+          mp += len;
+        }
+        for (int k = 0; k < len; ++k) vals->push_back(v[k]);
+        if (has_lens) lens->push_back(len);
+      }
+      delete miss_vals;
+      delete miss_lens;
+      if (on_complete) on_complete();
+    };
+    if (missing.empty()) {
+      merge();
+      return kCached;
+    }
+    return PullServers(missing, Store::kWeight, miss_vals, miss_lens, merge);
+  }
+
+  /**
+   * \brief reset or advance the clock of this worker on all servers. a clock
+   * is sent as the bytes of an int per server
+   */
+  template <typename V>
+  void SendClock(ps::KVWorker<V>* worker, bool reset, int gen) {
+    // the first key of each server, by the ranges the worker splits with
+    SArray<feaid_t> keys;
+    if (use_codec_) {
+      for (const auto& r : ps::Postoffice::Get()->GetServerKeyRanges()) {
+        keys.push_back(r.begin());
+      }
+    } else {
+      keys.CopyFrom(bounds_.data(), bounds_.size() - 1);
+    }
+    size_t k = sizeof(int) / sizeof(V);
+    if (reset) {
+      worker->Wait(worker->ZPush(
+          keys, SArray<V>(keys.size() * k, 0), SArray<int>(), kClock));
+      return;
+    }
+    auto mins = new SArray<V>();
+    worker->ZPull(keys, mins, nullptr, kClock, [this, mins, k, gen]() {
+        int m = std::numeric_limits<int>::max();
+        for (size_t i = 0; i < mins->size(); i += k) {
+          int c;
+          memcpy(&c, mins->data() + i, sizeof(int));
+          m = std::min(m, c);
+        }
+        delete mins;
+        std::lock_guard<std::mutex> lk(ssp_mu_);
+        if (gen == ssp_gen_) known_min_ = std::max(known_min_, m);
+      });
+  }
+
+  /**
+   * \brief reset or advance the clock of a worker, then reply the clock of
+   * the slowest worker, and respond the pulls that are ready now
+   */
+  template <typename V>
+  void ProcessClock(const ps::KVMeta& req_meta,
+                    const ps::KVPairs<V>& req_data,
+                    ps::KVServer<V>* server) {
+    int rank = ps::Postoffice::IDtoRank(req_meta.sender);
+    // the pushes before the clock are applied
+    if (apply_param_.server_apply_threads > 0) apply_.Wait();
+    int m;
+    std::vector<std::pair<int, std::function<void()>>> waiting, ready;
+    {
+      std::lock_guard<std::mutex> lk(ssp_mu_);
+      if (req_meta.push) {
+        ssp_clocks_.Reset(rank);
+      } else {
+        ssp_clocks_.Advance(rank);
+      }
+      m = ssp_clocks_.Min();
+      for (auto& p : ssp_pending_) {
+        if (ssp_clocks_.Ready(p.first, ssp_param_.ssp_staleness)) {
+          ready.push_back(std::move(p));
+        } else {
+          waiting.push_back(std::move(p));
+        }
+      }
+      ssp_pending_.swap(waiting);
+    }
+    for (auto& p : ready) p.second();
+    if (req_meta.push) {
+      server->Response(req_meta);
+      return;
+    }
+    ps::KVPairs<V> res;
+    res.keys = req_data.keys;
+    size_t k = sizeof(int) / sizeof(V);
+    res.vals.resize(res.keys.size() * k);
+    for (size_t i = 0; i < res.keys.size(); ++i) {
+      memcpy(res.vals.data() + i * k, &m, sizeof(int));
+    }
+    server->Response(req_meta, res);
+  }
+
+  /** \brief whether a push is queued into apply_ */
+  bool Queued(int val_type) {
+    return apply_param_.server_apply_threads > 0 &&
+           val_type == Store::kGradient &&
+           CHECK_NOTNULL(updater_)->ConcurrentUpdate(val_type);
+  }
+
+  /**
+   * \brief respond a pull now, or once the worker is no more than
+   * ssp_staleness clocks ahead of the slowest one if it pulls the weights
+   */
+  void RespondPull(int sender, int val_type,
+                   const std::function<void()>& respond) {
+    if (ssp_ && val_type == Store::kWeight) {
+      int rank = ps::Postoffice::IDtoRank(sender);
+      std::lock_guard<std::mutex> lk(ssp_mu_);
+      if (!ssp_clocks_.Ready(rank, ssp_param_.ssp_staleness)) {
+        ssp_pending_.push_back(std::make_pair(rank, respond));
+        return;
+      }
+    }
+    respond();
+  }
+
+  /** \brief a cached feature id list on a worker */
+  struct Slot {
+    SArray<feaid_t> fea_ids;
+    /** \brief the number of ids sent to each server, 0 for none */
+    std::vector<size_t> seg_size;
+  };
+
+  /**
+   * \brief returns the slot of the id list, and whether or not it is new.
+   * needs to hold mu_
+   */
+  int FindSlot(const SArray<feaid_t>& fea_ids, bool* is_new) {
+    if (param_.key_cache) {
+      for (int i = 0; i < kNumSlots; ++i) {
+        const auto& ids = slots_[i].fea_ids;
+        if (ids.data() == fea_ids.data() && ids.size() == fea_ids.size()) {
+          *is_new = false;
+          return i;
+        }
+      }
+    }
+    *is_new = true;
+    int i = next_slot_;
+    next_slot_ = (next_slot_ + 1) % kNumSlots;
+    auto& slot = slots_[i];
+    slot.fea_ids = fea_ids;
+    // split by the server key ranges
+    size_t num = bounds_.size() - 1;
+    slot.seg_size.resize(num);
+    size_t pos = 0, n = fea_ids.size();
+    for (size_t j = 0; j < num; ++j) {
+      size_t end = j + 1 == num ? n :
+          std::lower_bound(fea_ids.begin() + pos, fea_ids.end(),
+                           bounds_[j+1]) - fea_ids.begin();
+      slot.seg_size[j] = end - pos;
+      pos = end;
+    }
+    return i;
+  }
+
+  /**
+   * \brief the request keys, one per server owning some ids in the slot, plus
+   * kNumSlots if through the shared memory. needs to hold mu_
+   */
+  SArray<feaid_t> SlotKeys(int slot) {
+    const auto& ranges = ps::Postoffice::Get()->GetServerKeyRanges();
+    SArray<feaid_t> keys;
+    for (size_t j = 0; j < ranges.size(); ++j) {
+      if (slots_[slot].seg_size[j] == 0) continue;
+      int shm = ServerShm(j) ? kNumSlots : 0;
+      keys.push_back(ranges[j].begin() + slot + shm);
+    }
+    return keys;
+  }
+
+  /**
+   * \brief encode the ids or the values of a slot for each server
+   *
+   * @param with_keys write the ids
+   * @param skip_zero_V drop the all-zero V
+   * @param vals the values, nullptr to write the ids only
+   */
+  void EncodeSlot(const Slot& s, bool with_keys, bool skip_zero_V,
+                  StoreCodec::Type type,
+                  const SArray<real_t>* vals, const SArray<int>& lens,
+                  SArray<char>* data, SArray<int>* sizes) {
+    size_t n = s.fea_ids.size();
+    int k = vals == nullptr ? 0 : lens.empty() ? vals->size() / n : 0;
+    std::string blob, msg;
+    size_t pos = 0, val_pos = 0;
+    for (size_t j = 0; j < s.seg_size.size(); ++j) {
+      size_t seg = s.seg_size[j];
+      if (seg == 0) continue;
+      size_t size = blob.size();
+      ShmRing* peer = ServerShm(j);
+      msg.clear();
+      codec_.Encode(type, skip_zero_V, with_keys, seg, s.fea_ids.data() + pos,
+                    vals ? vals->data() + val_pos : nullptr,
+                    vals && lens.size() ? lens.data() + pos : nullptr, k,
+                    peer ? &msg : &blob);
+      if (peer) ShmWrap(shm_.get(), msg, &blob);
+      sizes->push_back(blob.size() - size);
+      if (vals) {
+        for (size_t j = pos; j < pos + seg; ++j) val_pos += lens.empty() ? k : lens[j];
+      }
+      pos += seg;
+    }
+    data->CopyFrom(blob.data(), blob.size());
+  }
+
+  /** \brief a message in a ring, offset is -1 if it follows the handle */
+  struct ShmHandle {
+    int64_t offset;
+    int64_t size;
+  };
+
+  /** \brief the name of the ring of a node */
+  static std::string ShmName(bool worker, int rank) {
+    // unique for a job on a machine
+    char const* uri = getenv("DMLC_PS_ROOT_URI");
+    char const* port = getenv("DMLC_PS_ROOT_PORT");
+    std::string name = std::string("/difacto_") + (uri ? uri : "") + "_" +
+        (port ? port : "") + (worker ? "_w" : "_s") + std::to_string(rank);
+    std::replace(name.begin() + 1, name.end(), '/', '_');
+    return name;
+  }
+
+  /** \brief the ring of server j if it is on this machine, nullptr if not */
+  ShmRing* ServerShm(size_t j) {
+    if (!shm_) return nullptr;
+    return OpenShm(ShmName(false, static_cast<int>(j)));
+  }
+
+  /** \brief the ring of a worker node, who has marked this server to be on
+   * the same machine */
+  ShmRing* WorkerShm(int node_id) {
+    auto name = ShmName(true, ps::Postoffice::IDtoRank(node_id));
+    auto ring = OpenShm(name);
+    CHECK(ring) << "cannot open " << name << ", the worker is not on this "
+                << "machine, the shared memory may be left by an old job";
+    return ring;
+  }
+
+  /** \brief open a ring once, nullptr if not exists */
+  ShmRing* OpenShm(const std::string& name) {
+    std::lock_guard<std::mutex> lk(shm_mu_);
+    auto it = shm_peers_.find(name);
+    if (it != shm_peers_.end()) return it->second.get();
+    std::unique_ptr<ShmRing> ring(new ShmRing());
+    if (!ring->Open(name)) ring.reset();
+    auto ptr = ring.get();
+    shm_peers_[name] = std::move(ring);
+    return ptr;
+  }
+
+  /**
+   * \brief append the handle of a message written into a ring, or the handle
+   * and the message itself if the ring is full
+   */
+  static void ShmWrap(ShmRing* ring, const std::string& msg,
+                      std::string* out) {
+    ShmHandle h;
+    h.offset = ring->Write(msg.data(), msg.size());
+    h.size = msg.size();
+    out->append(reinterpret_cast<char const*>(&h), sizeof(h));
+    if (h.offset < 0) out->append(msg);
+  }
+
+  /**
+   * \brief the message of a handle in a peer's ring. size is the size of the
+   * handle, and then the one of the message. offset is the one to release,
+   * -1 for none
+   */
+  static const char* ShmUnwrap(const ShmRing& ring, const char* data,
+                               size_t* size, int64_t* offset) {
+    CHECK_GE(*size, sizeof(ShmHandle));
+    ShmHandle h;
+    memcpy(&h, data, sizeof(h));
+    *offset = h.offset;
+    *size = h.size;
+    if (h.offset < 0) return data + sizeof(h);
+    return ring.Read(h.offset);
+  }
+
+  /** \brief returns the command of an encoded request */
+  static int Command(int val_type, StoreCodec::Type type, bool with_keys) {
+    return val_type + (type << 4) + (with_keys ? 1 << 8 : 0);
+  }
+
+  int PushEncoded(const SArray<feaid_t>& fea_ids,
+                  int val_type,
+                  const SArray<real_t>& vals,
+                  const SArray<int>& lens,
+                  const std::function<void()>& on_complete) {
+    auto type = val_type == Store::kGradient ? grad_type_ : StoreCodec::kNone;
+    // send the ids together with the values if the list is new
+    bool is_new;
+    Slot slot;
+    SArray<feaid_t> keys;
+    int t;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      int i = FindSlot(fea_ids, &is_new);
+      slot = slots_[i];
+      keys = SlotKeys(i);
+      t = next_turn_++;
+    }
+    Turn turn(this, t);
+    SArray<char> data;
+    SArray<int> sizes;
+    bool skip = val_type == Store::kGradient && param_.skip_zero_V_grad;
+    EncodeSlot(slot, is_new, skip, type, &vals, lens, &data, &sizes);
+    turn.Wait();
+    return 2 * CHECK_NOTNULL(codec_worker_)->ZPush(
+        keys, data, sizes, Command(val_type, type, is_new), on_complete) + 1;
+  }
+
+  int PullEncoded(const SArray<feaid_t>& fea_ids,
+                  int val_type,
+                  SArray<real_t>* vals,
+                  SArray<int>* lens,
+                  const std::function<void()>& on_complete) {
+    auto type = val_type == Store::kWeight ? weight_type_ : StoreCodec::kNone;
+    // a pull request cannot carry values, so a new id list is sent first
+    bool is_new;
+    Slot slot;
+    SArray<feaid_t> keys;
+    int t;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      int i = FindSlot(fea_ids, &is_new);
+      slot = slots_[i];
+      keys = SlotKeys(i);
+      t = next_turn_++;
+    }
+    Turn turn(this, t);
+    // the ring of each replying server, nullptr if not through it
+    std::vector<ShmRing*> peers;
+    for (size_t j = 0; j < slot.seg_size.size(); ++j) {
+      if (slot.seg_size[j]) peers.push_back(ServerShm(j));
+    }
+    auto data = new SArray<char>();
+    auto sizes = new SArray<int>();
+    auto callback = [data, sizes, vals, lens, peers, on_complete]() {
+      // decode the results of all servers directly into vals and lens, which
+      // are sized once for all of them
+      CHECK_EQ(sizes->size(), peers.size());
+      size_t n = peers.size();
+      std::vector<const char*> msgs(n);
+      std::vector<size_t> msg_sizes(n);
+      std::vector<int64_t> offsets(n, -1);
+      size_t pos = 0, num_lens = 0, num_vals = 0;
+      for (size_t i = 0; i < n; ++i) {
+        msg_sizes[i] = (*sizes)[i];
+        msgs[i] = data->data() + pos;
+        if (peers[i]) {
+          msgs[i] = ShmUnwrap(*peers[i], msgs[i], &msg_sizes[i], &offsets[i]);
+        }
+        size_t nl, nv;
+        StoreCodec::Count(msgs[i], msg_sizes[i], &nl, &nv);
+        num_lens += nl;
+        num_vals += nv;
+        pos += (*sizes)[i];
+      }
+      vals->reserve(num_vals); vals->resize(0);
+      lens->reserve(num_lens); lens->resize(0);
+      SArray<feaid_t> keys;
+      for (size_t i = 0; i < n; ++i) {
+        StoreCodec::Decode(msgs[i], msg_sizes[i], &keys, vals, lens, true);
+        if (offsets[i] >= 0) peers[i]->Release(offsets[i]);
+      }
+      delete data;
+      delete sizes;
+      if (on_complete) on_complete();
+    };
+    SArray<char> ids;
+    SArray<int> ids_sizes;
+    if (is_new) {
+      EncodeSlot(slot, true, false, StoreCodec::kNone, nullptr, {},
+                 &ids, &ids_sizes);
+    }
+    turn.Wait();
+    if (is_new) {
+      CHECK_NOTNULL(codec_worker_)->ZPush(
+          keys, ids, ids_sizes, Command(kKeysOnly, StoreCodec::kNone, true));
+    }
+    return 2 * CHECK_NOTNULL(codec_worker_)->ZPull(
+        keys, data, sizes, Command(val_type, type, false), callback) + 1;
+  }
+
+  /**
+   * \brief the turn of an encoded request to be sent, given under mu_
+   *
+   * the turn is ended when it is destroyed, on any path, after waiting for
+   * the earlier ones. so a request failed before sending never blocks the
+   * later ones
+   */
+  class Turn {
+   public:
+    Turn(StoreDist* store, int turn) : store_(store), turn_(turn) { }
+    ~Turn() {
+      Wait();
+      {
+        std::lock_guard<std::mutex> lk(store_->turn_mu_);
+        ++store_->turn_;
+      }
+      store_->turn_cond_.notify_all();
+    }
+    Turn(const Turn&) = delete;
+    Turn& operator=(const Turn&) = delete;
+
+    /** \brief wait until the requests of the earlier turns are sent */
+    void Wait() {
+      if (waited_) return;
+      std::unique_lock<std::mutex> lk(store_->turn_mu_);
+      store_->turn_cond_.wait(lk, [this] { return store_->turn_ == turn_; });
+      waited_ = true;
+    }
+
+   private:
+    StoreDist* store_;
+    int turn_;
+    bool waited_ = false;
+  };
+
+  /** \brief process an encoded request on a server node */
+  void ProcessEncoded(const ps::KVMeta& req_meta,
+                      const ps::KVPairs<char>& req_data,
+                      ps::KVServer<char>* server) {
+    if (req_meta.cmd == kClock) {
+      ProcessClock(req_meta, req_data, server);
+      return;
+    }
+    CHECK_EQ(req_data.keys.size(), 1);
+    int val_type = req_meta.cmd % 16;
+    auto type = static_cast<StoreCodec::Type>((req_meta.cmd >> 4) % 16);
+    bool with_keys = req_meta.cmd >> 8;
+    int slot = req_data.keys[0] -
+               ps::Postoffice::Get()->GetServerKeyRanges()[ps::MyRank()].begin();
+    bool shm = slot >= kNumSlots;
+    if (shm) slot -= kNumSlots;
+    CHECK(slot >= 0 && slot < kNumSlots);
+    auto& slots = server_slots_[req_meta.sender];
+    slots.resize(kNumSlots);
+    SArray<feaid_t>& fea_ids = slots[slot];
+    if (req_meta.push) {
+      CHECK_EQ(req_data.lens.size(), 1);
+      SArray<feaid_t> keys;
+      SArray<real_t> vals;
+      SArray<int> lens;
+      size_t size = req_data.lens[0];
+      int64_t offset = -1;
+      const char* msg = req_data.vals.data();
+      ShmRing* peer = shm ? WorkerShm(req_meta.sender) : nullptr;
+      if (peer) msg = ShmUnwrap(*peer, msg, &size, &offset);
+      StoreCodec::Decode(msg, size, &keys, &vals, &lens);
+      if (offset >= 0) peer->Release(offset);
+      if (with_keys) fea_ids = keys;
+      if (val_type != kKeysOnly && Queued(val_type)) {
+        apply_.Push(fea_ids, vals, lens,
+                    [req_meta, server]() { server->Response(req_meta); });
+        return;
+      }
+      if (val_type != kKeysOnly) {
+        CHECK_NOTNULL(updater_)->Update(fea_ids, val_type, vals, lens);
+      }
+      server->Response(req_meta);
+    } else {
+      // the slot may be replaced before a delayed response
+      SArray<feaid_t> ids = fea_ids;
+      auto respond = [this, req_meta, req_data, server, ids, val_type,
+                      type, shm]() {
+        SArray<real_t> vals;
+        SArray<int> lens;
+        CHECK_NOTNULL(updater_)->Get(ids, val_type, &vals, &lens);
+        size_t n = ids.size();
+        int k = lens.empty() && n ? vals.size() / n : 0;
+        std::string blob;
+        codec_.Encode(type, false, false, n, ids.data(), vals.data(),
+                      lens.empty() ? nullptr : lens.data(), k, &blob);
+        if (shm) {
+          std::string msg;
+          msg.swap(blob);
+          ShmWrap(CHECK_NOTNULL(shm_.get()), msg, &blob);
+        }
+        ps::KVPairs<char> res;
+        res.keys = req_data.keys;
+        res.vals.CopyFrom(blob.data(), blob.size());
+        res.lens = {static_cast<int>(blob.size())};
+        server->Response(req_meta, res);
+      };
+      RespondPull(req_meta.sender, val_type, respond);
+    }
+  }
+
+  /** \brief process a push or a pull request on a server node */
+  void Process(const ps::KVMeta& req_meta,
+               const ps::KVPairs<real_t>& req_data,
+               ps::KVServer<real_t>* server) {
+    if (req_meta.cmd == kClock) {
+      ProcessClock(req_meta, req_data, server);
+      return;
+    }
+    int val_type = req_meta.cmd;
+    if (req_meta.push && Queued(val_type)) {
+      apply_.Push(req_data.keys, req_data.vals, req_data.lens,
+                  [req_meta, server]() { server->Response(req_meta); });
+    } else if (req_meta.push) {
+      CHECK_NOTNULL(updater_)->Update(
+          req_data.keys, val_type, req_data.vals, req_data.lens);
+      server->Response(req_meta);
+    } else {
+      auto respond = [this, req_meta, req_data, server, val_type]() {
+        ps::KVPairs<real_t> res;
+        res.keys = req_data.keys;
+        CHECK_NOTNULL(updater_)->Get(res.keys, val_type, &res.vals, &res.lens);
+        server->Response(req_meta, res);
+      };
+      RespondPull(req_meta.sender, val_type, respond);
+    }
+  }
+
+  StoreCodecParam param_;
+  StoreCodec::Type grad_type_ = StoreCodec::kNone;
+  StoreCodec::Type weight_type_ = StoreCodec::kNone;
+  bool use_codec_ = false;
+  StoreCodec codec_;
+  ps::KVWorker<real_t>* worker_ = nullptr;
+  ps::KVServer<real_t>* server_ = nullptr;
+  ps::KVWorker<char>* codec_worker_ = nullptr;
+  ps::KVServer<char>* codec_server_ = nullptr;
+  /** \brief server j owns the keys in [bounds_[j], bounds_[j+1]) */
+  std::vector<feaid_t> bounds_;
+  // on a worker
+  std::mutex mu_;
+  Slot slots_[kNumSlots];
+  int next_slot_ = 0;
+  // the turn given to the next encoded request under mu_, and the one to be
+  // sent now
+  int next_turn_ = 0;
+  int turn_ = 0;
+  std::mutex turn_mu_;
+  std::condition_variable turn_cond_;
+  // on a server, the id lists of each worker
+  std::unordered_map<int, std::vector<SArray<feaid_t>>> server_slots_;
+  // the stale synchronous parallel consistency
+  StoreSSPParam ssp_param_;
+  bool ssp_ = false;
+  std::mutex ssp_mu_;
+  // on a worker: the clock, the known clock of the slowest worker, the
+  // generation increased by each reset, and the cached weights
+  int clock_ = 0;
+  int known_min_ = 0;
+  int ssp_gen_ = 0;
+  bool has_lens_ = false;
+  SSPCache ssp_cache_;
+  // on a server: the clocks, and the delayed pulls with the worker ranks
+  SSPClocks ssp_clocks_;
+  std::vector<std::pair<int, std::function<void()>>> ssp_pending_;
+  // the ring of this node, and the rings opened of the others
+  StoreShmParam shm_param_;
+  std::unique_ptr<ShmRing> shm_;
+  std::mutex shm_mu_;
+  std::unordered_map<std::string, std::unique_ptr<ShmRing>> shm_peers_;
+  // the multi-threaded apply on a server
+  StoreApplyParam apply_param_;
+  ApplyEngine apply_;
+};
+}  // namespace difacto
+#endif  // DIFACTO_STORE_STORE_DIST_H_
@@ -3,12 +3,14 @@
  */
 #ifndef DIFACTO_STORE_STORE_LOCAL_H_
 #define DIFACTO_STORE_STORE_LOCAL_H_
+#include <atomic>
 #include <string>
 #include <vector>
 #include <functional>
 #include "difacto/store.h"
 #include "difacto/updater.h"
 #include "dmlc/parameter.h"
+#include "common/tracer.h"
 namespace difacto {
 
 /**
@@ -26,10 +28,11 @@ class StoreLocal : public Store {
            const SArray<real_t>& vals,
            const SArray<int>& lens,
            const std::function<void()>& on_complete) override {
-    SArray<real_t> vals_copy; vals_copy.CopyFrom(vals);
-    SArray<int> lens_copy; lens_copy.CopyFrom(lens);
-    updater_->Update(fea_ids, val_type, vals_copy, lens_copy);
-    if (on_complete) on_complete();
+    // no copy, the updater either uses the values synchronously or copies
+    // what it keeps
+    auto done = Tracer::Get()->Async("push", "store", on_complete);
+    updater_->Update(fea_ids, val_type, vals, lens);
+    if (done) done();
     return time_++;
   }
 
@@ -38,8 +41,10 @@ class StoreLocal : public Store {
            SArray<real_t>* vals,
            SArray<int>* lens,
            const std::function<void()>& on_complete) override {
+    // write into the caller's buffers, which are reused if large enough
+    auto done = Tracer::Get()->Async("pull", "store", on_complete);
     updater_->Get(fea_ids, val_type, vals, lens);
-    if (on_complete) on_complete();
+    if (done) done();
     return time_++;
   }
 
@@ -49,7 +54,8 @@ class StoreLocal : public Store {
   int NumServers() override { return 1; }
 
  private:
-  int time_;
+  /** \brief atomic, the learners may push and pull from several threads */
+  std::atomic<int> time_{0};
 };
 }  // namespace difacto
 #endif  // DIFACTO_STORE_STORE_LOCAL_H_
@@ -0,0 +1,182 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_STORE_STORE_SHM_H_
+#define DIFACTO_STORE_STORE_SHM_H_
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include "dmlc/logging.h"
+#include "dmlc/parameter.h"
+namespace difacto {
+
+/**
+ * \brief the shared memory between the workers and the servers on the same
+ * machine
+ */
+struct StoreShmParam : public dmlc::Parameter<StoreShmParam> {
+  /**
+   * \brief if positive, each node creates a shared memory ring of this many
+   * MB, and the encoded requests and responses between two nodes on the
+   * same machine are written into the ring of the sender instead of being
+   * sent through ps-lite, which then only carries their offsets. 0 means not
+   * used. it turns on the encoded requests, see \ref StoreCodecParam
+   */
+  int shm_mb;
+  DMLC_DECLARE_PARAMETER(StoreShmParam) {
+    DMLC_DECLARE_FIELD(shm_mb).set_range(0, 1 << 16).set_default(0);
+  }
+};
+
+/**
+ * \brief a ring buffer in a named shared memory segment
+ *
+ * the process creating a ring writes messages into it, and the ones opening
+ * it read and release them, in any order. the writer reuses the space once
+ * the oldest messages are released. each message is preceded by its size and
+ * a released flag, which is an atomic shared by both processes.
+ */
+class ShmRing {
+ public:
+  ShmRing() { }
+  ~ShmRing() {
+    if (base_) munmap(base_, capacity_ + sizeof(Header));
+    if (owner_) shm_unlink(name_.c_str());
+  }
+
+  /** \brief create a ring of capacity bytes, replacing an old one */
+  void Create(const std::string& name, size_t capacity) {
+    capacity_ = (capacity + kAlign - 1) / kAlign * kAlign;
+    CHECK_GT(capacity_, 0);
+    name_ = name;
+    shm_unlink(name_.c_str());
+    int fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    CHECK_GE(fd, 0) << "failed to create shared memory " << name_ << ": "
+                    << strerror(errno);
+    owner_ = true;
+    CHECK_EQ(ftruncate(fd, capacity_ + sizeof(Header)), 0)
+        << "failed to resize shared memory " << name_;
+    Map(fd);
+    header()->capacity = capacity_;
+  }
+
+  /** \brief open a ring created by another process, false if not exists */
+  bool Open(const std::string& name) {
+    name_ = name;
+    int fd = shm_open(name_.c_str(), O_RDWR, 0600);
+    if (fd < 0) return false;
+    struct stat st;
+    CHECK_EQ(fstat(fd, &st), 0);
+    // the creator may not have resized it yet
+    if (static_cast<size_t>(st.st_size) < sizeof(Header)) {
+      close(fd);
+      return false;
+    }
+    capacity_ = st.st_size - sizeof(Header);
+    Map(fd);
+    if (header()->capacity != capacity_) {
+      munmap(base_, capacity_ + sizeof(Header));
+      base_ = nullptr;
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * \brief copy a message into the ring, only by the creator
+   * @return the offset of the message, or -1 if there is no space
+   */
+  int64_t Write(const char* data, size_t size) {
+    CHECK(owner_);
+    size_t total = (sizeof(Region) + size + kAlign - 1) / kAlign * kAlign;
+    std::lock_guard<std::mutex> lk(mu_);
+    Reclaim();
+    size_t pos = head_ % capacity_;
+    // a message is continuous, so the space before the end may be skipped
+    size_t skip = pos + total > capacity_ ? capacity_ - pos : 0;
+    if (head_ + skip + total - tail_ > capacity_) return -1;
+    if (skip) {
+      Region* pad = region(pos);
+      pad->size = skip;
+      pad->released.store(1, std::memory_order_relaxed);
+      head_ += skip;
+      pos = 0;
+    }
+    Region* r = region(pos);
+    r->size = total;
+    r->released.store(0, std::memory_order_relaxed);
+    memcpy(r + 1, data, size);
+    head_ += total;
+    return pos + sizeof(Region);
+  }
+
+  /** \brief the message at an offset */
+  const char* Read(int64_t offset) const {
+    CHECK(offset >= static_cast<int64_t>(sizeof(Region)) &&
+          static_cast<size_t>(offset) < capacity_);
+    return data() + offset;
+  }
+
+  /** \brief release the message at an offset, so its space can be reused */
+  void Release(int64_t offset) {
+    region(Read(offset) - data() - sizeof(Region))->released.store(
+        1, std::memory_order_release);
+  }
+
+  /** \brief the number of bytes not released yet, only by the creator */
+  size_t used() {
+    std::lock_guard<std::mutex> lk(mu_);
+    Reclaim();
+    return head_ - tail_;
+  }
+
+ private:
+  struct Header {
+    uint64_t capacity;
+    char padding[56];
+  };
+  struct Region {
+    uint64_t size;
+    std::atomic<uint32_t> released;
+  };
+  static const size_t kAlign = 64;
+
+  void Map(int fd) {
+    void* p = mmap(nullptr, capacity_ + sizeof(Header),
+                   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    CHECK(p != MAP_FAILED) << "failed to map shared memory " << name_;
+    base_ = static_cast<char*>(p);
+  }
+
+  /** \brief skip the released messages from the oldest. needs to hold mu_ */
+  void Reclaim() {
+    while (tail_ < head_) {
+      Region* r = region(tail_ % capacity_);
+      if (!r->released.load(std::memory_order_acquire)) break;
+      tail_ += r->size;
+    }
+  }
+
+  Header* header() { return reinterpret_cast<Header*>(base_); }
+  char* data() const { return base_ + sizeof(Header); }
+  Region* region(size_t pos) { return reinterpret_cast<Region*>(data() + pos); }
+
+  std::string name_;
+  bool owner_ = false;
+  char* base_ = nullptr;
+  size_t capacity_ = 0;
+  std::mutex mu_;
+  /** \brief the total bytes written and released */
+  uint64_t head_ = 0, tail_ = 0;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_STORE_STORE_SHM_H_
@@ -0,0 +1,165 @@
+/**
+ * Copyright (c) 2015 by Contributors
+ */
+#ifndef DIFACTO_STORE_STORE_SSP_H_
+#define DIFACTO_STORE_STORE_SSP_H_
+#include <limits>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+#include "difacto/base.h"
+#include "difacto/sarray.h"
+#include "dmlc/logging.h"
+#include "dmlc/parameter.h"
+namespace difacto {
+
+/**
+ * \brief the stale synchronous parallel (SSP) consistency of the distributed
+ * store
+ */
+struct StoreSSPParam : public dmlc::Parameter<StoreSSPParam> {
+  /**
+   * \brief a pull of the weights by a worker at clock c sees the gradients of
+   * the first c - ssp_staleness clocks of all workers. a worker then waits
+   * once it is more than ssp_staleness clocks ahead of the slowest one. 0 is
+   * bulk synchronous, and the default -1 is fully asynchronous
+   */
+  int ssp_staleness;
+  /**
+   * \brief the maximal number of features whose pulled weights are cached on
+   * a worker, which are read again while they are fresh enough. 0 means no
+   * cache
+   */
+  int ssp_cache_size;
+  DMLC_DECLARE_PARAMETER(StoreSSPParam) {
+    DMLC_DECLARE_FIELD(ssp_staleness).set_lower_bound(-1).set_default(-1);
+    DMLC_DECLARE_FIELD(ssp_cache_size).set_lower_bound(0).set_default(1 << 20);
+  }
+};
+
+/**
+ * \brief the clocks of the workers, kept by a server
+ *
+ * a clock is the number of gradient pushes of a worker in its current job. a
+ * worker is idle between jobs, and the others do not wait for it. so there
+ * is no deadlock even if the workers have different numbers of batches: the
+ * slowest active worker never waits.
+ */
+class SSPClocks {
+ public:
+  /** \brief all workers are idle */
+  void Init(int num_workers) {
+    clocks_.resize(num_workers);
+    for (int& c : clocks_) c = kIdle;
+  }
+
+  /** \brief advance the clock of a worker, an idle one starts from 0 */
+  int Advance(int rank) {
+    CHECK_LT(rank, static_cast<int>(clocks_.size()));
+    if (clocks_[rank] == kIdle) clocks_[rank] = 0;
+    return ++clocks_[rank];
+  }
+
+  /** \brief the worker finished its job */
+  void Reset(int rank) {
+    CHECK_LT(rank, static_cast<int>(clocks_.size()));
+    clocks_[rank] = kIdle;
+  }
+
+  /** \brief the clock of the slowest active worker, INT_MAX if none */
+  int Min() const {
+    int m = std::numeric_limits<int>::max();
+    for (int c : clocks_) if (c != kIdle) m = std::min(m, c);
+    return m;
+  }
+
+  /** \brief whether a worker can pull without exceeding the staleness */
+  bool Ready(int rank, int staleness) const {
+    return Min() >= clocks_[rank] - staleness;
+  }
+
+ private:
+  static const int kIdle = -1;
+  std::vector<int> clocks_;
+};
+
+/**
+ * \brief the pulled weights cached on a worker
+ *
+ * a weight pulled is stamped by the clock whose gradients it surely has seen,
+ * and can be read again by a pull requiring no later stamp. once full, the
+ * stale entries are dropped, or all of them if none is stale. not thread-safe
+ */
+class SSPCache {
+ public:
+  void Init(size_t capacity) { capacity_ = capacity; }
+
+  bool Disabled() const { return capacity_ == 0; }
+
+  /**
+   * \brief read the ids with a stamp no less than min_stamp
+   *
+   * @param ids the feature ids
+   * @param min_stamp the minimal stamp
+   * @param hit hit[i] is true if the i-th id is read
+   * @param vals the values of the ids read
+   * @param lens the lengths of the ids read
+   * @param missing the ids not read
+   */
+  void Get(const SArray<feaid_t>& ids, int min_stamp, std::vector<bool>* hit,
+           SArray<real_t>* vals, SArray<int>* lens,
+           SArray<feaid_t>* missing) const {
+    hit->assign(ids.size(), false);
+    for (size_t i = 0; i < ids.size(); ++i) {
+      auto it = entries_.find(ids[i]);
+      if (it == entries_.end() || it->second.stamp < min_stamp) {
+        missing->push_back(ids[i]);
+        continue;
+      }
+      (*hit)[i] = true;
+      const auto& val = it->second.val;
+      for (real_t v : val) vals->push_back(v);
+      lens->push_back(static_cast<int>(val.size()));
+    }
+  }
+
+  /** \brief cache the pulled values, lens is empty if each has length 1 */
+  void Put(const SArray<feaid_t>& ids, const SArray<real_t>& vals,
+           const SArray<int>& lens, int stamp, int min_stamp) {
+    if (ids.size() + entries_.size() > capacity_) {
+      for (auto it = entries_.begin(); it != entries_.end(); ) {
+        if (it->second.stamp < min_stamp) {
+          it = entries_.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      if (ids.size() + entries_.size() > capacity_) entries_.clear();
+    }
+    if (ids.size() > capacity_) return;
+    size_t p = 0;
+    for (size_t i = 0; i < ids.size(); ++i) {
+      int len = lens.empty() ? 1 : lens[i];
+      auto& e = entries_[ids[i]];
+      e.stamp = stamp;
+      e.val.assign(vals.data() + p, vals.data() + p + len);
+      p += len;
+    }
+    CHECK_EQ(p, vals.size());
+  }
+
+  void Clear() { entries_.clear(); }
+
+  size_t size() const { return entries_.size(); }
+
+ private:
+  struct Entry {
+    int stamp;
+    std::vector<real_t> val;
+  };
+  size_t capacity_ = 0;
+  std::unordered_map<feaid_t, Entry> entries_;
+};
+
+}  // namespace difacto
+#endif  // DIFACTO_STORE_STORE_SSP_H_
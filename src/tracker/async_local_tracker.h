@@ -7,11 +7,15 @@
 #include <utility>
 #include <unordered_map>
 #include <string>
-#include <queue>
 #include <functional>
+#include <future>
+#include <memory>
 #include <thread>
 #include <mutex>
-#include <condition_variable>
+#include <atomic>
+#include "dmlc/logging.h"
+#include "common/mpmc_queue.h"
+#include "common/tracer.h"
 namespace difacto {
 /**
  * \brief a thread-safe asynchronous workload tracker
@@ -22,19 +26,23 @@ namespace difacto {
  * 3. no node_id is required
  * 4. The executor can be asynchronous, it calls on_complete when actually finished.
  *
+ * the pending jobs are in a lock-free \ref MPMCQueue, and the number of
+ * unfinished jobs is an atomic counter, so issuing and waiting take no
+ * lock. only the running jobs are kept under a mutex
+ *
  * \tparam JobArgs the type of the job arguments
  * \parram JobRets the type of the job returns
  */
 template<typename JobArgs, typename JobRets = std::string>
 class AsyncLocalTracker {
  public:
-  AsyncLocalTracker() {
+  /** \param capacity the maximal number of pending jobs */
+  explicit AsyncLocalTracker(size_t capacity = 4096) : pending_(capacity) {
     thread_ = new std::thread(&AsyncLocalTracker::RunExecutor, this);
   }
   ~AsyncLocalTracker() {
     Wait();
-    done_ = true;
-    run_cond_.notify_one();
+    pending_.Close();
     thread_->join();
     delete thread_;
   }
@@ -45,11 +53,23 @@ class AsyncLocalTracker {
    */
   void Issue(const std::vector<JobArgs>& jobs) {
     CHECK(executor_) << "set executor first";
-    {
-      std::lock_guard<std::mutex> lk(mu_);
-      for (const auto& w : jobs) pending_.push(w);
+    for (const auto& w : jobs) {
+      num_remains_.fetch_add(1);
+      pending_.Push(Job{w, nullptr});
     }
-    run_cond_.notify_all();
+  }
+
+  /**
+   * \brief add a job, the returned future is ready with the job's returns
+   * once the job is finished
+   */
+  std::future<JobRets> Submit(const JobArgs& job) {
+    CHECK(executor_) << "set executor first";
+    std::shared_ptr<std::promise<JobRets>> done(new std::promise<JobRets>());
+    auto fut = done->get_future();
+    num_remains_.fetch_add(1);
+    pending_.Push(Job{job, done});
+    return fut;
   }
 
   /**
@@ -58,24 +78,24 @@ class AsyncLocalTracker {
    * \param num_remains the maximal number of unfinished jobers
    */
   void Wait(int num_remains = 0) {
-    std::unique_lock<std::mutex> lk(mu_);
-    fin_cond_.wait(lk, [this, num_remains] {
-        return pending_.size() + running_.size() <= num_remains;
+    fin_.Wait([this, num_remains] {
+        return num_remains_.load() <= num_remains;
       });
   }
   /**
-   * \brief clear all jobs that have not been assigned yet
+   * \brief clear all jobs that have not been assigned yet, their futures get
+   * broken promises
    */
   void Clear() {
-    std::lock_guard<std::mutex> lk(mu_);
-    while (pending_.size()) pending_.pop();
+    Job job;
+    while (pending_.TryPop(&job)) num_remains_.fetch_sub(1);
+    fin_.Notify(true);
   }
   /**
    * \brief return the number of unfinished job
    */
   int NumRemains() {
-    std::lock_guard<std::mutex> lk(mu_);
-    return pending_.size() + running_.size();
+    return num_remains_.load();
   }
 
   /** \brief the callback function type */
@@ -110,44 +130,65 @@ class AsyncLocalTracker {
 
  private:
   void RunExecutor() {
-    while (true) {
-      // get a job from the queue
+    Job job;
+    while (pending_.Pop(&job)) {
+      // the job is kept until it is actually finished
       std::unique_lock<std::mutex> lk(mu_);
-      run_cond_.wait(lk, [this] { return (done_ || pending_.size() > 0); });
-      if (done_) break;
-      auto it = running_.insert(std::make_pair(
-          cur_id_++, std::make_pair(std::move(pending_.front()), JobRets())));
-      pending_.pop();
+      auto it = running_.insert(std::make_pair(cur_id_++, std::move(job)));
       lk.unlock();
+      job = Job();
 
-      // run the job
+      // run the job, the span of a job ends once it is actually finished
       CHECK(executor_);
       int id = it.first->first;
-      auto on_complete = [this, id]() { Remove(id); };
-      executor_(it.first->second.first, on_complete, &(it.first->second.second));
+      uint64_t trace_id = Tracer::Get()->AsyncBegin("job", "tracker");
+      auto on_complete = [this, id, trace_id]() {
+        Tracer::Get()->AsyncEnd("job", "tracker", trace_id);
+        Remove(id);
+      };
+      DIFACTO_TRACE_SCOPE("execute", "tracker");
+      executor_(it.first->second.args, on_complete, &(it.first->second.rets));
     }
   }
 
   inline void Remove(int id) {
+    std::shared_ptr<std::promise<JobRets>> done;
+    JobRets rets;
     {
       std::lock_guard<std::mutex> lk(mu_);
       auto it = running_.find(id);
       CHECK(it != running_.end());
-      if (monitor_) monitor_(it->second.second);
+      if (monitor_) monitor_(it->second.rets);
+      done = std::move(it->second.done);
+      if (done) rets = std::move(it->second.rets);
       running_.erase(it);
     }
-    fin_cond_.notify_one();
+    // the job is not counted once its future is ready
+    num_remains_.fetch_sub(1);
+    if (done) done->set_value(std::move(rets));
+    // there may be several waiters with different thresholds
+    fin_.Notify(true);
   }
 
-  bool done_ = false;
+  /** \brief a queued or running job */
+  struct Job {
+    JobArgs args;
+    /** \brief the promise of \ref Submit, or null */
+    std::shared_ptr<std::promise<JobRets>> done;
+    JobRets rets;
+  };
+
   int cur_id_ = 0;
+  /** \brief guards running_ */
   std::mutex mu_;
-  std::condition_variable run_cond_, fin_cond_;
+  /** \brief the number of pending and running jobs */
+  std::atomic<int> num_remains_{0};
+  Parker fin_;
   std::thread* thread_;
   Executor executor_;
   Monitor monitor_;
-  std::queue<JobArgs> pending_;
-  std::unordered_map<int, std::pair<JobArgs, JobRets>> running_;
+  MPMCQueue<Job> pending_;
+  std::unordered_map<int, Job> running_;
 };
 
 
@@ -3,11 +3,330 @@
  */
 #ifndef DIFACTO_TRACKER_DIST_TRACKER_H_
 #define DIFACTO_TRACKER_DIST_TRACKER_H_
+#include <vector>
+#include <utility>
+#include <string>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include "dmlc/parameter.h"
+#include "difacto/tracker.h"
+#include "difacto/node_id.h"
+#include "ps/ps.h"
 namespace difacto {
+
+struct DistTrackerParam : public dmlc::Parameter<DistTrackerParam> {
+  /**
+   * \brief the seconds without a heartbeat after which a node is taken as
+   * dead, see \ref DistTracker. 0 disables it. only the workers running
+   * jobs sent to a group, such as SGD, can be replaced. the heartbeats
+   * are sent every PS_HEARTBEAT_INTERVAL seconds, which needs to be set in
+   * the environment of all nodes
+   */
+  int node_timeout;
+  DMLC_DECLARE_PARAMETER(DistTrackerParam) {
+    DMLC_DECLARE_FIELD(node_timeout).set_range(0, 1000000).set_default(0);
+  }
+};
+
 /**
  * \brief a tracker which runs over mutliple machines
+ *
+ * the scheduler keeps a job queue for each node, plus a shared queue for jobs
+ * sent to a node group. a node gets a new job only when its previous one is
+ * finished, first from its own queue and then from the shared one. so the
+ * jobs sent to a group are dynamically assigned to the nodes finish first.
+ *
+ * the membership is elastic for workers running jobs sent to a group, such
+ * as the data parts of SGD, if node_timeout is set. once such a worker is
+ * dead, its running job is put back into the group queue and taken over by
+ * the next idle worker. a replacement restarted by ps-lite's recovery has
+ * the same node id, and gets jobs again once its heartbeats arrive. the
+ * results of a dead node are dropped, even if they arrive later.
+ *
+ * a job sent to a node, such as a broadcast one, depends on the state the
+ * node built by the previous jobs, such as the data prepared by BCD and
+ * L-BFGS, and a server holds a part of the model. a replacement has none of
+ * them, so the scheduler aborts if a server dies, or a node dies with such a
+ * job running or queued, or such a job is sent to a node that has died. the
+ * training is then restarted from the last checkpoint. taking over such jobs
+ * is not supported: a worker keeps its tiles in a cache named by its pid and
+ * removed on exit, and its margins only in memory, so a replacement cannot
+ * resume the jobs of BCD or L-BFGS without preparing the data again
  */
 class DistTracker : public Tracker {
+ public:
+  DistTracker() { }
+  virtual ~DistTracker() {
+    if (watchdog_.joinable()) {
+      {
+        std::lock_guard<std::mutex> lk(mu_);
+        done_ = true;
+      }
+      cond_.notify_all();
+      watchdog_.join();
+    }
+    delete app_;
+  }
+
+  KWArgs Init(const KWArgs& kwargs) override {
+    using namespace std::placeholders;
+    auto remain = param_.InitAllowUnknown(kwargs);
+    app_ = new ps::SimpleApp(kAppID);
+    if (IsScheduler()) {
+      app_->set_response_handle(
+          std::bind(&DistTracker::OnResponse, this, _1, _2));
+      int group = NodeID::kWorkerGroup + NodeID::kServerGroup;
+      for (int id : ps::Postoffice::Get()->GetNodeIDs(group)) nodes_[id];
+      if (param_.node_timeout > 0) {
+        watchdog_ = std::thread([this]() { Watchdog(); });
+      }
+    } else {
+      app_->set_request_handle(
+          std::bind(&DistTracker::OnRequest, this, _1, _2));
+    }
+    return remain;
+  }
+
+  void Issue(const std::vector<std::pair<int, std::string>>& jobs) override {
+    std::lock_guard<std::mutex> lk(mu_);
+    for (const auto& job : jobs) {
+      if (NodeID::IsGroup(job.first)) {
+        group_jobs_.push_back(job);
+      } else {
+        auto it = nodes_.find(ToPSID(job.first));
+        CHECK(it != nodes_.end()) << "unknown node " << job.first;
+        CHECK(!it->second.died) << "node " << job.first << " has been dead "
+            << "and lost its state, restart from the last checkpoint";
+        it->second.jobs.push_back(job.second);
+      }
+      ++num_remains_;
+    }
+    Dispatch();
+  }
+
+  void Broadcast(int node_group, const std::string& args) override {
+    std::vector<std::pair<int, std::string>> jobs;
+    for (int id : ps::Postoffice::Get()->GetNodeIDs(node_group)) {
+      jobs.push_back(std::make_pair(ToNodeID(id), args));
+    }
+    Issue(jobs);
+  }
+
+  int NumRemains() override {
+    std::lock_guard<std::mutex> lk(mu_);
+    return num_remains_;
+  }
+
+  void WaitRemains(int num_remains) override {
+    std::unique_lock<std::mutex> lk(mu_);
+    cond_.wait(lk, [this, num_remains] { return num_remains_ <= num_remains; });
+  }
+
+  void Clear() override {
+    std::lock_guard<std::mutex> lk(mu_);
+    num_remains_ -= group_jobs_.size();
+    group_jobs_.clear();
+    for (auto& it : nodes_) {
+      num_remains_ -= it.second.jobs.size();
+      it.second.jobs.clear();
+    }
+    cond_.notify_all();
+  }
+
+  void Stop() override {
+    WaitRemains(0);
+    // a dead node never responds
+    std::vector<int> ts;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      for (const auto& it : nodes_) {
+        if (!it.second.dead) ts.push_back(app_->Request(kStop, "", it.first));
+      }
+    }
+    for (int t : ts) app_->Wait(t);
+  }
+
+  void SetMonitor(const Monitor& monitor) override {
+    std::lock_guard<std::mutex> lk(mu_);
+    monitor_ = monitor;
+  }
+
+  void SetExecutor(const Executor& executor) override {
+    CHECK_NOTNULL(executor);
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      executor_ = executor;
+    }
+    cond_.notify_all();
+  }
+
+  void Wait() override {
+    std::unique_lock<std::mutex> lk(mu_);
+    cond_.wait(lk, [this] { return stopped_; });
+  }
+
+ private:
+  /** \brief the ps-lite customer id, different to the model store's */
+  static const int kAppID = 1;
+  /** \brief the request heads */
+  static const int kJob = 0;
+  static const int kStop = 1;
+
+  /** \brief the state of an executor node on the scheduler */
+  struct Node {
+    bool busy = false;
+    bool dead = false;
+    /** \brief the node has been dead, so it lost its state */
+    bool died = false;
+    /** \brief the running job, and the node or group it was issued to */
+    std::pair<int, std::string> running;
+    /** \brief the timestamp of the request of the running job */
+    int ts = -1;
+    std::deque<std::string> jobs;
+  };
+
+  /** \brief send jobs to the idle nodes, needs to hold mu_ */
+  void Dispatch() {
+    for (auto& it : nodes_) {
+      Node& node = it.second;
+      if (node.busy || node.dead) continue;
+      if (node.jobs.size()) {
+        node.running = std::make_pair(ToNodeID(it.first),
+                                      std::move(node.jobs.front()));
+        node.jobs.pop_front();
+      } else {
+        auto job = group_jobs_.begin();
+        while (job != group_jobs_.end() && !(job->first & GroupOf(it.first))) ++job;
+        if (job == group_jobs_.end()) continue;
+        node.running = std::move(*job);
+        group_jobs_.erase(job);
+      }
+      node.busy = true;
+      node.ts = app_->Request(kJob, node.running.second, it.first);
+    }
+  }
+
+  /** \brief the scheduler receives the results of a job */
+  void OnResponse(const ps::SimpleData& res, ps::SimpleApp* app) {
+    if (res.head != kJob) return;
+    std::lock_guard<std::mutex> lk(mu_);
+    // the job may have been issued again since the node was taken as dead
+    Node& node = nodes_[res.sender];
+    if (!node.busy || node.ts != res.timestamp) return;
+    if (monitor_) monitor_(ToNodeID(res.sender), res.body);
+    node.busy = false;
+    node.running.second.clear();
+    --num_remains_;
+    Dispatch();
+    cond_.notify_all();
+  }
+
+  /** \brief the scheduler checks the heartbeats of the nodes every second */
+  void Watchdog() {
+    std::unique_lock<std::mutex> lk(mu_);
+    while (!done_) {
+      lk.unlock();
+      auto ids = ps::Postoffice::Get()->GetDeadNodes(param_.node_timeout);
+      std::unordered_set<int> dead(ids.begin(), ids.end());
+      lk.lock();
+      bool changed = false;
+      for (auto& it : nodes_) {
+        Node& node = it.second;
+        bool is_dead = dead.count(it.first) > 0;
+        if (is_dead == node.dead) continue;
+        node.dead = is_dead;
+        changed = true;
+        if (!is_dead) {
+          LOG(WARNING) << "node " << ToNodeID(it.first) << " rejoined";
+          continue;
+        }
+        node.died = true;
+        int id = ToNodeID(it.first);
+        LOG(WARNING) << "node " << id << " is dead, no heartbeat in "
+                     << param_.node_timeout << " sec";
+        CHECK_EQ(GroupOf(it.first), NodeID::kWorkerGroup)
+            << "server " << id << " is dead with its part of the model, "
+            << "restart from the last checkpoint";
+        bool node_job = node.busy && !NodeID::IsGroup(node.running.first);
+        CHECK(node.jobs.empty() && !node_job)
+            << "node " << id << " is dead with jobs sent to it, which need "
+            << "its state, restart from the last checkpoint";
+        if (!node.busy) continue;
+        // put the running job back to the group queue
+        group_jobs_.push_front(std::move(node.running));
+        node.busy = false;
+        node.ts = -1;
+      }
+      if (changed) Dispatch();
+      cond_.wait_for(lk, std::chrono::seconds(1), [this] { return done_; });
+    }
+  }
+
+  /** \brief an executor receives a job */
+  void OnRequest(const ps::SimpleData& req, ps::SimpleApp* app) {
+    if (req.head == kStop) {
+      app->Response(req);
+      {
+        std::lock_guard<std::mutex> lk(mu_);
+        stopped_ = true;
+      }
+      cond_.notify_all();
+      return;
+    }
+    Executor executor;
+    {
+      // the job may arrive before the executor is set
+      std::unique_lock<std::mutex> lk(mu_);
+      cond_.wait(lk, [this] { return executor_ != nullptr; });
+      executor = executor_;
+    }
+    std::string rets;
+    executor(req.body, &rets);
+    app->Response(req, rets);
+  }
+
+  /** \brief returns the group of a ps-lite node id */
+  static int GroupOf(int ps_id) {
+    return ps_id % 2 ? NodeID::kWorkerGroup : NodeID::kServerGroup;
+  }
+
+  /** \brief convert a ps-lite node id into a difacto node id */
+  static int ToNodeID(int ps_id) {
+    return NodeID::Encode(GroupOf(ps_id), ps::Postoffice::IDtoRank(ps_id));
+  }
+
+  /** \brief convert a difacto node id into a ps-lite node id */
+  static int ToPSID(int node_id) {
+    int rank = NodeID::GetRank(node_id);
+    int group = NodeID::GetGroup(node_id);
+    if (group == NodeID::kWorkerGroup) {
+      return ps::Postoffice::WorkerRankToID(rank);
+    } else if (group == NodeID::kServerGroup) {
+      return ps::Postoffice::ServerRankToID(rank);
+    }
+    LOG(FATAL) << "cannot send a job to node " << node_id;
+    return 0;
+  }
+
+  DistTrackerParam param_;
+  ps::SimpleApp* app_ = nullptr;
+  std::mutex mu_;
+  std::condition_variable cond_;
+  // on the scheduler
+  std::unordered_map<int, Node> nodes_;
+  std::deque<std::pair<int, std::string>> group_jobs_;
+  int num_remains_ = 0;
+  Monitor monitor_;
+  std::thread watchdog_;
+  bool done_ = false;
+  // on an executor
+  Executor executor_;
+  bool stopped_ = false;
 };
 }  // namespace difacto
 #endif  // DIFACTO_TRACKER_DIST_TRACKER_H_
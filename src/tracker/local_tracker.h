@@ -30,10 +30,19 @@ class LocalTracker : public Tracker {
     tracker_->Issue(jobs);
   }
 
+  void Broadcast(int node_group, const std::string& args) override {
+    // all groups are the same process
+    Issue({std::make_pair(node_group, args)});
+  }
+
   int NumRemains() override {
     return CHECK_NOTNULL(tracker_)->NumRemains();
   }
 
+  void WaitRemains(int num_remains) override {
+    CHECK_NOTNULL(tracker_)->Wait(num_remains);
+  }
+
   void Clear() override {
     CHECK_NOTNULL(tracker_)->Clear();
   }
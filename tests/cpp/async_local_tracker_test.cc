@@ -0,0 +1,47 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "tracker/async_local_tracker.h"
+
+using namespace difacto;
+
+TEST(AsyncLocalTracker, Submit) {
+  AsyncLocalTracker<int, int> tracker;
+  tracker.SetExecutor([](int args, const std::function<void()>& on_complete,
+                         int* rets) {
+      *rets = args * 2;
+      on_complete();
+    });
+  std::vector<std::future<int>> futs;
+  for (int i = 0; i < 100; ++i) futs.push_back(tracker.Submit(i));
+  for (int i = 0; i < 100; ++i) EXPECT_EQ(futs[i].get(), i * 2);
+  EXPECT_EQ(tracker.NumRemains(), 0);
+}
+
+TEST(AsyncLocalTracker, Wait) {
+  // the jobs are completed by other threads, as the store's callbacks are
+  AsyncLocalTracker<int, int> tracker;
+  std::vector<std::thread> threads;
+  std::atomic<int> done{0};
+  tracker.SetExecutor([&threads, &done](
+      int args, const std::function<void()>& on_complete, int* rets) {
+      threads.push_back(std::thread([on_complete, &done]() {
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+          ++done;
+          on_complete();
+        }));
+    });
+  int n = 20;
+  for (int i = 0; i < n; ++i) {
+    tracker.Wait(1);
+    EXPECT_GE(done, i - 1);
+    tracker.Issue({i});
+  }
+  tracker.Wait();
+  EXPECT_EQ(done, n);
+  for (auto& t : threads) t.join();
+}
@@ -29,18 +29,46 @@ TEST(BatchReader, Read) {
 }
 
 TEST(BatchReader, RandRead) {
-  BatchReader reader("../tests/data", "libsvm", 0, 1, batch_size, batch_size);
+  // the examples are shuffled across the batches in the buffer, rather than
+  // within a batch as before, so the sums of a batch change and only the
+  // totals are kept. the batches of a seed are checked by RandReadSeed
+  BatchReader reader("../tests/data", "libsvm", 0, 1, batch_size, 1);
   int i = 0;
+  double ttl_label = 0, ttl_idx = 0, ttl_val = 0;
+  bool shuffled = false;
   while (reader.Next()) {
     auto batch = reader.Value();
     int size = batch.size;
-    EXPECT_EQ(label[i], sum(batch.label, size));
     EXPECT_EQ(len[i], size);
-    EXPECT_NE(os[i], norm1(batch.offset, size+1));
-    EXPECT_EQ(idx[i], norm1(batch.index, batch.offset[size]));
-    EXPECT_LE(fabs(val[i] - norm2(batch.value, batch.offset[size])), 1e-5);
+    ttl_label += sum(batch.label, size);
+    ttl_idx += norm1(batch.index, batch.offset[size]);
+    ttl_val += norm2(batch.value, batch.offset[size]);
+    if (os[i] != norm1(batch.offset, size+1)) shuffled = true;
     ++i;
   }
+  EXPECT_EQ(3, i);
+  EXPECT_TRUE(shuffled);
+  EXPECT_EQ(label[0] + label[1] + label[2], ttl_label);
+  EXPECT_EQ(static_cast<double>(idx[0]) + idx[1] + idx[2], ttl_idx);
+  EXPECT_LE(fabs(val[0] + val[1] + val[2] - ttl_val), 1e-4);
+}
+
+TEST(BatchReader, RandReadSeed) {
+  // the same seed gives the same batches
+  std::vector<size_t> os2[2];
+  std::vector<double> label2[2];
+  for (int k = 0; k < 2; ++k) {
+    BatchReader reader("../tests/data", "libsvm", 0, 1, batch_size, 1, 1, 3);
+    while (reader.Next()) {
+      auto batch = reader.Value();
+      int size = batch.size;
+      os2[k].push_back(norm1(batch.offset, size+1));
+      label2[k].push_back(sum(batch.label, size));
+    }
+  }
+  EXPECT_EQ(3U, os2[0].size());
+  EXPECT_EQ(os2[0], os2[1]);
+  EXPECT_EQ(label2[0], label2[1]);
 }
 
 TEST(BatchReader, PartRead) {
@@ -55,3 +83,33 @@ TEST(BatchReader, PartRead) {
   CHECK_LE(ttl, 60);
   CHECK_GE(ttl, 40);
 }
+
+TEST(BatchReader, NegSampling) {
+  // the picked negatives are weighted by 1 / neg_sampling, and the same seed
+  // picks the same examples
+  for (float shuffle : {0, 1}) {
+    std::vector<real_t> weights[2];
+    for (int k = 0; k < 2; ++k) {
+      BatchReader reader("../tests/data", "libsvm", 0, 1, batch_size, shuffle,
+                         .25, 7);
+      int npos = 0;
+      while (reader.Next()) {
+        auto batch = reader.Value();
+        ASSERT_TRUE(batch.weight != nullptr);
+        for (size_t i = 0; i < batch.size; ++i) {
+          EXPECT_EQ(batch.weight[i], batch.label[i] > 0 ? 1 : 4);
+          weights[k].push_back(batch.weight[i]);
+          npos += batch.label[i] > 0;
+        }
+      }
+      // all positives are kept, the labels are +1 or -1
+      EXPECT_EQ(npos, (100 + label[0] + label[1] + label[2]) / 2);
+      EXPECT_LT(weights[k].size(), 100);
+    }
+    EXPECT_EQ(weights[0], weights[1]);
+  }
+  // not weighted
+  BatchReader reader("../tests/data", "libsvm", 0, 1, batch_size, 0, .25, 7,
+                     1, false);
+  while (reader.Next()) EXPECT_TRUE(reader.Value().weight == nullptr);
+}
@@ -2,6 +2,7 @@
  *  Copyright (c) 2015 by Contributors
  */
 #include <gtest/gtest.h>
+#include <cmath>
 #include "bcd/bcd_learner.h"
 
 using namespace difacto;
@@ -64,3 +65,184 @@ TEST(BCDLearer, Convergence) {
     EXPECT_LT(fabs(objv - 15.884923)/objv, 1e-3);
   }
 }
+
+TEST(BCDLearer, DataCache) {
+  // keep the tiles in files, either mapped or with a tiny memory capacity,
+  // and pack the tiles
+  std::vector<KWArgs> caches = {{{"data_cache_mmap", "1"}},
+                                {{"data_cache_mem_mb", ".01"}},
+                                {{"tile_compress", "1"}},
+                                {{"tile_compress", "2"},
+                                 {"data_cache_mmap", "1"}}};
+  for (const auto& cache : caches) {
+    real_t objv;
+    BCDLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"l1", ".1"},
+                   {"lr", ".8"},
+                   {"block_ratio", "1"},
+                   {"tail_feature_filter", "0"},
+                   {"max_num_epochs", "50"}};
+    args.insert(args.end(), cache.begin(), cache.end());
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+
+    auto callback = [&objv](int epoch, const std::vector<real_t>& prog) {
+      objv = prog[1];
+    };
+    learner.AddEpochEndCallback(callback);
+    learner.Run();
+
+    EXPECT_LT(fabs(objv - 15.884923)/objv, 1e-3);
+  }
+}
+
+TEST(BCDLearer, DataParts) {
+  // the sub-partitions read concurrently give the same model
+  real_t objv;
+  BCDLearner learner;
+  KWArgs args = {{"data_in", "../tests/data"},
+                 {"l1", ".1"},
+                 {"lr", ".8"},
+                 {"block_ratio", "1"},
+                 {"num_data_parts", "3"},
+                 {"tail_feature_filter", "0"},
+                 {"max_num_epochs", "50"}};
+  auto remain = learner.Init(args);
+  EXPECT_EQ(remain.size(), 0);
+
+  auto callback = [&objv](int epoch, const std::vector<real_t>& prog) {
+    objv = prog[1];
+  };
+  learner.AddEpochEndCallback(callback);
+  learner.Run();
+
+  EXPECT_LT(fabs(objv - 15.884923)/objv, 1e-3);
+}
+
+TEST(BCDLearer, Tau) {
+  for (int tau : {1, 4}) {
+    real_t objv;
+    BCDLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"l1", ".1"},
+                   {"lr", ".8"},
+                   {"block_ratio", "10"},
+                   {"tau", std::to_string(tau)},
+                   {"tail_feature_filter", "0"},
+                   {"max_num_epochs", "50"}};
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+
+    auto callback = [&objv](int epoch, const std::vector<real_t>& prog) {
+      objv = prog[1];
+    };
+    learner.AddEpochEndCallback(callback);
+    learner.Run();
+
+    EXPECT_LT(fabs(objv - 15.884923)/objv, 1e-3);
+  }
+}
+
+TEST(BCDLearer, ActiveSet) {
+  for (int interval : {2, 5}) {
+    real_t objv;
+    BCDLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"l1", ".1"},
+                   {"lr", ".8"},
+                   {"block_ratio", "10"},
+                   {"active_set_interval", std::to_string(interval)},
+                   {"tail_feature_filter", "0"},
+                   {"max_num_epochs", "50"}};
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+
+    auto callback = [&objv](int epoch, const std::vector<real_t>& prog) {
+      objv = prog[1];
+    };
+    learner.AddEpochEndCallback(callback);
+    learner.Run();
+
+    EXPECT_LT(fabs(objv - 15.884923)/objv, 1e-3);
+  }
+}
+
+TEST(BCDLearer, BlockPriority) {
+  // order the blocks by the decrease, and divide them by the tile size
+  std::vector<KWArgs> opts = {{{"block_priority", "1"}},
+                              {{"block_tile_mb", ".0002"}}};
+  for (const auto& opt : opts) {
+    real_t objv;
+    BCDLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"l1", ".1"},
+                   {"lr", ".8"},
+                   {"block_ratio", "1"},
+                   {"tail_feature_filter", "0"},
+                   {"max_num_epochs", "50"}};
+    args.insert(args.end(), opt.begin(), opt.end());
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+
+    auto callback = [&objv](int epoch, const std::vector<real_t>& prog) {
+      objv = prog[1];
+    };
+    learner.AddEpochEndCallback(callback);
+    learner.Run();
+
+    EXPECT_LT(fabs(objv - 15.884923)/objv, 1e-3);
+  }
+}
+
+TEST(BCDLearer, FM) {
+  real_t objv = 0, first = 0;
+  BCDLearner learner;
+  KWArgs args = {{"data_in", "../tests/data"},
+                 {"l1", ".1"},
+                 {"lr", ".8"},
+                 {"V_dim", "2"},
+                 {"V_l2", ".1"},
+                 {"V_lr", ".8"},
+                 {"tail_feature_filter", "0"},
+                 {"max_num_epochs", "50"}};
+  auto remain = learner.Init(args);
+  EXPECT_EQ(remain.size(), 0);
+
+  auto callback = [&objv, &first](int epoch, const std::vector<real_t>& prog) {
+    if (epoch == 0) first = prog[1];
+    objv = prog[1];
+  };
+  learner.AddEpochEndCallback(callback);
+  learner.Run();
+  EXPECT_TRUE(std::isfinite(objv));
+  EXPECT_LT(objv, first);
+  // the embeddings fit better than the optimal linear model
+  EXPECT_LT(objv, 15.884923);
+}
+
+TEST(BCDLearer, FeaCountSketch) {
+  // a large sketch rarely collides, so it filters the same tail features as
+  // the exact counts
+  std::vector<real_t> objv(2);
+  for (int i = 0; i < 2; ++i) {
+    BCDLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"l1", ".1"},
+                   {"lr", ".8"},
+                   {"block_ratio", "1"},
+                   {"tail_feature_filter", "2"},
+                   {"feacnt_sketch_mb", i ? "1" : "0"},
+                   {"max_num_epochs", "20"}};
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+
+    real_t* ret = &objv[i];
+    auto callback = [ret](int epoch, const std::vector<real_t>& prog) {
+      *ret = prog[1];
+    };
+    learner.AddEpochEndCallback(callback);
+    learner.Run();
+  }
+  EXPECT_LT(fabs(objv[0] - objv[1]) / objv[0], 1e-3);
+}
@@ -0,0 +1,74 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <random>
+#include "bcd/bcd_utils.h"
+
+using namespace difacto;
+
+TEST(BCDUtils, Bucket) {
+  for (int nbits : {0, 4, 8}) {
+    bcd::FeaGroupStats stats(nbits);
+    int nb = bcd::FeaGroupStats::NumBuckets(nbits);
+    std::mt19937_64 rnd(nbits);
+    for (int i = 0; i < 10000; ++i) {
+      feaid_t x = rnd() >> (rnd() % 64);
+      int b = stats.Bucket(x);
+      EXPECT_GE(b, 0);
+      EXPECT_LT(b, nb);
+      // x is in [begin of b, begin of b+1)
+      EXPECT_LE(bcd::FeaGroupStats::BucketBegin(b, nbits), x);
+      if (b + 1 < nb) EXPECT_GT(bcd::FeaGroupStats::BucketBegin(b+1, nbits), x);
+      EXPECT_LE(stats.Bucket(x / 2), b);
+    }
+  }
+}
+
+TEST(BCDUtils, PartitionFeature) {
+  // a few frequent features and many rare ones
+  int n = 10000;
+  std::mt19937_64 rnd(0);
+  std::vector<feaid_t> ids(n);
+  std::vector<int> cnt(n);
+  std::vector<size_t> offset = {0};
+  std::vector<feaid_t> index;
+  for (int i = 0; i < n; ++i) {
+    ids[i] = rnd();
+    cnt[i] = 1 + 20000 / (i + 1);
+    for (int k = 0; k < cnt[i]; ++k) index.push_back(ids[i]);
+  }
+  offset.push_back(index.size());
+  dmlc::RowBlock<feaid_t> blk;
+  blk.size = 1;
+  blk.offset = offset.data();
+  blk.index = index.data();
+  blk.label = nullptr;
+  blk.weight = nullptr;
+  blk.value = nullptr;
+
+  bcd::FeaGroupStats stats(0);
+  stats.Add(blk);
+  std::vector<real_t> value;
+  stats.Get(&value);
+  EXPECT_EQ(value[0], index.size());
+
+  int nblk = 8;
+  std::vector<Range> feablks;
+  bcd::PartitionFeature(0, {{0, nblk}}, value.data() + 4, &feablks);
+  EXPECT_EQ(feablks.size(), nblk);
+  std::vector<real_t> nnz(feablks.size());
+  for (int i = 0; i < n; ++i) {
+    feaid_t id = ReverseBytes(ids[i]);
+    for (size_t j = 0; j < feablks.size(); ++j) {
+      if (feablks[j].Has(id)) nnz[j] += cnt[i];
+    }
+  }
+  real_t avg = static_cast<real_t>(index.size()) / nblk;
+  for (size_t j = 0; j < feablks.size(); ++j) {
+    if (j) EXPECT_EQ(feablks[j-1].end, feablks[j].begin);
+    // the most frequent feature has 20001 of the 201k nnz
+    EXPECT_LT(nnz[j], 20001 + avg);
+    EXPECT_GT(nnz[j], avg / 4);
+  }
+}
@@ -0,0 +1,5 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include "benchmark/benchmark.h"
+BENCHMARK_MAIN();
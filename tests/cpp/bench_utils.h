@@ -0,0 +1,113 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef TESTS_CPP_BENCH_UTILS_H_
+#define TESTS_CPP_BENCH_UTILS_H_
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <random>
+#include <vector>
+#include "dmlc/data.h"
+#include "difacto/base.h"
+#include "common/perf_counters.h"
+#include "data/localizer.h"
+namespace difacto {
+
+/**
+ * \brief a synthetic dataset, the feature ids follow a power law as the ones
+ * of CTR data, a few features appear in most examples and most features
+ * appear once or twice
+ */
+struct BenchData {
+  /** \brief the examples with the original ids */
+  dmlc::data::RowBlockContainer<feaid_t> raw;
+  /** \brief the examples localized by \ref Localizer */
+  dmlc::data::RowBlockContainer<unsigned> local;
+  /** \brief the sorted unique ids of local */
+  std::vector<feaid_t> uniq;
+};
+
+/**
+ * \brief generate nrows examples with nnz_per_row features each
+ *
+ * the rank r feature shows up with probability proportional to 1 / r^alpha
+ * among num_feas features, and the ranks are scattered into the 64-bit id
+ * space. the labels are +1 and -1 with equal probability
+ */
+inline void gen_power_law_data(size_t nrows, int nnz_per_row, size_t num_feas,
+                               real_t alpha, unsigned seed, BenchData* data) {
+  std::vector<double> cdf(num_feas);
+  double sum = 0;
+  for (size_t r = 0; r < num_feas; ++r) {
+    sum += 1 / std::pow(static_cast<double>(r + 1), alpha);
+    cdf[r] = sum;
+  }
+  std::mt19937_64 rng(seed);
+  std::uniform_real_distribution<double> uniform(0, sum);
+  auto& raw = data->raw;
+  raw.Clear();
+  raw.offset.push_back(0);
+  std::vector<feaid_t> row;
+  for (size_t i = 0; i < nrows; ++i) {
+    row.clear();
+    for (int j = 0; j < nnz_per_row; ++j) {
+      size_t r = std::lower_bound(cdf.begin(), cdf.end(), uniform(rng)) -
+                 cdf.begin();
+      row.push_back((r + 1) * 0x9E3779B97F4A7C15ULL);
+    }
+    std::sort(row.begin(), row.end());
+    row.erase(std::unique(row.begin(), row.end()), row.end());
+    raw.index.insert(raw.index.end(), row.begin(), row.end());
+    raw.offset.push_back(raw.index.size());
+    raw.label.push_back(rng() % 2 ? 1 : -1);
+  }
+  Localizer lc;
+  lc.Compact(raw.GetBlock(), &data->local, &data->uniq);
+}
+
+/**
+ * \brief returns a dataset with nrows examples of 40 features each, drawn
+ * from 1M features with alpha = 1.1. it is generated once and then cached
+ */
+inline const BenchData& GetBenchData(size_t nrows) {
+  static std::map<size_t, std::unique_ptr<BenchData>> cache;
+  auto& data = cache[nrows];
+  if (!data) {
+    data.reset(new BenchData());
+    gen_power_law_data(nrows, 40, 1 << 20, 1.1, 0, data.get());
+  }
+  return *data;
+}
+
+/**
+ * \brief reports the hardware events of the benchmark thread since the
+ * construction: the IPC, the GB/s read from the memory, and the LLC and dTLB
+ * misses per item. nothing is reported if \ref PerfCounters is not available.
+ * the worker threads of a multi-threaded kernel are not counted
+ */
+class PerfReport {
+ public:
+  PerfReport() : start_(PerfCounters::ThisThread().Read()) { }
+
+  /** \brief items is the number of items processed by an iteration */
+  void Set(benchmark::State& state, size_t items) const {
+    if (!PerfCounters::ThisThread().Available()) return;
+    auto d = PerfCounters::ThisThread().Read().Since(start_);
+    double n = static_cast<double>(items) * state.iterations();
+    state.counters["ipc"] = d.IPC();
+    state.counters["GB/s"] = benchmark::Counter(
+        d.Bytes() * 1e-9, benchmark::Counter::kIsRate);
+    state.counters["llc_miss_per_item"] = d.count[PerfCounts::kLLCMisses] / n;
+    state.counters["dtlb_miss_per_item"] =
+        d.count[PerfCounts::kDTLBMisses] / n;
+  }
+
+ private:
+  PerfCounts start_;
+};
+
+}  // namespace difacto
+#endif  // TESTS_CPP_BENCH_UTILS_H_
@@ -0,0 +1,147 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "dmlc/memory_io.h"
+#include "./utils.h"
+#include "loss/bin_class_metric.h"
+
+using namespace difacto;
+
+TEST(AUCHistogram, AUC) {
+  size_t n = 10000;
+  SArray<real_t> pred, noise;
+  gen_vals(n, -3, 3, &pred);
+  gen_vals(n, -2, 2, &noise);
+  std::vector<dmlc::real_t> label(n);
+  for (size_t i = 0; i < n; ++i) label[i] = pred[i] + noise[i] > 0 ? 1 : -1;
+
+  // the sorted auc, which is flipped to be at least .5 and scaled by n
+  BinClassMetric metric(label.data(), pred.data(), n);
+  real_t auc = metric.AUC() / n;
+
+  int num_bins = 256;
+  std::vector<double> hist(2 * num_bins);
+  AUCHistogram::Add(label.data(), pred.data(), n, num_bins, hist.data());
+  EXPECT_LT(fabs(AUCHistogram::AUC(hist.data(), num_bins) - auc), 1e-3);
+
+  // merge two halves
+  std::vector<double> hist2(2 * num_bins);
+  AUCHistogram::Add(label.data(), pred.data(), n / 2, num_bins, hist2.data());
+  std::vector<double> hist3(2 * num_bins);
+  AUCHistogram::Add(label.data() + n / 2, pred.data() + n / 2, n - n / 2,
+                    num_bins, hist3.data());
+  for (int i = 0; i < 2 * num_bins; ++i) hist2[i] += hist3[i];
+  EXPECT_EQ(AUCHistogram::AUC(hist.data(), num_bins),
+            AUCHistogram::AUC(hist2.data(), num_bins));
+}
+
+TEST(AUCHistogram, LowCTR) {
+  // the sigmoids of the predictions are in [1e-4, 7e-3]
+  size_t n = 10000;
+  SArray<real_t> pred, noise;
+  gen_vals(n, -9, -5, &pred);
+  gen_vals(n, -1, 1, &noise);
+  std::vector<dmlc::real_t> label(n);
+  for (size_t i = 0; i < n; ++i) label[i] = pred[i] + noise[i] > -6 ? 1 : -1;
+
+  BinClassMetric metric(label.data(), pred.data(), n);
+  int num_bins = 1024;
+  std::vector<double> hist(2 * num_bins);
+  AUCHistogram::Add(label.data(), pred.data(), n, num_bins, hist.data());
+  EXPECT_LT(fabs(AUCHistogram::AUC(hist.data(), num_bins) -
+                 metric.AUC() / n), 1e-3);
+}
+
+TEST(BinClassStats, OnePass) {
+  size_t n = 100000;
+  SArray<real_t> pred, noise;
+  gen_vals(n, -3, 3, &pred);
+  gen_vals(n, -2, 2, &noise);
+  std::vector<dmlc::real_t> label(n);
+  for (size_t i = 0; i < n; ++i) label[i] = pred[i] + noise[i] > 0 ? 1 : -1;
+
+  BinClassMetric metric(label.data(), pred.data(), n);
+  real_t pos = 0, prob = 0, sq = 0;
+  for (size_t i = 0; i < n; ++i) {
+    real_t y = label[i] > 0, p = 1 / (1 + exp(-pred[i]));
+    pos += y; prob += p; sq += (p - y) * (p - y);
+  }
+
+  // single and multiple threads, and two merged halves
+  BinClassStats one, multi, half, half2;
+  one.Add(label.data(), pred.data(), n);
+  multi.Add(label.data(), pred.data(), n, BinClassStats::kMaxAUCBins, 0, 4);
+  half.Add(label.data(), pred.data(), n / 2);
+  half2.Add(label.data() + n / 2, pred.data() + n / 2, n - n / 2);
+  half.Merge(half2);
+  for (const auto& s : {one, multi, half}) {
+    EXPECT_EQ(s.count, n);
+    EXPECT_EQ(s.num_pos, pos);
+    EXPECT_LT(fabs(s.objv - metric.LogitObjv()) / s.objv, 1e-4);
+    EXPECT_EQ(s.correct, metric.Accuracy(0));
+    EXPECT_LT(fabs(s.COPC() - pos / prob), 1e-3);
+    EXPECT_LT(fabs(s.RMSE() - sqrt(sq / n)), 1e-3);
+    EXPECT_LT(fabs(s.AUC() - metric.AUC() / n), 1e-3);
+  }
+  EXPECT_EQ(one.AUC(), multi.AUC());
+}
+
+TEST(BinClassStats, Weight) {
+  std::vector<dmlc::real_t> label = {1, -1, 1, -1}, weight = {2, 3, 1, 1};
+  std::vector<real_t> pred = {.5, -1, -.2, .3};
+  // the examples repeated by their weights
+  std::vector<dmlc::real_t> label2;
+  std::vector<real_t> pred2;
+  for (size_t i = 0; i < label.size(); ++i) {
+    for (int k = 0; k < weight[i]; ++k) {
+      label2.push_back(label[i]);
+      pred2.push_back(pred[i]);
+    }
+  }
+  BinClassStats a, b;
+  a.Add(label.data(), pred.data(), label.size(), 64, 0, 1, weight.data());
+  b.Add(label2.data(), pred2.data(), label2.size(), 64);
+  EXPECT_EQ(a.count, b.count);
+  EXPECT_NEAR(a.objv, b.objv, 1e-5);
+  EXPECT_EQ(a.correct, b.correct);
+  EXPECT_NEAR(a.AUC(), b.AUC(), 1e-6);
+  EXPECT_NEAR(a.RMSE(), b.RMSE(), 1e-6);
+}
+
+TEST(BinClassStats, Count) {
+  // a float stops counting at 2^24
+  std::vector<dmlc::real_t> label = {1, -1}, weight = {1 << 24, 1};
+  std::vector<real_t> pred = {1, -1};
+  BinClassStats a, b;
+  a.Add(label.data(), pred.data(), 1, 64, 0, 1, weight.data());
+  for (int i = 0; i < 3; ++i) {
+    b.Add(label.data() + 1, pred.data() + 1, 1, 64, 0, 1, weight.data() + 1);
+  }
+  a.Merge(b);
+  EXPECT_EQ(a.count, (1 << 24) + 3);
+  EXPECT_EQ(a.num_pos, 1 << 24);
+  EXPECT_EQ(a.correct, (1 << 24) + 3);
+}
+
+TEST(BinClassStats, SaveLoad) {
+  std::vector<dmlc::real_t> label = {1, -1, 1, -1};
+  std::vector<real_t> pred = {.5, -1, -.2, .3};
+  BinClassStats a, b;
+  a.Add(label.data(), pred.data(), label.size());
+  std::string str;
+  dmlc::MemoryStringStream fo(&str);
+  a.Save(&fo);
+  // only the nonzero bins are written
+  EXPECT_LT(str.size(), 200U);
+  dmlc::MemoryStringStream fi(&str);
+  b.Load(&fi);
+  EXPECT_EQ(a.count, b.count);
+  EXPECT_EQ(a.objv, b.objv);
+  EXPECT_EQ(a.correct, b.correct);
+  EXPECT_EQ(a.AUC(), b.AUC());
+  EXPECT_EQ(memcmp(a.auc_hist, b.auc_hist, sizeof(a.auc_hist)), 0);
+}
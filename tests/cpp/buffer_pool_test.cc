@@ -0,0 +1,35 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include "common/buffer_pool.h"
+
+using namespace difacto;
+
+TEST(BufferPool, Reuse) {
+  BufferPool pool(1024);
+  const float* p;
+  {
+    SArray<float> a = pool.New<float>(100, 1);
+    ASSERT_EQ(a.size(), 100);
+    EXPECT_EQ(a[99], 1);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(a.data()) % 64, 0);
+    p = a.data();
+    SArray<float> b = a;  // a copy keeps the buffer
+  }
+  // 400 bytes are in the class of 512 bytes
+  EXPECT_EQ(pool.cached_bytes(), 512);
+  {
+    SArray<int> c = pool.New<int>(120);
+    EXPECT_EQ(reinterpret_cast<const void*>(c.data()),
+              reinterpret_cast<const void*>(p));
+    EXPECT_EQ(pool.cached_bytes(), 0);
+    // larger than the cache, so it is freed
+    SArray<char> d = pool.New<char>(2000);
+  }
+  EXPECT_EQ(pool.cached_bytes(), 512);
+  pool.Clear();
+  EXPECT_EQ(pool.cached_bytes(), 0);
+  EXPECT_EQ(pool.New<int>(0).size(), 0);
+}
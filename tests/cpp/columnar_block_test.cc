@@ -0,0 +1,139 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <random>
+#include <utility>
+#include <vector>
+#include "data/columnar_block.h"
+#include "data/localizer.h"
+#include "common/spmt.h"
+#include "reader/columnar_parser.h"
+
+using namespace difacto;
+
+/** \brief rows with features of 4 bits group ids, some values are not 1 */
+static void GenBlock(dmlc::data::RowBlockContainer<feaid_t>* blk) {
+  std::mt19937 rng(0);
+  blk->Clear();
+  for (int i = 0; i < 200; ++i) {
+    blk->label.push_back(i % 3 == 0 ? 1 : -1);
+    int n = rng() % 10;
+    for (int j = 0; j < n; ++j) {
+      blk->index.push_back(EncodeFeaGrpID(rng() % 50, rng() % 5, 4));
+      blk->value.push_back(rng() % 4 ? 1 : .5);
+    }
+    blk->offset.push_back(blk->index.size());
+  }
+}
+
+/** \brief the sorted (id, value) pairs of row i */
+static std::vector<std::pair<feaid_t, real_t>> Row(
+    const dmlc::RowBlock<feaid_t>& blk, size_t i) {
+  std::vector<std::pair<feaid_t, real_t>> row;
+  for (size_t j = blk.offset[i]; j < blk.offset[i+1]; ++j) {
+    row.push_back(std::make_pair(blk.index[j], blk.value ? blk.value[j] : 1));
+  }
+  std::sort(row.begin(), row.end());
+  return row;
+}
+
+TEST(ColumnarBlock, Rows) {
+  dmlc::data::RowBlockContainer<feaid_t> in;
+  GenBlock(&in);
+  auto A = in.GetBlock();
+  std::string str;
+  ColumnarBlock cb;
+  cb.Compress(A, 4, 100, &str);
+
+  ColumnarFooter footer;
+  cb.ReadFooter(str.data(), str.size(), &footer);
+  EXPECT_EQ(footer.first_row, 100);
+  EXPECT_EQ(footer.nrows, A.size);
+  EXPECT_EQ(footer.nnz, A.offset[A.size]);
+  EXPECT_EQ(footer.label_min, -1);
+  EXPECT_EQ(footer.label_max, 1);
+  ASSERT_EQ(footer.fields.size(), 5);
+  for (int k = 0; k < 5; ++k) {
+    const auto& f = footer.fields[k];
+    EXPECT_EQ(f.id, k);
+    EXPECT_EQ(DecodeFeaGrpID(f.min_id, 4), k);
+    EXPECT_LE(f.min_id, f.max_id);
+  }
+
+  std::vector<int> all = {0, 1, 2, 3, 4};
+  dmlc::data::RowBlockContainer<feaid_t> out;
+  cb.Decompress(str.data(), str.size(), footer, all, &out);
+  auto B = out.GetBlock();
+  ASSERT_EQ(B.size, A.size);
+  for (size_t i = 0; i < A.size; ++i) {
+    EXPECT_EQ(A.label[i], B.label[i]);
+    EXPECT_EQ(Row(A, i), Row(B, i));
+  }
+
+  // only fields 1 and 3
+  std::vector<int> some = {1, 3};
+  cb.Decompress(str.data(), str.size(), footer, some, &out);
+  B = out.GetBlock();
+  ASSERT_EQ(B.size, A.size);
+  for (size_t i = 0; i < A.size; ++i) {
+    auto a = Row(A, i);
+    std::vector<std::pair<feaid_t, real_t>> expected;
+    for (const auto& e : a) {
+      int gid = DecodeFeaGrpID(e.first, 4);
+      if (gid == 1 || gid == 3) expected.push_back(e);
+    }
+    EXPECT_EQ(expected, Row(B, i));
+  }
+}
+
+TEST(ColumnarBlock, Transposed) {
+  dmlc::data::RowBlockContainer<feaid_t> in;
+  GenBlock(&in);
+  auto A = in.GetBlock();
+  std::string str;
+  ColumnarBlock cb;
+  cb.Compress(A, 4, 0, &str);
+  ColumnarFooter footer;
+  cb.ReadFooter(str.data(), str.size(), &footer);
+  ColumnarTile tile;
+  cb.Decompress(str.data(), str.size(), footer, {0, 1, 2, 3, 4}, &tile);
+
+  // the same as what the tile builder does
+  dmlc::data::RowBlockContainer<unsigned> compacted, transposed;
+  std::vector<feaid_t> ids;
+  std::vector<real_t> cnts;
+  Localizer(-1, 2).Compact(A, &compacted, &ids, &cnts);
+  SpMT::Transpose(compacted.GetBlock(), &transposed, ids.size(), 2);
+  EXPECT_EQ(tile.ids, ids);
+  EXPECT_EQ(tile.cnts, cnts);
+  EXPECT_EQ(tile.data.offset, transposed.offset);
+  EXPECT_EQ(tile.data.index, transposed.index);
+  EXPECT_EQ(tile.data.value, transposed.value);
+  EXPECT_EQ(tile.label, in.label);
+}
+
+TEST(ColumnarFilter, Select) {
+  ColumnarFooter footer;
+  footer.first_row = 100;
+  footer.nrows = 50;
+  footer.fields.resize(4);
+  for (int k = 0; k < 4; ++k) footer.fields[k].id = k * 2;
+
+  ColumnarParam param;
+  param.Init(KWArgs{{"col_skip_fields", "2,6"}, {"col_row_begin", "120"}});
+  ColumnarFilter filter;
+  filter.Init(param);
+  std::vector<int> fields;
+  ASSERT_TRUE(filter.Select(footer, &fields));
+  EXPECT_EQ(fields, std::vector<int>({0, 2}));
+
+  param.Init(KWArgs{{"col_fields", "4,6"}, {"col_row_end", "100"}});
+  filter.Init(param);
+  EXPECT_FALSE(filter.Select(footer, &fields));
+  param.Init(KWArgs{{"col_fields", "4,6"}, {"col_row_end", "101"}});
+  filter.Init(param);
+  ASSERT_TRUE(filter.Select(footer, &fields));
+  EXPECT_EQ(fields, std::vector<int>({2, 3}));
+}
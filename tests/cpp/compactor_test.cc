@@ -0,0 +1,88 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include "dmlc/io.h"
+#include "difacto/scorer.h"
+#include "predict/compactor.h"
+#include "sgd/sgd_learner.h"
+#include "common/model_file.h"
+
+using namespace difacto;
+
+TEST(Compactor, Prune) {
+  ModelFile model;
+  model.V_dim = 2;
+  model.feaids = {1, 2, 3, 4};
+  model.w = {0, 0, .5, .01};
+  model.V_idx = {-1, 0, 1, -1};
+  model.V = {.1, .1, .001, 0};
+  auto out = Compactor::Prune(model, .1, .01);
+  // 1 has nothing, the V of 3 is tiny, and the w of 4 is tiny
+  ASSERT_EQ(out.feaids.size(), 2);
+  EXPECT_EQ(out.feaids[0], 2);
+  EXPECT_EQ(out.feaids[1], 3);
+  EXPECT_EQ(out.V_idx[0], 0);
+  EXPECT_EQ(out.V_idx[1], -1);
+  EXPECT_EQ(out.V.size(), 2);
+}
+
+TEST(Compactor, Run) {
+  std::string model = "/tmp/difacto_compactor_test_model";
+  std::string compact = "/tmp/difacto_compactor_test_compact";
+  {
+    SGDLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"V_dim", "4"},
+                   {"V_threshold", "2"},
+                   {"l1", "1"},
+                   {"lr", "1"},
+                   {"num_jobs_per_epoch", "1"},
+                   {"batch_size", "100"},
+                   {"max_num_epochs", "10"},
+                   {"model_out", model}};
+    learner.Init(args);
+    learner.Run();
+  }
+  Compactor compactor;
+  KWArgs args = {{"model_in", model},
+                 {"model_out", compact},
+                 {"V_int8", "1"},
+                 {"data_val", "../tests/data"}};
+  EXPECT_EQ(compactor.Init(args).size(), 0);
+  compactor.Run();
+
+  ModelFile m0, m1;
+  std::unique_ptr<dmlc::Stream> fi(dmlc::Stream::Create(model.c_str(), "r"));
+  m0.Load(fi.get());
+  fi.reset(dmlc::Stream::Create(compact.c_str(), "r"));
+  m1.Load(fi.get());
+  EXPECT_FALSE(m1.has_aux());
+  EXPECT_TRUE(m1.quantized());
+  EXPECT_LE(m1.feaids.size(), m0.feaids.size());
+  EXPECT_LT(m1.NumBytes(), m0.NumBytes());
+  // the dequantized V is within half a step
+  auto pruned = Compactor::Prune(m0, 0, 0);
+  ASSERT_EQ(m1.V.size(), pruned.V.size());
+  for (size_t i = 0; i < m1.V.size(); ++i) {
+    EXPECT_LE(fabs(m1.V[i] - pruned.V[i]),
+              m1.V_scale[i / m1.V_dim] * .5 + 1e-7);
+  }
+
+  // the int8 scorer gives nearly the same margins
+  Scorer s0, s1;
+  ASSERT_TRUE(s0.Load(model));
+  ASSERT_TRUE(s1.Load(compact));
+  EXPECT_LT(s1.MemBytes(), s0.MemBytes());
+  for (size_t i = 0; i + 3 <= m0.feaids.size(); i += 3) {
+    feaid_t index[3];
+    for (int j = 0; j < 3; ++j) index[j] = ReverseBytes(m0.feaids[i+j]);
+    EXPECT_NEAR(s0.Predict(index, nullptr, 3), s1.Predict(index, nullptr, 3),
+                1e-2);
+  }
+  remove(model.c_str());
+  remove(compact.c_str());
+}
@@ -23,3 +23,21 @@ TEST(CompressedRowBlock, Basic) {
 
   check_equal(A, B);
 }
+
+TEST(CompressedRowBlock, Reuse) {
+  // the output string and the container are reused by the converter and the
+  // parser
+  BatchReader reader("../tests/data", "libsvm", 0, 1, 37);
+  std::string out;
+  dmlc::data::RowBlockContainer<feaid_t> container;
+  int n = 0;
+  while (reader.Next()) {
+    auto A = reader.Value();
+    CompressedRowBlock().Compress(A, &out);
+    container.Clear();
+    CompressedRowBlock().Decompress(out, &container);
+    check_equal(A, container.GetBlock());
+    ++n;
+  }
+  EXPECT_GT(n, 1);
+}
@@ -0,0 +1,78 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "reader/criteo_parser.h"
+
+using namespace difacto;
+
+/** \brief parse a text into one container, with the crosses */
+static void Parse(const std::string& text, const std::string& crosses,
+                  dmlc::data::RowBlockContainer<feaid_t>* blk) {
+  std::string file = "/tmp/difacto_criteo_" + std::to_string(getpid());
+  std::ofstream(file) << text;
+  CriteoParser parser(
+      dmlc::InputSplit::Create(file.c_str(), 0, 1, "text"), true, 2, crosses);
+  blk->Clear();
+  while (parser.Next()) {
+    const auto& b = parser.Value();
+    for (size_t i = 0; i < b.size; ++i) blk->Push(b[i]);
+  }
+  std::remove(file.c_str());
+}
+
+/** \brief a line with the label, 13 integers and 26 categories */
+static std::string Line(int label, const std::string& c1,
+                        const std::string& c2) {
+  std::string line = std::to_string(label);
+  for (int i = 0; i < 13; ++i) line += "\t" + std::to_string(i);
+  line += "\t" + c1 + "\t" + c2;
+  for (int i = 2; i < 26; ++i) line += "\tc" + std::to_string(i);
+  return line + "\n";
+}
+
+TEST(CriteoParser, Cross) {
+  std::string text = Line(1, "a", "b") + Line(0, "a", "") + Line(1, "a", "b");
+  dmlc::data::RowBlockContainer<feaid_t> base, blk;
+  Parse(text, "", &base);
+  Parse(text, "13,14; 13,14,15", &blk);
+  ASSERT_EQ(blk.Size(), 3);
+  std::vector<size_t> offset = {0, 41, 79, 120};
+  EXPECT_EQ(blk.offset, offset);
+  for (size_t i = 0; i < 3; ++i) {
+    // the columns are kept, and then followed by the crosses present
+    for (size_t j = base.offset[i]; j < base.offset[i+1]; ++j) {
+      EXPECT_EQ(blk.index[blk.offset[i] + j - base.offset[i]], base.index[j]);
+    }
+  }
+  feaid_t c1 = blk.index[39], c2 = blk.index[40];
+  EXPECT_EQ(DecodeFeaGrpID(c1, 12), 39);
+  EXPECT_EQ(DecodeFeaGrpID(c2, 12), 40);
+  EXPECT_NE(c1 >> 12, c2 >> 12);
+  // the same values have the same cross ids
+  EXPECT_EQ(blk.index[118], c1);
+  EXPECT_EQ(blk.index[119], c2);
+}
+
+TEST(FeatureCross, Append) {
+  FeatureCross cross("0,1;1,0", 3, 4);
+  EXPECT_EQ(cross.Size(), 2);
+  feaid_t hashes[] = {7, 8, 9};
+  bool present[] = {true, true, false};
+  std::vector<feaid_t> index;
+  cross.Append(hashes, present, &index);
+  ASSERT_EQ(index.size(), 2);
+  // the order of the groups matters
+  EXPECT_NE(index[0] >> 4, index[1] >> 4);
+  EXPECT_EQ(DecodeFeaGrpID(index[1], 4), 4);
+  present[1] = false;
+  index.clear();
+  cross.Append(hashes, present, &index);
+  EXPECT_TRUE(index.empty());
+  EXPECT_TRUE(FeatureCross("", 3, 4).Empty());
+}
@@ -0,0 +1,176 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <benchmark/benchmark.h>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+#include "./bench_utils.h"
+#include "data/localizer.h"
+#include "data/compressed_row_block.h"
+#include "reader/reader.h"
+#include "reader/libsvm_parser.h"
+#include "data/libsvm_parser.h"
+
+using namespace difacto;
+
+namespace {
+/** \brief args are {number of rows, number of threads}, timed by wall clock */
+void RowsAndThreads(benchmark::internal::Benchmark* b) {
+  b->UseRealTime();
+  for (int nt : {1, 4}) {
+    for (int n : {1 << 14, 1 << 17}) b->Args({n, nt});
+  }
+}
+
+/**
+ * \brief the text files of the 1 << 16 rows dataset in each format, written
+ * once and removed at exit
+ */
+class TextFiles {
+ public:
+  ~TextFiles() {
+    for (const auto& f : files_) remove(f.second.c_str());
+  }
+
+  static const std::string& Get(const std::string& format) {
+    static TextFiles files;
+    auto& name = files.files_[format];
+    if (name.empty()) {
+      name = "/tmp/difacto_bench_" + format;
+      Write(format, name);
+    }
+    return name;
+  }
+
+ private:
+  static void Write(const std::string& format, const std::string& name) {
+    auto D = GetBenchData(1 << 16).raw.GetBlock();
+    std::ofstream out(name);
+    for (size_t i = 0; i < D.size; ++i) {
+      int label = D.label[i] > 0;
+      if (format == "criteo") {
+        // 13 integer and then 26 categorical fields, hashed by the parser
+        out << label;
+        size_t j = D.offset[i];
+        for (int k = 0; k < 39; ++k, ++j) {
+          out << '\t';
+          if (j >= D.offset[i+1]) continue;
+          if (k < 13) {
+            out << D.index[j] % 1000;
+          } else {
+            out << std::hex << D.index[j] << std::dec;
+          }
+        }
+      } else if (format == "adfea") {
+        // line id, count, label, and then id:group
+        out << i << " 1 " << label;
+        for (size_t j = D.offset[i]; j < D.offset[i+1]; ++j) {
+          out << ' ' << (D.index[j] >> 12) << ':' << j - D.offset[i];
+        }
+      } else {
+        out << label;
+        for (size_t j = D.offset[i]; j < D.offset[i+1]; ++j) {
+          out << ' ' << D.index[j] << ":1";
+        }
+      }
+      out << '\n';
+    }
+  }
+
+  std::map<std::string, std::string> files_;
+};
+}  // namespace
+
+static void BM_LocalizerCompact(benchmark::State& state) {
+  const auto& data = GetBenchData(state.range(0));
+  auto D = data.raw.GetBlock();
+  Localizer lc(std::numeric_limits<feaid_t>::max(), state.range(1));
+  dmlc::data::RowBlockContainer<unsigned> local;
+  std::vector<feaid_t> uniq;
+  std::vector<real_t> cnt;
+  for (auto _ : state) {
+    lc.Compact(D, &local, &uniq, &cnt);
+    benchmark::DoNotOptimize(local.index.data());
+  }
+  state.SetItemsProcessed(state.iterations() * data.raw.index.size());
+}
+BENCHMARK(BM_LocalizerCompact)->Apply(RowsAndThreads);
+
+static void BM_CompressRowBlock(benchmark::State& state) {
+  const auto& data = GetBenchData(state.range(0));
+  auto D = data.local.GetBlock();
+  std::string str;
+  for (auto _ : state) {
+    CompressedRowBlock().Compress(D, &str);
+    benchmark::DoNotOptimize(str.data());
+  }
+  state.SetBytesProcessed(state.iterations() * D.MemCostBytes());
+  state.counters["ratio"] = static_cast<double>(D.MemCostBytes()) / str.size();
+}
+BENCHMARK(BM_CompressRowBlock)->Arg(1 << 14)->Arg(1 << 17);
+
+static void BM_DecompressRowBlock(benchmark::State& state) {
+  const auto& data = GetBenchData(state.range(0));
+  auto D = data.local.GetBlock();
+  std::string str;
+  CompressedRowBlock().Compress(D, &str);
+  dmlc::data::RowBlockContainer<unsigned> blk;
+  for (auto _ : state) {
+    blk.Clear();
+    CompressedRowBlock().Decompress(str, &blk);
+    benchmark::DoNotOptimize(blk.index.data());
+  }
+  state.SetBytesProcessed(state.iterations() * D.MemCostBytes());
+}
+BENCHMARK(BM_DecompressRowBlock)->Arg(1 << 14)->Arg(1 << 17);
+
+/** \brief parse the whole file of a format, the arg is the number of threads */
+static void BM_Parse(benchmark::State& state, const char* format) {
+  const auto& file = TextFiles::Get(format);
+  size_t bytes = std::ifstream(file, std::ifstream::ate).tellg();
+  for (auto _ : state) {
+    Reader reader(file, format, 0, 1, 64 << 20, state.range(0));
+    size_t nrows = 0;
+    while (reader.Next()) nrows += reader.Value().size;
+    benchmark::DoNotOptimize(nrows);
+  }
+  state.SetBytesProcessed(state.iterations() * bytes);
+}
+BENCHMARK_CAPTURE(BM_Parse, libsvm, "libsvm")->Arg(1)->Arg(4)->UseRealTime();
+BENCHMARK_CAPTURE(BM_Parse, criteo, "criteo")->Arg(1)->Arg(4)->UseRealTime();
+BENCHMARK_CAPTURE(BM_Parse, adfea, "adfea")->Arg(1)->Arg(4)->UseRealTime();
+
+/**
+ * \brief parse the libsvm file by the parser of difacto or dmlc directly,
+ * the arg is the number of threads
+ */
+static void BM_ParseLibSVM(benchmark::State& state, bool dmlc_parser) {
+  const auto& file = TextFiles::Get("libsvm");
+  size_t bytes = std::ifstream(file, std::ifstream::ate).tellg();
+  int nthreads = state.range(0);
+  for (auto _ : state) {
+    auto input = dmlc::InputSplit::Create(file.c_str(), 0, 1, "text");
+    input->HintChunkSize(64 << 20);
+    dmlc::data::ParserImpl<feaid_t>* parser;
+    if (dmlc_parser) {
+      parser = new dmlc::data::LibSVMParser<feaid_t>(input, nthreads);
+    } else {
+      parser = new LibSVMParser(input, nthreads);
+    }
+    size_t nrows = 0;
+    while (parser->Next()) nrows += parser->Value().size;
+    benchmark::DoNotOptimize(nrows);
+    delete parser;
+  }
+  state.SetBytesProcessed(state.iterations() * bytes);
+  state.counters["bytes_per_core"] = benchmark::Counter(
+      static_cast<double>(state.iterations()) * bytes / nthreads,
+      benchmark::Counter::kIsRate);
+}
+BENCHMARK_CAPTURE(BM_ParseLibSVM, difacto, false)
+    ->Arg(1)->Arg(4)->UseRealTime();
+BENCHMARK_CAPTURE(BM_ParseLibSVM, dmlc, true)->Arg(1)->Arg(4)->UseRealTime();
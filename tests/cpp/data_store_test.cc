@@ -77,3 +77,37 @@ TEST(DataStore, Meta) {
   EXPECT_EQ(store2.size("2"), n);
   EXPECT_EQ(store2.size("3"), n);
 }
+
+TEST(DataStore, Disk) {
+  int n = 1000, k = 10;
+  // keeps about 3 arrays in memory
+  DataStore store("/tmp/difacto_test_", 3 * n * sizeof(int));
+  std::vector<SArray<int>> vals(k);
+  for (int i = 0; i < k; ++i) {
+    gen_vals(n, -100, 100, &vals[i]);
+    store.Store(std::to_string(i), vals[i]);
+  }
+
+  for (int t = 0; t < 2; ++t) {
+    for (int i = 0; i < k; ++i) {
+      if (i + 1 < k) store.Prefetch(std::to_string(i + 1));
+      SArray<int> ret;
+      store.Fetch(std::to_string(i), &ret, Range(10, 30));
+      EXPECT_EQ(norm2(vals[i].segment(10, 30)), norm2(ret));
+      store.Fetch(std::to_string(i), &ret);
+      EXPECT_EQ(norm2(vals[i]), norm2(ret));
+    }
+  }
+
+  // overwrite a key which has been written into disk
+  SArray<int> val;
+  gen_vals(n, -100, 100, &val);
+  store.Store("0", val);
+  store.Store("9", val);
+  SArray<int> ret;
+  store.Fetch("0", &ret);
+  EXPECT_EQ(norm2(val), norm2(ret));
+  store.Remove("1");
+  store.Fetch("2", &ret);
+  EXPECT_EQ(norm2(vals[2]), norm2(ret));
+}
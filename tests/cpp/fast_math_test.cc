@@ -0,0 +1,34 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <cmath>
+#include "common/fast_math.h"
+
+using namespace difacto;
+
+TEST(FastMath, ExpLog) {
+  for (real_t x = -80; x < 80; x += .0137) {
+    real_t e = std::exp(x);
+    EXPECT_LE(fabs(math::Exp(x) - e), e * 5e-7) << x;
+  }
+  for (real_t x = 1e-30; x < 1e30; x *= 1.37) {
+    EXPECT_LE(fabs(math::Log(x) - std::log(x)),
+              fabs(std::log(x)) * 5e-7 + 1e-7) << x;
+  }
+  for (real_t x = 1e-12; x <= 1; x *= 1.13) {
+    real_t l = std::log1p(x);
+    EXPECT_LE(fabs(math::Log1p(x) - l), l * 5e-7) << x;
+  }
+}
+
+TEST(FastMath, Logit) {
+  for (real_t p = -30; p < 30; p += .0731) {
+    for (real_t y : {-1.f, 1.f}) {
+      double objv = std::log1p(std::exp(- y * static_cast<double>(p)));
+      EXPECT_LE(fabs(math::LogitObjv(y, p) - objv), objv * 1e-6 + 1e-12);
+      double grad = - y / (1 + std::exp(y * static_cast<double>(p)));
+      EXPECT_LE(fabs(math::LogitGrad(y, p) - grad), fabs(grad) * 1e-6);
+    }
+  }
+}
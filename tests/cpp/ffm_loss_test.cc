@@ -0,0 +1,113 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <vector>
+#include "./utils.h"
+#include "loss/ffm_loss.h"
+#include "common/fast_math.h"
+
+using namespace difacto;
+
+namespace {
+/** \brief the pairwise O(nnz^2 k) ffm, and its gradients */
+void NaiveFFM(const dmlc::RowBlock<unsigned>& data, const SArray<real_t>& w,
+              const SArray<int>& w_pos, const SArray<int>& V_pos,
+              const SArray<int>& fields, int k,
+              std::vector<real_t>* pred, std::vector<real_t>* grad) {
+  pred->assign(data.size, 0);
+  grad->assign(w.size(), 0);
+  for (size_t i = 0; i < data.size; ++i) {
+    real_t s = 0;
+    for (size_t a = data.offset[i]; a < data.offset[i+1]; ++a) {
+      unsigned c = data.index[a];
+      real_t x = data.value ? data.value[a] : 1;
+      s += x * w[w_pos[c]];
+      if (V_pos[c] < 0) continue;
+      for (size_t b = a + 1; b < data.offset[i+1]; ++b) {
+        unsigned d = data.index[b];
+        if (V_pos[d] < 0) continue;
+        real_t y = data.value ? data.value[b] : 1;
+        real_t const* Va = w.data() + V_pos[c] + fields[d] * k;
+        real_t const* Vb = w.data() + V_pos[d] + fields[c] * k;
+        for (int l = 0; l < k; ++l) s += x * y * Va[l] * Vb[l];
+      }
+    }
+    s = s > 20 ? 20 : (s < -20 ? -20 : s);
+    (*pred)[i] = s;
+    real_t p = math::LogitGrad(data.label[i] > 0 ? 1 : -1, s);
+    for (size_t a = data.offset[i]; a < data.offset[i+1]; ++a) {
+      unsigned c = data.index[a];
+      real_t x = data.value ? data.value[a] : 1;
+      (*grad)[w_pos[c]] += p * x;
+      if (V_pos[c] < 0) continue;
+      for (size_t b = data.offset[i]; b < data.offset[i+1]; ++b) {
+        unsigned d = data.index[b];
+        if (b == a || V_pos[d] < 0) continue;
+        real_t y = data.value ? data.value[b] : 1;
+        real_t* gVa = grad->data() + V_pos[c] + fields[d] * k;
+        real_t const* Vb = w.data() + V_pos[d] + fields[c] * k;
+        for (int l = 0; l < k; ++l) gVa[l] += p * x * y * Vb[l];
+      }
+    }
+  }
+}
+}  // namespace
+
+TEST(FFMLoss, GetFields) {
+  FFMLoss loss;
+  loss.Init({{"V_dim", "12"}, {"ffm_num_fields", "3"}});
+  SArray<feaid_t> feaids;
+  for (int gid = 0; gid < 6; ++gid) {
+    feaids.push_back(ReverseBytes(EncodeFeaGrpID(123 + gid, gid, 12)));
+  }
+  SArray<int> fields;
+  loss.GetFields(feaids, &fields);
+  ASSERT_EQ(fields.size(), 6);
+  for (int gid = 0; gid < 6; ++gid) EXPECT_EQ(fields[gid], gid % 3);
+}
+
+TEST(FFMLoss, AgainstPairwise) {
+  int num_fields = 3;
+  int k = 10;  // so both the avx and the scalar tails are used
+  int V_dim = num_fields * k;
+  dmlc::data::RowBlockContainer<unsigned> rowblk;
+  std::vector<feaid_t> uidx;
+  load_data(&rowblk, &uidx);
+  size_t n = uidx.size();
+
+  // every 7th feature has no V
+  SArray<int> w_pos(n), V_pos(n), fields(n);
+  int p = 0;
+  for (size_t i = 0; i < n; ++i) {
+    w_pos[i] = p++;
+    V_pos[i] = i % 7 == 0 ? -1 : p;
+    if (V_pos[i] >= 0) p += V_dim;
+    fields[i] = uidx[i] % num_fields;
+  }
+  SArray<real_t> w;
+  gen_vals(p, -.1, .1, &w);
+
+  FFMLoss loss;
+  loss.Init({{"V_dim", std::to_string(V_dim)},
+             {"ffm_num_fields", std::to_string(num_fields)}});
+  auto data = rowblk.GetBlock();
+  SArray<real_t> pred(data.size);
+  auto ws = loss.GetWorkspace();
+  loss.Predict(data, {SArray<char>(w), SArray<char>(w_pos),
+                      SArray<char>(V_pos), SArray<char>(fields)}, ws, &pred);
+  SArray<real_t> grad(w.size());
+  loss.CalcGrad(data, {SArray<char>(w), SArray<char>(w_pos),
+                       SArray<char>(V_pos), SArray<char>(fields),
+                       SArray<char>(pred)}, ws, &grad);
+  loss.ReleaseWorkspace(ws);
+
+  std::vector<real_t> pred2, grad2;
+  NaiveFFM(data, w, w_pos, V_pos, fields, k, &pred2, &grad2);
+  for (size_t i = 0; i < data.size; ++i) {
+    EXPECT_NEAR(pred[i], pred2[i], 1e-4 * (1 + fabs(pred2[i])));
+  }
+  for (size_t i = 0; i < grad.size(); ++i) {
+    EXPECT_NEAR(grad[i], grad2[i], 1e-3 * (1 + fabs(grad2[i])));
+  }
+}
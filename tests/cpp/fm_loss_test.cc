@@ -27,7 +27,8 @@ TEST(FMLoss, NoV) {
   FMLoss loss; loss.Init(args);
   auto data = rowblk.GetBlock();
   SArray<real_t> pred(data.size);
-  loss.Predict(data, w, {}, {}, &pred);
+  auto ws = loss.GetWorkspace();
+  loss.Predict(data, w, {}, {}, {}, ws, &pred);
 
   BinClassMetric eval(data.label, pred.data(), data.size);
 
@@ -35,7 +36,7 @@ TEST(FMLoss, NoV) {
   EXPECT_LT(fabs(eval.LogitObjv() - 147.4672), 1e-3);
 
   SArray<real_t> grad(w.size());
-  loss.CalcGrad(data, w, {}, {}, pred, &grad);
+  loss.CalcGrad(data, w, {}, {}, {}, pred, ws, &grad);
   EXPECT_LT(fabs(norm2(grad) - 90.5817), 1e-3);
 }
 
@@ -71,13 +72,113 @@ TEST(FMLoss, HasV) {
   FMLoss loss; loss.Init(args);
   auto data = rowblk.GetBlock();
   SArray<real_t> pred(data.size);
-  loss.Predict(data, w, w_pos, V_pos, &pred);
+  auto ws = loss.GetWorkspace();
+  loss.Predict(data, w, w_pos, V_pos, {}, ws, &pred);
 
   // Progress prog;
   BinClassMetric eval(data.label, pred.data(), data.size);
   EXPECT_LT(fabs(eval.LogitObjv() - 330.628), 1e-3);
 
   SArray<real_t> grad(w.size());
-  loss.CalcGrad(data, w, w_pos, V_pos, pred, &grad);
+  loss.CalcGrad(data, w, w_pos, V_pos, {}, pred, ws, &grad);
   EXPECT_LT(fabs(norm2(grad) - 1.2378e+03), 1e-1);
+
+  // two batches in flight with their own workspaces
+  auto ws2 = loss.GetWorkspace();
+  EXPECT_NE(ws, ws2);
+  SArray<real_t> w2; w2.CopyFrom(w);
+  for (auto& v : w2) v *= 2;
+  SArray<real_t> pred1(data.size), pred2(data.size);
+  loss.Predict(data, w, w_pos, V_pos, {}, ws, &pred1);
+  loss.Predict(data, w2, w_pos, V_pos, {}, ws2, &pred2);
+  SArray<real_t> grad1(w.size());
+  loss.CalcGrad(data, w, w_pos, V_pos, {}, pred1, ws, &grad1);
+  EXPECT_EQ(norm2(pred), norm2(pred1));
+  EXPECT_EQ(norm2(grad), norm2(grad1));
+  loss.ReleaseWorkspace(ws);
+  loss.ReleaseWorkspace(ws2);
+  EXPECT_EQ(loss.GetWorkspace(), ws2);
+}
+
+TEST(FMLoss, MixedVDim) {
+  int V_dim = 5;
+  dmlc::data::RowBlockContainer<unsigned> rowblk;
+  std::vector<feaid_t> uidx;
+  load_data(&rowblk, &uidx);
+  size_t n = uidx.size();
+
+  // packed with the V length i % (V_dim + 1), and the same V padded by zeros
+  SArray<int> w_pos(n), V_pos(n), V_len(n), w_pos2(n), V_pos2(n);
+  SArray<real_t> w, w2;
+  for (size_t i = 0; i < n; ++i) {
+    int d = i % (V_dim + 1);
+    SArray<real_t> v;
+    gen_vals(1 + d, -.1, .1, &v);
+    w_pos[i] = w.size();
+    V_pos[i] = d ? w_pos[i] + 1 : -1;
+    V_len[i] = d;
+    w_pos2[i] = w2.size();
+    V_pos2[i] = d ? w_pos2[i] + 1 : -1;
+    for (int j = 0; j <= d; ++j) w.push_back(v[j]);
+    for (int j = 0; d && j <= V_dim; ++j) w2.push_back(j <= d ? v[j] : 0);
+    if (!d) w2.push_back(v[0]);
+  }
+
+  FMLoss loss;
+  loss.Init({{"V_dim", std::to_string(V_dim)}});
+  auto data = rowblk.GetBlock();
+  auto ws = loss.GetWorkspace();
+  SArray<real_t> pred(data.size), pred2(data.size);
+  SArray<real_t> grad(w.size()), grad2(w2.size());
+  loss.Predict(data, {SArray<char>(w), SArray<char>(w_pos),
+                      SArray<char>(V_pos), SArray<char>(V_len)}, ws, &pred);
+  loss.CalcGrad(data, {SArray<char>(w), SArray<char>(w_pos),
+                       SArray<char>(V_pos), SArray<char>(V_len),
+                       SArray<char>(pred)}, ws, &grad);
+  loss.Predict(data, w2, w_pos2, V_pos2, {}, ws, &pred2);
+  loss.CalcGrad(data, w2, w_pos2, V_pos2, {}, pred2, ws, &grad2);
+  loss.ReleaseWorkspace(ws);
+
+  for (size_t i = 0; i < data.size; ++i) {
+    EXPECT_NEAR(pred[i], pred2[i], 1e-5 * (1 + fabs(pred2[i])));
+  }
+  for (size_t i = 0; i < n; ++i) {
+    for (int j = 0; j <= V_len[i]; ++j) {
+      EXPECT_NEAR(grad[w_pos[i]+j], grad2[w_pos2[i]+j], 1e-5);
+    }
+  }
+}
+
+TEST(FMLoss, FixedVDim) {
+  // the kernels of V_dim 8 unrolled and the generic ones, taken with V_len
+  int V_dim = 8;
+  dmlc::data::RowBlockContainer<unsigned> rowblk;
+  std::vector<feaid_t> uidx;
+  load_data(&rowblk, &uidx);
+  size_t n = uidx.size();
+  SArray<int> w_pos(n), V_pos(n), V_len(n, V_dim);
+  SArray<real_t> w;
+  gen_vals(n * (V_dim + 1), -.1, .1, &w);
+  for (size_t i = 0; i < n; ++i) {
+    w_pos[i] = i * (V_dim + 1);
+    V_pos[i] = i % 3 ? w_pos[i] + 1 : -1;
+  }
+
+  FMLoss loss;
+  loss.Init({{"V_dim", std::to_string(V_dim)}});
+  auto data = rowblk.GetBlock();
+  auto ws = loss.GetWorkspace();
+  SArray<real_t> pred(data.size), pred2(data.size);
+  SArray<real_t> grad(w.size()), grad2(w.size());
+  loss.Predict(data, w, w_pos, V_pos, {}, ws, &pred);
+  loss.CalcGrad(data, w, w_pos, V_pos, {}, pred, ws, &grad);
+  loss.Predict(data, w, w_pos, V_pos, V_len, ws, &pred2);
+  loss.CalcGrad(data, w, w_pos, V_pos, V_len, pred2, ws, &grad2);
+  loss.ReleaseWorkspace(ws);
+  for (size_t i = 0; i < data.size; ++i) {
+    EXPECT_NEAR(pred[i], pred2[i], 1e-5 * (1 + fabs(pred2[i])));
+  }
+  for (size_t i = 0; i < w.size(); ++i) {
+    EXPECT_NEAR(grad[i], grad2[i], 1e-5 * (1 + fabs(grad2[i])));
+  }
 }
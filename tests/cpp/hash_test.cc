@@ -0,0 +1,33 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <string>
+#include <unordered_set>
+#include "common/hash.h"
+
+using namespace difacto;
+
+TEST(Hash, Bytes) {
+  // every length up to a few blocks, and tokens differing by one byte
+  std::unordered_set<uint64_t> seen;
+  std::string str(100, 'a');
+  size_t n = 0;
+  for (size_t len = 0; len <= str.size(); ++len) {
+    for (size_t i = 0; i < len; ++i) {
+      str[i] = 'b';
+      uint64_t h = hash::Bytes(str.data(), len);
+      EXPECT_EQ(h, hash::Bytes(str.data(), len));
+      seen.insert(h); ++n;
+      str[i] = 'a';
+    }
+    seen.insert(hash::Bytes(str.data(), len)); ++n;
+  }
+  EXPECT_EQ(seen.size(), n);
+}
+
+TEST(Hash, Int) {
+  std::unordered_set<uint64_t> seen;
+  for (uint64_t i = 0; i < 100000; ++i) seen.insert(hash::Int(i));
+  EXPECT_EQ(seen.size(), 100000u);
+}
@@ -0,0 +1,88 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include "common/huge_pages.h"
+#include "sgd/sgd_model.h"
+
+using namespace difacto;
+
+namespace {
+/** \brief enable the pages in a scope, and then restore the default */
+struct ScopedHugePages {
+  ScopedHugePages(int mode, int lock) {
+    HugePageParam param;
+    param.Init(KWArgs{{"huge_pages", std::to_string(mode)},
+                      {"mem_lock", std::to_string(lock)}});
+    HugePages::Get()->Init(param);
+  }
+  ~ScopedHugePages() {
+    HugePageParam param;
+    param.Init(KWArgs());
+    HugePages::Get()->Init(param);
+  }
+};
+
+/** \brief all zeros, and then writable */
+void CheckArray(SArray<real_t> arr, size_t n) {
+  ASSERT_EQ(arr.size(), n);
+  for (size_t i = 0; i < n; ++i) ASSERT_EQ(arr[i], 0);
+  for (size_t i = 0; i < n; ++i) arr[i] = i;
+  for (size_t i = 0; i < n; i += 1023) ASSERT_EQ(arr[i], i);
+}
+}  // namespace
+
+TEST(HugePages, Disabled) {
+  auto pages = HugePages::Get();
+  EXPECT_FALSE(pages->Enabled());
+  size_t n = 3 << 20;
+  CheckArray(pages->New<real_t>(n), n);
+  EXPECT_EQ(pages->HugeBytes(), 0);
+}
+
+TEST(HugePages, New) {
+  auto pages = HugePages::Get();
+  // hugetlb pages may be not available, then fall back to the next mode
+  for (int mode = 1; mode <= 3; ++mode) {
+    ScopedHugePages scope(mode, mode == 1);
+    EXPECT_TRUE(pages->Enabled());
+    // not mapped
+    CheckArray(pages->New<real_t>(100), 100);
+    EXPECT_EQ(pages->HugeBytes(), 0);
+    size_t n = (3 << 20) + 5;
+    {
+      SArray<real_t> arr = pages->New<real_t>(n);
+      CheckArray(arr, n);
+      // the mapping is rounded up to 2MB
+      EXPECT_EQ(pages->HugeBytes() % HugePages::kPageSize, 0);
+      SArray<real_t> copy = pages->Copy(arr);
+      for (size_t i = 0; i < n; i += 1023) ASSERT_EQ(copy[i], i);
+    }
+    // released with the last copy
+    EXPECT_EQ(pages->HugeBytes(), 0);
+    EXPECT_EQ(pages->LockedBytes(), 0);
+  }
+}
+
+TEST(HugePages, VArena) {
+  ScopedHugePages scope(1, 0);
+  SGDVArena arena;
+  arena.Init(4);
+  // the slabs are allocated a huge page each time
+  std::vector<char*> rows;
+  for (int i = 0; i < 50000; ++i) rows.push_back(arena.New());
+  for (auto p : rows) {
+    real_t V[4], aux[4];
+    arena.Get(p, V, aux);
+    for (int j = 0; j < 4; ++j) ASSERT_EQ(V[j] + aux[j], 0);
+    p[0] = 1;
+  }
+  EXPECT_EQ(arena.MemBytes() % HugePages::kPageSize, 0);
+
+  SGDVArena hashed;
+  hashed.Init(4);
+  hashed.Reserve(10000);
+  real_t V[4];
+  hashed.Get(hashed.Row(9999), V, nullptr);
+  EXPECT_EQ(V[3], 0);
+}
@@ -0,0 +1,223 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <benchmark/benchmark.h>
+#include <random>
+#include <vector>
+#include "./bench_utils.h"
+#include "common/spmv.h"
+#include "common/spmm.h"
+#include "common/spmt.h"
+#include "common/kv_match.h"
+#include "common/kv_union.h"
+#include "common/huge_pages.h"
+#include "loss/bin_class_metric.h"
+
+using namespace difacto;
+
+namespace {
+/** \brief args are {number of rows, number of threads}, timed by wall clock */
+void RowsAndThreads(benchmark::internal::Benchmark* b) {
+  b->UseRealTime();
+  for (int nt : {1, 4}) {
+    for (int n : {1 << 14, 1 << 17}) b->Args({n, nt});
+  }
+}
+
+/** \brief args are {number of rows, k} */
+void RowsAndDims(benchmark::internal::Benchmark* b) {
+  b->UseRealTime();
+  for (int k : {4, 16, 64}) {
+    for (int n : {1 << 14, 1 << 17}) b->Args({n, k});
+  }
+}
+
+/** \brief report the nonzeros processed, and the hardware events per one */
+void SetNNZ(benchmark::State& state, const BenchData& data,
+            const PerfReport& perf) {
+  size_t nnz = data.local.index.size();
+  state.SetItemsProcessed(state.iterations() * nnz);
+  state.counters["nnz"] = nnz;
+  perf.Set(state, nnz);
+}
+}  // namespace
+
+static void BM_SpMVTimes(benchmark::State& state) {
+  const auto& data = GetBenchData(state.range(0));
+  auto D = data.local.GetBlock();
+  SArray<real_t> x(data.uniq.size(), 1), y(D.size);
+  PerfReport perf;
+  for (auto _ : state) {
+    SpMV::Times(D, x, &y, state.range(1));
+    benchmark::DoNotOptimize(y.data());
+  }
+  SetNNZ(state, data, perf);
+}
+BENCHMARK(BM_SpMVTimes)->Apply(RowsAndThreads);
+
+static void BM_SpMVTransTimes(benchmark::State& state) {
+  const auto& data = GetBenchData(state.range(0));
+  auto D = data.local.GetBlock();
+  SArray<real_t> x(D.size, 1), y(data.uniq.size());
+  PerfReport perf;
+  for (auto _ : state) {
+    SpMV::TransTimes(D, x, &y, state.range(1));
+    benchmark::DoNotOptimize(y.data());
+  }
+  SetNNZ(state, data, perf);
+}
+BENCHMARK(BM_SpMVTransTimes)->Apply(RowsAndThreads);
+
+static void BM_SpMMTimes(benchmark::State& state) {
+  const auto& data = GetBenchData(state.range(0));
+  auto D = data.local.GetBlock();
+  int k = state.range(1);
+  SArray<real_t> x(data.uniq.size() * k, 1), y(D.size * k);
+  PerfReport perf;
+  for (auto _ : state) {
+    SpMM::Times(D, x, k, &y);
+    benchmark::DoNotOptimize(y.data());
+  }
+  SetNNZ(state, data, perf);
+}
+BENCHMARK(BM_SpMMTimes)->Apply(RowsAndDims);
+
+static void BM_SpMMTransTimes(benchmark::State& state) {
+  const auto& data = GetBenchData(state.range(0));
+  auto D = data.local.GetBlock();
+  int k = state.range(1);
+  SArray<real_t> x(D.size * k, 1), y(data.uniq.size() * k);
+  PerfReport perf;
+  for (auto _ : state) {
+    SpMM::TransTimes(D, x, k, &y);
+    benchmark::DoNotOptimize(y.data());
+  }
+  SetNNZ(state, data, perf);
+}
+BENCHMARK(BM_SpMMTransTimes)->Apply(RowsAndDims);
+
+/**
+ * \brief SpMM::Times with V allocated by \ref HugePages, the args are {k,
+ * huge_pages}. the V rows of the features are gathered randomly, so compare
+ * the dtlb_miss_per_item of the two if perf events are available
+ */
+static void BM_SpMMTimesHugePages(benchmark::State& state) {
+  const auto& data = GetBenchData(1 << 17);
+  auto D = data.local.GetBlock();
+  int k = state.range(0);
+  HugePageParam param;
+  param.Init(KWArgs{{"huge_pages", std::to_string(state.range(1))}});
+  auto pages = HugePages::Get();
+  pages->Init(param);
+  SArray<real_t> x = pages->New<real_t>(data.uniq.size() * k), y(D.size * k);
+  for (auto& v : x) v = 1;
+  state.counters["huge_mb"] = pages->HugeBytes() >> 20;
+  PerfReport perf;
+  for (auto _ : state) {
+    SpMM::Times(D, x, k, &y, 1);
+    benchmark::DoNotOptimize(y.data());
+  }
+  SetNNZ(state, data, perf);
+  param.Init(KWArgs());
+  pages->Init(param);
+}
+BENCHMARK(BM_SpMMTimesHugePages)->UseRealTime()
+    ->Args({16, 0})->Args({16, 1})->Args({64, 0})->Args({64, 1});
+
+static void BM_SpMTTranspose(benchmark::State& state) {
+  const auto& data = GetBenchData(state.range(0));
+  auto D = data.local.GetBlock();
+  dmlc::data::RowBlockContainer<unsigned> Y;
+  PerfReport perf;
+  for (auto _ : state) {
+    SpMT::Transpose(D, &Y, data.uniq.size(), state.range(1));
+    benchmark::DoNotOptimize(Y.index.data());
+  }
+  SetNNZ(state, data, perf);
+}
+BENCHMARK(BM_SpMTTranspose)->Apply(RowsAndThreads);
+
+namespace {
+/**
+ * \brief the ids of a model, and the ones of a batch of 1K examples, as a
+ * worker pulls the weights of a batch
+ */
+void GetKeys(size_t nrows, SArray<feaid_t>* model, SArray<feaid_t>* batch) {
+  const auto& data = GetBenchData(nrows);
+  model->CopyFrom(data.uniq.data(), data.uniq.size());
+  BenchData small;
+  gen_power_law_data(1000, 40, 1 << 20, 1.1, 1, &small);
+  batch->CopyFrom(small.uniq.data(), small.uniq.size());
+}
+}  // namespace
+
+static void BM_KVMatch(benchmark::State& state) {
+  SArray<feaid_t> model, batch;
+  GetKeys(state.range(0), &model, &batch);
+  SArray<real_t> model_val(model.size(), 1), batch_val;
+  PerfReport perf;
+  for (auto _ : state) {
+    KVMatch(model, model_val, batch, &batch_val, ASSIGN, state.range(1));
+    benchmark::DoNotOptimize(batch_val.data());
+  }
+  state.SetItemsProcessed(state.iterations() * batch.size());
+  perf.Set(state, batch.size());
+}
+BENCHMARK(BM_KVMatch)->Apply(RowsAndThreads);
+
+static void BM_KVUnion(benchmark::State& state) {
+  SArray<feaid_t> model, batch, keys;
+  GetKeys(state.range(0), &model, &batch);
+  SArray<real_t> model_val(model.size(), 1), batch_val(batch.size(), 1), vals;
+  PerfReport perf;
+  for (auto _ : state) {
+    KVUnion(model, model_val, batch, batch_val, &keys, &vals, PLUS,
+            state.range(1));
+    benchmark::DoNotOptimize(vals.data());
+  }
+  state.SetItemsProcessed(state.iterations() * (model.size() + batch.size()));
+  perf.Set(state, model.size() + batch.size());
+}
+BENCHMARK(BM_KVUnion)->Apply(RowsAndThreads);
+
+static void BM_AUC(benchmark::State& state) {
+  size_t n = state.range(0);
+  std::vector<dmlc::real_t> label(n);
+  std::vector<real_t> pred(n);
+  std::mt19937 rng(0);
+  std::normal_distribution<real_t> noise(0, 1);
+  for (size_t i = 0; i < n; ++i) {
+    label[i] = rng() % 2 ? 1 : -1;
+    pred[i] = label[i] * .5 + noise(rng);
+  }
+  PerfReport perf;
+  for (auto _ : state) {
+    BinClassMetric metric(label.data(), pred.data(), n, state.range(1));
+    benchmark::DoNotOptimize(metric.AUC());
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+  perf.Set(state, n);
+}
+BENCHMARK(BM_AUC)->Apply(RowsAndThreads);
+
+static void BM_BinClassStats(benchmark::State& state) {
+  size_t n = state.range(0);
+  std::vector<dmlc::real_t> label(n);
+  std::vector<real_t> pred(n);
+  std::mt19937 rng(0);
+  std::normal_distribution<real_t> noise(0, 1);
+  for (size_t i = 0; i < n; ++i) {
+    label[i] = rng() % 2 ? 1 : -1;
+    pred[i] = label[i] * .5 + noise(rng);
+  }
+  PerfReport perf;
+  for (auto _ : state) {
+    BinClassStats stats;
+    stats.Add(label.data(), pred.data(), n, BinClassStats::kMaxAUCBins, 0,
+              state.range(1));
+    benchmark::DoNotOptimize(stats.AUC());
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+  perf.Set(state, n);
+}
+BENCHMARK(BM_BinClassStats)->Apply(RowsAndThreads);
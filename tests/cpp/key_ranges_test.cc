@@ -0,0 +1,44 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <limits>
+#include <vector>
+#include "common/key_ranges.h"
+
+using namespace difacto;
+
+TEST(KeyRanges, Even) {
+  std::vector<real_t> hist(KeyRanges::NumBuckets());
+  feaid_t end = std::numeric_limits<feaid_t>::max();
+  auto bounds = KeyRanges::Balance(hist, 4, end);
+  ASSERT_EQ(bounds.size(), 5);
+  for (int j = 0; j < 4; ++j) {
+    EXPECT_EQ(bounds[j], static_cast<feaid_t>(j) << 62);
+    EXPECT_EQ(KeyRanges::Server(bounds, bounds[j]), j);
+    EXPECT_EQ(KeyRanges::Server(bounds, bounds[j+1] - 1), j);
+  }
+  EXPECT_EQ(bounds[4], end);
+}
+
+TEST(KeyRanges, HotBucket) {
+  size_t nb = KeyRanges::NumBuckets();
+  std::vector<real_t> hist(nb, 1);
+  SArray<feaid_t> hot = {static_cast<feaid_t>(nb / 8) << 48};
+  KeyRanges::Add(hot, nb, &hist);
+  int n = 5;
+  auto bounds = KeyRanges::Balance(
+      hist, n, std::numeric_limits<feaid_t>::max());
+  // the hot bucket is half of the load, so it is about alone in a range, and
+  // no other range gets more than the average load
+  int s = KeyRanges::Server(bounds, hot[0]);
+  std::vector<real_t> load(n);
+  for (size_t b = 0; b < nb; ++b) {
+    load[KeyRanges::Server(bounds, b << 48)] += hist[b];
+  }
+  EXPECT_LT(load[s], nb * 1.1);
+  for (int j = 0; j < n; ++j) {
+    EXPECT_LT(bounds[j], bounds[j+1]);
+    if (j != s) EXPECT_LE(load[j], nb * 2.0 / n);
+  }
+}
@@ -3,6 +3,7 @@
  */
 #include <gtest/gtest.h>
 #include <map>
+#include <vector>
 #include "./utils.h"
 #include "common/kv_union.h"
 
@@ -50,6 +51,11 @@ void KVUnionRefer(
 }
 
 namespace  {
+template <typename T>
+std::vector<T> vec(const SArray<T>& a) {
+  return std::vector<T>(a.begin(), a.end());
+}
+
 void test(int n, int k) {
   SArray<uint32_t> key1, key2, jkey1, jkey2;
   SArray<real_t> val1, val2, jval1, jval2;
@@ -83,3 +89,28 @@ TEST(KVUnion, Val3) {
     test(1000, 4);
   }
 }
+
+TEST(KVUnion, Skewed) {
+  // one list is much longer than the other, so galloping is used
+  for (int i = 0; i < 10; ++i) {
+    for (int k : {1, 3}) {
+      SArray<uint32_t> key1, key2, jkey1, jkey2;
+      SArray<real_t> val1, val2, jval1, jval2;
+      gen_keys(100000, 1000000, &key1);
+      gen_keys(100, 1000000, &key2);
+      gen_vals(key1.size()*k, -100, 100, &val1);
+      gen_vals(key2.size()*k, -100, 100, &val2);
+
+      KVUnion(key1, val1, key2, val2, &jkey1, &jval1, PLUS, 4);
+      KVUnionRefer(key1, val1, key2, val2, &jkey2, &jval2, k);
+      EXPECT_EQ(vec(jkey1), vec(jkey2));
+      EXPECT_EQ(vec(jval1), vec(jval2));
+
+      jkey1.clear(); jval1.clear(); jkey2.clear(); jval2.clear();
+      KVUnion(key2, val2, key1, val1, &jkey1, &jval1, PLUS, 4);
+      KVUnionRefer(key2, val2, key1, val1, &jkey2, &jval2, k);
+      EXPECT_EQ(vec(jkey1), vec(jkey2));
+      EXPECT_EQ(vec(jval1), vec(jval2));
+    }
+  }
+}
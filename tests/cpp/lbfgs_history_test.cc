@@ -0,0 +1,90 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include "lbfgs/lbfgs_history.h"
+#include "lbfgs/lbfgs_twoloop.h"
+#include "./utils.h"
+
+using namespace difacto;
+using namespace difacto::lbfgs;
+
+namespace {
+/** \brief push k random pairs into both the history and the plain vectors */
+void PushPairs(int k, int m, int n, History* hist,
+               std::vector<SArray<real_t>>* s, std::vector<SArray<real_t>>* y) {
+  for (int i = 0; i < k; ++i) {
+    SArray<real_t> d, g0, g1;
+    gen_vals(n, -1, 1, &d);
+    gen_vals(n, -1, 1, &g0);
+    gen_vals(n, -.1, .1, &g1);
+    // a positive curvature s'y, as a convex objective has
+    for (int j = 0; j < n; ++j) g1[j] += g0[j] + d[j];
+    real_t alpha = .5;
+    hist->Push(alpha, d, g1, g0);
+    SArray<real_t> a(n), b(n);
+    for (int j = 0; j < n; ++j) {
+      a[j] = alpha * d[j];
+      b[j] = g1[j] - g0[j];
+    }
+    if (static_cast<int>(s->size()) == m) {
+      s->erase(s->begin());
+      y->erase(y->begin());
+    }
+    s->push_back(a);
+    y->push_back(b);
+  }
+}
+}  // namespace
+
+TEST(History, Ring) {
+  int m = 3, n = 5000;
+  for (int mem_pairs : {0, 1, 2}) {
+    History hist;
+    hist.Init(m, 0, mem_pairs, "/tmp/difacto_test_history_");
+    std::vector<SArray<real_t>> s, y;
+    for (int k = 0; k < 6; ++k) {
+      PushPairs(1, m, n, &hist, &s, &y);
+      std::vector<VecRef> sr, yr;
+      hist.Get(&sr, &yr);
+      ASSERT_EQ(hist.size(), static_cast<int>(s.size()));
+      ASSERT_EQ(sr.size(), s.size());
+      for (size_t i = 0; i < s.size(); ++i) {
+        for (int j = 0; j < n; ++j) {
+          EXPECT_EQ(sr[i].f32[j], s[i][j]);
+          EXPECT_EQ(yr[i].f32[j], y[i][j]);
+        }
+      }
+    }
+  }
+}
+
+TEST(History, Compact) {
+  int m = 4, n = 1000;
+  for (int precision : {1, 2}) {
+    History hist;
+    hist.Init(m, precision, 2, "/tmp/difacto_test_history_");
+    std::vector<SArray<real_t>> s, y;
+    Twoloop two0, two1;
+    for (int k = 0; k < 8; ++k) {
+      PushPairs(1, m, n, &hist, &s, &y);
+      SArray<real_t> g, p0, p1;
+      gen_vals(n, -1, 1, &g);
+
+      std::vector<real_t> B0, B1;
+      two0.CalcIncreB(s, y, g, &B0);
+      two0.ApplyIncreB(B0);
+      two0.CalcDirection(s, y, g, &p0);
+
+      std::vector<VecRef> sr, yr;
+      hist.Get(&sr, &yr);
+      two1.CalcIncreB(sr, yr, g, &B1);
+      two1.ApplyIncreB(B1);
+      two1.CalcDirection(sr, yr, g, &p1);
+
+      real_t diff = 0;
+      for (int j = 0; j < n; ++j) diff += (p0[j] - p1[j]) * (p0[j] - p1[j]);
+      EXPECT_LT(sqrt(diff / norm2(p0)), precision == 1 ? 1e-2 : 5e-2);
+    }
+  }
+}
@@ -46,6 +46,28 @@ TEST(LBFGSLearner, Basic) {
   learner.Run();
 }
 
+TEST(LBFGSLearner, DataParts) {
+  // the same data read by 3 sub-partitions concurrently
+  std::vector<real_t> objv = {34.603421, 12.655075, 5.224232, 2.713903};
+  LBFGSLearner learner;
+  KWArgs args = {{"data_in", "../tests/data"},
+                 {"m", "5"},
+                 {"V_dim", "0"},
+                 {"l2", "0"},
+                 {"init_alpha", "1"},
+                 {"num_data_parts", "3"},
+                 {"tail_feature_filter", "0"},
+                 {"max_num_epochs", "4"}};
+  auto remain = learner.Init(args);
+  EXPECT_EQ(remain.size(), 0);
+
+  auto callback = [objv](int epoch, const lbfgs::Progress& prog) {
+    EXPECT_LT(fabs(objv[epoch] - prog.objv), 1e-4 * objv[epoch]);
+  };
+  learner.AddEpochEndCallback(callback);
+  learner.Run();
+}
+
 TEST(LBFGSLearner, RemoveTailFeatures) {
   std::vector<real_t> objv = {
     43.865008,
@@ -144,3 +166,92 @@ TEST(LBFGSLearner, WithV) {
   learner.AddEpochEndCallback(callback);
   learner.Run();
 }
+
+TEST(LBFGSLearner, LineSearchCache) {
+  // a large init_alpha needs several line search steps
+  for (const char* V_dim : {"0", "5"}) {
+    std::vector<std::vector<real_t>> objv(2);
+    for (int cache : {0, 1}) {
+      LBFGSLearner learner;
+      KWArgs args = {{"data_in", "../tests/data"},
+                     {"m", "5"},
+                     {"V_dim", V_dim},
+                     {"l2", ".1"},
+                     {"init_alpha", "64"},
+                     {"V_l2", ".01"},
+                     {"V_threshold", "0"},
+                     {"linesearch_cache", std::to_string(cache)},
+                     {"tail_feature_filter", "0"},
+                     {"max_num_epochs", "10"}};
+      auto remain = learner.Init(args);
+      EXPECT_EQ(remain.size(), 0);
+      auto callback = [&objv, cache](int epoch, const lbfgs::Progress& prog) {
+        objv[cache].push_back(prog.objv);
+      };
+      learner.AddEpochEndCallback(callback);
+      learner.Run();
+    }
+    ASSERT_EQ(objv[0].size(), objv[1].size());
+    for (size_t i = 0; i < objv[0].size(); ++i) {
+      EXPECT_LT(fabs(objv[0][i] - objv[1][i]) / objv[0][i], 1e-3);
+    }
+  }
+}
+
+TEST(LBFGSLearner, Validation) {
+  // the validation runs in background, on the same w as the training AUC.
+  // the margins are either cached along the directions or predicted again
+  for (int cache : {0, 1}) {
+    LBFGSLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"data_val", "../tests/data"},
+                   {"m", "5"},
+                   {"V_dim", "0"},
+                   {"l2", ".1"},
+                   {"init_alpha", "1"},
+                   {"linesearch_cache", std::to_string(cache)},
+                   {"tail_feature_filter", "0"},
+                   {"max_num_epochs", "5"}};
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+    int nepochs = 0;
+    auto callback = [&nepochs](int epoch, const lbfgs::Progress& prog) {
+      EXPECT_EQ(epoch, nepochs++);
+      // w = 0 in the first epoch, so all predictions tie
+      if (epoch > 0) EXPECT_GT(prog.val_auc, .5);
+      EXPECT_LT(fabs(prog.val_auc - prog.auc), 1e-5);
+    };
+    learner.AddEpochEndCallback(callback);
+    learner.Run();
+    EXPECT_EQ(nepochs, 5);
+  }
+}
+
+TEST(LBFGSLearner, L1) {
+  // OWL-QN decreases the objective and gets a sparser model than l2 only
+  std::vector<real_t> nnz_w;
+  for (const char* l1 : {"0", ".1"}) {
+    LBFGSLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"m", "5"},
+                   {"V_dim", "0"},
+                   {"l1", l1},
+                   {"l2", ".1"},
+                   {"init_alpha", "1"},
+                   {"tail_feature_filter", "0"},
+                   {"max_num_epochs", "10"}};
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+    real_t last_objv = 0, nnz = 0;
+    auto callback = [&](int epoch, const lbfgs::Progress& prog) {
+      if (epoch > 0) EXPECT_LE(prog.objv, last_objv * (1 + 1e-6));
+      last_objv = prog.objv;
+      nnz = prog.nnz_w;
+    };
+    learner.AddEpochEndCallback(callback);
+    learner.Run();
+    nnz_w.push_back(nnz);
+  }
+  EXPECT_GT(nnz_w[1], 0);
+  EXPECT_LT(nnz_w[1], nnz_w[0]);
+}
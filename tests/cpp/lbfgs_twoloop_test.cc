@@ -89,3 +89,33 @@ TEST(Twoloop, basic) {
     EXPECT_LE(fabs(norm2(p0) - norm2(p1)) / norm2(p1), 1e-5);
   }
 }
+
+TEST(Twoloop, MultiInnerAdd) {
+  for (size_t n : {0, 10, 5000, 10007}) {
+    std::vector<SArray<real_t>> vecs(5);
+    std::vector<VecRef> a, b;
+    for (size_t i = 0; i < vecs.size(); ++i) {
+      gen_vals(n, -1, 1, &vecs[i]);
+      (i < 2 ? a : b).push_back(vecs[i].data());
+    }
+    for (int nt : {1, 3}) {
+      std::vector<double> res;
+      MultiInner(a, b, n, &res, nt);
+      ASSERT_EQ(res.size(), 6U);
+      for (int i = 0; i < 2; ++i) {
+        for (int j = 0; j < 3; ++j) {
+          double r = Inner(vecs[i], vecs[2+j]);
+          EXPECT_LE(fabs(res[i*3+j] - r), 1e-4 * (1 + fabs(r)));
+        }
+      }
+
+      std::vector<double> x = {.5, 0, -2, 1, 3};
+      SArray<real_t> p0(n, 0), p1(n, 1);
+      for (size_t i = 0; i < vecs.size(); ++i) Add(x[i], vecs[i], &p0);
+      MultiAdd(x, std::vector<VecRef>(
+          {vecs[0].data(), vecs[1].data(), vecs[2].data(),
+           vecs[3].data(), vecs[4].data()}), n, p1.data(), nt);
+      for (size_t k = 0; k < n; ++k) EXPECT_LE(fabs(p0[k] - p1[k]), 1e-5);
+    }
+  }
+}
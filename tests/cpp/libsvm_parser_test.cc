@@ -0,0 +1,55 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "reader/libsvm_parser.h"
+
+using namespace difacto;
+
+/** \brief parse a text into one container, with nthreads threads */
+static void Parse(const std::string& text, int nthreads,
+                  dmlc::data::RowBlockContainer<feaid_t>* blk) {
+  std::string file = "/tmp/difacto_libsvm_" + std::to_string(getpid());
+  std::ofstream(file) << text;
+  LibSVMParser parser(
+      dmlc::InputSplit::Create(file.c_str(), 0, 1, "text"), nthreads);
+  blk->Clear();
+  while (parser.Next()) {
+    const auto& b = parser.Value();
+    for (size_t i = 0; i < b.size; ++i) blk->Push(b[i]);
+  }
+  std::remove(file.c_str());
+}
+
+TEST(LibSVMParser, Binary) {
+  std::string text = "1 3:1 10:1\n0 qid:2 7:1\n-1 1:1 2 5:1\n+1\n";
+  for (int nt : {1, 3}) {
+    dmlc::data::RowBlockContainer<feaid_t> blk;
+    Parse(text, nt, &blk);
+    std::vector<real_t> label = {1, 0, -1, 1};
+    std::vector<size_t> offset = {0, 2, 3, 6, 6};
+    std::vector<feaid_t> index = {3, 10, 7, 1, 2, 5};
+    EXPECT_EQ(blk.label, label);
+    EXPECT_EQ(blk.offset, offset);
+    EXPECT_EQ(blk.index, index);
+    // no values are stored for a binary input
+    EXPECT_TRUE(blk.value.empty());
+  }
+}
+
+TEST(LibSVMParser, Value) {
+  std::string text = "0.5 3:1 10:2.5\n-2 7:1\n1 4:-1 9:1e2\n";
+  dmlc::data::RowBlockContainer<feaid_t> blk;
+  Parse(text, 1, &blk);
+  std::vector<real_t> label = {.5, -2, 1};
+  std::vector<feaid_t> index = {3, 10, 7, 4, 9};
+  std::vector<real_t> value = {1, 2.5, 1, -1, 100};
+  EXPECT_EQ(blk.label, label);
+  EXPECT_EQ(blk.index, index);
+  EXPECT_EQ(blk.value, value);
+}
@@ -61,3 +61,47 @@ TEST(Localizer, ReverseBytes) {
     EXPECT_EQ(j, ReverseBytes(ReverseBytes(j)));
   }
 }
+
+TEST(Localizer, Hash) {
+  for (feaid_t max_index : {static_cast<feaid_t>(-1), static_cast<feaid_t>(1000)}) {
+    BatchReader reader("../tests/data", "libsvm", 0, 1, 37);
+    Localizer lc(max_index);
+    // reused among blocks
+    Localizer lc_hash(max_index, 1, Localizer::kHash);
+    Localizer lc_radix(max_index, 1, Localizer::kHashRadix);
+    while (reader.Next()) {
+      dmlc::data::RowBlockContainer<unsigned> c1, c2, c3;
+      std::vector<feaid_t> u1, u2, u3;
+      std::vector<real_t> f1, f2, f3;
+      lc.Compact(reader.Value(), &c1, &u1, &f1);
+      lc_hash.Compact(reader.Value(), &c2, &u2, &f2);
+      lc_radix.Compact(reader.Value(), &c3, &u3, &f3);
+      EXPECT_EQ(u1, u2);
+      EXPECT_EQ(u1, u3);
+      EXPECT_EQ(f1, f2);
+      EXPECT_EQ(f1, f3);
+      EXPECT_EQ(c1.index, c2.index);
+      EXPECT_EQ(c1.index, c3.index);
+      EXPECT_EQ(c1.offset, c2.offset);
+      EXPECT_EQ(c1.value, c3.value);
+    }
+  }
+}
+
+TEST(Localizer, HashRemap) {
+  // remap with a dictionary different to the unique indices
+  BatchReader reader("../tests/data", "libsvm", 0, 1, 100);
+  CHECK(reader.Next());
+  std::vector<feaid_t> uidx, dict;
+  Localizer lc, lc_hash(-1, 1, Localizer::kHash);
+  lc.CountUniqIndex(reader.Value(), &uidx, nullptr);
+  for (size_t i = 0; i < uidx.size(); i += 3) dict.push_back(uidx[i]);
+  lc_hash.CountUniqIndex(reader.Value(), &uidx, nullptr);
+
+  dmlc::data::RowBlockContainer<unsigned> c1, c2;
+  lc.RemapIndex(reader.Value(), dict, &c1);
+  lc_hash.RemapIndex(reader.Value(), dict, &c2);
+  EXPECT_EQ(c1.index, c2.index);
+  EXPECT_EQ(c1.offset, c2.offset);
+  EXPECT_LT(c1.index.size(), reader.Value().offset[100]);
+}
@@ -26,8 +26,8 @@ TEST(LogitLossDelta, Grad) {
     gen_vals(uidx.size(), -10, 10, &w);
 
     SArray<real_t> ref_pred(100), ref_grad(w.size());
-    ref_loss.Predict(rowblk.GetBlock(), {SArray<char>(w)}, &ref_pred);
-    ref_loss.CalcGrad(rowblk.GetBlock(), {SArray<char>(ref_pred)}, &ref_grad);
+    ref_loss.Predict(rowblk.GetBlock(), {SArray<char>(w)}, nullptr, &ref_pred);
+    ref_loss.CalcGrad(rowblk.GetBlock(), {SArray<char>(ref_pred)}, nullptr, &ref_grad);
 
     int nblk = 10;
     SArray<real_t> pred(100), grad(w.size());
@@ -35,7 +35,7 @@ TEST(LogitLossDelta, Grad) {
       auto rg = Range(0, w.size()).Segment(b, nblk);
       auto data = transposed.GetBlock().Slice(rg.begin, rg.end);
       data.label = rowblk.GetBlock().label;
-      loss.Predict(data, {SArray<char>(w.segment(rg.begin, rg.end))}, &pred);
+      loss.Predict(data, {SArray<char>(w.segment(rg.begin, rg.end))}, nullptr, &pred);
     }
 
     for (int b = 0; b < nblk; ++b) {
@@ -44,7 +44,7 @@ TEST(LogitLossDelta, Grad) {
       data.label = rowblk.GetBlock().label;
       auto grad_seg = grad.segment(rg.begin, rg.end);
       auto param = {SArray<char>(pred), {}, SArray<char>(w.segment(rg.begin, rg.end))};
-      loss.CalcGrad(data, param, &grad_seg);
+      loss.CalcGrad(data, param, nullptr, &grad_seg);
     }
 
     EXPECT_LE(fabs(norm2(pred) - norm2(ref_pred)) / norm2(ref_pred), 1e-6);
@@ -81,7 +81,7 @@ TEST(LogitLossDelta, Hessien) {
     auto rg = Range(0, w.size()).Segment(b, nblk);
     auto data = transposed.GetBlock().Slice(rg.begin, rg.end);
     data.label = rowblk.GetBlock().label;
-    loss.Predict(data, {SArray<char>(w.segment(rg.begin, rg.end))}, &pred);
+    loss.Predict(data, {SArray<char>(w.segment(rg.begin, rg.end))}, nullptr, &pred);
   }
 
   for (int b = 0; b < nblk; ++b) {
@@ -93,7 +93,7 @@ TEST(LogitLossDelta, Hessien) {
     SArray<int> grad_pos(w_seg.size());
     for (size_t i = 0; i < w_seg.size(); ++i) grad_pos[i] = 2*i;
     auto param = {SArray<char>(pred), SArray<char>(grad_pos), SArray<char>(w_seg)};
-    loss.CalcGrad(data, param, &grad_seg);
+    loss.CalcGrad(data, param, nullptr, &grad_seg);
   }
 
   SArray<real_t> H(w.size()), G(w.size());
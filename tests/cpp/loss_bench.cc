@@ -0,0 +1,80 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <benchmark/benchmark.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "./bench_utils.h"
+#include "difacto/loss.h"
+
+using namespace difacto;
+
+namespace {
+/** \brief an fm loss with the model of a dataset, every feature has a V */
+struct FMBench {
+  FMBench(const BenchData& data, int V_dim, int nthreads)
+      : loss(Loss::Create("fm", nthreads)) {
+    loss->Init({{"V_dim", std::to_string(V_dim)}});
+    size_t p = data.uniq.size();
+    int len = 1 + V_dim;
+    SArray<real_t> weights(p * len, .01);
+    SArray<int> w_pos, V_pos;
+    if (V_dim > 0) {
+      w_pos.resize(p);
+      V_pos.resize(p);
+      for (size_t i = 0; i < p; ++i) {
+        w_pos[i] = i * len;
+        V_pos[i] = i * len + 1;
+      }
+    }
+    inputs = {SArray<char>(weights), SArray<char>(w_pos), SArray<char>(V_pos)};
+    pred.resize(data.local.label.size());
+    grad.resize(weights.size());
+  }
+  std::unique_ptr<Loss> loss;
+  std::vector<SArray<char>> inputs;
+  SArray<real_t> pred, grad;
+};
+
+/** \brief args are {number of rows, V_dim}, with 4 threads */
+void RowsAndDims(benchmark::internal::Benchmark* b) {
+  b->UseRealTime();
+  for (int d : {0, 4, 16, 64}) {
+    for (int n : {1 << 14, 1 << 17}) b->Args({n, d});
+  }
+}
+}  // namespace
+
+static void BM_FMLossPredict(benchmark::State& state) {
+  const auto& data = GetBenchData(state.range(0));
+  auto D = data.local.GetBlock();
+  FMBench fm(data, state.range(1), 4);
+  auto ws = fm.loss->GetWorkspace();
+  for (auto _ : state) {
+    fm.loss->Predict(D, fm.inputs, ws, &fm.pred);
+    benchmark::DoNotOptimize(fm.pred.data());
+  }
+  fm.loss->ReleaseWorkspace(ws);
+  state.SetItemsProcessed(state.iterations() * D.size);
+}
+BENCHMARK(BM_FMLossPredict)->Apply(RowsAndDims);
+
+static void BM_FMLossCalcGrad(benchmark::State& state) {
+  const auto& data = GetBenchData(state.range(0));
+  auto D = data.local.GetBlock();
+  FMBench fm(data, state.range(1), 4);
+  auto ws = fm.loss->GetWorkspace();
+  // CalcGrad uses the X*V kept by Predict
+  fm.loss->Predict(D, fm.inputs, ws, &fm.pred);
+  auto inputs = fm.inputs;
+  inputs.push_back(SArray<char>(fm.pred));
+  for (auto _ : state) {
+    std::fill(fm.grad.begin(), fm.grad.end(), 0);
+    fm.loss->CalcGrad(D, inputs, ws, &fm.grad);
+    benchmark::DoNotOptimize(fm.grad.data());
+  }
+  fm.loss->ReleaseWorkspace(ws);
+  state.SetItemsProcessed(state.iterations() * D.size);
+}
+BENCHMARK(BM_FMLossCalcGrad)->Apply(RowsAndDims);
@@ -0,0 +1,59 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include "common/mem_tracker.h"
+#include "data/data_store.h"
+#include "sgd/sgd_batch_cache.h"
+#include "./utils.h"
+
+using namespace difacto;
+
+TEST(MemTracker, Gauge) {
+  auto tracker = MemTracker::Get();
+  int64_t total = tracker->Total();
+  int64_t aux = tracker->Bytes(MemTracker::kAux);
+  {
+    MemGauge a(MemTracker::kAux), b(MemTracker::kScratch);
+    a.Set(100);
+    b.Set(50);
+    a.Set(30);
+    EXPECT_EQ(tracker->Bytes(MemTracker::kAux), aux + 30);
+    EXPECT_EQ(tracker->Total(), total + 80);
+  }
+  EXPECT_EQ(tracker->Total(), total);
+
+  tracker->SetBudget(total + 100);
+  EXPECT_FALSE(tracker->Exceeds(100));
+  EXPECT_TRUE(tracker->Exceeds(101));
+  tracker->SetBudget(0);
+  EXPECT_FALSE(tracker->Exceeds(1 << 30));
+}
+
+TEST(MemTracker, DiskSpill) {
+  auto tracker = MemTracker::Get();
+  int n = 1000;
+  SArray<real_t> val;
+  gen_vals(n, -100, 100, &val);
+  size_t bytes = n * sizeof(real_t);
+  int64_t data = tracker->Bytes(MemTracker::kData);
+  // the capacity is large, but the budget only allows 2 of them
+  tracker->SetBudget(tracker->Total() + bytes * 2);
+  {
+    DataStore store("/tmp/difacto_test_", bytes * 10);
+    for (int i = 0; i < 5; ++i) store.Store(std::to_string(i), val);
+    EXPECT_LE(tracker->Bytes(MemTracker::kData), data + bytes * 2);
+    SArray<real_t> ret;
+    store.Fetch("0", &ret);
+    EXPECT_EQ(norm2(val), norm2(ret));
+
+    // over the budget, nothing more can be cached
+    sgd::BatchCache cache;
+    cache.Init(bytes * 10, false);
+    sgd::LocalBatch batch;
+    batch.feaids.resize(n * 2);
+    EXPECT_FALSE(cache.Add("part", batch));
+  }
+  EXPECT_EQ(tracker->Bytes(MemTracker::kData), data);
+  tracker->SetBudget(0);
+}
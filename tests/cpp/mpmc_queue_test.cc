@@ -0,0 +1,71 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "common/mpmc_queue.h"
+#include "common/thread_pool.h"
+
+using namespace difacto;
+
+TEST(MPMCQueue, TryPushPop) {
+  MPMCQueue<int> queue(3);
+  // the capacity is rounded up to 4
+  for (int i = 0; i < 4; ++i) EXPECT_TRUE(queue.TryPush(int(i)));
+  EXPECT_FALSE(queue.TryPush(4));
+  EXPECT_EQ(queue.Size(), 4);
+  int v;
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_TRUE(queue.TryPop(&v));
+    EXPECT_EQ(v, i);
+  }
+  EXPECT_FALSE(queue.TryPop(&v));
+}
+
+TEST(MPMCQueue, Concurrent) {
+  // a small queue, so both producers and consumers park
+  MPMCQueue<int> queue(8);
+  int nthreads = 4, n = 20000;
+  std::vector<std::thread> producers, consumers;
+  std::vector<std::atomic<int>> seen(nthreads * n);
+  for (auto& s : seen) s = 0;
+  for (int t = 0; t < nthreads; ++t) {
+    producers.push_back(std::thread([&queue, t, n]() {
+          for (int i = 0; i < n; ++i) queue.Push(t * n + i);
+        }));
+    consumers.push_back(std::thread([&queue, &seen]() {
+          int v;
+          while (queue.Pop(&v)) ++seen[v];
+        }));
+  }
+  for (auto& t : producers) t.join();
+  queue.Close();
+  for (auto& t : consumers) t.join();
+  for (const auto& s : seen) EXPECT_EQ(s.load(), 1);
+}
+
+TEST(ThreadPool, Wait) {
+  std::atomic<int> sum{0};
+  ThreadPool pool(3, 16);
+  for (int k = 0; k < 3; ++k) {
+    for (int i = 0; i < 1000; ++i) pool.Add([&sum, i](int tid) { sum += i; });
+    pool.Wait();
+    EXPECT_EQ(sum.load(), (k + 1) * 999 * 1000 / 2);
+  }
+}
+
+TEST(ThreadPool, AddFromWorker) {
+  // the workers add more jobs than the queue holds, which they run at once
+  // rather than waiting for themselves to drain the queue
+  std::atomic<int> sum{0};
+  ThreadPool pool(2, 4);
+  for (int i = 0; i < 8; ++i) {
+    pool.Add([&sum, &pool](int tid) {
+        for (int j = 0; j < 100; ++j) pool.Add([&sum](int tid) { ++sum; });
+      });
+  }
+  pool.Wait();
+  EXPECT_EQ(sum.load(), 800);
+}
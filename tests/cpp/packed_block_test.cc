@@ -0,0 +1,106 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include "./utils.h"
+#include "./spmv_test.h"
+#include "common/packed_block.h"
+#include "common/spmv.h"
+#include "common/spmt.h"
+
+using namespace difacto;
+
+namespace {
+std::vector<unsigned> decode(const PackedBlock& P) {
+  std::vector<unsigned> ret;
+  unsigned idx[PackedBlock::kGroup];
+  for (size_t i = 0; i < P.size(); ++i) {
+    PackedBlock::RowReader rd(P, i);
+    for (int n; (n = rd.Next(idx)) > 0; ) ret.insert(ret.end(), idx, idx + n);
+  }
+  return ret;
+}
+}  // namespace
+
+TEST(PackedBlock, Decode) {
+  // rows with various lengths and gaps
+  dmlc::data::RowBlockContainer<unsigned> data;
+  for (int len : {0, 1, 127, 128, 129, 1000}) {
+    SArray<uint32_t> gap;
+    gen_keys(len, len % 2 ? 1 << 20 : 3, &gap);
+    unsigned cur = 0;
+    for (int i = 0; i < len; ++i) {
+      cur += gap[i] + (i > 0 && (i % 7) ? 1 : 0);
+      if (i > 0 && cur <= data.index.back()) cur = data.index.back() + 1;
+      data.index.push_back(cur);
+    }
+    data.offset.push_back(data.index.size());
+  }
+  PackedBlock P;
+  P.Pack(data.GetBlock(), false);
+  EXPECT_EQ(P.size(), 6);
+  auto ret = decode(P);
+  ASSERT_EQ(ret.size(), data.index.size());
+  for (size_t i = 0; i < ret.size(); ++i) EXPECT_EQ(ret[i], data.index[i]);
+}
+
+TEST(PackedBlock, SpMV) {
+  dmlc::data::RowBlockContainer<unsigned> data, Y;
+  std::vector<feaid_t> uidx;
+  load_data(&data, &uidx);
+  SpMT::Transpose(data.GetBlock(), &Y, uidx.size());
+  auto D = Y.GetBlock();
+
+  for (int fp16 : {0, 1}) {
+    PackedBlock P;
+    P.Pack(D, fp16);
+    auto ret = decode(P);
+    ASSERT_EQ(ret.size(), Y.index.size());
+    for (size_t i = 0; i < ret.size(); ++i) EXPECT_EQ(ret[i], Y.index[i]);
+    EXPECT_LT(P.words.size(), Y.index.size());
+
+    real_t eps = fp16 ? 1e-2 : 1e-5;
+
+    // y = D * x
+    SArray<real_t> x, y1(D.size), y2(D.size);
+    gen_vals(data.Size(), -10, 10, &x);
+    SpMV::Times(D, x, &y1);
+    SpMV::Times(P, x, &y2);
+    EXPECT_NEAR(norm2(y1), norm2(y2), norm2(y1) * eps);
+
+    // with positions
+    SArray<int> x_pos;
+    SArray<real_t> x_val;
+    test::gen_sliced_vec(x, &x_val, &x_pos);
+    SArray<real_t> y3(D.size);
+    SpMV::Times(P, x_val, &y3, DEFAULT_NTHREADS, x_pos);
+    EXPECT_NEAR(norm2(y1), norm2(y3), norm2(y1) * eps);
+
+    // y = (D .* D) * x
+    dmlc::RowBlock<unsigned> DD = D;
+    SArray<real_t> dd(Y.value.size());
+    for (size_t i = 0; i < dd.size(); ++i) dd[i] = Y.value[i] * Y.value[i];
+    DD.value = dd.data();
+    memset(y1.data(), 0, y1.size() * sizeof(real_t));
+    memset(y2.data(), 0, y2.size() * sizeof(real_t));
+    SpMV::Times(DD, x, &y1);
+    SpMV::Times(P, x, &y2, DEFAULT_NTHREADS, {}, {}, true);
+    EXPECT_NEAR(norm2(y1), norm2(y2), norm2(y1) * eps);
+
+    // z = D' * w
+    SArray<real_t> w, z1(data.Size()), z2(data.Size());
+    gen_vals(D.size, -10, 10, &w);
+    SpMV::TransTimes(D, w, &z1);
+    SpMV::TransTimes(P, w, &z2);
+    EXPECT_NEAR(norm2(z1), norm2(z2), norm2(z1) * eps);
+
+    SArray<int> z_pos;
+    SArray<real_t> z_val;
+    test::gen_sliced_vec(z1, &z_val, &z_pos);
+    memset(z_val.data(), 0, z_val.size() * sizeof(real_t));
+    SpMV::TransTimes(P, w, &z_val, DEFAULT_NTHREADS, {}, z_pos);
+    SArray<real_t> z3;
+    test::slice_vec(z_val, z_pos, &z3);
+    EXPECT_NEAR(norm2(z1), norm2(z3), norm2(z1) * eps);
+  }
+}
@@ -0,0 +1,49 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include "./utils.h"
+#include "common/parallel_sort.h"
+
+using namespace difacto;
+
+namespace {
+struct Pair {
+  feaid_t k; unsigned i;
+};
+}  // namespace
+
+TEST(ParallelSort, Sort) {
+  for (int n : {10, 100000, 1000003}) {
+    for (int nt : {1, 3, 8}) {
+      SArray<uint32_t> keys;
+      gen_keys(n, 1000000, &keys);
+      std::vector<uint32_t> a(keys.begin(), keys.end());
+      std::vector<uint32_t> b = a;
+      ParallelSort(&a, nt, std::less<uint32_t>());
+      std::sort(b.begin(), b.end());
+      EXPECT_EQ(a, b);
+    }
+  }
+}
+
+TEST(ParallelSort, RadixSort) {
+  for (int n : {10, 100000, 1000003}) {
+    for (int nt : {1, 4}) {
+      std::vector<Pair> a(n), tmp;
+      for (int i = 0; i < n; ++i) {
+        // only a few distinct high bytes, and duplicated keys
+        a[i].k = ReverseBytes(static_cast<feaid_t>(rand() % (n / 2 + 1)));
+        a[i].i = i;
+      }
+      std::vector<Pair> b = a;
+      RadixSort(&a, &tmp, [](const Pair& p) { return p.k; }, nt);
+      std::stable_sort(b.begin(), b.end(),
+                       [](const Pair& x, const Pair& y) { return x.k < y.k; });
+      for (int i = 0; i < n; ++i) {
+        ASSERT_EQ(a[i].k, b[i].k);
+        ASSERT_EQ(a[i].i, b[i].i);
+      }
+    }
+  }
+}
@@ -0,0 +1,113 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "predict/predictor.h"
+#include "sgd/sgd_learner.h"
+#include "loss/bin_class_metric.h"
+
+using namespace difacto;
+
+TEST(Predictor, FM) {
+  std::string model = "/tmp/difacto_predictor_test_model";
+  std::string pred = "/tmp/difacto_predictor_test_pred";
+  real_t train_auc = 0;
+  {
+    SGDLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"V_dim", "2"},
+                   {"V_threshold", "2"},
+                   {"l1", "1"},
+                   {"lr", "1"},
+                   {"num_jobs_per_epoch", "1"},
+                   {"batch_size", "100"},
+                   {"max_num_epochs", "10"},
+                   {"model_out", model}};
+    learner.Init(args);
+    learner.AddEpochEndCallback(
+        [&train_auc](int epoch, const sgd::Progress& train,
+                     const sgd::Progress& val) {
+          train_auc = train.AUC();
+        });
+    learner.Run();
+  }
+
+  for (int num_parts : {1, 3}) {
+    std::vector<real_t> label, score;
+    for (int i = 0; i < num_parts; ++i) {
+      Predictor predictor;
+      KWArgs args = {{"data_in", "../tests/data"},
+                     {"model_in", model},
+                     {"pred_out", pred},
+                     {"pred_format", "label"},
+                     {"num_parts", std::to_string(num_parts)},
+                     {"part_idx", std::to_string(i)},
+                     {"num_threads", "3"}};
+      auto remain = predictor.Init(args);
+      EXPECT_EQ(remain.size(), 0);
+      predictor.Run();
+
+      auto name = num_parts > 1 ? pred + "_part-" + std::to_string(i) : pred;
+      std::ifstream in(name);
+      real_t y, p;
+      while (in >> y >> p) {
+        EXPECT_GT(p, 0);
+        EXPECT_LT(p, 1);
+        label.push_back(y);
+        score.push_back(p);
+      }
+      remove(name.c_str());
+    }
+    EXPECT_EQ(label.size(), 100);
+    // the model after the last update scores about as well as training,
+    // AUC() is weighted by the number of examples
+    BinClassMetric metric(label.data(), score.data(), label.size(), 1);
+    EXPECT_GT(metric.AUC() / label.size(), train_auc - .05);
+  }
+  remove(model.c_str());
+}
+
+TEST(Predictor, NegSampling) {
+  // a model trained on the unweighted samples is calibrated by log(rate)
+  std::string model = "/tmp/difacto_predictor_test_neg_model";
+  std::string pred = "/tmp/difacto_predictor_test_neg_pred";
+  {
+    SGDLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"V_dim", "0"},
+                   {"neg_sampling", ".25"},
+                   {"neg_sampling_weight", "0"},
+                   {"num_jobs_per_epoch", "1"},
+                   {"batch_size", "100"},
+                   {"max_num_epochs", "2"},
+                   {"model_out", model}};
+    learner.Init(args);
+    learner.Run();
+  }
+  std::vector<real_t> margins[2];
+  for (int k = 0; k < 2; ++k) {
+    Predictor predictor;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"model_in", model},
+                   {"pred_out", pred},
+                   {"pred_prob", "0"},
+                   {"neg_sampling", k ? ".25" : "1"}};
+    auto remain = predictor.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+    predictor.Run();
+    std::ifstream in(pred);
+    real_t p;
+    while (in >> p) margins[k].push_back(p);
+    remove(pred.c_str());
+  }
+  ASSERT_EQ(margins[0].size(), 100);
+  ASSERT_EQ(margins[1].size(), 100);
+  for (size_t i = 0; i < margins[0].size(); ++i) {
+    EXPECT_NEAR(margins[1][i] - margins[0][i], log(.25), 1e-4);
+  }
+  remove(model.c_str());
+}
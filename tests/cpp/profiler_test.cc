@@ -0,0 +1,95 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+// test the macros as if compiled with PROFILE=1
+#define DIFACTO_PROFILE 1
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+#include "common/perf_counters.h"
+#include "common/profiler.h"
+#include "reporter/profile_reporter.h"
+
+using namespace difacto;
+
+TEST(Profiler, Threads) {
+  auto begin = Profiler::Get()->Total();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.push_back(std::thread([]() {
+          for (int i = 0; i < 100; ++i) {
+            DIFACTO_PROFILE_SCOPE(kPull);
+            DIFACTO_PROFILE_COUNT(kPull, 10);
+          }
+        }));
+  }
+  for (auto& t : threads) t.join();
+  // the slots of the exited threads are kept
+  auto diff = Profiler::Get()->Total().Since(begin);
+  EXPECT_EQ(diff.calls[ProfileStats::kPull], 400);
+  EXPECT_EQ(diff.items[ProfileStats::kPull], 4000);
+  EXPECT_GE(diff.sec[ProfileStats::kPull], 0);
+  EXPECT_EQ(diff.calls[ProfileStats::kPush], 0);
+  EXPECT_FALSE(diff.Empty());
+
+  std::string str;
+  diff.SerializeToString(&str);
+  ProfileStats copy;
+  copy.ParseFromString(str);
+  copy.Merge(diff);
+  EXPECT_EQ(copy.items[ProfileStats::kPull], 8000);
+  EXPECT_TRUE(copy.Since(copy).Empty());
+}
+
+TEST(ProfileReporter, Local) {
+  ProfileReporter reporter;
+  reporter.Init(0);
+  reporter.Flush();
+  reporter.Take();
+
+  { DIFACTO_PROFILE_SCOPE(kUpdate); DIFACTO_PROFILE_COUNT(kUpdate, 3); }
+  reporter.Flush();
+  auto stats = reporter.Take();
+  EXPECT_EQ(stats.calls[ProfileStats::kUpdate], 1);
+  EXPECT_EQ(stats.items[ProfileStats::kUpdate], 3);
+  EXPECT_TRUE(reporter.Take().Empty());
+}
+
+TEST(PerfCounters, Read) {
+  const auto& counters = PerfCounters::ThisThread();
+  auto begin = counters.Read();
+  double sum = 0;
+  for (int i = 0; i < 1000000; ++i) sum += i * .5;
+  EXPECT_GT(sum, 0);
+  auto diff = counters.Read().Since(begin);
+  // not counted if perf events are restricted
+  if (counters.Available(PerfCounts::kInstructions)) {
+    EXPECT_GT(diff.count[PerfCounts::kInstructions], 1000000);
+  } else {
+    EXPECT_EQ(diff.count[PerfCounts::kInstructions], 0);
+  }
+  if (!counters.Available(PerfCounts::kCycles)) {
+    EXPECT_EQ(diff.IPC(), 0);
+  }
+}
+
+TEST(Profiler, Events) {
+  auto begin = Profiler::Get()->Total();
+  {
+    ProfileTimer timer(ProfileStats::kGrad, true);
+    Profiler::Get()->Add(ProfileStats::kGrad, 0, 0, 100);
+  }
+  PerfCounts counts;
+  counts.count[PerfCounts::kCycles] = 200;
+  counts.count[PerfCounts::kInstructions] = 300;
+  counts.count[PerfCounts::kLLCMisses] = 10;
+  Profiler::Get()->AddEvents(ProfileStats::kPredict, counts);
+  auto diff = Profiler::Get()->Total().Since(begin);
+  EXPECT_EQ(diff.calls[ProfileStats::kGrad], 1);
+  EXPECT_EQ(diff.events[PerfCounts::kCycles][ProfileStats::kPredict], 200);
+  EXPECT_EQ(diff.IPC(ProfileStats::kPredict), 1.5);
+  diff.sec[ProfileStats::kPredict] = 1e-6;
+  EXPECT_NEAR(diff.GBps(ProfileStats::kPredict), .64, 1e-6);
+  EXPECT_EQ(diff.IPC(ProfileStats::kPush), 0);
+  EXPECT_NE(diff.TextString().find("ipc"), std::string::npos);
+}
@@ -0,0 +1,103 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "dmlc/recordio.h"
+#include "reader/read_ahead_split.h"
+
+using namespace difacto;
+
+/** \brief two files of lines and their names, joined by ';' */
+static std::string WriteLines(std::vector<std::string>* lines) {
+  std::string uri;
+  for (int f = 0; f < 2; ++f) {
+    std::string name = "/tmp/difacto_read_ahead_" + std::to_string(getpid()) +
+                       "_" + std::to_string(f);
+    std::ofstream out(name);
+    for (int i = 0; i < 300; ++i) {
+      std::string line = std::to_string(f) + " " + std::string(i % 17, 'x') +
+                         std::to_string(i);
+      lines->push_back(line);
+      out << line;
+      // the last line of a file has no newline
+      if (i + 1 < 300) out << (i % 5 ? "\n" : "\r\n");
+    }
+    uri += (f ? ";" : "") + name;
+  }
+  return uri;
+}
+
+static void Remove(const std::string& uri) {
+  size_t pos = uri.find(';');
+  std::remove(uri.substr(0, pos).c_str());
+  std::remove(uri.substr(pos + 1).c_str());
+}
+
+TEST(ReadAheadSplit, Text) {
+  std::vector<std::string> lines;
+  auto uri = WriteLines(&lines);
+  for (int nparts : {1, 3}) {
+    std::vector<std::string> read;
+    for (int k = 0; k < nparts; ++k) {
+      ReadAheadSplit split(uri, k, nparts, false, 3, 100);
+      for (int epoch = 0; epoch < 2; ++epoch) {
+        dmlc::InputSplit::Blob rec;
+        size_t n = 0;
+        while (split.NextRecord(&rec)) {
+          std::string line(static_cast<char*>(rec.dptr), rec.size);
+          if (epoch == 0) read.push_back(line);
+          ++n;
+        }
+        split.BeforeFirst();
+      }
+    }
+    EXPECT_EQ(read, lines);
+  }
+  // a chunk is whole lines
+  ReadAheadSplit split(uri, 0, 1, false, 2, 100);
+  dmlc::InputSplit::Blob chunk;
+  size_t bytes = 0;
+  while (split.NextChunk(&chunk)) {
+    EXPECT_EQ(static_cast<char*>(chunk.dptr)[chunk.size - 1], '\n');
+    bytes += chunk.size;
+  }
+  EXPECT_GE(bytes, split.bytes_read());
+  Remove(uri);
+}
+
+TEST(ReadAheadSplit, RecordIO) {
+  std::string name = "/tmp/difacto_read_ahead_rec_" + std::to_string(getpid());
+  std::vector<std::string> recs;
+  {
+    std::unique_ptr<dmlc::Stream> fo(dmlc::Stream::Create(name.c_str(), "w"));
+    dmlc::RecordIOWriter writer(fo.get());
+    uint32_t magic = 0xced7230a;
+    for (int i = 0; i < 200; ++i) {
+      std::string rec(i % 37 + 1, 'a' + i % 26);
+      // the magic in a record is split by the writer
+      if (i % 7 == 0) rec += std::string(4 - rec.size() % 4, ' ') +
+                             std::string(reinterpret_cast<char*>(&magic), 4) +
+                             "tail";
+      writer.WriteRecord(rec);
+      recs.push_back(rec);
+    }
+  }
+  for (int nparts : {1, 4}) {
+    std::vector<std::string> read;
+    for (int k = 0; k < nparts; ++k) {
+      ReadAheadSplit split(name, k, nparts, true, 4, 128);
+      dmlc::InputSplit::Blob rec;
+      while (split.NextRecord(&rec)) {
+        read.push_back(std::string(static_cast<char*>(rec.dptr), rec.size));
+      }
+    }
+    EXPECT_EQ(read, recs);
+  }
+  std::remove(name.c_str());
+}
@@ -0,0 +1,27 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <vector>
+#include "common/reduce.h"
+
+using namespace difacto;
+
+TEST(Reduce, Sum) {
+  for (size_t n : {1, 1000, 100003}) {
+    for (int nparts : {1, 3, 8}) {
+      std::vector<std::vector<real_t>> arrs(5, std::vector<real_t>(n));
+      std::vector<real_t> sum(n, 0);
+      std::vector<real_t*> ptrs;
+      for (auto& a : arrs) {
+        for (size_t j = 0; j < n; ++j) {
+          a[j] = static_cast<real_t>(rand() % 100);
+          sum[j] += a[j];
+        }
+        ptrs.push_back(a.data());
+      }
+      Reduce(ptrs, n, nparts);
+      EXPECT_EQ(arrs[0], sum);
+    }
+  }
+}
@@ -0,0 +1,52 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include "./utils.h"
+#include "data/row_dedup.h"
+#include "loss/logit_loss.h"
+
+using namespace difacto;
+
+TEST(RowDedup, Merge) {
+  dmlc::data::RowBlockContainer<unsigned> rowblk, dup, merged;
+  std::vector<feaid_t> uidx;
+  load_data(&rowblk, &uidx);
+  // every row twice, the second copy with the indices reversed
+  auto blk = rowblk.GetBlock();
+  dup.Push(blk);
+  for (size_t i = 0; i < blk.size; ++i) {
+    dup.label.push_back(blk.label[i]);
+    for (size_t j = blk.offset[i+1]; j > blk.offset[i]; --j) {
+      dup.index.push_back(blk.index[j-1]);
+      if (blk.value) dup.value.push_back(blk.value[j-1]);
+    }
+    dup.offset.push_back(dup.index.size());
+  }
+  RowDedup dedup;
+  dedup.Dedup(dup.GetBlock(), &merged);
+  auto data = merged.GetBlock();
+  EXPECT_LE(data.size, blk.size);
+  real_t sum_w = 0;
+  for (size_t i = 0; i < data.size; ++i) {
+    EXPECT_GE(data.weight[i], 2);
+    sum_w += data.weight[i];
+  }
+  EXPECT_EQ(sum_w, 2 * blk.size);
+
+  // the weighted rows give the same gradients and metrics
+  size_t n = uidx.size();
+  SArray<real_t> w;
+  gen_vals(n, -1, 1, &w);
+  LogitLoss loss;
+  SArray<real_t> grad(n), grad2(n);
+  for (int k = 0; k < 2; ++k) {
+    auto d = k ? data : dup.GetBlock();
+    SArray<real_t> pred(d.size);
+    loss.Predict(d, {SArray<char>(w)}, nullptr, &pred);
+    loss.CalcGrad(d, {SArray<char>(pred)}, nullptr, k ? &grad2 : &grad);
+  }
+  for (size_t i = 0; i < n; ++i) {
+    EXPECT_NEAR(grad[i], grad2[i], 1e-4 * (1 + fabs(grad[i])));
+  }
+}
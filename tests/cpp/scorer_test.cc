@@ -0,0 +1,67 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include "difacto/scorer.h"
+#include "predict/predictor.h"
+#include "sgd/sgd_learner.h"
+
+using namespace difacto;
+
+TEST(Scorer, Predict) {
+  std::string model = "/tmp/difacto_scorer_test_model";
+  std::string pred = "/tmp/difacto_scorer_test_pred";
+  for (const char* V_dim : {"0", "2", "70"}) {
+    {
+      SGDLearner learner;
+      KWArgs args = {{"data_in", "../tests/data"},
+                     {"V_dim", V_dim},
+                     {"V_threshold", "2"},
+                     {"l1", "1"},
+                     {"lr", "1"},
+                     {"num_jobs_per_epoch", "1"},
+                     {"batch_size", "100"},
+                     {"max_num_epochs", "5"},
+                     {"model_out", model}};
+      learner.Init(args);
+      learner.Run();
+    }
+    // the margins by the predict task
+    {
+      Predictor predictor;
+      KWArgs args = {{"data_in", "../tests/data"},
+                     {"model_in", model},
+                     {"pred_out", pred},
+                     {"pred_prob", "0"}};
+      predictor.Init(args);
+      predictor.Run();
+    }
+    Scorer scorer;
+    EXPECT_FALSE(scorer.Load(model + "_not_exist"));
+    ASSERT_TRUE(scorer.Load(model));
+    EXPECT_EQ(scorer.V_dim(), atoi(V_dim));
+    EXPECT_GT(scorer.NumFeatures(), 0);
+
+    std::ifstream in(pred);
+    Reader reader("../tests/data", "libsvm", 0, 1, 1 << 20);
+    size_t nrows = 0;
+    while (reader.Next()) {
+      auto blk = reader.Value();
+      for (size_t i = 0; i < blk.size; ++i) {
+        size_t begin = blk.offset[i], nnz = blk.offset[i+1] - begin;
+        real_t p = scorer.Predict(blk.index + begin,
+                                  blk.value ? blk.value + begin : nullptr, nnz);
+        real_t expected;
+        ASSERT_TRUE(in >> expected);
+        EXPECT_NEAR(p, expected, 1e-4 * std::max(1.f, fabsf(expected)));
+        ++nrows;
+      }
+    }
+    EXPECT_EQ(nrows, 100);
+    remove(pred.c_str());
+    remove(model.c_str());
+  }
+}
@@ -2,12 +2,18 @@
  *  Copyright (c) 2015 by Contributors
  */
 #include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
 #include "sgd/sgd_learner.h"
 
 using namespace difacto;
 
-TEST(SGDLearner, Basic) {
-  std::vector<real_t> objv = {
+namespace {
+const std::vector<real_t> objv = {
     69.314718,
     69.314718,
     67.151912,
@@ -28,6 +34,9 @@ TEST(SGDLearner, Basic) {
     44.386417,
     44.240657,
     44.109764};
+}  // namespace
+
+TEST(SGDLearner, Basic) {
   SGDLearner learner;
   KWArgs args = {{"data_in", "../tests/data"},
                  {"V_dim", "0"},
@@ -40,10 +49,432 @@ TEST(SGDLearner, Basic) {
   auto remain = learner.Init(args);
   EXPECT_EQ(remain.size(), 0);
 
-  auto callback = [objv](
+  auto callback = [](
       int epoch, const sgd::Progress& train, const sgd::Progress& val) {
     EXPECT_LT(fabs(objv[epoch] - train.loss), 5e-5);
   };
   learner.AddEpochEndCallback(callback);
   learner.Run();
 }
+
+TEST(SGDLearner, Cache) {
+  // the later epochs read the cached data, which gives the same results. the
+  // last one spills most batches into files
+  std::vector<std::vector<std::string>> confs = {
+    {"16", "0", ""}, {"16", "1", ""},
+    {"0.001", "0", "/tmp/difacto_cache_test_"}};
+  for (const auto& conf : confs) {
+    SGDLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"V_dim", "0"},
+                   {"l2", "1"},
+                   {"l1", "1"},
+                   {"lr", "1"},
+                   {"num_jobs_per_epoch", "1"},
+                   {"batch_size", "100"},
+                   {"max_num_epochs", "20"},
+                   {"stop_rel_objv", "0"},
+                   {"data_cache_mb", conf[0]},
+                   {"data_cache_compress", conf[1]},
+                   {"data_cache_prefix", conf[2]}};
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+
+    int nepochs = 0;
+    auto callback = [&nepochs](
+        int epoch, const sgd::Progress& train, const sgd::Progress& val) {
+      EXPECT_LT(fabs(objv[epoch] - train.loss), 5e-5);
+      ++nepochs;
+    };
+    learner.AddEpochEndCallback(callback);
+    learner.Run();
+    EXPECT_EQ(static_cast<int>(objv.size()), nepochs);
+  }
+}
+
+TEST(SGDLearner, Hogwild) {
+  // the updates of the threads interleave, so only check it decreases
+  SGDLearner learner;
+  KWArgs args = {{"data_in", "../tests/data"},
+                 {"V_dim", "0"},
+                 {"l2", "1"},
+                 {"l1", "1"},
+                 {"lr", "1"},
+                 {"num_jobs_per_epoch", "1"},
+                 {"num_hogwild_threads", "4"},
+                 {"batch_size", "100"},
+                 {"max_num_epochs", "20"},
+                 {"stop_rel_objv", "0"}};
+  auto remain = learner.Init(args);
+  EXPECT_EQ(remain.size(), 0);
+
+  real_t nrows = 0, loss = 0;
+  auto callback = [&nrows, &loss](
+      int epoch, const sgd::Progress& train, const sgd::Progress& val) {
+    if (epoch == 0) nrows = train.nrows;
+    EXPECT_EQ(train.nrows, nrows);
+    EXPECT_GT(train.sec, 0);
+    loss = train.loss;
+  };
+  learner.AddEpochEndCallback(callback);
+  learner.Run();
+  EXPECT_GT(nrows, 0);
+  EXPECT_LT(loss, objv[0] * .9);
+}
+
+TEST(SGDLearner, Pipeline) {
+  // the stages overlap if max_delay > 0
+  SGDLearner learner;
+  KWArgs args = {{"data_in", "../tests/data"},
+                 {"V_dim", "0"},
+                 {"l2", "1"},
+                 {"l1", "1"},
+                 {"lr", "1"},
+                 {"num_jobs_per_epoch", "1"},
+                 {"num_localize_threads", "2"},
+                 {"num_pull_threads", "2"},
+                 {"num_compute_threads", "3"},
+                 {"num_push_threads", "2"},
+                 {"pipeline_queue_size", "2"},
+                 {"max_delay", "2"},
+                 {"batch_size", "100"},
+                 {"max_num_epochs", "20"},
+                 {"stop_rel_objv", "0"}};
+  auto remain = learner.Init(args);
+  EXPECT_EQ(remain.size(), 0);
+
+  real_t nrows = 0, loss = 0;
+  auto callback = [&nrows, &loss](
+      int epoch, const sgd::Progress& train, const sgd::Progress& val) {
+    if (epoch == 0) nrows = train.nrows;
+    EXPECT_EQ(train.nrows, nrows);
+    EXPECT_GT(train.busy_sec[sgd::Stage::kCompute], 0);
+    loss = train.loss;
+  };
+  learner.AddEpochEndCallback(callback);
+  learner.Run();
+  EXPECT_GT(nrows, 0);
+  EXPECT_LT(loss, objv[0] * .9);
+}
+
+TEST(SGDLearner, GradWindow) {
+  // 10 batches, every 4 of them pull a feature once and push the summed gradients once
+  for (const char* V_dim : {"0", "2"}) {
+    SGDLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"V_dim", V_dim},
+                   {"V_threshold", "2"},
+                   {"l2", "1"},
+                   {"l1", "1"},
+                   {"lr", "1"},
+                   {"num_jobs_per_epoch", "1"},
+                   {"grad_push_batches", "4"},
+                   {"batch_size", "10"},
+                   {"max_num_epochs", "20"},
+                   {"stop_rel_objv", "0"}};
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+
+    real_t loss = 0;
+    auto callback = [&loss](
+        int epoch, const sgd::Progress& train, const sgd::Progress& val) {
+      loss = train.loss;
+    };
+    learner.AddEpochEndCallback(callback);
+    learner.Run();
+    EXPECT_LT(loss, objv[0] * .9);
+  }
+}
+
+TEST(SGDLearner, HotCache) {
+  // the 20 most frequent features are pulled every 3 batches
+  for (const char* V_dim : {"0", "2"}) {
+    SGDLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"V_dim", V_dim},
+                   {"V_threshold", "2"},
+                   {"l2", "1"},
+                   {"l1", "1"},
+                   {"lr", "1"},
+                   {"num_jobs_per_epoch", "1"},
+                   {"hot_cache_size", "20"},
+                   {"hot_cache_refresh", "3"},
+                   {"batch_size", "10"},
+                   {"max_num_epochs", "20"},
+                   {"stop_rel_objv", "0"}};
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+
+    real_t loss = 0;
+    auto callback = [&loss](
+        int epoch, const sgd::Progress& train, const sgd::Progress& val) {
+      loss = train.loss;
+    };
+    learner.AddEpochEndCallback(callback);
+    learner.Run();
+    EXPECT_LT(loss, objv[0] * .9);
+  }
+}
+
+TEST(SGDLearner, Stream) {
+  // train the files as they arrive, and resume from the checkpoint
+  std::string dir = "/tmp/difacto_stream_test";
+  std::string model = "/tmp/difacto_stream_test_model";
+  mkdir(dir.c_str(), 0755);
+  auto add_file = [&dir](const std::string& name) {
+    std::ifstream in("../tests/data");
+    std::ofstream out(dir + "/" + name);
+    out << in.rdbuf();
+  };
+  auto run = [&dir, &model](std::vector<real_t>* losses) {
+    SGDLearner learner;
+    KWArgs args = {{"data_in", dir},
+                   {"model_out", model},
+                   {"stream", "1"},
+                   {"stream_poll_sec", "1"},
+                   {"stream_idle_sec", "1"},
+                   {"V_dim", "0"},
+                   {"l2", "1"},
+                   {"l1", "1"},
+                   {"lr", "1"},
+                   {"num_jobs_per_epoch", "1"},
+                   {"batch_size", "100"}};
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+    learner.AddEpochEndCallback([losses](
+        int epoch, const sgd::Progress& train, const sgd::Progress& val) {
+        losses->push_back(train.loss);
+      });
+    learner.Run();
+  };
+
+  add_file("part-0");
+  add_file("part-1");
+  // being written
+  add_file("_part-2");
+  std::vector<real_t> losses;
+  run(&losses);
+  ASSERT_EQ(losses.size(), 2);
+  EXPECT_LT(fabs(objv[0] - losses[0]), 5e-5);
+  EXPECT_LT(fabs(objv[1] - losses[1]), 5e-5);
+
+  // only the new file is trained, on the checkpointed model
+  rename((dir + "/_part-2").c_str(), (dir + "/part-2").c_str());
+  losses.clear();
+  run(&losses);
+  ASSERT_EQ(losses.size(), 1);
+  EXPECT_LT(fabs(objv[2] - losses[0]), 5e-5);
+
+  std::ifstream list(model + ".files");
+  std::string name;
+  int n = 0;
+  while (list >> name) EXPECT_EQ(name, "part-" + std::to_string(n++));
+  EXPECT_EQ(n, 3);
+
+  for (const char* f : {"part-0", "part-1", "part-2"}) {
+    remove((dir + "/" + f).c_str());
+  }
+  rmdir(dir.c_str());
+  remove(model.c_str());
+  remove((model + ".files").c_str());
+}
+
+TEST(SGDLearner, Sweep) {
+  // a model of the sweep has the same losses as it is trained alone
+  KWArgs base = {{"data_in", "../tests/data"},
+                 {"V_dim", "0"},
+                 {"l2", "1"},
+                 {"l1", "1"},
+                 {"lr", "1"},
+                 {"num_jobs_per_epoch", "1"},
+                 {"batch_size", "100"},
+                 {"max_num_epochs", "10"},
+                 {"stop_rel_objv", "0"}};
+  std::vector<real_t> alone;
+  {
+    SGDLearner learner;
+    KWArgs args = base;
+    args.push_back({"l1", ".1"});
+    args.push_back({"lr", ".5"});
+    learner.Init(args);
+    learner.AddEpochEndCallback([&alone](
+        int epoch, const sgd::Progress& train, const sgd::Progress& val) {
+        alone.push_back(train.loss);
+      });
+    learner.Run();
+  }
+
+  SGDLearner learner;
+  KWArgs args = base;
+  args.push_back({"sweep", "l1=.1,lr=.5;V_dim=2"});
+  auto remain = learner.Init(args);
+  EXPECT_EQ(remain.size(), 0);
+  ASSERT_EQ(learner.NumModels(), 3);
+  std::vector<std::vector<real_t>> losses(3);
+  learner.AddSweepEpochEndCallback([&losses](
+      int epoch, int model, const sgd::Progress& train,
+      const sgd::Progress& val) {
+      losses[model].push_back(train.loss);
+    });
+  learner.Run();
+  ASSERT_EQ(losses[0].size(), 10);
+  for (int k = 0; k < 10; ++k) {
+    EXPECT_LT(fabs(objv[k] - losses[0][k]), 5e-5);
+    EXPECT_LT(fabs(alone[k] - losses[1][k]), 5e-5);
+  }
+  EXPECT_NE(losses[2], losses[0]);
+}
+
+TEST(SGDLearner, AdaptPushBatches) {
+  // the loss always plateaus, so the batches pushed together are 1, 2, 4, 4
+  SGDLearner learner;
+  KWArgs args = {{"data_in", "../tests/data"},
+                 {"V_dim", "2"},
+                 {"V_lr", ".01"},
+                 {"l2", "1"},
+                 {"l1", "1"},
+                 {"lr", "1"},
+                 {"num_jobs_per_epoch", "1"},
+                 {"batch_size", "20"},
+                 {"max_num_epochs", "4"},
+                 {"stop_rel_objv", "0"},
+                 {"adapt_push_batches", "4"},
+                 {"adapt_rel_objv", "10"}};
+  auto remain = learner.Init(args);
+  EXPECT_EQ(remain.size(), 0);
+  std::vector<real_t> losses;
+  learner.AddEpochEndCallback([&losses](
+      int epoch, const sgd::Progress& train, const sgd::Progress& val) {
+      losses.push_back(train.loss);
+    });
+  learner.Run();
+  ASSERT_EQ(losses.size(), 4);
+  EXPECT_LT(losses[3], losses[0]);
+  EXPECT_NEAR(learner.GetUpdater()->param().V_lr, .02, 1e-6);
+}
+
+TEST(SGDLearner, ValAsync) {
+  // the validation of epoch k on a snapshot is reported after epoch k+1, and
+  // is the same as the one right after epoch k
+  auto run = [](const char* async, std::vector<real_t>* val_loss) {
+    SGDLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"data_val", "../tests/data"},
+                   {"V_dim", "2"},
+                   {"l1", "1"},
+                   {"lr", "1"},
+                   {"num_jobs_per_epoch", "1"},
+                   {"batch_size", "100"},
+                   {"max_num_epochs", "5"},
+                   {"stop_rel_objv", "0"},
+                   {"stop_val_auc", "-1"},
+                   {"val_async", async}};
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+    learner.AddEpochEndCallback([val_loss](
+        int epoch, const sgd::Progress& train, const sgd::Progress& val) {
+        val_loss->push_back(val.loss);
+      });
+    learner.Run();
+  };
+  std::vector<real_t> sync, async;
+  run("0", &sync);
+  run("1", &async);
+  ASSERT_EQ(sync.size(), 5);
+  ASSERT_EQ(async.size(), 5);
+  EXPECT_EQ(async[0], 0);
+  for (int k = 1; k < 5; ++k) {
+    EXPECT_GT(sync[k-1], 0);
+    EXPECT_LT(fabs(sync[k-1] - async[k]), 1e-4 * sync[k-1]);
+  }
+}
+
+TEST(SGDLearner, SampledValidation) {
+  // the AUC never improves by 1, so the first sampled validation stops it
+  SGDLearner learner;
+  KWArgs args = {{"data_in", "../tests/data"},
+                 {"data_val", "../tests/data"},
+                 {"V_dim", "0"},
+                 {"num_jobs_per_epoch", "1"},
+                 {"batch_size", "100"},
+                 {"max_num_epochs", "100000"},
+                 {"stop_rel_objv", "0"},
+                 {"stop_val_auc", "1"},
+                 {"val_interval_sec", ".05"},
+                 {"val_sample_rows", "200"}};
+  auto remain = learner.Init(args);
+  EXPECT_EQ(remain.size(), 0);
+  int nepochs = 0;
+  learner.AddEpochEndCallback([&nepochs](
+      int epoch, const sgd::Progress& train, const sgd::Progress& val) {
+      ++nepochs;
+    });
+  learner.Run();
+  EXPECT_LT(nepochs, 100000);
+}
+
+TEST(SGDLearner, ValCache) {
+  // the cached validation data gives the same results, without reading again
+  auto run = [](const char* cache, std::vector<sgd::Progress>* vals) {
+    SGDLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"data_val", "../tests/data"},
+                   {"V_dim", "2"},
+                   {"num_jobs_per_epoch", "1"},
+                   {"batch_size", "100"},
+                   {"max_num_epochs", "3"},
+                   {"stop_rel_objv", "0"},
+                   {"stop_val_auc", "-1"},
+                   {"val_cache_mb", cache}};
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+    learner.AddEpochEndCallback([vals](
+        int epoch, const sgd::Progress& train, const sgd::Progress& val) {
+        vals->push_back(val);
+      });
+    learner.Run();
+  };
+  std::vector<sgd::Progress> cached, uncached;
+  run("100", &cached);
+  run("0", &uncached);
+  ASSERT_EQ(cached.size(), 3);
+  ASSERT_EQ(uncached.size(), 3);
+  for (int k = 0; k < 3; ++k) {
+    EXPECT_EQ(cached[k].nrows, uncached[k].nrows);
+    EXPECT_NEAR(cached[k].loss, uncached[k].loss, 1e-4 * uncached[k].loss);
+    EXPECT_GT(uncached[k].parse_sec, 0);
+  }
+  EXPECT_GT(cached[0].parse_sec, 0);
+  EXPECT_EQ(cached[2].parse_sec, 0);
+}
+
+TEST(SGDLearner, DedupRows) {
+  // a batch of merged rows gives the same gradients, so the same model
+  auto run = [](const char* dedup, std::vector<sgd::Progress>* trains) {
+    SGDLearner learner;
+    KWArgs args = {{"data_in", "../tests/data"},
+                   {"V_dim", "2"},
+                   {"num_jobs_per_epoch", "1"},
+                   {"batch_size", "100"},
+                   {"max_num_epochs", "3"},
+                   {"stop_rel_objv", "0"},
+                   {"dedup_rows", dedup}};
+    auto remain = learner.Init(args);
+    EXPECT_EQ(remain.size(), 0);
+    learner.AddEpochEndCallback([trains](
+        int epoch, const sgd::Progress& train, const sgd::Progress& val) {
+        trains->push_back(train);
+      });
+    learner.Run();
+  };
+  std::vector<sgd::Progress> merged, raw;
+  run("1", &merged);
+  run("0", &raw);
+  ASSERT_EQ(merged.size(), 3);
+  ASSERT_EQ(raw.size(), 3);
+  for (int k = 0; k < 3; ++k) {
+    EXPECT_LE(merged[k].nrows, raw[k].nrows);
+    EXPECT_EQ(merged[k].metric.count, raw[k].metric.count);
+    EXPECT_NEAR(merged[k].loss, raw[k].loss, 1e-3 * raw[k].loss);
+  }
+}
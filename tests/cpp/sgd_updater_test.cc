@@ -0,0 +1,591 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "dmlc/memory_io.h"
+#include "sgd/sgd_updater.h"
+#include "sgd/sgd_kernels.h"
+#include "common/model_file.h"
+#include "common/model_saver.h"
+#include "difacto/store.h"
+#include "./utils.h"
+
+using namespace difacto;
+
+TEST(SGDUpdater, GetUpdate) {
+  SGDUpdater updater;
+  KWArgs args = {{"V_dim", "2"}, {"V_threshold", "0"},
+                 {"l1", "0"}, {"lr", "1"}, {"num_shards", "3"}};
+  auto remain = updater.Init(args);
+  EXPECT_EQ(remain.size(), 0);
+
+  SArray<uint32_t> key;
+  gen_keys(10000, 1000000, &key);
+  SArray<feaid_t> feaids(key.size());
+  for (size_t i = 0; i < key.size(); ++i) feaids[i] = ReverseBytes(key[i]);
+  size_t n = feaids.size();
+
+  updater.Update(feaids, Store::kFeaCount, SArray<real_t>(n, 1), {});
+  SArray<real_t> w;
+  SArray<int> len;
+  updater.Get(feaids, Store::kWeight, &w, &len);
+  EXPECT_EQ(w.size(), n);
+  EXPECT_EQ(len.size(), n);
+  EXPECT_EQ(norm1(w.data(), n), 0);
+
+  // w is updated by ftrl, and then V is allocated
+  SArray<real_t> grad;
+  gen_vals(n, -1, 1, &grad);
+  updater.Update(feaids, Store::kGradient, grad, {});
+  updater.Get(feaids, Store::kWeight, &w, &len);
+  EXPECT_EQ(w.size(), n * 3);
+  for (size_t i = 0; i < n; ++i) {
+    EXPECT_EQ(len[i], 3);
+    real_t g = grad[i];
+    EXPECT_LT(fabs(w[i*3] + g / (1 + fabs(g))), 1e-6);
+  }
+
+  size_t num_feas, num_bytes;
+  updater.MemUsage(&num_feas, &num_bytes);
+  EXPECT_EQ(num_feas, n);
+  EXPECT_GT(num_bytes, n * (sizeof(SGDEntry) + 4 * sizeof(real_t)));
+}
+
+TEST(SGDUpdater, AdaGradKernel) {
+  for (int n : {1, 7, 16, 37, 64}) {
+    SArray<real_t> g, V, cg;
+    gen_vals(n, -1, 1, &g);
+    gen_vals(n, -1, 1, &V);
+    gen_vals(n, 0, 1, &cg);
+    SArray<real_t> V2, cg2;
+    V2.CopyFrom(V); cg2.CopyFrom(cg);
+    sgd::AdaGradScalar(n, .1, 1, .01, g.data(), V.data(), cg.data());
+    sgd::AdaGrad(n, .1, 1, .01, g.data(), V2.data(), cg2.data());
+    EXPECT_EQ(memcmp(V.data(), V2.data(), n * sizeof(real_t)), 0);
+    EXPECT_EQ(memcmp(cg.data(), cg2.data(), n * sizeof(real_t)), 0);
+  }
+}
+
+TEST(SGDUpdater, SaveLoad) {
+  KWArgs args = {{"V_dim", "2"}, {"V_threshold", "0"}, {"l1", "0"}, {"lr", "1"}};
+  SGDUpdater updater;
+  updater.Init(args);
+
+  SArray<uint32_t> key;
+  gen_keys(1000, 100000, &key);
+  SArray<feaid_t> feaids(key.size());
+  for (size_t i = 0; i < key.size(); ++i) feaids[i] = key[i];
+  size_t n = feaids.size();
+  updater.Update(feaids, Store::kFeaCount, SArray<real_t>(n, 1), {});
+  SArray<real_t> grad;
+  gen_vals(n, -1, 1, &grad);
+  updater.Update(feaids, Store::kGradient, grad, {});
+  SArray<real_t> w, w2, w3;
+  SArray<int> len, len2, len3;
+  updater.Get(feaids, Store::kWeight, &w, &len);
+
+  std::string str;
+  std::unique_ptr<dmlc::Stream> fo(new dmlc::MemoryStringStream(&str));
+  updater.Save(true, fo.get());
+
+  SGDUpdater updater2;
+  updater2.Init(args);
+  std::unique_ptr<dmlc::Stream> fi(new dmlc::MemoryStringStream(&str));
+  bool has_aux = false;
+  updater2.Load(fi.get(), &has_aux);
+  EXPECT_TRUE(has_aux);
+  updater2.Get(feaids, Store::kWeight, &w2, &len2);
+  EXPECT_EQ(w2.size(), w.size());
+  EXPECT_EQ(memcmp(w.data(), w2.data(), w.size() * sizeof(real_t)), 0);
+  EXPECT_EQ(memcmp(len.data(), len2.data(), n * sizeof(int)), 0);
+
+  // mmap the same file
+  std::string filename = "/tmp/difacto_sgd_model_test";
+  {
+    std::unique_ptr<dmlc::Stream> f(dmlc::Stream::Create(filename.c_str(), "w"));
+    f->Write(str.data(), str.size());
+  }
+  ModelFile model;
+  EXPECT_TRUE(model.Map(filename));
+  EXPECT_EQ(model.V_dim, 2);
+  EXPECT_EQ(model.feaids.size(), n);
+  EXPECT_EQ(model.aux_w.size(), 3);
+  remove(filename.c_str());
+  for (size_t i = 0; i < n; ++i) {
+    EXPECT_EQ(model.feaids[i], feaids[i]);
+    EXPECT_EQ(model.w[i], w[i*3]);
+    EXPECT_EQ(model.GetV(i)[1], w[i*3+2]);
+  }
+}
+
+TEST(SGDUpdater, Snapshot) {
+  KWArgs args = {{"V_dim", "2"}, {"V_threshold", "0"}, {"l1", "0"}, {"lr", "1"}};
+  SGDUpdater updater;
+  updater.Init(args);
+
+  SArray<uint32_t> key;
+  gen_keys(1000, 100000, &key);
+  SArray<feaid_t> feaids(key.size());
+  for (size_t i = 0; i < key.size(); ++i) feaids[i] = key[i];
+  size_t n = feaids.size();
+  updater.Update(feaids, Store::kFeaCount, SArray<real_t>(n, 2), {});
+  SArray<real_t> grad, w, w2;
+  SArray<int> len, len2;
+  gen_vals(n, -1, 1, &grad);
+  updater.Update(feaids, Store::kGradient, grad, {});
+  updater.Get(feaids, Store::kWeight, &w, &len);
+
+  ModelFile snapshot;
+  updater.Snapshot(true, &snapshot);
+  // the training continues, which does not change the snapshot
+  updater.Update(feaids, Store::kGradient, grad, {});
+  ASSERT_EQ(snapshot.feaids.size(), n);
+  ASSERT_EQ(snapshot.aux_w.size(), 3);
+  for (size_t i = 0; i < n; ++i) {
+    EXPECT_EQ(snapshot.feaids[i], feaids[i]);
+    EXPECT_EQ(snapshot.w[i], w[i*3]);
+    EXPECT_EQ(snapshot.GetV(i)[1], w[i*3+2]);
+    EXPECT_EQ(snapshot.aux_w[0][i], 2);
+  }
+  EXPECT_NE(snapshot.aux_w[1].data(), snapshot.aux_w[2].data());
+
+  std::string filename = "/tmp/difacto_sgd_snapshot_test";
+  ModelSaver saver;
+  saver.SaveAsync(snapshot, filename);
+  saver.Wait();
+  // written into a temporary file, and then renamed
+  EXPECT_FALSE(std::ifstream(filename + ".tmp").good());
+  SGDUpdater updater2;
+  updater2.Init(args);
+  std::unique_ptr<dmlc::Stream> fi(dmlc::Stream::Create(filename.c_str(), "r"));
+  bool has_aux = false;
+  updater2.Load(fi.get(), &has_aux);
+  EXPECT_TRUE(has_aux);
+  remove(filename.c_str());
+  updater2.Get(feaids, Store::kWeight, &w2, &len2);
+  ASSERT_EQ(w2.size(), w.size());
+  EXPECT_EQ(memcmp(w.data(), w2.data(), w.size() * sizeof(real_t)), 0);
+}
+
+TEST(SGDUpdater, SnapshotWhileUpdating) {
+  KWArgs args = {{"V_dim", "0"}, {"l1", "0"}, {"lr", "1"}};
+  SGDUpdater updater;
+  updater.Init(args);
+
+  SArray<uint32_t> key;
+  gen_keys(1000, 100000, &key);
+  SArray<feaid_t> feaids(key.size());
+  for (size_t i = 0; i < key.size(); ++i) feaids[i] = key[i];
+  size_t n = feaids.size();
+  updater.Update(feaids, Store::kFeaCount, SArray<real_t>(n, 1), {});
+  SArray<real_t> grad;
+  gen_vals(n, -1, 1, &grad);
+
+  // a feature copied in the middle of an update has a w that does not match
+  // its z and sqrt_g
+  std::thread trainer([&]() {
+      for (int i = 0; i < 200; ++i) {
+        updater.Update(feaids, Store::kGradient, grad, {});
+      }
+    });
+  for (int k = 0; k < 20; ++k) {
+    ModelFile snapshot;
+    updater.Snapshot(true, &snapshot);
+    ASSERT_EQ(snapshot.feaids.size(), n);
+    ASSERT_EQ(snapshot.aux_w.size(), 3);
+    for (size_t i = 0; i < n; ++i) {
+      real_t sqrt_g = snapshot.aux_w[1][i], z = snapshot.aux_w[2][i];
+      EXPECT_NEAR(snapshot.w[i], z / (1 + sqrt_g), 1e-5);
+    }
+  }
+  trainer.join();
+}
+
+TEST(SGDUpdater, HalfStorage) {
+  KWArgs args = {{"V_dim", "16"}, {"V_threshold", "0"}, {"l1", "0"}, {"lr", "1"}};
+  SArray<uint32_t> key;
+  gen_keys(1000, 100000, &key);
+  SArray<feaid_t> feaids(key.size());
+  for (size_t i = 0; i < key.size(); ++i) feaids[i] = key[i];
+  size_t n = feaids.size();
+  SArray<int> lens(n, 17);
+  SArray<real_t> grad;
+  gen_vals(n * 17, -1, 1, &grad);
+
+  SArray<real_t> w[2];
+  SArray<int> len[2];
+  size_t num_feas[2], num_bytes[2];
+  for (int k = 0; k < 2; ++k) {
+    KWArgs kw = args;
+    if (k) {
+      kw.push_back(std::make_pair("V_storage", "bf16"));
+      kw.push_back(std::make_pair("V_aux_storage", "fp16"));
+    }
+    SGDUpdater updater;
+    updater.Init(kw);
+    updater.Update(feaids, Store::kFeaCount, SArray<real_t>(n, 1), {});
+    for (int t = 0; t < 3; ++t) {
+      SArray<real_t> g; g.CopyFrom(grad);
+      updater.Update(feaids, Store::kGradient, g, lens);
+    }
+    updater.Get(feaids, Store::kWeight, &w[k], &len[k]);
+    updater.MemUsage(&num_feas[k], &num_bytes[k]);
+  }
+  ASSERT_EQ(w[0].size(), w[1].size());
+  for (size_t i = 0; i < w[0].size(); ++i) {
+    EXPECT_LE(fabs(w[0][i] - w[1][i]), fabs(w[0][i]) * 1e-2 + 1e-4);
+  }
+  EXPECT_LT(num_bytes[1], num_bytes[0]);
+}
+
+TEST(SGDUpdater, MixedVDims) {
+  KWArgs args = {{"V_dim", "4"}, {"V_dims", "1:2,2:0"}, {"V_threshold", "0"},
+                 {"l1", "0"}, {"lr", "1"}};
+  SGDUpdater updater;
+  updater.Init(args);
+
+  // the features of group i % 3, whose V has length 4, 2 or 0
+  int dims[] = {4, 2, 0};
+  size_t n = 999;
+  SArray<feaid_t> feaids(n);
+  for (size_t i = 0; i < n; ++i) {
+    feaids[i] = ReverseBytes(EncodeFeaGrpID(i * 7 + 1, i % 3, 12));
+  }
+  std::sort(feaids.begin(), feaids.end());
+  for (size_t i = 0; i < n; ++i) {
+    int gid = DecodeFeaGrpID(ReverseBytes(feaids[i]), 12);
+    EXPECT_EQ(updater.VDim(feaids[i]), dims[gid]);
+  }
+  updater.Update(feaids, Store::kFeaCount, SArray<real_t>(n, 1), {});
+  SArray<real_t> grad;
+  gen_vals(n, -1, 1, &grad);
+  updater.Update(feaids, Store::kGradient, grad, {});
+
+  SArray<real_t> w, w2;
+  SArray<int> len, len2;
+  updater.Get(feaids, Store::kWeight, &w, &len);
+  size_t total = 0;
+  for (size_t i = 0; i < n; ++i) {
+    EXPECT_EQ(len[i], updater.VDim(feaids[i]) + 1);
+    total += len[i];
+  }
+  EXPECT_EQ(w.size(), total);
+
+  // the V gradients of the packed lengths
+  SArray<real_t> gV;
+  gen_vals(total, -1, 1, &gV);
+  updater.Update(feaids, Store::kGradient, gV, len);
+  updater.Get(feaids, Store::kWeight, &w, &len);
+
+  // saved with V padded to V_dim, and loaded back into the packed lengths
+  ModelFile model;
+  updater.Snapshot(false, &model);
+  EXPECT_EQ(model.V_dim, 4);
+  ASSERT_EQ(model.feaids.size(), n);
+  size_t p = 0;
+  for (size_t i = 0; i < n; ++i) {
+    real_t const* V = model.GetV(i);
+    int d = len[i] - 1;
+    ASSERT_EQ(V == nullptr, d == 0);
+    for (int j = 0; j < 4 && V; ++j) EXPECT_EQ(V[j], j < d ? w[p+1+j] : 0);
+    p += len[i];
+  }
+  std::string str;
+  std::unique_ptr<dmlc::Stream> fo(new dmlc::MemoryStringStream(&str));
+  updater.Save(true, fo.get());
+  SGDUpdater updater2;
+  updater2.Init(args);
+  std::unique_ptr<dmlc::Stream> fi(new dmlc::MemoryStringStream(&str));
+  updater2.Load(fi.get(), nullptr);
+  updater2.Get(feaids, Store::kWeight, &w2, &len2);
+  ASSERT_EQ(w2.size(), w.size());
+  EXPECT_EQ(memcmp(w.data(), w2.data(), w.size() * sizeof(real_t)), 0);
+  EXPECT_EQ(memcmp(len.data(), len2.data(), n * sizeof(int)), 0);
+}
+
+TEST(SGDUpdater, Hashed) {
+  KWArgs args = {{"V_dim", "2"}, {"V_threshold", "0"}, {"l1", "0"},
+                 {"lr", "1"}, {"hash_capacity", "500"},
+                 {"V_hash_capacity", "100"}};
+  SGDUpdater updater;
+  updater.Init(args);
+  size_t num_feas, num_bytes;
+  updater.MemUsage(&num_feas, &num_bytes);
+  EXPECT_EQ(num_feas, 500);
+
+  SArray<uint32_t> key;
+  gen_keys(2000, 100000, &key);
+  SArray<feaid_t> feaids(key.size());
+  for (size_t i = 0; i < key.size(); ++i) feaids[i] = key[i];
+  size_t n = feaids.size();
+  updater.Update(feaids, Store::kFeaCount, SArray<real_t>(n, 1), {});
+  SArray<real_t> grad;
+  gen_vals(n, -1, 1, &grad);
+  updater.Update(feaids, Store::kGradient, grad, {});
+
+  // the model does not grow, and the features in a slot share the weights
+  size_t num_bytes2;
+  updater.MemUsage(&num_feas, &num_bytes2);
+  EXPECT_EQ(num_bytes, num_bytes2);
+  SArray<real_t> w, w2;
+  SArray<int> len, len2;
+  updater.Get(feaids, Store::kWeight, &w, &len);
+  ASSERT_EQ(w.size(), n * 3);
+  // and the slots share the rows of V by slot % 100
+  std::vector<int> first(500, -1), first_row(100, -1);
+  for (size_t i = 0; i < n; ++i) {
+    int slot = ModelFile::HashSlot(feaids[i], 500);
+    if (first[slot] < 0) first[slot] = i;
+    if (first_row[slot % 100] < 0) first_row[slot % 100] = i;
+    EXPECT_EQ(w[i*3], w[first[slot]*3]);
+    EXPECT_EQ(w[i*3+1], w[first_row[slot % 100]*3+1]);
+  }
+
+  // the slots are saved, and then loaded back
+  std::string str;
+  std::unique_ptr<dmlc::Stream> fo(new dmlc::MemoryStringStream(&str));
+  updater.Save(true, fo.get());
+  std::unique_ptr<dmlc::Stream> fi(new dmlc::MemoryStringStream(&str));
+  ModelFile model;
+  model.Load(fi.get());
+  EXPECT_EQ(model.hash_capacity, 500);
+  EXPECT_LE(model.feaids.size(), 500);
+  SGDUpdater updater2;
+  updater2.Init(args);
+  fi.reset(new dmlc::MemoryStringStream(&str));
+  updater2.Load(fi.get(), nullptr);
+  updater2.Get(feaids, Store::kWeight, &w2, &len2);
+  ASSERT_EQ(w2.size(), w.size());
+  EXPECT_EQ(memcmp(w.data(), w2.data(), w.size() * sizeof(real_t)), 0);
+}
+
+TEST(SGDUpdater, HashedRows) {
+  SArray<uint32_t> key;
+  gen_keys(2000, 100000, &key);
+  SArray<feaid_t> feaids(key.size());
+  for (size_t i = 0; i < key.size(); ++i) feaids[i] = key[i];
+  size_t n = feaids.size();
+  // several hashes, and the quotient-remainder trick with 25 + 500 / 25 rows
+  for (auto conf : {std::make_pair("V_num_hashes", "3"),
+                    std::make_pair("V_hash_qr", "1")}) {
+    KWArgs args = {{"V_dim", "2"}, {"V_threshold", "0"}, {"l1", "0"},
+                   {"lr", "1"}, {"hash_capacity", "500"},
+                   {"V_hash_capacity", "25"}, {conf.first, conf.second}};
+    SGDUpdater updater;
+    updater.Init(args);
+    updater.Update(feaids, Store::kFeaCount, SArray<real_t>(n, 1), {});
+    // w gets V once non-zero, and then V is updated
+    SArray<real_t> grad, w, w2;
+    SArray<int> len, len2;
+    gen_vals(n, -1, 1, &grad);
+    updater.Update(feaids, Store::kGradient, grad, {});
+    updater.Get(feaids, Store::kWeight, &w, &len);
+    gen_vals(w.size(), -1, 1, &grad);
+    updater.Update(feaids, Store::kGradient, grad, len);
+
+    // the slots sharing the first row mostly have their own V
+    updater.Get(feaids, Store::kWeight, &w, &len);
+    ASSERT_EQ(w.size(), n * 3);
+    std::vector<int> first_row(25, -1);
+    int same = 0, diff = 0;
+    for (size_t i = 0; i < n; ++i) {
+      int slot = ModelFile::HashSlot(feaids[i], 500);
+      int& j = first_row[slot % 25];
+      if (j < 0) { j = i; continue; }
+      if (ModelFile::HashSlot(feaids[j], 500) == slot) continue;
+      if (w[i*3+1] == w[j*3+1]) ++same; else ++diff;
+    }
+    EXPECT_LT(same * 10, diff);
+
+    // the rows are saved after the slots, and then loaded back
+    std::string str;
+    std::unique_ptr<dmlc::Stream> fo(new dmlc::MemoryStringStream(&str));
+    updater.Save(true, fo.get());
+    std::unique_ptr<dmlc::Stream> fi(new dmlc::MemoryStringStream(&str));
+    ModelFile model;
+    model.Load(fi.get());
+    EXPECT_GT(model.feaids.back(), 500);
+    SGDUpdater updater2;
+    updater2.Init(args);
+    fi.reset(new dmlc::MemoryStringStream(&str));
+    updater2.Load(fi.get(), nullptr);
+    updater2.Get(feaids, Store::kWeight, &w2, &len2);
+    ASSERT_EQ(w2.size(), w.size());
+    EXPECT_EQ(memcmp(w.data(), w2.data(), w.size() * sizeof(real_t)), 0);
+  }
+}
+
+TEST(SGDModelShard, Erase) {
+  SGDModelShard shard;
+  SArray<uint32_t> key;
+  gen_keys(10000, 1000000, &key);
+  for (auto k : key) shard.Find(k)->w = k;
+  size_t n = key.size();
+  size_t bytes = shard.MemBytes();
+  for (size_t i = 0; i < n; i += 2) EXPECT_TRUE(shard.Erase(key[i]));
+  EXPECT_FALSE(shard.Erase(key[0]));
+  EXPECT_EQ(shard.size(), n / 2);
+  for (size_t i = 0; i < n; ++i) {
+    auto e = shard.Lookup(key[i]);
+    if (i % 2) {
+      ASSERT_TRUE(e != nullptr);
+      EXPECT_EQ(e->w, key[i]);
+    } else {
+      EXPECT_TRUE(e == nullptr);
+    }
+  }
+  // the erased entries are reused, and reset
+  shard.ReleaseErased();
+  for (size_t i = 0; i < n; i += 2) EXPECT_EQ(shard.Find(key[i])->w, 0);
+  EXPECT_EQ(shard.size(), n);
+  EXPECT_EQ(shard.MemBytes(), bytes);
+}
+
+TEST(SGDUpdater, Admit) {
+  KWArgs args = {{"V_dim", "2"}, {"V_threshold", "0"}, {"l1", "0"},
+                 {"lr", "1"}, {"admit_count", "3"}};
+  SGDUpdater updater;
+  updater.Init(args);
+  SArray<uint32_t> key;
+  gen_keys(1000, 100000, &key);
+  SArray<feaid_t> feaids(key.size());
+  for (size_t i = 0; i < key.size(); ++i) feaids[i] = key[i];
+  size_t n = feaids.size();
+
+  // seen twice, neither the pulls nor the pushes create the entries
+  updater.Update(feaids, Store::kFeaCount, SArray<real_t>(n, 1), {});
+  SArray<real_t> w, grad;
+  SArray<int> len;
+  updater.Get(feaids, Store::kWeight, &w, &len);
+  EXPECT_EQ(w.size(), n);
+  EXPECT_EQ(norm1(w.data(), n), 0);
+  gen_vals(n, -1, 1, &grad);
+  updater.Update(feaids, Store::kGradient, grad, {});
+  size_t num_feas, num_bytes, num_admitted, num_evicted;
+  updater.MemUsage(&num_feas, &num_bytes);
+  EXPECT_EQ(num_feas, 0);
+
+  // admitted at the third time
+  updater.Update(feaids, Store::kFeaCount, SArray<real_t>(n, 1), {});
+  updater.MemUsage(&num_feas, &num_bytes);
+  EXPECT_EQ(num_feas, n);
+  updater.AdmitStats(&num_admitted, &num_evicted);
+  EXPECT_EQ(num_admitted, n);
+  EXPECT_EQ(num_evicted, 0);
+  updater.Update(feaids, Store::kGradient, grad, {});
+  updater.Get(feaids, Store::kWeight, &w, &len);
+  EXPECT_EQ(w.size(), n * 3);
+}
+
+TEST(SGDUpdater, Evict) {
+  KWArgs args = {{"V_dim", "0"}, {"l1", "0"}, {"lr", "1"},
+                 {"evict_interval", "1"}, {"evict_count", "5"}};
+  SGDUpdater updater;
+  updater.Init(args);
+  SArray<uint32_t> key;
+  gen_keys(1000, 100000, &key);
+  SArray<feaid_t> feaids(key.size());
+  for (size_t i = 0; i < key.size(); ++i) feaids[i] = key[i];
+  size_t n = feaids.size();
+  updater.Update(feaids, Store::kFeaCount, SArray<real_t>(n, 1), {});
+
+  // the second half keeps w = 0, so they are evicted after the push
+  SArray<real_t> grad;
+  gen_vals(n, -1, 1, &grad);
+  for (size_t i = n / 2; i < n; ++i) grad[i] = 0;
+  SArray<real_t> w;
+  SArray<int> len;
+  updater.Get(feaids, Store::kWeight, &w, &len);
+  updater.Update(feaids, Store::kGradient, grad, {});
+  size_t num_feas, num_bytes, num_admitted, num_evicted;
+  updater.MemUsage(&num_feas, &num_bytes);
+  EXPECT_EQ(num_feas, n / 2);
+  updater.AdmitStats(&num_admitted, &num_evicted);
+  EXPECT_EQ(num_admitted, n);
+  EXPECT_EQ(num_evicted, n - n / 2);
+  updater.Get(feaids, Store::kWeight, &w, &len);
+  for (size_t i = 0; i < n; ++i) EXPECT_EQ(w[i] == 0, i >= n / 2);
+}
+
+TEST(SGDUpdater, EvictConcurrent) {
+  // every push evicts, while the other threads admit and update their
+  // entries, which are idle until written
+  KWArgs args = {{"V_dim", "0"}, {"l1", "0"}, {"lr", "1"},
+                 {"evict_interval", "1"}, {"evict_count", "100"}};
+  SGDUpdater updater;
+  updater.Init(args);
+  int nt = 4;
+  std::vector<std::vector<SArray<feaid_t>>> feaids(nt);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < nt; ++t) {
+    threads.push_back(std::thread([&updater, &feaids, t]() {
+          for (int k = 0; k < 50; ++k) {
+            SArray<feaid_t> ids(100);
+            for (size_t i = 0; i < ids.size(); ++i) {
+              ids[i] = (t * 50 + k) * 100 + i;
+            }
+            updater.Update(ids, Store::kGradient,
+                           SArray<real_t>(ids.size(), 1), {});
+            feaids[t].push_back(ids);
+          }
+        }));
+  }
+  for (auto& th : threads) th.join();
+  // no update is lost in an evicted entry
+  for (const auto& batches : feaids) {
+    for (const auto& ids : batches) {
+      SArray<real_t> w;
+      SArray<int> len;
+      updater.Get(ids, Store::kWeight, &w, &len);
+      for (real_t v : w) ASSERT_NE(v, 0);
+    }
+  }
+  sgd::Progress prog;
+  updater.Evaluate(&prog);
+  EXPECT_EQ(prog.nnz_w, nt * 50 * 100);
+}
+
+TEST(SGDUpdater, Evaluate) {
+  // the penalty and nnz maintained by the updates are the same as the ones
+  // counted by loading the model
+  KWArgs args = {{"V_dim", "2"}, {"V_threshold", "0"}, {"l1", ".1"},
+                 {"l2", ".5"}, {"V_l2", ".3"}, {"lr", "1"}};
+  SGDUpdater updater;
+  updater.Init(args);
+  SArray<uint32_t> key;
+  gen_keys(1000, 100000, &key);
+  SArray<feaid_t> feaids(key.size());
+  for (size_t i = 0; i < key.size(); ++i) feaids[i] = key[i];
+  size_t n = feaids.size();
+  updater.Update(feaids, Store::kFeaCount, SArray<real_t>(n, 1), {});
+  for (int k = 0; k < 5; ++k) {
+    SArray<real_t> w;
+    SArray<int> len;
+    updater.Get(feaids, Store::kWeight, &w, &len);
+    SArray<real_t> grad;
+    gen_vals(w.size(), -1, 1, &grad);
+    updater.Update(feaids, Store::kGradient, grad, len);
+  }
+  sgd::Progress prog;
+  updater.Evaluate(&prog);
+  EXPECT_GT(prog.nnz_w, n);
+  EXPECT_GT(prog.penalty, 0);
+
+  std::string str;
+  dmlc::MemoryStringStream fo(&str);
+  updater.Save(true, &fo);
+  SGDUpdater loaded;
+  loaded.Init(args);
+  dmlc::MemoryStringStream fi(&str);
+  loaded.Load(&fi, nullptr);
+  sgd::Progress expected;
+  loaded.Evaluate(&expected);
+  EXPECT_EQ(prog.nnz_w, expected.nnz_w);
+  EXPECT_LT(fabs(prog.penalty - expected.penalty), 1e-4 * expected.penalty);
+}
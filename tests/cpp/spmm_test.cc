@@ -87,3 +87,41 @@ TEST(SpMM, TransTimesPosVec) {
   SpMV::TransTimes(D, x_val, &y_val, DEFAULT_NTHREADS, x_pos, y_pos);
   EXPECT_EQ(norm2(y_val), norm2(y_val2));
 }
+
+TEST(SpMM, TransTimesBuckets) {
+  load_data(&data, &uidx);
+  auto D = data.GetBlock();
+  SArray<real_t> x;
+  int k = 10;
+  gen_vals(D.size*k, -10, 10, &x);
+
+  SArray<real_t> y1(uidx.size()*k);
+  SArray<real_t> y2(uidx.size()*k);
+
+  test::SpMM::TransTimes(D, x, &y1);
+  SpMM::TransTimes(D, x, k, &y2, 4);
+  EXPECT_EQ(norm2(y1), norm2(y2));
+}
+
+TEST(SpMM, Specialized) {
+  load_data(&data, &uidx);
+  for (bool binary : {false, true}) {
+    auto D = data.GetBlock();
+    if (binary) D.value = nullptr;
+    for (int k : {8, 16, 32, 64}) {
+      SArray<real_t> x;
+      gen_vals(uidx.size()*k, -10, 10, &x);
+      SArray<real_t> y1(D.size*k);
+      SArray<real_t> y2(D.size*k);
+      test::SpMM::Times(D, x, &y1);
+      SpMM::Times(D, x, k, &y2);
+      EXPECT_EQ(norm2(y1), norm2(y2));
+
+      SArray<real_t> z1(uidx.size()*k);
+      SArray<real_t> z2(uidx.size()*k);
+      test::SpMM::TransTimes(D, y1, &z1);
+      SpMM::TransTimes(D, y1, k, &z2);
+      EXPECT_EQ(norm2(z1), norm2(z2));
+    }
+  }
+}
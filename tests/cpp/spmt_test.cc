@@ -28,3 +28,18 @@ TEST(SpMT, Transpose) {
   EXPECT_EQ(norm2(X.value, nnz),
             norm2(X3.value, nnz));
 }
+
+TEST(SpMT, TransposeThreads) {
+  dmlc::data::RowBlockContainer<unsigned> data;
+  std::vector<feaid_t> uidx;
+  load_data(&data, &uidx);
+
+  auto X = data.GetBlock();
+  dmlc::data::RowBlockContainer<unsigned> Y1, Y4;
+  SpMT::Transpose(X, &Y1, uidx.size(), 1);
+  SpMT::Transpose(X, &Y4, uidx.size(), 4);
+
+  EXPECT_EQ(Y1.offset, Y4.offset);
+  EXPECT_EQ(Y1.index, Y4.index);
+  EXPECT_EQ(Y1.value, Y4.value);
+}
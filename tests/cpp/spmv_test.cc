@@ -91,3 +91,26 @@ TEST(SpMV, TransTimesPos) {
   test::slice_vec(y_val, y_pos, &y2);
   EXPECT_EQ(norm2(y), norm2(y2));
 }
+
+TEST(SpMV, TransTimesBuckets) {
+  load_data(&data, &uidx);
+  auto D = data.GetBlock();
+  SArray<real_t> x;
+  gen_vals(D.size, -10, 10, &x);
+  SArray<int> x_pos;
+  SArray<real_t> x_val;
+  test::gen_sliced_vec(x, &x_val, &x_pos);
+
+  SArray<real_t> y1(uidx.size());
+  SArray<real_t> y2(uidx.size());
+  test::SpMV::TransTimes(D, x, &y1);
+  SpMV::TransTimes(D, x, &y2, 4);
+  EXPECT_EQ(norm2(y1), norm2(y2));
+
+  SArray<int> y_pos;
+  SArray<real_t> y_val;
+  test::gen_sliced_vec(y2, &y_val, &y_pos);
+  memset(y_val.data(), 0, y_val.size()*sizeof(real_t));
+  SpMV::TransTimes(D, x_val, &y_val, 4, x_pos, y_pos);
+  EXPECT_EQ(norm2(y1), norm2(y_val));
+}
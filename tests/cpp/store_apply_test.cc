@@ -0,0 +1,61 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <mutex>
+#include <map>
+#include <vector>
+#include "store/store_apply.h"
+#include "./utils.h"
+
+using namespace difacto;
+
+TEST(ApplyEngine, SumByKey) {
+  // the applied values of each key, which are added up
+  std::mutex mu;
+  std::map<feaid_t, std::vector<real_t>> applied;
+  auto apply = [&mu, &applied](const SArray<feaid_t>& ids,
+                               const SArray<real_t>& vals,
+                               const SArray<int>& lens) {
+    std::lock_guard<std::mutex> lk(mu);
+    size_t p = 0;
+    for (size_t i = 0; i < ids.size(); ++i) {
+      int len = lens.empty() ? 1 : lens[i];
+      auto& v = applied[ids[i]];
+      if (v.size() < static_cast<size_t>(len)) v.resize(len, 0);
+      for (int j = 0; j < len; ++j) v[j] += vals[p + j];
+      p += len;
+    }
+  };
+  ApplyEngine engine;
+  engine.Start(4, 0, 1000, apply);
+
+  // pushes with lengths 1 or 3, and the expected sums
+  std::map<feaid_t, std::vector<real_t>> expected;
+  int num_applied = 0;
+  std::mutex cnt_mu;
+  for (int k = 0; k < 20; ++k) {
+    SArray<feaid_t> ids;
+    SArray<real_t> vals;
+    SArray<int> lens;
+    for (feaid_t id = k % 7; id < 1000; id += 7 + k % 5) {
+      int len = id % 3 == 0 ? 3 : 1;
+      ids.push_back(id);
+      lens.push_back(len);
+      auto& v = expected[id];
+      if (v.size() < static_cast<size_t>(len)) v.resize(len, 0);
+      for (int j = 0; j < len; ++j) {
+        vals.push_back(id + j + k);
+        v[j] += id + j + k;
+      }
+    }
+    engine.Push(ids, vals, lens, [&cnt_mu, &num_applied]() {
+        std::lock_guard<std::mutex> lk(cnt_mu);
+        ++num_applied;
+      });
+  }
+  engine.Wait();
+  EXPECT_EQ(num_applied, 20);
+  EXPECT_EQ(applied, expected);
+  engine.Stop();
+}
@@ -0,0 +1,161 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include "store/store_codec.h"
+#include "common/mem_tracker.h"
+#include "./utils.h"
+
+using namespace difacto;
+
+TEST(StoreCodec, Float16) {
+  for (real_t x : {0.f, 1.f, -2.5f, 1e-3f, 65504.f, 1e-6f, -3.14159f}) {
+    EXPECT_EQ(HalfToFloat(FloatToHalf(x)),
+              HalfToFloat(FloatToHalf(
+                  HalfToFloat(FloatToHalf(x)))));
+    EXPECT_LE(fabs(HalfToFloat(FloatToHalf(x)) - x),
+              fabs(x) * 1e-3 + 6e-8);
+    EXPECT_LE(fabs(BF16ToFloat(FloatToBF16(x)) - x),
+              fabs(x) * 4e-3);
+  }
+}
+
+TEST(StoreCodec, EncodeDecode) {
+  SArray<uint32_t> key;
+  gen_keys(1000, 1000000, &key);
+  size_t n = key.size();
+  SArray<feaid_t> keys(n);
+  SArray<int> lens(n);
+  for (size_t i = 0; i < n; ++i) {
+    keys[i] = key[i];
+    lens[i] = i % 3 ? 5 : 1;
+  }
+  SArray<real_t> vals;
+  gen_vals(sum(lens.data(), n), -1, 1, &vals);
+  // the V of the first feature with V is zero
+  for (int j = 1; j < 5; ++j) vals[1+j] = 0;
+
+  for (auto type : {StoreCodec::kNone, StoreCodec::kFP16, StoreCodec::kBF16,
+                    StoreCodec::kInt8, StoreCodec::k1Bit}) {
+    StoreCodec codec;
+    std::string str;
+    codec.Encode(type, false, true, n, keys.data(), vals.data(), lens.data(), 0, &str);
+    SArray<feaid_t> keys2;
+    SArray<real_t> vals2;
+    SArray<int> lens2;
+    EXPECT_EQ(StoreCodec::Decode(str.data(), str.size(), &keys2, &vals2, &lens2),
+              str.size());
+    EXPECT_EQ(memcmp(keys.data(), keys2.data(), n * sizeof(feaid_t)), 0);
+    EXPECT_EQ(memcmp(lens.data(), lens2.data(), n * sizeof(int)), 0);
+    ASSERT_EQ(vals2.size(), vals.size());
+    if (type == StoreCodec::kNone) {
+      EXPECT_EQ(memcmp(vals.data(), vals2.data(), vals.size() * sizeof(real_t)), 0);
+    } else if (type != StoreCodec::k1Bit) {
+      for (size_t i = 0; i < vals.size(); ++i) {
+        EXPECT_LT(fabs(vals[i] - vals2[i]), .01);
+      }
+    }
+    if (type == StoreCodec::kFP16) {
+      EXPECT_LT(str.size(), n * 3 + vals.size() * 2);
+    }
+  }
+
+  // skip the zero V
+  StoreCodec codec;
+  std::string str;
+  codec.Encode(StoreCodec::kNone, true, true, n, keys.data(), vals.data(), lens.data(), 0, &str);
+  SArray<feaid_t> keys2;
+  SArray<real_t> vals2;
+  SArray<int> lens2;
+  StoreCodec::Decode(str.data(), str.size(), &keys2, &vals2, &lens2);
+  EXPECT_EQ(lens2[1], 1);
+  EXPECT_EQ(vals2[1], vals[1]);
+  EXPECT_EQ(vals2[2], vals[6]);
+  EXPECT_EQ(vals2.size(), vals.size() - 4);
+  // without the ids
+  str.clear();
+  codec.Encode(StoreCodec::kNone, false, false, n, keys.data(), vals.data(), lens.data(), 0, &str);
+  EXPECT_EQ(StoreCodec::Decode(str.data(), str.size(), &keys2, &vals2, &lens2),
+            str.size());
+  EXPECT_TRUE(keys2.empty());
+  EXPECT_EQ(memcmp(vals.data(), vals2.data(), vals.size() * sizeof(real_t)), 0);
+
+  // two messages appended into the buffers reserved by Count
+  size_t num_lens, num_vals;
+  StoreCodec::Count(str.data(), str.size(), &num_lens, &num_vals);
+  EXPECT_EQ(num_lens, n);
+  EXPECT_EQ(num_vals, vals.size());
+  vals2.reserve(2 * num_vals); vals2.resize(0);
+  lens2.reserve(2 * num_lens); lens2.resize(0);
+  real_t* buf = vals2.data();
+  for (int t = 0; t < 2; ++t) {
+    StoreCodec::Decode(str.data(), str.size(), &keys2, &vals2, &lens2, true);
+  }
+  EXPECT_EQ(vals2.data(), buf);
+  ASSERT_EQ(vals2.size(), 2 * vals.size());
+  ASSERT_EQ(lens2.size(), 2 * n);
+  EXPECT_EQ(memcmp(vals.data(), vals2.data() + vals.size(),
+                   vals.size() * sizeof(real_t)), 0);
+  EXPECT_EQ(memcmp(lens.data(), lens2.data() + n, n * sizeof(int)), 0);
+}
+
+TEST(StoreCodec, ErrorFeedback) {
+  // the sum of the decoded values converges to the sum of the pushed ones
+  size_t n = 10;
+  SArray<feaid_t> keys(n);
+  for (size_t i = 0; i < n; ++i) keys[i] = i * 7;
+  SArray<real_t> vals;
+  gen_vals(n * 4, -1, 1, &vals);
+  for (auto type : {StoreCodec::kInt8, StoreCodec::k1Bit}) {
+    StoreCodec codec;
+    std::vector<double> total(vals.size(), 0);
+    int m = 200;
+    for (int t = 0; t < m; ++t) {
+      std::string str;
+      codec.Encode(type, false, true, n, keys.data(), vals.data(), nullptr, 4, &str);
+      SArray<feaid_t> keys2;
+      SArray<real_t> vals2;
+      SArray<int> lens2;
+      StoreCodec::Decode(str.data(), str.size(), &keys2, &vals2, &lens2);
+      for (size_t i = 0; i < vals.size(); ++i) total[i] += vals2[i];
+    }
+    for (size_t i = 0; i < vals.size(); ++i) {
+      EXPECT_LT(fabs(total[i] / m - vals[i]), .05);
+    }
+  }
+}
+
+TEST(StoreCodec, ResidualLimit) {
+  size_t n = 1000;
+  SArray<feaid_t> keys(n);
+  for (size_t i = 0; i < n; ++i) keys[i] = i * 7;
+  SArray<real_t> vals;
+  gen_vals(n * 4, -1, 1, &vals);
+  auto tracker = MemTracker::Get();
+  int64_t base = tracker->Bytes(MemTracker::kAux);
+  {
+    // the errors of all features need more than 16KB
+    StoreCodec codec;
+    codec.SetResidualLimit(16 << 10);
+    for (int t = 0; t < 3; ++t) {
+      std::string str;
+      codec.Encode(StoreCodec::kInt8, false, true, n, keys.data(),
+                   vals.data(), nullptr, 4, &str);
+      SArray<feaid_t> keys2;
+      SArray<real_t> vals2;
+      SArray<int> lens2;
+      EXPECT_EQ(StoreCodec::Decode(str.data(), str.size(), &keys2, &vals2,
+                                   &lens2), str.size());
+      ASSERT_EQ(vals2.size(), vals.size());
+      for (size_t i = 0; i < vals.size(); ++i) {
+        EXPECT_LT(fabs(vals[i] - vals2[i]), .02);
+      }
+    }
+    int64_t used = tracker->Bytes(MemTracker::kAux) - base;
+    EXPECT_GT(used, 0);
+    // plus the rows of the features not kept
+    EXPECT_LE(used,
+              static_cast<int64_t>((16 << 10) + 16 * 4 * sizeof(real_t)));
+  }
+  EXPECT_EQ(tracker->Bytes(MemTracker::kAux), base);
+}
@@ -0,0 +1,55 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "store/store_shm.h"
+
+using namespace difacto;
+
+TEST(ShmRing, WriteRelease) {
+  std::string name = "/difacto_test_" + std::to_string(getpid());
+  ShmRing writer, reader;
+  EXPECT_FALSE(reader.Open(name));
+  writer.Create(name, 1024);
+  ASSERT_TRUE(reader.Open(name));
+
+  // each message takes 64 bytes with its header
+  std::vector<int64_t> offsets;
+  for (int i = 0; i < 16; ++i) {
+    std::string msg = "msg" + std::to_string(i);
+    int64_t offset = writer.Write(msg.data(), msg.size() + 1);
+    ASSERT_GE(offset, 0);
+    EXPECT_EQ(std::string(reader.Read(offset)), msg);
+    offsets.push_back(offset);
+  }
+  EXPECT_EQ(writer.Write("full", 5), -1);
+
+  // the space is reused only once the oldest ones are released
+  reader.Release(offsets[1]);
+  EXPECT_EQ(writer.Write("full", 5), -1);
+  reader.Release(offsets[0]);
+  EXPECT_EQ(writer.used(), 14 * 64);
+
+  for (int i = 2; i < 16; ++i) reader.Release(offsets[i]);
+  EXPECT_EQ(writer.used(), 0);
+}
+
+TEST(ShmRing, Wrap) {
+  std::string name = "/difacto_test_wrap_" + std::to_string(getpid());
+  ShmRing writer, reader;
+  writer.Create(name, 1024);
+  ASSERT_TRUE(reader.Open(name));
+  for (int i = 0; i < 15; ++i) reader.Release(writer.Write("a", 1));
+  // no space for 128 bytes before the end, so it goes to the beginning
+  std::string big(100, 'x');
+  int64_t offset = writer.Write(big.data(), big.size());
+  ASSERT_GE(offset, 0);
+  EXPECT_LT(offset, 64);
+  EXPECT_EQ(std::string(reader.Read(offset), big.size()), big);
+  EXPECT_EQ(writer.used(), 128);
+  reader.Release(offset);
+  EXPECT_EQ(writer.used(), 0);
+}
@@ -0,0 +1,66 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <vector>
+#include "store/store_ssp.h"
+
+using namespace difacto;
+
+namespace {
+template <typename V>
+std::vector<V> Vec(const SArray<V>& a) {
+  return std::vector<V>(a.begin(), a.end());
+}
+}  // namespace
+
+TEST(SSPClocks, Ready) {
+  SSPClocks clocks;
+  clocks.Init(3);
+  int s = 2;
+  // an idle worker never waits, and is not waited for
+  EXPECT_TRUE(clocks.Ready(0, s));
+  for (int i = 0; i < 4; ++i) clocks.Advance(0);
+  EXPECT_EQ(clocks.Min(), 4);
+  clocks.Advance(1);
+  EXPECT_EQ(clocks.Min(), 1);
+  EXPECT_FALSE(clocks.Ready(0, s));
+  EXPECT_TRUE(clocks.Ready(1, s));
+  clocks.Advance(1);
+  EXPECT_TRUE(clocks.Ready(0, s));
+
+  // a finished worker restarts from 0
+  clocks.Reset(1);
+  EXPECT_EQ(clocks.Min(), 4);
+  EXPECT_EQ(clocks.Advance(1), 1);
+  EXPECT_FALSE(clocks.Ready(0, s));
+}
+
+TEST(SSPCache, GetPut) {
+  SSPCache cache;
+  cache.Init(4);
+  SArray<feaid_t> ids = {1, 3, 5};
+  SArray<real_t> vals = {1, 3, 3, 5};
+  SArray<int> lens = {1, 2, 1};
+  cache.Put(ids, vals, lens, 2, 0);
+
+  std::vector<bool> hit;
+  SArray<real_t> got;
+  SArray<int> got_lens;
+  SArray<feaid_t> missing;
+  cache.Get(SArray<feaid_t>({1, 2, 3}), 2, &hit, &got, &got_lens, &missing);
+  EXPECT_EQ(hit, std::vector<bool>({true, false, true}));
+  EXPECT_EQ(Vec(got), std::vector<real_t>({1, 3, 3}));
+  EXPECT_EQ(Vec(got_lens), std::vector<int>({1, 2}));
+  EXPECT_EQ(Vec(missing), std::vector<feaid_t>({2}));
+
+  // too stale
+  missing.clear();
+  cache.Get(ids, 3, &hit, &got, &got_lens, &missing);
+  EXPECT_EQ(Vec(missing), Vec(ids));
+
+  // full, so the stale ones are dropped
+  cache.Put(SArray<feaid_t>({7, 9}), SArray<real_t>({7, 9}), SArray<int>(),
+            4, 3);
+  EXPECT_EQ(cache.size(), 2);
+}
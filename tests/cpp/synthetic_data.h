@@ -0,0 +1,132 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef TESTS_CPP_SYNTHETIC_DATA_H_
+#define TESTS_CPP_SYNTHETIC_DATA_H_
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+#include "dmlc/logging.h"
+#include "difacto/base.h"
+#include "common/hash.h"
+namespace difacto {
+
+/**
+ * \brief a reproducible CTR-like data generator
+ *
+ * an example has nnz_per_row features over num_fields fields, the j-th
+ * feature is in field j % num_fields. within a field the rank r id is drawn
+ * with probability proportional to 1 / r^alpha among field_size ids. the
+ * feature ids encode the field in the lower 12 bits, as the criteo parser.
+ *
+ * the label is drawn from the sigmoid of a hidden model, either linear or a
+ * factorization machine with V_dim. the weights of the hidden model are
+ * hashed from the feature ids, so nothing is stored. the same config always
+ * gives the same data
+ */
+class SyntheticData {
+ public:
+  struct Config {
+    size_t nrows = 100000;
+    int nnz_per_row = 40;
+    int num_fields = 20;
+    size_t field_size = 1 << 16;
+    double alpha = 1.1;
+    /** \brief the hidden model, linear or fm */
+    std::string label = "linear";
+    int V_dim = 4;
+    /** \brief w is uniform in [-w_scale, w_scale], and so is V */
+    double w_scale = .5;
+    /** \brief the bias of the hidden model, a negative one gives a low CTR */
+    double bias = -1;
+    unsigned seed = 0;
+  };
+
+  explicit SyntheticData(const Config& cfg) : cfg_(cfg), rng_(cfg.seed) {
+    CHECK_GT(cfg.num_fields, 0);
+    CHECK_LT(cfg.num_fields, 1 << 12);
+    CHECK(cfg.label == "linear" || cfg.label == "fm")
+        << "unknown label model " << cfg.label;
+    cdf_.resize(cfg.field_size);
+    double sum = 0;
+    for (size_t r = 0; r < cfg.field_size; ++r) {
+      sum += 1 / std::pow(static_cast<double>(r + 1), cfg.alpha);
+      cdf_[r] = sum;
+    }
+  }
+
+  /**
+   * \brief generate the next example
+   *
+   * @param feaids the feature ids, sorted
+   * @param prob the probability of a positive label by the hidden model
+   * @return the label, 1 or -1
+   */
+  int Next(std::vector<feaid_t>* feaids, double* prob) {
+    std::uniform_real_distribution<double> uniform(0, cdf_.back());
+    feaids->clear();
+    for (int j = 0; j < cfg_.nnz_per_row; ++j) {
+      int field = j % cfg_.num_fields;
+      size_t r = std::lower_bound(cdf_.begin(), cdf_.end(), uniform(rng_)) -
+                 cdf_.begin();
+      feaid_t x = hash::Int(r * cfg_.num_fields + field + 1) >> 13;
+      feaids->push_back(EncodeFeaGrpID(x, field, 12));
+    }
+    std::sort(feaids->begin(), feaids->end());
+    feaids->erase(std::unique(feaids->begin(), feaids->end()), feaids->end());
+
+    double margin = cfg_.bias;
+    std::vector<double> sum_V(cfg_.label == "fm" ? cfg_.V_dim : 0, 0);
+    double sum_VV = 0;
+    for (feaid_t id : *feaids) {
+      margin += Hidden(id, 0);
+      for (size_t k = 0; k < sum_V.size(); ++k) {
+        double v = Hidden(id, k + 1);
+        sum_V[k] += v;
+        sum_VV += v * v;
+      }
+    }
+    for (double s : sum_V) margin += .5 * s * s;
+    margin -= .5 * sum_VV;
+    *prob = 1 / (1 + std::exp(-margin));
+    return std::uniform_real_distribution<double>(0, 1)(rng_) < *prob ? 1 : -1;
+  }
+
+  /**
+   * \brief write nrows examples into a libsvm file, returns the mean logloss
+   * of the hidden model, which is the best a learner can get
+   */
+  double WriteLibSVM(const std::string& filename) {
+    std::ofstream out(filename);
+    CHECK(out.good()) << "failed to open " << filename;
+    std::vector<feaid_t> feaids;
+    double logloss = 0, prob;
+    for (size_t i = 0; i < cfg_.nrows; ++i) {
+      int label = Next(&feaids, &prob);
+      logloss -= std::log(std::max(label > 0 ? prob : 1 - prob, 1e-15));
+      out << label;
+      for (feaid_t id : feaids) out << ' ' << id << ":1";
+      out << '\n';
+    }
+    return logloss / std::max(cfg_.nrows, static_cast<size_t>(1));
+  }
+
+ private:
+  /** \brief the k-th hidden weight of a feature, k = 0 is w */
+  double Hidden(feaid_t id, size_t k) const {
+    uint64_t h = hash::Int(id * 31 + k + cfg_.seed * 1000003ULL);
+    double u = static_cast<double>(h >> 11) / static_cast<double>(1ULL << 53);
+    return (2 * u - 1) * cfg_.w_scale;
+  }
+
+  Config cfg_;
+  std::mt19937_64 rng_;
+  /** \brief the unnormalized cdf of the ranks */
+  std::vector<double> cdf_;
+};
+
+}  // namespace difacto
+#endif  // TESTS_CPP_SYNTHETIC_DATA_H_
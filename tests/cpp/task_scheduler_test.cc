@@ -0,0 +1,119 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <atomic>
+#include <vector>
+#include "common/task_scheduler.h"
+
+using namespace difacto;
+
+TEST(TaskScheduler, TaskGroup) {
+  TaskScheduler sched(4);
+  std::atomic<int> sum{0};
+  TaskGroup group(0, &sched);
+  for (int i = 0; i < 1000; ++i) {
+    group.Run([&sum, &sched, i]() {
+        // spawn from a worker, which goes to its own deque
+        TaskGroup sub(0, &sched);
+        sub.Run([&sum, i]() { sum += i; });
+        sub.Run([&sum, i]() { sum += i; });
+      });
+  }
+  group.Wait();
+  EXPECT_EQ(sum, 999 * 1000);
+}
+
+TEST(TaskScheduler, WaitOwnGroup) {
+  // no worker, so the waiters run all tasks, and only those of their groups
+  TaskScheduler sched(0);
+  int a = 0, b = 0;
+  TaskGroup group_a(0, &sched), group_b(0, &sched);
+  for (int i = 0; i < 10; ++i) {
+    group_a.Run([&a]() { ++a; });
+    group_b.Run([&b]() { ++b; });
+  }
+  group_a.Wait();
+  EXPECT_EQ(a, 10);
+  EXPECT_EQ(b, 0);
+  group_b.Wait();
+  EXPECT_EQ(b, 10);
+}
+
+TEST(TaskScheduler, MaxPending) {
+  TaskScheduler sched(4);
+  std::atomic<int> running{0}, max_running{0};
+  TaskGroup group(2, &sched);
+  for (int i = 0; i < 100; ++i) {
+    group.Run([&running, &max_running]() {
+        int r = ++running;
+        int m = max_running;
+        while (r > m && !max_running.compare_exchange_weak(m, r)) { }
+        --running;
+      });
+  }
+  group.Wait();
+  EXPECT_LE(max_running, 2);
+}
+
+TEST(TaskScheduler, ParallelFor) {
+  for (int nt : {1, 3, 16}) {
+    for (int n : {0, 1, 10, 1000}) {
+      std::vector<int> cnt(n);
+      std::vector<int> tids(n, -1);
+      ParallelFor(n, nt, [&cnt, &tids, nt](int tid, int i) {
+          EXPECT_LT(tid, nt);
+          ++cnt[i];
+          tids[i] = tid;
+        });
+      for (int i = 0; i < n; ++i) {
+        EXPECT_EQ(cnt[i], 1);
+        EXPECT_GE(tids[i], 0);
+      }
+    }
+  }
+}
+
+TEST(TaskScheduler, Nested) {
+  // parallel kernels inside tasks, as the learners do
+  int nouter = 8, ninner = 4, n = 1000;
+  std::vector<std::vector<int>> res(nouter, std::vector<int>(n));
+  ParallelFor(nouter, nouter, [&res, ninner, n](int tid, int k) {
+      ParallelRun(ninner, [&res, k, n](int t, int nt) {
+          for (int i = t; i < n; i += nt) res[k][i] = k + i;
+        });
+    });
+  for (int k = 0; k < nouter; ++k) {
+    for (int i = 0; i < n; ++i) EXPECT_EQ(res[k][i], k + i);
+  }
+}
+
+TEST(TaskScheduler, ParallelForNodes) {
+  TaskScheduler sched(4, 2);
+  EXPECT_EQ(sched.NumNodes(), 2);
+  for (int begin : {0, 3}) {
+    for (int n : {0, 1, 7, 100}) {
+      std::vector<std::atomic<int>> cnt(begin + n);
+      for (auto& c : cnt) c = 0;
+      ParallelForNodes(begin, begin + n, 5, [&cnt](int tid, int i) {
+          EXPECT_LT(tid, 5);
+          ++cnt[i];
+        }, &sched);
+      for (int i = 0; i < begin + n; ++i) EXPECT_EQ(cnt[i], i >= begin);
+    }
+  }
+}
+
+TEST(TaskScheduler, ParseCpuList) {
+  std::vector<int> cpus = {0, 1, 2, 3, 8, 10, 11};
+  EXPECT_EQ(Numa::ParseCpuList("0-3,8,10-11\n"), cpus);
+  EXPECT_TRUE(Numa::ParseCpuList("").empty());
+  EXPECT_GE(Numa::Get().NumNodes(), 1);
+}
+
+TEST(TaskScheduler, PartitionThreads) {
+  EXPECT_EQ(PartitionThreads(32, 1), 32);
+  EXPECT_EQ(PartitionThreads(32, 8), 4);
+  EXPECT_EQ(PartitionThreads(32, 100), 1);
+  EXPECT_EQ(PartitionThreads(1, 4), 1);
+}
@@ -1,4 +1,5 @@
 GTEST_PATH = /usr
+BENCH_PATH = /usr
 
 CPPTEST_SRC = $(wildcard tests/cpp/*_test.cc)
 CPPTEST_OBJ = $(patsubst tests/cpp/%_test.cc, build/tests/%_test.o, $(CPPTEST_SRC))
@@ -12,7 +13,7 @@ build/difacto_tests: $(CPPTEST_OBJ) build/tests/main.o build/libdifacto.a $(DMLC
 	$(CXX) $(CFLAGS) -I$(GTEST_PATH)/include -o $@ $^ $(LDFLAGS) -L$(GTEST_PATH)/lib -lgtest
 
 CPPPERF_SRC = $(wildcard tests/cpp/*_perf.cc)
-CPPPERF = $(patsubst tests/cpp/%_perf.cc, build/%_perf, $(CPPTEST_SRC))
+CPPPERF = $(patsubst tests/cpp/%_perf.cc, build/%_perf, $(CPPPERF_SRC))
 
 
 build/%_perf : tests/cpp/%_perf.cc build/libdifacto.a $(DMLC_DEPS) ${DEPS}
@@ -20,3 +21,13 @@ build/%_perf : tests/cpp/%_perf.cc build/libdifacto.a $(DMLC_DEPS) ${DEPS}
 	$(CXX) -std=c++0x $(CFLAGS) -I$(GTEST_PATH)/include -o $@ $(filter %.cc %.a, $^) $(LDFLAGS)
 
 cpp-perf: $(CPPPERF)
+
+# the google benchmark suite, the results are saved in json by
+#   build/difacto_bench --benchmark_out=bench.json --benchmark_out_format=json
+CPPBENCH_SRC = $(wildcard tests/cpp/*_bench.cc)
+CPPBENCH_OBJ = $(patsubst tests/cpp/%_bench.cc, build/tests/%_bench.o, $(CPPBENCH_SRC))
+
+build/difacto_bench: $(CPPBENCH_OBJ) build/tests/bench_main.o build/libdifacto.a $(DMLC_DEPS)
+	$(CXX) $(CFLAGS) -I$(BENCH_PATH)/include -o $@ $^ $(LDFLAGS) -L$(BENCH_PATH)/lib -lbenchmark
+
+cpp-bench: build/difacto_bench
@@ -0,0 +1,48 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+#include "reader/text_tokenizer.h"
+
+using namespace difacto;
+
+TEST(TextTokenizer, FindChar) {
+  std::string str;
+  for (int i = 0; i < 100; ++i) {
+    str += std::string(i % 37, 'a') + (i % 3 ? "\t" : "\n");
+  }
+  char* begin = &str[0];
+  char* end = begin + str.size();
+  for (char* p = begin; p != end; ++p) {
+    char* q = p;
+    while (q != end && *q != '\t' && *q != '\n') ++q;
+    EXPECT_EQ(q, FindChar(p, end, '\t', '\n'));
+    q = p;
+    while (q != end && *q != '\n') ++q;
+    EXPECT_EQ(q, FindChar(p, end, '\n'));
+    size_t n = 0;
+    for (q = p; q != end; ++q) n += *q == '\t';
+    EXPECT_EQ(n, CountChar(p, end, '\t'));
+  }
+  EXPECT_EQ(end, FindChar(begin, end, 'b', 'c'));
+}
+
+TEST(TextTokenizer, SplitLines) {
+  std::string str;
+  for (int i = 0; i < 100; ++i) str += std::string(i % 13, 'a') + "\n";
+  char* begin = &str[0];
+  char* end = begin + str.size();
+  for (int n : {1, 2, 3, 8, 200}) {
+    std::vector<char*> bounds;
+    SplitLines(begin, end, n, &bounds);
+    ASSERT_EQ(bounds.size(), static_cast<size_t>(n + 1));
+    EXPECT_EQ(begin, bounds[0]);
+    EXPECT_EQ(end, bounds[n]);
+    for (int i = 1; i < n; ++i) {
+      EXPECT_LE(bounds[i-1], bounds[i]);
+      if (bounds[i] != end) EXPECT_EQ('\n', bounds[i][-1]);
+    }
+  }
+}
@@ -0,0 +1,53 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <gtest/gtest.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "dmlc/memory_io.h"
+#include "common/tracer.h"
+
+using namespace difacto;
+
+namespace {
+size_t Count(const std::string& str, const std::string& sub) {
+  size_t n = 0;
+  for (size_t p = str.find(sub); p != std::string::npos;
+       p = str.find(sub, p + 1)) ++n;
+  return n;
+}
+}  // namespace
+
+TEST(Tracer, RingBuffer) {
+  auto tracer = Tracer::Get();
+  tracer->Stop();
+  { DIFACTO_TRACE_SCOPE("off", "test"); }
+  EXPECT_EQ(tracer->AsyncBegin("off", "test"), 0);
+
+  tracer->Start(8);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 2; ++t) {
+    threads.push_back(std::thread([tracer]() {
+          for (int i = 0; i < 5; ++i) { DIFACTO_TRACE_SCOPE("span", "test"); }
+        }));
+  }
+  for (auto& t : threads) t.join();
+  bool called = false;
+  auto done = tracer->Async("async", "test", [&called]() { called = true; });
+  done();
+  EXPECT_TRUE(called);
+  tracer->Stop();
+  EXPECT_EQ(tracer->NumEvents(), 12);
+
+  std::string json;
+  dmlc::MemoryStringStream fo(&json);
+  tracer->Write(&fo);
+  // the oldest 4 events are dropped
+  EXPECT_NE(json.find("\"dropped\": 4"), std::string::npos);
+  EXPECT_EQ(Count(json, "\"ph\""), 8);
+  EXPECT_EQ(Count(json, "\"name\": \"off\""), 0);
+  EXPECT_EQ(Count(json, "\"name\": \"span\""), 6);
+  EXPECT_EQ(Count(json, "\"ph\": \"b\""), 1);
+  EXPECT_EQ(Count(json, "\"ph\": \"e\""), 1);
+}
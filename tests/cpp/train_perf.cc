@@ -0,0 +1,208 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include <sys/resource.h>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "./synthetic_data.h"
+#include "common/arg_parser.h"
+#include "dmlc/parameter.h"
+#include "dmlc/timer.h"
+#include "difacto/learner.h"
+#include "sgd/sgd_learner.h"
+#include "bcd/bcd_learner.h"
+#include "lbfgs/lbfgs_learner.h"
+
+using namespace difacto;
+
+/**
+ * \brief the end-to-end training throughput on synthetic CTR data
+ *
+ * usage: build/train_perf learner=sgd nrows=1000000 epochs=5 [kwargs]
+ *
+ * the data are generated into a libsvm file, then trained by the learner for
+ * a fixed number of epochs. it reports the examples/sec, the time until the
+ * training logloss reaches the target, the peak memory, and the time of the
+ * data generation, of the first epoch, which includes loading the data, and
+ * of the later ones. the unknown kwargs are passed to the learner
+ */
+struct TrainPerfParam : public dmlc::Parameter<TrainPerfParam> {
+  /** \brief the learner, sgd, bcd or lbfgs */
+  std::string learner;
+  /** \brief the file to generate the data into */
+  std::string data;
+  /** \brief the number of epochs */
+  int epochs;
+  /**
+   * \brief the training logloss to reach, 0 means 1.05 times the logloss of
+   * the hidden model
+   */
+  float target_logloss;
+  /** \brief write the report in json into it if not empty */
+  std::string report_out;
+  /** \brief the generator, see \ref SyntheticData::Config */
+  uint64_t nrows;
+  int nnz_per_row;
+  int num_fields;
+  uint64_t field_size;
+  float alpha;
+  std::string label;
+  int label_V_dim;
+  int seed;
+  DMLC_DECLARE_PARAMETER(TrainPerfParam) {
+    DMLC_DECLARE_FIELD(learner).set_default("sgd");
+    DMLC_DECLARE_FIELD(data).set_default("/tmp/difacto_train_perf");
+    DMLC_DECLARE_FIELD(epochs).set_default(5).set_lower_bound(1);
+    DMLC_DECLARE_FIELD(target_logloss).set_default(0);
+    DMLC_DECLARE_FIELD(report_out).set_default("");
+    DMLC_DECLARE_FIELD(nrows).set_default(1000000);
+    DMLC_DECLARE_FIELD(nnz_per_row).set_default(40);
+    DMLC_DECLARE_FIELD(num_fields).set_default(20);
+    DMLC_DECLARE_FIELD(field_size).set_default(1 << 16);
+    DMLC_DECLARE_FIELD(alpha).set_default(1.1);
+    DMLC_DECLARE_FIELD(label).set_default("linear");
+    DMLC_DECLARE_FIELD(label_V_dim).set_default(4);
+    DMLC_DECLARE_FIELD(seed).set_default(0);
+  }
+};
+
+DMLC_REGISTER_PARAMETER(TrainPerfParam);
+
+namespace {
+/** \brief the peak resident memory in MB */
+double PeakRSSMB() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss / 1024.0;  // ru_maxrss is in KB on linux
+}
+
+/** \brief add kv into kwargs if the key is absent */
+void SetDefault(const std::string& key, const std::string& value,
+                KWArgs* kwargs) {
+  for (const auto& kv : *kwargs) if (kv.first == key) return;
+  kwargs->push_back(std::make_pair(key, value));
+}
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  TrainPerfParam param;
+  if (argc < 2) {
+    LOG(ERROR) << "usage: train_perf key1=val1 key2=val2 ...\n\n"
+               << param.__DOC__();
+    return 0;
+  }
+  ArgParser parser;
+  for (int i = 1; i < argc; ++i) parser.AddArg(argv[i]);
+  KWArgs kwargs = param.InitAllowUnknown(parser.GetKWArgs());
+
+  // generate the data
+  SyntheticData::Config cfg;
+  cfg.nrows = param.nrows;
+  cfg.nnz_per_row = param.nnz_per_row;
+  cfg.num_fields = param.num_fields;
+  cfg.field_size = param.field_size;
+  cfg.alpha = param.alpha;
+  cfg.label = param.label;
+  cfg.V_dim = param.label_V_dim;
+  cfg.seed = param.seed;
+  double start = dmlc::GetTime();
+  double true_logloss = SyntheticData(cfg).WriteLibSVM(param.data);
+  double gen_sec = dmlc::GetTime() - start;
+  double target = param.target_logloss > 0 ?
+                  param.target_logloss : 1.05 * true_logloss;
+  LOG(INFO) << "generated " << param.nrows << " examples into " << param.data
+            << " in " << gen_sec << " sec, the logloss of the hidden model is "
+            << true_logloss;
+
+  // the learner
+  SetDefault("data_in", param.data, &kwargs);
+  SetDefault("max_num_epochs", std::to_string(param.epochs), &kwargs);
+  SetDefault("V_dim", "0", &kwargs);
+  if (param.learner == "sgd") SetDefault("batch_size", "1000", &kwargs);
+  if (param.learner != "bcd") SetDefault("stop_rel_objv", "0", &kwargs);
+  Learner* learner = Learner::Create(param.learner);
+  auto remain = learner->Init(kwargs);
+  for (const auto& kv : remain) {
+    LOG(WARNING) << "unknown kwarg " << kv.first << " = " << kv.second;
+  }
+
+  // record the logloss of every epoch
+  std::vector<double> epoch_end, logloss;
+  sgd::Progress sgd_prog;
+  auto record = [&](double loss) {
+    epoch_end.push_back(dmlc::GetTime());
+    logloss.push_back(loss);
+    LOG(INFO) << "epoch " << logloss.size() - 1 << ": logloss = " << loss
+              << ", " << epoch_end.back() - start << " sec";
+  };
+  if (auto sgd = dynamic_cast<SGDLearner*>(learner)) {
+    sgd->AddEpochEndCallback([&](
+        int epoch, const sgd::Progress& train, const sgd::Progress& val) {
+        sgd_prog.Merge(train);
+        record(train.loss / std::max(train.nrows, (real_t)1));
+      });
+  } else if (auto bcd = dynamic_cast<BCDLearner*>(learner)) {
+    bcd->AddEpochEndCallback([&](int epoch, const std::vector<real_t>& prog) {
+        record(prog[1] / std::max(prog[0], (real_t)1));
+      });
+  } else if (auto lbfgs = dynamic_cast<LBFGSLearner*>(learner)) {
+    // objv includes the penalty
+    lbfgs->AddEpochEndCallback([&](int epoch, const lbfgs::Progress& prog) {
+        record(prog.objv / param.nrows);
+      });
+  } else {
+    LOG(FATAL) << "unknown learner " << param.learner;
+  }
+
+  start = dmlc::GetTime();
+  learner->Run();
+  double train_sec = dmlc::GetTime() - start;
+  delete learner;
+  CHECK(!epoch_end.empty()) << "no epoch is finished";
+
+  size_t nepochs = epoch_end.size();
+  double first_sec = epoch_end[0] - start;
+  double later_sec = nepochs > 1 ?
+                     (epoch_end.back() - epoch_end[0]) / (nepochs - 1) : 0;
+  double target_sec = -1;
+  for (size_t i = 0; i < nepochs; ++i) {
+    if (logloss[i] <= target) {
+      target_sec = epoch_end[i] - start;
+      break;
+    }
+  }
+  double throughput = param.nrows * nepochs / train_sec;
+
+  LOG(INFO) << "learner = " << param.learner << ", " << nepochs << " epochs in "
+            << train_sec << " sec, " << throughput << " examples/sec";
+  LOG(INFO) << " - first epoch, with loading: " << first_sec
+            << " sec, later epochs: " << later_sec << " sec";
+  LOG(INFO) << " - logloss: " << logloss.back() << ", target: " << target
+            << ", reached in " << target_sec << " sec";
+  LOG(INFO) << " - peak memory: " << PeakRSSMB() << " MB";
+  if (param.learner == "sgd") {
+    LOG(INFO) << " - stages: " << sgd_prog.StageString();
+  }
+
+  if (param.report_out.size()) {
+    std::ofstream out(param.report_out);
+    CHECK(out.good()) << "failed to open " << param.report_out;
+    out << "{\"learner\": \"" << param.learner << "\""
+        << ", \"nrows\": " << param.nrows
+        << ", \"epochs\": " << nepochs
+        << ", \"gen_sec\": " << gen_sec
+        << ", \"train_sec\": " << train_sec
+        << ", \"first_epoch_sec\": " << first_sec
+        << ", \"later_epoch_sec\": " << later_sec
+        << ", \"examples_per_sec\": " << throughput
+        << ", \"true_logloss\": " << true_logloss
+        << ", \"target_logloss\": " << target
+        << ", \"final_logloss\": " << logloss.back()
+        << ", \"time_to_target_sec\": " << target_sec
+        << ", \"peak_rss_mb\": " << PeakRSSMB() << "}\n";
+  }
+  return 0;
+}